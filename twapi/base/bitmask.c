@@ -0,0 +1,619 @@
+/*
+ * Copyright (c) 2018, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ */
+
+/*
+ * Conversion between bitmasks and symbolic names. A symbol table,
+ * passed from script as a flat list of symbol value pairs, is compiled
+ * into a Tcl_ObjType internal rep the first time it is used so that
+ * subsequent conversions only involve hash lookups and bit operations.
+ * Since symbol tables are almost always literals or namespace variables,
+ * the compiled form is retained across calls.
+ */
+
+#include "twapi.h"
+#include "twapi_base.h"
+
+typedef struct _TwapiBitmaskSym {
+    Tcl_Obj *nameObj;
+    Tcl_WideInt value;
+    unsigned long hash;         /* Hash of case-folded name */
+    int name_len;
+} TwapiBitmaskSym;
+
+typedef struct _TwapiBitmaskSyms {
+    int nsyms;
+    unsigned int hash_mask;     /* Number of hash slots - 1 */
+    TwapiBitmaskSym syms[1];    /* Actually nsyms entries */
+    /* Followed by (hash_mask+1) ints containing index into syms[] */
+} TwapiBitmaskSyms;
+#define BITMASK_EMPTY_SLOT (-1)
+
+#define BITMASK_SYMS_ALLOC_SIZE(nsyms_, nslots_)                        \
+    (offsetof(TwapiBitmaskSyms, syms)                                   \
+     + ((nsyms_) * sizeof(TwapiBitmaskSym))                             \
+     + ((nslots_) * sizeof(int)))
+
+/* How unmatched bits are returned by TwapiBitmaskToSymbols */
+enum TwapiBitmaskUnknown {
+    BITMASK_UNKNOWN_NONE,       /* Not returned */
+    BITMASK_UNKNOWN_MASK,       /* As a single integer */
+    BITMASK_UNKNOWN_BITS,       /* Each bit as a separate hex value */
+};
+
+/* How symbols are matched by TwapiBitmaskToSymbols */
+enum TwapiBitmaskMatch {
+    BITMASK_MATCH_ANY,          /* Any bit in common */
+    BITMASK_MATCH_ALL,          /* All bits of symbol are set */
+    BITMASK_MATCH_CONSUME,      /* Any bit in common with bits not
+                                   already matched by a previous symbol */
+};
+
+static void DupBitmaskSyms(Tcl_Obj *srcP, Tcl_Obj *dstP);
+static void FreeBitmaskSyms(Tcl_Obj *objP);
+static void UpdateStringBitmaskSyms(Tcl_Obj *objP);
+
+static struct Tcl_ObjType gBitmaskSymsType = {
+    "TwapiBitmaskSyms",
+    FreeBitmaskSyms,
+    DupBitmaskSyms,
+    UpdateStringBitmaskSyms,
+    NULL,     /* jenglish says keep this NULL */
+};
+
+TWAPI_STATIC_INLINE int *TwapiBitmaskSymsSlots(TwapiBitmaskSyms *tabP)
+{
+    return (int *) &tabP->syms[tabP->nsyms];
+}
+
+/*
+ * FNV-1a hash of the ASCII case-folded name. Folding is done for all
+ * tables so the same table can be used for case sensitive and
+ * insensitive lookups.
+ */
+TWAPI_STATIC_INLINE unsigned long TwapiBitmaskHash(const char *p, int len)
+{
+    unsigned long hash = 2166136261U;
+    while (len--) {
+        unsigned char ch = (unsigned char) *p++;
+        if (ch >= 'A' && ch <= 'Z')
+            ch += 'a' - 'A';
+        hash ^= ch;
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+static int TwapiBitmaskNamesEqual(const char *a, const char *b, int len, int nocase)
+{
+    if (! nocase)
+        return memcmp(a, b, len) == 0;
+    while (len--) {
+        unsigned char cha = (unsigned char) *a++;
+        unsigned char chb = (unsigned char) *b++;
+        if (cha >= 'A' && cha <= 'Z')
+            cha += 'a' - 'A';
+        if (chb >= 'A' && chb <= 'Z')
+            chb += 'a' - 'A';
+        if (cha != chb)
+            return 0;
+    }
+    return 1;
+}
+
+/* Returns index of the symbol in table or -1 if not found */
+static int TwapiBitmaskLookup(TwapiBitmaskSyms *tabP, const char *name,
+                              int name_len, int nocase)
+{
+    unsigned long hash;
+    unsigned int slot;
+    int *slotsP;
+    TwapiBitmaskSym *symP;
+
+    hash = TwapiBitmaskHash(name, name_len);
+    slotsP = TwapiBitmaskSymsSlots(tabP);
+    for (slot = hash & tabP->hash_mask;
+         slotsP[slot] != BITMASK_EMPTY_SLOT;
+         slot = (slot + 1) & tabP->hash_mask) {
+        symP = &tabP->syms[slotsP[slot]];
+        if (symP->hash == hash &&
+            symP->name_len == name_len &&
+            TwapiBitmaskNamesEqual(ObjToString(symP->nameObj), name,
+                                   name_len, nocase))
+            return slotsP[slot];
+    }
+    return -1;
+}
+
+static void TwapiBitmaskSymsFree(TwapiBitmaskSyms *tabP)
+{
+    int i;
+    for (i = 0; i < tabP->nsyms; ++i) {
+        if (tabP->syms[i].nameObj)
+            ObjDecrRefs(tabP->syms[i].nameObj);
+    }
+    ckfree((char *) tabP);
+}
+
+/*
+ * Compiles a flat list of symbol value pairs. Returns NULL on error
+ * with an error message in interp.
+ */
+static TwapiBitmaskSyms *TwapiBitmaskSymsNew(Tcl_Interp *interp, int objc,
+                                             Tcl_Obj * const objv[])
+{
+    int i, nsyms;
+    unsigned int nslots, slot;
+    int *slotsP;
+    TwapiBitmaskSyms *tabP;
+
+    if (objc & 1) {
+        ObjSetStaticResult(interp, "Symbol table must have an even number of elements.");
+        Tcl_SetObjErrorCode(interp, Twapi_MakeTwapiErrorCodeObj(TWAPI_INVALID_ARGS));
+        return NULL;
+    }
+
+    nsyms = objc / 2;
+    for (nslots = 8; nslots < (unsigned int) (2*nsyms); nslots <<= 1)
+        ;
+    tabP = (TwapiBitmaskSyms *) ckalloc((int)BITMASK_SYMS_ALLOC_SIZE(nsyms, nslots));
+    tabP->nsyms = nsyms;
+    tabP->hash_mask = nslots - 1;
+    slotsP = TwapiBitmaskSymsSlots(tabP);
+    for (slot = 0; slot < nslots; ++slot)
+        slotsP[slot] = BITMASK_EMPTY_SLOT;
+    for (i = 0; i < nsyms; ++i)
+        tabP->syms[i].nameObj = NULL;
+
+    for (i = 0; i < nsyms; ++i) {
+        TwapiBitmaskSym *symP = &tabP->syms[i];
+        const char *name;
+
+        if (ObjToWideInt(interp, objv[2*i+1], &symP->value) != TCL_OK) {
+            TwapiBitmaskSymsFree(tabP);
+            return NULL;
+        }
+        symP->nameObj = objv[2*i];
+        ObjIncrRefs(symP->nameObj);
+        name = ObjToStringN(symP->nameObj, &symP->name_len);
+        symP->hash = TwapiBitmaskHash(name, symP->name_len);
+
+        /*
+         * Symbols are iterated in list order for mask to symbol
+         * conversion but for lookups by name, a later definition of a
+         * symbol replaces an earlier one (as array set would do).
+         */
+        for (slot = symP->hash & tabP->hash_mask;
+             slotsP[slot] != BITMASK_EMPTY_SLOT;
+             slot = (slot + 1) & tabP->hash_mask) {
+            TwapiBitmaskSym *prevP = &tabP->syms[slotsP[slot]];
+            if (prevP->hash == symP->hash &&
+                prevP->name_len == symP->name_len &&
+                ! memcmp(ObjToString(prevP->nameObj), name, symP->name_len))
+                break;
+        }
+        slotsP[slot] = i;
+    }
+
+    return tabP;
+}
+
+static void FreeBitmaskSyms(Tcl_Obj *objP)
+{
+    TwapiBitmaskSyms *tabP = objP->internalRep.ptrAndLongRep.ptr;
+    if (tabP)
+        TwapiBitmaskSymsFree(tabP);
+    objP->internalRep.ptrAndLongRep.ptr = NULL;
+    objP->typePtr = NULL;
+}
+
+static void DupBitmaskSyms(Tcl_Obj *srcP, Tcl_Obj *dstP)
+{
+    int i;
+    size_t sz;
+    TwapiBitmaskSyms *stabP = srcP->internalRep.ptrAndLongRep.ptr;
+    TwapiBitmaskSyms *dtabP;
+
+    sz = BITMASK_SYMS_ALLOC_SIZE(stabP->nsyms, stabP->hash_mask + 1);
+    dtabP = (TwapiBitmaskSyms *) ckalloc((int) sz);
+    CopyMemory(dtabP, stabP, sz);
+    for (i = 0; i < dtabP->nsyms; ++i)
+        ObjIncrRefs(dtabP->syms[i].nameObj);
+    dstP->internalRep.ptrAndLongRep.ptr = dtabP;
+    dstP->internalRep.ptrAndLongRep.value = 0;
+    dstP->typePtr = &gBitmaskSymsType;
+}
+
+static void UpdateStringBitmaskSyms(Tcl_Obj *objP)
+{
+    int i;
+    Tcl_Obj *listObj = ObjEmptyList();
+    TwapiBitmaskSyms *tabP = objP->internalRep.ptrAndLongRep.ptr;
+
+    for (i = 0; i < tabP->nsyms; ++i) {
+        ObjAppendElement(NULL, listObj, tabP->syms[i].nameObj);
+        ObjAppendElement(NULL, listObj, ObjFromWideInt(tabP->syms[i].value));
+    }
+    ObjToString(listObj);
+    objP->length = listObj->length;
+    objP->bytes = ckalloc(listObj->length + 1);
+    CopyMemory(objP->bytes, listObj->bytes, listObj->length+1);
+    ObjDecrRefs(listObj);
+}
+
+/*
+ * Returns the contents of the named array in the current call frame as
+ * a list with its reference count incremented. Returns NULL on error.
+ */
+static Tcl_Obj *TwapiArrayGet(Tcl_Interp *interp, Tcl_Obj *arrayNameObj)
+{
+    Tcl_Obj *cmdv[3];
+    Tcl_Obj *cmdObj;
+    Tcl_Obj *resultObj = NULL;
+
+    cmdv[0] = STRING_LITERAL_OBJ("array");
+    cmdv[1] = STRING_LITERAL_OBJ("get");
+    cmdv[2] = arrayNameObj;
+    cmdObj = ObjNewList(3, cmdv);
+    ObjIncrRefs(cmdObj);
+    if (Tcl_EvalObjEx(interp, cmdObj, 0) == TCL_OK) {
+        resultObj = ObjGetResult(interp);
+        ObjIncrRefs(resultObj);
+        Tcl_ResetResult(interp);
+    }
+    ObjDecrRefs(cmdObj);
+    return resultObj;
+}
+
+/*
+ * Returns the compiled symbol table for symvalsObj, converting its internal
+ * rep if necessary. If symvalsObj is a single element, it is treated as
+ * the name of an array (in the current call frame) containing the
+ * symbol table. In that case a temporary table is returned in *tempPP
+ * which the caller must free with TwapiBitmaskSymsFree.
+ */
+static TwapiBitmaskSyms *TwapiGetBitmaskSyms(Tcl_Interp *interp,
+                                             Tcl_Obj *symvalsObj,
+                                             TwapiBitmaskSyms **tempPP)
+{
+    Tcl_Obj **objv;
+    int objc;
+    TwapiBitmaskSyms *tabP;
+
+    *tempPP = NULL;
+    if (symvalsObj->typePtr == &gBitmaskSymsType)
+        return symvalsObj->internalRep.ptrAndLongRep.ptr;
+
+    if (ObjGetElements(interp, symvalsObj, &objc, &objv) != TCL_OK)
+        return NULL;
+
+    if (objc == 1) {
+        /* Array name. Not cached since array contents may change. */
+        Tcl_Obj *arrayObj = TwapiArrayGet(interp, objv[0]);
+        if (arrayObj == NULL)
+            return NULL;
+        if (ObjGetElements(interp, arrayObj, &objc, &objv) == TCL_OK)
+            *tempPP = TwapiBitmaskSymsNew(interp, objc, objv);
+        ObjDecrRefs(arrayObj);
+        return *tempPP;
+    }
+
+    tabP = TwapiBitmaskSymsNew(interp, objc, objv);
+    if (tabP == NULL)
+        return NULL;
+
+    /* Note string rep, if any, is retained as required for literals */
+    if (symvalsObj->typePtr && symvalsObj->typePtr->freeIntRepProc)
+        symvalsObj->typePtr->freeIntRepProc(symvalsObj);
+    symvalsObj->internalRep.ptrAndLongRep.ptr = tabP;
+    symvalsObj->internalRep.ptrAndLongRep.value = 0;
+    symvalsObj->typePtr = &gBitmaskSymsType;
+    return tabP;
+}
+
+/*
+ * Maps a list of symbols and integers to a bitmask. If errlabel is not
+ * NULL, it is used in the error message for invalid symbols.
+ */
+static TCL_RESULT TwapiSymbolsToBitmask(Tcl_Interp *interp,
+                                        TwapiBitmaskSyms *tabP,
+                                        Tcl_Obj *symsObj, int nocase,
+                                        const char *errlabel,
+                                        Tcl_WideInt *bitsP)
+{
+    Tcl_Obj **objv;
+    int i, objc, len, symindex;
+    const char *name;
+    Tcl_WideInt bits = 0, wide;
+
+    if (ObjGetElements(interp, symsObj, &objc, &objv) != TCL_OK)
+        return TCL_ERROR;
+
+    for (i = 0; i < objc; ++i) {
+        name = ObjToStringN(objv[i], &len);
+        symindex = TwapiBitmaskLookup(tabP, name, len, nocase);
+        if (symindex >= 0)
+            bits |= tabP->syms[symindex].value;
+        else if (ObjToWideInt(NULL, objv[i], &wide) == TCL_OK)
+            bits |= wide;
+        else {
+            ObjSetResult(interp,
+                         Tcl_ObjPrintf("Invalid %s '%s'",
+                                       errlabel ? errlabel : "symbol", name));
+            Tcl_SetObjErrorCode(interp, Twapi_MakeTwapiErrorCodeObj(TWAPI_INVALID_ARGS));
+            return TCL_ERROR;
+        }
+    }
+
+    *bitsP = bits;
+    return TCL_OK;
+}
+
+static Tcl_Obj *TwapiBitmaskToSymbols(TwapiBitmaskSyms *tabP,
+                                      Tcl_WideInt bits,
+                                      enum TwapiBitmaskMatch match,
+                                      enum TwapiBitmaskUnknown unknown)
+{
+    int i;
+    Tcl_WideInt symbits = 0;
+    Tcl_WideInt remaining = bits;
+    Tcl_Obj *resultObj = ObjNewList(0, NULL);
+
+    for (i = 0; i < tabP->nsyms; ++i) {
+        Tcl_WideInt value = tabP->syms[i].value;
+        switch (match) {
+        case BITMASK_MATCH_ANY:
+            if ((bits & value) == 0)
+                continue;
+            break;
+        case BITMASK_MATCH_ALL:
+            if ((bits & value) != value)
+                continue;
+            break;
+        case BITMASK_MATCH_CONSUME:
+            if ((remaining & value) == 0)
+                continue;
+            remaining &= ~value;
+            break;
+        }
+        symbits |= value;
+        ObjAppendElement(NULL, resultObj, tabP->syms[i].nameObj);
+    }
+
+    bits &= ~symbits;
+    switch (unknown) {
+    case BITMASK_UNKNOWN_NONE:
+        break;
+    case BITMASK_UNKNOWN_MASK:
+        if (bits)
+            ObjAppendElement(NULL, resultObj, ObjFromWideInt(bits));
+        break;
+    case BITMASK_UNKNOWN_BITS:
+        for (i = 0; i < 32; ++i) {
+            ULONG bit = 1UL << i;
+            if (bits & bit)
+                ObjAppendElement(NULL, resultObj, ObjFromULONGHex(bit));
+        }
+        break;
+    }
+
+    return resultObj;
+}
+
+/* _make_symbolic_bitmask BITS SYMVALS ?APPEND_UNKNOWN? */
+int Twapi_MakeSymbolicBitmaskObjCmd(
+    ClientData clientdata,
+    Tcl_Interp *interp,
+    int objc,
+    Tcl_Obj *CONST objv[])
+{
+    Tcl_WideInt bits;
+    int append_unknown = 1;
+    Tcl_Obj *symvalsObj, *appendObj;
+    TwapiBitmaskSyms *tabP, *tempP;
+
+    if (TwapiGetArgs(interp, objc-1, objv+1,
+                     GETWIDE(bits), GETOBJ(symvalsObj), ARGUSEDEFAULT,
+                     GETOBJ(appendObj), ARGEND) != TCL_OK)
+        return TCL_ERROR;
+    /* Note GETBOOL would default to 0, not 1 */
+    if (appendObj && ObjToBoolean(interp, appendObj, &append_unknown) != TCL_OK)
+        return TCL_ERROR;
+
+    tabP = TwapiGetBitmaskSyms(interp, symvalsObj, &tempP);
+    if (tabP == NULL)
+        return TCL_ERROR;
+    ObjSetResult(interp,
+                 TwapiBitmaskToSymbols(tabP, bits, BITMASK_MATCH_ANY,
+                                       append_unknown ? BITMASK_UNKNOWN_MASK : BITMASK_UNKNOWN_NONE));
+    if (tempP)
+        TwapiBitmaskSymsFree(tempP);
+    return TCL_OK;
+}
+
+/* _parse_symbolic_bitmask SYMS SYMVALS ?NOCASE? ?ERRLABEL? */
+int Twapi_ParseSymbolicBitmaskObjCmd(
+    ClientData clientdata,
+    Tcl_Interp *interp,
+    int objc,
+    Tcl_Obj *CONST objv[])
+{
+    Tcl_WideInt bits;
+    int nocase;
+    Tcl_Obj *symsObj, *symvalsObj, *errlabelObj;
+    TwapiBitmaskSyms *tabP, *tempP;
+    TCL_RESULT res;
+
+    if (TwapiGetArgs(interp, objc-1, objv+1,
+                     GETOBJ(symsObj), GETOBJ(symvalsObj), ARGUSEDEFAULT,
+                     GETBOOL(nocase), GETOBJ(errlabelObj), ARGEND) != TCL_OK)
+        return TCL_ERROR;
+
+    /*
+     * If the same object is passed for both, converting it to a list of
+     * symbols would free the symbol table while in use. Use a copy.
+     */
+    if (symsObj == symvalsObj)
+        symsObj = ObjDuplicate(symsObj);
+    ObjIncrRefs(symsObj);
+
+    tabP = TwapiGetBitmaskSyms(interp, symvalsObj, &tempP);
+    if (tabP == NULL)
+        res = TCL_ERROR;
+    else {
+        res = TwapiSymbolsToBitmask(interp, tabP, symsObj, nocase,
+                                    errlabelObj ? ObjToString(errlabelObj) : NULL,
+                                    &bits);
+        if (res == TCL_OK)
+            ObjSetResult(interp, ObjFromWideInt(bits));
+        if (tempP)
+            TwapiBitmaskSymsFree(tempP);
+    }
+    ObjDecrRefs(symsObj);
+    return res;
+}
+
+/* _switches_to_bitmask SWITCHES SYMVALS ?BITS? */
+int Twapi_SwitchesToBitmaskObjCmd(
+    ClientData clientdata,
+    Tcl_Interp *interp,
+    int objc,
+    Tcl_Obj *CONST objv[])
+{
+    Tcl_WideInt bits;
+    Tcl_Obj *switchesObj, *symvalsObj, *arrayObj = NULL;
+    Tcl_Obj **swv;
+    int i, swc, symindex, bval, len;
+    const char *name;
+    TwapiBitmaskSyms *tabP, *tempP = NULL;
+    TCL_RESULT res = TCL_ERROR;
+
+    if (TwapiGetArgs(interp, objc-1, objv+1,
+                     GETOBJ(switchesObj), GETOBJ(symvalsObj), ARGUSEDEFAULT,
+                     GETWIDE(bits), ARGEND) != TCL_OK)
+        return TCL_ERROR;
+
+    /*
+     * As for _parse_symbolic_bitmask, the switch list and symbol table
+     * must not share an object. The table is fetched only after the
+     * switches are retrieved since evaluating the array command may
+     * shimmer any object used as the array name.
+     */
+    if (switchesObj == symvalsObj)
+        switchesObj = ObjDuplicate(switchesObj);
+    ObjIncrRefs(switchesObj);
+
+    if (ObjGetElements(interp, switchesObj, &swc, &swv) != TCL_OK)
+        goto vamoose;
+    if (swc == 1) {
+        /* Name of an array of switch values */
+        arrayObj = TwapiArrayGet(interp, swv[0]);
+        if (arrayObj == NULL)
+            goto vamoose;
+        if (ObjGetElements(interp, arrayObj, &swc, &swv) != TCL_OK)
+            goto vamoose;
+    }
+    if (swc & 1) {
+        ObjSetStaticResult(interp, "Switch list must have an even number of elements.");
+        goto vamoose;
+    }
+
+    tabP = TwapiGetBitmaskSyms(interp, symvalsObj, &tempP);
+    if (tabP == NULL)
+        goto vamoose;
+
+    for (i = 0; i < swc; i += 2) {
+        name = ObjToStringN(swv[i], &len);
+        symindex = TwapiBitmaskLookup(tabP, name, len, 0);
+        if (symindex < 0) {
+            ObjSetResult(interp, Tcl_ObjPrintf("Invalid switch '%s'", name));
+            goto vamoose;
+        }
+        if (ObjToBoolean(interp, swv[i+1], &bval) != TCL_OK)
+            goto vamoose;
+        if (bval)
+            bits |= tabP->syms[symindex].value;
+        else
+            bits &= ~ tabP->syms[symindex].value;
+    }
+    res = ObjSetResult(interp, ObjFromWideInt(bits));
+
+vamoose:
+    if (arrayObj)
+        ObjDecrRefs(arrayObj);
+    ObjDecrRefs(switchesObj);
+    if (tempP)
+        TwapiBitmaskSymsFree(tempP);
+    return res;
+}
+
+/* _bitmask_to_switches BITS SYMVALS */
+int Twapi_BitmaskToSwitchesObjCmd(
+    ClientData clientdata,
+    Tcl_Interp *interp,
+    int objc,
+    Tcl_Obj *CONST objv[])
+{
+    Tcl_WideInt bits;
+    Tcl_Obj *symvalsObj, *resultObj;
+    int i;
+    TwapiBitmaskSyms *tabP, *tempP;
+
+    if (TwapiGetArgs(interp, objc-1, objv+1,
+                     GETWIDE(bits), GETOBJ(symvalsObj), ARGEND) != TCL_OK)
+        return TCL_ERROR;
+
+    tabP = TwapiGetBitmaskSyms(interp, symvalsObj, &tempP);
+    if (tabP == NULL)
+        return TCL_ERROR;
+
+    resultObj = ObjNewList(0, NULL);
+    for (i = 0; i < tabP->nsyms; ++i) {
+        ObjAppendElement(NULL, resultObj, tabP->syms[i].nameObj);
+        ObjAppendElement(NULL, resultObj,
+                         ObjFromBoolean((bits & tabP->syms[i].value) != 0));
+    }
+    if (tempP)
+        TwapiBitmaskSymsFree(tempP);
+    return ObjSetResult(interp, resultObj);
+}
+
+/* bitmask_to_symbols BITS SYMVALS ?any|all|consume? ?none|mask|bits? */
+int Twapi_BitmaskToSymbolsObjCmd(
+    ClientData clientdata,
+    Tcl_Interp *interp,
+    int objc,
+    Tcl_Obj *CONST objv[])
+{
+    static const char *matches[] = {"any", "all", "consume", NULL};
+    static const char *unknowns[] = {"none", "mask", "bits", NULL};
+    Tcl_WideInt bits;
+    Tcl_Obj *symvalsObj, *matchObj = NULL, *unknownObj = NULL;
+    int match = BITMASK_MATCH_ANY, unknown = BITMASK_UNKNOWN_MASK;
+    TwapiBitmaskSyms *tabP, *tempP;
+
+    if (TwapiGetArgs(interp, objc-1, objv+1,
+                     GETWIDE(bits), GETOBJ(symvalsObj), ARGUSEDEFAULT,
+                     GETOBJ(matchObj), GETOBJ(unknownObj), ARGEND) != TCL_OK)
+        return TCL_ERROR;
+
+    if (matchObj &&
+        Tcl_GetIndexFromObj(interp, matchObj, matches, "match type",
+                            TCL_EXACT, &match) != TCL_OK)
+        return TCL_ERROR;
+    if (unknownObj &&
+        Tcl_GetIndexFromObj(interp, unknownObj, unknowns, "unknown bits option",
+                            TCL_EXACT, &unknown) != TCL_OK)
+        return TCL_ERROR;
+
+    tabP = TwapiGetBitmaskSyms(interp, symvalsObj, &tempP);
+    if (tabP == NULL)
+        return TCL_ERROR;
+    ObjSetResult(interp, TwapiBitmaskToSymbols(tabP, bits, match, unknown));
+    if (tempP)
+        TwapiBitmaskSymsFree(tempP);
+    return TCL_OK;
+}
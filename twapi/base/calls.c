@@ -2451,6 +2451,11 @@ int Twapi_InitCalls(Tcl_Interp *interp, TwapiInterpContext *ticP)
     static struct tcl_dispatch_s TclDispatch[] = {
         DEFINE_TCL_CMD(Call, Twapi_CallObjCmd),
         DEFINE_TCL_CMD(parseargs, Twapi_ParseargsObjCmd),
+        DEFINE_TCL_CMD(_make_symbolic_bitmask, Twapi_MakeSymbolicBitmaskObjCmd),
+        DEFINE_TCL_CMD(_parse_symbolic_bitmask, Twapi_ParseSymbolicBitmaskObjCmd),
+        DEFINE_TCL_CMD(_switches_to_bitmask, Twapi_SwitchesToBitmaskObjCmd),
+        DEFINE_TCL_CMD(_bitmask_to_switches, Twapi_BitmaskToSwitchesObjCmd),
+        DEFINE_TCL_CMD(bitmask_to_symbols, Twapi_BitmaskToSymbolsObjCmd),
         DEFINE_TCL_CMD(trap, Twapi_TrapObjCmd),
         DEFINE_TCL_CMD(kl_get, Twapi_KlGetObjCmd),
         DEFINE_TCL_CMD(twine, Twapi_TwineObjCmd),
@@ -2459,6 +2464,10 @@ int Twapi_InitCalls(Tcl_Interp *interp, TwapiInterpContext *ticP)
         DEFINE_TCL_CMD(GetTwapiBuildInfo, Twapi_GetTwapiBuildInfo),
         DEFINE_TCL_CMD(Twapi_ReadMemory, Twapi_ReadMemoryObjCmd),
         DEFINE_TCL_CMD(Twapi_WriteMemory, Twapi_WriteMemoryObjCmd),
+        DEFINE_TCL_CMD(cstruct_decode, Twapi_CStructDecodeObjCmd),
+        DEFINE_TCL_CMD(cstruct_decode_pointer, Twapi_CStructDecodePointerObjCmd),
+        DEFINE_TCL_CMD(cstruct_view, Twapi_CStructViewObjCmd),
+        DEFINE_TCL_CMD(cstruct_view_pointer, Twapi_CStructViewPointerObjCmd),
         DEFINE_TCL_CMD(Twapi_InternalCast, Twapi_InternalCastObjCmd),
         DEFINE_TCL_CMD(tcltype, Twapi_GetTclTypeObjCmd),
         DEFINE_TCL_CMD(Twapi_EnumPrinters_Level4, Twapi_EnumPrintersLevel4ObjCmd),
@@ -472,6 +472,66 @@ error_return:
 }
 
 
+static TCL_RESULT ObjFromCStructHelper(Tcl_Interp *interp, void *pv, unsigned int nbytes, TwapiCStructRep *csP, DWORD flags, Tcl_Obj **objPP);
+
+/*
+ * Returns a Tcl_Obj for a single element of a field. pv points to the
+ * element, NOT the containing structure.
+ */
+static TCL_RESULT ObjFromCStructElem(Tcl_Interp *interp, void *pv, TwapiCStructField *fldP, DWORD flags, Tcl_Obj **objPP)
+{
+    switch (fldP->type) {
+    case CSTRUCT_BOOLEAN: *objPP = ObjFromBoolean(*(int *)pv); break;
+    case CSTRUCT_CHAR: *objPP = ObjFromInt(*(char *)pv); break;
+    case CSTRUCT_UCHAR: *objPP = ObjFromInt(*(unsigned char *)pv); break;
+    case CSTRUCT_SHORT: *objPP = ObjFromInt(*(short *)pv); break;
+    case CSTRUCT_USHORT: *objPP = ObjFromInt(*(unsigned short *)pv); break;
+    case CSTRUCT_INT: *objPP = ObjFromInt(*(int *)pv); break;
+    case CSTRUCT_UINT: *objPP = ObjFromWideInt(*(DWORD *)pv); break;
+    case CSTRUCT_INT64: *objPP = ObjFromWideInt(*(__int64 *)pv); break;
+    case CSTRUCT_UINT64: *objPP = ObjFromWideInt(*(__int64 *)pv); break; // TBD-handles unsigned ?
+    case CSTRUCT_DOUBLE: *objPP = ObjFromDouble(*(double *)pv); break;
+    case CSTRUCT_FLOAT: *objPP = ObjFromFloat(*(float *)pv); break;
+    case CSTRUCT_HANDLE: *objPP = ObjFromHANDLE(*(HANDLE *)pv); break;
+    case CSTRUCT_STRING: *objPP = ObjFromString(*(char **)pv); break;
+    case CSTRUCT_WSTRING: *objPP = ObjFromWinChars(*(WCHAR **)pv); break;
+    case CSTRUCT_CBSIZE: *objPP = ObjFromDWORD(*(DWORD *)pv); break;
+    case CSTRUCT_PSID:
+        return ObjFromSID(interp, *(PSID*)pv, objPP);
+    case CSTRUCT_STRUCT:
+        TWAPI_ASSERT(fldP->child);
+        return ObjFromCStructHelper(interp, pv, fldP->size, fldP->child, flags, objPP);
+    default:
+        return TwapiReturnErrorEx(interp, TWAPI_BUG, Tcl_ObjPrintf("Unknown Cstruct type %d", fldP->type));
+    }
+    return TCL_OK;
+}
+
+/*
+ * Returns a Tcl_Obj for a field, a list if the field is an array.
+ * pv points to the field.
+ */
+static TCL_RESULT ObjFromCStructField(Tcl_Interp *interp, void *pv, TwapiCStructField *fldP, DWORD flags, Tcl_Obj **objPP)
+{
+    Tcl_Obj *arrayObj;
+    Tcl_Obj *elemObj;
+    unsigned int j;
+
+    if (fldP->count == 0)
+        return ObjFromCStructElem(interp, pv, fldP, flags, objPP);
+
+    arrayObj = ObjNewList(fldP->count, NULL);
+    for (j = 0; j < fldP->count; j++, pv = ADDPTR(pv, fldP->size, void*)) {
+        if (ObjFromCStructElem(interp, pv, fldP, flags, &elemObj) != TCL_OK) {
+            ObjDecrRefs(arrayObj);
+            return TCL_ERROR;
+        }
+        ObjAppendElement(NULL, arrayObj, elemObj);
+    }
+    *objPP = arrayObj;
+    return TCL_OK;
+}
+
 static TCL_RESULT ObjFromCStructHelper(Tcl_Interp *interp, void *pv, unsigned int nbytes, TwapiCStructRep *csP, DWORD flags, Tcl_Obj **objPP)
 {
     Tcl_Obj *objs[2*32]; /* Assume no more than 32 fields in a struct */
@@ -500,88 +560,22 @@ static TCL_RESULT ObjFromCStructHelper(Tcl_Interp *interp, void *pv, unsigned in
     }
 
     for (i = 0, objindex = 0; i < csP->nfields; ++i) {
-        int count = csP->fields[i].count;
-        void *pv2 = ADDPTR(pv, csP->fields[i].offset, void*);
-        Tcl_Obj *arrayObj;
-        int j, elem_size;
-
-        elem_size = csP->fields[i].size;
-
-#define EXTRACT(type_, fn_)                                             \
-        do {                                                            \
-            if (include_key) objs[objindex++] = csP->fields[i].name;    \
-            if (count) {                                                \
-                arrayObj = ObjNewList(count, NULL);                     \
-                for (j = 0; j < count; j++, pv2 = ADDPTR(pv2, sizeof(type_), void*)) { \
-                    ObjAppendElement(NULL, arrayObj, (fn_)(*(type_ *)pv2)); \
-                }                                                       \
-                objs[objindex++] = arrayObj;                            \
-            } else {                                                    \
-                objs[objindex++] = (fn_)(*(type_ *)pv2);                \
-            }                                                           \
-        } while (0)
-        switch (csP->fields[i].type) {
-        case CSTRUCT_BOOLEAN: EXTRACT(int, ObjFromBoolean); break;
-        case CSTRUCT_CHAR: EXTRACT(char, ObjFromInt); break;
-        case CSTRUCT_UCHAR: EXTRACT(unsigned char, ObjFromInt); break;
-        case CSTRUCT_SHORT: EXTRACT(short, ObjFromInt); break;
-        case CSTRUCT_USHORT: EXTRACT(unsigned short, ObjFromInt); break;
-        case CSTRUCT_INT: EXTRACT(int, ObjFromInt); break;
-        case CSTRUCT_UINT: EXTRACT(DWORD, ObjFromWideInt); break;
-        case CSTRUCT_INT64: EXTRACT(__int64, ObjFromWideInt); break;
-        case CSTRUCT_UINT64: EXTRACT(__int64, ObjFromWideInt); break; // TBD-handles unsigned ?
-        case CSTRUCT_DOUBLE: EXTRACT(double, ObjFromDouble); break;
-        case CSTRUCT_FLOAT: EXTRACT(float, ObjFromFloat); break;
-        case CSTRUCT_HANDLE: EXTRACT(HANDLE, ObjFromHANDLE); break;
-        case CSTRUCT_STRING: EXTRACT(char*, ObjFromString); break;
-        case CSTRUCT_WSTRING: EXTRACT(WCHAR*, ObjFromWinChars); break;
-        case CSTRUCT_CBSIZE: EXTRACT(DWORD, ObjFromDWORD); break;
-        case CSTRUCT_PSID:
-            if (include_key) objs[objindex++] = csP->fields[i].name;
-            if (count) {
-                arrayObj = ObjNewList(count, NULL);
-                for (j = 0; j < count; j++, pv2 = ADDPTR(pv2, elem_size, void*)) {
-                    Tcl_Obj *elemObj;
-
-                    if (ObjFromSID(interp, *(PSID*)pv2, &elemObj) != TCL_OK) {
-                        ObjDecrRefs(arrayObj);
-                        goto error_return;
-                    }
-                    ObjAppendElement(NULL, arrayObj, elemObj);
-                }
-                objs[objindex++] = arrayObj;
-            } else {
-                if (ObjFromSID(interp, *(PSID*)pv2, &objs[objindex]) != TCL_OK)
-                    goto error_return;
-                objindex++;
+        if (csP->fields[i].type == CSTRUCT_VOID)
+            continue;           /* Only for function return types */
+        if (include_key)
+            objs[objindex++] = csP->fields[i].name;
+        if (ObjFromCStructField(interp,
+                                ADDPTR(pv, csP->fields[i].offset, void*),
+                                &csP->fields[i], flags,
+                                &objs[objindex]) != TCL_OK) {
+            /* Free up the values decoded so far. Keys are not ours. */
+            while (objindex--) {
+                if (!include_key || (objindex & 1))
+                    ObjDecrRefs(objs[objindex]);
             }
-            break;
-
-        case CSTRUCT_STRUCT:
-            if (include_key) objs[objindex++] = csP->fields[i].name;
-            if (count) {
-                arrayObj = ObjNewList(count, NULL);
-                for (j = 0; j < count; j++, pv2 = ADDPTR(pv2, elem_size, void*)) {
-                    Tcl_Obj *elemObj;
-                    if (ObjFromCStructHelper(interp, pv2, elem_size,
-                                             csP->fields[i].child, flags, &elemObj)
-                        != TCL_OK) {
-                        ObjDecrRefs(arrayObj);
-                        goto error_return;
-                    }
-                    ObjAppendElement(NULL, arrayObj, elemObj);
-                }
-                objs[objindex++] = arrayObj;
-            } else {
-                TWAPI_ASSERT(csP->fields[i].child);
-                if (ObjFromCStructHelper(interp, pv2, elem_size,
-                                         csP->fields[i].child, flags, &objs[objindex])
-                    != TCL_OK)
-                    goto error_return;
-                objindex++;
-            }
-            break;
+            goto error_return;
         }
+        objindex++;
     }
     
     *objPP = ObjNewList(objindex, objs);
@@ -609,6 +603,519 @@ TCL_RESULT ObjFromCStruct(Tcl_Interp *interp, void *pv, int nbytes, Tcl_Obj *csO
     return TCL_ERROR;
 }
 
+/*
+ * Decodes count consecutive instances of a cstruct starting at pv, each
+ * stride bytes apart (stride 0 means the packed struct size). The structure
+ * definition is parsed once and reused for all elements. The caller is
+ * responsible for ensuring the memory range is valid.
+ *
+ * With CSTRUCT_RETURN_RECORDARRAY the result is in recordarray form,
+ * i.e. a pair of field names and list of records. Else a list of
+ * records (dicts if CSTRUCT_RETURN_DICT is set).
+ */
+TCL_RESULT ObjFromCStructArray(Tcl_Interp *interp, void *pv, int count, int stride, Tcl_Obj *csObj, DWORD flags, Tcl_Obj **objPP)
+{
+    TwapiCStructRep *csP;
+    Tcl_Obj *listObj;
+    Tcl_Obj *objP;
+    int i;
+
+    if (ObjCastToCStruct(interp, csObj, 0) != TCL_OK)
+        return TCL_ERROR;
+    csP = CSTRUCT_REP(csObj);
+
+    if (count < 0)
+        return TwapiReturnErrorMsg(interp, TWAPI_INVALID_ARGS, "Negative cstruct array count");
+    if (stride == 0)
+        stride = csP->size;
+    else if (stride < 0 || (unsigned int) stride < csP->size)
+        return TwapiReturnErrorMsg(interp, TWAPI_INVALID_ARGS, "Stride is less than cstruct size");
+
+    if (flags & CSTRUCT_RETURN_RECORDARRAY)
+        flags &= ~CSTRUCT_RETURN_DICT; /* Field names go in the header */
+
+    /* Hold a reference so csObj shimmering in a nested call cannot free it */
+    csP->nrefs += 1;
+
+    listObj = ObjNewList(count, NULL);
+    for (i = 0; i < count; ++i, pv = ADDPTR(pv, stride, void*)) {
+        if (ObjFromCStructHelper(interp, pv, 0, csP, flags, &objP) != TCL_OK) {
+            ObjDecrRefs(listObj);
+            CStructRepDecrRefs(csP);
+            return TCL_ERROR;
+        }
+        ObjAppendElement(NULL, listObj, objP);
+    }
+
+    if (flags & CSTRUCT_RETURN_RECORDARRAY) {
+        Tcl_Obj *objs[2];
+        objs[0] = ObjNewList(csP->nfields, NULL);
+        for (i = 0; i < csP->nfields; ++i)
+            ObjAppendElement(NULL, objs[0], csP->fields[i].name);
+        objs[1] = listObj;
+        listObj = ObjNewList(2, objs);
+    }
+
+    CStructRepDecrRefs(csP);
+
+    if (objPP)
+        *objPP = listObj;
+    else
+        ObjSetResult(interp, listObj);
+    return TCL_OK;
+}
+
+/* Returns 1 if decoding the struct would dereference embedded pointers */
+static int CStructHasIndirections(TwapiCStructRep *csP)
+{
+    int i;
+    for (i = 0; i < csP->nfields; ++i) {
+        switch (csP->fields[i].type) {
+        case CSTRUCT_STRING:
+        case CSTRUCT_WSTRING:
+        case CSTRUCT_PSID:
+            return 1;
+        case CSTRUCT_STRUCT:
+            if (CStructHasIndirections(csP->fields[i].child))
+                return 1;
+            break;
+        }
+    }
+    return 0;
+}
+
+static TCL_RESULT CStructArrayFormatFlags(Tcl_Interp *interp, Tcl_Obj *formatObj, DWORD *flagsP)
+{
+    static const char *formats[] = {"list", "dict", "recordarray", NULL};
+    static DWORD format_flags[] = {0, CSTRUCT_RETURN_DICT, CSTRUCT_RETURN_RECORDARRAY};
+    int format;
+
+    if (formatObj == NULL) {
+        *flagsP = 0;
+        return TCL_OK;
+    }
+    if (Tcl_GetIndexFromObj(interp, formatObj, formats, "format", TCL_EXACT, &format) != TCL_OK)
+        return TCL_ERROR;
+    *flagsP = format_flags[format];
+    return TCL_OK;
+}
+
+/*
+ * Validates the layout of an array of cstructs within binary data of
+ * length len. *strideP is updated if 0 (packed), *countP is computed if
+ * countObj is NULL or negative.
+ */
+static TCL_RESULT CStructArrayExtent(Tcl_Interp *interp, TwapiCStructRep *csP, int len, Tcl_Obj *countObj, int offset, int *strideP, int *countP)
+{
+    int count, stride;
+
+    stride = *strideP;
+    if (stride == 0)
+        stride = csP->size;
+    else if (stride < 0 || (unsigned int) stride < csP->size)
+        return TwapiReturnErrorMsg(interp, TWAPI_INVALID_ARGS, "Stride is less than cstruct size");
+    if (offset < 0 || offset > len)
+        return TwapiReturnErrorMsg(interp, TWAPI_INVALID_ARGS, "Offset is outside binary data");
+
+    len -= offset;
+    if (countObj == NULL)
+        count = -1;
+    else if (ObjToInt(interp, countObj, &count) != TCL_OK)
+        return TCL_ERROR;
+    if (count < 0) {
+        /* Last element need not be padded out to the stride */
+        count = len < (int) csP->size ? 0 : 1 + (len - csP->size) / stride;
+    } else if (count > 0 &&
+               (len < (int) csP->size ||
+                (count - 1) > (len - (int) csP->size) / stride)) {
+        return TwapiReturnErrorMsg(interp, TWAPI_INVALID_ARGS, "Binary data too short for cstruct array");
+    }
+
+    *strideP = stride;
+    *countP = count;
+    return TCL_OK;
+}
+
+/*
+ * cstruct_decode CSTRUCTDEF BINDATA ?COUNT? ?STRIDE? ?OFFSET? ?FORMAT?
+ * Decodes an array of structs from a binary string. If COUNT is not
+ * specified or negative, decodes as many elements as fit in BINDATA.
+ * Since the data is not live memory, structs containing string or SID
+ * pointers are rejected.
+ */
+TCL_RESULT Twapi_CStructDecodeObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    Tcl_Obj *csObj, *countObj, *formatObj;
+    unsigned char *p;
+    int len, count, stride, offset;
+    DWORD flags;
+    TwapiCStructRep *csP;
+
+    countObj = NULL;
+    formatObj = NULL;
+    if (TwapiGetArgs(interp, objc-1, objv+1,
+                     GETOBJ(csObj), GETBA(p, len),
+                     ARGUSEDEFAULT, GETOBJ(countObj), GETINT(stride),
+                     GETINT(offset), GETOBJ(formatObj),
+                     ARGEND) != TCL_OK)
+        return TCL_ERROR;
+
+    if (ObjCastToCStruct(interp, csObj, 0) != TCL_OK ||
+        CStructArrayFormatFlags(interp, formatObj, &flags) != TCL_OK)
+        return TCL_ERROR;
+    csP = CSTRUCT_REP(csObj);
+
+    if (CStructHasIndirections(csP))
+        return TwapiReturnErrorMsg(interp, TWAPI_INVALID_ARGS, "Binary data cannot be decoded into cstructs containing string or SID fields");
+
+    if (CStructArrayExtent(interp, csP, len, countObj, offset, &stride, &count) != TCL_OK)
+        return TCL_ERROR;
+
+    return ObjFromCStructArray(interp, p + offset, count, stride, csObj, flags, NULL);
+}
+
+/*
+ * cstruct_decode_pointer CSTRUCTDEF POINTER COUNT ?STRIDE? ?FORMAT?
+ * Like cstruct_decode but reads from live memory. Caller has to ensure
+ * the memory range is valid.
+ */
+TCL_RESULT Twapi_CStructDecodePointerObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    Tcl_Obj *csObj, *formatObj;
+    void *pv;
+    int count, stride;
+    DWORD flags;
+
+    formatObj = NULL;
+    if (TwapiGetArgs(interp, objc-1, objv+1,
+                     GETOBJ(csObj), GETVOIDP(pv), GETINT(count),
+                     ARGUSEDEFAULT, GETINT(stride), GETOBJ(formatObj),
+                     ARGEND) != TCL_OK)
+        return TCL_ERROR;
+
+    if (CStructArrayFormatFlags(interp, formatObj, &flags) != TCL_OK)
+        return TCL_ERROR;
+
+    if (pv == NULL && count != 0)
+        return TwapiReturnError(interp, TWAPI_NULL_POINTER);
+
+    return ObjFromCStructArray(interp, pv, count, stride, csObj, flags, NULL);
+}
+
+
+/*
+ * Stores a value into a single element of a field. Only fixed size types
+ * can be written as there is no storage to which strings or SIDs could
+ * point.
+ */
+static TCL_RESULT ObjToCStructElem(Tcl_Interp *interp, Tcl_Obj *valObj, TwapiCStructField *fldP, void *pv)
+{
+    switch (fldP->type) {
+    case CSTRUCT_BOOLEAN: return ObjToBoolean(interp, valObj, (int *)pv);
+    case CSTRUCT_CHAR: return ObjToCHAR(interp, valObj, (CHAR *)pv);
+    case CSTRUCT_UCHAR: return ObjToUCHAR(interp, valObj, (UCHAR *)pv);
+    case CSTRUCT_SHORT: return ObjToSHORT(interp, valObj, (SHORT *)pv);
+    case CSTRUCT_USHORT: return ObjToUSHORT(interp, valObj, (WORD *)pv);
+    case CSTRUCT_INT: return ObjToLong(interp, valObj, (long *)pv);
+    case CSTRUCT_UINT: return ObjToLong(interp, valObj, (long *)pv); // TBD - handles unsigned ?
+    case CSTRUCT_CBSIZE: return ObjToInt(interp, valObj, (int *)pv);
+    case CSTRUCT_INT64: return ObjToWideInt(interp, valObj, (Tcl_WideInt *)pv);
+    case CSTRUCT_UINT64: return ObjToWideInt(interp, valObj, (Tcl_WideInt *)pv); // TBD-handles unsigned ?
+    case CSTRUCT_FLOAT: return ObjToFloat(interp, valObj, (float *)pv);
+    case CSTRUCT_DOUBLE: return ObjToDouble(interp, valObj, (double *)pv);
+    case CSTRUCT_HANDLE: return ObjToHANDLE(interp, valObj, (HANDLE *)pv);
+    default:
+        return TwapiReturnErrorMsg(interp, TWAPI_INVALID_ARGS, "Field type cannot be modified through a cstruct view");
+    }
+}
+
+/*
+ * Resolves a field path {NAME ?INDEX? NAME ?INDEX? ...} within the struct
+ * at pv. An INDEX selects an element of an array field. Every name but the
+ * last must refer to a nested struct (or element of a struct array).
+ * Returns the field descriptor and the address of the field or element.
+ * *wholeP is set to 1 if the path ends at an array field with no index.
+ */
+static TCL_RESULT CStructResolvePath(Tcl_Interp *interp, TwapiCStructRep *csP, void *pv, Tcl_Obj *pathObj, TwapiCStructField **fldPP, void **pvP, int *wholeP)
+{
+    Tcl_Obj **elems;
+    int i, j, nelems, whole;
+    TwapiCStructField *fldP;
+
+    if (ObjGetElements(interp, pathObj, &nelems, &elems) != TCL_OK)
+        return TCL_ERROR;
+    if (nelems == 0)
+        return TwapiReturnErrorMsg(interp, TWAPI_INVALID_ARGS, "Empty cstruct field path");
+
+    i = 0;
+    while (1) {
+        char *name;
+        int name_len;
+
+        name = ObjToStringN(elems[i], &name_len);
+        for (j = 0; j < csP->nfields; ++j) {
+            int field_len;
+            char *field_name = ObjToStringN(csP->fields[j].name, &field_len);
+            if (field_len == name_len && !memcmp(field_name, name, name_len))
+                break;
+        }
+        if (j == csP->nfields)
+            return TwapiReturnErrorEx(interp, TWAPI_INVALID_ARGS, Tcl_ObjPrintf("Unknown cstruct field '%s'", name));
+
+        fldP = &csP->fields[j];
+        pv = ADDPTR(pv, fldP->offset, void*);
+        whole = fldP->count != 0;
+        ++i;
+        if (whole && i < nelems) {
+            int index;
+            if (ObjToInt(interp, elems[i], &index) != TCL_OK)
+                return TCL_ERROR;
+            if (index < 0 || (unsigned int) index >= fldP->count)
+                return TwapiReturnErrorEx(interp, TWAPI_OUT_OF_RANGE, Tcl_ObjPrintf("Index %d out of range for cstruct field '%s'", index, name));
+            pv = ADDPTR(pv, index * fldP->size, void*);
+            whole = 0;
+            ++i;
+        }
+        if (i == nelems)
+            break;
+        if (fldP->type != CSTRUCT_STRUCT || whole)
+            return TwapiReturnErrorEx(interp, TWAPI_INVALID_ARGS, Tcl_ObjPrintf("Cstruct field '%s' is not a struct", name));
+        csP = fldP->child;
+    }
+
+    *fldPP = fldP;
+    *pvP = pv;
+    *wholeP = whole;
+    return TCL_OK;
+}
+
+/*
+ * A cstruct view overlays a cstruct layout on an array of structs held
+ * either in a Tcl byte array or in memory, and reads or writes individual
+ * fields in place without decoding the rest of the buffer. A byte array
+ * is copied on the first write if it is shared, like any other Tcl value.
+ */
+typedef struct TwapiCStructView_s {
+    TwapiCStructRep *csP;       /* Layout. A reference is held. */
+    Tcl_Obj *dataObj;           /* Byte array, NULL for memory views */
+    void *pv;                   /* Base address for memory views */
+    int offset;                 /* Offset of first element in dataObj */
+    int stride;                 /* Distance between elements */
+    int count;                  /* Number of elements */
+} TwapiCStructView;
+
+static void TwapiCStructViewDelete(ClientData clientdata)
+{
+    TwapiCStructView *viewP = (TwapiCStructView *) clientdata;
+    if (viewP->dataObj)
+        ObjDecrRefs(viewP->dataObj);
+    CStructRepDecrRefs(viewP->csP);
+    TwapiFree(viewP);
+}
+
+/* Returns address of element index, NULL (with error in interp) if invalid */
+static void *CStructViewElem(Tcl_Interp *interp, TwapiCStructView *viewP, Tcl_Obj *indexObj, int writable)
+{
+    int index, len;
+    void *pv;
+
+    if (ObjToInt(interp, indexObj, &index) != TCL_OK)
+        return NULL;
+    if (index < 0 || index >= viewP->count) {
+        TwapiReturnErrorEx(interp, TWAPI_OUT_OF_RANGE, Tcl_ObjPrintf("Index %d out of range for cstruct view", index));
+        return NULL;
+    }
+
+    if (viewP->dataObj == NULL)
+        pv = viewP->pv;
+    else {
+        if (writable) {
+            if (Tcl_IsShared(viewP->dataObj)) {
+                Tcl_Obj *objP = ObjDuplicate(viewP->dataObj);
+                ObjIncrRefs(objP);
+                ObjDecrRefs(viewP->dataObj);
+                viewP->dataObj = objP;
+            }
+            /* Caller is going to modify the bytes */
+            Tcl_InvalidateStringRep(viewP->dataObj);
+        }
+        pv = ADDPTR(ObjToByteArray(viewP->dataObj, &len), viewP->offset, void*);
+    }
+    return ADDPTR(pv, index * viewP->stride, void*);
+}
+
+/*
+ * VIEW get INDEX FIELDPATH
+ * VIEW set INDEX FIELDPATH VALUE
+ * VIEW record INDEX ?list|dict?
+ * VIEW count
+ * VIEW binary
+ */
+static TCL_RESULT Twapi_CStructViewInstanceObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    static const char *subcmds[] = {"get", "set", "record", "count", "binary", NULL};
+    enum {VIEW_GET, VIEW_SET, VIEW_RECORD, VIEW_COUNT, VIEW_BINARY};
+    static const char *formats[] = {"list", "dict", NULL};
+    TwapiCStructView *viewP = (TwapiCStructView *) clientdata;
+    TwapiCStructField *fldP;
+    Tcl_Obj *objP;
+    void *pv;
+    int subcmd, format, whole, len;
+    TCL_RESULT res;
+
+    if (objc < 2)
+        return TwapiReturnError(interp, TWAPI_BAD_ARG_COUNT);
+    if (Tcl_GetIndexFromObj(interp, objv[1], subcmds, "subcommand", 0, &subcmd) != TCL_OK)
+        return TCL_ERROR;
+
+    switch (subcmd) {
+    case VIEW_GET:
+        CHECK_NARGS(interp, objc, 4);
+        pv = CStructViewElem(interp, viewP, objv[2], 0);
+        if (pv == NULL ||
+            CStructResolvePath(interp, viewP->csP, pv, objv[3], &fldP, &pv, &whole) != TCL_OK)
+            return TCL_ERROR;
+        if (whole)
+            res = ObjFromCStructField(interp, pv, fldP, 0, &objP);
+        else
+            res = ObjFromCStructElem(interp, pv, fldP, 0, &objP);
+        if (res != TCL_OK)
+            return res;
+        break;
+
+    case VIEW_SET:
+        CHECK_NARGS(interp, objc, 5);
+        /* Validate the path before possibly copying the data */
+        pv = CStructViewElem(interp, viewP, objv[2], 0);
+        if (pv == NULL ||
+            CStructResolvePath(interp, viewP->csP, pv, objv[3], &fldP, &pv, &whole) != TCL_OK)
+            return TCL_ERROR;
+        if (whole)
+            return TwapiReturnErrorMsg(interp, TWAPI_INVALID_ARGS, "Array cstruct fields must be set one element at a time");
+        pv = CStructViewElem(interp, viewP, objv[2], 1);
+        if (CStructResolvePath(interp, viewP->csP, pv, objv[3], &fldP, &pv, &whole) != TCL_OK ||
+            ObjToCStructElem(interp, objv[4], fldP, pv) != TCL_OK)
+            return TCL_ERROR;
+        return TCL_OK;
+
+    case VIEW_RECORD:
+        CHECK_NARGS_RANGE(interp, objc, 3, 4);
+        format = 0;
+        if (objc == 4 &&
+            Tcl_GetIndexFromObj(interp, objv[3], formats, "format", TCL_EXACT, &format) != TCL_OK)
+            return TCL_ERROR;
+        pv = CStructViewElem(interp, viewP, objv[2], 0);
+        if (pv == NULL ||
+            ObjFromCStructHelper(interp, pv, 0, viewP->csP,
+                                 format ? CSTRUCT_RETURN_DICT : 0, &objP) != TCL_OK)
+            return TCL_ERROR;
+        break;
+
+    case VIEW_COUNT:
+        CHECK_NARGS(interp, objc, 2);
+        objP = ObjFromInt(viewP->count);
+        break;
+
+    case VIEW_BINARY:
+        CHECK_NARGS(interp, objc, 2);
+        if (viewP->dataObj)
+            objP = viewP->dataObj;
+        else {
+            len = viewP->count ? (viewP->count - 1) * viewP->stride + viewP->csP->size : 0;
+            objP = ObjFromByteArray(viewP->pv, len);
+        }
+        break;
+    }
+
+    return ObjSetResult(interp, objP);
+}
+
+static TCL_RESULT CStructViewCreate(Tcl_Interp *interp, Tcl_Obj *nameObj, TwapiCStructRep *csP, Tcl_Obj *dataObj, void *pv, int offset, int stride, int count)
+{
+    TwapiCStructView *viewP;
+
+    viewP = TwapiAlloc(sizeof(*viewP));
+    viewP->csP = csP;
+    csP->nrefs += 1;
+    viewP->dataObj = dataObj;
+    if (dataObj)
+        ObjIncrRefs(dataObj);
+    viewP->pv = pv;
+    viewP->offset = offset;
+    viewP->stride = stride;
+    viewP->count = count;
+    Tcl_CreateObjCommand(interp, ObjToString(nameObj),
+                         Twapi_CStructViewInstanceObjCmd, viewP,
+                         TwapiCStructViewDelete);
+    return ObjSetResult(interp, nameObj);
+}
+
+/*
+ * cstruct_view CMDNAME CSTRUCTDEF BINDATA ?COUNT? ?STRIDE? ?OFFSET?
+ * Creates a view command over an array of cstructs in BINDATA. COUNT,
+ * STRIDE and OFFSET are as for cstruct_decode.
+ */
+TCL_RESULT Twapi_CStructViewObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    Tcl_Obj *nameObj, *csObj, *dataObj, *countObj;
+    int len, count, stride, offset;
+    TwapiCStructRep *csP;
+
+    countObj = NULL;
+    if (TwapiGetArgs(interp, objc-1, objv+1,
+                     GETOBJ(nameObj), GETOBJ(csObj), GETOBJ(dataObj),
+                     ARGUSEDEFAULT, GETOBJ(countObj), GETINT(stride),
+                     GETINT(offset),
+                     ARGEND) != TCL_OK)
+        return TCL_ERROR;
+
+    if (ObjCastToCStruct(interp, csObj, 0) != TCL_OK)
+        return TCL_ERROR;
+    csP = CSTRUCT_REP(csObj);
+    if (CStructHasIndirections(csP))
+        return TwapiReturnErrorMsg(interp, TWAPI_INVALID_ARGS, "Binary data cannot be decoded into cstructs containing string or SID fields");
+
+    ObjToByteArray(dataObj, &len);
+    if (CStructArrayExtent(interp, csP, len, countObj, offset, &stride, &count) != TCL_OK)
+        return TCL_ERROR;
+
+    return CStructViewCreate(interp, nameObj, csP, dataObj, NULL, offset, stride, count);
+}
+
+/*
+ * cstruct_view_pointer CMDNAME CSTRUCTDEF POINTER COUNT ?STRIDE?
+ * Creates a view command over an array of cstructs in memory. Caller
+ * has to ensure the memory stays valid for the lifetime of the view.
+ */
+TCL_RESULT Twapi_CStructViewPointerObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    Tcl_Obj *nameObj, *csObj;
+    void *pv;
+    int count, stride;
+    TwapiCStructRep *csP;
+
+    if (TwapiGetArgs(interp, objc-1, objv+1,
+                     GETOBJ(nameObj), GETOBJ(csObj), GETVOIDP(pv),
+                     GETINT(count), ARGUSEDEFAULT, GETINT(stride),
+                     ARGEND) != TCL_OK)
+        return TCL_ERROR;
+
+    if (ObjCastToCStruct(interp, csObj, 0) != TCL_OK)
+        return TCL_ERROR;
+    csP = CSTRUCT_REP(csObj);
+
+    if (count < 0)
+        return TwapiReturnErrorMsg(interp, TWAPI_INVALID_ARGS, "Negative cstruct array count");
+    if (pv == NULL && count != 0)
+        return TwapiReturnError(interp, TWAPI_NULL_POINTER);
+    if (stride == 0)
+        stride = csP->size;
+    else if (stride < 0 || (unsigned int) stride < csP->size)
+        return TwapiReturnErrorMsg(interp, TWAPI_INVALID_ARGS, "Stride is less than cstruct size");
+
+    return CStructViewCreate(interp, nameObj, csP, NULL, pv, 0, stride, count);
+}
+
 
 TCL_RESULT TwapiCStructSize(Tcl_Interp *interp, Tcl_Obj *csObj, int *szP)
 {
@@ -742,74 +1249,67 @@ TCL_RESULT Twapi_FfiHObjCmd(TwapiInterpContext *ticP, Tcl_Interp *interp, int ob
 }
 #endif /* OBSOLETE */
 
-TCL_RESULT Twapi_FfiCallObjCmd(void *clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+/*
+ * Returns TCL_OK if type is supported as an FFI parameter. Checked once
+ * when the call signature is bound, not on every call.
+ */
+static TCL_RESULT FfiCheckParamType(Tcl_Interp *interp, TwapiCStructField *fldP)
 {
-    DCCallVM *vmP = (DCCallVM *) clientdata;
-    FARPROC fn;
-    TCL_RESULT res;
-    TwapiCStructRep *fntypeP = NULL;
-    TwapiCStructRep *paramtypesP = NULL;
-    Tcl_Obj *paramObj = NULL;
-    Tcl_Obj **params;
-    int i, nparams;
-    union {
-        int i32; UINT ui32; char i8; unsigned char ui8;
-        short i16; unsigned short ui16; Tcl_WideInt i64;
-        double d; float f; void *pv;
-    } u;
-    Tcl_Obj *objP;
-
-    if (objc != 5)
-        return TwapiReturnError(interp, TWAPI_BAD_ARG_COUNT);
-    if (ObjToFARPROC(NULL, objv[1], &fn) != TCL_OK || fn == NULL)
-        return TwapiReturnErrorMsg(interp, TWAPI_INVALID_ARGS, "Invalid or NULL function pointer.");
-
-    /* 
-     * Convert return type and parameter type definitions. The parameter
-     * list may be empty so last argument to ObjCastToCStruct in that
-     * case is 1
-     */
-    if (ObjCastToCStruct(interp, objv[2], 0) != TCL_OK ||
-        ObjCastToCStruct(interp, objv[3], 1) != TCL_OK)
-        return TCL_ERROR;
-
-    fntypeP = CSTRUCT_REP(objv[2]);
-    if (fntypeP->nfields > 1) {
-        return TwapiReturnErrorMsg(interp, TWAPI_INVALID_ARGS, "Function return type has multiple elements.");
+    if (fldP->count)
+        return TwapiReturnErrorMsg(interp, TWAPI_INVALID_ARGS, "Array types not supported in FFI calls.");
+    switch (fldP->type) {
+    case CSTRUCT_BOOLEAN: case CSTRUCT_INT: case CSTRUCT_UINT:
+    case CSTRUCT_CHAR: case CSTRUCT_UCHAR: case CSTRUCT_SHORT:
+    case CSTRUCT_USHORT: case CSTRUCT_INT64: case CSTRUCT_UINT64:
+    case CSTRUCT_DOUBLE: case CSTRUCT_FLOAT: case CSTRUCT_HANDLE:
+    case CSTRUCT_STRING:
+        return TCL_OK;
+        /*
+          CSTRUCT_WSTRING not supported because to be safe against
+          shimmering we should dup the parameter Tcl_Obj
+        */
+    default:
+        return TwapiReturnErrorMsg(interp, TWAPI_INVALID_ARGS, "Unsupported parameter type");
     }
-    paramtypesP = CSTRUCT_REP(objv[3]);
-
-    /* Do not want these structures deallocated on Tcl_Obj shimmering */
-    fntypeP->nrefs += 1;
-    paramtypesP->nrefs += 1;
+}
 
-    /* Simly guard param list obj from shimmering by duping it */
-    paramObj = ObjDuplicate(objv[4]);
-    res = ObjGetElements(interp, paramObj, &nparams, &params);
-    if (res != TCL_OK)
-        goto vamoose;
-    if (nparams != paramtypesP->nfields) {
-        res = TwapiReturnError(interp, TWAPI_BAD_ARG_COUNT);
-        goto vamoose;
+static TCL_RESULT FfiCheckReturnType(Tcl_Interp *interp, TwapiCStructRep *fntypeP)
+{
+    if (fntypeP->nfields > 1)
+        return TwapiReturnErrorMsg(interp, TWAPI_INVALID_ARGS, "Function return type has multiple elements.");
+    switch (fntypeP->fields[0].type) {
+    case CSTRUCT_VOID: case CSTRUCT_BOOLEAN: case CSTRUCT_INT:
+    case CSTRUCT_UINT: case CSTRUCT_CHAR: case CSTRUCT_UCHAR:
+    case CSTRUCT_SHORT: case CSTRUCT_USHORT: case CSTRUCT_INT64:
+    case CSTRUCT_UINT64: case CSTRUCT_DOUBLE: case CSTRUCT_FLOAT:
+    case CSTRUCT_HANDLE: case CSTRUCT_STRING: case CSTRUCT_WSTRING:
+        return TCL_OK;
+    default:
+        return TwapiReturnErrorMsg(interp, TWAPI_INVALID_ARGS, "Unsupported return type");
     }
+}
 
-    /* Now prepare parameters for the call */
-    dcReset(vmP);
+/*
+ * Pushes the parameters onto the call VM. The types must have been
+ * validated with FfiCheckParamType. Caller must dcReset the VM.
+ */
+static TCL_RESULT FfiPushArgs(Tcl_Interp *interp, DCCallVM *vmP, int nparams, const char *types, Tcl_Obj *CONST params[])
+{
+    int i;
+    union {
+        int i32; UINT ui32; char i8; unsigned char ui8;
+        short i16; unsigned short ui16; Tcl_WideInt i64;
+        double d; void *pv;
+    } u;
 
     for (i = 0; i < nparams; ++i) {
-        TwapiCStructField *fldP = &paramtypesP->fields[i];
-        if (fldP->count) {
-            res = TwapiReturnErrorMsg(interp, TWAPI_INVALID_ARGS, "Array types not supported in FFI calls.");
-            goto vamoose;
-        }
-
 #define STOREARG(objfn_, dcfn_, var_)                   \
-        res = objfn_(interp, params[i], &var_);         \
-        if (res != TCL_OK) goto vamoose;                \
+        if (objfn_(interp, params[i], &var_) != TCL_OK) \
+            return TCL_ERROR;                           \
         dcfn_(vmP, var_);                               \
         break;
 
-        switch (fldP->type) {
+        switch (types[i]) {
         case CSTRUCT_BOOLEAN: STOREARG(ObjToBoolean, dcArgInt, u.i32);
         case CSTRUCT_INT: STOREARG(ObjToInt, dcArgInt, u.i32);
         case CSTRUCT_UINT: STOREARG(ObjToUINT, dcArgInt, u.ui32);
@@ -823,25 +1323,31 @@ TCL_RESULT Twapi_FfiCallObjCmd(void *clientdata, Tcl_Interp *interp, int objc, T
         case CSTRUCT_FLOAT: STOREARG(ObjToDouble, dcArgFloat, u.d);
         case CSTRUCT_HANDLE: STOREARG(ObjToHANDLE, dcArgPointer, u.pv);
         case CSTRUCT_STRING: dcArgPointer(vmP, ObjToString(params[i])); break;
-            /*
-              Commented out because to be safe against shimmering we should
-              dup the params[i] Tcl_Obj
-              case CSTRUCT_WSTRING: dcArgPointer(vmP, ObjToWinChars(params[i])); break;
-            */
         default:
-            res = TwapiReturnErrorMsg(interp, TWAPI_INVALID_ARGS, "Unsupported parameter type");
-            goto vamoose;
+            return TwapiReturnErrorMsg(interp, TWAPI_INVALID_ARGS, "Unsupported parameter type");
         }
-    }
 #undef STOREARG
-    
+    }
+    return TCL_OK;
+}
+
+/* Makes the call and stores the return value as the interp result */
+static TCL_RESULT FfiInvoke(Tcl_Interp *interp, DCCallVM *vmP, FARPROC fn, char rettype)
+{
+    union {
+        int i32; UINT ui32; char i8; unsigned char ui8;
+        short i16; unsigned short ui16; Tcl_WideInt i64;
+        double d; void *pv;
+    } u;
+    Tcl_Obj *objP;
+
 #define CALLFN(objfn_, dcfn_, var_)              \
     var_ = dcfn_(vmP, fn);                       \
     objP = objfn_(var_);                         \
     break;
 
     /* Call based on return type */
-    switch (fntypeP->fields[0].type) {
+    switch (rettype) {
     case CSTRUCT_VOID:
         dcCallVoid(vmP, fn);
         objP = ObjFromEmptyString();
@@ -861,11 +1367,73 @@ TCL_RESULT Twapi_FfiCallObjCmd(void *clientdata, Tcl_Interp *interp, int objc, T
     case CSTRUCT_STRING: CALLFN(ObjFromString, dcCallPointer, u.pv);
     case CSTRUCT_WSTRING: CALLFN(ObjFromWinChars, dcCallPointer, u.pv);
     default:
-        res = TwapiReturnErrorMsg(interp, TWAPI_INVALID_ARGS, "Unsupported return type");
+        return TwapiReturnErrorMsg(interp, TWAPI_INVALID_ARGS, "Unsupported return type");
+    }
+#undef CALLFN
+
+    return ObjSetResult(interp, objP);
+}
+
+TCL_RESULT Twapi_FfiCallObjCmd(void *clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    DCCallVM *vmP = (DCCallVM *) clientdata;
+    FARPROC fn;
+    TCL_RESULT res;
+    TwapiCStructRep *fntypeP = NULL;
+    TwapiCStructRep *paramtypesP = NULL;
+    Tcl_Obj *paramObj = NULL;
+    Tcl_Obj **params;
+    int i, nparams;
+    char types_buf[32];
+    char *types = types_buf;
+
+    if (objc != 5)
+        return TwapiReturnError(interp, TWAPI_BAD_ARG_COUNT);
+    if (ObjToFARPROC(NULL, objv[1], &fn) != TCL_OK || fn == NULL)
+        return TwapiReturnErrorMsg(interp, TWAPI_INVALID_ARGS, "Invalid or NULL function pointer.");
+
+    /* 
+     * Convert return type and parameter type definitions. The parameter
+     * list may be empty so last argument to ObjCastToCStruct in that
+     * case is 1
+     */
+    if (ObjCastToCStruct(interp, objv[2], 0) != TCL_OK ||
+        ObjCastToCStruct(interp, objv[3], 1) != TCL_OK)
+        return TCL_ERROR;
+
+    fntypeP = CSTRUCT_REP(objv[2]);
+    if (FfiCheckReturnType(interp, fntypeP) != TCL_OK)
+        return TCL_ERROR;
+    paramtypesP = CSTRUCT_REP(objv[3]);
+
+    /* Do not want these structures deallocated on Tcl_Obj shimmering */
+    fntypeP->nrefs += 1;
+    paramtypesP->nrefs += 1;
+
+    /* Simly guard param list obj from shimmering by duping it */
+    paramObj = ObjDuplicate(objv[4]);
+    res = ObjGetElements(interp, paramObj, &nparams, &params);
+    if (res != TCL_OK)
+        goto vamoose;
+    if (nparams != paramtypesP->nfields) {
+        res = TwapiReturnError(interp, TWAPI_BAD_ARG_COUNT);
         goto vamoose;
     }
 
-    res = ObjSetResult(interp, objP);
+    if (nparams > (int) ARRAYSIZE(types_buf))
+        types = TwapiAlloc(nparams);
+    for (i = 0; i < nparams; ++i) {
+        res = FfiCheckParamType(interp, &paramtypesP->fields[i]);
+        if (res != TCL_OK)
+            goto vamoose;
+        types[i] = paramtypesP->fields[i].type;
+    }
+
+    /* Now prepare parameters for the call */
+    dcReset(vmP);
+    res = FfiPushArgs(interp, vmP, nparams, types, params);
+    if (res == TCL_OK)
+        res = FfiInvoke(interp, vmP, fn, fntypeP->fields[0].type);
 
 vamoose: /* res holds TCL_OK / TCL_ERROR */
     
@@ -875,10 +1443,109 @@ vamoose: /* res holds TCL_OK / TCL_ERROR */
         CStructRepDecrRefs(paramtypesP);
     if (paramObj)
         ObjDecrRefs(paramObj);
+    if (types != types_buf)
+        TwapiFree(types);
     
     return res;
 }
 
+/*
+ * A prepared FFI call binds the function address, calling convention and
+ * the parameter and return types once. Invoking the command created by
+ * ffi_prepare then only has to marshal the argument values. Each prepared
+ * call has its own call VM so calls through different functions can nest.
+ */
+typedef struct TwapiFfiPrepared_s {
+    DCCallVM *vmP;
+    FARPROC   fn;
+    int       nparams;
+    char      rettype;
+    char      paramtypes[1];    /* Actually nparams, at least 1 */
+} TwapiFfiPrepared;
+
+static TCL_RESULT Twapi_FfiPreparedObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiFfiPrepared *prepP = (TwapiFfiPrepared *) clientdata;
+
+    if ((objc-1) != prepP->nparams)
+        return TwapiReturnError(interp, TWAPI_BAD_ARG_COUNT);
+
+    dcReset(prepP->vmP);
+    if (FfiPushArgs(interp, prepP->vmP, prepP->nparams, prepP->paramtypes, objv+1) != TCL_OK)
+        return TCL_ERROR;
+    return FfiInvoke(interp, prepP->vmP, prepP->fn, prepP->rettype);
+}
+
+static void TwapiFfiPreparedDelete(ClientData clientdata)
+{
+    TwapiFfiPrepared *prepP = (TwapiFfiPrepared *) clientdata;
+    dcFree(prepP->vmP);
+    TwapiFree(prepP);
+}
+
+/*
+ * ffi_prepare CMDNAME FNADDR FNTYPE PARAMTYPES ?STDCALL?
+ * Creates command CMDNAME which calls FNADDR with its arguments.
+ */
+TCL_RESULT Twapi_FfiPrepareObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    Tcl_Obj *nameObj, *fntypeObj, *paramtypesObj;
+    FARPROC fn;
+    int stdcall;
+    int i;
+    TwapiCStructRep *fntypeP;
+    TwapiCStructRep *paramtypesP;
+    TwapiFfiPrepared *prepP;
+
+    if (TwapiGetArgs(interp, objc-1, objv+1,
+                     GETOBJ(nameObj), ARGSKIP, GETOBJ(fntypeObj),
+                     GETOBJ(paramtypesObj), ARGUSEDEFAULT, GETBOOL(stdcall),
+                     ARGEND) != TCL_OK)
+        return TCL_ERROR;
+
+    if (ObjToFARPROC(NULL, objv[2], &fn) != TCL_OK || fn == NULL)
+        return TwapiReturnErrorMsg(interp, TWAPI_INVALID_ARGS, "Invalid or NULL function pointer.");
+
+    if (ObjCastToCStruct(interp, fntypeObj, 0) != TCL_OK ||
+        ObjCastToCStruct(interp, paramtypesObj, 1) != TCL_OK)
+        return TCL_ERROR;
+    fntypeP = CSTRUCT_REP(fntypeObj);
+    paramtypesP = CSTRUCT_REP(paramtypesObj);
+
+    if (FfiCheckReturnType(interp, fntypeP) != TCL_OK)
+        return TCL_ERROR;
+    for (i = 0; i < paramtypesP->nfields; ++i) {
+        if (FfiCheckParamType(interp, &paramtypesP->fields[i]) != TCL_OK)
+            return TCL_ERROR;
+    }
+
+    /*
+     * Only the type codes are kept so nothing refers back to the cstruct
+     * definitions after this point.
+     */
+    prepP = TwapiAlloc(sizeof(*prepP) + paramtypesP->nfields);
+    prepP->fn = fn;
+    prepP->nparams = paramtypesP->nfields;
+    prepP->rettype = fntypeP->fields[0].type;
+    for (i = 0; i < paramtypesP->nfields; ++i)
+        prepP->paramtypes[i] = paramtypesP->fields[i].type;
+
+    /* Arguments take at most 8 bytes each on the call stack */
+    prepP->vmP = dcNewCallVM(64 + 8 * prepP->nparams);
+#ifndef _WIN64
+    if (stdcall)
+        dcMode(prepP->vmP, DC_CALL_C_X86_WIN32_STD);
+    else
+#endif
+        dcMode(prepP->vmP, DC_CALL_C_DEFAULT);
+
+    Tcl_CreateObjCommand(interp, ObjToString(nameObj),
+                         Twapi_FfiPreparedObjCmd, prepP,
+                         TwapiFfiPreparedDelete);
+    ObjSetResult(interp, nameObj);
+    return TCL_OK;
+}
+
 void TwapiDeleteFfiCmd(ClientData vmP)
 {
     dcFree((DCCallVM *) vmP);
@@ -898,5 +1565,7 @@ void TwapiFfiInit(Tcl_Interp *interp)
     dcMode(vmP, DC_CALL_C_X86_WIN32_STD);
     Tcl_CreateObjCommand(interp, TWAPI_TCL_NAMESPACE "::ffi_stdcall", Twapi_FfiCallObjCmd, vmP, TwapiDeleteFfiCmd);
 #endif
+
+    Tcl_CreateObjCommand(interp, TWAPI_TCL_NAMESPACE "::ffi_prepare", Twapi_FfiPrepareObjCmd, NULL, NULL);
     
 }
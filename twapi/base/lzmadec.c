@@ -1,4 +1,4 @@
-/* This file from Pavlov's public domain LZMA SDK 9.12 */
+/* This file from Pavlov's public domain LZMA SDK 9.12 with TWAPI additions */
 /* LzmaDec.c -- LZMA Decoder
 2009-09-20 : Igor Pavlov : Public domain */
 
@@ -25,12 +25,41 @@
   { UPDATE_1(p); i = (i + i) + 1; A1; }
 #define GET_BIT(p, i) GET_BIT2(p, i, ; , ;)
 
-#define TREE_GET_BIT(probs, i) { GET_BIT((probs + i), i); }
+/*
+ * TWAPI addition - branch-free bit decoding. Where the decoded bit only
+ * selects the next node of a bit tree, both outcomes are computed and
+ * the result selected with the mask m (all ones for a 1 bit). Literal
+ * bits in particular are close to random, so this is cheaper than the
+ * mispredicted branches of GET_BIT. Output is identical.
+ */
+#define GET_BIT_MASK(p, i, m) \
+  { UInt32 p0_, p1_; \
+    ttt = *(p); NORMALIZE; bound = (range >> kNumBitModelTotalBits) * ttt; \
+    m = (UInt32)0 - (UInt32)(code >= bound); \
+    code -= bound & m; \
+    range = bound + ((range - bound - bound) & m); \
+    p0_ = ttt + ((kBitModelTotal - ttt) >> kNumMoveBits); \
+    p1_ = ttt - (ttt >> kNumMoveBits); \
+    *(p) = (CLzmaProb)(p0_ ^ ((p0_ ^ p1_) & m)); \
+    i = (i + i) - m; }
+#define GET_BIT_NB(p, i) { UInt32 m_; GET_BIT_MASK(p, i, m_) }
+
+#define TREE_GET_BIT(probs, i) { GET_BIT_NB((probs + i), i); }
 #define TREE_DECODE(probs, limit, i) \
   { i = 1; do { TREE_GET_BIT(probs, i); } while (i < limit); i -= limit; }
 
 /* #define _LZMA_SIZE_OPT */
 
+/*
+ * TWAPI addition - copy matches a word at a time on processors where
+ * unaligned access is cheap. The memcpy calls compile to single loads
+ * and stores.
+ */
+#if !defined(LZMA_DEC_COPY_WORDS) && !defined(_SZ_NO_INT_64) && \
+    (defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__))
+#define LZMA_DEC_COPY_WORDS
+#endif
+
 #ifdef _LZMA_SIZE_OPT
 #define TREE_6_DECODE(probs, i) TREE_DECODE(probs, (1 << 6), i)
 #else
@@ -172,7 +201,18 @@ static int MY_FAST_CALL LzmaDec_DecodeReal(CLzmaDec *p, SizeT limit, const Byte
       {
         state -= (state < 4) ? state : 3;
         symbol = 1;
-        do { GET_BIT(prob + symbol, symbol) } while (symbol < 0x100);
+#ifdef _LZMA_SIZE_OPT
+        do { TREE_GET_BIT(prob, symbol) } while (symbol < 0x100);
+#else
+        TREE_GET_BIT(prob, symbol);
+        TREE_GET_BIT(prob, symbol);
+        TREE_GET_BIT(prob, symbol);
+        TREE_GET_BIT(prob, symbol);
+        TREE_GET_BIT(prob, symbol);
+        TREE_GET_BIT(prob, symbol);
+        TREE_GET_BIT(prob, symbol);
+        TREE_GET_BIT(prob, symbol);
+#endif
       }
       else
       {
@@ -183,11 +223,13 @@ static int MY_FAST_CALL LzmaDec_DecodeReal(CLzmaDec *p, SizeT limit, const Byte
         do
         {
           unsigned bit;
+          UInt32 m;
           CLzmaProb *probLit;
           matchByte <<= 1;
           bit = (matchByte & offs);
           probLit = prob + offs + bit + symbol;
-          GET_BIT2(probLit, symbol, offs &= ~bit, offs &= bit)
+          GET_BIT_MASK(probLit, symbol, m);
+          offs &= ~bit ^ m;
         }
         while (symbol < 0x100);
       }
@@ -312,7 +354,9 @@ static int MY_FAST_CALL LzmaDec_DecodeReal(CLzmaDec *p, SizeT limit, const Byte
               unsigned i = 1;
               do
               {
-                GET_BIT2(prob + i, i, ; , distance |= mask);
+                UInt32 m;
+                GET_BIT_MASK(prob + i, i, m);
+                distance |= mask & m;
                 mask <<= 1;
               }
               while (--numDirectBits != 0);
@@ -347,10 +391,11 @@ static int MY_FAST_CALL LzmaDec_DecodeReal(CLzmaDec *p, SizeT limit, const Byte
             distance <<= kNumAlignBits;
             {
               unsigned i = 1;
-              GET_BIT2(prob + i, i, ; , distance |= 1);
-              GET_BIT2(prob + i, i, ; , distance |= 2);
-              GET_BIT2(prob + i, i, ; , distance |= 4);
-              GET_BIT2(prob + i, i, ; , distance |= 8);
+              UInt32 m;
+              GET_BIT_MASK(prob + i, i, m); distance |= 1 & m;
+              GET_BIT_MASK(prob + i, i, m); distance |= 2 & m;
+              GET_BIT_MASK(prob + i, i, m); distance |= 4 & m;
+              GET_BIT_MASK(prob + i, i, m); distance |= 8 & m;
             }
             if (distance == (UInt32)0xFFFFFFFF)
             {
@@ -392,9 +437,28 @@ static int MY_FAST_CALL LzmaDec_DecodeReal(CLzmaDec *p, SizeT limit, const Byte
           ptrdiff_t src = (ptrdiff_t)pos - (ptrdiff_t)dicPos;
           const Byte *lim = dest + curLen;
           dicPos += curLen;
+#ifdef LZMA_DEC_COPY_WORDS
+          /* Source at least a word behind so words do not overlap */
+          if (src <= -(ptrdiff_t)sizeof(UInt64))
+          {
+            while (lim - dest >= (ptrdiff_t)sizeof(UInt64))
+            {
+              UInt64 w;
+              memcpy(&w, dest + src, sizeof(w));
+              memcpy(dest, &w, sizeof(w));
+              dest += sizeof(w);
+            }
+          }
+          while (dest != lim)
+          {
+            *(dest) = (Byte)*(dest + src);
+            dest++;
+          }
+#else
           do
             *(dest) = (Byte)*(dest + src);
           while (++dest != lim);
+#endif
         }
         else
         {
@@ -21,8 +21,45 @@ struct OptionDescriptor {
 #define OPT_SWITCH 3
 #define OPT_SYM    4
     char        first;          /* First char of name[] */
+    unsigned long hash;         /* Hash of first name_len chars of name */
 };
 
+/*
+ * Compiled form of an option list. The descriptors are followed in the
+ * same allocation by an open addressing hash table of option indices
+ * so that each supplied option is located in constant time irrespective
+ * of the number of options in the list.
+ */
+struct OptionDescriptors {
+    int nopts;
+    unsigned int hash_mask;     /* Number of hash slots - 1 */
+    struct OptionDescriptor opts[1]; /* Actually nopts entries */
+    /* Followed by (hash_mask+1) shorts containing index into opts[] */
+};
+#define OPTDESCS_EMPTY_SLOT (-1)
+
+/* Size of the allocation needed for given number of options and slots */
+#define OPTDESCS_ALLOC_SIZE(nopts_, nslots_) \
+    (offsetof(struct OptionDescriptors, opts)                           \
+     + ((nopts_) * sizeof(struct OptionDescriptor))                     \
+     + ((nslots_) * sizeof(short)))
+
+TWAPI_STATIC_INLINE short *OptionDescriptorsSlots(struct OptionDescriptors *descsP)
+{
+    return (short *) &descsP->opts[descsP->nopts];
+}
+
+/* FNV-1a hash of option name */
+TWAPI_STATIC_INLINE unsigned long OptionNameHash(const char *p, int len)
+{
+    unsigned long hash = 2166136261U;
+    while (len--) {
+        hash ^= (unsigned char) *p++;
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
 
 static int SetParseargsOptFromAny(Tcl_Interp *interp, Tcl_Obj *objP);
 static void DupParseargsOpt(Tcl_Obj *srcP, Tcl_Obj *dstP);
@@ -56,16 +93,16 @@ static void CleanupOptionDescriptor(struct OptionDescriptor *optP)
 static void UpdateStringParseargsOpt(Tcl_Obj *objP)
 {
     /* Not the most efficient but not likely to be called often */
-    unsigned long i;
+    int i;
     Tcl_Obj *listObj = ObjEmptyList();
+    struct OptionDescriptors *descsP;
     struct OptionDescriptor *optP;
 
     TWAPI_ASSERT(objP->bytes == NULL);
     TWAPI_ASSERT(objP->typePtr == &gParseargsOptionType);
 
-    for (i = 0, optP = (struct OptionDescriptor *) objP->internalRep.ptrAndLongRep.ptr;
-         i < objP->internalRep.ptrAndLongRep.value;
-         ++i, ++optP) {
+    descsP = (struct OptionDescriptors *) objP->internalRep.ptrAndLongRep.ptr;
+    for (i = 0, optP = descsP->opts; i < descsP->nopts; ++i, ++optP) {
         Tcl_Obj *elems[3];
         int nelems;
         elems[0] = optP->name;
@@ -93,14 +130,15 @@ static void UpdateStringParseargsOpt(Tcl_Obj *objP)
 
 static void FreeParseargsOpt(Tcl_Obj *objP)
 {
-    unsigned long i;
-    struct OptionDescriptor *optsP;
+    int i;
+    struct OptionDescriptors *descsP;
 
-    if ((optsP = (struct OptionDescriptor *)objP->internalRep.ptrAndLongRep.ptr) != NULL) {
-        for (i = 0; i < objP->internalRep.ptrAndLongRep.value; ++i) {
-            CleanupOptionDescriptor(&optsP[i]);
+    descsP = (struct OptionDescriptors *)objP->internalRep.ptrAndLongRep.ptr;
+    if (descsP != NULL) {
+        for (i = 0; i < descsP->nopts; ++i) {
+            CleanupOptionDescriptor(&descsP->opts[i]);
         }
-        ckfree((char *) optsP);
+        ckfree((char *) descsP);
     }
 
     objP->internalRep.ptrAndLongRep.ptr = NULL;
@@ -111,42 +149,76 @@ static void FreeParseargsOpt(Tcl_Obj *objP)
 static void DupParseargsOpt(Tcl_Obj *srcP, Tcl_Obj *dstP)
 {
     int i;
+    size_t sz;
+    struct OptionDescriptors *ddescsP;
+    struct OptionDescriptors *sdescsP;
     struct OptionDescriptor *doptsP;
-    struct OptionDescriptor *soptsP;
     
     dstP->typePtr = &gParseargsOptionType;
-    soptsP = srcP->internalRep.ptrAndLongRep.ptr;
-    if (soptsP == NULL) {
+    sdescsP = srcP->internalRep.ptrAndLongRep.ptr;
+    if (sdescsP == NULL) {
         dstP->internalRep.ptrAndLongRep.ptr = NULL;
         dstP->internalRep.ptrAndLongRep.value = 0;
         return;
     }
 
-    doptsP = (struct OptionDescriptor *) ckalloc(srcP->internalRep.ptrAndLongRep.value * sizeof(*doptsP));
-    dstP->internalRep.ptrAndLongRep.ptr = doptsP;
-    i = srcP->internalRep.ptrAndLongRep.value;
-    dstP->internalRep.ptrAndLongRep.value = i;
-    while (i--) {
-        if ((doptsP->name = soptsP->name) != NULL)
+    /*
+     * The descriptors and hash table are position independent so a
+     * straight copy suffices except for the object references.
+     */
+    sz = OPTDESCS_ALLOC_SIZE(sdescsP->nopts, sdescsP->hash_mask + 1);
+    ddescsP = (struct OptionDescriptors *) ckalloc((int) sz);
+    CopyMemory(ddescsP, sdescsP, sz);
+    dstP->internalRep.ptrAndLongRep.ptr = ddescsP;
+    dstP->internalRep.ptrAndLongRep.value = srcP->internalRep.ptrAndLongRep.value;
+    for (i = 0, doptsP = ddescsP->opts; i < ddescsP->nopts; ++i, ++doptsP) {
+        if (doptsP->name)
             ObjIncrRefs(doptsP->name);
-        if ((doptsP->def_value = soptsP->def_value) != NULL)
+        if (doptsP->def_value)
             ObjIncrRefs(doptsP->def_value);
-        if ((doptsP->valid_values = soptsP->valid_values) != NULL)
+        if (doptsP->valid_values)
             ObjIncrRefs(doptsP->valid_values);
-        doptsP->name_len = soptsP->name_len;
-        doptsP->type = soptsP->type;
-        doptsP->first = soptsP->first;
-        ++doptsP;
-        ++soptsP;
     }
-
 }
 
+/*
+ * Returns index of the option matching the passed name (without the
+ * leading "-") or -1 if none match.
+ */
+static int OptionDescriptorsLookup(struct OptionDescriptors *descsP,
+                                   const char *name, int name_len)
+{
+    unsigned long hash;
+    unsigned int slot;
+    short *slotsP;
+    struct OptionDescriptor *optP;
+
+    if (descsP->nopts == 0)
+        return -1;
+    hash = OptionNameHash(name, name_len);
+    slotsP = OptionDescriptorsSlots(descsP);
+    /* Table is never more than half full so an empty slot always exists */
+    for (slot = hash & descsP->hash_mask;
+         slotsP[slot] != OPTDESCS_EMPTY_SLOT;
+         slot = (slot + 1) & descsP->hash_mask) {
+        optP = &descsP->opts[slotsP[slot]];
+        if (optP->hash == hash &&
+            optP->name_len == name_len &&
+            optP->first == *name &&
+            ! memcmp(ObjToString(optP->name), name, name_len)) {
+            return slotsP[slot];
+        }
+    }
+    return -1;
+}
 
 static int SetParseargsOptFromAny(Tcl_Interp *interp, Tcl_Obj *objP)
 {
     int k, nopts;
+    unsigned int nslots, slot;
+    short *slotsP;
     Tcl_Obj **optObjs;
+    struct OptionDescriptors *descsP;
     struct OptionDescriptor *optsP;
     struct OptionDescriptor *curP;
     int len;
@@ -156,9 +228,24 @@ static int SetParseargsOptFromAny(Tcl_Interp *interp, Tcl_Obj *objP)
 
     if (ObjGetElements(interp, objP, &nopts, &optObjs) != TCL_OK)
         return TCL_ERROR;
-    
-    
-    optsP = nopts ? (struct OptionDescriptor *) ckalloc(nopts * sizeof(*optsP)) : NULL;
+
+    /* Indices are stored as shorts in the hash table */
+    if (nopts > SHRT_MAX) {
+        ObjSetStaticResult(interp, "Too many options in option descriptor list.");
+        Tcl_SetObjErrorCode(interp, Twapi_MakeTwapiErrorCodeObj(TWAPI_INVALID_ARGS));
+        return TCL_ERROR;
+    }
+
+    /* Keep hash table load factor at most 1/2 */
+    for (nslots = 8; nslots < (unsigned int) (2*nopts); nslots <<= 1)
+        ;
+    descsP = (struct OptionDescriptors *) ckalloc((int)OPTDESCS_ALLOC_SIZE(nopts, nslots));
+    descsP->nopts = nopts;
+    descsP->hash_mask = nslots - 1;
+    optsP = descsP->opts;
+    slotsP = OptionDescriptorsSlots(descsP);
+    for (slot = 0; slot < nslots; ++slot)
+        slotsP[slot] = OPTDESCS_EMPTY_SLOT;
 
     for (k = 0; k < nopts ; ++k) {
         Tcl_Obj **elems;
@@ -205,6 +292,19 @@ static int SetParseargsOptFromAny(Tcl_Interp *interp, Tcl_Obj *objP)
             else
                 goto error_handler;
         }
+        curP->hash = OptionNameHash(p, curP->name_len);
+
+        /*
+         * Add to hash table. Duplicate option names are entered as well
+         * but since lookups stop at the first match, the earliest
+         * definition wins as was always the case.
+         */
+        for (slot = curP->hash & descsP->hash_mask;
+             slotsP[slot] != OPTDESCS_EMPTY_SLOT;
+             slot = (slot + 1) & descsP->hash_mask)
+            ;
+        slotsP[slot] = (short) k;
+
         if (nelems > 1) {
             /* Squirrel away specified default */
             curP->def_value = elems[1];
@@ -262,7 +362,7 @@ static int SetParseargsOptFromAny(Tcl_Interp *interp, Tcl_Obj *objP)
     Tcl_InvalidateStringRep(objP);
 #endif
 
-    objP->internalRep.ptrAndLongRep.ptr = optsP;
+    objP->internalRep.ptrAndLongRep.ptr = descsP;
     objP->internalRep.ptrAndLongRep.value = nopts;
     objP->typePtr = &gParseargsOptionType;
 
@@ -275,13 +375,11 @@ error_handler: /* Tcl error result must have been set */
                          ObjToString(optObjs[k]), "'", NULL);
         Tcl_SetObjErrorCode(interp, Twapi_MakeTwapiErrorCodeObj(TWAPI_INVALID_ARGS));
     }
-    if (optsP) {
-        while (k >= 0) {
-            CleanupOptionDescriptor(&optsP[k]);
-            --k;
-        }
-        ckfree((char *)optsP);
+    while (k >= 0) {
+        CleanupOptionDescriptor(&optsP[k]);
+        --k;
     }
+    ckfree((char *)descsP);
     return TCL_ERROR;
 }
 
@@ -332,6 +430,7 @@ int Twapi_ParseargsObjCmd(
     int         nopts;
     int         j, k;
     Tcl_WideInt wide;
+    struct OptionDescriptors *descsP;
     struct OptionDescriptor *opts;
     int         ignoreunknown = 0;
     int         nulldefault = 0;
@@ -358,8 +457,9 @@ int Twapi_ParseargsObjCmd(
             return TCL_ERROR;
     }
 
-    opts =  objv[2]->internalRep.ptrAndLongRep.ptr;
-    nopts = objv[2]->internalRep.ptrAndLongRep.value;
+    descsP = objv[2]->internalRep.ptrAndLongRep.ptr;
+    opts =  descsP->opts;
+    nopts = descsP->nopts;
 
     if (nopts > TWAPI_PARSEARGS_STATIC) {
         valuesP = MemLifoPushFrame(ticP->memlifoP, nopts * sizeof(*valuesP), NULL);
@@ -429,16 +529,8 @@ int Twapi_ParseargsObjCmd(
             break;
         }
 
-        /* Check against each option in turn */
-        for (j = 0; j < nopts; ++j) {
-            if (opts[j].name_len == (argp_len-1) &&
-                opts[j].first == argp[1] &&
-                ! Tcl_UtfNcmp(ObjToString(opts[j].name), argp+1, (argp_len-1))) {
-                break;          /* Match ! */
-            }
-        }
-
-        if (j < nopts) {
+        j = OptionDescriptorsLookup(descsP, argp+1, argp_len-1);
+        if (j >= 0) {
             /*
              *  Matches option j. Remember the option value.
              */
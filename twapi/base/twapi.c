@@ -49,6 +49,8 @@ typedef struct _TwapiRegisteredPointer {
 OSVERSIONINFOW gTwapiOSVersionInfo;
 TwapiBaseSettings gBaseSettings = {
     1,                          /* use_unicode_obj, controlled via Tcl_LinkVar */
+    0,                          /* cache_scripts, controlled via Tcl_LinkVar */
+    0,                          /* defer_cached_scripts, ditto */
 };
 GUID gTwapiNullGuid;             /* Initialized to all zeroes */
 struct TwapiTclVersion gTclVersion;
@@ -247,6 +249,8 @@ int Twapi_base_Init(Tcl_Interp *interp)
     Tcl_SetVar2(interp, "::twapi::version", MODULENAME, MODULEVERSION, 0);
     Tcl_SetVar2(interp, "::twapi::settings", "log_limit", "100", 0);
     Tcl_LinkVar(interp, "::twapi::settings(use_unicode_obj)", (char *)&gBaseSettings.use_unicode_obj, TCL_LINK_ULONG);
+    Tcl_LinkVar(interp, "::twapi::settings(cache_scripts)", (char *)&gBaseSettings.cache_scripts, TCL_LINK_ULONG);
+    Tcl_LinkVar(interp, "::twapi::settings(defer_cached_scripts)", (char *)&gBaseSettings.defer_cached_scripts, TCL_LINK_ULONG);
 
     /* Allocate a context that will be passed around in all interpreters */
     ticP = TwapiRegisterModule(interp,  gTwapiModuleHandle, &gBaseModule, NEW_TIC);
@@ -276,6 +280,171 @@ int Twapi_Init(Tcl_Interp *interp)
     return Twapi_base_Init(interp);
 }
 
+/*
+ * Startup profiling. The time taken by each module's C initializer and
+ * by the decompression and evaluation of its script is recorded in the
+ * ::twapi::_startup_profile array, indexed by module name. Each element
+ * is a dictionary with keys init, decompress and eval (microseconds)
+ * and compressed_size and size (bytes). Retrieved through
+ * twapi::startup_profile.
+ */
+#define TWAPI_STARTUP_PROFILE_VAR "::" TWAPI_TCL_NAMESPACE "::_startup_profile"
+
+static Tcl_WideInt TwapiElapsedMicroseconds(LARGE_INTEGER *startP)
+{
+    static LARGE_INTEGER freq; /* Fixed at system boot */
+    LARGE_INTEGER now;
+
+    QueryPerformanceCounter(&now);
+    if (freq.QuadPart == 0)
+        QueryPerformanceFrequency(&freq);
+    return ((now.QuadPart - startP->QuadPart) * 1000000) / freq.QuadPart;
+}
+
+static void TwapiStartupProfileSet(Tcl_Interp *interp, const char *modname,
+                                   const char *key, Tcl_WideInt value)
+{
+    Tcl_Obj *dictObj;
+    int n;
+
+    /* Errors are ignored. Profiling must never cause a load to fail. */
+    dictObj = Tcl_GetVar2Ex(interp, TWAPI_STARTUP_PROFILE_VAR, modname,
+                            TCL_GLOBAL_ONLY);
+    if (dictObj == NULL || Tcl_DictObjSize(NULL, dictObj, &n) != TCL_OK)
+        dictObj = Tcl_NewDictObj();
+    else if (Tcl_IsShared(dictObj))
+        dictObj = ObjDuplicate(dictObj);
+    Tcl_DictObjPut(NULL, dictObj, ObjFromString(key), ObjFromWideInt(value));
+    Tcl_SetVar2Ex(interp, TWAPI_STARTUP_PROFILE_VAR, modname, dictObj,
+                  TCL_GLOBAL_ONLY);
+}
+
+/*
+ * Per-process cache of module scripts, enabled through
+ * ::twapi::settings(cache_scripts). Decompressed scripts are kept so that
+ * interps created later, for example by thread pools, do not decompress
+ * them again. Independently, if ::twapi::settings(defer_cached_scripts)
+ * is set, the commands defined by a module script are recorded when it
+ * is first evaluated so that later interps only install auto_index stubs
+ * for them (see TwapiSourceModuleScript). Entries live until process exit.
+ */
+typedef struct _TwapiScriptCacheEntry {
+    struct _TwapiScriptCacheEntry *nextP;
+    HANDLE dllH;
+    unsigned char *scriptP;     /* Decompressed script or NULL */
+    DWORD script_size;
+    char *commands;             /* {NAMESPACE COMMANDS ...} list of the
+                                   commands defined by the script or NULL */
+    char name[1];               /* Module name. Variable size. */
+} TwapiScriptCacheEntry;
+static TwapiScriptCacheEntry *gTwapiScriptCache;
+static CRITICAL_SECTION gTwapiScriptCacheCS;
+
+/* Caller must hold gTwapiScriptCacheCS */
+static TwapiScriptCacheEntry *TwapiScriptCacheLookup(HANDLE dllH, const char *name, int create)
+{
+    TwapiScriptCacheEntry *entryP;
+    int len;
+
+    for (entryP = gTwapiScriptCache; entryP; entryP = entryP->nextP) {
+        if (entryP->dllH == dllH && lstrcmpA(entryP->name, name) == 0)
+            return entryP;
+    }
+    if (! create)
+        return NULL;
+
+    len = lstrlenA(name);
+    entryP = TwapiAlloc(sizeof(*entryP) + len);
+    entryP->dllH = dllH;
+    entryP->scriptP = NULL;
+    entryP->script_size = 0;
+    entryP->commands = NULL;
+    CopyMemory(entryP->name, name, len + 1);
+    entryP->nextP = gTwapiScriptCache;
+    gTwapiScriptCache = entryP;
+    return entryP;
+}
+
+static unsigned char *TwapiScriptCacheGetScript(HANDLE dllH, const char *name, DWORD *szP)
+{
+    TwapiScriptCacheEntry *entryP;
+    unsigned char *scriptP = NULL;
+
+    EnterCriticalSection(&gTwapiScriptCacheCS);
+    entryP = TwapiScriptCacheLookup(dllH, name, 0);
+    if (entryP && entryP->scriptP) {
+        scriptP = entryP->scriptP;
+        *szP = entryP->script_size;
+    }
+    LeaveCriticalSection(&gTwapiScriptCacheCS);
+    return scriptP;
+}
+
+/*
+ * Hands over a decompressed script to the cache. Returns the cached
+ * script which is a different one if another thread added it first.
+ */
+static unsigned char *TwapiScriptCachePutScript(HANDLE dllH, const char *name, unsigned char *scriptP, DWORD *szP)
+{
+    TwapiScriptCacheEntry *entryP;
+
+    EnterCriticalSection(&gTwapiScriptCacheCS);
+    entryP = TwapiScriptCacheLookup(dllH, name, 1);
+    if (entryP->scriptP == NULL) {
+        entryP->scriptP = scriptP;
+        entryP->script_size = *szP;
+    } else {
+        TwapiLzmaFreeBuffer(scriptP);
+        scriptP = entryP->scriptP;
+        *szP = entryP->script_size;
+    }
+    LeaveCriticalSection(&gTwapiScriptCacheCS);
+    return scriptP;
+}
+
+/* Returns the recorded commands for a module script or NULL */
+static Tcl_Obj *TwapiScriptCacheGetCommands(HANDLE dllH, const char *name)
+{
+    TwapiScriptCacheEntry *entryP;
+    Tcl_Obj *objP = NULL;
+
+    EnterCriticalSection(&gTwapiScriptCacheCS);
+    entryP = TwapiScriptCacheLookup(dllH, name, 0);
+    if (entryP && entryP->commands)
+        objP = ObjFromString(entryP->commands);
+    LeaveCriticalSection(&gTwapiScriptCacheCS);
+    return objP;
+}
+
+static void TwapiScriptCacheSetCommands(HANDLE dllH, const char *name, const char *commands)
+{
+    TwapiScriptCacheEntry *entryP;
+    int len;
+
+    EnterCriticalSection(&gTwapiScriptCacheCS);
+    entryP = TwapiScriptCacheLookup(dllH, name, 1);
+    if (entryP->commands == NULL) {
+        len = lstrlenA(commands);
+        entryP->commands = TwapiAlloc(len + 1);
+        CopyMemory(entryP->commands, commands, len + 1);
+    }
+    LeaveCriticalSection(&gTwapiScriptCacheCS);
+}
+
+static void TwapiScriptCacheFree(void)
+{
+    TwapiScriptCacheEntry *entryP;
+
+    while ((entryP = gTwapiScriptCache) != NULL) {
+        gTwapiScriptCache = entryP->nextP;
+        TwapiLzmaFreeBuffer(entryP->scriptP);
+        if (entryP->commands)
+            TwapiFree(entryP->commands);
+        TwapiFree(entryP);
+    }
+    DeleteCriticalSection(&gTwapiScriptCacheCS);
+}
+
 /*
  * Loads the initialization script from image file resource
  */
@@ -288,6 +457,9 @@ TCL_RESULT Twapi_SourceResource(Tcl_Interp *interp, HANDLE dllH, const char *nam
     int result;
     int compressed;
     Tcl_Obj *pathObj;
+    const char *modname = name;
+    LARGE_INTEGER start;
+    int cached = 0;
 
     /*
      * Locate the twapi resource and load it if found. First check for
@@ -312,15 +484,37 @@ TCL_RESULT Twapi_SourceResource(Tcl_Interp *interp, HANDLE dllH, const char *nam
             if (dataP) {
                 /* If compressed, we need to uncompress it first */
                 if (compressed) {
+                    TwapiStartupProfileSet(interp, modname, "compressed_size", sz);
+                    if (gBaseSettings.cache_scripts) {
+                        unsigned char *cachedP;
+                        cachedP = TwapiScriptCacheGetScript(dllH, name, &sz);
+                        if (cachedP) {
+                            dataP = cachedP;
+                            cached = 1;
+                        }
+                    }
+                }
+                if (compressed && ! cached) {
+                    QueryPerformanceCounter(&start);
                     dataP = TwapiLzmaUncompressBuffer(interp, dataP, sz, &sz);
                     if (dataP == NULL)
                         return TCL_ERROR; /* interp already has error */
+                    TwapiStartupProfileSet(interp, modname, "decompress",
+                                           TwapiElapsedMicroseconds(&start));
+                    if (gBaseSettings.cache_scripts) {
+                        dataP = TwapiScriptCachePutScript(dllH, name, dataP, &sz);
+                        cached = 1;
+                    }
                 }
-                
+                TwapiStartupProfileSet(interp, modname, "size", sz);
+
                 /* The resource is expected to be UTF-8 (actually strict ASCII) */
                 /* TBD - double check use of GLOBAL and DIRECT */
+                QueryPerformanceCounter(&start);
                 result = Tcl_EvalEx(interp, (char *)dataP, sz, TCL_EVAL_GLOBAL | TCL_EVAL_DIRECT);
-                if (compressed)
+                TwapiStartupProfileSet(interp, modname, "eval",
+                                       TwapiElapsedMicroseconds(&start));
+                if (compressed && ! cached)
                     TwapiLzmaFreeBuffer(dataP);
                 if (result == TCL_OK)
                     Tcl_ResetResult(interp);
@@ -360,7 +554,10 @@ TCL_RESULT Twapi_SourceResource(Tcl_Interp *interp, HANDLE dllH, const char *nam
         name += 6;
 #endif
     Tcl_AppendStringsToObj(pathObj, name, ".tcl", NULL);
+    QueryPerformanceCounter(&start);
     result = Tcl_FSEvalFile(interp, pathObj);
+    TwapiStartupProfileSet(interp, modname, "eval",
+                           TwapiElapsedMicroseconds(&start));
     ObjDecrRefs(pathObj);
     return result;
 #if 0
@@ -509,6 +706,7 @@ static void Twapi_Cleanup(ClientData clientdata)
     // TBD - clean up allocated interp context lists, threads etc.
 
     DeleteCriticalSection(&gTwapiInterpContextsCS);
+    TwapiScriptCacheFree();
     WSACleanup();
 }
 
@@ -700,6 +898,7 @@ static int TwapiOneTimeInit(void *pv)
 
     InitializeCriticalSection(&gTwapiInterpContextsCS);
     ZLIST_INIT(&gTwapiInterpContexts);
+    InitializeCriticalSection(&gTwapiScriptCacheCS);
 
     if (Tcl_GetVar2Ex(interp, "tcl_platform", "threaded", TCL_GLOBAL_ONLY))
         gTclIsThreaded = 1;
@@ -759,6 +958,110 @@ TCL_RESULT Twapi_CheckThreadedTcl(Tcl_Interp *interp)
     return TCL_OK;
 }
 
+/*
+ * Sources a module script, recording the commands it defines in the
+ * script cache for use by other interps.
+ */
+static TCL_RESULT TwapiSourceAndRecordCommands(Tcl_Interp *interp, HMODULE hmod, const char *name)
+{
+    Tcl_Obj *objs[2];
+    Tcl_Obj *cmdObj;
+    TCL_RESULT res;
+
+    objs[0] = STRING_LITERAL_OBJ("::" TWAPI_TCL_NAMESPACE "::_namespace_commands");
+    ObjIncrRefs(objs[0]);
+    res = Tcl_EvalObjEx(interp, objs[0], TCL_EVAL_GLOBAL);
+    if (res != TCL_OK) {
+        ObjDecrRefs(objs[0]);
+        return res;
+    }
+    objs[1] = ObjGetResult(interp);
+    cmdObj = ObjNewList(2, objs);
+    ObjIncrRefs(cmdObj);
+    ObjDecrRefs(objs[0]);
+
+    res = Twapi_SourceResource(interp, hmod, name, 1);
+    if (res == TCL_OK)
+        res = Tcl_EvalObjEx(interp, cmdObj, TCL_EVAL_GLOBAL);
+    if (res == TCL_OK) {
+        TwapiScriptCacheSetCommands(hmod, name, ObjToString(ObjGetResult(interp)));
+        Tcl_ResetResult(interp);
+    }
+    ObjDecrRefs(cmdObj);
+    return res;
+}
+
+/*
+ * Sources the script for a module. If the package index has deferred
+ * the script by setting ::twapi::_deferred_scripts(MODULE) to the
+ * module's commands as a {NAMESPACE COMMANDS ...} list, auto_index
+ * entries are created instead so that the script is only decompressed
+ * and evaluated when one of its commands is first invoked. Commands
+ * already created by the module's C initializer are not stubbed. The
+ * command that loads the script is stored in
+ * ::twapi::_script_loaders(MODULE). The same is done if
+ * ::twapi::settings(defer_cached_scripts) is set and the script has been
+ * evaluated in some other interp so its commands are known.
+ */
+static TCL_RESULT TwapiSourceModuleScript(Tcl_Interp *interp, HMODULE hmod, const char *name)
+{
+    Tcl_Obj *deferredObj, *loaderObj, *cmdObj;
+    Tcl_Obj *objs[4];
+    Tcl_Obj **nsv, **cmdv;
+    Tcl_CmdInfo cmdinfo;
+    int i, j, nns, ncmds;
+    TCL_RESULT res;
+
+    deferredObj = Tcl_GetVar2Ex(interp,
+                                "::" TWAPI_TCL_NAMESPACE "::_deferred_scripts",
+                                name, TCL_GLOBAL_ONLY);
+    if (deferredObj == NULL) {
+        /* The base script defines the commands needed for stubs */
+        if (! gBaseSettings.defer_cached_scripts ||
+            lstrcmpA(name, MODULENAME) == 0)
+            return Twapi_SourceResource(interp, hmod, name, 1);
+        deferredObj = TwapiScriptCacheGetCommands(hmod, name);
+        if (deferredObj == NULL)
+            return TwapiSourceAndRecordCommands(interp, hmod, name);
+    }
+
+    ObjIncrRefs(deferredObj);
+    objs[0] = STRING_LITERAL_OBJ("::" TWAPI_TCL_NAMESPACE "::Twapi_SourceResource");
+    objs[1] = ObjFromString(name);
+    objs[2] = ObjFromInt(1);
+    objs[3] = ObjFromHANDLE(hmod);
+    loaderObj = ObjNewList(4, objs);
+    ObjIncrRefs(loaderObj);
+
+    res = ObjGetElements(interp, deferredObj, &nns, &nsv);
+    if (res == TCL_OK && (nns & 1))
+        res = TwapiReturnErrorMsg(interp, TWAPI_INVALID_ARGS,
+                                  "Deferred script command list must have an even number of elements");
+    for (i = 0; res == TCL_OK && i < nns; i += 2) {
+        res = ObjGetElements(interp, nsv[i+1], &ncmds, &cmdv);
+        for (j = 0; res == TCL_OK && j < ncmds; ++j) {
+            cmdObj = Tcl_ObjPrintf("%s::%s", ObjToString(nsv[i]),
+                                   ObjToString(cmdv[j]));
+            ObjIncrRefs(cmdObj);
+            if (! Tcl_GetCommandInfo(interp, ObjToString(cmdObj), &cmdinfo) &&
+                Tcl_SetVar2Ex(interp, "::auto_index", ObjToString(cmdObj),
+                              loaderObj, TCL_GLOBAL_ONLY|TCL_LEAVE_ERR_MSG) == NULL)
+                res = TCL_ERROR;
+            ObjDecrRefs(cmdObj);
+        }
+    }
+
+    if (res == TCL_OK &&
+        Tcl_SetVar2Ex(interp, "::" TWAPI_TCL_NAMESPACE "::_script_loaders",
+                      name, loaderObj,
+                      TCL_GLOBAL_ONLY|TCL_LEAVE_ERR_MSG) == NULL)
+        res = TCL_ERROR;
+
+    ObjDecrRefs(loaderObj);
+    ObjDecrRefs(deferredObj);
+    return res;
+}
+
 /* Does basic default initialization of a module */
 TwapiInterpContext *TwapiRegisterModule(
     Tcl_Interp *interp,
@@ -770,6 +1073,7 @@ TwapiInterpContext *TwapiRegisterModule(
     TwapiInterpContext *ticP;
     char buf[100];
     Tcl_Obj *objP;
+    LARGE_INTEGER start;
 
     if (modP->finalizer && ! context_type) {
         /* Non-private context cannot be requested if finalizer is specified */
@@ -796,10 +1100,18 @@ TwapiInterpContext *TwapiRegisterModule(
 
     TWAPI_ASSERT(ticP);
 
-    /* Call SourceResource to either read from a resource or from
-       a script file if the resource does not exist. */
-    if ((modP->initializer && modP->initializer(interp, ticP) != TCL_OK) ||
-        Twapi_SourceResource(interp, hmod, modP->name, 1) != TCL_OK ||
+    QueryPerformanceCounter(&start);
+    if (modP->initializer && modP->initializer(interp, ticP) != TCL_OK) {
+        if (context_type)
+            TwapiInterpContextUnref(ticP, 1);
+        return NULL;
+    }
+    TwapiStartupProfileSet(interp, modP->name, "init",
+                           TwapiElapsedMicroseconds(&start));
+
+    /* Either read the script from a resource or from a script file if
+       the resource does not exist, unless deferred by the package index. */
+    if (TwapiSourceModuleScript(interp, hmod, modP->name) != TCL_OK ||
         Tcl_PkgProvide(interp, modP->name, MODULEVERSION) != TCL_OK
         ) {
         if (context_type)
@@ -6,6 +6,11 @@ extern OSVERSIONINFOW gTwapiOSVersionInfo;
 typedef struct _TwapiBaseSettings {
     unsigned int use_unicode_obj; /* Whether to use utf8 or wide chars when
                                      creating strings */
+    unsigned int cache_scripts;   /* Whether to keep decompressed module
+                                     scripts for other interps */
+    unsigned int defer_cached_scripts; /* Whether to defer evaluation of
+                                          module scripts already evaluated
+                                          in another interp */
 } TwapiBaseSettings;
 extern TwapiBaseSettings gBaseSettings;
 
@@ -45,6 +50,11 @@ TCL_RESULT TwapiCStructDefDump(Tcl_Interp *interp, Tcl_Obj *csObj);
 void TwapiFfiInit(Tcl_Interp *interp);
 
 TwapiTclObjCmd Twapi_ParseargsObjCmd;
+TwapiTclObjCmd Twapi_MakeSymbolicBitmaskObjCmd;
+TwapiTclObjCmd Twapi_ParseSymbolicBitmaskObjCmd;
+TwapiTclObjCmd Twapi_SwitchesToBitmaskObjCmd;
+TwapiTclObjCmd Twapi_BitmaskToSwitchesObjCmd;
+TwapiTclObjCmd Twapi_BitmaskToSymbolsObjCmd;
 TwapiTclObjCmd Twapi_TrapObjCmd;
 TwapiTclObjCmd Twapi_KlGetObjCmd;
 TwapiTclObjCmd Twapi_TwineObjCmd;
@@ -55,6 +65,11 @@ TwapiTclObjCmd Twapi_InternalCastObjCmd;
 TwapiTclObjCmd Twapi_GetTclTypeObjCmd;
 TwapiTclObjCmd Twapi_EnumPrintersLevel4ObjCmd;
 TwapiTclObjCmd Twapi_FfiCallObjCmd;
+TwapiTclObjCmd Twapi_FfiPrepareObjCmd;
+TwapiTclObjCmd Twapi_CStructDecodeObjCmd;
+TwapiTclObjCmd Twapi_CStructDecodePointerObjCmd;
+TwapiTclObjCmd Twapi_CStructViewObjCmd;
+TwapiTclObjCmd Twapi_CStructViewPointerObjCmd;
 #ifdef OBSOLETE
 TwapiTclObjCmd Twapi_FfiLoadObjCmd;
 TwapiTclObjCmd Twapi_Ffi0ObjCmd;
@@ -0,0 +1,462 @@
+/*
+ * Copyright (c) 2018, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ */
+
+/*
+ * Native DER tokenizer. Lets certificate extensions and name strings be
+ * decoded in a single pass over the encoding instead of a
+ * CryptDecodeObjectEx call, with its allocation and UTF-16 conversion,
+ * for every element. Every read is checked against the end of the
+ * buffer since the input is frequently untrusted (e.g. a peer's
+ * certificate).
+ */
+
+#ifdef CRYPTO_STANDALONE
+# ifdef _WIN32
+#  include <windows.h>
+# endif
+#else
+# include "twapi.h"
+# include "twapi_crypto.h"
+#endif
+
+#include <limits.h>
+#include <string.h>
+
+#include "asn1.h"
+
+size_t TwapiDerParse(const unsigned char *p, size_t n, TwapiDerTlv *tlvP)
+{
+    size_t pos, len, nlen;
+    unsigned long tag;
+
+    if (n < 2)
+        return 0;
+    tlvP->tagclass = p[0] >> 6;
+    tlvP->constructed = (p[0] & 0x20) != 0;
+    tag = p[0] & 0x1f;
+    pos = 1;
+    if (tag == 0x1f) {
+        /* High tag number form. Leading 0x80 is not minimal. */
+        if (p[1] == 0x80)
+            return 0;
+        tag = 0;
+        do {
+            if (pos >= n || tag > (ULONG_MAX >> 7))
+                return 0;
+            tag = (tag << 7) | (p[pos] & 0x7f);
+        } while (p[pos++] & 0x80);
+        if (tag < 0x1f)
+            return 0;
+    }
+    tlvP->tag = tag;
+
+    if (pos >= n)
+        return 0;
+    len = p[pos++];
+    if (len & 0x80) {
+        nlen = len & 0x7f;
+        /* 0 is the indefinite form which DER does not permit */
+        if (nlen == 0 || nlen > 4 || nlen > n - pos)
+            return 0;
+        len = 0;
+        while (nlen--)
+            len = (len << 8) | p[pos++];
+    }
+    if (len > n - pos)
+        return 0;
+    tlvP->valueP = p + pos;
+    tlvP->len = len;
+    return pos + len;
+}
+
+int TwapiDerValidate(const unsigned char *p, size_t n, int maxdepth)
+{
+    TwapiDerTlv tlv;
+    size_t used;
+
+    while (n) {
+        used = TwapiDerParse(p, n, &tlv);
+        if (used == 0)
+            return 0;
+        if (tlv.constructed) {
+            if (maxdepth <= 0 ||
+                !TwapiDerValidate(tlv.valueP, tlv.len, maxdepth - 1))
+                return 0;
+        }
+        p += used;
+        n -= used;
+    }
+    return 1;
+}
+
+/* Stores decimal representation of val in buf. Returns length. */
+static size_t FormatULong(unsigned long val, char *buf)
+{
+    char tmp[3 * sizeof(unsigned long)];
+    size_t i = 0, len;
+    do {
+        tmp[i++] = (char) ('0' + val % 10);
+        val /= 10;
+    } while (val);
+    len = i;
+    while (i)
+        *buf++ = tmp[--i];
+    return len;
+}
+
+size_t TwapiDerOidToString(const unsigned char *p, size_t n,
+                           char *buf, size_t bufsize)
+{
+    char arc[3 * sizeof(unsigned long)];
+    size_t pos = 0, out = 0, len;
+    unsigned long val;
+    int first = 1;
+
+    if (n == 0)
+        return 0;
+    while (pos < n) {
+        if (p[pos] == 0x80)
+            return 0;           /* Not minimal */
+        val = 0;
+        do {
+            if (pos >= n || val > (ULONG_MAX >> 7))
+                return 0;
+            val = (val << 7) | (p[pos] & 0x7f);
+        } while (p[pos++] & 0x80);
+
+        if (first) {
+            /* First subidentifier encodes the first two arcs */
+            unsigned long top = val < 40 ? 0 : (val < 80 ? 1 : 2);
+            len = FormatULong(top, arc);
+            arc[len++] = '.';
+            len += FormatULong(val - 40 * top, arc + len);
+            first = 0;
+        } else {
+            arc[0] = '.';
+            len = 1 + FormatULong(val, arc + 1);
+        }
+        if (len >= bufsize - out)
+            return 0;
+        memcpy(buf + out, arc, len);
+        out += len;
+    }
+    buf[out] = '\0';
+    return out;
+}
+
+size_t TwapiDerOidFromString(const char *oidP, unsigned char *buf,
+                             size_t bufsize)
+{
+    unsigned long arcs[2], val;
+    unsigned char tmp[(sizeof(unsigned long) * 8 + 6) / 7];
+    size_t out = 0, i;
+    int narcs = 0;
+
+    while (1) {
+        if (*oidP < '0' || *oidP > '9')
+            return 0;
+        if (*oidP == '0' && oidP[1] >= '0' && oidP[1] <= '9')
+            return 0;           /* No leading zeroes */
+        val = 0;
+        while (*oidP >= '0' && *oidP <= '9') {
+            if (val > (ULONG_MAX - 9) / 10)
+                return 0;
+            val = 10 * val + (*oidP++ - '0');
+        }
+        if (narcs < 2) {
+            arcs[narcs] = val;
+        }
+        ++narcs;
+        if (narcs == 2) {
+            if (arcs[0] > 2 || (arcs[0] < 2 && arcs[1] >= 40) ||
+                arcs[1] > ULONG_MAX - 80)
+                return 0;
+            val = 40 * arcs[0] + arcs[1];
+        }
+        if (narcs >= 2) {
+            i = sizeof(tmp);
+            do {
+                tmp[--i] = (unsigned char) ((val & 0x7f) | 0x80);
+                val >>= 7;
+            } while (val);
+            tmp[sizeof(tmp) - 1] &= 0x7f;
+            if (sizeof(tmp) - i > bufsize - out)
+                return 0;
+            memcpy(buf + out, tmp + i, sizeof(tmp) - i);
+            out += sizeof(tmp) - i;
+        }
+        if (*oidP == '\0')
+            break;
+        if (*oidP++ != '.')
+            return 0;
+    }
+    return narcs >= 2 ? out : 0;
+}
+
+int TwapiDerIntegerToWide(const unsigned char *p, size_t n, long long *valP)
+{
+    unsigned long long val;
+    size_t i;
+
+    if (n == 0 || n > 8)
+        return 0;
+    /* Sign extend */
+    val = (p[0] & 0x80) ? ~0ULL : 0;
+    for (i = 0; i < n; ++i)
+        val = (val << 8) | p[i];
+    *valP = (long long) val;
+    return 1;
+}
+
+/* Returns the value of 2 digits at p or -1 */
+static int TwoDigits(const unsigned char *p)
+{
+    if (p[0] < '0' || p[0] > '9' || p[1] < '0' || p[1] > '9')
+        return -1;
+    return 10 * (p[0] - '0') + (p[1] - '0');
+}
+
+int TwapiDerTimeToString(unsigned long tag, const unsigned char *p, size_t n,
+                         char buf[20])
+{
+    int century, year, fields[5], i;
+    size_t pos;
+    static const int maxes[5] = {12, 31, 23, 59, 60};
+
+    if (tag == TWAPI_DER_UTC_TIME) {
+        if (n != 13)
+            return 0;
+        year = TwoDigits(p);
+        if (year < 0)
+            return 0;
+        /* RFC 5280 4.1.2.5.1 */
+        century = year < 50 ? 20 : 19;
+        pos = 2;
+    } else if (tag == TWAPI_DER_GENERALIZED_TIME) {
+        if (n < 15)
+            return 0;
+        century = TwoDigits(p);
+        year = TwoDigits(p + 2);
+        if (century < 0 || year < 0)
+            return 0;
+        pos = 4;
+    } else
+        return 0;
+
+    for (i = 0; i < 5; ++i, pos += 2) {
+        fields[i] = TwoDigits(p + pos);
+        if (fields[i] < (i < 2 ? 1 : 0) || fields[i] > maxes[i])
+            return 0;
+    }
+    if (tag == TWAPI_DER_GENERALIZED_TIME && p[pos] == '.') {
+        /* Fractional seconds are dropped */
+        if (++pos == n - 1)
+            return 0;
+        while (pos < n - 1) {
+            if (p[pos] < '0' || p[pos] > '9')
+                return 0;
+            ++pos;
+        }
+    }
+    if (pos != n - 1 || p[pos] != 'Z')
+        return 0;
+
+    buf[0] = (char) ('0' + century / 10);
+    buf[1] = (char) ('0' + century % 10);
+    buf[2] = (char) ('0' + year / 10);
+    buf[3] = (char) ('0' + year % 10);
+    for (i = 0; i < 5; ++i) {
+        buf[4 + 3*i] = "-- ::"[i];
+        buf[5 + 3*i] = (char) ('0' + fields[i] / 10);
+        buf[6 + 3*i] = (char) ('0' + fields[i] % 10);
+    }
+    buf[19] = '\0';
+    return 1;
+}
+
+/* Returns non-0 if c is in the character set for the string type */
+static int DerCharAllowed(unsigned long tag, unsigned long c)
+{
+    switch (tag) {
+    case TWAPI_DER_NUMERIC_STRING:
+        return (c >= '0' && c <= '9') || c == ' ';
+    case TWAPI_DER_PRINTABLE_STRING:
+        return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') ||
+            (c >= '0' && c <= '9') ||
+            (c != 0 && strchr(" '()+,-./:=?", (int) c) != NULL);
+    case TWAPI_DER_VISIBLE_STRING:
+        return c >= 0x20 && c < 0x7f;
+    case TWAPI_DER_IA5_STRING:
+        return c < 0x80;
+    case TWAPI_DER_T61_STRING:
+    case TWAPI_DER_VIDEOTEX_STRING:
+    case TWAPI_DER_GRAPHIC_STRING:
+    case TWAPI_DER_GENERAL_STRING:
+        return c < 0x100;
+    case TWAPI_DER_BMP_STRING:
+        return c < 0x10000;
+    case TWAPI_DER_UTF8_STRING:
+    case TWAPI_DER_UNIVERSAL_STRING:
+        return c < 0x110000 && (c < 0xd800 || c > 0xdfff);
+    default:
+        return 0;
+    }
+}
+
+size_t TwapiDerStringToUnicode(unsigned long tag, const unsigned char *p,
+                               size_t n, unsigned long *outP)
+{
+    size_t i, nout = 0;
+    unsigned long c, min;
+    int extra;
+
+    switch (tag) {
+    case TWAPI_DER_UTF8_STRING:
+        for (i = 0; i < n; ) {
+            c = p[i++];
+            if (c < 0x80) {
+                outP[nout++] = c;
+                continue;
+            }
+            if (c >= 0xf0 && c < 0xf5) {
+                extra = 3;
+                min = 0x10000;
+                c &= 0x07;
+            } else if (c >= 0xe0 && c < 0xf0) {
+                extra = 2;
+                min = 0x800;
+                c &= 0x0f;
+            } else if (c >= 0xc2 && c < 0xe0) {
+                extra = 1;
+                min = 0x80;
+                c &= 0x1f;
+            } else
+                return (size_t) -1;
+            if ((size_t) extra > n - i)
+                return (size_t) -1;
+            while (extra--) {
+                if ((p[i] & 0xc0) != 0x80)
+                    return (size_t) -1;
+                c = (c << 6) | (p[i++] & 0x3f);
+            }
+            /* Reject overlong forms, surrogates and beyond U+10FFFF */
+            if (c < min || !DerCharAllowed(tag, c))
+                return (size_t) -1;
+            outP[nout++] = c;
+        }
+        return nout;
+
+    case TWAPI_DER_BMP_STRING:
+        if (n & 1)
+            return (size_t) -1;
+        for (i = 0; i < n; i += 2)
+            outP[nout++] = (p[i] << 8) | p[i+1];
+        return nout;
+
+    case TWAPI_DER_UNIVERSAL_STRING:
+        if (n & 3)
+            return (size_t) -1;
+        for (i = 0; i < n; i += 4) {
+            c = ((unsigned long) p[i] << 24) | (p[i+1] << 16) |
+                (p[i+2] << 8) | p[i+3];
+            if (!DerCharAllowed(tag, c))
+                return (size_t) -1;
+            outP[nout++] = c;
+        }
+        return nout;
+
+    case TWAPI_DER_NUMERIC_STRING:
+    case TWAPI_DER_PRINTABLE_STRING:
+    case TWAPI_DER_VISIBLE_STRING:
+    case TWAPI_DER_IA5_STRING:
+        /*
+         * Only checked to be 7 bit. Many issuers put characters such as
+         * @ and * in PrintableStrings and rejecting them helps no one.
+         */
+        for (i = 0; i < n; ++i) {
+            if (p[i] >= 0x80)
+                return (size_t) -1;
+            outP[i] = p[i];
+        }
+        return n;
+
+    case TWAPI_DER_T61_STRING:
+    case TWAPI_DER_VIDEOTEX_STRING:
+    case TWAPI_DER_GRAPHIC_STRING:
+    case TWAPI_DER_GENERAL_STRING:
+        for (i = 0; i < n; ++i)
+            outP[i] = p[i];
+        return n;
+
+    default:
+        return (size_t) -1;
+    }
+}
+
+size_t TwapiDerStringFromUnicode(unsigned long tag, const unsigned long *p,
+                                 size_t n, unsigned char *outP)
+{
+    size_t i, nout = 0;
+    unsigned long c;
+
+    for (i = 0; i < n; ++i) {
+        c = p[i];
+        if (!DerCharAllowed(tag, c))
+            return (size_t) -1;
+        switch (tag) {
+        case TWAPI_DER_UTF8_STRING:
+            if (c < 0x80) {
+                outP[nout++] = (unsigned char) c;
+            } else if (c < 0x800) {
+                outP[nout++] = (unsigned char) (0xc0 | (c >> 6));
+                outP[nout++] = (unsigned char) (0x80 | (c & 0x3f));
+            } else if (c < 0x10000) {
+                outP[nout++] = (unsigned char) (0xe0 | (c >> 12));
+                outP[nout++] = (unsigned char) (0x80 | ((c >> 6) & 0x3f));
+                outP[nout++] = (unsigned char) (0x80 | (c & 0x3f));
+            } else {
+                outP[nout++] = (unsigned char) (0xf0 | (c >> 18));
+                outP[nout++] = (unsigned char) (0x80 | ((c >> 12) & 0x3f));
+                outP[nout++] = (unsigned char) (0x80 | ((c >> 6) & 0x3f));
+                outP[nout++] = (unsigned char) (0x80 | (c & 0x3f));
+            }
+            break;
+        case TWAPI_DER_BMP_STRING:
+            outP[nout++] = (unsigned char) (c >> 8);
+            outP[nout++] = (unsigned char) c;
+            break;
+        case TWAPI_DER_UNIVERSAL_STRING:
+            outP[nout++] = (unsigned char) (c >> 24);
+            outP[nout++] = (unsigned char) (c >> 16);
+            outP[nout++] = (unsigned char) (c >> 8);
+            outP[nout++] = (unsigned char) c;
+            break;
+        default:
+            outP[nout++] = (unsigned char) c;
+            break;
+        }
+    }
+    return nout;
+}
+
+size_t TwapiDerEncodeHeader(unsigned long tag, size_t len,
+                            unsigned char *outP)
+{
+    size_t nlen, i;
+
+    outP[0] = (unsigned char) tag;
+    if (len < 0x80) {
+        outP[1] = (unsigned char) len;
+        return 2;
+    }
+    for (nlen = 1; nlen < sizeof(len) && (len >> (8 * nlen)) != 0; ++nlen)
+        ;
+    outP[1] = (unsigned char) (0x80 | nlen);
+    for (i = 0; i < nlen; ++i)
+        outP[2 + i] = (unsigned char) (len >> (8 * (nlen - 1 - i)));
+    return 2 + nlen;
+}
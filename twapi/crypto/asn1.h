@@ -0,0 +1,116 @@
+#ifndef TWAPI_ASN1_H
+#define TWAPI_ASN1_H
+
+/*
+ * Bounds checked DER (X.690) tokenizer.
+ * Builds standalone when CRYPTO_STANDALONE is defined.
+ *
+ * No function reads outside the buffer it is passed, whatever the
+ * content, and none allocate memory.
+ */
+
+#include <stddef.h>
+
+#define TWAPI_DER_UNIVERSAL   0
+#define TWAPI_DER_APPLICATION 1
+#define TWAPI_DER_CONTEXT     2
+#define TWAPI_DER_PRIVATE     3
+
+/* Universal tag numbers */
+#define TWAPI_DER_BOOLEAN           1
+#define TWAPI_DER_INTEGER           2
+#define TWAPI_DER_BIT_STRING        3
+#define TWAPI_DER_OCTET_STRING      4
+#define TWAPI_DER_NULL              5
+#define TWAPI_DER_OID               6
+#define TWAPI_DER_ENUMERATED        10
+#define TWAPI_DER_UTF8_STRING       12
+#define TWAPI_DER_SEQUENCE          16
+#define TWAPI_DER_SET               17
+#define TWAPI_DER_NUMERIC_STRING    18
+#define TWAPI_DER_PRINTABLE_STRING  19
+#define TWAPI_DER_T61_STRING        20
+#define TWAPI_DER_VIDEOTEX_STRING   21
+#define TWAPI_DER_IA5_STRING        22
+#define TWAPI_DER_UTC_TIME          23
+#define TWAPI_DER_GENERALIZED_TIME  24
+#define TWAPI_DER_GRAPHIC_STRING    25
+#define TWAPI_DER_VISIBLE_STRING    26
+#define TWAPI_DER_GENERAL_STRING    27
+#define TWAPI_DER_UNIVERSAL_STRING  28
+#define TWAPI_DER_BMP_STRING        30
+
+/* Nesting depth beyond which content is treated as malformed */
+#define TWAPI_DER_MAX_DEPTH 32
+
+typedef struct _TwapiDerTlv {
+    int tagclass;                 /* TWAPI_DER_UNIVERSAL etc. */
+    int constructed;
+    unsigned long tag;
+    const unsigned char *valueP;
+    size_t len;                   /* Length of value */
+} TwapiDerTlv;
+
+/*
+ * Parses the TLV at the start of p[0..n). Returns the total number of
+ * bytes in the encoding, or 0 if it is truncated, uses the indefinite
+ * length form or otherwise malformed.
+ */
+size_t TwapiDerParse(const unsigned char *p, size_t n, TwapiDerTlv *tlvP);
+
+/*
+ * Returns 1 if p[0..n) consists entirely of well formed TLVs including
+ * the content of constructed TLVs down to maxdepth levels.
+ */
+int TwapiDerValidate(const unsigned char *p, size_t n, int maxdepth);
+
+/*
+ * Formats an OID value as a dotted string in buf. Returns the length of
+ * the string, or 0 if malformed or buf is too small. Arcs that do not
+ * fit in an unsigned long are treated as malformed.
+ */
+size_t TwapiDerOidToString(const unsigned char *p, size_t n,
+                           char *buf, size_t bufsize);
+/* Encodes a dotted OID. Returns number of bytes, or 0 if invalid. */
+size_t TwapiDerOidFromString(const char *oidP, unsigned char *buf,
+                             size_t bufsize);
+
+/*
+ * Converts an INTEGER value to a native integer. Returns 0 if it is
+ * empty or does not fit.
+ */
+int TwapiDerIntegerToWide(const unsigned char *p, size_t n, long long *valP);
+
+/*
+ * Converts a UTCTime or GeneralizedTime value in Zulu time to
+ * "YYYY-MM-DD HH:MM:SS" in buf. Returns 0 if malformed.
+ */
+int TwapiDerTimeToString(unsigned long tag, const unsigned char *p, size_t n,
+                         char buf[20]);
+
+/*
+ * Converts a string value to Unicode code points in outP, which must
+ * have room for n code points. Returns the number of code points
+ * stored or (size_t)-1 if tag is not a string type or the value is
+ * invalid for it. Strings with 8 bit characters (T61 etc.) are treated
+ * as Latin-1.
+ */
+size_t TwapiDerStringToUnicode(unsigned long tag, const unsigned char *p,
+                               size_t n, unsigned long *outP);
+
+/*
+ * Converts code points to the value of a string of type tag in outP,
+ * which must have room for 4*n bytes. Returns number of bytes stored,
+ * or (size_t)-1 if a character cannot be represented.
+ */
+size_t TwapiDerStringFromUnicode(unsigned long tag, const unsigned long *p,
+                                 size_t n, unsigned char *outP);
+
+/*
+ * Stores the identifier and length octets for a universal primitive TLV
+ * in outP, which needs room for 6 bytes. Returns number of bytes.
+ */
+size_t TwapiDerEncodeHeader(unsigned long tag, size_t len,
+                            unsigned char *outP);
+
+#endif
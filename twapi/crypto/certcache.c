@@ -0,0 +1,170 @@
+/*
+ * Copyright (c) 2018, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ */
+
+/*
+ * Cache of decoded certificate information. Scripts iterating over
+ * stores or verifying chains call cert_info and friends on the same
+ * certificates over and over, each time decoding names, extensions and
+ * key information through CAPI. Certificates are immutable so the
+ * result can be remembered against a digest of the encoding. SHA-256
+ * is used by default since SHA-1 collisions can be manufactured and a
+ * colliding certificate would otherwise be reported with the
+ * information of another.
+ */
+
+#ifdef CRYPTO_STANDALONE
+# ifdef _WIN32
+#  include <windows.h>
+# endif
+# include <stdlib.h>
+# define CacheAlloc(n_) malloc(n_)
+# define CacheFree(p_) free(p_)
+#else
+# include "twapi.h"
+# include "twapi_crypto.h"
+# define CacheAlloc(n_) TwapiAlloc(n_)
+# define CacheFree(p_) TwapiFree(p_)
+#endif
+
+#include <string.h>
+
+#include "twapi_lru.h"
+#include "certcache.h"
+
+typedef struct _TwapiCertCacheEntry {
+    TwapiLruLink link;          /* Must be first */
+    TwapiCertCacheKey key;
+    void *valueP;
+} TwapiCertCacheEntry;
+
+struct _TwapiCertCache {
+    const TwapiHashAlg *algP;
+    size_t ndigest;
+    TwapiCertCacheFreeFn *freeFn;
+    TwapiLruTable table;
+    TwapiCertCacheStats stats;
+};
+
+TwapiCertCache *TwapiCertCacheNew(const TwapiHashAlg *algP, size_t maxentries,
+                                  TwapiCertCacheFreeFn *freeFn)
+{
+    TwapiCertCache *cacheP;
+
+    cacheP = CacheAlloc(sizeof(*cacheP));
+    if (cacheP == NULL)
+        return NULL;
+    memset(cacheP, 0, sizeof(*cacheP));
+    cacheP->algP = algP;
+    cacheP->ndigest = TwapiHashDigestSize(algP);
+    cacheP->freeFn = freeFn;
+    cacheP->stats.maxentries = maxentries;
+    cacheP->table.nbuckets = TwapiLruBucketCount(maxentries);
+    cacheP->table.bucketsP = CacheAlloc(cacheP->table.nbuckets * sizeof(cacheP->table.bucketsP[0]));
+    if (cacheP->table.bucketsP == NULL) {
+        CacheFree(cacheP);
+        return NULL;
+    }
+    TwapiLruReset(&cacheP->table);
+    return cacheP;
+}
+
+static void TwapiCertCacheFreeEntry(TwapiCertCache *cacheP,
+                                    TwapiCertCacheEntry *entryP)
+{
+    if (cacheP->freeFn)
+        cacheP->freeFn(entryP->valueP);
+    CacheFree(entryP);
+}
+
+void TwapiCertCacheClear(TwapiCertCache *cacheP)
+{
+    TwapiLruLink *linkP, *nextP;
+
+    for (linkP = cacheP->table.headP; linkP; linkP = nextP) {
+        nextP = linkP->lru_nextP;
+        TwapiCertCacheFreeEntry(cacheP, (TwapiCertCacheEntry *) linkP);
+    }
+    TwapiLruReset(&cacheP->table);
+    cacheP->stats.nentries = 0;
+}
+
+void TwapiCertCacheFree(TwapiCertCache *cacheP)
+{
+    TwapiCertCacheClear(cacheP);
+    CacheFree(cacheP->table.bucketsP);
+    CacheFree(cacheP);
+}
+
+const TwapiHashAlg *TwapiCertCacheAlg(TwapiCertCache *cacheP)
+{
+    return cacheP->algP;
+}
+
+void TwapiCertCacheKeyInit(TwapiCertCache *cacheP, const unsigned char *p,
+                           size_t n, TwapiCertCacheKey *keyP)
+{
+    TwapiHashCtx ctx;
+
+    TwapiHashInit(&ctx, cacheP->algP);
+    TwapiHashUpdate(&ctx, p, n);
+    TwapiHashFinal(&ctx, keyP->digest);
+    keyP->nencoded = n;
+}
+
+static size_t TwapiCertCacheHash(const TwapiCertCacheKey *keyP)
+{
+    /* The digest is already uniformly distributed */
+    return keyP->digest[0] | (keyP->digest[1] << 8) |
+        (keyP->digest[2] << 16) | ((size_t) keyP->digest[3] << 24);
+}
+
+void *TwapiCertCacheLookup(TwapiCertCache *cacheP, const TwapiCertCacheKey *keyP)
+{
+    TwapiLruLink *linkP;
+    TwapiCertCacheEntry *entryP;
+    size_t hash = TwapiCertCacheHash(keyP);
+
+    for (linkP = TwapiLruBucket(&cacheP->table, hash); linkP; linkP = linkP->hash_nextP) {
+        entryP = (TwapiCertCacheEntry *) linkP;
+        if (linkP->hash == hash && entryP->key.nencoded == keyP->nencoded &&
+            memcmp(entryP->key.digest, keyP->digest, cacheP->ndigest) == 0) {
+            cacheP->stats.hits++;
+            TwapiLruTouch(&cacheP->table, linkP);
+            return entryP->valueP;
+        }
+    }
+    cacheP->stats.misses++;
+    return NULL;
+}
+
+int TwapiCertCacheInsert(TwapiCertCache *cacheP, const TwapiCertCacheKey *keyP,
+                         void *valueP)
+{
+    TwapiCertCacheEntry *entryP;
+
+    if (cacheP->stats.maxentries == 0)
+        return 0;
+    if (cacheP->stats.nentries >= cacheP->stats.maxentries) {
+        entryP = (TwapiCertCacheEntry *) TwapiLruRemoveTail(&cacheP->table);
+        TwapiCertCacheFreeEntry(cacheP, entryP);
+        cacheP->stats.nentries--;
+        cacheP->stats.evictions++;
+    }
+    entryP = CacheAlloc(sizeof(*entryP));
+    if (entryP == NULL)
+        return 0;
+    entryP->key = *keyP;
+    entryP->valueP = valueP;
+    TwapiLruAdd(&cacheP->table, &entryP->link, TwapiCertCacheHash(keyP));
+    cacheP->stats.nentries++;
+    return 1;
+}
+
+void TwapiCertCacheGetStats(TwapiCertCache *cacheP, TwapiCertCacheStats *statsP)
+{
+    *statsP = cacheP->stats;
+}
@@ -0,0 +1,64 @@
+#ifndef TWAPI_CERTCACHE_H
+#define TWAPI_CERTCACHE_H
+
+/*
+ * Bounded cache of values decoded from encoded certificates, keyed by
+ * a digest of the encoding. The least recently used entry is evicted
+ * when full. The cache does not interpret the values and is not thread
+ * safe; callers keep one per interpreter.
+ * Builds standalone when CRYPTO_STANDALONE is defined.
+ */
+
+#include "hash.h"
+
+typedef struct _TwapiCertCache TwapiCertCache;
+
+/* Called for values when evicted or when the cache is cleared or freed */
+typedef void TwapiCertCacheFreeFn(void *valueP);
+
+typedef struct _TwapiCertCacheStats {
+    TwapiHashU64 hits;
+    TwapiHashU64 misses;
+    TwapiHashU64 evictions;
+    size_t nentries;
+    size_t maxentries;
+} TwapiCertCacheStats;
+
+/*
+ * Returns a new cache holding at most maxentries values keyed by the
+ * algP digest, or NULL if out of memory. A maxentries of 0 disables
+ * caching.
+ */
+TwapiCertCache *TwapiCertCacheNew(const TwapiHashAlg *algP, size_t maxentries,
+                                  TwapiCertCacheFreeFn *freeFn);
+void TwapiCertCacheFree(TwapiCertCache *cacheP);
+void TwapiCertCacheClear(TwapiCertCache *cacheP);
+const TwapiHashAlg *TwapiCertCacheAlg(TwapiCertCache *cacheP);
+
+/*
+ * Digest of an encoded certificate for use with the functions below.
+ * Computing it once lets the caller look up and then insert on a miss
+ * without hashing twice.
+ */
+typedef struct _TwapiCertCacheKey {
+    unsigned char digest[TWAPI_HASH_MAX_DIGEST_SIZE];
+    size_t nencoded;            /* Also compared as a cheap extra check */
+} TwapiCertCacheKey;
+
+void TwapiCertCacheKeyInit(TwapiCertCache *cacheP, const unsigned char *p,
+                           size_t n, TwapiCertCacheKey *keyP);
+
+/* Returns the cached value or NULL. Updates the hit and miss counts. */
+void *TwapiCertCacheLookup(TwapiCertCache *cacheP, const TwapiCertCacheKey *keyP);
+
+/*
+ * Adds a value, which must not already be present, taking ownership of
+ * it. Returns 0 if it could not be added, in which case the caller
+ * still owns the value.
+ */
+int TwapiCertCacheInsert(TwapiCertCache *cacheP, const TwapiCertCacheKey *keyP,
+                         void *valueP);
+
+void TwapiCertCacheGetStats(TwapiCertCache *cacheP, TwapiCertCacheStats *statsP);
+
+#endif
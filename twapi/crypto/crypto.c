@@ -36,6 +36,10 @@
 #include "twapi.h"
 #include "twapi_crypto.h"
 #include "pbkdf2.h"
+#include "hash.h"
+#include "pem.h"
+#include "asn1.h"
+#include "certcache.h"
 #include <mscat.h>
 
 #ifndef TWAPI_SINGLE_MODULE
@@ -64,6 +68,7 @@ static TCL_RESULT TwapiCryptDecodeObject(
     void *penc,
     DWORD nenc,
     Tcl_Obj **objPP);
+static Tcl_Obj *TwapiDerDecodeKnown(DWORD_PTR dwoid, const unsigned char *p, DWORD n);
 static BOOL WINAPI TwapiCertFreeCertificateChain(
   PCCERT_CHAIN_CONTEXT chainP
     );
@@ -1390,6 +1395,12 @@ static TCL_RESULT TwapiCryptDecodeObject(
         }
     }
 
+    objP = TwapiDerDecodeKnown(dwoid, penc, nenc);
+    if (objP) {
+        *objPP = objP;
+        return TCL_OK;
+    }
+
     if (! CryptDecodeObjectEx(
             X509_ASN_ENCODING|PKCS_7_ASN_ENCODING,
             oid, penc, nenc,
@@ -4195,6 +4206,163 @@ vamoose:
     return res;
 }
 
+/* Formats a validity time as "YYYY-MM-DD HH:MM:SS" UTC */
+static Tcl_Obj *ObjFromCertTime(FILETIME *ftP)
+{
+    SYSTEMTIME st;
+    char buf[32];
+
+    if (! FileTimeToSystemTime(ftP, &st))
+        return ObjFromFILETIME(ftP);
+    _snprintf(buf, sizeof(buf), "%04u-%02u-%02u %02u:%02u:%02u",
+              st.wYear, st.wMonth, st.wDay,
+              st.wHour, st.wMinute, st.wSecond);
+    return ObjFromString(buf);
+}
+
+/*
+ * Returns the dictionary returned by cert_info. It is built entirely
+ * here, including the time formatting, so a cached result can be
+ * returned as is.
+ */
+static Tcl_Obj *ObjFromCERT_INFO(CERT_INFO *ciP)
+{
+    Tcl_Obj *objs[22];
+
+    objs[0] = STRING_LITERAL_OBJ("-version");
+    objs[1] = ObjFromInt(ciP->dwVersion);
+    objs[2] = STRING_LITERAL_OBJ("-serialnumber");
+    objs[3] = ObjFromCRYPT_BLOB(&ciP->SerialNumber);
+    objs[4] = STRING_LITERAL_OBJ("-signaturealgorithm");
+    objs[5] = ObjFromCRYPT_ALGORITHM_IDENTIFIER(&ciP->SignatureAlgorithm);
+    objs[6] = STRING_LITERAL_OBJ("-issuer");
+    objs[7] = ObjFromCERT_NAME_BLOB(&ciP->Issuer, CERT_X500_NAME_STR);
+    objs[8] = STRING_LITERAL_OBJ("-start");
+    objs[9] = ObjFromCertTime(&ciP->NotBefore);
+    objs[10] = STRING_LITERAL_OBJ("-end");
+    objs[11] = ObjFromCertTime(&ciP->NotAfter);
+    objs[12] = STRING_LITERAL_OBJ("-subject");
+    objs[13] = ObjFromCERT_NAME_BLOB(&ciP->Subject, CERT_X500_NAME_STR);
+    objs[14] = STRING_LITERAL_OBJ("-publickey");
+    objs[15] = ObjFromCERT_PUBLIC_KEY_INFO(&ciP->SubjectPublicKeyInfo);
+    objs[16] = STRING_LITERAL_OBJ("-issuerid");
+    objs[17] = ObjFromCRYPT_BIT_BLOB(&ciP->IssuerUniqueId);
+    objs[18] = STRING_LITERAL_OBJ("-subjectid");
+    objs[19] = ObjFromCRYPT_BIT_BLOB(&ciP->SubjectUniqueId);
+    objs[20] = STRING_LITERAL_OBJ("-extensions");
+    objs[21] = ObjFromCERT_EXTENSIONS(ciP->cExtension, ciP->rgExtension);
+    return ObjNewList(22, objs);
+}
+
+static void TwapiCertInfoCacheFreeObj(void *pv)
+{
+    ObjDecrRefs((Tcl_Obj *) pv);
+}
+
+/*
+ * Returns the cert_info dictionary for a certificate context. Results are
+ * cached per interpreter since scripts tend to look at the same
+ * certificates repeatedly, e.g. when iterating over stores.
+ */
+static TCL_RESULT Twapi_CertGetInfoObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiInterpContext *ticP = (TwapiInterpContext*) clientdata;
+    TwapiCertCache *cacheP = CRYPTO_CONTEXT(ticP)->certinfo_cacheP;
+    TwapiCertCacheKey key;
+    PCCERT_CONTEXT certP;
+    Tcl_Obj *objP;
+
+    if (TwapiGetArgs(interp, objc-1, objv+1,
+                     GETVERIFIEDPTR(certP, PCCERT_CONTEXT, CertFreeCertificateContext),
+                     ARGEND) != TCL_OK)
+        return TCL_ERROR;
+
+    if (certP->pCertInfo == NULL)
+        return TCL_OK;
+
+    if (certP->pbCertEncoded == NULL || certP->cbCertEncoded == 0)
+        return ObjSetResult(interp, ObjFromCERT_INFO(certP->pCertInfo));
+
+    /*
+     * The encoding is hashed rather than using the CAPI thumbprint
+     * properties since those are persisted by stores and can be set
+     * to any value.
+     */
+    TwapiCertCacheKeyInit(cacheP, certP->pbCertEncoded, certP->cbCertEncoded, &key);
+    objP = TwapiCertCacheLookup(cacheP, &key);
+    if (objP)
+        return ObjSetResult(interp, objP);
+
+    objP = ObjFromCERT_INFO(certP->pCertInfo);
+    ObjSetResult(interp, objP);
+    ObjIncrRefs(objP);
+    if (! TwapiCertCacheInsert(cacheP, &key, objP))
+        ObjDecrRefs(objP);
+    return TCL_OK;
+}
+
+static TCL_RESULT Twapi_CertInfoCacheStatsObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiInterpContext *ticP = (TwapiInterpContext*) clientdata;
+    TwapiCertCache *cacheP = CRYPTO_CONTEXT(ticP)->certinfo_cacheP;
+    TwapiCertCacheStats stats;
+    Tcl_Obj *objs[12];
+
+    CHECK_NARGS(interp, objc, 1);
+    TwapiCertCacheGetStats(cacheP, &stats);
+    objs[0] = STRING_LITERAL_OBJ("hits");
+    objs[1] = ObjFromWideInt(stats.hits);
+    objs[2] = STRING_LITERAL_OBJ("misses");
+    objs[3] = ObjFromWideInt(stats.misses);
+    objs[4] = STRING_LITERAL_OBJ("evictions");
+    objs[5] = ObjFromWideInt(stats.evictions);
+    objs[6] = STRING_LITERAL_OBJ("entries");
+    objs[7] = ObjFromWideInt(stats.nentries);
+    objs[8] = STRING_LITERAL_OBJ("maxentries");
+    objs[9] = ObjFromWideInt(stats.maxentries);
+    objs[10] = STRING_LITERAL_OBJ("hash");
+    objs[11] = ObjFromString(TwapiHashAlgName(TwapiCertCacheAlg(cacheP)));
+    return ObjSetResult(interp, ObjNewList(12, objs));
+}
+
+/* Replaces the cache, discarding its contents and counters */
+static TCL_RESULT Twapi_CertInfoCacheConfigureObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiInterpContext *ticP = (TwapiInterpContext*) clientdata;
+    TwapiCertCache *cacheP;
+    const TwapiHashAlg *algP;
+    int maxentries;
+    char *hashP;
+
+    if (TwapiGetArgs(interp, objc-1, objv+1,
+                     GETINT(maxentries), GETASTR(hashP),
+                     ARGEND) != TCL_OK)
+        return TCL_ERROR;
+
+    algP = TwapiHashAlgFromName(hashP);
+    if (algP == NULL || (strcmp(TwapiHashAlgName(algP), "sha1") &&
+                         strcmp(TwapiHashAlgName(algP), "sha256")))
+        return TwapiReturnErrorMsg(interp, TWAPI_INVALID_ARGS,
+                                   "Cache hash must be sha1 or sha256");
+    if (maxentries < 0)
+        return TwapiReturnErrorMsg(interp, TWAPI_INVALID_ARGS,
+                                   "Cache size must not be negative");
+
+    /* TwapiAlloc panics rather than fail so cacheP is never NULL */
+    cacheP = TwapiCertCacheNew(algP, maxentries, TwapiCertInfoCacheFreeObj);
+    TwapiCertCacheFree(CRYPTO_CONTEXT(ticP)->certinfo_cacheP);
+    CRYPTO_CONTEXT(ticP)->certinfo_cacheP = cacheP;
+    return TCL_OK;
+}
+
+static TCL_RESULT Twapi_CertInfoCacheClearObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiInterpContext *ticP = (TwapiInterpContext*) clientdata;
+    CHECK_NARGS(interp, objc, 1);
+    TwapiCertCacheClear(CRYPTO_CONTEXT(ticP)->certinfo_cacheP);
+    return TCL_OK;
+}
+
 static TCL_RESULT Twapi_CryptoCallObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 {
     TwapiResult result;
@@ -4296,7 +4464,6 @@ static TCL_RESULT Twapi_CryptoCallObjCmd(ClientData clientdata, Tcl_Interp *inte
         
     case 10004:
     case 10015:
-    case 10035:
     case 10036:
     case 10041:
         if (TwapiGetArgs(interp, objc, objv,
@@ -4320,28 +4487,6 @@ static TCL_RESULT Twapi_CryptoCallObjCmd(ClientData clientdata, Tcl_Interp *inte
                 result.type = TRT_OBJV;
             }
             /* else empty result - TBD */
-            break;
-        case 10035: //Twapi_CertGetInfo
-            ciP = certP->pCertInfo;
-            if (ciP) {
-                objs[0] = ObjFromInt(ciP->dwVersion);
-                objs[1] = ObjFromCRYPT_BLOB(&ciP->SerialNumber);
-                objs[2] = ObjFromCRYPT_ALGORITHM_IDENTIFIER(&ciP->SignatureAlgorithm);
-                objs[3] = ObjFromCERT_NAME_BLOB(&ciP->Issuer, CERT_X500_NAME_STR);
-                objs[4] = ObjFromFILETIME(&ciP->NotBefore);
-                objs[5] = ObjFromFILETIME(&ciP->NotAfter);
-                objs[6] = ObjFromCERT_NAME_BLOB(&ciP->Subject, CERT_X500_NAME_STR);
-                objs[7] = ObjFromCERT_PUBLIC_KEY_INFO(&ciP->SubjectPublicKeyInfo);
-                objs[8] = ObjFromCRYPT_BIT_BLOB(&ciP->IssuerUniqueId);
-                objs[9] = ObjFromCRYPT_BIT_BLOB(&ciP->SubjectUniqueId);
-                objs[10] = ObjFromCERT_EXTENSIONS(ciP->cExtension, ciP->rgExtension);
-                result.value.objv.nobj = 11;
-            } else
-                result.value.objv.nobj = 0;
-
-            result.value.objv.objPP = objs;
-            result.type = TRT_OBJV;
-
             break;
         case 10036: //Twapi_CertGetExtensions
             ciP = certP->pCertInfo;
@@ -5510,6 +5655,737 @@ static int Twapi_WinVerifyTrustObjCmd(ClientData clientdata, Tcl_Interp *interp,
     return ret;
 }
 
+/*
+ * Native streaming hashes. The contexts are registered as TWAPI_HASH
+ * pointers with TwapiHashStreamFree as the verifier.
+ */
+static void TwapiHashStreamFree(TwapiHmacCtx *ctxP)
+{
+    SecureZeroMemory(ctxP, sizeof(*ctxP));
+    TwapiFree(ctxP);
+}
+
+/* Accepts a CALG_* value or a name such as sha256 or sha_256 */
+static const TwapiHashAlg *TwapiHashAlgFromObj(Tcl_Interp *interp, Tcl_Obj *objP)
+{
+    const TwapiHashAlg *algP = NULL;
+    int alg_id;
+
+    if (ObjToInt(NULL, objP, &alg_id) == TCL_OK) {
+        switch (alg_id) {
+        case CALG_MD5: algP = TwapiHashAlgFromName("md5"); break;
+        case CALG_SHA1: algP = TwapiHashAlgFromName("sha1"); break;
+        case CALG_SHA_256: algP = TwapiHashAlgFromName("sha256"); break;
+        case CALG_SHA_384: algP = TwapiHashAlgFromName("sha384"); break;
+        case CALG_SHA_512: algP = TwapiHashAlgFromName("sha512"); break;
+        }
+    } else
+        algP = TwapiHashAlgFromName(ObjToString(objP));
+
+    if (algP == NULL)
+        TwapiReturnErrorMsg(interp, TWAPI_INVALID_ARGS,
+                            "Unsupported hash algorithm");
+    return algP;
+}
+
+/* Initializes ctxP as a HMAC if keyObj is a concealed key, else a hash */
+static TCL_RESULT TwapiHashStreamInit(TwapiInterpContext *ticP,
+                                      TwapiHmacCtx *ctxP,
+                                      Tcl_Obj *algObj, Tcl_Obj *keyObj)
+{
+    const TwapiHashAlg *algP;
+    MemLifoMarkHandle mark;
+    unsigned char *keyP;
+    int nkey;
+
+    algP = TwapiHashAlgFromObj(ticP->interp, algObj);
+    if (algP == NULL)
+        return TCL_ERROR;
+
+    if (keyObj == NULL) {
+        TwapiHmacInit(ctxP, algP, NULL, 0);
+        return TCL_OK;
+    }
+
+    TWAPI_ASSERT(ticP->memlifoP == SWS());
+    mark = MemLifoPushMark(ticP->memlifoP);
+    keyP = ObjDecryptBytesExSWS(ticP->interp, keyObj, 0, &nkey);
+    if (keyP == NULL) {
+        MemLifoPopMark(mark);
+        return TCL_ERROR;
+    }
+    TwapiHmacInit(ctxP, algP, keyP, nkey);
+    SecureZeroMemory(keyP, nkey);
+    MemLifoPopMark(mark);
+    return TCL_OK;
+}
+
+static TCL_RESULT TwapiHashStreamResult(Tcl_Interp *interp, TwapiHmacCtx *ctxP)
+{
+    unsigned char digest[TWAPI_HASH_MAX_DIGEST_SIZE];
+    DWORD ndigest = TwapiHashDigestSize(ctxP->inner.algP);
+
+    TwapiHmacFinal(ctxP, digest);
+    return ObjSetResult(interp, ObjFromByteArray(digest, ndigest));
+}
+
+static int Twapi_HashObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiInterpContext *ticP = (TwapiInterpContext*) clientdata;
+    Tcl_Obj *algObj, *keyObj;
+    unsigned char *dataP;
+    int ndata;
+    TwapiHmacCtx ctx;
+
+    keyObj = NULL;
+    if (TwapiGetArgs(interp, objc-1, objv+1,
+                     GETOBJ(algObj), GETBA(dataP, ndata), ARGUSEDEFAULT,
+                     GETOBJ(keyObj), ARGEND) != TCL_OK)
+        return TCL_ERROR;
+
+    if (TwapiHashStreamInit(ticP, &ctx, algObj, keyObj) != TCL_OK)
+        return TCL_ERROR;
+    TwapiHmacUpdate(&ctx, dataP, ndata);
+    return TwapiHashStreamResult(interp, &ctx);
+}
+
+static int Twapi_HashCreateObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiInterpContext *ticP = (TwapiInterpContext*) clientdata;
+    Tcl_Obj *algObj, *keyObj;
+    TwapiHmacCtx *ctxP;
+
+    keyObj = NULL;
+    if (TwapiGetArgs(interp, objc-1, objv+1,
+                     GETOBJ(algObj), ARGUSEDEFAULT, GETOBJ(keyObj),
+                     ARGEND) != TCL_OK)
+        return TCL_ERROR;
+
+    ctxP = TwapiAlloc(sizeof(*ctxP));
+    if (TwapiHashStreamInit(ticP, ctxP, algObj, keyObj) != TCL_OK ||
+        TwapiRegisterPointer(interp, ctxP, TwapiHashStreamFree) != TCL_OK) {
+        TwapiHashStreamFree(ctxP);
+        return TCL_ERROR;
+    }
+    return ObjSetResult(interp, ObjFromOpaque(ctxP, "TWAPI_HASH"));
+}
+
+static int Twapi_HashUpdateObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiHmacCtx *ctxP;
+    unsigned char *dataP;
+    int ndata;
+
+    if (TwapiGetArgs(interp, objc-1, objv+1,
+                     GETVERIFIEDPTR(ctxP, TWAPI_HASH, TwapiHashStreamFree),
+                     GETBA(dataP, ndata), ARGEND) != TCL_OK)
+        return TCL_ERROR;
+    TwapiHmacUpdate(ctxP, dataP, ndata);
+    return TCL_OK;
+}
+
+/*
+ * Hashes channel content until end of file, until the channel would
+ * block, or until maxbytes bytes have been read if maxbytes is not
+ * negative. The data is fed to the hash directly without creating Tcl
+ * objects. The channel should be configured for binary translation by
+ * the caller. Returns the number of bytes hashed.
+ */
+static int Twapi_HashUpdateChannelObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiHmacCtx *ctxP;
+    Tcl_Channel chan;
+    Tcl_WideInt maxbytes, total;
+    char *chan_name;
+    char *bufP;
+    int mode, nread, nwant;
+    const int bufsize = 65536;
+
+    maxbytes = -1;
+    if (TwapiGetArgs(interp, objc-1, objv+1,
+                     GETVERIFIEDPTR(ctxP, TWAPI_HASH, TwapiHashStreamFree),
+                     GETASTR(chan_name), ARGUSEDEFAULT,
+                     GETWIDE(maxbytes), ARGEND) != TCL_OK)
+        return TCL_ERROR;
+
+    chan = Tcl_GetChannel(interp, chan_name, &mode);
+    if (chan == NULL)
+        return TCL_ERROR;
+    if (! (mode & TCL_READABLE))
+        return TwapiReturnErrorMsg(interp, TWAPI_INVALID_ARGS,
+                                   "Channel is not open for reading");
+
+    bufP = TwapiAlloc(bufsize);
+    total = 0;
+    while (maxbytes < 0 || total < maxbytes) {
+        nwant = bufsize;
+        if (maxbytes >= 0 && (maxbytes - total) < nwant)
+            nwant = (int) (maxbytes - total);
+        nread = Tcl_Read(chan, bufP, nwant);
+        if (nread < 0) {
+            TwapiFree(bufP);
+            Tcl_SetObjResult(interp,
+                             Tcl_ObjPrintf("Error reading channel %s: %s",
+                                           chan_name, Tcl_PosixError(interp)));
+            return TCL_ERROR;
+        }
+        TwapiHmacUpdate(ctxP, (unsigned char *) bufP, nread);
+        total += nread;
+        if (nread < nwant)
+            break;              /* EOF or would block */
+    }
+    TwapiFree(bufP);
+    return ObjSetResult(interp, ObjFromWideInt(total));
+}
+
+/* Returns the digest and frees the context */
+static int Twapi_HashFinalObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiHmacCtx *ctxP;
+
+    if (TwapiGetArgs(interp, objc-1, objv+1,
+                     GETVERIFIEDPTR(ctxP, TWAPI_HASH, TwapiHashStreamFree),
+                     ARGEND) != TCL_OK
+        || TwapiUnregisterPointer(interp, ctxP, TwapiHashStreamFree) != TCL_OK)
+        return TCL_ERROR;
+    TwapiHashStreamResult(interp, ctxP);
+    TwapiHashStreamFree(ctxP);
+    return TCL_OK;
+}
+
+static int Twapi_HashFreeObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiHmacCtx *ctxP;
+
+    if (TwapiGetArgs(interp, objc-1, objv+1,
+                     GETVERIFIEDPTR(ctxP, TWAPI_HASH, TwapiHashStreamFree),
+                     ARGEND) != TCL_OK
+        || TwapiUnregisterPointer(interp, ctxP, TwapiHashStreamFree) != TCL_OK)
+        return TCL_ERROR;
+    TwapiHashStreamFree(ctxP);
+    return TCL_OK;
+}
+
+/*
+ * PEM and base64 text is ASCII so for byte arrays, e.g. from files read
+ * in binary mode, use the bytes directly instead of generating a string
+ * representation.
+ */
+static const char *TwapiPemChars(Tcl_Obj *objP, int *nP)
+{
+    if (TwapiGetTclType(objP) == TWAPI_TCLTYPE_BYTEARRAY)
+        return (const char *) ObjToByteArray(objP, nP);
+    return ObjToStringN(objP, nP);
+}
+
+static TCL_RESULT TwapiBase64DecodeObj(Tcl_Interp *interp, const char *p,
+                                       size_t n, Tcl_Obj **objPP)
+{
+    Tcl_Obj *objP;
+    void *pv;
+    size_t nbytes;
+
+    objP = ObjAllocateByteArray((int) TWAPI_BASE64_DECODED_MAX(n), &pv);
+    if (TwapiBase64Decode(p, n, pv, &nbytes) != 0) {
+        ObjDecrRefs(objP);
+        return TwapiReturnErrorMsg(interp, TWAPI_INVALID_DATA,
+                                   "Invalid base64 data");
+    }
+    Tcl_SetByteArrayLength(objP, (int) nbytes);
+    *objPP = objP;
+    return TCL_OK;
+}
+
+/*
+ * Decodes up to maxblocks (all if not positive) PEM blocks and returns
+ * a flat list of labels and binary content. Data without a BEGIN line
+ * is decoded as plain base64 and returned with an empty label.
+ */
+static int Twapi_PemDecodeObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    Tcl_Obj *dataObj, *resultObj, *objs[2];
+    TwapiPemBlock block;
+    const char *p;
+    int n, maxblocks, nblocks, status;
+
+    maxblocks = 0;
+    if (TwapiGetArgs(interp, objc-1, objv+1,
+                     GETOBJ(dataObj), ARGUSEDEFAULT, GETINT(maxblocks),
+                     ARGEND) != TCL_OK)
+        return TCL_ERROR;
+
+    p = TwapiPemChars(dataObj, &n);
+    resultObj = ObjNewList(0, NULL);
+    nblocks = 0;
+    while (maxblocks <= 0 || nblocks < maxblocks) {
+        status = TwapiPemNext(p, n, &block);
+        if (status == 0) {
+            if (nblocks)
+                break;
+            /* No PEM header, treat as base64 */
+            block.labelP = "";
+            block.nlabel = 0;
+            block.bodyP = p;
+            block.nbody = n;
+            block.next = n;
+        }
+        if (status < 0) {
+            ObjDecrRefs(resultObj);
+            return TwapiReturnErrorMsg(interp, TWAPI_INVALID_DATA,
+                                       "Invalid or truncated PEM block");
+        }
+        if (TwapiBase64DecodeObj(interp, block.bodyP, block.nbody,
+                                 &objs[1]) != TCL_OK) {
+            ObjDecrRefs(resultObj);
+            return TCL_ERROR;
+        }
+        objs[0] = ObjFromStringN(block.labelP, (int) block.nlabel);
+        ObjAppendElement(NULL, resultObj, objs[0]);
+        ObjAppendElement(NULL, resultObj, objs[1]);
+        ++nblocks;
+        p += block.next;
+        n -= (int) block.next;
+    }
+    return ObjSetResult(interp, resultObj);
+}
+
+/* Returns a PEM block with label LABEL for binary content */
+static int Twapi_PemEncodeObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    Tcl_Obj *resultObj;
+    unsigned char *binP;
+    char *labelP;
+    int nbin, nlabel;
+    size_t nchars;
+
+    if (TwapiGetArgs(interp, objc-1, objv+1,
+                     GETBA(binP, nbin), GETASTRN(labelP, nlabel),
+                     ARGEND) != TCL_OK)
+        return TCL_ERROR;
+
+    /* Encode straight into the string representation of the result */
+    nchars = TwapiPemEncodedSize(nlabel, nbin);
+    resultObj = Tcl_NewObj();
+    Tcl_SetObjLength(resultObj, (int) nchars);
+    TwapiPemEncode(labelP, nlabel, binP, nbin, Tcl_GetString(resultObj));
+    return ObjSetResult(interp, resultObj);
+}
+
+static int Twapi_IsPemObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    const char *p;
+    int n;
+
+    CHECK_NARGS(interp, objc, 2);
+    p = TwapiPemChars(objv[1], &n);
+    return ObjSetResult(interp, ObjFromBoolean(TwapiIsPem(p, n)));
+}
+
+/*
+ * Native DER decoding.
+ */
+
+/* X509_UNICODE_ANY_STRING value types for DER string tags, 0 if none */
+static DWORD TwapiDerTagToRdnType(unsigned long tag)
+{
+    switch (tag) {
+    case TWAPI_DER_NUMERIC_STRING: return CERT_RDN_NUMERIC_STRING;
+    case TWAPI_DER_PRINTABLE_STRING: return CERT_RDN_PRINTABLE_STRING;
+    case TWAPI_DER_T61_STRING: return CERT_RDN_TELETEX_STRING;
+    case TWAPI_DER_VIDEOTEX_STRING: return CERT_RDN_VIDEOTEX_STRING;
+    case TWAPI_DER_IA5_STRING: return CERT_RDN_IA5_STRING;
+    case TWAPI_DER_GRAPHIC_STRING: return CERT_RDN_GRAPHIC_STRING;
+    case TWAPI_DER_VISIBLE_STRING: return CERT_RDN_VISIBLE_STRING;
+    case TWAPI_DER_GENERAL_STRING: return CERT_RDN_GENERAL_STRING;
+    case TWAPI_DER_UNIVERSAL_STRING: return CERT_RDN_UNIVERSAL_STRING;
+    case TWAPI_DER_BMP_STRING: return CERT_RDN_BMP_STRING;
+    case TWAPI_DER_UTF8_STRING: return CERT_RDN_UTF8_STRING;
+    default: return 0;
+    }
+}
+
+static unsigned long TwapiRdnTypeToDerTag(int rdntype)
+{
+    unsigned long tag;
+    for (tag = 1; tag <= TWAPI_DER_BMP_STRING; ++tag) {
+        if (TwapiDerTagToRdnType(tag) == (DWORD) rdntype)
+            return tag;
+    }
+    return 0;
+}
+
+/*
+ * Returns a string object for a DER string value or NULL if it is not
+ * valid for the type. If bmp_only is set, characters outside the BMP
+ * also result in NULL.
+ */
+static Tcl_Obj *ObjFromDerString(unsigned long tag, const unsigned char *p,
+                                 size_t n, int bmp_only)
+{
+    unsigned long *codesP;
+    WCHAR *wP;
+    size_t ncodes, i, nw;
+    Tcl_Obj *objP = NULL;
+
+    codesP = SWSPushFrame((DWORD) (n * (sizeof(*codesP) + 2*sizeof(WCHAR)) + 1), NULL);
+    wP = (WCHAR *) (codesP + n);
+    ncodes = TwapiDerStringToUnicode(tag, p, n, codesP);
+    if (ncodes != (size_t) -1) {
+        for (i = 0, nw = 0; i < ncodes; ++i) {
+            if (codesP[i] < 0x10000) {
+                wP[nw++] = (WCHAR) codesP[i];
+            } else if (bmp_only) {
+                break;
+            } else {
+                wP[nw++] = (WCHAR) (0xd800 + ((codesP[i] - 0x10000) >> 10));
+                wP[nw++] = (WCHAR) (0xdc00 + (codesP[i] & 0x3ff));
+            }
+        }
+        if (i == ncodes)
+            objP = ObjFromWinCharsN(wP, (int) nw);
+    }
+    SWSPopFrame();
+    return objP;
+}
+
+/* Returns an ASCII string without nulls as an object, else NULL */
+static Tcl_Obj *ObjFromDerAscii(const unsigned char *p, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; ++i) {
+        if (p[i] == 0 || p[i] >= 0x80)
+            return NULL;
+    }
+    return ObjFromStringN((const char *) p, (int) n);
+}
+
+static Tcl_Obj *ObjFromDerOid(const unsigned char *p, size_t n)
+{
+    char buf[256];
+    size_t len = TwapiDerOidToString(p, n, buf, sizeof(buf));
+    return len ? ObjFromStringN(buf, (int) len) : NULL;
+}
+
+/* Parses a TLV that must occupy all of p[0..n) */
+static int TwapiDerParseAll(const unsigned char *p, size_t n, TwapiDerTlv *tlvP)
+{
+    return n != 0 && TwapiDerParse(p, n, tlvP) == n;
+}
+
+static int TwapiDerIsUniversal(TwapiDerTlv *tlvP, unsigned long tag, int constructed)
+{
+    return tlvP->tagclass == TWAPI_DER_UNIVERSAL && tlvP->tag == tag
+        && tlvP->constructed == constructed;
+}
+
+static Tcl_Obj *TwapiDerDecodeAltNames(const unsigned char *p, size_t n)
+{
+    TwapiDerTlv tlv, inner;
+    size_t used;
+    Tcl_Obj *resultObj, *objs[2];
+
+    resultObj = ObjNewList(0, NULL);
+    for ( ; n; p += used, n -= used) {
+        used = TwapiDerParse(p, n, &tlv);
+        if (used == 0 || tlv.tagclass != TWAPI_DER_CONTEXT)
+            goto fallback;
+        /* The CAPI CERT_ALT_NAME_* choice is the context tag plus 1 */
+        objs[0] = NULL;
+        objs[1] = NULL;
+        switch (tlv.tag) {
+        case 1:                 /* rfc822Name */
+        case 2:                 /* dNSName */
+        case 6:                 /* uniformResourceIdentifier */
+            if (! tlv.constructed)
+                objs[1] = ObjFromDerAscii(tlv.valueP, tlv.len);
+            break;
+        case 4:                 /* directoryName - returned encoded */
+            if (tlv.constructed &&
+                TwapiDerParseAll(tlv.valueP, tlv.len, &inner) &&
+                TwapiDerIsUniversal(&inner, TWAPI_DER_SEQUENCE, 1))
+                objs[1] = ObjFromByteArray(tlv.valueP, (int) tlv.len);
+            break;
+        case 7:                 /* iPAddress */
+            if (! tlv.constructed)
+                objs[1] = ObjFromByteArray(tlv.valueP, (int) tlv.len);
+            break;
+        case 8:                 /* registeredID */
+            if (! tlv.constructed)
+                objs[1] = ObjFromDerOid(tlv.valueP, tlv.len);
+            break;
+        default:
+            /* otherName, x400Address and ediPartyName left to CAPI */
+            break;
+        }
+        if (objs[1] == NULL)
+            goto fallback;
+        objs[0] = ObjFromDWORD(tlv.tag + 1);
+        ObjAppendElement(NULL, resultObj, ObjNewList(2, objs));
+    }
+    return resultObj;
+
+fallback:
+    ObjDecrRefs(resultObj);
+    return NULL;
+}
+
+/*
+ * Decodes the types for which the CryptDecodeObjectEx result, as
+ * converted by TwapiCryptDecodeObject, can be reproduced from the
+ * encoding alone. These make up most of the extensions in the
+ * certificates seen in practice. Returns NULL for anything else,
+ * including any encoding that is not in the common form, so the caller
+ * can fall back to CryptDecodeObjectEx for identical results and errors.
+ */
+static Tcl_Obj *TwapiDerDecodeKnown(DWORD_PTR dwoid, const unsigned char *p, DWORD n)
+{
+    TwapiDerTlv tlv, elem;
+    size_t used;
+    long long val;
+    Tcl_Obj *objP, *objs[3];
+
+    if (! TwapiDerParseAll(p, n, &tlv))
+        return NULL;
+
+    if (dwoid == (DWORD_PTR) X509_KEY_USAGE) {
+        if (! TwapiDerIsUniversal(&tlv, TWAPI_DER_BIT_STRING, 0) ||
+            tlv.len == 0 || tlv.valueP[0] > 7 ||
+            (tlv.len == 1 && tlv.valueP[0] != 0))
+            return NULL;
+        if (tlv.len == 1)
+            objs[0] = ObjFromEmptyString();
+        else
+            objs[0] = ObjFromByteArray(tlv.valueP + 1, (int) tlv.len - 1);
+        objs[1] = ObjFromDWORD(tlv.valueP[0]);
+        return ObjNewList(2, objs);
+    } else if (dwoid == (DWORD_PTR) X509_ENHANCED_KEY_USAGE) {
+        if (! TwapiDerIsUniversal(&tlv, TWAPI_DER_SEQUENCE, 1))
+            return NULL;
+        objP = ObjNewList(0, NULL);
+        for (p = tlv.valueP, n = (DWORD) tlv.len; n; p += used, n -= (DWORD) used) {
+            used = TwapiDerParse(p, n, &elem);
+            if (used == 0 ||
+                ! TwapiDerIsUniversal(&elem, TWAPI_DER_OID, 0) ||
+                (objs[0] = ObjFromDerOid(elem.valueP, elem.len)) == NULL) {
+                ObjDecrRefs(objP);
+                return NULL;
+            }
+            ObjAppendElement(NULL, objP, objs[0]);
+        }
+        return objP;
+    } else if (dwoid == (DWORD_PTR) X509_ALTERNATE_NAME) {
+        if (! TwapiDerIsUniversal(&tlv, TWAPI_DER_SEQUENCE, 1))
+            return NULL;
+        return TwapiDerDecodeAltNames(tlv.valueP, tlv.len);
+    } else if (dwoid == (DWORD_PTR) X509_BASIC_CONSTRAINTS2) {
+        BOOL fCA = FALSE, fPathLen = FALSE;
+        DWORD pathlen = 0;
+        if (! TwapiDerIsUniversal(&tlv, TWAPI_DER_SEQUENCE, 1))
+            return NULL;
+        p = tlv.valueP;
+        n = (DWORD) tlv.len;
+        if (n && (used = TwapiDerParse(p, n, &elem)) != 0 &&
+            TwapiDerIsUniversal(&elem, TWAPI_DER_BOOLEAN, 0)) {
+            if (elem.len != 1)
+                return NULL;
+            fCA = elem.valueP[0] != 0;
+            p += used;
+            n -= (DWORD) used;
+        }
+        if (n) {
+            if (! TwapiDerParseAll(p, n, &elem) ||
+                ! TwapiDerIsUniversal(&elem, TWAPI_DER_INTEGER, 0) ||
+                ! TwapiDerIntegerToWide(elem.valueP, elem.len, &val) ||
+                val < 0 || val > 0xffffffff)
+                return NULL;
+            fPathLen = TRUE;
+            pathlen = (DWORD) val;
+        }
+        objs[0] = ObjFromBoolean(fCA);
+        objs[1] = ObjFromBoolean(fPathLen);
+        objs[2] = ObjFromDWORD(pathlen);
+        return ObjNewList(3, objs);
+    } else if (dwoid == (DWORD_PTR) (65535-1)) { // szOID_SUBJECT_KEY_IDENTIFIER
+        if (! TwapiDerIsUniversal(&tlv, TWAPI_DER_OCTET_STRING, 0))
+            return NULL;
+        if (tlv.len == 0)
+            return ObjFromEmptyString();
+        return ObjFromByteArray(tlv.valueP, (int) tlv.len);
+    } else if (dwoid == (DWORD_PTR) X509_UNICODE_ANY_STRING) {
+        size_t i;
+        if (tlv.tagclass != TWAPI_DER_UNIVERSAL || tlv.constructed ||
+            TwapiDerTagToRdnType(tlv.tag) == 0)
+            return NULL;
+        switch (tlv.tag) {
+        case TWAPI_DER_T61_STRING:
+        case TWAPI_DER_VIDEOTEX_STRING:
+        case TWAPI_DER_GRAPHIC_STRING:
+        case TWAPI_DER_GENERAL_STRING:
+            /* CAPI may interpret 8-bit content as UTF-8 so leave to it */
+            for (i = 0; i < tlv.len; ++i) {
+                if (tlv.valueP[i] >= 0x80)
+                    return NULL;
+            }
+            break;
+        }
+        objs[1] = ObjFromDerString(tlv.tag, tlv.valueP, tlv.len, 1);
+        if (objs[1] == NULL)
+            return NULL;
+        objs[0] = ObjFromDWORD(TwapiDerTagToRdnType(tlv.tag));
+        return ObjNewList(2, objs);
+    }
+    return NULL;
+}
+
+static Tcl_Obj *ObjFromDerTag(TwapiDerTlv *tlvP)
+{
+    static const char *universal_names[] = {
+        NULL, "boolean", "integer", "bitstring", "octetstring", "null",
+        "oid", NULL, NULL, NULL, "enumerated", NULL, "utf8string", NULL,
+        NULL, NULL, "sequence", "set", "numericstring", "printablestring",
+        "t61string", "videotexstring", "ia5string", "utctime",
+        "generalizedtime", "graphicstring", "visiblestring",
+        "generalstring", "universalstring", NULL, "bmpstring"
+    };
+    static const char *classes[] = {
+        "universal", "application", "context", "private"
+    };
+
+    if (tlvP->tagclass == TWAPI_DER_UNIVERSAL &&
+        tlvP->tag < ARRAYSIZE(universal_names) &&
+        universal_names[tlvP->tag])
+        return ObjFromString(universal_names[tlvP->tag]);
+    return Tcl_ObjPrintf("%s-%lu", classes[tlvP->tagclass], tlvP->tag);
+}
+
+/*
+ * Returns a {TYPE VALUE} pair for a TLV whose content has been checked
+ * with TwapiDerValidate. VALUE is the list of nested pairs for
+ * constructed types. Primitive values that cannot be interpreted for
+ * their type are returned as binary.
+ */
+static Tcl_Obj *ObjFromDerTlv(TwapiDerTlv *tlvP)
+{
+    Tcl_Obj *objs[2], *subobjs[2];
+    TwapiDerTlv elem;
+    const unsigned char *p;
+    size_t n, used;
+    long long val;
+    char buf[20];
+
+    objs[0] = ObjFromDerTag(tlvP);
+    objs[1] = NULL;
+    if (tlvP->constructed) {
+        objs[1] = ObjNewList(0, NULL);
+        for (p = tlvP->valueP, n = tlvP->len; n; p += used, n -= used) {
+            used = TwapiDerParse(p, n, &elem);
+            TWAPI_ASSERT(used);
+            ObjAppendElement(NULL, objs[1], ObjFromDerTlv(&elem));
+        }
+    } else if (tlvP->tagclass == TWAPI_DER_UNIVERSAL) {
+        switch (tlvP->tag) {
+        case TWAPI_DER_BOOLEAN:
+            if (tlvP->len == 1)
+                objs[1] = ObjFromBoolean(tlvP->valueP[0] != 0);
+            break;
+        case TWAPI_DER_INTEGER:
+        case TWAPI_DER_ENUMERATED:
+            if (TwapiDerIntegerToWide(tlvP->valueP, tlvP->len, &val))
+                objs[1] = ObjFromWideInt(val);
+            break;
+        case TWAPI_DER_BIT_STRING:
+            if (tlvP->len && tlvP->valueP[0] <= 7) {
+                subobjs[0] = ObjFromByteArray(tlvP->valueP + 1, (int) tlvP->len - 1);
+                subobjs[1] = ObjFromInt(tlvP->valueP[0]);
+                objs[1] = ObjNewList(2, subobjs);
+            }
+            break;
+        case TWAPI_DER_NULL:
+            objs[1] = ObjFromEmptyString();
+            break;
+        case TWAPI_DER_OID:
+            objs[1] = ObjFromDerOid(tlvP->valueP, tlvP->len);
+            break;
+        case TWAPI_DER_UTC_TIME:
+        case TWAPI_DER_GENERALIZED_TIME:
+            if (TwapiDerTimeToString(tlvP->tag, tlvP->valueP, tlvP->len, buf))
+                objs[1] = ObjFromStringN(buf, 19);
+            break;
+        default:
+            if (TwapiDerTagToRdnType(tlvP->tag))
+                objs[1] = ObjFromDerString(tlvP->tag, tlvP->valueP, tlvP->len, 0);
+            break;
+        }
+    }
+    if (objs[1] == NULL)
+        objs[1] = ObjFromByteArray(tlvP->valueP, (int) tlvP->len);
+    return ObjNewList(2, objs);
+}
+
+/* Decodes a single DER encoded value into nested {TYPE VALUE} pairs */
+static int Twapi_Asn1DecodeObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiDerTlv tlv;
+    unsigned char *p;
+    int n;
+
+    CHECK_NARGS(interp, objc, 2);
+    p = ObjToByteArray(objv[1], &n);
+    if (! TwapiDerParseAll(p, n, &tlv) ||
+        (tlv.constructed &&
+         ! TwapiDerValidate(tlv.valueP, tlv.len, TWAPI_DER_MAX_DEPTH)))
+        return TwapiReturnErrorMsg(interp, TWAPI_INVALID_DATA,
+                                   "Invalid or truncated DER encoding");
+    return ObjSetResult(interp, ObjFromDerTlv(&tlv));
+}
+
+/*
+ * Returns the DER encoding of a string as a value of type RDNTYPE, one
+ * of the X509_UNICODE_ANY_STRING value types.
+ */
+static int Twapi_Asn1EncodeStringObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    unsigned long tag, *codesP;
+    WCHAR *wP;
+    int rdntype, nw, i;
+    size_t ncodes, nbytes, nhdr;
+    unsigned char hdr[8];
+    unsigned char *valueP;
+    void *pv;
+    Tcl_Obj *objP;
+
+    if (TwapiGetArgs(interp, objc-1, objv+1,
+                     GETINT(rdntype), GETWSTRN(wP, nw), ARGEND) != TCL_OK)
+        return TCL_ERROR;
+    tag = TwapiRdnTypeToDerTag(rdntype);
+    if (tag == 0)
+        return TwapiReturnErrorMsg(interp, TWAPI_INVALID_ARGS,
+                                   "Unsupported string type");
+
+    codesP = SWSPushFrame(nw * (sizeof(*codesP) + 4) + 1, NULL);
+    valueP = (unsigned char *) (codesP + nw);
+    for (i = 0, ncodes = 0; i < nw; ++i) {
+        if (wP[i] >= 0xd800 && wP[i] < 0xdc00 && i + 1 < nw &&
+            wP[i+1] >= 0xdc00 && wP[i+1] < 0xe000) {
+            codesP[ncodes++] = 0x10000 + ((wP[i] - 0xd800) << 10) + (wP[i+1] - 0xdc00);
+            ++i;
+        } else
+            codesP[ncodes++] = wP[i];
+    }
+    nbytes = TwapiDerStringFromUnicode(tag, codesP, ncodes, valueP);
+    if (nbytes == (size_t) -1) {
+        SWSPopFrame();
+        return TwapiReturnErrorMsg(interp, TWAPI_INVALID_ARGS,
+                                   "Invalid character for string type");
+    }
+    nhdr = TwapiDerEncodeHeader(tag, nbytes, hdr);
+    objP = ObjAllocateByteArray((int) (nhdr + nbytes), &pv);
+    memcpy(pv, hdr, nhdr);
+    memcpy(nhdr + (unsigned char *) pv, valueP, nbytes);
+    SWSPopFrame();
+    return ObjSetResult(interp, objP);
+}
+
 static int Twapi_PBKDF2ObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 {
     TwapiInterpContext *ticP = (TwapiInterpContext*) clientdata;
@@ -5621,7 +6497,6 @@ static int TwapiCryptoInitCalls(Tcl_Interp *interp, TwapiInterpContext *ticP)
         DEFINE_FNCODE_CMD(cert_chain_release, 10032), // TBD - document
         DEFINE_FNCODE_CMD(CertFindExtension, 10033),
         DEFINE_FNCODE_CMD(CryptGenRandom, 10034),
-        DEFINE_FNCODE_CMD(Twapi_CertGetInfo, 10035),
         DEFINE_FNCODE_CMD(Twapi_CertGetExtensions, 10036),
         DEFINE_FNCODE_CMD(CryptFindCertificateKeyProvInfo, 10037),
         DEFINE_FNCODE_CMD(CertAddEncodedCertificateToStore, 10038),
@@ -5699,6 +6574,21 @@ static int TwapiCryptoInitCalls(Tcl_Interp *interp, TwapiInterpContext *ticP)
         DEFINE_TCL_CMD(CryptImportKey, Twapi_CryptImportKeyObjCmd),
         DEFINE_TCL_CMD(CryptExportKey, Twapi_CryptExportKeyObjCmd),
         DEFINE_TCL_CMD(PBKDF2, Twapi_PBKDF2ObjCmd),
+        DEFINE_TCL_CMD(Twapi_Hash, Twapi_HashObjCmd),
+        DEFINE_TCL_CMD(Twapi_HashCreate, Twapi_HashCreateObjCmd),
+        DEFINE_TCL_CMD(Twapi_HashUpdate, Twapi_HashUpdateObjCmd),
+        DEFINE_TCL_CMD(Twapi_HashUpdateChannel, Twapi_HashUpdateChannelObjCmd),
+        DEFINE_TCL_CMD(Twapi_HashFinal, Twapi_HashFinalObjCmd),
+        DEFINE_TCL_CMD(Twapi_HashFree, Twapi_HashFreeObjCmd),
+        DEFINE_TCL_CMD(Twapi_PemDecode, Twapi_PemDecodeObjCmd),
+        DEFINE_TCL_CMD(Twapi_PemEncode, Twapi_PemEncodeObjCmd),
+        DEFINE_TCL_CMD(Twapi_IsPem, Twapi_IsPemObjCmd),
+        DEFINE_TCL_CMD(Twapi_Asn1Decode, Twapi_Asn1DecodeObjCmd),
+        DEFINE_TCL_CMD(Twapi_Asn1EncodeString, Twapi_Asn1EncodeStringObjCmd),
+        DEFINE_TCL_CMD(Twapi_CertGetInfo, Twapi_CertGetInfoObjCmd),
+        DEFINE_TCL_CMD(Twapi_CertInfoCacheStats, Twapi_CertInfoCacheStatsObjCmd),
+        DEFINE_TCL_CMD(Twapi_CertInfoCacheConfigure, Twapi_CertInfoCacheConfigureObjCmd),
+        DEFINE_TCL_CMD(Twapi_CertInfoCacheClear, Twapi_CertInfoCacheClearObjCmd),
         DEFINE_TCL_CMD(CryptImportPublicKeyInfoEx, Twapi_CryptImportPublicKeyInfoExObjCmd),
     };
 
@@ -5709,6 +6599,15 @@ static int TwapiCryptoInitCalls(Tcl_Interp *interp, TwapiInterpContext *ticP)
 }
 
 
+static void TwapiCryptoCleanup(TwapiInterpContext *ticP)
+{
+    if (ticP->module.data.pval) {
+        TwapiCertCacheFree(CRYPTO_CONTEXT(ticP)->certinfo_cacheP);
+        TwapiFree(ticP->module.data.pval);
+        ticP->module.data.pval = NULL;
+    }
+}
+
 #ifndef TWAPI_SINGLE_MODULE
 BOOL WINAPI DllMain(HINSTANCE hmod, DWORD reason, PVOID unused)
 {
@@ -5727,8 +6626,10 @@ int Twapi_crypto_Init(Tcl_Interp *interp)
     static TwapiModuleDef gModuleDef = {
         MODULENAME,
         TwapiCryptoInitCalls,
-        NULL
+        TwapiCryptoCleanup
     };
+    TwapiInterpContext *ticP;
+    TwapiCryptoInterpContext *cicP;
 
     /* IMPORTANT */
     /* MUST BE FIRST CALL as it initializes Tcl stubs */
@@ -5736,6 +6637,18 @@ int Twapi_crypto_Init(Tcl_Interp *interp)
         return TCL_ERROR;
     }
 
-    return TwapiRegisterModule(interp, MODULE_HANDLE, &gModuleDef, DEFAULT_TIC) ? TCL_OK : TCL_ERROR;
+    /* Cannot use DEFAULT_TIC because we have a cleanup routine and
+     * use the ticP->module.data area
+     */
+    ticP = TwapiRegisterModule(interp, MODULE_HANDLE, &gModuleDef, NEW_TIC);
+    if (ticP == NULL)
+        return TCL_ERROR;
+
+    cicP = TwapiAlloc(sizeof(TwapiCryptoInterpContext));
+    cicP->certinfo_cacheP = TwapiCertCacheNew(TwapiHashAlgFromName("sha256"),
+                                              TWAPI_CERTINFO_CACHE_SIZE,
+                                              TwapiCertInfoCacheFreeObj);
+    ticP->module.data.pval = cicP;
+    return TCL_OK;
 }
 
@@ -0,0 +1,570 @@
+/*
+ * Copyright (c) 2018, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ */
+
+/*
+ * Native implementations of MD5 (RFC 1321), SHA-1 and SHA-2 (FIPS 180-4)
+ * and HMAC (RFC 2104). Unlike Crypto API hash objects, contexts are plain
+ * memory so data can be fed to them without a provider call per chunk.
+ */
+
+#ifdef CRYPTO_STANDALONE
+# ifdef _WIN32
+#  include <windows.h>
+# endif
+#else
+# include "twapi.h"
+# include "twapi_crypto.h"
+#endif
+
+#include <string.h>
+
+#include "hash.h"
+
+struct _TwapiHashAlg {
+    const char *nameP;
+    DWORD digest_size;
+    DWORD block_size;
+    DWORD state_size;           /* Bytes of initial state */
+    int   little_endian;        /* Only MD5 */
+    const void *initP;          /* Initial state */
+    void (*blocksfn)(TwapiHashCtx *, const unsigned char *, size_t nblocks);
+};
+
+#define ROL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define ROR64(x, n) (((x) >> (n)) | ((x) << (64 - (n))))
+
+#define LOAD32BE(p) (((DWORD)(p)[0] << 24) | ((DWORD)(p)[1] << 16) | \
+                     ((DWORD)(p)[2] << 8) | (DWORD)(p)[3])
+#define LOAD32LE(p) (((DWORD)(p)[3] << 24) | ((DWORD)(p)[2] << 16) | \
+                     ((DWORD)(p)[1] << 8) | (DWORD)(p)[0])
+#define LOAD64BE(p) (((TwapiHashU64) LOAD32BE(p) << 32) | LOAD32BE((p) + 4))
+
+/* Zeroes memory holding key material. Not optimized away. */
+static void TwapiHashZero(void *p, size_t n)
+{
+    volatile unsigned char *vp = (volatile unsigned char *) p;
+    while (n--)
+        *vp++ = 0;
+}
+
+/*
+ * MD5
+ */
+
+static const DWORD md5InitState[4] = {
+    0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476
+};
+
+#define MD5_F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define MD5_G(x, y, z) ((y) ^ ((z) & ((x) ^ (y))))
+#define MD5_H(x, y, z) ((x) ^ (y) ^ (z))
+#define MD5_I(x, y, z) ((y) ^ ((x) | ~(z)))
+#define MD5_STEP(f, a, b, c, d, x, k, s)        \
+    do {                                        \
+        a += f(b, c, d) + (x) + (k);            \
+        a = ROL32(a, s) + b;                    \
+    } while (0)
+
+static void md5_blocks(TwapiHashCtx *ctxP, const unsigned char *p, size_t nblocks)
+{
+    DWORD *s = ctxP->state.w32;
+    DWORD x[16];
+    DWORD a, b, c, d;
+    int i;
+
+    while (nblocks--) {
+        for (i = 0; i < 16; ++i, p += 4)
+            x[i] = LOAD32LE(p);
+        a = s[0]; b = s[1]; c = s[2]; d = s[3];
+
+        MD5_STEP(MD5_F, a, b, c, d, x[0], 0xd76aa478, 7);
+        MD5_STEP(MD5_F, d, a, b, c, x[1], 0xe8c7b756, 12);
+        MD5_STEP(MD5_F, c, d, a, b, x[2], 0x242070db, 17);
+        MD5_STEP(MD5_F, b, c, d, a, x[3], 0xc1bdceee, 22);
+        MD5_STEP(MD5_F, a, b, c, d, x[4], 0xf57c0faf, 7);
+        MD5_STEP(MD5_F, d, a, b, c, x[5], 0x4787c62a, 12);
+        MD5_STEP(MD5_F, c, d, a, b, x[6], 0xa8304613, 17);
+        MD5_STEP(MD5_F, b, c, d, a, x[7], 0xfd469501, 22);
+        MD5_STEP(MD5_F, a, b, c, d, x[8], 0x698098d8, 7);
+        MD5_STEP(MD5_F, d, a, b, c, x[9], 0x8b44f7af, 12);
+        MD5_STEP(MD5_F, c, d, a, b, x[10], 0xffff5bb1, 17);
+        MD5_STEP(MD5_F, b, c, d, a, x[11], 0x895cd7be, 22);
+        MD5_STEP(MD5_F, a, b, c, d, x[12], 0x6b901122, 7);
+        MD5_STEP(MD5_F, d, a, b, c, x[13], 0xfd987193, 12);
+        MD5_STEP(MD5_F, c, d, a, b, x[14], 0xa679438e, 17);
+        MD5_STEP(MD5_F, b, c, d, a, x[15], 0x49b40821, 22);
+
+        MD5_STEP(MD5_G, a, b, c, d, x[1], 0xf61e2562, 5);
+        MD5_STEP(MD5_G, d, a, b, c, x[6], 0xc040b340, 9);
+        MD5_STEP(MD5_G, c, d, a, b, x[11], 0x265e5a51, 14);
+        MD5_STEP(MD5_G, b, c, d, a, x[0], 0xe9b6c7aa, 20);
+        MD5_STEP(MD5_G, a, b, c, d, x[5], 0xd62f105d, 5);
+        MD5_STEP(MD5_G, d, a, b, c, x[10], 0x02441453, 9);
+        MD5_STEP(MD5_G, c, d, a, b, x[15], 0xd8a1e681, 14);
+        MD5_STEP(MD5_G, b, c, d, a, x[4], 0xe7d3fbc8, 20);
+        MD5_STEP(MD5_G, a, b, c, d, x[9], 0x21e1cde6, 5);
+        MD5_STEP(MD5_G, d, a, b, c, x[14], 0xc33707d6, 9);
+        MD5_STEP(MD5_G, c, d, a, b, x[3], 0xf4d50d87, 14);
+        MD5_STEP(MD5_G, b, c, d, a, x[8], 0x455a14ed, 20);
+        MD5_STEP(MD5_G, a, b, c, d, x[13], 0xa9e3e905, 5);
+        MD5_STEP(MD5_G, d, a, b, c, x[2], 0xfcefa3f8, 9);
+        MD5_STEP(MD5_G, c, d, a, b, x[7], 0x676f02d9, 14);
+        MD5_STEP(MD5_G, b, c, d, a, x[12], 0x8d2a4c8a, 20);
+
+        MD5_STEP(MD5_H, a, b, c, d, x[5], 0xfffa3942, 4);
+        MD5_STEP(MD5_H, d, a, b, c, x[8], 0x8771f681, 11);
+        MD5_STEP(MD5_H, c, d, a, b, x[11], 0x6d9d6122, 16);
+        MD5_STEP(MD5_H, b, c, d, a, x[14], 0xfde5380c, 23);
+        MD5_STEP(MD5_H, a, b, c, d, x[1], 0xa4beea44, 4);
+        MD5_STEP(MD5_H, d, a, b, c, x[4], 0x4bdecfa9, 11);
+        MD5_STEP(MD5_H, c, d, a, b, x[7], 0xf6bb4b60, 16);
+        MD5_STEP(MD5_H, b, c, d, a, x[10], 0xbebfbc70, 23);
+        MD5_STEP(MD5_H, a, b, c, d, x[13], 0x289b7ec6, 4);
+        MD5_STEP(MD5_H, d, a, b, c, x[0], 0xeaa127fa, 11);
+        MD5_STEP(MD5_H, c, d, a, b, x[3], 0xd4ef3085, 16);
+        MD5_STEP(MD5_H, b, c, d, a, x[6], 0x04881d05, 23);
+        MD5_STEP(MD5_H, a, b, c, d, x[9], 0xd9d4d039, 4);
+        MD5_STEP(MD5_H, d, a, b, c, x[12], 0xe6db99e5, 11);
+        MD5_STEP(MD5_H, c, d, a, b, x[15], 0x1fa27cf8, 16);
+        MD5_STEP(MD5_H, b, c, d, a, x[2], 0xc4ac5665, 23);
+
+        MD5_STEP(MD5_I, a, b, c, d, x[0], 0xf4292244, 6);
+        MD5_STEP(MD5_I, d, a, b, c, x[7], 0x432aff97, 10);
+        MD5_STEP(MD5_I, c, d, a, b, x[14], 0xab9423a7, 15);
+        MD5_STEP(MD5_I, b, c, d, a, x[5], 0xfc93a039, 21);
+        MD5_STEP(MD5_I, a, b, c, d, x[12], 0x655b59c3, 6);
+        MD5_STEP(MD5_I, d, a, b, c, x[3], 0x8f0ccc92, 10);
+        MD5_STEP(MD5_I, c, d, a, b, x[10], 0xffeff47d, 15);
+        MD5_STEP(MD5_I, b, c, d, a, x[1], 0x85845dd1, 21);
+        MD5_STEP(MD5_I, a, b, c, d, x[8], 0x6fa87e4f, 6);
+        MD5_STEP(MD5_I, d, a, b, c, x[15], 0xfe2ce6e0, 10);
+        MD5_STEP(MD5_I, c, d, a, b, x[6], 0xa3014314, 15);
+        MD5_STEP(MD5_I, b, c, d, a, x[13], 0x4e0811a1, 21);
+        MD5_STEP(MD5_I, a, b, c, d, x[4], 0xf7537e82, 6);
+        MD5_STEP(MD5_I, d, a, b, c, x[11], 0xbd3af235, 10);
+        MD5_STEP(MD5_I, c, d, a, b, x[2], 0x2ad7d2bb, 15);
+        MD5_STEP(MD5_I, b, c, d, a, x[9], 0xeb86d391, 21);
+
+        s[0] += a; s[1] += b; s[2] += c; s[3] += d;
+    }
+}
+
+/*
+ * SHA-1
+ */
+
+static const DWORD sha1InitState[5] = {
+    0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0
+};
+
+#define SHA1_F1(b, c, d) ((d) ^ ((b) & ((c) ^ (d))))
+#define SHA1_F2(b, c, d) ((b) ^ (c) ^ (d))
+#define SHA1_F3(b, c, d) (((b) & (c)) | ((d) & ((b) | (c))))
+#define SHA1_W(i) (w[(i) & 15] = ROL32(w[((i) + 13) & 15] ^ w[((i) + 8) & 15] ^ w[((i) + 2) & 15] ^ w[(i) & 15], 1))
+#define SHA1_R(a, b, c, d, e, f, k, x)          \
+    do {                                        \
+        e += ROL32(a, 5) + f(b, c, d) + k + (x); \
+        b = ROL32(b, 30);                       \
+    } while (0)
+
+void TwapiSha1Compress(DWORD *s, const DWORD *block)
+{
+    DWORD w[16];
+    DWORD a = s[0], b = s[1], c = s[2], d = s[3], e = s[4];
+    int i;
+
+    memcpy(w, block, sizeof(w));
+    for (i = 0; i < 15; i += 5) {
+        SHA1_R(a, b, c, d, e, SHA1_F1, 0x5A827999, w[i]);
+        SHA1_R(e, a, b, c, d, SHA1_F1, 0x5A827999, w[i+1]);
+        SHA1_R(d, e, a, b, c, SHA1_F1, 0x5A827999, w[i+2]);
+        SHA1_R(c, d, e, a, b, SHA1_F1, 0x5A827999, w[i+3]);
+        SHA1_R(b, c, d, e, a, SHA1_F1, 0x5A827999, w[i+4]);
+    }
+    SHA1_R(a, b, c, d, e, SHA1_F1, 0x5A827999, w[15]);
+    SHA1_R(e, a, b, c, d, SHA1_F1, 0x5A827999, SHA1_W(16));
+    SHA1_R(d, e, a, b, c, SHA1_F1, 0x5A827999, SHA1_W(17));
+    SHA1_R(c, d, e, a, b, SHA1_F1, 0x5A827999, SHA1_W(18));
+    SHA1_R(b, c, d, e, a, SHA1_F1, 0x5A827999, SHA1_W(19));
+    for (i = 20; i < 40; i += 5) {
+        SHA1_R(a, b, c, d, e, SHA1_F2, 0x6ED9EBA1, SHA1_W(i));
+        SHA1_R(e, a, b, c, d, SHA1_F2, 0x6ED9EBA1, SHA1_W(i+1));
+        SHA1_R(d, e, a, b, c, SHA1_F2, 0x6ED9EBA1, SHA1_W(i+2));
+        SHA1_R(c, d, e, a, b, SHA1_F2, 0x6ED9EBA1, SHA1_W(i+3));
+        SHA1_R(b, c, d, e, a, SHA1_F2, 0x6ED9EBA1, SHA1_W(i+4));
+    }
+    for (; i < 60; i += 5) {
+        SHA1_R(a, b, c, d, e, SHA1_F3, 0x8F1BBCDC, SHA1_W(i));
+        SHA1_R(e, a, b, c, d, SHA1_F3, 0x8F1BBCDC, SHA1_W(i+1));
+        SHA1_R(d, e, a, b, c, SHA1_F3, 0x8F1BBCDC, SHA1_W(i+2));
+        SHA1_R(c, d, e, a, b, SHA1_F3, 0x8F1BBCDC, SHA1_W(i+3));
+        SHA1_R(b, c, d, e, a, SHA1_F3, 0x8F1BBCDC, SHA1_W(i+4));
+    }
+    for (; i < 80; i += 5) {
+        SHA1_R(a, b, c, d, e, SHA1_F2, 0xCA62C1D6, SHA1_W(i));
+        SHA1_R(e, a, b, c, d, SHA1_F2, 0xCA62C1D6, SHA1_W(i+1));
+        SHA1_R(d, e, a, b, c, SHA1_F2, 0xCA62C1D6, SHA1_W(i+2));
+        SHA1_R(c, d, e, a, b, SHA1_F2, 0xCA62C1D6, SHA1_W(i+3));
+        SHA1_R(b, c, d, e, a, SHA1_F2, 0xCA62C1D6, SHA1_W(i+4));
+    }
+    s[0] += a; s[1] += b; s[2] += c; s[3] += d; s[4] += e;
+}
+
+static void sha1_blocks(TwapiHashCtx *ctxP, const unsigned char *p, size_t nblocks)
+{
+    DWORD w[16];
+    int i;
+
+    while (nblocks--) {
+        for (i = 0; i < 16; ++i, p += 4)
+            w[i] = LOAD32BE(p);
+        TwapiSha1Compress(ctxP->state.w32, w);
+    }
+}
+
+/*
+ * SHA-224 and SHA-256
+ */
+
+static const DWORD sha224InitState[8] = {
+    0xc1059ed8, 0x367cd507, 0x3070dd17, 0xf70e5939,
+    0xffc00b31, 0x68581511, 0x64f98fa7, 0xbefa4fa4
+};
+
+static const DWORD sha256InitState[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static const DWORD sha256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define SHA256_S0(x) (ROR32(x, 2) ^ ROR32(x, 13) ^ ROR32(x, 22))
+#define SHA256_S1(x) (ROR32(x, 6) ^ ROR32(x, 11) ^ ROR32(x, 25))
+#define SHA256_s0(x) (ROR32(x, 7) ^ ROR32(x, 18) ^ ((x) >> 3))
+#define SHA256_s1(x) (ROR32(x, 17) ^ ROR32(x, 19) ^ ((x) >> 10))
+#define SHA_CH(e, f, g) ((g) ^ ((e) & ((f) ^ (g))))
+#define SHA_MAJ(a, b, c) (((a) & (b)) | ((c) & ((a) | (b))))
+#define SHA256_W(i) (w[(i) & 15] += SHA256_s1(w[((i) + 14) & 15]) + w[((i) + 9) & 15] + SHA256_s0(w[((i) + 1) & 15]))
+#define SHA256_R(a, b, c, d, e, f, g, h, k, x)                          \
+    do {                                                                \
+        DWORD t1_ = h + SHA256_S1(e) + SHA_CH(e, f, g) + k + (x);       \
+        d += t1_;                                                       \
+        h = t1_ + SHA256_S0(a) + SHA_MAJ(a, b, c);                      \
+    } while (0)
+
+void TwapiSha256Compress(DWORD *s, const DWORD *block)
+{
+    DWORD w[16];
+    DWORD a = s[0], b = s[1], c = s[2], d = s[3];
+    DWORD e = s[4], f = s[5], g = s[6], h = s[7];
+    int i;
+
+    memcpy(w, block, sizeof(w));
+    for (i = 0; i < 16; i += 8) {
+        SHA256_R(a, b, c, d, e, f, g, h, sha256K[i], w[i]);
+        SHA256_R(h, a, b, c, d, e, f, g, sha256K[i+1], w[i+1]);
+        SHA256_R(g, h, a, b, c, d, e, f, sha256K[i+2], w[i+2]);
+        SHA256_R(f, g, h, a, b, c, d, e, sha256K[i+3], w[i+3]);
+        SHA256_R(e, f, g, h, a, b, c, d, sha256K[i+4], w[i+4]);
+        SHA256_R(d, e, f, g, h, a, b, c, sha256K[i+5], w[i+5]);
+        SHA256_R(c, d, e, f, g, h, a, b, sha256K[i+6], w[i+6]);
+        SHA256_R(b, c, d, e, f, g, h, a, sha256K[i+7], w[i+7]);
+    }
+    for (; i < 64; i += 8) {
+        SHA256_R(a, b, c, d, e, f, g, h, sha256K[i], SHA256_W(i));
+        SHA256_R(h, a, b, c, d, e, f, g, sha256K[i+1], SHA256_W(i+1));
+        SHA256_R(g, h, a, b, c, d, e, f, sha256K[i+2], SHA256_W(i+2));
+        SHA256_R(f, g, h, a, b, c, d, e, sha256K[i+3], SHA256_W(i+3));
+        SHA256_R(e, f, g, h, a, b, c, d, sha256K[i+4], SHA256_W(i+4));
+        SHA256_R(d, e, f, g, h, a, b, c, sha256K[i+5], SHA256_W(i+5));
+        SHA256_R(c, d, e, f, g, h, a, b, sha256K[i+6], SHA256_W(i+6));
+        SHA256_R(b, c, d, e, f, g, h, a, sha256K[i+7], SHA256_W(i+7));
+    }
+    s[0] += a; s[1] += b; s[2] += c; s[3] += d;
+    s[4] += e; s[5] += f; s[6] += g; s[7] += h;
+}
+
+static void sha256_blocks(TwapiHashCtx *ctxP, const unsigned char *p, size_t nblocks)
+{
+    DWORD w[16];
+    int i;
+
+    while (nblocks--) {
+        for (i = 0; i < 16; ++i, p += 4)
+            w[i] = LOAD32BE(p);
+        TwapiSha256Compress(ctxP->state.w32, w);
+    }
+}
+
+/*
+ * SHA-384 and SHA-512
+ */
+
+#define U64C(hi, lo) (((TwapiHashU64) (hi) << 32) | (lo))
+
+static const TwapiHashU64 sha384InitState[8] = {
+    U64C(0xcbbb9d5d, 0xc1059ed8), U64C(0x629a292a, 0x367cd507),
+    U64C(0x9159015a, 0x3070dd17), U64C(0x152fecd8, 0xf70e5939),
+    U64C(0x67332667, 0xffc00b31), U64C(0x8eb44a87, 0x68581511),
+    U64C(0xdb0c2e0d, 0x64f98fa7), U64C(0x47b5481d, 0xbefa4fa4)
+};
+
+static const TwapiHashU64 sha512InitState[8] = {
+    U64C(0x6a09e667, 0xf3bcc908), U64C(0xbb67ae85, 0x84caa73b),
+    U64C(0x3c6ef372, 0xfe94f82b), U64C(0xa54ff53a, 0x5f1d36f1),
+    U64C(0x510e527f, 0xade682d1), U64C(0x9b05688c, 0x2b3e6c1f),
+    U64C(0x1f83d9ab, 0xfb41bd6b), U64C(0x5be0cd19, 0x137e2179)
+};
+
+static const TwapiHashU64 sha512K[80] = {
+    U64C(0x428a2f98, 0xd728ae22), U64C(0x71374491, 0x23ef65cd), U64C(0xb5c0fbcf, 0xec4d3b2f), U64C(0xe9b5dba5, 0x8189dbbc),
+    U64C(0x3956c25b, 0xf348b538), U64C(0x59f111f1, 0xb605d019), U64C(0x923f82a4, 0xaf194f9b), U64C(0xab1c5ed5, 0xda6d8118),
+    U64C(0xd807aa98, 0xa3030242), U64C(0x12835b01, 0x45706fbe), U64C(0x243185be, 0x4ee4b28c), U64C(0x550c7dc3, 0xd5ffb4e2),
+    U64C(0x72be5d74, 0xf27b896f), U64C(0x80deb1fe, 0x3b1696b1), U64C(0x9bdc06a7, 0x25c71235), U64C(0xc19bf174, 0xcf692694),
+    U64C(0xe49b69c1, 0x9ef14ad2), U64C(0xefbe4786, 0x384f25e3), U64C(0x0fc19dc6, 0x8b8cd5b5), U64C(0x240ca1cc, 0x77ac9c65),
+    U64C(0x2de92c6f, 0x592b0275), U64C(0x4a7484aa, 0x6ea6e483), U64C(0x5cb0a9dc, 0xbd41fbd4), U64C(0x76f988da, 0x831153b5),
+    U64C(0x983e5152, 0xee66dfab), U64C(0xa831c66d, 0x2db43210), U64C(0xb00327c8, 0x98fb213f), U64C(0xbf597fc7, 0xbeef0ee4),
+    U64C(0xc6e00bf3, 0x3da88fc2), U64C(0xd5a79147, 0x930aa725), U64C(0x06ca6351, 0xe003826f), U64C(0x14292967, 0x0a0e6e70),
+    U64C(0x27b70a85, 0x46d22ffc), U64C(0x2e1b2138, 0x5c26c926), U64C(0x4d2c6dfc, 0x5ac42aed), U64C(0x53380d13, 0x9d95b3df),
+    U64C(0x650a7354, 0x8baf63de), U64C(0x766a0abb, 0x3c77b2a8), U64C(0x81c2c92e, 0x47edaee6), U64C(0x92722c85, 0x1482353b),
+    U64C(0xa2bfe8a1, 0x4cf10364), U64C(0xa81a664b, 0xbc423001), U64C(0xc24b8b70, 0xd0f89791), U64C(0xc76c51a3, 0x0654be30),
+    U64C(0xd192e819, 0xd6ef5218), U64C(0xd6990624, 0x5565a910), U64C(0xf40e3585, 0x5771202a), U64C(0x106aa070, 0x32bbd1b8),
+    U64C(0x19a4c116, 0xb8d2d0c8), U64C(0x1e376c08, 0x5141ab53), U64C(0x2748774c, 0xdf8eeb99), U64C(0x34b0bcb5, 0xe19b48a8),
+    U64C(0x391c0cb3, 0xc5c95a63), U64C(0x4ed8aa4a, 0xe3418acb), U64C(0x5b9cca4f, 0x7763e373), U64C(0x682e6ff3, 0xd6b2b8a3),
+    U64C(0x748f82ee, 0x5defb2fc), U64C(0x78a5636f, 0x43172f60), U64C(0x84c87814, 0xa1f0ab72), U64C(0x8cc70208, 0x1a6439ec),
+    U64C(0x90befffa, 0x23631e28), U64C(0xa4506ceb, 0xde82bde9), U64C(0xbef9a3f7, 0xb2c67915), U64C(0xc67178f2, 0xe372532b),
+    U64C(0xca273ece, 0xea26619c), U64C(0xd186b8c7, 0x21c0c207), U64C(0xeada7dd6, 0xcde0eb1e), U64C(0xf57d4f7f, 0xee6ed178),
+    U64C(0x06f067aa, 0x72176fba), U64C(0x0a637dc5, 0xa2c898a6), U64C(0x113f9804, 0xbef90dae), U64C(0x1b710b35, 0x131c471b),
+    U64C(0x28db77f5, 0x23047d84), U64C(0x32caab7b, 0x40c72493), U64C(0x3c9ebe0a, 0x15c9bebc), U64C(0x431d67c4, 0x9c100d4c),
+    U64C(0x4cc5d4be, 0xcb3e42b6), U64C(0x597f299c, 0xfc657e2a), U64C(0x5fcb6fab, 0x3ad6faec), U64C(0x6c44198c, 0x4a475817)
+};
+
+#define SHA512_S0(x) (ROR64(x, 28) ^ ROR64(x, 34) ^ ROR64(x, 39))
+#define SHA512_S1(x) (ROR64(x, 14) ^ ROR64(x, 18) ^ ROR64(x, 41))
+#define SHA512_s0(x) (ROR64(x, 1) ^ ROR64(x, 8) ^ ((x) >> 7))
+#define SHA512_s1(x) (ROR64(x, 19) ^ ROR64(x, 61) ^ ((x) >> 6))
+#define SHA512_W(i) (w[(i) & 15] += SHA512_s1(w[((i) + 14) & 15]) + w[((i) + 9) & 15] + SHA512_s0(w[((i) + 1) & 15]))
+#define SHA512_R(a, b, c, d, e, f, g, h, k, x)                          \
+    do {                                                                \
+        TwapiHashU64 t1_ = h + SHA512_S1(e) + SHA_CH(e, f, g) + k + (x); \
+        d += t1_;                                                       \
+        h = t1_ + SHA512_S0(a) + SHA_MAJ(a, b, c);                      \
+    } while (0)
+
+static void sha512_blocks(TwapiHashCtx *ctxP, const unsigned char *p, size_t nblocks)
+{
+    TwapiHashU64 *s = ctxP->state.w64;
+    TwapiHashU64 w[16];
+    TwapiHashU64 a, b, c, d, e, f, g, h;
+    int i;
+
+    while (nblocks--) {
+        for (i = 0; i < 16; ++i, p += 8)
+            w[i] = LOAD64BE(p);
+        a = s[0]; b = s[1]; c = s[2]; d = s[3];
+        e = s[4]; f = s[5]; g = s[6]; h = s[7];
+        for (i = 0; i < 16; i += 8) {
+            SHA512_R(a, b, c, d, e, f, g, h, sha512K[i], w[i]);
+            SHA512_R(h, a, b, c, d, e, f, g, sha512K[i+1], w[i+1]);
+            SHA512_R(g, h, a, b, c, d, e, f, sha512K[i+2], w[i+2]);
+            SHA512_R(f, g, h, a, b, c, d, e, sha512K[i+3], w[i+3]);
+            SHA512_R(e, f, g, h, a, b, c, d, sha512K[i+4], w[i+4]);
+            SHA512_R(d, e, f, g, h, a, b, c, sha512K[i+5], w[i+5]);
+            SHA512_R(c, d, e, f, g, h, a, b, sha512K[i+6], w[i+6]);
+            SHA512_R(b, c, d, e, f, g, h, a, sha512K[i+7], w[i+7]);
+        }
+        for (; i < 80; i += 8) {
+            SHA512_R(a, b, c, d, e, f, g, h, sha512K[i], SHA512_W(i));
+            SHA512_R(h, a, b, c, d, e, f, g, sha512K[i+1], SHA512_W(i+1));
+            SHA512_R(g, h, a, b, c, d, e, f, sha512K[i+2], SHA512_W(i+2));
+            SHA512_R(f, g, h, a, b, c, d, e, sha512K[i+3], SHA512_W(i+3));
+            SHA512_R(e, f, g, h, a, b, c, d, sha512K[i+4], SHA512_W(i+4));
+            SHA512_R(d, e, f, g, h, a, b, c, sha512K[i+5], SHA512_W(i+5));
+            SHA512_R(c, d, e, f, g, h, a, b, sha512K[i+6], SHA512_W(i+6));
+            SHA512_R(b, c, d, e, f, g, h, a, sha512K[i+7], SHA512_W(i+7));
+        }
+        s[0] += a; s[1] += b; s[2] += c; s[3] += d;
+        s[4] += e; s[5] += f; s[6] += g; s[7] += h;
+    }
+}
+
+static const TwapiHashAlg gHashAlgs[] = {
+    {"md5", 16, 64, sizeof(md5InitState), 1, md5InitState, md5_blocks},
+    {"sha1", 20, 64, sizeof(sha1InitState), 0, sha1InitState, sha1_blocks},
+    {"sha224", 28, 64, sizeof(sha224InitState), 0, sha224InitState, sha256_blocks},
+    {"sha256", 32, 64, sizeof(sha256InitState), 0, sha256InitState, sha256_blocks},
+    {"sha384", 48, 128, sizeof(sha384InitState), 0, sha384InitState, sha512_blocks},
+    {"sha512", 64, 128, sizeof(sha512InitState), 0, sha512InitState, sha512_blocks},
+};
+
+const TwapiHashAlg *TwapiHashAlgFromName(const char *nameP)
+{
+    char name[8];
+    int i;
+
+    /* Accept sha_256 etc. as used in algorithm identifiers */
+    for (i = 0; *nameP && i < (int) sizeof(name) - 1; ++nameP) {
+        if (*nameP != '_')
+            name[i++] = *nameP;
+    }
+    if (*nameP)
+        return NULL;
+    name[i] = 0;
+    for (i = 0; i < (int) (sizeof(gHashAlgs)/sizeof(gHashAlgs[0])); ++i) {
+        if (strcmp(gHashAlgs[i].nameP, name) == 0)
+            return &gHashAlgs[i];
+    }
+    return NULL;
+}
+
+DWORD TwapiHashDigestSize(const TwapiHashAlg *algP)
+{
+    return algP->digest_size;
+}
+
+const char *TwapiHashAlgName(const TwapiHashAlg *algP)
+{
+    return algP->nameP;
+}
+
+void TwapiHashInit(TwapiHashCtx *ctxP, const TwapiHashAlg *algP)
+{
+    ctxP->algP = algP;
+    memcpy(&ctxP->state, algP->initP, algP->state_size);
+    ctxP->nbytes = 0;
+    ctxP->nbuf = 0;
+}
+
+void TwapiHashUpdate(TwapiHashCtx *ctxP, const unsigned char *p, size_t n)
+{
+    DWORD bs = ctxP->algP->block_size;
+    size_t nblocks, ncopy;
+
+    ctxP->nbytes += n;
+    if (ctxP->nbuf) {
+        ncopy = bs - ctxP->nbuf;
+        if (ncopy > n)
+            ncopy = n;
+        memcpy(ctxP->buf + ctxP->nbuf, p, ncopy);
+        ctxP->nbuf += (DWORD) ncopy;
+        p += ncopy;
+        n -= ncopy;
+        if (ctxP->nbuf < bs)
+            return;
+        ctxP->algP->blocksfn(ctxP, ctxP->buf, 1);
+        ctxP->nbuf = 0;
+    }
+    /* Whole blocks are hashed in place without copying */
+    nblocks = n / bs;
+    if (nblocks) {
+        ctxP->algP->blocksfn(ctxP, p, nblocks);
+        p += nblocks * bs;
+        n -= nblocks * bs;
+    }
+    if (n) {
+        memcpy(ctxP->buf, p, n);
+        ctxP->nbuf = (DWORD) n;
+    }
+}
+
+void TwapiHashFinal(TwapiHashCtx *ctxP, unsigned char *digestP)
+{
+    const TwapiHashAlg *algP = ctxP->algP;
+    DWORD bs = algP->block_size;
+    DWORD nlen = bs / 8;        /* Length field is 64 or 128 bits */
+    TwapiHashU64 nbits = ctxP->nbytes << 3;
+    unsigned char *p = ctxP->buf;
+    DWORD i, n = ctxP->nbuf;
+
+    p[n++] = 0x80;
+    if (n > bs - nlen) {
+        memset(p + n, 0, bs - n);
+        algP->blocksfn(ctxP, p, 1);
+        n = 0;
+    }
+    memset(p + n, 0, bs - n);
+    for (i = 0; i < 8; ++i) {
+        if (algP->little_endian)
+            p[bs - 8 + i] = (unsigned char) (nbits >> (8 * i));
+        else
+            p[bs - 1 - i] = (unsigned char) (nbits >> (8 * i));
+    }
+    if (nlen == 16)
+        p[bs - 9] = (unsigned char) (ctxP->nbytes >> 61);
+    algP->blocksfn(ctxP, p, 1);
+
+    for (i = 0; i < algP->digest_size; ++i) {
+        if (bs == 128)
+            digestP[i] = (unsigned char) (ctxP->state.w64[i >> 3] >> (56 - 8 * (i & 7)));
+        else if (algP->little_endian)
+            digestP[i] = (unsigned char) (ctxP->state.w32[i >> 2] >> (8 * (i & 3)));
+        else
+            digestP[i] = (unsigned char) (ctxP->state.w32[i >> 2] >> (24 - 8 * (i & 3)));
+    }
+    TwapiHashZero(ctxP, sizeof(*ctxP));
+}
+
+void TwapiHmacInit(TwapiHmacCtx *ctxP, const TwapiHashAlg *algP,
+                   const unsigned char *keyP, size_t nkey)
+{
+    unsigned char pad[TWAPI_HASH_MAX_BLOCK_SIZE];
+    DWORD i, bs = algP->block_size;
+
+    TwapiHashInit(&ctxP->inner, algP);
+    if (keyP == NULL) {
+        ctxP->outer.algP = NULL;
+        return;
+    }
+
+    /* Keys longer than the block size are replaced by their hash */
+    memset(pad, 0, bs);
+    if (nkey > bs) {
+        TwapiHashInit(&ctxP->outer, algP);
+        TwapiHashUpdate(&ctxP->outer, keyP, nkey);
+        TwapiHashFinal(&ctxP->outer, pad);
+    } else
+        memcpy(pad, keyP, nkey);
+
+    for (i = 0; i < bs; ++i)
+        pad[i] ^= 0x36;
+    TwapiHashUpdate(&ctxP->inner, pad, bs);
+    for (i = 0; i < bs; ++i)
+        pad[i] ^= 0x36 ^ 0x5c;
+    TwapiHashInit(&ctxP->outer, algP);
+    TwapiHashUpdate(&ctxP->outer, pad, bs);
+    TwapiHashZero(pad, sizeof(pad));
+}
+
+void TwapiHmacUpdate(TwapiHmacCtx *ctxP, const unsigned char *p, size_t n)
+{
+    TwapiHashUpdate(&ctxP->inner, p, n);
+}
+
+void TwapiHmacFinal(TwapiHmacCtx *ctxP, unsigned char *digestP)
+{
+    unsigned char digest[TWAPI_HASH_MAX_DIGEST_SIZE];
+    const TwapiHashAlg *algP = ctxP->inner.algP;
+
+    if (ctxP->outer.algP == NULL) {
+        TwapiHashFinal(&ctxP->inner, digestP);
+        return;
+    }
+    TwapiHashFinal(&ctxP->inner, digest);
+    TwapiHashUpdate(&ctxP->outer, digest, algP->digest_size);
+    TwapiHashFinal(&ctxP->outer, digestP);
+    TwapiHashZero(digest, sizeof(digest));
+}
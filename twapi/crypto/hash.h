@@ -0,0 +1,80 @@
+#ifndef TWAPI_HASH_H
+#define TWAPI_HASH_H
+
+/*
+ * Native MD5, SHA-1 and SHA-2 message digests and HMAC.
+ *
+ * The implementation does not depend on TWAPI or Windows. Defining
+ * CRYPTO_STANDALONE when compiling hash.c and pbkdf2.c builds them
+ * without TWAPI headers, as done by the benchmarks in tests/perf.
+ */
+
+#if defined(CRYPTO_STANDALONE) && !defined(_WIN32)
+# include <stddef.h>
+typedef unsigned int DWORD;
+typedef int BOOL;
+typedef unsigned char BYTE;
+# define TRUE 1
+# define FALSE 0
+#endif
+
+#ifdef _MSC_VER
+typedef unsigned __int64 TwapiHashU64;
+#else
+typedef unsigned long long TwapiHashU64;
+#endif
+
+#define TWAPI_HASH_MAX_DIGEST_SIZE 64
+#define TWAPI_HASH_MAX_BLOCK_SIZE 128
+
+typedef struct _TwapiHashAlg TwapiHashAlg;
+
+/* Hash computation in progress */
+typedef struct _TwapiHashCtx {
+    const TwapiHashAlg *algP;
+    union {
+        DWORD w32[8];
+        TwapiHashU64 w64[8];
+    } state;
+    TwapiHashU64 nbytes;        /* Total bytes hashed so far */
+    DWORD nbuf;                 /* Bytes held in buf[] */
+    unsigned char buf[TWAPI_HASH_MAX_BLOCK_SIZE];
+} TwapiHashCtx;
+
+/*
+ * Hash or HMAC computation in progress. For plain hashes outer.algP
+ * is NULL.
+ */
+typedef struct _TwapiHmacCtx {
+    TwapiHashCtx inner;
+    TwapiHashCtx outer;
+} TwapiHmacCtx;
+
+/*
+ * Looks up an algorithm by name - md5, sha1, sha224, sha256, sha384
+ * or sha512, optionally with an underscore after "sha" as used in
+ * TWAPI algorithm identifiers. Returns NULL if not supported.
+ */
+const TwapiHashAlg *TwapiHashAlgFromName(const char *nameP);
+DWORD TwapiHashDigestSize(const TwapiHashAlg *algP);
+const char *TwapiHashAlgName(const TwapiHashAlg *algP);
+
+void TwapiHashInit(TwapiHashCtx *ctxP, const TwapiHashAlg *algP);
+void TwapiHashUpdate(TwapiHashCtx *ctxP, const unsigned char *p, size_t n);
+/* Stores TwapiHashDigestSize() bytes in digestP */
+void TwapiHashFinal(TwapiHashCtx *ctxP, unsigned char *digestP);
+
+/* keyP may be NULL in which case a plain hash is computed */
+void TwapiHmacInit(TwapiHmacCtx *ctxP, const TwapiHashAlg *algP,
+                   const unsigned char *keyP, size_t nkey);
+void TwapiHmacUpdate(TwapiHmacCtx *ctxP, const unsigned char *p, size_t n);
+void TwapiHmacFinal(TwapiHmacCtx *ctxP, unsigned char *digestP);
+
+/*
+ * Compression functions for callers that manage their own blocks,
+ * given as 16 big-endian words
+ */
+void TwapiSha1Compress(DWORD *stateP, const DWORD *blockP);
+void TwapiSha256Compress(DWORD *stateP, const DWORD *blockP);
+
+#endif
@@ -1,267 +1,212 @@
 /*
- * An implementation of PBKDF2 (Password-Based Key Derivation Function) using Crypto API 
- * (RFC2898 / PKCS#5)
+ * An implementation of PBKDF2 (Password-Based Key Derivation Function)
+ * with HMAC-SHA1 and HMAC-SHA256 (RFC2898 / PKCS#5)
  *
  * Copyright (c) 2010 Mounir IDRASSI <mounir.idrassi@idrix.fr>. All rights reserved.
  *
- * This program is distributed in the hope that it will be useful, 
- * but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
  * or FITNESS FOR A PARTICULAR PURPOSE.
- * 
+ *
  */
 
-#ifndef _WIN32_WINNT         
-#define _WIN32_WINNT 0x0501
-#endif
-
 /*
- * Defining USE_SWS uses the TWAPI software stack for allocations
- * and assumes twapi integration.
+ * TWAPI additions: the HMAC was originally computed through Crypto API
+ * which cost a provider call per iteration. It now uses the native
+ * hashes in hash.c. The HMAC key pads are hashed once so that every
+ * iteration costs exactly two compressions of pre-padded blocks, and
+ * the independent output blocks are derived in parallel threads.
+ *
+ * Defining CRYPTO_STANDALONE builds the file without TWAPI, including
+ * on non-Windows platforms, as done by tests/perf/pbkdf2_bench.c.
  */
-#define USE_SWS 1
 
-#ifdef USE_SWS
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0501
+#endif
+
+#ifdef CRYPTO_STANDALONE
+# ifdef _WIN32
+#  include <windows.h>
+# else
+#  include <pthread.h>
+#  include <string.h>
+#  include <unistd.h>
+#  define ERROR_BAD_ARGUMENTS 160
+#  define SetLastError(e) ((void) (e))
+#  define ZeroMemory(p, n) memset((p), 0, (n))
+#  define SecureZeroMemory PBKDF2SecureZeroMemory
+# endif
+#else
 # include "twapi.h"
 # include "twapi_crypto.h"
-#define LocalAlloc LocalAllocShouldNotBeUsedIfSWSEnabled
-#define LocalFree LocalFreeShouldNotBeUsedIfSWSEnabled
-#else
-# include <windows.h>
-# include <wincrypt.h>
 #endif
 
-#include <stdio.h>
-#include <math.h>
+#include <string.h>
 
+#include "hash.h"
 #include "pbkdf2.h"
 
-/* Implementation of HMAC-SHA1 using CAPI */
-
-#define HMAC_SHA1_MAGIC 0x53484131
-
-typedef struct
-{
-   HCRYPTPROV hProv;
-   HCRYPTKEY hKey;
-} CAPI_CTX_PARAM;
-
-// Structure used by CAPI for HMAC computation
-typedef struct {
-   BLOBHEADER hdr;
-   DWORD cbKeySize;
-} HMAC_KEY_BLOB;
-
-BOOL WINAPI hmacInit_sha(
-   PRF_CTX*       pContext,   /* PRF context used in HMAC computation */
-   unsigned char* pbKey,      /* pointer to authentication key */
-   DWORD          cbKey       /* length of authentication key */                        
-)
+#if defined(CRYPTO_STANDALONE) && !defined(_WIN32)
+static void PBKDF2SecureZeroMemory(void *p, size_t n)
 {
-   HCRYPTPROV hProv = 0;
-   HCRYPTKEY hKey = 0;
-   HMAC_KEY_BLOB *pKeyBlob = NULL;
-   BOOL bStatus = FALSE;
-   DWORD dwError = 0, dwLen;
-   CAPI_CTX_PARAM* pParam = NULL;
-
-#ifdef USE_SWS
-   pKeyBlob = (HMAC_KEY_BLOB *) SWSAlloc(sizeof(HMAC_KEY_BLOB) + cbKey + 20,
-                                         NULL); // enough room for 0's padding
-#else
-   pKeyBlob = (HMAC_KEY_BLOB *) LocalAlloc(0, sizeof(HMAC_KEY_BLOB) + cbKey + 20); // we put enough room for 0's padding
-   if (pKeyBlob == NULL) {
-      dwError = ERROR_NOT_ENOUGH_MEMORY;
-      goto hmacInit_end;
-   }
-#endif
-   
-   pKeyBlob->hdr.bType = PLAINTEXTKEYBLOB;
-   pKeyBlob->hdr.bVersion = CUR_BLOB_VERSION;
-   pKeyBlob->hdr.reserved = 0;
-   pKeyBlob->hdr.aiKeyAlg = CALG_RC2;
-   pKeyBlob->cbKeySize = cbKey;
-   memcpy(((LPBYTE) pKeyBlob) + sizeof(HMAC_KEY_BLOB), pbKey, cbKey);
-
-   if (!pContext)
-   {
-      dwError = ERROR_BAD_ARGUMENTS;
-      goto hmacInit_end;
-   }
-
-   if (!CryptAcquireContext(&hProv, NULL, NULL, PROV_RSA_AES, CRYPT_VERIFYCONTEXT)) 
-   {
-      dwError = GetLastError();
-      goto hmacInit_end;
-   }
-
-   dwLen = sizeof(HMAC_KEY_BLOB) + cbKey;
-   if (dwLen < 20)
-   {
-      // we pad with zeros till the size of SHA1 digest.
-      // this is to avoid erros under Windows 8.1 wich doesn't accept 1-byte RC2 keys
-      // the result will be the same since the HMAC-SHA1 will perform the same padding
-	  DWORD dwPad = 20 - dwLen;
-	  memset(((LPBYTE) pKeyBlob) + dwLen, 0, dwPad);
-	  dwLen += dwPad;
-	  pKeyBlob->cbKeySize += dwPad;
-   }
-
-   if (!CryptImportKey(hProv, (LPBYTE) pKeyBlob, dwLen, 0, CRYPT_IPSEC_HMAC_KEY, &hKey))
-   {
-      dwError = GetLastError();
-      goto hmacInit_end;
-   }
-
-#ifdef USE_SWS
-   pParam = (CAPI_CTX_PARAM*) SWSAlloc(sizeof(CAPI_CTX_PARAM), NULL);
-#else
-   pParam = (CAPI_CTX_PARAM*) LocalAlloc(0, sizeof(CAPI_CTX_PARAM));
+   volatile BYTE *vp = (volatile BYTE *) p;
+   while (n--) *vp++ = 0;
+}
 #endif
-   pParam->hProv = hProv;
-   pParam->hKey = hKey;
 
-   pContext->magic = HMAC_SHA1_MAGIC;
-   pContext->pParam = (void*) pParam;
+/* Maximum number of threads used to derive output blocks */
+#define PBKDF2_MAX_THREADS 16
 
-   hProv = 0;
-   hKey = 0;
-
-   bStatus = TRUE;
+/*
+ * Below this iteration count a block is cheaper to derive than the
+ * cost of starting a thread for it
+ */
+#define PBKDF2_MIN_PARALLEL_ITERATIONS 1000
 
-hmacInit_end:
+/*
+ * Definition of the HMAC-SHA1 and HMAC-SHA256 PRFs
+ */
+PRF sha1Prf = {TwapiSha1Compress, "sha1", 5, 20};
+PRF sha256Prf = {TwapiSha256Compress, "sha256", 8, 32};
 
-   if (hKey) CryptDestroyKey(hKey);
-   if (hProv) CryptReleaseContext(hProv, 0);
-#ifndef USE_SWS
-   if (pKeyBlob) LocalFree(pKeyBlob);
-#endif
-   
-   SetLastError(dwError);
-   return bStatus;
+/* State shared by the threads deriving the blocks of a key */
+typedef struct
+{
+   PRF*           pPrf;
+   TwapiHmacCtx   hmac;       /* after hashing the key XOR ipad / opad */
+   unsigned char* pbSalt;
+   DWORD          cbSalt;
+   DWORD          dwIterationCount;
+   unsigned char* pbDerivedKey;
+   DWORD          cbDerivedKey;
+   DWORD          nBlocks;
+} PBKDF2_CTX;
+
+/* Derives output block i (1-based) into pbDerivedKey */
+static void PBKDF2Block(PBKDF2_CTX *pCtx, DWORD i)
+{
+   PRF *pPrf = pCtx->pPrf;
+   DWORD n = pPrf->nStateWords;
+   DWORD hlen = pPrf->cbHmacLength;
+   const DWORD *inner = pCtx->hmac.inner.state.w32;
+   const DWORD *outer = pCtx->hmac.outer.state.w32;
+   DWORD U[8], T[8];
+   DWORD inBlock[16], outBlock[16];
+   TwapiHmacCtx hmac;
+   BYTE digest[32];
+   BYTE counter[4];
+   DWORD j, k, cbOut;
+
+   /* U1 = PRF(P, S || INT(i)) */
+   counter[0] = (BYTE) (i >> 24);
+   counter[1] = (BYTE) (i >> 16);
+   counter[2] = (BYTE) (i >> 8);
+   counter[3] = (BYTE) i;
+   hmac = pCtx->hmac;
+   TwapiHmacUpdate(&hmac, pCtx->pbSalt, pCtx->cbSalt);
+   TwapiHmacUpdate(&hmac, counter, 4);
+   TwapiHmacFinal(&hmac, digest);
+   for (k = 0; k < n; k++)
+      T[k] = U[k] = ((DWORD) digest[4*k] << 24) | ((DWORD) digest[4*k+1] << 16) |
+         ((DWORD) digest[4*k+2] << 8) | digest[4*k+3];
+
+   /*
+    * Both the inner and outer hashes of the remaining iterations are of
+    * a single digest following the 64 byte pad block so their padding
+    * is fixed and set up once.
+    */
+   ZeroMemory(inBlock, sizeof(inBlock));
+   inBlock[n] = 0x80000000;
+   inBlock[15] = (64 + hlen) * 8;
+   memcpy(outBlock, inBlock, sizeof(outBlock));
+
+   for (j = 1; j < pCtx->dwIterationCount; j++)
+   {
+      memcpy(inBlock, U, n * sizeof(DWORD));
+      memcpy(outBlock, inner, n * sizeof(DWORD));
+      pPrf->compress(outBlock, inBlock);
+      memcpy(U, outer, n * sizeof(DWORD));
+      pPrf->compress(U, outBlock);
+      for (k = 0; k < n; k++)
+         T[k] ^= U[k];
+   }
+
+   /* Only the leading bytes of the last block are used */
+   cbOut = pCtx->cbDerivedKey - (i - 1) * hlen;
+   if (cbOut > hlen)
+      cbOut = hlen;
+   for (k = 0; k < cbOut; k++)
+      pCtx->pbDerivedKey[(i - 1) * hlen + k] = (BYTE) (T[k >> 2] >> (24 - 8 * (k & 3)));
+
+   SecureZeroMemory(&hmac, sizeof(hmac));
+   SecureZeroMemory(digest, sizeof(digest));
+   SecureZeroMemory(U, sizeof(U));
+   SecureZeroMemory(T, sizeof(T));
+   SecureZeroMemory(inBlock, sizeof(inBlock));
+   SecureZeroMemory(outBlock, sizeof(outBlock));
 }
 
-static BOOL WINAPI hmac_sha(
-   ALG_ID          algid,         /* CALG_SHA1, CALG_SHA256 etc. */
-   PRF_CTX*        pContext,      /* PRF context used in HMAC computation */  
-   unsigned char*  pbData,        /* pointer to data stream */
-   DWORD           cbData,        /* length of data stream */
-   unsigned char*  pbDigest,      /* caller digest to be filled in */
-   DWORD           cbDigest
-)
+/* Work of one thread - every nStride'th block starting at dwFirst */
+typedef struct
 {
-   HCRYPTPROV hProv = 0;
-   HCRYPTHASH hHash = 0;
-   HCRYPTKEY hKey = 0;
-   HMAC_INFO   HmacInfo;
-   BOOL bStatus = FALSE;
-   DWORD dwError = 0;
-
-   ZeroMemory(&HmacInfo, sizeof(HmacInfo));
-   HmacInfo.HashAlgid = algid;
-
-   if (!pContext || (pContext->magic != HMAC_SHA1_MAGIC) || (!pContext->pParam))
-   {
-      dwError = ERROR_BAD_ARGUMENTS;
-      goto hmac_end;
-   }
-
-   hProv = ((CAPI_CTX_PARAM*) pContext->pParam)->hProv;
-   hKey = ((CAPI_CTX_PARAM*) pContext->pParam)->hKey;
-
-   if (!CryptCreateHash(hProv, CALG_HMAC, hKey, 0, &hHash))
-   {
-      dwError = GetLastError();
-      goto hmac_end;
-   }
-
-   if (!CryptSetHashParam( hHash, HP_HMAC_INFO, (BYTE*)&HmacInfo, 0))
-   {
-      dwError = GetLastError();
-      goto hmac_end;
-   }
+   PBKDF2_CTX* pCtx;
+   DWORD       dwFirst;
+   DWORD       nStride;
+} PBKDF2_WORK;
 
-   if (!CryptHashData(hHash, pbData, cbData, 0))
-   {
-      dwError = GetLastError();
-      goto hmac_end;
-   }
-
-   if (!CryptGetHashParam(hHash, HP_HASHVAL, pbDigest, &cbDigest, 0))
-   {
-      dwError = GetLastError();
-      goto hmac_end;
-   }
-
-   bStatus = TRUE;
-
-hmac_end:
-
-   if (hHash) CryptDestroyHash(hHash);
-
-   SetLastError(dwError);
-   return bStatus;
+static void PBKDF2Blocks(PBKDF2_WORK *pWork)
+{
+   DWORD i;
+   for (i = pWork->dwFirst; i <= pWork->pCtx->nBlocks; i += pWork->nStride)
+      PBKDF2Block(pWork->pCtx, i);
 }
 
-BOOL WINAPI hmac_sha1(
-   PRF_CTX*       pContext,        /* PRF context used in HMAC computation */  
-   unsigned char*  pbData,         /* pointer to data stream */
-   DWORD           cbData,         /* length of data stream */
-   unsigned char*  pbDigest,       /* caller digest to be filled in */
-   DWORD           cbDigest        /* Space in pbDigest */
-)
+#ifdef _WIN32
+typedef HANDLE PBKDF2_THREAD;
+static DWORD WINAPI PBKDF2ThreadProc(LPVOID pv)
 {
-   return hmac_sha(CALG_SHA1, pContext, pbData, cbData, pbDigest, cbDigest);
+   PBKDF2Blocks((PBKDF2_WORK *) pv);
+   return 0;
 }
-
-BOOL WINAPI hmac_sha256(
-   PRF_CTX*       pContext,        /* PRF context used in HMAC computation */  
-   unsigned char*  pbData,         /* pointer to data stream */
-   DWORD           cbData,         /* length of data stream */
-   unsigned char*  pbDigest,       /* caller digest to be filled in */
-   DWORD           cbDigest        /* Space in pbDigest */
-)
+static BOOL PBKDF2StartThread(PBKDF2_THREAD *pThread, PBKDF2_WORK *pWork)
 {
-   return hmac_sha(CALG_SHA_256, pContext, pbData, cbData, pbDigest, cbDigest);
+   /* Thread does not use the CRT so CreateThread is safe */
+   *pThread = CreateThread(NULL, 0, PBKDF2ThreadProc, pWork, 0, NULL);
+   return *pThread != NULL;
 }
-
-BOOL WINAPI hmacFree_sha(
-   PRF_CTX*       pContext          /* PRF context used in HMAC computation */  
-)
+static void PBKDF2JoinThread(PBKDF2_THREAD thread)
 {
-   HCRYPTPROV hProv = 0;
-   HCRYPTKEY hKey = 0;
-
-   if (!pContext || (pContext->magic != HMAC_SHA1_MAGIC) || (!pContext->pParam))
-   {
-      SetLastError(ERROR_BAD_ARGUMENTS);
-      return FALSE;
-   }
-
-   hProv = ((CAPI_CTX_PARAM*) pContext->pParam)->hProv;
-   hKey = ((CAPI_CTX_PARAM*) pContext->pParam)->hKey;
-
-   CryptDestroyKey(hKey);
-   CryptReleaseContext(hProv, 0);
-
-#ifndef USE_SWS
-   LocalFree(pContext->pParam);
-#endif
-   SecureZeroMemory(pContext, sizeof(PRF_CTX));
-
-   return TRUE;
+   WaitForSingleObject(thread, INFINITE);
+   CloseHandle(thread);
 }
-
-/*
- * Definition of the HMAC-SHA1 PRF
- */
-PRF sha1Prf = {hmacInit_sha, hmac_sha1, hmacFree_sha, 20};
-PRF sha256Prf = {hmacInit_sha, hmac_sha256, hmacFree_sha, 32};
-
-static __inline void xor(LPBYTE ptr1, LPBYTE ptr2, DWORD dwLen)
+static DWORD PBKDF2ProcessorCount(void)
 {
-   if (dwLen)
-      while (dwLen--) *ptr1++ ^= *ptr2++;
+   SYSTEM_INFO si;
+   GetSystemInfo(&si);
+   return si.dwNumberOfProcessors;
 }
+#else
+typedef pthread_t PBKDF2_THREAD;
+static void *PBKDF2ThreadProc(void *pv)
+{
+   PBKDF2Blocks((PBKDF2_WORK *) pv);
+   return NULL;
+}
+static BOOL PBKDF2StartThread(PBKDF2_THREAD *pThread, PBKDF2_WORK *pWork)
+{
+   return pthread_create(pThread, NULL, PBKDF2ThreadProc, pWork) == 0;
+}
+static void PBKDF2JoinThread(PBKDF2_THREAD thread)
+{
+   pthread_join(thread, NULL);
+}
+static DWORD PBKDF2ProcessorCount(void)
+{
+   long n = sysconf(_SC_NPROCESSORS_ONLN);
+   return n > 0 ? (DWORD) n : 1;
+}
+#endif
 
 /*
  * PBKDF2 implementation
@@ -275,112 +220,65 @@ BOOL PBKDF2(PRF *pPrf,
             unsigned char* pbDerivedKey,
             DWORD          cbDerivedKey)
 {
-   BOOL bStatus = FALSE;
-   DWORD dwError = 0;
-   DWORD l, r, i,j;
+   static DWORD nProcessors;
+   PBKDF2_CTX ctx;
+   PBKDF2_WORK work[PBKDF2_MAX_THREADS];
+   PBKDF2_THREAD threads[PBKDF2_MAX_THREADS];
+   BOOL started[PBKDF2_MAX_THREADS];
    DWORD hlen = pPrf->cbHmacLength;
-   LPBYTE Ti = NULL;
-   LPBYTE V = NULL;
-   LPBYTE U = NULL;
-   DWORD dwULen;
-   PRF_CTX prfCtx = {0};
-#ifdef USE_SWS
-   SWSMark mark = NULL;
-#endif
+   DWORD nThreads, t;
 
-   
-   if (!pbDerivedKey || !cbDerivedKey || (!pbPassword && cbPassword) )
+   if (!pbDerivedKey || !cbDerivedKey || (!pbPassword && cbPassword) ||
+       (!pbSalt && cbSalt) || !dwIterationCount)
    {
-      dwError = ERROR_BAD_ARGUMENTS;
-      goto PBKDF2_end;
+      SetLastError(ERROR_BAD_ARGUMENTS);
+      return FALSE;
    }
 
-#ifdef USE_SWS
-   mark = SWSPushMark();
-   Ti = (LPBYTE) SWSAlloc(hlen, NULL);
-   V = (LPBYTE) SWSAlloc(hlen, NULL);
-   U = (LPBYTE) SWSAlloc(max((cbSalt + 4), hlen), NULL);
-#else
-   Ti = (LPBYTE) LocalAlloc(0, hlen);
-   V = (LPBYTE) LocalAlloc(0, hlen);
-   U = (LPBYTE) LocalAlloc(0, max((cbSalt + 4), hlen));
+   ctx.pPrf = pPrf;
+   TwapiHmacInit(&ctx.hmac, TwapiHashAlgFromName(pPrf->pszHashName),
+                 pbPassword ? pbPassword : (unsigned char *) "", cbPassword);
+   ctx.pbSalt = pbSalt;
+   ctx.cbSalt = cbSalt;
+   ctx.dwIterationCount = dwIterationCount;
+   ctx.pbDerivedKey = pbDerivedKey;
+   ctx.cbDerivedKey = cbDerivedKey;
+   ctx.nBlocks = (cbDerivedKey + hlen - 1) / hlen;
 
-   if (!Ti || !U || !V)
+   nThreads = 1;
+   if (ctx.nBlocks > 1 && dwIterationCount >= PBKDF2_MIN_PARALLEL_ITERATIONS)
    {
-      dwError = ERROR_NOT_ENOUGH_MEMORY;
-      goto PBKDF2_end;
+      if (nProcessors == 0)
+         nProcessors = PBKDF2ProcessorCount(); /* Benign race */
+      nThreads = ctx.nBlocks;
+      if (nThreads > nProcessors)
+         nThreads = nProcessors;
+      if (nThreads > PBKDF2_MAX_THREADS)
+         nThreads = PBKDF2_MAX_THREADS;
    }
-#endif
-   
-   l = (DWORD) ceil((double) cbDerivedKey / (double) hlen);
-   r = cbDerivedKey - (l - 1) * hlen;
 
-   if (!pPrf->hmacInit(&prfCtx, pbPassword, cbPassword))
+   for (t = 0; t < nThreads; t++)
    {
-      dwError = GetLastError();
-      goto PBKDF2_end;
+      work[t].pCtx = &ctx;
+      work[t].dwFirst = t + 1;
+      work[t].nStride = nThreads;
    }
-
-   for (i = 1; i <= l; i++)
+   /* This thread does the first share and any that could not be started */
+   for (t = 1; t < nThreads; t++)
+      started[t] = PBKDF2StartThread(&threads[t], &work[t]);
+   PBKDF2Blocks(&work[0]);
+   for (t = 1; t < nThreads; t++)
    {
-      ZeroMemory(Ti, hlen);
-      for (j = 0; j < dwIterationCount; j++)
-      {
-         if (j == 0)
-         {
-            // construct first input for PRF
-            memcpy(U, pbSalt, cbSalt);
-            U[cbSalt] = (BYTE) ((i & 0xFF000000) >> 24);
-            U[cbSalt + 1] = (BYTE) ((i & 0x00FF0000) >> 16);
-            U[cbSalt + 2] = (BYTE) ((i & 0x0000FF00) >> 8);
-            U[cbSalt + 3] = (BYTE) ((i & 0x000000FF));
-            dwULen = cbSalt + 4;
-         }
-         else
-         {
-            memcpy(U, V, hlen);
-            dwULen = hlen;
-         }
-
-         if (!pPrf->hmac(&prfCtx, U, dwULen, V, hlen))
-         {
-            dwError = GetLastError();
-            goto PBKDF2_end;
-         }
-
-         xor(Ti, V, hlen);
-      }
-
-      if (i != l)
-      {
-         memcpy(&pbDerivedKey[(i-1) * hlen], Ti, hlen);
-      }
+      if (started[t])
+         PBKDF2JoinThread(threads[t]);
       else
-      {
-         // Take only the first r bytes
-         memcpy(&pbDerivedKey[(i-1) * hlen], Ti, r);
-      }
+         PBKDF2Blocks(&work[t]);
    }
 
-   bStatus = TRUE;
-
-PBKDF2_end:
-
-   pPrf->hmacFree(&prfCtx);
-
-#ifdef USE_SWS
-   if (mark)
-       SWSPopMark(mark);
-#else
-   if (Ti) LocalFree(Ti);
-   if (U) LocalFree(U);
-   if (V) LocalFree(V);
-#endif
-   
-   SetLastError(dwError);
-   return bStatus;
+   SecureZeroMemory(&ctx, sizeof(ctx));
+   return TRUE;
 }
-   
+
 #if defined(PBKDF2TEST)
 int main(int argc, char* argv[])
 {  
@@ -581,7 +479,7 @@ int main(int argc, char* argv[])
                                        };
 
    
-   if (!PBKDF2(sha1Prf, (LPBYTE) "password", 8, (LPBYTE) "salt", 4, 1, pbDerivedKey, 20))
+   if (!PBKDF2(&sha1Prf, (LPBYTE) "password", 8, (LPBYTE) "salt", 4, 1, pbDerivedKey, 20))
    {
       printf("Test 1 failed: PBKDF2 returned FALSE (Error 0x%.8X)\n", GetLastError());
       goto main_end;
@@ -593,7 +491,7 @@ int main(int argc, char* argv[])
    }
 
    
-   if (!PBKDF2(sha1Prf, (LPBYTE) "password", 8, (LPBYTE) "salt", 4, 2, pbDerivedKey, 20))
+   if (!PBKDF2(&sha1Prf, (LPBYTE) "password", 8, (LPBYTE) "salt", 4, 2, pbDerivedKey, 20))
    {
       printf("Test 2 failed: PBKDF2 returned FALSE (Error 0x%.8X)\n", GetLastError());
       goto main_end;
@@ -604,7 +502,7 @@ int main(int argc, char* argv[])
       goto main_end;
    }
 
-   if (!PBKDF2(sha1Prf, (LPBYTE) "password", 8, (LPBYTE) "salt", 4, 4096, pbDerivedKey, 20))
+   if (!PBKDF2(&sha1Prf, (LPBYTE) "password", 8, (LPBYTE) "salt", 4, 4096, pbDerivedKey, 20))
    {
       printf("Test 3 failed: PBKDF2 returned FALSE (Error 0x%.8X)\n", GetLastError());
       goto main_end;
@@ -615,7 +513,7 @@ int main(int argc, char* argv[])
       goto main_end;
    }
 
-   if (!PBKDF2(sha1Prf, (LPBYTE) "password", 8, pbSalt, 8, 2048, pbDerivedKey, 24))
+   if (!PBKDF2(&sha1Prf, (LPBYTE) "password", 8, pbSalt, 8, 2048, pbDerivedKey, 24))
    {
       printf("Test 4 failed: PBKDF2 returned FALSE (Error 0x%.8X)\n", GetLastError());
       goto main_end;
@@ -626,7 +524,7 @@ int main(int argc, char* argv[])
       goto main_end;
    }
 
-   if (!PBKDF2(sha1Prf, (LPBYTE) "Hello World", 11, pbOtherSalt, 8, 1000, pbDerivedKey, 20))
+   if (!PBKDF2(&sha1Prf, (LPBYTE) "Hello World", 11, pbOtherSalt, 8, 1000, pbDerivedKey, 20))
    {
       printf("Test 5 failed: PBKDF2 returned FALSE (Error 0x%.8X)\n", GetLastError());
       goto main_end;
@@ -637,7 +535,7 @@ int main(int argc, char* argv[])
       goto main_end;
    }
 
-   if (!PBKDF2(sha1Prf, (LPBYTE) "password", 8, (LPBYTE) "ATHENA.MIT.EDUraeburn", 21, 1, pbDerivedKey, 32))
+   if (!PBKDF2(&sha1Prf, (LPBYTE) "password", 8, (LPBYTE) "ATHENA.MIT.EDUraeburn", 21, 1, pbDerivedKey, 32))
    {
       printf("Test 6 failed: PBKDF2 returned FALSE (Error 0x%.8X)\n", GetLastError());
       goto main_end;
@@ -648,7 +546,7 @@ int main(int argc, char* argv[])
       goto main_end;
    }
 
-   if (!PBKDF2(sha1Prf, (LPBYTE) "password", 8, (LPBYTE) "ATHENA.MIT.EDUraeburn", 21, 2, pbDerivedKey, 32))
+   if (!PBKDF2(&sha1Prf, (LPBYTE) "password", 8, (LPBYTE) "ATHENA.MIT.EDUraeburn", 21, 2, pbDerivedKey, 32))
    {
       printf("Test 7 failed: PBKDF2 returned FALSE (Error 0x%.8X)\n", GetLastError());
       goto main_end;
@@ -659,7 +557,7 @@ int main(int argc, char* argv[])
       goto main_end;
    }
 
-   if (!PBKDF2(sha1Prf, (LPBYTE) "password", 8, (LPBYTE) "ATHENA.MIT.EDUraeburn", 21, 1200, pbDerivedKey, 32))
+   if (!PBKDF2(&sha1Prf, (LPBYTE) "password", 8, (LPBYTE) "ATHENA.MIT.EDUraeburn", 21, 1200, pbDerivedKey, 32))
    {
       printf("Test 8 failed: PBKDF2 returned FALSE (Error 0x%.8X)\n", GetLastError());
       goto main_end;
@@ -670,7 +568,7 @@ int main(int argc, char* argv[])
       goto main_end;
    }
 
-   if (!PBKDF2(sha1Prf, (LPBYTE) "password", 8, (LPBYTE) "\0224VxxV4\022", 8, 5, pbDerivedKey, 32))
+   if (!PBKDF2(&sha1Prf, (LPBYTE) "password", 8, (LPBYTE) "\0224VxxV4\022", 8, 5, pbDerivedKey, 32))
    {
       printf("Test 9 failed: PBKDF2 returned FALSE (Error 0x%.8X)\n", GetLastError());
       goto main_end;
@@ -681,7 +579,7 @@ int main(int argc, char* argv[])
       goto main_end;
    }
 
-   if (!PBKDF2(sha1Prf, (LPBYTE) "XXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXX", 64, 
+   if (!PBKDF2(&sha1Prf, (LPBYTE) "XXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXX", 64, 
                         (LPBYTE) "pass phrase equals block size", 29, 1200, pbDerivedKey, 32))
    {
       printf("Test 10 failed: PBKDF2 returned FALSE (Error 0x%.8X)\n", GetLastError());
@@ -693,7 +591,7 @@ int main(int argc, char* argv[])
       goto main_end;
    }
 
-   if (!PBKDF2(sha1Prf, (LPBYTE) "XXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXX", 65, 
+   if (!PBKDF2(&sha1Prf, (LPBYTE) "XXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXX", 65, 
                         (LPBYTE) "pass phrase exceeds block size", 30, 1200, pbDerivedKey, 32))
    {
       printf("Test 11 failed: PBKDF2 returned FALSE (Error 0x%.8X)\n", GetLastError());
@@ -705,7 +603,7 @@ int main(int argc, char* argv[])
       goto main_end;
    }
 
-   if (!PBKDF2(sha1Prf, (LPBYTE) "\360\235\204\236", 4, 
+   if (!PBKDF2(&sha1Prf, (LPBYTE) "\360\235\204\236", 4, 
                         (LPBYTE) "EXAMPLE.COMpianist", 18, 50, pbDerivedKey, 32))
    {
       printf("Test 12 failed: PBKDF2 returned FALSE (Error 0x%.8X)\n", GetLastError());
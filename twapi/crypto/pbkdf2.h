@@ -3,38 +3,21 @@
 
 // Pseudo Random Function (PRF) prototype
 
-/* generic context used in HMAC calculation */
-typedef struct
-{
-   DWORD	magic;			/* used to help check that we are using the correct context */
-   void*	pParam;	      /* hold a custom pointer known to the implementation  */
-} PRF_CTX;
-
-typedef BOOL (WINAPI* PRF_HmacInitPtr)(
-                           PRF_CTX*       pContext,   /* PRF context used in HMAC computation */
-                           unsigned char* pbKey,      /* pointer to authentication key */
-                           DWORD          cbKey       /* length of authentication key */                        
-                           );
-
-typedef BOOL (WINAPI* PRF_HmacPtr)(
-                           PRF_CTX*       pContext,   /* PRF context initialized by HmacInit */
-                           unsigned char*  pbData,    /* pointer to data stream */
-                           DWORD          cbData,     /* length of data stream */                           
-                           unsigned char* pbDigest,   /* caller digest to be filled in */
-                           DWORD          cbDigest    /* Space allocated for pbDigest */
-                           );
-
-typedef BOOL (WINAPI* PRF_HmacFreePtr)(
-                           PRF_CTX*       pContext	/* PRF context initialized by HmacInit */                        
+/*
+ * Compression function of the hash, e.g. TwapiSha1Compress. Updates
+ * the state with one 64 byte block given as 16 big-endian words.
+ */
+typedef void (*PRF_CompressPtr)(
+                           DWORD*         pState,     /* hash state, nStateWords words */
+                           const DWORD*   pBlock      /* 16 words of message */
                            );
 
-
 /* PRF type definition */
 typedef struct
 {
-   PRF_HmacInitPtr   hmacInit;
-   PRF_HmacPtr       hmac;
-   PRF_HmacFreePtr	hmacFree;
+   PRF_CompressPtr   compress;
+   const char*       pszHashName;  /* as passed to TwapiHashAlgFromName */
+   DWORD             nStateWords;
    DWORD             cbHmacLength;
 } PRF;
 
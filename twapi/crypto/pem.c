@@ -0,0 +1,469 @@
+/*
+ * Copyright (c) 2018, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ */
+
+/*
+ * Native base64 and PEM codec. Replaces the round trip through
+ * CryptStringToBinary/CryptBinaryToString, which need conversion to and
+ * from UTF-16, and the script level header stripping. On x86 processors
+ * with SSSE3 the inner loops convert 16 characters at a time using the
+ * pshufb based translation described by Wojciech Mula and Daniel Lemire
+ * ("Faster Base64 Encoding and Decoding Using AVX2 Instructions").
+ */
+
+#ifdef CRYPTO_STANDALONE
+# ifdef _WIN32
+#  include <windows.h>
+# endif
+#else
+# include "twapi.h"
+# include "twapi_crypto.h"
+#endif
+
+#include <string.h>
+
+#include "pem.h"
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+# include <intrin.h>
+# include <tmmintrin.h>
+# define TWAPI_BASE64_SSSE3
+# define SSSE3_TARGET
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+# include <cpuid.h>
+# include <tmmintrin.h>
+# define TWAPI_BASE64_SSSE3
+# define SSSE3_TARGET __attribute__((target("ssse3")))
+#endif
+
+int gTwapiBase64Simd = -1;
+
+static const char gBase64Chars[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+#define XX 64                   /* Invalid character */
+#define WS 65                   /* White space */
+#define PD 66                   /* Padding '=' */
+static const unsigned char gBase64Values[256] = {
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, WS, WS, WS, WS, WS, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    WS, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, 62, XX, XX, XX, 63,
+    52, 53, 54, 55, 56, 57, 58, 59, 60, 61, XX, XX, XX, PD, XX, XX,
+    XX,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+    15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, XX, XX, XX, XX, XX,
+    XX, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+    41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+};
+
+#ifdef TWAPI_BASE64_SSSE3
+
+static int TwapiBase64UseSimd(void)
+{
+    int simd = gTwapiBase64Simd;
+    if (simd < 0) {
+        /* Races are harmless as all threads store the same value */
+#ifdef _MSC_VER
+        int info[4];
+        __cpuid(info, 1);
+        simd = (info[2] & (1 << 9)) != 0;
+#else
+        unsigned int eax, ebx, ecx, edx;
+        simd = __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSSE3);
+#endif
+        gTwapiBase64Simd = simd;
+    }
+    return simd;
+}
+
+/*
+ * Encodes 12 byte groups while at least 16 bytes are readable from p
+ * and at least 12 are left in the chunk. Returns the number of bytes
+ * consumed.
+ */
+SSSE3_TARGET
+static size_t TwapiBase64EncodeSSSE3(const unsigned char *p, size_t n,
+                                     const unsigned char *endP, char *outP)
+{
+    const __m128i shuf = _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7,
+                                      4, 5, 3, 4, 1, 2, 0, 1);
+    const __m128i shift_lut = _mm_setr_epi8(
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+        '/' - 63, 'A', 0, 0);
+    const unsigned char *startP = p;
+    __m128i in, t0, t1, t2, t3, indices, result, less;
+
+    while (n >= 12 && (endP - p) >= 16) {
+        in = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) p), shuf);
+        /* Spread the four 6 bit values of each 3 bytes into 4 bytes */
+        t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+        t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+        t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+        t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+        indices = _mm_or_si128(t1, t3);
+        /* Map each range of values to the offset of its ASCII range */
+        result = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+        less = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+        result = _mm_or_si128(result, _mm_and_si128(less, _mm_set1_epi8(13)));
+        result = _mm_add_epi8(_mm_shuffle_epi8(shift_lut, result), indices);
+        _mm_storeu_si128((__m128i *) outP, result);
+        p += 12;
+        n -= 12;
+        outP += 16;
+    }
+    return p - startP;
+}
+
+/*
+ * Decodes 16 character groups while they only contain base64 alphabet
+ * characters. Returns the number of characters consumed; 3 bytes are
+ * stored for every 4 characters.
+ */
+SSSE3_TARGET
+static size_t TwapiBase64DecodeSSSE3(const unsigned char *p,
+                                     const unsigned char *endP,
+                                     unsigned char *outP)
+{
+    const __m128i lut_lo = _mm_setr_epi8(
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m128i lut_hi = _mm_setr_epi8(
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m128i lut_roll = _mm_setr_epi8(
+        0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i pack = _mm_setr_epi8(
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    const __m128i mask_2f = _mm_set1_epi8(0x2f);
+    const __m128i zero = _mm_setzero_si128();
+    const unsigned char *startP = p;
+    __m128i str, hi_nibbles, lo, hi, roll, merged;
+    unsigned char tmp[16];
+
+    while ((endP - p) >= 16) {
+        str = _mm_loadu_si128((const __m128i *) p);
+        hi_nibbles = _mm_and_si128(_mm_srli_epi32(str, 4), mask_2f);
+        lo = _mm_shuffle_epi8(lut_lo, _mm_and_si128(str, mask_2f));
+        hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+        /* Any character outside the alphabet has a common bit set */
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo, hi), zero)) != 0xFFFF)
+            break;
+        roll = _mm_shuffle_epi8(lut_roll,
+                                _mm_add_epi8(_mm_cmpeq_epi8(str, mask_2f),
+                                             hi_nibbles));
+        str = _mm_add_epi8(str, roll);
+        /* Pack the 6 bit values of each 4 characters into 3 bytes */
+        merged = _mm_maddubs_epi16(str, _mm_set1_epi32(0x01400140));
+        merged = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+        merged = _mm_shuffle_epi8(merged, pack);
+        /* Output buffer only has room for 12 bytes */
+        _mm_storeu_si128((__m128i *) tmp, merged);
+        memcpy(outP, tmp, 12);
+        p += 16;
+        outP += 12;
+    }
+    return p - startP;
+}
+
+#endif /* TWAPI_BASE64_SSSE3 */
+
+size_t TwapiBase64EncodedSize(size_t n, size_t linelen)
+{
+    size_t nchars = ((n + 2) / 3) * 4;
+    if (linelen && nchars)
+        nchars += (nchars + linelen - 1) / linelen; /* \n per line */
+    return nchars;
+}
+
+/* Encodes a chunk that is a multiple of 3 bytes unless it is the last */
+static char *TwapiBase64EncodeChunk(const unsigned char *p, size_t n,
+                                    const unsigned char *endP, char *outP)
+{
+    unsigned long v;
+
+#ifdef TWAPI_BASE64_SSSE3
+    if (TwapiBase64UseSimd()) {
+        size_t consumed = TwapiBase64EncodeSSSE3(p, n, endP, outP);
+        p += consumed;
+        n -= consumed;
+        outP += (consumed / 3) * 4;
+    }
+#endif
+
+    for (; n >= 3; n -= 3, p += 3) {
+        v = (p[0] << 16) | (p[1] << 8) | p[2];
+        *outP++ = gBase64Chars[v >> 18];
+        *outP++ = gBase64Chars[(v >> 12) & 0x3f];
+        *outP++ = gBase64Chars[(v >> 6) & 0x3f];
+        *outP++ = gBase64Chars[v & 0x3f];
+    }
+    if (n) {
+        v = p[0] << 16;
+        if (n == 2)
+            v |= p[1] << 8;
+        *outP++ = gBase64Chars[v >> 18];
+        *outP++ = gBase64Chars[(v >> 12) & 0x3f];
+        *outP++ = n == 2 ? gBase64Chars[(v >> 6) & 0x3f] : '=';
+        *outP++ = '=';
+    }
+    return outP;
+}
+
+size_t TwapiBase64Encode(const unsigned char *p, size_t n, char *outP,
+                         size_t linelen)
+{
+    const unsigned char *endP = p + n;
+    char *startP = outP;
+    size_t chunk;
+
+    if (linelen == 0)
+        return TwapiBase64EncodeChunk(p, n, endP, outP) - startP;
+
+    chunk = (linelen / 4) * 3;  /* Bytes per line */
+    while (n) {
+        if (chunk > n)
+            chunk = n;
+        outP = TwapiBase64EncodeChunk(p, chunk, endP, outP);
+        *outP++ = '\n';
+        p += chunk;
+        n -= chunk;
+    }
+    return outP - startP;
+}
+
+int TwapiBase64Decode(const char *inP, size_t n, unsigned char *outP,
+                      size_t *noutP)
+{
+    const unsigned char *p = (const unsigned char *) inP;
+    const unsigned char *endP = p + n;
+    unsigned char *startP = outP;
+    unsigned char a, b, c, d;
+    unsigned long acc = 0;
+    int nacc = 0, npad = 0;
+
+    while (p < endP) {
+        if (nacc == 0 && npad == 0) {
+            /* Fast paths for runs of complete groups */
+#ifdef TWAPI_BASE64_SSSE3
+            if (TwapiBase64UseSimd()) {
+                size_t consumed = TwapiBase64DecodeSSSE3(p, endP, outP);
+                p += consumed;
+                outP += (consumed / 4) * 3;
+            }
+#endif
+            while ((endP - p) >= 4) {
+                a = gBase64Values[p[0]];
+                b = gBase64Values[p[1]];
+                c = gBase64Values[p[2]];
+                d = gBase64Values[p[3]];
+                if ((a | b | c | d) & 0xC0)
+                    break;      /* Not alphabet characters */
+                acc = (a << 18) | (b << 12) | (c << 6) | d;
+                *outP++ = (unsigned char) (acc >> 16);
+                *outP++ = (unsigned char) (acc >> 8);
+                *outP++ = (unsigned char) acc;
+                p += 4;
+            }
+            if (p >= endP)
+                break;
+        }
+
+        /* Slow path one character at a time */
+        a = gBase64Values[*p++];
+        if (a < 64) {
+            if (npad)
+                return -1;      /* Data after padding */
+            acc = (acc << 6) | a;
+            if (++nacc == 4) {
+                *outP++ = (unsigned char) (acc >> 16);
+                *outP++ = (unsigned char) (acc >> 8);
+                *outP++ = (unsigned char) acc;
+                nacc = 0;
+                acc = 0;
+            }
+        } else if (a == PD) {
+            if (nacc < 2 || ++npad > 4 - nacc)
+                return -1;
+        } else if (a != WS)
+            return -1;
+    }
+
+    switch (nacc) {
+    case 0:
+        break;
+    case 1:
+        return -1;
+    case 2:
+        if (npad != 0 && npad != 2)
+            return -1;
+        *outP++ = (unsigned char) (acc >> 4);
+        break;
+    case 3:
+        *outP++ = (unsigned char) (acc >> 10);
+        *outP++ = (unsigned char) (acc >> 2);
+        break;
+    }
+    *noutP = outP - startP;
+    return 0;
+}
+
+static const char *TwapiPemFind(const char *p, const char *endP,
+                                const char *s, size_t slen)
+{
+    while ((size_t)(endP - p) >= slen) {
+        p = memchr(p, s[0], (endP - p) - slen + 1);
+        if (p == NULL)
+            return NULL;
+        if (memcmp(p, s, slen) == 0)
+            return p;
+        ++p;
+    }
+    return NULL;
+}
+
+/*
+ * Matches a boundary marker at p, i.e. "-----" followed by the keyword
+ * kw (BEGIN or END) in any case, with optional white space between and
+ * white space after. This is the former regexp ^-----\s*BEGIN\s+ with
+ * -nocase. Returns a pointer to the label following the white space
+ * or NULL if p is not a marker.
+ */
+static const char *TwapiPemMatchMarker(const char *p, const char *endP,
+                                       const char *kw, size_t nkw)
+{
+    size_t i;
+
+    if ((endP - p) < 5 || memcmp(p, "-----", 5) != 0)
+        return NULL;
+    p += 5;
+    while (p < endP && gBase64Values[(unsigned char) *p] == WS)
+        ++p;
+    if ((size_t)(endP - p) <= nkw)
+        return NULL;
+    for (i = 0; i < nkw; ++i) {
+        if ((p[i] | 0x20) != (kw[i] | 0x20))
+            return NULL;
+    }
+    p += nkw;
+    if (gBase64Values[(unsigned char) *p] != WS)
+        return NULL;
+    while (p < endP && gBase64Values[(unsigned char) *p] == WS)
+        ++p;
+    return p;
+}
+
+/*
+ * Finds the first boundary marker for keyword kw at or after p. Returns
+ * a pointer to the marker and stores the location of its label in
+ * *labelPP, or returns NULL if there is none.
+ */
+static const char *TwapiPemFindMarker(const char *p, const char *endP,
+                                      const char *kw, size_t nkw,
+                                      const char **labelPP)
+{
+    while ((p = TwapiPemFind(p, endP, "-----", 5)) != NULL) {
+        *labelPP = TwapiPemMatchMarker(p, endP, kw, nkw);
+        if (*labelPP)
+            return p;
+        ++p;
+    }
+    return NULL;
+}
+
+/* Returns pointer past the end of line at p */
+static const char *TwapiPemSkipLine(const char *p, const char *endP)
+{
+    const char *nlP = memchr(p, '\n', endP - p);
+    return nlP ? nlP + 1 : endP;
+}
+
+int TwapiPemNext(const char *p, size_t n, TwapiPemBlock *blockP)
+{
+    const char *endP = p + n;
+    const char *labelP, *endlabelP, *bodyP, *lineP, *nextP, *colonP;
+
+    if (TwapiPemFindMarker(p, endP, "BEGIN", 5, &labelP) == NULL)
+        return 0;
+    p = TwapiPemFind(labelP, endP, "-----", 5);
+    if (p == NULL)
+        return -1;
+    blockP->labelP = labelP;
+    blockP->nlabel = p - labelP;
+    bodyP = TwapiPemSkipLine(p + 5, endP);
+
+    /*
+     * RFC 1421 style encapsulated headers, e.g. Proc-Type, are separated
+     * from the content by an empty line. Such lines contain a ':' which
+     * is not a base64 character.
+     */
+    nextP = TwapiPemSkipLine(bodyP, endP);
+    colonP = memchr(bodyP, ':', nextP - bodyP);
+    if (colonP) {
+        for (lineP = nextP; lineP < endP; lineP = nextP) {
+            nextP = TwapiPemSkipLine(lineP, endP);
+            for (p = lineP; p < nextP && (*p == '\r' || *p == '\n' || *p == ' ' || *p == '\t'); ++p)
+                ;
+            if (p == nextP)
+                break;          /* Empty line */
+        }
+        bodyP = nextP;
+    }
+
+    p = TwapiPemFindMarker(bodyP, endP, "END", 3, &endlabelP);
+    if (p == NULL)
+        return -1;
+    blockP->bodyP = bodyP;
+    blockP->nbody = p - bodyP;
+    p = endlabelP;
+    if ((size_t)(endP - p) < blockP->nlabel + 5 ||
+        memcmp(p, labelP, blockP->nlabel) != 0 ||
+        memcmp(p + blockP->nlabel, "-----", 5) != 0)
+        return -1;
+    p = TwapiPemSkipLine(p + blockP->nlabel + 5, endP);
+    blockP->next = p - (endP - n);
+    return 1;
+}
+
+int TwapiIsPem(const char *p, size_t n)
+{
+    /* Leading white space, then what TwapiPemNext takes as the start */
+    const char *endP = p + n;
+
+    while (p < endP && gBase64Values[(unsigned char) *p] == WS)
+        ++p;
+    return TwapiPemMatchMarker(p, endP, "BEGIN", 5) != NULL;
+}
+
+size_t TwapiPemEncodedSize(size_t nlabel, size_t n)
+{
+    /* -----BEGIN label-----\n ... -----END label-----\n */
+    return 11 + nlabel + 6 + TwapiBase64EncodedSize(n, 64) + 9 + nlabel + 6;
+}
+
+size_t TwapiPemEncode(const char *labelP, size_t nlabel,
+                      const unsigned char *p, size_t n, char *outP)
+{
+    char *startP = outP;
+
+    memcpy(outP, "-----BEGIN ", 11);
+    memcpy(outP + 11, labelP, nlabel);
+    memcpy(outP + 11 + nlabel, "-----\n", 6);
+    outP += 11 + nlabel + 6;
+    outP += TwapiBase64Encode(p, n, outP, 64);
+    memcpy(outP, "-----END ", 9);
+    memcpy(outP + 9, labelP, nlabel);
+    memcpy(outP + 9 + nlabel, "-----\n", 6);
+    outP += 9 + nlabel + 6;
+    return outP - startP;
+}
@@ -0,0 +1,62 @@
+#ifndef TWAPI_PEM_H
+#define TWAPI_PEM_H
+
+/*
+ * Native base64 (RFC 4648) and PEM (RFC 7468) encoding and decoding.
+ * Builds standalone when CRYPTO_STANDALONE is defined.
+ */
+
+#include <stddef.h>
+
+/*
+ * Whether the SSSE3 loops are used. -1 until the processor is checked on
+ * first use. May be set to 0 to force the portable code.
+ */
+extern int gTwapiBase64Simd;
+
+/*
+ * Number of characters output by TwapiBase64Encode for n bytes with lines
+ * of linelen characters each terminated by a \n. linelen must be a
+ * multiple of 4, or 0 for no line breaks.
+ */
+size_t TwapiBase64EncodedSize(size_t n, size_t linelen);
+/* Returns number of characters stored in outP. Not null terminated. */
+size_t TwapiBase64Encode(const unsigned char *p, size_t n, char *outP,
+                         size_t linelen);
+
+/* Upper bound on decoded size of n characters */
+#define TWAPI_BASE64_DECODED_MAX(n) (((n) / 4) * 3 + 3)
+/*
+ * Decodes base64 ignoring white space. Trailing padding is optional.
+ * Returns 0 and the number of bytes stored in *noutP, or -1 if the
+ * input is not valid base64.
+ */
+int TwapiBase64Decode(const char *p, size_t n, unsigned char *outP,
+                      size_t *noutP);
+
+/* A PEM encapsulated block located by TwapiPemNext */
+typedef struct _TwapiPemBlock {
+    const char *labelP;         /* Label in BEGIN line, e.g. CERTIFICATE */
+    size_t nlabel;
+    const char *bodyP;          /* base64 content without any headers */
+    size_t nbody;
+    size_t next;                /* Offset just past the END line */
+} TwapiPemBlock;
+
+/*
+ * Locates the first PEM block in p[0..n). Returns 1 if found, 0 if there
+ * is no BEGIN line and -1 if the block is not terminated by a matching
+ * END line. BEGIN and END are matched as by TwapiIsPem.
+ */
+int TwapiPemNext(const char *p, size_t n, TwapiPemBlock *blockP);
+
+/* Returns non-0 if p[0..n) starts with a BEGIN line after white space */
+int TwapiIsPem(const char *p, size_t n);
+
+/* Size of PEM block for n bytes of content with a label of nlabel chars */
+size_t TwapiPemEncodedSize(size_t nlabel, size_t n);
+/* Encodes with 64 character lines. Returns number of characters stored. */
+size_t TwapiPemEncode(const char *labelP, size_t nlabel,
+                      const unsigned char *p, size_t n, char *outP);
+
+#endif
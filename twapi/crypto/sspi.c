@@ -55,6 +55,8 @@ Table showing SECBUFFER usage for different functions/providers in different sam
 
 #include "twapi.h"
 #include "twapi_crypto.h"
+#include "sspistream.h"
+#include "tlschan.h"
 
 static Tcl_Obj *ObjFromSecHandle(SecHandle *shP);
 static int ObjToSecHandle(Tcl_Interp *interp, Tcl_Obj *obj, SecHandle *shP);
@@ -870,189 +872,253 @@ static TCL_RESULT Twapi_EncryptMessageObjCmd(ClientData clientdata, Tcl_Interp *
 }
 
 
+static TCL_RESULT ObjToSecPkgContext_StreamSizes(Tcl_Interp *interp, Tcl_Obj *objP, SecPkgContext_StreamSizes *sizesP)
+{
+    Tcl_Obj **objs;
+    int nobjs;
+
+    /* Same format as returned by QueryContextAttributes */
+    if (ObjGetElements(interp, objP, &nobjs, &objs) != TCL_OK)
+        return TCL_ERROR;
+    if (nobjs != 5)
+        return TwapiReturnErrorMsg(interp, TWAPI_INVALID_ARGS,
+                                   "Stream sizes must have 5 elements.");
+    if (ObjToDWORD(interp, objs[0], &sizesP->cbHeader) != TCL_OK ||
+        ObjToDWORD(interp, objs[1], &sizesP->cbTrailer) != TCL_OK ||
+        ObjToDWORD(interp, objs[2], &sizesP->cbMaximumMessage) != TCL_OK ||
+        ObjToDWORD(interp, objs[3], &sizesP->cBuffers) != TCL_OK ||
+        ObjToDWORD(interp, objs[4], &sizesP->cbBlockSize) != TCL_OK)
+        return TCL_ERROR;
+    if (sizesP->cbMaximumMessage == 0)
+        return TwapiReturnErrorMsg(interp, TWAPI_INVALID_ARGS,
+                                   "Stream maximum message size must not be 0.");
+    return TCL_OK;
+}
+
+/* Returns the SSPI dispatch table, a static table in the SSPI dll */
+static SecurityFunctionTableW *TwapiSspiFunctions(Tcl_Interp *interp)
+{
+    static SecurityFunctionTableW *fnsP;
+
+    if (fnsP == NULL) {
+        fnsP = InitSecurityInterfaceW();
+        if (fnsP == NULL)
+            TwapiReturnSystemError(interp);
+    }
+    return fnsP;
+}
+
+/*
+ * EncryptStream HANDLE QOP DATA ?STREAMSIZES?
+ * Encrypts all of DATA into as many records as needed. STREAMSIZES
+ * is the SECPKG_ATTR_STREAM_SIZES list cached by the caller after the
+ * handshake. It is queried from the context if not specified.
+ */
 static TCL_RESULT Twapi_EncryptStreamObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 {
+    SecurityFunctionTableW *fnsP;
     SecHandle sech;
     ULONG qop;
     SECURITY_STATUS ss;
     SecPkgContext_StreamSizes sizes;
-    SecBuffer sbufs[4];
-    SecBufferDesc sbd;
-    Tcl_Obj *dataObj;
-    Tcl_Obj *objs[2];           /* 0 encrypted data, 1 leftover data */
-    BYTE  *dataP, *encP;
-    DWORD   datalen;
+    Tcl_Obj *dataObj, *sizesObj = NULL;
+    Tcl_Obj *encObj;
+    BYTE  *dataP;
+    int    datalen;
+    size_t enclen;
 
     if (TwapiGetArgs(interp, objc-1, objv+1,
                      GETVAR(sech, ObjToSecHandle),
                      GETINT(qop),
                      GETOBJ(dataObj),
+                     ARGUSEDEFAULT,
+                     GETOBJ(sizesObj),
                      ARGEND) != TCL_OK)
         return TCL_ERROR;
 
-    ss = QueryContextAttributesW(&sech, SECPKG_ATTR_STREAM_SIZES, &sizes);
-    if (ss != SEC_E_OK)
-        return Twapi_AppendSystemError(interp, ss);
+    if (sizesObj) {
+        if (ObjToSecPkgContext_StreamSizes(interp, sizesObj, &sizes) != TCL_OK)
+            return TCL_ERROR;
+    } else {
+        ss = QueryContextAttributesW(&sech, SECPKG_ATTR_STREAM_SIZES, &sizes);
+        if (ss != SEC_E_OK)
+            return Twapi_AppendSystemError(interp, ss);
+    }
 
-    dataP = ObjToByteArray(dataObj, (int *) &datalen);
-    if (datalen > sizes.cbMaximumMessage) {
-        objs[1] = ObjFromByteArray(dataP+sizes.cbMaximumMessage,
-                                       datalen-sizes.cbMaximumMessage);
-        datalen = sizes.cbMaximumMessage;
-    } else
-        objs[1] = ObjFromEmptyString();
+    fnsP = TwapiSspiFunctions(interp);
+    if (fnsP == NULL)
+        return TCL_ERROR;
 
-    objs[0] = ObjFromByteArray(NULL, sizes.cbHeader + datalen + sizes.cbTrailer);
-    encP = ObjToByteArray(objs[0], NULL);
-    CopyMemory(encP + sizes.cbHeader, dataP, datalen);
+    dataP = ObjToByteArray(dataObj, &datalen);
+    encObj = ObjFromByteArray(NULL,
+                              (int) TWAPI_ENCRYPT_STREAM_MAX(&sizes, (size_t) datalen));
+    ss = TwapiEncryptStream(fnsP, &sech, qop, &sizes, dataP, datalen,
+                            ObjToByteArray(encObj, NULL), &enclen);
+    if (ss != SEC_E_OK) {
+        ObjDecrRefs(encObj);
+        return Twapi_AppendSystemError(interp, ss);
+    }
+    Tcl_SetByteArrayLength(encObj, (int) enclen);
+    return ObjSetResult(interp, encObj);
+}
 
-    sbufs[0].BufferType = SECBUFFER_STREAM_HEADER;
-    sbufs[0].pvBuffer   = encP;
-    sbufs[0].cbBuffer   = sizes.cbHeader;
 
-    sbufs[1].BufferType = SECBUFFER_DATA;
-    sbufs[1].pvBuffer   = encP + sizes.cbHeader;
-    sbufs[1].cbBuffer   = datalen;
+static TCL_RESULT Twapi_StreamBufferCreateObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiStreamBuffer *sbP;
 
-    sbufs[2].BufferType = SECBUFFER_STREAM_TRAILER;
-    sbufs[2].pvBuffer   = encP + sizes.cbHeader + datalen;
-    sbufs[2].cbBuffer   = sizes.cbTrailer;
+    CHECK_NARGS(interp, objc, 1);
+    sbP = TwapiStreamBufferNew();
+    if (TwapiRegisterPointer(interp, sbP, TwapiStreamBufferFree) != TCL_OK) {
+        TwapiStreamBufferFree(sbP);
+        return TCL_ERROR;
+    }
+    return ObjSetResult(interp, ObjFromOpaque(sbP, "TwapiStreamBuffer"));
+}
 
-    sbufs[3].BufferType = SECBUFFER_EMPTY;
-    sbufs[3].pvBuffer   = NULL;
-    sbufs[3].cbBuffer   = 0;
+static TCL_RESULT Twapi_StreamBufferFreeObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiStreamBuffer *sbP;
 
-    sbd.cBuffers = 4;
-    sbd.pBuffers = sbufs;
-    sbd.ulVersion = SECBUFFER_VERSION;
+    if (TwapiGetArgs(interp, objc-1, objv+1,
+                     GETVERIFIEDPTR(sbP, TwapiStreamBuffer, TwapiStreamBufferFree),
+                     ARGEND) != TCL_OK
+        || TwapiUnregisterPointer(interp, sbP, TwapiStreamBufferFree) != TCL_OK)
+        return TCL_ERROR;
+    TwapiStreamBufferFree(sbP);
+    return TCL_OK;
+}
 
-    ss = EncryptMessage(&sech, qop, &sbd, 0);
-    if (ss != SEC_E_OK) {
-        int i;
-        Twapi_AppendSystemError(interp, ss);
-        for (i=0; i < ARRAYSIZE(objs); ++i)
-            ObjDecrRefs(objs[i]);
-    } else {
-        /* TBD - ensure that only length of trailer has changed. Else
-           we have to copy each fragment separately into a new buffer */
-        Tcl_SetByteArrayLength(objs[0], sbufs[0].cbBuffer + sbufs[1].cbBuffer + sbufs[2].cbBuffer);
-        ObjSetResult(interp, ObjNewList(ARRAYSIZE(objs), objs));
-    }
+/*
+ * StreamBufferRead BUFFER ?NBYTES?
+ * Returns up to NBYTES of decrypted data, or all of it if NBYTES is
+ * negative or not specified.
+ */
+static TCL_RESULT Twapi_StreamBufferReadObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiStreamBuffer *sbP;
+    int nbytes = -1;
+    size_t n;
 
-    return ss == SEC_E_OK ? TCL_OK : TCL_ERROR;
+    if (TwapiGetArgs(interp, objc-1, objv+1,
+                     GETVERIFIEDPTR(sbP, TwapiStreamBuffer, TwapiStreamBufferFree),
+                     ARGUSEDEFAULT, GETINT(nbytes),
+                     ARGEND) != TCL_OK)
+        return TCL_ERROR;
+
+    n = TwapiStreamBufferPlaintextSize(sbP);
+    if (nbytes >= 0 && (size_t) nbytes < n)
+        n = nbytes;
+    ObjSetResult(interp, ObjFromByteArray(TwapiStreamBufferPlaintext(sbP), (int) n));
+    TwapiStreamBufferConsume(sbP, n);
+    return TCL_OK;
 }
 
+/* Returns the number of decrypted bytes available to be read */
+static TCL_RESULT Twapi_StreamBufferSizeObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiStreamBuffer *sbP;
 
+    if (TwapiGetArgs(interp, objc-1, objv+1,
+                     GETVERIFIEDPTR(sbP, TwapiStreamBuffer, TwapiStreamBufferFree),
+                     ARGEND) != TCL_OK)
+        return TCL_ERROR;
+    return ObjSetResult(interp, ObjFromWideInt(TwapiStreamBufferPlaintextSize(sbP)));
+}
+
+/*
+ * DecryptStream HANDLE BUFFER ?DATA ...?
+ * Appends the received DATA to the ciphertext retained in BUFFER and
+ * decrypts all complete records into it. Returns ok, expired or
+ * renegotiate. Decrypted data is retrieved with StreamBufferRead.
+ */
 static TCL_RESULT Twapi_DecryptStreamObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 {
-    TwapiInterpContext *ticP = (TwapiInterpContext*) clientdata;
+    SecurityFunctionTableW *fnsP;
     SecHandle sech;
     SECURITY_STATUS ss;
-    SecBuffer sbufs[4];
-    SecBufferDesc sbd;
-    Tcl_Obj *objs[3];           /* 0 status, 1 decrypted data, 2 extra data */
-    BYTE *encP, *p;
+    TwapiStreamBuffer *sbP;
+    BYTE *encP;
     int  i, enclen;
-    TCL_RESULT res;
 
     CHECK_NARGS_RANGE(interp, objc, 3, INT_MAX);
     if (ObjToSecHandle(interp, objv[1], &sech) != TCL_OK)
         return TCL_ERROR;
+    if (TwapiGetArgs(interp, 1, objv+2,
+                     GETVERIFIEDPTR(sbP, TwapiStreamBuffer, TwapiStreamBufferFree),
+                     ARGEND) != TCL_OK)
+        return TCL_ERROR;
+    fnsP = TwapiSspiFunctions(interp);
+    if (fnsP == NULL)
+        return TCL_ERROR;
 
-    sbufs[0].BufferType = SECBUFFER_DATA;
-    sbufs[0].cbBuffer   = 0;
-    for (i = 2; i < objc; ++i) {
-        ObjToByteArray(objv[i], &enclen);
-        sbufs[0].cbBuffer += enclen;
-    }
-    sbufs[0].pvBuffer = MemLifoPushFrame(ticP->memlifoP,
-                                         sbufs[0].cbBuffer, NULL);
-    p = sbufs[0].pvBuffer;
-    for (i = 2; i < objc; ++i) {
+    for (i = 3; i < objc; ++i) {
         encP = ObjToByteArray(objv[i], &enclen);
-        CopyMemory(p, encP, enclen);
-        p += enclen;
+        if (! TwapiStreamBufferAppend(sbP, encP, enclen))
+            return Twapi_AppendSystemError(interp, E_OUTOFMEMORY);
     }
-    TWAPI_ASSERT(p == (sbufs[0].cbBuffer + (char*) sbufs[0].pvBuffer));
 
-    /* Note DecryptMessage decrypts in place */
-
-    for (i = 1; i < ARRAYSIZE(sbufs); ++i)
-        sbufs[i].BufferType = SECBUFFER_EMPTY;
-
-    sbd.cBuffers = 4;
-    sbd.pBuffers = sbufs;
-    sbd.ulVersion = SECBUFFER_VERSION;
-
-    /* DecryptMessage will not preserve values in sbufs[0] so remember them */
-    encP = sbufs[0].pvBuffer;
-    enclen = sbufs[0].cbBuffer;
-
-    ss = DecryptMessage(&sech, &sbd, 0, NULL);
+    ss = TwapiStreamBufferDecrypt(fnsP, &sech, sbP);
     switch (ss) {
-    case SEC_E_INCOMPLETE_MESSAGE:
-        objs[0] = STRING_LITERAL_OBJ("incomplete_message");
-        objs[1] = ObjFromEmptyString();
-        objs[2] = ObjFromByteArray(encP, enclen);
-        ObjSetResult(interp, ObjNewList(ARRAYSIZE(objs), objs));
-        res = TCL_OK;
-        break;
-
     case SEC_E_OK:
+        return ObjSetResult(interp, STRING_LITERAL_OBJ("ok"));
     case SEC_I_CONTEXT_EXPIRED:
+        return ObjSetResult(interp, STRING_LITERAL_OBJ("expired"));
     case SEC_I_RENEGOTIATE:
-        /* We do not know which of the output buffers 1-3 contain
-         * decrypted data and extra data
-         * TBD - Is handling of context_expired and renegoitate correct ?
-        */
-        for (i = 1; i < ARRAYSIZE(sbufs); ++i) {
-            if (sbufs[i].BufferType == SECBUFFER_DATA)
-                break;
-        }
-        if (i < ARRAYSIZE(sbufs))
-            objs[1] = ObjFromByteArray(sbufs[i].pvBuffer, sbufs[i].cbBuffer);
-        else
-            objs[1] = ObjFromEmptyString(); /* No leftover data */
-
-        for (i = 1; i < ARRAYSIZE(sbufs); ++i) {
-            if (sbufs[i].BufferType == SECBUFFER_EXTRA)
-                break;
-        }
-        if (i < ARRAYSIZE(sbufs)) {
-            TWAPI_ASSERT(enclen > sbufs[i].cbBuffer);
-            /* MSDN docs say "pvBuffer" does not contain a copy of the
-               data. What they probably mean is that it points into
-               the original data, not to a copy of it. But the sample
-               code in MSDN and curl etc. does not make use of this field
-               so neither do we, just to be safe. Instead calculate base
-               on counts and the original data pointer
-            */
-            objs[2] = ObjFromByteArray(encP + (enclen - sbufs[i].cbBuffer), sbufs[i].cbBuffer);
-        } else
-            objs[2] = ObjFromEmptyString();
-
-        switch (ss) {
-        case SEC_E_OK:
-            objs[0] = STRING_LITERAL_OBJ("ok");
-            break;
-        case SEC_I_CONTEXT_EXPIRED:
-            objs[0] = STRING_LITERAL_OBJ("expired");
-            break;
-        case SEC_I_RENEGOTIATE:
-            objs[0] = STRING_LITERAL_OBJ("renegotiate");
-            break;
-        }
-        ObjSetResult(interp, ObjNewList(ARRAYSIZE(objs), objs));
-        res = TCL_OK;
-        break;
-
+        /* TBD - the remaining ciphertext is handshake data */
+        return ObjSetResult(interp, STRING_LITERAL_OBJ("renegotiate"));
     default:
-        res = Twapi_AppendSystemError(ticP->interp, ss);
-        break;
+        return Twapi_AppendSystemError(interp, ss);
     }
+}
 
-    MemLifoPopFrame(ticP->memlifoP);
-    return res;
+/*
+ * TlsChannelStack CHANNEL HANDLE CREDENTIALS FREECREDENTIALS ISSERVER
+ *     TARGET CONTEXTREQ DATAREP STREAMSIZES BUFFER
+ * Stacks the native TLS driver on CHANNEL once the handshake on context
+ * HANDLE is complete. The channel takes ownership of HANDLE, BUFFER and,
+ * if FREECREDENTIALS is true, CREDENTIALS. Returns the channel name,
+ * which is unchanged.
+ */
+static TCL_RESULT Twapi_TlsChannelStackObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiTlsChannelConfig config;
+    Tcl_Channel chan;
+    Tcl_Obj *chanObj, *targetObj, *sizesObj;
+    TwapiStreamBuffer *sbP;
+
+    ZeroMemory(&config, sizeof(config));
+    if (TwapiGetArgs(interp, objc-1, objv+1,
+                     GETOBJ(chanObj),
+                     GETVAR(config.context, ObjToSecHandle),
+                     GETVAR(config.credentials, ObjToSecHandle),
+                     GETBOOL(config.free_credentials),
+                     GETBOOL(config.server),
+                     GETOBJ(targetObj),
+                     GETINT(config.context_req),
+                     GETINT(config.datarep),
+                     GETOBJ(sizesObj),
+                     GETVERIFIEDPTR(sbP, TwapiStreamBuffer, TwapiStreamBufferFree),
+                     ARGEND) != TCL_OK)
+        return TCL_ERROR;
+
+    if (ObjToSecPkgContext_StreamSizes(interp, sizesObj, &config.sizes) != TCL_OK)
+        return TCL_ERROR;
+    chan = Tcl_GetChannel(interp, ObjToString(chanObj), NULL);
+    if (chan == NULL)
+        return TCL_ERROR;
+    config.fnsP = TwapiSspiFunctions(interp);
+    if (config.fnsP == NULL)
+        return TCL_ERROR;
+    if (ObjCharLength(targetObj))
+        config.targetP = ObjToWinChars(targetObj);
+    config.inP = sbP;
+
+    if (TwapiTlsChannelStack(interp, chan, &config) == NULL)
+        return TCL_ERROR;
+    /* Buffer now belongs to the channel */
+    TwapiUnregisterPointer(interp, sbP, TwapiStreamBufferFree);
+    return ObjSetResult(interp, chanObj);
 }
 
 static int Twapi_AcquireCredentialsHandleObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
@@ -1268,6 +1334,11 @@ int TwapiSspiInitCalls(Tcl_Interp *interp, TwapiInterpContext *ticP)
         DEFINE_TCL_CMD(MakeSignature, Twapi_MakeSignatureObjCmd),
         DEFINE_TCL_CMD(EncryptStream, Twapi_EncryptStreamObjCmd),
         DEFINE_TCL_CMD(DecryptStream, Twapi_DecryptStreamObjCmd),
+        DEFINE_TCL_CMD(StreamBufferCreate, Twapi_StreamBufferCreateObjCmd),
+        DEFINE_TCL_CMD(StreamBufferFree, Twapi_StreamBufferFreeObjCmd),
+        DEFINE_TCL_CMD(StreamBufferRead, Twapi_StreamBufferReadObjCmd),
+        DEFINE_TCL_CMD(StreamBufferSize, Twapi_StreamBufferSizeObjCmd),
+        DEFINE_TCL_CMD(TlsChannelStack, Twapi_TlsChannelStackObjCmd),
     };
 
     TwapiDefineFncodeCmds(interp, ARRAYSIZE(SspiDispatch), SspiDispatch, Twapi_SspiCallObjCmd);
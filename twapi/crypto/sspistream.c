@@ -0,0 +1,244 @@
+/*
+ * Copyright (c) 2018, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ */
+
+/*
+ * Multi-record stream encryption and in place decryption. Previously
+ * each EncryptStream call queried the stream sizes and encrypted at
+ * most one record, returning the remainder for the script to loop over
+ * with a new byte array and list per record. Here the caller passes
+ * sizes cached after the handshake and all records are encrypted in
+ * place, back to back, in one output buffer.
+ *
+ * Similarly DecryptStream copied all input into a new buffer on every
+ * call and returned undecrypted data to the script which then had to
+ * pass it back prefixed to the next input. TwapiStreamBuffer keeps it
+ * natively instead.
+ */
+
+#ifdef CRYPTO_STANDALONE
+# include <stdlib.h>
+# define StreamAlloc(n_) malloc(n_)
+# define StreamRealloc(p_, n_) realloc((p_), (n_))
+# define StreamFree(p_) free(p_)
+#else
+# include "twapi.h"
+# include "twapi_crypto.h"
+# define StreamAlloc(n_) TwapiAlloc(n_)
+# define StreamRealloc(p_, n_) TwapiReallocTry((p_), (n_))
+# define StreamFree(p_) TwapiFree(p_)
+#endif
+
+#include <string.h>
+
+#include "sspistream.h"
+
+SECURITY_STATUS TwapiEncryptStream(const SecurityFunctionTableW *fnsP,
+                                   CtxtHandle *ctxP, ULONG qop,
+                                   const SecPkgContext_StreamSizes *sizesP,
+                                   const unsigned char *dataP, size_t n,
+                                   unsigned char *outP, size_t *noutP)
+{
+    SecBuffer sbufs[4];
+    SecBufferDesc sbd;
+    SECURITY_STATUS ss;
+    unsigned char *recP = outP;
+    size_t chunk;
+    int i;
+
+    if (sizesP->cbMaximumMessage == 0) {
+        *noutP = 0;
+        return SEC_E_INVALID_TOKEN;
+    }
+
+    while (n) {
+        chunk = n < sizesP->cbMaximumMessage ? n : sizesP->cbMaximumMessage;
+        memcpy(recP + sizesP->cbHeader, dataP, chunk);
+
+        sbufs[0].BufferType = SECBUFFER_STREAM_HEADER;
+        sbufs[0].pvBuffer   = recP;
+        sbufs[0].cbBuffer   = sizesP->cbHeader;
+
+        sbufs[1].BufferType = SECBUFFER_DATA;
+        sbufs[1].pvBuffer   = recP + sizesP->cbHeader;
+        sbufs[1].cbBuffer   = (ULONG) chunk;
+
+        sbufs[2].BufferType = SECBUFFER_STREAM_TRAILER;
+        sbufs[2].pvBuffer   = recP + sizesP->cbHeader + chunk;
+        sbufs[2].cbBuffer   = sizesP->cbTrailer;
+
+        sbufs[3].BufferType = SECBUFFER_EMPTY;
+        sbufs[3].pvBuffer   = NULL;
+        sbufs[3].cbBuffer   = 0;
+
+        sbd.cBuffers = 4;
+        sbd.pBuffers = sbufs;
+        sbd.ulVersion = SECBUFFER_VERSION;
+
+        ss = fnsP->EncryptMessage(ctxP, qop, &sbd, 0);
+        if (ss != SEC_E_OK) {
+            *noutP = recP - outP;
+            return ss;
+        }
+
+        /*
+         * Providers may shorten the header or trailer, e.g. for block
+         * cipher padding. Close any gaps so the record is contiguous
+         * and the next one follows immediately. Moves are always
+         * towards the start so earlier ones do not overwrite later.
+         */
+        for (i = 0; i < 3; ++i) {
+            if (sbufs[i].pvBuffer != recP)
+                memmove(recP, sbufs[i].pvBuffer, sbufs[i].cbBuffer);
+            recP += sbufs[i].cbBuffer;
+        }
+
+        dataP += chunk;
+        n -= chunk;
+    }
+
+    *noutP = recP - outP;
+    return SEC_E_OK;
+}
+
+TwapiStreamBuffer *TwapiStreamBufferNew(void)
+{
+    TwapiStreamBuffer *sbP = StreamAlloc(sizeof(*sbP));
+    if (sbP)
+        memset(sbP, 0, sizeof(*sbP));
+    return sbP;
+}
+
+void TwapiStreamBufferFree(TwapiStreamBuffer *sbP)
+{
+    if (sbP->bufP)
+        StreamFree(sbP->bufP);
+    StreamFree(sbP);
+}
+
+unsigned char *TwapiStreamBufferReserve(TwapiStreamBuffer *sbP, size_t n)
+{
+    size_t nplain, ncipher, newsize;
+    unsigned char *newP;
+
+    if (sbP->size - sbP->cend < n) {
+        /* Slide unread data down to the front, closing the gap */
+        nplain = sbP->pend - sbP->pstart;
+        ncipher = sbP->cend - sbP->cstart;
+        if (sbP->pstart && nplain)
+            memmove(sbP->bufP, sbP->bufP + sbP->pstart, nplain);
+        if (sbP->cstart != nplain && ncipher)
+            memmove(sbP->bufP + nplain, sbP->bufP + sbP->cstart, ncipher);
+        sbP->pstart = 0;
+        sbP->pend = sbP->cstart = nplain;
+        sbP->cend = nplain + ncipher;
+
+        if (sbP->size - sbP->cend < n) {
+            /* A TLS record is at most about 16K */
+            newsize = sbP->size ? sbP->size : 32768;
+            while (newsize - sbP->cend < n)
+                newsize *= 2;
+            if (sbP->bufP)
+                newP = StreamRealloc(sbP->bufP, newsize);
+            else
+                newP = StreamAlloc(newsize);
+            if (newP == NULL)
+                return NULL;
+            sbP->bufP = newP;
+            sbP->size = newsize;
+        }
+    }
+    return sbP->bufP + sbP->cend;
+}
+
+int TwapiStreamBufferAppend(TwapiStreamBuffer *sbP, const unsigned char *p,
+                            size_t n)
+{
+    unsigned char *destP;
+
+    if (n == 0)
+        return 1;
+    destP = TwapiStreamBufferReserve(sbP, n);
+    if (destP == NULL)
+        return 0;
+    memcpy(destP, p, n);
+    TwapiStreamBufferCommit(sbP, n);
+    return 1;
+}
+
+SECURITY_STATUS TwapiStreamBufferDecrypt(const SecurityFunctionTableW *fnsP,
+                                         CtxtHandle *ctxP,
+                                         TwapiStreamBuffer *sbP)
+{
+    SecBuffer sbufs[4];
+    SecBufferDesc sbd;
+    SECURITY_STATUS ss;
+    size_t ncipher, nextra;
+    int i;
+
+    while (sbP->cstart < sbP->cend) {
+        ncipher = sbP->cend - sbP->cstart;
+        sbufs[0].BufferType = SECBUFFER_DATA;
+        sbufs[0].pvBuffer   = sbP->bufP + sbP->cstart;
+        sbufs[0].cbBuffer   = (ULONG) ncipher;
+        for (i = 1; i < 4; ++i) {
+            sbufs[i].BufferType = SECBUFFER_EMPTY;
+            sbufs[i].pvBuffer   = NULL;
+            sbufs[i].cbBuffer   = 0;
+        }
+        sbd.cBuffers = 4;
+        sbd.pBuffers = sbufs;
+        sbd.ulVersion = SECBUFFER_VERSION;
+
+        ss = fnsP->DecryptMessage(ctxP, &sbd, 0, NULL);
+        switch (ss) {
+        case SEC_E_INCOMPLETE_MESSAGE:
+            return SEC_E_OK;    /* Wait for rest of record */
+        case SEC_E_OK:
+        case SEC_I_CONTEXT_EXPIRED:
+        case SEC_I_RENEGOTIATE:
+            break;
+        default:
+            return ss;
+        }
+
+        /*
+         * The decrypted data lies within the record. Move it down to
+         * follow the unread plaintext. As for DecryptStream, the
+         * position of the unused data is computed from the EXTRA
+         * buffer count and not its pvBuffer field.
+         */
+        nextra = 0;
+        for (i = 1; i < 4; ++i) {
+            if (sbufs[i].BufferType == SECBUFFER_DATA && sbufs[i].cbBuffer) {
+                memmove(sbP->bufP + sbP->pend, sbufs[i].pvBuffer,
+                        sbufs[i].cbBuffer);
+                sbP->pend += sbufs[i].cbBuffer;
+            } else if (sbufs[i].BufferType == SECBUFFER_EXTRA) {
+                nextra = sbufs[i].cbBuffer;
+            }
+        }
+        if (nextra >= ncipher)
+            return SEC_E_INVALID_TOKEN; /* Provider consumed nothing */
+        sbP->cstart = sbP->cend - nextra;
+
+        if (ss != SEC_E_OK)
+            return ss;
+    }
+    return SEC_E_OK;
+}
+
+void TwapiStreamBufferConsume(TwapiStreamBuffer *sbP, size_t n)
+{
+    sbP->pstart += n;
+    if (sbP->pstart == sbP->pend) {
+        /* Restart at the front if nothing is left */
+        if (sbP->cstart == sbP->cend)
+            sbP->pstart = sbP->pend = sbP->cstart = sbP->cend = 0;
+        else
+            sbP->pstart = sbP->pend = sbP->cstart;
+    }
+}
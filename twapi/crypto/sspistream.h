@@ -0,0 +1,160 @@
+#ifndef TWAPI_SSPISTREAM_H
+#define TWAPI_SSPISTREAM_H
+
+/*
+ * Encryption and decryption of arbitrary length data for stream (TLS)
+ * security contexts. The provider limits each EncryptMessage call to
+ * cbMaximumMessage bytes so the data is split into as many records as
+ * needed, all written to a single caller supplied buffer. Received
+ * data is decrypted in place in a TwapiStreamBuffer which also retains
+ * partial records until the rest arrives.
+ *
+ * Provider calls go through a SecurityFunctionTableW so tests can
+ * substitute a mock provider.
+ * Builds standalone when CRYPTO_STANDALONE is defined.
+ */
+
+/* Off Windows, standalone builds get the few SSPI definitions needed here */
+#ifdef CRYPTO_STANDALONE
+# ifdef _WIN32
+#  define SECURITY_WIN32
+#  include <windows.h>
+#  include <sspi.h>
+# else
+#  include <stddef.h>
+typedef long SECURITY_STATUS;
+typedef unsigned long ULONG;
+typedef struct _SecHandle {
+    size_t dwLower;
+    size_t dwUpper;
+} SecHandle, CtxtHandle, *PCtxtHandle, CredHandle, *PCredHandle;
+typedef struct _TimeStamp {
+    unsigned long LowPart;
+    long HighPart;
+} TimeStamp, *PTimeStamp;
+typedef unsigned short SEC_WCHAR;
+typedef struct _SecBuffer {
+    ULONG cbBuffer;
+    ULONG BufferType;
+    void *pvBuffer;
+} SecBuffer, *PSecBuffer;
+typedef struct _SecBufferDesc {
+    ULONG ulVersion;
+    ULONG cBuffers;
+    PSecBuffer pBuffers;
+} SecBufferDesc, *PSecBufferDesc;
+typedef struct _SecPkgContext_StreamSizes {
+    ULONG cbHeader;
+    ULONG cbTrailer;
+    ULONG cbMaximumMessage;
+    ULONG cBuffers;
+    ULONG cbBlockSize;
+} SecPkgContext_StreamSizes;
+typedef struct _SecurityFunctionTableW {
+    SECURITY_STATUS (*EncryptMessage)(PCtxtHandle, ULONG, PSecBufferDesc, ULONG);
+    SECURITY_STATUS (*DecryptMessage)(PCtxtHandle, PSecBufferDesc, ULONG, ULONG *);
+    /* Used by the TLS channel driver */
+    SECURITY_STATUS (*InitializeSecurityContextW)(PCredHandle, PCtxtHandle,
+                                                  SEC_WCHAR *, ULONG, ULONG,
+                                                  ULONG, PSecBufferDesc, ULONG,
+                                                  PCtxtHandle, PSecBufferDesc,
+                                                  ULONG *, PTimeStamp);
+    SECURITY_STATUS (*AcceptSecurityContext)(PCredHandle, PCtxtHandle,
+                                             PSecBufferDesc, ULONG, ULONG,
+                                             PCtxtHandle, PSecBufferDesc,
+                                             ULONG *, PTimeStamp);
+    SECURITY_STATUS (*ApplyControlToken)(PCtxtHandle, PSecBufferDesc);
+    SECURITY_STATUS (*DeleteSecurityContext)(PCtxtHandle);
+    SECURITY_STATUS (*FreeCredentialsHandle)(PCredHandle);
+    SECURITY_STATUS (*FreeContextBuffer)(void *);
+} SecurityFunctionTableW;
+#  define SEC_E_OK ((SECURITY_STATUS) 0)
+#  define SEC_E_INVALID_TOKEN ((SECURITY_STATUS) 0x80090308)
+#  define SEC_E_INCOMPLETE_MESSAGE ((SECURITY_STATUS) 0x80090318)
+#  define SEC_E_INSUFFICIENT_MEMORY ((SECURITY_STATUS) 0x80090300)
+#  define SEC_I_CONTEXT_EXPIRED ((SECURITY_STATUS) 0x00090317)
+#  define SEC_I_RENEGOTIATE ((SECURITY_STATUS) 0x00090321)
+#  define SEC_I_CONTINUE_NEEDED ((SECURITY_STATUS) 0x00090312)
+#  define ISC_REQ_ALLOCATE_MEMORY 0x00000100
+#  define ASC_REQ_ALLOCATE_MEMORY 0x00000100
+#  define SCHANNEL_SHUTDOWN 1
+#  define SECBUFFER_VERSION 0
+#  define SECBUFFER_EMPTY 0
+#  define SECBUFFER_DATA 1
+#  define SECBUFFER_TOKEN 2
+#  define SECBUFFER_EXTRA 5
+#  define SECBUFFER_STREAM_TRAILER 6
+#  define SECBUFFER_STREAM_HEADER 7
+# endif
+#endif
+
+/* Size of buffer needed to encrypt n bytes */
+#define TWAPI_ENCRYPT_STREAM_MAX(sizesP_, n_)                           \
+    ((n_) + ((n_) / (sizesP_)->cbMaximumMessage + 1) *                  \
+     ((size_t) (sizesP_)->cbHeader + (sizesP_)->cbTrailer))
+
+/*
+ * Encrypts n bytes at dataP into outP, which must have room for
+ * TWAPI_ENCRYPT_STREAM_MAX bytes. Returns SEC_E_OK and the number of
+ * bytes stored in *noutP, or the provider's error status. No records
+ * are generated if n is 0.
+ */
+SECURITY_STATUS TwapiEncryptStream(const SecurityFunctionTableW *fnsP,
+                                   CtxtHandle *ctxP, ULONG qop,
+                                   const SecPkgContext_StreamSizes *sizesP,
+                                   const unsigned char *dataP, size_t n,
+                                   unsigned char *outP, size_t *noutP);
+
+/*
+ * Received data for a stream context. Records are decrypted in place
+ * and the plaintext moved down to follow any plaintext not yet read,
+ * so the buffer holds
+ *
+ *   | read | plaintext | unused | ciphertext | free |
+ *
+ * A wrapping ring buffer cannot be used as DecryptMessage needs each
+ * record contiguous. Instead space is reclaimed by restarting at the
+ * front when all data has been read, or by sliding unread data down
+ * when more room is needed at the end.
+ */
+typedef struct _TwapiStreamBuffer {
+    unsigned char *bufP;
+    size_t size;
+    size_t pstart, pend;        /* Plaintext not yet read */
+    size_t cstart, cend;        /* Ciphertext not yet decrypted */
+} TwapiStreamBuffer;
+
+TwapiStreamBuffer *TwapiStreamBufferNew(void);
+void TwapiStreamBufferFree(TwapiStreamBuffer *sbP);
+
+/* Appends received ciphertext. Returns 0 if out of memory. */
+int TwapiStreamBufferAppend(TwapiStreamBuffer *sbP, const unsigned char *p,
+                            size_t n);
+
+/*
+ * Returns a pointer to room for at least n bytes following the
+ * ciphertext, or NULL if out of memory, so data can be received
+ * directly into the buffer. TwapiStreamBufferCommit then adds the
+ * number of bytes actually stored there to the ciphertext.
+ */
+unsigned char *TwapiStreamBufferReserve(TwapiStreamBuffer *sbP, size_t n);
+#define TwapiStreamBufferCommit(sbP_, n_) ((sbP_)->cend += (n_))
+
+/*
+ * Decrypts all complete records in the buffer. Returns SEC_E_OK if
+ * the remaining ciphertext, if any, is an incomplete record. Returns
+ * SEC_I_CONTEXT_EXPIRED or SEC_I_RENEGOTIATE on reaching a record
+ * with that status, leaving any further ciphertext undecrypted, or the
+ * provider's error status.
+ */
+SECURITY_STATUS TwapiStreamBufferDecrypt(const SecurityFunctionTableW *fnsP,
+                                         CtxtHandle *ctxP,
+                                         TwapiStreamBuffer *sbP);
+
+#define TwapiStreamBufferPlaintext(sbP_) ((sbP_)->bufP + (sbP_)->pstart)
+#define TwapiStreamBufferPlaintextSize(sbP_) ((sbP_)->pend - (sbP_)->pstart)
+
+/* Discards n bytes of plaintext after the caller has copied them */
+void TwapiStreamBufferConsume(TwapiStreamBuffer *sbP, size_t n);
+
+#endif
@@ -0,0 +1,449 @@
+/*
+ * Copyright (c) 2018, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ */
+
+/*
+ * Stacked channel driver for TLS connections. The reflected channel in
+ * tls.tcl runs every read and write through script procedures, with
+ * the dictionary manipulation, puts and flush that implies per call.
+ * Here records are encrypted straight into an output buffer written to
+ * the socket with Tcl_WriteRaw, and received directly into the stream
+ * buffer where they are decrypted in place.
+ *
+ * The handshake itself is still done by tls.tcl since it calls back
+ * into the script for credential and peer verification. The driver is
+ * stacked once the context is established.
+ */
+
+#ifdef CRYPTO_STANDALONE
+# include <stdlib.h>
+# define ChanAlloc(n_) malloc(n_)
+# define ChanFree(p_) free(p_)
+#else
+# include "twapi.h"
+# include "twapi_crypto.h"
+# define ChanAlloc(n_) TwapiAlloc(n_)
+# define ChanFree(p_) TwapiFree(p_)
+#endif
+
+#include <errno.h>
+#include <string.h>
+
+#include "tlschan.h"
+
+/* Amount requested from the socket per read. Enough for a full record. */
+#define TLSCHAN_READ_SIZE 16640
+
+typedef struct _TwapiTlsChannel {
+    Tcl_Channel chan;           /* This channel, the top of the stack */
+    Tcl_Channel down;           /* The socket channel below */
+    TwapiTlsChannelConfig config;
+    SEC_WCHAR *targetP;         /* Our copy of config.targetP */
+    TwapiStreamBuffer *inP;
+    unsigned char *outP;        /* Encrypted data */
+    size_t outsize;
+    size_t outstart, outend;    /* Part of outP not yet written */
+    Tcl_TimerToken timer;       /* Notifies buffered plaintext */
+    int watchmask;              /* Events the channel layer wants */
+    int eof;                    /* Peer closed the connection */
+    int error;                  /* errno value to report on next call */
+} TwapiTlsChannel;
+
+static void TlsChanWatchDown(TwapiTlsChannel *ctP)
+{
+    Tcl_DriverWatchProc *watchProc;
+    int mask = ctP->watchmask;
+
+    /* Need to know when pending output can be written */
+    if (ctP->outstart < ctP->outend)
+        mask |= TCL_WRITABLE;
+    watchProc = Tcl_ChannelWatchProc(Tcl_GetChannelType(ctP->down));
+    watchProc(Tcl_GetChannelInstanceData(ctP->down), mask);
+}
+
+/*
+ * Writes pending encrypted data. Returns 0 if all written or the
+ * socket would block, else the errno value.
+ */
+static int TlsChanFlushOutput(TwapiTlsChannel *ctP)
+{
+    int n;
+
+    while (ctP->outstart < ctP->outend) {
+        n = Tcl_WriteRaw(ctP->down, (char *) ctP->outP + ctP->outstart,
+                         (int) (ctP->outend - ctP->outstart));
+        if (n < 0) {
+            if (Tcl_GetErrno() == EAGAIN)
+                return 0;
+            return Tcl_GetErrno();
+        }
+        if (n == 0)
+            return 0;
+        ctP->outstart += n;
+    }
+    ctP->outstart = ctP->outend = 0;
+    return 0;
+}
+
+/* Sends a close_notify alert to the peer */
+static void TlsChanShutdown(TwapiTlsChannel *ctP)
+{
+    const SecurityFunctionTableW *fnsP = ctP->config.fnsP;
+    SecBuffer sb;
+    SecBufferDesc sbd;
+    CtxtHandle new_context;
+    ULONG control = SCHANNEL_SHUTDOWN;
+    ULONG attr;
+    TimeStamp expiration;
+    SECURITY_STATUS ss;
+    size_t written;
+    int n;
+
+    sb.BufferType = SECBUFFER_TOKEN;
+    sb.pvBuffer   = &control;
+    sb.cbBuffer   = sizeof(control);
+    sbd.cBuffers  = 1;
+    sbd.pBuffers  = &sb;
+    sbd.ulVersion = SECBUFFER_VERSION;
+    if (fnsP->ApplyControlToken(&ctP->config.context, &sbd) != SEC_E_OK)
+        return;
+
+    sb.BufferType = SECBUFFER_TOKEN;
+    sb.pvBuffer   = NULL;
+    sb.cbBuffer   = 0;
+    if (ctP->config.server)
+        ss = fnsP->AcceptSecurityContext(
+            &ctP->config.credentials, &ctP->config.context, NULL,
+            ctP->config.context_req | ASC_REQ_ALLOCATE_MEMORY,
+            ctP->config.datarep, &new_context, &sbd, &attr, &expiration);
+    else
+        ss = fnsP->InitializeSecurityContextW(
+            &ctP->config.credentials, &ctP->config.context, ctP->targetP,
+            ctP->config.context_req | ISC_REQ_ALLOCATE_MEMORY, 0,
+            ctP->config.datarep, NULL, 0, &new_context, &sbd, &attr,
+            &expiration);
+
+    if (sb.pvBuffer == NULL)
+        return;
+    if (ss == SEC_E_OK || ss == SEC_I_CONTEXT_EXPIRED ||
+        ss == SEC_I_CONTINUE_NEEDED) {
+        for (written = 0; written < sb.cbBuffer; written += n) {
+            n = Tcl_WriteRaw(ctP->down, (char *) sb.pvBuffer + written,
+                             (int) (sb.cbBuffer - written));
+            if (n <= 0)
+                break;
+        }
+    }
+    fnsP->FreeContextBuffer(sb.pvBuffer);
+}
+
+static void TlsChanFree(TwapiTlsChannel *ctP)
+{
+    if (ctP->inP)
+        TwapiStreamBufferFree(ctP->inP);
+    if (ctP->outP)
+        ChanFree(ctP->outP);
+    if (ctP->targetP)
+        ChanFree(ctP->targetP);
+    ChanFree(ctP);
+}
+
+static int TlsChanClose(ClientData instanceData, Tcl_Interp *interp)
+{
+    TwapiTlsChannel *ctP = (TwapiTlsChannel *) instanceData;
+    const SecurityFunctionTableW *fnsP = ctP->config.fnsP;
+    Tcl_DriverBlockModeProc *blockModeProc;
+    int error;
+
+    if (ctP->timer)
+        Tcl_DeleteTimerHandler(ctP->timer);
+
+    /*
+     * The socket is closed as soon as we return so there is no later
+     * opportunity to write. Switch it to blocking to finish off any
+     * pending output and the close_notify.
+     */
+    blockModeProc = Tcl_ChannelBlockModeProc(Tcl_GetChannelType(ctP->down));
+    if (blockModeProc)
+        blockModeProc(Tcl_GetChannelInstanceData(ctP->down), TCL_MODE_BLOCKING);
+    error = ctP->error;
+    if (error == 0) {
+        error = TlsChanFlushOutput(ctP);
+        if (error == 0)
+            TlsChanShutdown(ctP);
+    }
+
+    fnsP->DeleteSecurityContext(&ctP->config.context);
+    if (ctP->config.free_credentials)
+        fnsP->FreeCredentialsHandle(&ctP->config.credentials);
+    TlsChanFree(ctP);
+    return error;
+}
+
+static int TlsChanInput(ClientData instanceData, char *buf, int toRead,
+                        int *errorCodePtr)
+{
+    TwapiTlsChannel *ctP = (TwapiTlsChannel *) instanceData;
+    TwapiStreamBuffer *sbP = ctP->inP;
+    unsigned char *p;
+    size_t n;
+    int nread;
+
+    *errorCodePtr = 0;
+    while (TwapiStreamBufferPlaintextSize(sbP) == 0) {
+        if (ctP->error) {
+            *errorCodePtr = ctP->error;
+            return -1;
+        }
+        if (ctP->eof)
+            return 0;
+
+        p = TwapiStreamBufferReserve(sbP, TLSCHAN_READ_SIZE);
+        if (p == NULL) {
+            *errorCodePtr = ENOMEM;
+            return -1;
+        }
+        nread = Tcl_ReadRaw(ctP->down, (char *) p, TLSCHAN_READ_SIZE);
+        if (nread < 0) {
+            *errorCodePtr = Tcl_GetErrno();
+            return -1;
+        }
+        if (nread == 0) {
+            if (!Tcl_Eof(ctP->down)) {
+                *errorCodePtr = EAGAIN;
+                return -1;
+            }
+            /* Closed without a close_notify. Any partial record is lost. */
+            ctP->eof = 1;
+            continue;
+        }
+        TwapiStreamBufferCommit(sbP, nread);
+
+        switch (TwapiStreamBufferDecrypt(ctP->config.fnsP,
+                                         &ctP->config.context, sbP)) {
+        case SEC_E_OK:
+            break;
+        case SEC_I_CONTEXT_EXPIRED:
+            ctP->eof = 1;       /* close_notify */
+            break;
+        default:
+            /* Renegotiation is not supported on native channels */
+            ctP->error = EIO;
+            break;
+        }
+    }
+
+    n = TwapiStreamBufferPlaintextSize(sbP);
+    if (n > (size_t) toRead)
+        n = toRead;
+    memcpy(buf, TwapiStreamBufferPlaintext(sbP), n);
+    TwapiStreamBufferConsume(sbP, n);
+    return (int) n;
+}
+
+static int TlsChanOutput(ClientData instanceData, const char *buf,
+                         int toWrite, int *errorCodePtr)
+{
+    TwapiTlsChannel *ctP = (TwapiTlsChannel *) instanceData;
+    SECURITY_STATUS ss;
+    size_t needed, n;
+
+    *errorCodePtr = ctP->error;
+    if (*errorCodePtr == 0 && ctP->outstart < ctP->outend) {
+        *errorCodePtr = TlsChanFlushOutput(ctP);
+        if (*errorCodePtr == 0 && ctP->outstart < ctP->outend)
+            *errorCodePtr = EAGAIN;
+    }
+    if (*errorCodePtr)
+        return -1;
+    if (toWrite == 0)
+        return 0;
+
+    needed = TWAPI_ENCRYPT_STREAM_MAX(&ctP->config.sizes, (size_t) toWrite);
+    if (needed > ctP->outsize) {
+        if (ctP->outP)
+            ChanFree(ctP->outP);
+        ctP->outP = ChanAlloc(needed);
+        if (ctP->outP == NULL) {
+            ctP->outsize = 0;
+            *errorCodePtr = ENOMEM;
+            return -1;
+        }
+        ctP->outsize = needed;
+    }
+    ss = TwapiEncryptStream(ctP->config.fnsP, &ctP->config.context, 0,
+                            &ctP->config.sizes, (const unsigned char *) buf,
+                            toWrite, ctP->outP, &n);
+    if (ss != SEC_E_OK) {
+        *errorCodePtr = EIO;
+        return -1;
+    }
+    ctP->outstart = 0;
+    ctP->outend = n;
+
+    /*
+     * All of buf is accepted as it has been encrypted. Whatever the
+     * socket does not take now is written when it becomes writable.
+     */
+    *errorCodePtr = TlsChanFlushOutput(ctP);
+    if (*errorCodePtr)
+        return -1;
+    if (ctP->outstart < ctP->outend)
+        TlsChanWatchDown(ctP);
+    return toWrite;
+}
+
+static int TlsChanSetOption(ClientData instanceData, Tcl_Interp *interp,
+                            const char *optionName, const char *value)
+{
+    TwapiTlsChannel *ctP = (TwapiTlsChannel *) instanceData;
+    Tcl_DriverSetOptionProc *setOptionProc;
+
+    setOptionProc = Tcl_ChannelSetOptionProc(Tcl_GetChannelType(ctP->down));
+    if (setOptionProc == NULL)
+        return Tcl_BadChannelOption(interp, optionName, "");
+    return setOptionProc(Tcl_GetChannelInstanceData(ctP->down), interp,
+                         optionName, value);
+}
+
+static int TlsChanGetOption(ClientData instanceData, Tcl_Interp *interp,
+                            const char *optionName, Tcl_DString *dsPtr)
+{
+    TwapiTlsChannel *ctP = (TwapiTlsChannel *) instanceData;
+    Tcl_DriverGetOptionProc *getOptionProc;
+
+    getOptionProc = Tcl_ChannelGetOptionProc(Tcl_GetChannelType(ctP->down));
+    if (getOptionProc == NULL) {
+        if (optionName == NULL)
+            return TCL_OK;
+        return Tcl_BadChannelOption(interp, optionName, "");
+    }
+    return getOptionProc(Tcl_GetChannelInstanceData(ctP->down), interp,
+                         optionName, dsPtr);
+}
+
+static void TlsChanTimer(ClientData clientData)
+{
+    TwapiTlsChannel *ctP = (TwapiTlsChannel *) clientData;
+    ctP->timer = NULL;
+    Tcl_NotifyChannel(ctP->chan, TCL_READABLE);
+}
+
+static void TlsChanWatch(ClientData instanceData, int mask)
+{
+    TwapiTlsChannel *ctP = (TwapiTlsChannel *) instanceData;
+
+    ctP->watchmask = mask;
+    TlsChanWatchDown(ctP);
+
+    /*
+     * The socket will not signal data that has already been received
+     * and decrypted, so schedule the notification ourselves.
+     */
+    if ((mask & TCL_READABLE) &&
+        (TwapiStreamBufferPlaintextSize(ctP->inP) || ctP->eof || ctP->error)) {
+        if (ctP->timer == NULL)
+            ctP->timer = Tcl_CreateTimerHandler(0, TlsChanTimer, ctP);
+    } else if (ctP->timer) {
+        Tcl_DeleteTimerHandler(ctP->timer);
+        ctP->timer = NULL;
+    }
+}
+
+static int TlsChanGetHandle(ClientData instanceData, int direction,
+                            ClientData *handlePtr)
+{
+    TwapiTlsChannel *ctP = (TwapiTlsChannel *) instanceData;
+    return Tcl_GetChannelHandle(ctP->down, direction, handlePtr);
+}
+
+static int TlsChanBlockMode(ClientData instanceData, int mode)
+{
+    /* The channel layer sets the mode of the socket as well */
+    return 0;
+}
+
+/* Called with events on the socket before they are passed up */
+static int TlsChanHandler(ClientData instanceData, int interestMask)
+{
+    TwapiTlsChannel *ctP = (TwapiTlsChannel *) instanceData;
+
+    if ((interestMask & TCL_WRITABLE) && ctP->outstart < ctP->outend) {
+        if (ctP->error == 0)
+            ctP->error = TlsChanFlushOutput(ctP);
+        if (ctP->outstart < ctP->outend && ctP->error == 0)
+            interestMask &= ~TCL_WRITABLE;
+        else
+            TlsChanWatchDown(ctP); /* Stop watching if only we were */
+    }
+    return interestMask;
+}
+
+static Tcl_ChannelType TlsChanType = {
+    "twapitls",
+    TCL_CHANNEL_VERSION_4,
+    TlsChanClose,
+    TlsChanInput,
+    TlsChanOutput,
+    NULL,                       /* seekProc */
+    TlsChanSetOption,
+    TlsChanGetOption,
+    TlsChanWatch,
+    TlsChanGetHandle,
+    NULL,                       /* close2Proc */
+    TlsChanBlockMode,
+    NULL,                       /* flushProc */
+    TlsChanHandler,
+    NULL,                       /* wideSeekProc */
+    NULL,                       /* threadActionProc */
+};
+
+Tcl_Channel TwapiTlsChannelStack(Tcl_Interp *interp, Tcl_Channel chan,
+                                 const TwapiTlsChannelConfig *configP)
+{
+    TwapiTlsChannel *ctP;
+    size_t n;
+
+    ctP = ChanAlloc(sizeof(*ctP));
+    if (ctP == NULL)
+        goto nomem;
+    memset(ctP, 0, sizeof(*ctP));
+    ctP->down = chan;
+    ctP->config = *configP;
+    ctP->config.targetP = NULL;
+    if (configP->targetP) {
+        for (n = 0; configP->targetP[n]; ++n)
+            ;
+        ctP->targetP = ChanAlloc((n + 1) * sizeof(SEC_WCHAR));
+        if (ctP->targetP == NULL)
+            goto nomem;
+        memcpy(ctP->targetP, configP->targetP, (n + 1) * sizeof(SEC_WCHAR));
+    }
+    ctP->inP = TwapiStreamBufferNew();
+    if (ctP->inP == NULL)
+        goto nomem;
+
+    ctP->chan = Tcl_StackChannel(interp, &TlsChanType, ctP,
+                                 Tcl_GetChannelMode(chan), chan);
+    if (ctP->chan == NULL) {
+        TlsChanFree(ctP);
+        return NULL;
+    }
+
+    /* Only take over the caller's buffer now that nothing can fail */
+    if (configP->inP) {
+        TwapiStreamBufferFree(ctP->inP);
+        ctP->inP = configP->inP;
+    }
+    return ctP->chan;
+
+nomem:
+    if (ctP)
+        TlsChanFree(ctP);
+    if (interp)
+        Tcl_SetResult(interp, "Out of memory.", TCL_STATIC);
+    return NULL;
+}
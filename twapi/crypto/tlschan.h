@@ -0,0 +1,44 @@
+#ifndef TWAPI_TLSCHAN_H
+#define TWAPI_TLSCHAN_H
+
+/*
+ * Native TLS channel driver. Once a TLS handshake has completed, the
+ * driver is stacked on the connected socket and takes over the security
+ * context, encrypting on output and decrypting on input without going
+ * through script level reflected channel callbacks. On close it sends a
+ * close_notify and releases the context.
+ *
+ * As for sspistream.h, provider calls go through a SecurityFunctionTableW
+ * so the driver can be run against a mock provider. Builds standalone
+ * (with Tcl but without the rest of twapi) when CRYPTO_STANDALONE is
+ * defined.
+ */
+
+#include <tcl.h>
+
+#include "sspistream.h"
+
+typedef struct _TwapiTlsChannelConfig {
+    const SecurityFunctionTableW *fnsP;
+    CtxtHandle context;         /* Ownership passes to the channel */
+    CredHandle credentials;
+    int free_credentials;       /* If true, the channel frees credentials */
+    int server;                 /* Server or client side of the context */
+    const SEC_WCHAR *targetP;   /* Client target name, copied, may be NULL */
+    ULONG context_req;          /* Passed to the close_notify context call */
+    ULONG datarep;
+    SecPkgContext_StreamSizes sizes;
+    TwapiStreamBuffer *inP;     /* Received data not yet read, may be NULL.
+                                   Ownership passes to the channel */
+} TwapiTlsChannelConfig;
+
+/*
+ * Stacks a TLS channel on chan. On success returns the new top of the
+ * stack, which has the same name as chan, and the channel owns the
+ * context and buffer. On failure returns NULL, with an error message in
+ * interp if not NULL, and the caller retains ownership.
+ */
+Tcl_Channel TwapiTlsChannelStack(Tcl_Interp *interp, Tcl_Channel chan,
+                                 const TwapiTlsChannelConfig *configP);
+
+#endif
@@ -104,4 +104,16 @@ TCL_RESULT TwapiUnregisterPCCERT_CONTEXT(Tcl_Interp *, PCCERT_CONTEXT);
 TCL_RESULT TwapiUnregisterPCCERT_CONTEXTTic(TwapiInterpContext *, PCCERT_CONTEXT);
 Tcl_Obj *ObjFromCERT_NAME_BLOB(CERT_NAME_BLOB *blobP, DWORD flags);
 
+#include "certcache.h"
+
+/* Default number of certificates whose decoded information is cached */
+#define TWAPI_CERTINFO_CACHE_SIZE 256
+
+/* We hang this off TwapiInterpContext to hold this module's data */
+typedef struct _TwapiCryptoInterpContext {
+    /* Results of Twapi_CertGetInfo keyed by digest of the encoded cert */
+    TwapiCertCache *certinfo_cacheP;
+} TwapiCryptoInterpContext;
+#define CRYPTO_CONTEXT(ticP_) ((TwapiCryptoInterpContext *)(ticP_)->module.data.pval)
+
 #endif
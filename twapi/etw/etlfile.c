@@ -0,0 +1,639 @@
+/*
+ * Copyright (c) 2018, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ */
+
+/*
+ * Parser for the .etl file format. The format is not documented by
+ * Microsoft. The layouts below are those of the WMI_BUFFER_HEADER and the
+ * record headers written by the kernel logger (see ntwmi.h in the WDK
+ * and published analyses of the format) and match what ProcessTrace
+ * reads. All fields are little endian and are read with memcpy as
+ * records are only 8 byte aligned relative to the start of the buffer.
+ */
+
+#ifdef ETW_STANDALONE
+# include <stdlib.h>
+# define EtlAlloc(n_) malloc(n_)
+# define EtlFree(p_) free(p_)
+#else
+# include "twapi.h"
+# include <evntrace.h>
+# include <ntverp.h>
+# if (VER_PRODUCTBUILD < 7600) || (_WIN32_WINNT <= 0x600)
+#  include "tdhdefs.h"
+# else
+#  include <tdh.h>
+# endif
+# define EtlAlloc(n_) TwapiAlloc(n_)
+# define EtlFree(p_) TwapiFree(p_)
+#endif
+
+#include <string.h>
+
+#include "etlfile.h"
+
+/* WMI_BUFFER_HEADER */
+#define ETL_BUFFER_HEADER_SIZE 72
+#define ETL_BUF_BUFFER_SIZE    0
+#define ETL_BUF_SAVED_OFFSET   4
+#define ETL_BUF_TIMESTAMP      16
+#define ETL_BUF_CLIENT_CONTEXT 40
+#define ETL_BUF_OFFSET         48
+#define ETL_BUF_FLAGS          52
+#define ETL_BUF_TYPE           54
+
+/* Largest buffer size permitted by StartTrace is 1MB. Allow for growth. */
+#define ETL_MAX_BUFFER_SIZE (64*1024*1024)
+
+/*
+ * Every record starts with a marker ULONG whose high bit is always set,
+ * with the header type in bits 16-23.
+ */
+#define TRACE_HEADER_FLAG 0x80000000
+
+#define TRACE_HEADER_TYPE_SYSTEM32       1
+#define TRACE_HEADER_TYPE_SYSTEM64       2
+#define TRACE_HEADER_TYPE_COMPACT32      3
+#define TRACE_HEADER_TYPE_COMPACT64      4
+#define TRACE_HEADER_TYPE_FULL_HEADER32 10
+#define TRACE_HEADER_TYPE_PERFINFO32    16
+#define TRACE_HEADER_TYPE_PERFINFO64    17
+#define TRACE_HEADER_TYPE_EVENT_HEADER32 18
+#define TRACE_HEADER_TYPE_EVENT_HEADER64 19
+#define TRACE_HEADER_TYPE_FULL_HEADER64 20
+
+/*
+ * SYSTEM_TRACE_HEADER - Version, HeaderType, Flags, Size, Type (opcode),
+ * Group, ThreadId, ProcessId, SystemTime, KernelTime, UserTime. The
+ * compact form omits the CPU times and the perfinfo form has only the
+ * timestamp after the hook id.
+ */
+#define ETL_SYSTEM_HEADER_SIZE   32
+#define ETL_COMPACT_HEADER_SIZE  24
+#define ETL_PERFINFO_HEADER_SIZE 16
+/* EVENT_TRACE_HEADER as logged by TraceEvent */
+#define ETL_FULL_HEADER_SIZE     48
+/* EVENT_HEADER as logged by EventWrite */
+#define ETL_EVENT_HEADER_SIZE    80
+
+/* Offsets within TRACE_LOGFILE_HEADER up to the pointer sized fields */
+#define ETL_LFH_BUFFER_SIZE       0
+#define ETL_LFH_VERSION           4
+#define ETL_LFH_PROVIDER_VERSION  8
+#define ETL_LFH_NPROCESSORS       12
+#define ETL_LFH_END_TIME          16
+#define ETL_LFH_TIMER_RESOLUTION  24
+#define ETL_LFH_MAX_FILE_SIZE     28
+#define ETL_LFH_LOG_FILE_MODE     32
+#define ETL_LFH_BUFFERS_WRITTEN   36
+#define ETL_LFH_POINTER_SIZE      44
+#define ETL_LFH_EVENTS_LOST       48
+#define ETL_LFH_CPU_SPEED         52
+#define ETL_LFH_LOGGER_NAME       56 /* Followed by LogFileName, TimeZone */
+#define ETL_TIME_ZONE_INFO_SIZE   172
+
+#define ETL_ALIGN8(n_) (((n_) + 7) & ~7)
+
+/*
+ * Provider GUIDs for the event groups of the system headers. Only those
+ * for which the MOF classes are documented.
+ */
+static const struct {
+    UCHAR group;
+    GUID guid;
+} gEtlGroupGuids[] = {
+    /* EventTraceGuid - log file header and rundown */
+    {0x00, {0x68fdd900, 0x4a3e, 0x11d1, {0x84, 0xf4, 0x00, 0x00, 0xf8, 0x04, 0x64, 0xe3}}},
+    /* DiskIo */
+    {0x01, {0x3d6fa8d4, 0xfe05, 0x11d0, {0x9d, 0xda, 0x00, 0xc0, 0x4f, 0xd7, 0xba, 0x7c}}},
+    /* PageFault */
+    {0x02, {0x3d6fa8d3, 0xfe05, 0x11d0, {0x9d, 0xda, 0x00, 0xc0, 0x4f, 0xd7, 0xba, 0x7c}}},
+    /* Process */
+    {0x03, {0x3d6fa8d0, 0xfe05, 0x11d0, {0x9d, 0xda, 0x00, 0xc0, 0x4f, 0xd7, 0xba, 0x7c}}},
+    /* FileIo */
+    {0x04, {0x90cbdc39, 0x4a3e, 0x11d1, {0x84, 0xf4, 0x00, 0x00, 0xf8, 0x04, 0x64, 0xe3}}},
+    /* Thread */
+    {0x05, {0x3d6fa8d1, 0xfe05, 0x11d0, {0x9d, 0xda, 0x00, 0xc0, 0x4f, 0xd7, 0xba, 0x7c}}},
+    /* TcpIp */
+    {0x06, {0x9a280ac0, 0xc8e0, 0x11d1, {0x84, 0xe2, 0x00, 0xc0, 0x4f, 0xb9, 0x98, 0xa2}}},
+    /* UdpIp */
+    {0x08, {0xbf3a50c5, 0xa9c9, 0x4988, {0xa0, 0x05, 0x2d, 0xf0, 0xb7, 0xc8, 0x0f, 0x80}}},
+    /* Registry */
+    {0x09, {0xae53722e, 0xc863, 0x11d2, {0x86, 0x59, 0x00, 0xc0, 0x4f, 0xa3, 0x21, 0xa1}}},
+    /* EventTraceConfig - hardware configuration */
+    {0x0B, {0x01853a65, 0x418f, 0x4f36, {0xae, 0xfc, 0xdc, 0x0f, 0x1d, 0x2f, 0xd2, 0x35}}},
+    /* PerfInfo - sampled profile, system calls, DPCs, interrupts */
+    {0x0F, {0xce1dbfb4, 0x137e, 0x4da6, {0x87, 0xb0, 0x3f, 0x59, 0xaa, 0x10, 0x2c, 0xbc}}},
+    /* ImageLoad */
+    {0x14, {0x2cb15d1d, 0x5fc1, 0x11d2, {0xab, 0xe1, 0x00, 0xa0, 0xc9, 0x11, 0xf5, 0x18}}},
+    /* StackWalk */
+    {0x18, {0xdef2fe46, 0x7bd6, 0x4b80, {0xbd, 0x94, 0xf5, 0x7f, 0xe2, 0x0d, 0x0c, 0xe3}}},
+    /* ALPC */
+    {0x1A, {0x45d8cccd, 0x539f, 0x4b72, {0xa8, 0xb7, 0x5c, 0x68, 0x31, 0x42, 0x60, 0x9a}}},
+    /* SplitIo */
+    {0x1B, {0xd837ca92, 0x12b9, 0x44a5, {0xad, 0x6a, 0x3a, 0x65, 0xb3, 0x57, 0x8a, 0xa8}}},
+};
+
+struct _TwapiEtlFile {
+    TwapiEtlReadFn *readFn;
+    void *ctxP;
+    ULONG flags;
+    ULONG nbuffers;
+    ULONG next_buffer;          /* Index of next buffer to read */
+    BYTE *bufP;                 /* Current buffer, header.buffer_size bytes */
+    ULONG buf_pos;              /* Offset of next record in bufP */
+    ULONG buf_end;              /* End of the filled part of bufP */
+    TwapiEtlBufferInfo bufinfo;
+    EVENT_RECORD evr;
+    EVENT_HEADER_EXTENDED_DATA_ITEM *extP;
+    ULONG ext_capacity;
+    /*
+     * Timestamps are converted to FILETIME as start_time plus the ticks
+     * since sync_ts, the timestamp of the log file header event, at freq
+     * ticks per second. No conversion if freq is 0.
+     */
+    LONGLONG sync_ts;
+    LONGLONG freq;
+    BYTE *rawP;                 /* Copy of the log file header event data */
+    TwapiEtlHeader header;
+    TwapiEtlStats stats;
+};
+
+static USHORT EtlU16(const BYTE *p)
+{
+    USHORT v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static ULONG EtlU32(const BYTE *p)
+{
+    ULONG v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static LONGLONG EtlI64(const BYTE *p)
+{
+    LONGLONG v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static LONGLONG EtlConvertTimestamp(TwapiEtlFile *etlP, LONGLONG ts)
+{
+    LONGLONG delta;
+
+    if (etlP->freq == 0)
+        return ts;
+    /* Split so the multiplication cannot overflow for long traces */
+    delta = ts - etlP->sync_ts;
+    return etlP->header.start_time
+        + (delta / etlP->freq) * 10000000
+        + ((delta % etlP->freq) * 10000000) / etlP->freq;
+}
+
+static void EtlSetGroupGuid(GUID *guidP, UCHAR group)
+{
+    size_t i;
+    for (i = 0; i < sizeof(gEtlGroupGuids)/sizeof(gEtlGroupGuids[0]); ++i) {
+        if (gEtlGroupGuids[i].group == group) {
+            *guidP = gEtlGroupGuids[i].guid;
+            return;
+        }
+    }
+    memset(guidP, 0, sizeof(*guidP));
+}
+
+/* Returns ERROR_BAD_FORMAT for buffers that should be skipped */
+static ULONG EtlLoadBuffer(TwapiEtlFile *etlP, ULONG index)
+{
+    ULONG status, filled;
+    BYTE *p = etlP->bufP;
+    TwapiEtlBufferInfo *infoP = &etlP->bufinfo;
+
+    etlP->buf_pos = etlP->buf_end = 0;
+    status = etlP->readFn(etlP->ctxP,
+                          index * (ULONGLONG) etlP->header.buffer_size,
+                          p, etlP->header.buffer_size);
+    if (status != ERROR_SUCCESS)
+        return status;
+
+    if (EtlU32(p + ETL_BUF_BUFFER_SIZE) != etlP->header.buffer_size)
+        return ERROR_BAD_FORMAT;
+    filled = EtlU32(p + ETL_BUF_OFFSET);
+    if (filled < ETL_BUFFER_HEADER_SIZE || filled > etlP->header.buffer_size) {
+        filled = EtlU32(p + ETL_BUF_SAVED_OFFSET);
+        if (filled < ETL_BUFFER_HEADER_SIZE || filled > etlP->header.buffer_size)
+            return ERROR_BAD_FORMAT;
+    }
+
+    infoP->index = index;
+    infoP->filled = filled;
+    infoP->timestamp = EtlConvertTimestamp(etlP, EtlI64(p + ETL_BUF_TIMESTAMP));
+    memcpy(&infoP->context, p + ETL_BUF_CLIENT_CONTEXT, sizeof(infoP->context));
+    infoP->flags = EtlU16(p + ETL_BUF_FLAGS);
+    infoP->type = EtlU16(p + ETL_BUF_TYPE);
+    if (infoP->flags & TWAPI_ETL_BUFFER_FLAG_COMPRESSED)
+        return ERROR_BAD_FORMAT;
+
+    etlP->buf_pos = ETL_BUFFER_HEADER_SIZE;
+    etlP->buf_end = filled;
+    return ERROR_SUCCESS;
+}
+
+static void EtlDecodeSystemHeader(TwapiEtlFile *etlP, const BYTE *p,
+                                  int htype, ULONG hdrlen)
+{
+    EVENT_HEADER *ehP = &etlP->evr.EventHeader;
+
+    ehP->Flags = EVENT_HEADER_FLAG_CLASSIC_HEADER;
+    if (htype == TRACE_HEADER_TYPE_SYSTEM64 ||
+        htype == TRACE_HEADER_TYPE_COMPACT64 ||
+        htype == TRACE_HEADER_TYPE_PERFINFO64)
+        ehP->Flags |= EVENT_HEADER_FLAG_64_BIT_HEADER;
+    else
+        ehP->Flags |= EVENT_HEADER_FLAG_32_BIT_HEADER;
+    EtlSetGroupGuid(&ehP->ProviderId, p[7]);
+    ehP->EventDescriptor.Opcode = p[6];
+    ehP->EventDescriptor.Version = (UCHAR) EtlU16(p);
+    if (hdrlen == ETL_PERFINFO_HEADER_SIZE) {
+        /* Not associated with any thread */
+        ehP->Flags |= EVENT_HEADER_FLAG_NO_CPUTIME;
+        ehP->ThreadId = (ULONG) -1;
+        ehP->ProcessId = (ULONG) -1;
+        ehP->TimeStamp.QuadPart = EtlI64(p + 8);
+    } else {
+        ehP->ThreadId = EtlU32(p + 8);
+        ehP->ProcessId = EtlU32(p + 12);
+        ehP->TimeStamp.QuadPart = EtlI64(p + 16);
+        if (hdrlen == ETL_SYSTEM_HEADER_SIZE) {
+            ehP->KernelTime = EtlU32(p + 24);
+            ehP->UserTime = EtlU32(p + 28);
+        } else
+            ehP->Flags |= EVENT_HEADER_FLAG_NO_CPUTIME;
+    }
+}
+
+static void EtlDecodeFullHeader(TwapiEtlFile *etlP, const BYTE *p, int htype)
+{
+    EVENT_HEADER *ehP = &etlP->evr.EventHeader;
+
+    ehP->Flags = EVENT_HEADER_FLAG_CLASSIC_HEADER |
+        (htype == TRACE_HEADER_TYPE_FULL_HEADER64 ?
+         EVENT_HEADER_FLAG_64_BIT_HEADER : EVENT_HEADER_FLAG_32_BIT_HEADER);
+    ehP->EventDescriptor.Opcode = p[4];
+    ehP->EventDescriptor.Level = p[5];
+    ehP->EventDescriptor.Version = (UCHAR) EtlU16(p + 6);
+    ehP->ThreadId = EtlU32(p + 8);
+    ehP->ProcessId = EtlU32(p + 12);
+    ehP->TimeStamp.QuadPart = EtlI64(p + 16);
+    memcpy(&ehP->ProviderId, p + 24, sizeof(GUID));
+    ehP->KernelTime = EtlU32(p + 40);
+    ehP->UserTime = EtlU32(p + 44);
+}
+
+/*
+ * Extended data items follow the header, each an 8 byte item header as
+ * in EVENT_HEADER_EXTENDED_DATA_ITEM without the DataPtr, followed by
+ * the data padded to 8 bytes. Linkage is set in all but the last. Returns
+ * the number of bytes taken up or 0 if they do not fit in len.
+ */
+static ULONG EtlDecodeExtendedData(TwapiEtlFile *etlP, const BYTE *p, ULONG len)
+{
+    ULONG pos = 0, n = 0, datasize;
+    int linkage;
+    EVENT_HEADER_EXTENDED_DATA_ITEM *itemP;
+
+    do {
+        if (pos > len || len - pos < 8)
+            return 0;
+        linkage = EtlU16(p + pos + 4) & 1;
+        datasize = EtlU16(p + pos + 6);
+        if (datasize > len - pos - 8)
+            return 0;
+        if (n == etlP->ext_capacity) {
+            EVENT_HEADER_EXTENDED_DATA_ITEM *newP;
+            if (n == 0xffff)
+                return 0;       /* Would overflow ExtendedDataCount */
+            newP = EtlAlloc(2 * (n + 4) * sizeof(*newP));
+            if (newP == NULL)
+                return 0;
+            if (n)
+                memcpy(newP, etlP->extP, n * sizeof(*newP));
+            if (etlP->extP)
+                EtlFree(etlP->extP);
+            etlP->extP = newP;
+            etlP->ext_capacity = 2 * (n + 4);
+        }
+        itemP = &etlP->extP[n++];
+        memset(itemP, 0, sizeof(*itemP));
+        itemP->ExtType = EtlU16(p + pos + 2);
+        itemP->Linkage = linkage;
+        itemP->DataSize = (USHORT) datasize;
+        itemP->DataPtr = (ULONGLONG) (size_t) (p + pos + 8);
+        pos += 8 + datasize;
+        if (linkage)
+            pos = ETL_ALIGN8(pos);
+    } while (linkage);
+
+    pos = ETL_ALIGN8(pos);
+    if (pos > len)
+        pos = len;
+    etlP->evr.ExtendedDataCount = (USHORT) (n > 0xffff ? 0xffff : n);
+    etlP->evr.ExtendedData = etlP->extP;
+    return pos;
+}
+
+ULONG TwapiEtlNextEvent(TwapiEtlFile *etlP, EVENT_RECORD **evrPP)
+{
+    EVENT_RECORD *evrP = &etlP->evr;
+    const BYTE *p;
+    ULONG marker, avail, size, hdrlen, extlen;
+    int htype;
+
+    while (etlP->buf_end - etlP->buf_pos >= 8) {
+        p = etlP->bufP + etlP->buf_pos;
+        avail = etlP->buf_end - etlP->buf_pos;
+        marker = EtlU32(p);
+        if (marker == 0xffffffff || (marker & TRACE_HEADER_FLAG) == 0)
+            break;              /* Unused remainder of buffer */
+
+        htype = (marker >> 16) & 0xff;
+        switch (htype) {
+        case TRACE_HEADER_TYPE_SYSTEM32:
+        case TRACE_HEADER_TYPE_SYSTEM64:
+            hdrlen = ETL_SYSTEM_HEADER_SIZE;
+            size = EtlU16(p + 4);
+            break;
+        case TRACE_HEADER_TYPE_COMPACT32:
+        case TRACE_HEADER_TYPE_COMPACT64:
+            hdrlen = ETL_COMPACT_HEADER_SIZE;
+            size = EtlU16(p + 4);
+            break;
+        case TRACE_HEADER_TYPE_PERFINFO32:
+        case TRACE_HEADER_TYPE_PERFINFO64:
+            hdrlen = ETL_PERFINFO_HEADER_SIZE;
+            size = EtlU16(p + 4);
+            break;
+        case TRACE_HEADER_TYPE_FULL_HEADER32:
+        case TRACE_HEADER_TYPE_FULL_HEADER64:
+            hdrlen = ETL_FULL_HEADER_SIZE;
+            size = EtlU16(p);
+            break;
+        case TRACE_HEADER_TYPE_EVENT_HEADER32:
+        case TRACE_HEADER_TYPE_EVENT_HEADER64:
+            hdrlen = ETL_EVENT_HEADER_SIZE;
+            size = EtlU16(p);
+            break;
+        default:
+            /* Instance headers, WPP messages etc. Size is first. */
+            hdrlen = 0;
+            size = EtlU16(p);
+            break;
+        }
+
+        if (size < (hdrlen ? hdrlen : 8) || size > avail) {
+            /* Cannot locate the next record so give up on the buffer */
+            ++etlP->stats.bad_records;
+            break;
+        }
+        etlP->buf_pos += ETL_ALIGN8(size);
+        if (etlP->buf_pos > etlP->buf_end)
+            etlP->buf_pos = etlP->buf_end;
+
+        if (hdrlen == 0) {
+            ++etlP->stats.skipped_records;
+            continue;
+        }
+
+        memset(evrP, 0, sizeof(*evrP));
+        extlen = 0;
+        if (hdrlen == ETL_EVENT_HEADER_SIZE) {
+            memcpy(&evrP->EventHeader, p, ETL_EVENT_HEADER_SIZE);
+            if ((evrP->EventHeader.Flags & (EVENT_HEADER_FLAG_32_BIT_HEADER | EVENT_HEADER_FLAG_64_BIT_HEADER)) == 0)
+                evrP->EventHeader.Flags |=
+                    htype == TRACE_HEADER_TYPE_EVENT_HEADER64 ?
+                    EVENT_HEADER_FLAG_64_BIT_HEADER : EVENT_HEADER_FLAG_32_BIT_HEADER;
+            if (evrP->EventHeader.Flags & EVENT_HEADER_FLAG_EXTENDED_INFO) {
+                extlen = EtlDecodeExtendedData(etlP, p + hdrlen, size - hdrlen);
+                if (extlen == 0) {
+                    ++etlP->stats.bad_records;
+                    continue;
+                }
+            }
+        } else if (hdrlen == ETL_FULL_HEADER_SIZE)
+            EtlDecodeFullHeader(etlP, p, htype);
+        else
+            EtlDecodeSystemHeader(etlP, p, htype, hdrlen);
+
+        evrP->EventHeader.Size = (USHORT) size;
+        evrP->EventHeader.TimeStamp.QuadPart =
+            EtlConvertTimestamp(etlP, evrP->EventHeader.TimeStamp.QuadPart);
+        evrP->BufferContext = etlP->bufinfo.context;
+        if (etlP->bufinfo.flags & TWAPI_ETL_BUFFER_FLAG_PROC_INDEX)
+            evrP->EventHeader.Flags |= EVENT_HEADER_FLAG_PROCESSOR_INDEX;
+        evrP->UserDataLength = (USHORT) (size - hdrlen - extlen);
+        evrP->UserData = evrP->UserDataLength ? (PVOID) (p + hdrlen + extlen) : NULL;
+
+        ++etlP->stats.events;
+        *evrPP = evrP;
+        return ERROR_SUCCESS;
+    }
+
+    etlP->buf_pos = etlP->buf_end;
+    return ERROR_NO_MORE_ITEMS;
+}
+
+/* Returns the length in bytes of the nul terminated string at p */
+static ULONG EtlWideStringSize(const BYTE *p, ULONG len)
+{
+    ULONG n;
+    for (n = 0; n + 1 < len; n += 2) {
+        if (p[n] == 0 && p[n+1] == 0)
+            return n + 2;
+    }
+    return len;
+}
+
+static ULONG EtlParseLogfileHeader(TwapiEtlFile *etlP, EVENT_RECORD *evrP)
+{
+    TwapiEtlHeader *hP = &etlP->header;
+    const BYTE *p = evrP->UserData;
+    ULONG len = evrP->UserDataLength;
+    ULONG pos;
+
+    if (len < ETL_LFH_LOGGER_NAME)
+        return ERROR_BAD_FORMAT;
+    hP->pointer_size = EtlU32(p + ETL_LFH_POINTER_SIZE);
+    if (hP->pointer_size != 4 && hP->pointer_size != 8)
+        return ERROR_BAD_FORMAT;
+    /* Fields after the time zone are 8 byte aligned */
+    pos = ETL_ALIGN8(ETL_LFH_LOGGER_NAME + 2 * hP->pointer_size + ETL_TIME_ZONE_INFO_SIZE);
+    if (len < pos + 32)
+        return ERROR_BAD_FORMAT;
+
+    hP->buffer_size = EtlU32(p + ETL_LFH_BUFFER_SIZE);
+    hP->version = EtlU32(p + ETL_LFH_VERSION);
+    hP->provider_version = EtlU32(p + ETL_LFH_PROVIDER_VERSION);
+    hP->nprocessors = EtlU32(p + ETL_LFH_NPROCESSORS);
+    hP->end_time = EtlI64(p + ETL_LFH_END_TIME);
+    hP->timer_resolution = EtlU32(p + ETL_LFH_TIMER_RESOLUTION);
+    hP->max_file_size = EtlU32(p + ETL_LFH_MAX_FILE_SIZE);
+    hP->log_file_mode = EtlU32(p + ETL_LFH_LOG_FILE_MODE);
+    hP->buffers_written = EtlU32(p + ETL_LFH_BUFFERS_WRITTEN);
+    hP->events_lost = EtlU32(p + ETL_LFH_EVENTS_LOST);
+    hP->cpu_speed = EtlU32(p + ETL_LFH_CPU_SPEED);
+    hP->boot_time = EtlI64(p + pos);
+    hP->perf_freq = EtlI64(p + pos + 8);
+    hP->start_time = EtlI64(p + pos + 16);
+    hP->clock_type = EtlU32(p + pos + 24);
+    hP->buffers_lost = EtlU32(p + pos + 28);
+
+    /*
+     * The logger and log file names follow. Keep a copy with room for
+     * terminating nuls in case they are missing or truncated.
+     */
+    etlP->rawP = EtlAlloc(ETL_ALIGN8(len) + 8);
+    if (etlP->rawP == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+    memcpy(etlP->rawP, p, len);
+    memset(etlP->rawP + len, 0, ETL_ALIGN8(len) + 8 - len);
+    hP->rawP = etlP->rawP;
+    hP->raw_size = len;
+    pos += 32;
+    hP->logger_nameP = (WCHAR *) (etlP->rawP + ETL_ALIGN8(len));
+    hP->log_file_nameP = hP->logger_nameP;
+    if (pos < len) {
+        hP->logger_nameP = (WCHAR *) (etlP->rawP + pos);
+        pos += EtlWideStringSize(p + pos, len - pos);
+        if (pos < len)
+            hP->log_file_nameP = (WCHAR *) (etlP->rawP + pos);
+    }
+
+    if (etlP->flags & TWAPI_ETL_RAW_TIMESTAMP)
+        etlP->freq = 0;
+    else if (hP->clock_type == 2)
+        etlP->freq = 0;         /* Already system time */
+    else if (hP->clock_type == 3)
+        etlP->freq = hP->cpu_speed * (LONGLONG) 1000000;
+    else
+        etlP->freq = hP->perf_freq;
+    etlP->sync_ts = evrP->EventHeader.TimeStamp.QuadPart;
+    return ERROR_SUCCESS;
+}
+
+ULONG TwapiEtlOpen(TwapiEtlReadFn *readFn, void *ctxP, ULONGLONG file_size,
+                   ULONG flags, TwapiEtlFile **etlPP)
+{
+    TwapiEtlFile *etlP;
+    BYTE bufhdr[ETL_BUFFER_HEADER_SIZE];
+    EVENT_RECORD *evrP;
+    ULONG status, buffer_size;
+
+    if (file_size < ETL_BUFFER_HEADER_SIZE)
+        return ERROR_BAD_FORMAT;
+    status = readFn(ctxP, 0, bufhdr, sizeof(bufhdr));
+    if (status != ERROR_SUCCESS)
+        return status;
+    buffer_size = EtlU32(bufhdr + ETL_BUF_BUFFER_SIZE);
+    if (buffer_size < ETL_BUFFER_HEADER_SIZE + ETL_SYSTEM_HEADER_SIZE ||
+        buffer_size > ETL_MAX_BUFFER_SIZE || buffer_size > file_size)
+        return ERROR_BAD_FORMAT;
+
+    etlP = EtlAlloc(sizeof(*etlP));
+    if (etlP == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+    memset(etlP, 0, sizeof(*etlP));
+    etlP->readFn = readFn;
+    etlP->ctxP = ctxP;
+    etlP->flags = flags;
+    etlP->bufP = EtlAlloc(buffer_size);
+    if (etlP->bufP == NULL) {
+        TwapiEtlClose(etlP);
+        return ERROR_NOT_ENOUGH_MEMORY;
+    }
+    etlP->header.buffer_size = buffer_size;
+    etlP->nbuffers = (ULONG) (file_size / buffer_size);
+
+    /* The first event must be the log file header */
+    status = EtlLoadBuffer(etlP, 0);
+    if (status == ERROR_SUCCESS) {
+        status = TwapiEtlNextEvent(etlP, &evrP);
+        if (status == ERROR_SUCCESS) {
+            if (evrP->EventHeader.EventDescriptor.Opcode != 0 ||
+                memcmp(&evrP->EventHeader.ProviderId, &gEtlGroupGuids[0].guid, sizeof(GUID)))
+                status = ERROR_BAD_FORMAT;
+            else
+                status = EtlParseLogfileHeader(etlP, evrP);
+        } else
+            status = ERROR_BAD_FORMAT;
+    }
+    if (status == ERROR_SUCCESS && etlP->header.buffer_size != buffer_size)
+        status = ERROR_BAD_FORMAT;
+    if (status != ERROR_SUCCESS) {
+        TwapiEtlClose(etlP);
+        return status;
+    }
+
+    memset(&etlP->stats, 0, sizeof(etlP->stats));
+    TwapiEtlSeekBuffer(etlP, 0);
+    *etlPP = etlP;
+    return ERROR_SUCCESS;
+}
+
+void TwapiEtlClose(TwapiEtlFile *etlP)
+{
+    if (etlP->bufP)
+        EtlFree(etlP->bufP);
+    if (etlP->extP)
+        EtlFree(etlP->extP);
+    if (etlP->rawP)
+        EtlFree(etlP->rawP);
+    EtlFree(etlP);
+}
+
+const TwapiEtlHeader *TwapiEtlGetHeader(TwapiEtlFile *etlP)
+{
+    return &etlP->header;
+}
+
+ULONG TwapiEtlBufferCount(TwapiEtlFile *etlP)
+{
+    return etlP->nbuffers;
+}
+
+ULONG TwapiEtlSeekBuffer(TwapiEtlFile *etlP, ULONG index)
+{
+    if (index > etlP->nbuffers)
+        return ERROR_INVALID_PARAMETER;
+    etlP->next_buffer = index;
+    etlP->buf_pos = etlP->buf_end = 0;
+    return ERROR_SUCCESS;
+}
+
+ULONG TwapiEtlReadBuffer(TwapiEtlFile *etlP, const TwapiEtlBufferInfo **infoPP)
+{
+    ULONG status;
+
+    while (etlP->next_buffer < etlP->nbuffers) {
+        status = EtlLoadBuffer(etlP, etlP->next_buffer++);
+        if (status == ERROR_SUCCESS) {
+            ++etlP->stats.buffers;
+            *infoPP = &etlP->bufinfo;
+            return ERROR_SUCCESS;
+        }
+        if (status != ERROR_BAD_FORMAT)
+            return status;
+        ++etlP->stats.skipped_buffers;
+    }
+    return ERROR_HANDLE_EOF;
+}
+
+void TwapiEtlGetStats(TwapiEtlFile *etlP, TwapiEtlStats *statsP)
+{
+    *statsP = etlP->stats;
+}
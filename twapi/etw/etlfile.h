@@ -0,0 +1,125 @@
+#ifndef TWAPI_ETLFILE_H
+#define TWAPI_ETLFILE_H
+
+/*
+ * Reader for .etl files that does not use OpenTrace/ProcessTrace. An .etl
+ * file is a sequence of fixed size buffers, each filled with events by
+ * one processor. Events are returned one buffer at a time as EVENT_RECORD
+ * structures, filled in as ProcessTrace passes them to an
+ * EventRecordCallback, so the same decoders can be used for both. Unlike
+ * ProcessTrace, events are returned in file order and are not merged
+ * across buffers in timestamp order. Any buffer can be read directly
+ * given its index.
+ *
+ * Classic (MOF) events logged with the kernel's compact system headers
+ * are given the provider GUID of their event group where that is known,
+ * as ProcessTrace does. Records with instance headers, WPP messages and
+ * compressed buffers are not supported and are skipped.
+ *
+ * Builds standalone without Tcl or TWAPI when ETW_STANDALONE is defined,
+ * in which case the definitions come from etwtypes.h.
+ */
+
+#ifdef ETW_STANDALONE
+# include "etwtypes.h"
+#endif
+
+#ifndef EVENT_HEADER_FLAG_PROCESSOR_INDEX
+# define EVENT_HEADER_FLAG_PROCESSOR_INDEX 0x0200 /* Win 8, not in older SDKs */
+#endif
+
+/*
+ * Reads exactly len bytes at the given file offset. Returns ERROR_SUCCESS
+ * or a Win32 error code, ERROR_HANDLE_EOF if the file is too short.
+ */
+typedef ULONG TwapiEtlReadFn(void *ctxP, ULONGLONG offset, void *bufP, ULONG len);
+
+typedef struct _TwapiEtlFile TwapiEtlFile;
+
+/* Flags for TwapiEtlOpen */
+#define TWAPI_ETL_RAW_TIMESTAMP 0x1 /* Do not convert timestamps to FILETIME */
+
+/* Log file information from the TRACE_LOGFILE_HEADER event */
+typedef struct _TwapiEtlHeader {
+    ULONG buffer_size;
+    ULONG version;
+    ULONG provider_version;
+    ULONG nprocessors;
+    ULONG timer_resolution;
+    ULONG max_file_size;
+    ULONG log_file_mode;
+    ULONG buffers_written;
+    ULONG pointer_size;
+    ULONG events_lost;
+    ULONG cpu_speed;            /* MHz */
+    ULONG clock_type;           /* ReservedFlags - 1 QPC, 2 system, 3 cycles */
+    ULONG buffers_lost;
+    LONGLONG end_time;
+    LONGLONG boot_time;
+    LONGLONG perf_freq;
+    LONGLONG start_time;
+    const WCHAR *logger_nameP;  /* Empty if not present */
+    const WCHAR *log_file_nameP;
+    /* The event data (TRACE_LOGFILE_HEADER and names) as in the file */
+    const void *rawP;
+    ULONG raw_size;
+} TwapiEtlHeader;
+
+typedef struct _TwapiEtlBufferInfo {
+    ULONG index;
+    ULONG filled;               /* Bytes in use including buffer header */
+    LONGLONG timestamp;
+    ETW_BUFFER_CONTEXT context;
+    USHORT flags;               /* TWAPI_ETL_BUFFER_FLAG_* */
+    USHORT type;
+} TwapiEtlBufferInfo;
+
+#define TWAPI_ETL_BUFFER_FLAG_EVENTS_LOST 0x0002
+#define TWAPI_ETL_BUFFER_FLAG_BUFFER_LOST 0x0004
+#define TWAPI_ETL_BUFFER_FLAG_PROC_INDEX  0x0020
+#define TWAPI_ETL_BUFFER_FLAG_COMPRESSED  0x0040
+
+typedef struct _TwapiEtlStats {
+    ULONGLONG events;           /* Returned by TwapiEtlNextEvent */
+    ULONGLONG buffers;          /* Returned by TwapiEtlReadBuffer */
+    ULONGLONG skipped_records;  /* Unsupported header types */
+    ULONGLONG skipped_buffers;  /* Compressed or bad buffer headers */
+    ULONGLONG bad_records;      /* Invalid record sizes, rest of buffer lost */
+} TwapiEtlStats;
+
+/*
+ * Opens a file of file_size bytes read through readFn. Returns
+ * ERROR_BAD_FORMAT if it does not start with a log file header.
+ * Reading starts with the first buffer whose first event is the
+ * log file header event, as with ProcessTrace.
+ */
+ULONG TwapiEtlOpen(TwapiEtlReadFn *readFn, void *ctxP, ULONGLONG file_size,
+                   ULONG flags, TwapiEtlFile **etlPP);
+void TwapiEtlClose(TwapiEtlFile *etlP);
+
+const TwapiEtlHeader *TwapiEtlGetHeader(TwapiEtlFile *etlP);
+ULONG TwapiEtlBufferCount(TwapiEtlFile *etlP);
+
+/*
+ * Makes the buffer at index the next one to be read. An index equal to
+ * the buffer count is permitted and positions at the end of the file.
+ */
+ULONG TwapiEtlSeekBuffer(TwapiEtlFile *etlP, ULONG index);
+
+/*
+ * Reads the next buffer, skipping any that cannot be parsed. Returns
+ * ERROR_HANDLE_EOF when there are no more. The returned information, and
+ * all events from the buffer, are only valid until the next call to
+ * TwapiEtlReadBuffer or TwapiEtlSeekBuffer.
+ */
+ULONG TwapiEtlReadBuffer(TwapiEtlFile *etlP, const TwapiEtlBufferInfo **infoPP);
+
+/*
+ * Returns the next event in the current buffer, ERROR_NO_MORE_ITEMS
+ * after the last one. UserData and ExtendedData point into the buffer.
+ */
+ULONG TwapiEtlNextEvent(TwapiEtlFile *etlP, EVENT_RECORD **evrPP);
+
+void TwapiEtlGetStats(TwapiEtlFile *etlP, TwapiEtlStats *statsP);
+
+#endif
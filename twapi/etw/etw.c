@@ -26,15 +26,6 @@
 #pragma comment(lib, "tdh.lib")	 /* New TDH library for Vista and beyond */
 #endif
 
-#if !defined(ETW_BUFFER_CONTEXT_DEF) && !defined(__GNUC__)
-/* TBD - note this struct has changed in the post-Win7 SDKs */
-typedef struct _ETW_BUFFER_CONTEXT {
-    UCHAR ProcessorNumber;
-    UCHAR Alignment;
-    USHORT LoggerId;
-} ETW_BUFFER_CONTEXT, *PETW_BUFFER_CONTEXT;
-#endif
-
 #ifdef RUNTIME_TDH_LOAD
 
 #define INITGUID // To get EventTraceGuid defined
@@ -47,323 +38,7 @@ DEFINE_GUID ( /* 68fdd900-4a3e-11d1-84f4-0000f80464e3 */
     0x84, 0xf4, 0x00, 0x00, 0xf8, 0x04, 0x64, 0xe3
   );
 
-#define EVENT_HEADER_PROPERTY_XML               0x0001
-#define EVENT_HEADER_PROPERTY_FORWARDED_XML     0x0002
-#define EVENT_HEADER_PROPERTY_LEGACY_EVENTLOG   0x0004
-
-#define EVENT_HEADER_FLAG_EXTENDED_INFO         0x0001
-#define EVENT_HEADER_FLAG_PRIVATE_SESSION       0x0002
-#define EVENT_HEADER_FLAG_STRING_ONLY           0x0004
-#define EVENT_HEADER_FLAG_TRACE_MESSAGE         0x0008
-#define EVENT_HEADER_FLAG_NO_CPUTIME            0x0010
-#define EVENT_HEADER_FLAG_32_BIT_HEADER         0x0020
-#define EVENT_HEADER_FLAG_64_BIT_HEADER         0x0040
-#define EVENT_HEADER_FLAG_CLASSIC_HEADER        0x0100
-
-#define EVENT_HEADER_EXT_TYPE_RELATED_ACTIVITYID   0x0001
-#define EVENT_HEADER_EXT_TYPE_SID                  0x0002
-#define EVENT_HEADER_EXT_TYPE_TS_ID                0x0003
-#define EVENT_HEADER_EXT_TYPE_INSTANCE_INFO        0x0004
-#define EVENT_HEADER_EXT_TYPE_STACK_TRACE32        0x0005
-#define EVENT_HEADER_EXT_TYPE_STACK_TRACE64        0x0006
-#define EVENT_HEADER_EXT_TYPE_MAX                  0x0007
-
-typedef struct _EVENT_DESCRIPTOR {
-
-    USHORT      Id;
-    UCHAR       Version;
-    UCHAR       Channel;
-    UCHAR       Level;
-    UCHAR       Opcode;
-    USHORT      Task;
-    ULONGLONG   Keyword;
-
-} EVENT_DESCRIPTOR, *PEVENT_DESCRIPTOR;
-
-typedef const EVENT_DESCRIPTOR *PCEVENT_DESCRIPTOR;
-
-typedef struct _EVENT_HEADER {
-    USHORT Size;
-    USHORT HeaderType;
-    USHORT Flags;
-    USHORT EventProperty;
-    ULONG ThreadId;
-    ULONG ProcessId;
-    LARGE_INTEGER TimeStamp;
-    GUID ProviderId;
-    EVENT_DESCRIPTOR EventDescriptor;
-    union {
-        struct {
-            ULONG KernelTime;
-            ULONG UserTime;
-        };
-        ULONG64 ProcessorTime;
-    };
-    GUID ActivityId;
-
-} EVENT_HEADER, *PEVENT_HEADER;
-
-typedef struct _EVENT_EXTENDED_ITEM_TS_ID {
-  ULONG SessionId;
-} EVENT_EXTENDED_ITEM_TS_ID, *PEVENT_EXTENDED_ITEM_TS_ID;
-
-typedef struct _EVENT_EXTENDED_ITEM_RELATED_ACTIVITYID {
-  GUID RelatedActivityId;
-} EVENT_EXTENDED_ITEM_RELATED_ACTIVITYID, *PEVENT_EXTENDED_ITEM_RELATED_ACTIVITYID;
-
-typedef struct _EVENT_EXTENDED_ITEM_INSTANCE {
-  ULONG InstanceId;
-  ULONG ParentInstanceId;
-  GUID  ParentGuid;
-} EVENT_EXTENDED_ITEM_INSTANCE, *PEVENT_EXTENDED_ITEM_INSTANCE;
-
-typedef struct _EVENT_HEADER_EXTENDED_DATA_ITEM {
-    USHORT Reserved1;
-    USHORT ExtType;
-    struct {
-        USHORT Linkage :  1;
-        USHORT Reserved2 : 15;
-    };
-    USHORT DataSize;
-    ULONGLONG  DataPtr;
-
-} EVENT_HEADER_EXTENDED_DATA_ITEM, *PEVENT_HEADER_EXTENDED_DATA_ITEM;
-
-typedef struct _EVENT_RECORD {
-
-    EVENT_HEADER EventHeader;
-    ETW_BUFFER_CONTEXT BufferContext;
-    USHORT ExtendedDataCount;
-    USHORT UserDataLength;
-    PEVENT_HEADER_EXTENDED_DATA_ITEM ExtendedData;
-    PVOID UserData;
-    PVOID UserContext;
-} EVENT_RECORD, *PEVENT_RECORD;
-
-#define EVENT_ENABLE_PROPERTY_SID                   0x00000001
-#define EVENT_ENABLE_PROPERTY_TS_ID                 0x00000002
-#define EVENT_ENABLE_PROPERTY_STACK_TRACE           0x00000004
-
-#define PROCESS_TRACE_MODE_REAL_TIME                0x00000100
-#define PROCESS_TRACE_MODE_RAW_TIMESTAMP            0x00001000
-#define PROCESS_TRACE_MODE_EVENT_RECORD             0x10000000
-
-typedef enum _TDH_CONTEXT_TYPE { 
-    TDH_CONTEXT_WPP_TMFFILE = 0,
-    TDH_CONTEXT_WPP_TMFSEARCHPATH = 1,
-    TDH_CONTEXT_WPP_GMT = 2,
-    TDH_CONTEXT_POINTERSIZE = 3,
-    TDH_CONTEXT_PDB_PATH = 4,
-    TDH_CONTEXT_MAXIMUM = 5
-} TDH_CONTEXT_TYPE;
-
-typedef struct _TDH_CONTEXT {
-    ULONGLONG ParameterValue;
-    TDH_CONTEXT_TYPE ParameterType;
-    ULONG ParameterSize;
-} TDH_CONTEXT;
-
-typedef enum _DECODING_SOURCE { 
-  DecodingSourceXMLFile  = 0,
-  DecodingSourceWbem     = 1,
-  DecodingSourceWPP      = 2
-} DECODING_SOURCE;
-
-typedef enum _TEMPLATE_FLAGS
-{
-    TEMPLATE_EVENT_DATA = 1,
-    TEMPLATE_USER_DATA = 2
-} TEMPLATE_FLAGS;
-
-
-typedef enum _PROPERTY_FLAGS
-{
-   PropertyStruct        = 0x1,      // Type is struct.
-   PropertyParamLength   = 0x2,      // Length field is index of param with length.
-   PropertyParamCount    = 0x4,      // Count file is index of param with count.
-   PropertyWBEMXmlFragment = 0x8,    // WBEM extension flag for property.
-   PropertyParamFixedLength = 0x10   // Length of the parameter is fixed.
-} PROPERTY_FLAGS;
-
-typedef struct _EVENT_PROPERTY_INFO {
-    PROPERTY_FLAGS Flags;
-    ULONG NameOffset;
-    union {
-        struct _nonStructType {
-            USHORT InType;
-            USHORT OutType;
-            ULONG MapNameOffset;
-        } nonStructType;
-        struct _structType {
-            USHORT StructStartIndex;
-            USHORT NumOfStructMembers;
-            ULONG padding;
-        } structType;
-    };
-    union {
-        USHORT count;
-        USHORT countPropertyIndex;
-    };
-    union {
-        USHORT length;
-        USHORT lengthPropertyIndex;
-    };
-    ULONG Reserved;
-} EVENT_PROPERTY_INFO;
-typedef EVENT_PROPERTY_INFO *PEVENT_PROPERTY_INFO;
-
-typedef struct _TRACE_EVENT_INFO {
-  GUID ProviderGuid;
-  GUID EventGuid;
-  EVENT_DESCRIPTOR EventDescriptor;
-  DECODING_SOURCE DecodingSource;
-  ULONG ProviderNameOffset;
-  ULONG LevelNameOffset;
-  ULONG ChannelNameOffset;
-  ULONG KeywordsNameOffset;
-  ULONG TaskNameOffset;
-  ULONG OpcodeNameOffset;
-  ULONG EventMessageOffset;
-  ULONG ProviderMessageOffset;
-  ULONG BinaryXMLOffset;
-  ULONG BinaryXMLSize;
-  ULONG ActivityIDNameOffset;
-  ULONG RelatedActivityIDNameOffset;
-  ULONG PropertyCount;
-  ULONG TopLevelPropertyCount;
-  TEMPLATE_FLAGS Flags;
-  EVENT_PROPERTY_INFO EventPropertyInfoArray[ANYSIZE_ARRAY];
-} TRACE_EVENT_INFO;
-
-typedef struct _PROPERTY_DATA_DESCRIPTOR {
-    ULONGLONG PropertyName;
-    ULONG ArrayIndex;
-    ULONG Reserved;
-} PROPERTY_DATA_DESCRIPTOR;
-typedef PROPERTY_DATA_DESCRIPTOR *PPROPERTY_DATA_DESCRIPTOR;
-
-typedef struct _EVENT_MAP_ENTRY {
-    ULONG OutputOffset;
-    union {
-        ULONG Value;
-        ULONG InputOffset;
-    };
-} EVENT_MAP_ENTRY;
-typedef EVENT_MAP_ENTRY *PEVENT_MAP_ENTRY;
-
-typedef enum _MAP_FLAGS {
-    EVENTMAP_INFO_FLAG_MANIFEST_VALUEMAP   = 0x1,
-    EVENTMAP_INFO_FLAG_MANIFEST_BITMAP     = 0x2,
-    EVENTMAP_INFO_FLAG_MANIFEST_PATTERNMAP = 0x4,
-    EVENTMAP_INFO_FLAG_WBEM_VALUEMAP       = 0x8,
-    EVENTMAP_INFO_FLAG_WBEM_BITMAP         = 0x10,
-    EVENTMAP_INFO_FLAG_WBEM_FLAG           = 0x20,
-    EVENTMAP_INFO_FLAG_WBEM_NO_MAP         = 0x40
-} MAP_FLAGS;
-
-typedef enum _MAP_VALUETYPE {
-    EVENTMAP_ENTRY_VALUETYPE_ULONG,
-    EVENTMAP_ENTRY_VALUETYPE_STRING
-}  MAP_VALUETYPE;
-
-typedef struct _EVENT_MAP_INFO {
-    ULONG NameOffset;
-    MAP_FLAGS Flag;
-    ULONG EntryCount;
-    union {
-        MAP_VALUETYPE MapEntryValueType;
-        ULONG FormatStringOffset;
-    };
-    EVENT_MAP_ENTRY MapEntryArray[ANYSIZE_ARRAY];
-} EVENT_MAP_INFO;
-typedef EVENT_MAP_INFO *PEVENT_MAP_INFO;
-
-enum _TDH_IN_TYPE {
-    TDH_INTYPE_NULL,
-    TDH_INTYPE_UNICODESTRING,
-    TDH_INTYPE_ANSISTRING,
-    TDH_INTYPE_INT8,
-    TDH_INTYPE_UINT8,
-    TDH_INTYPE_INT16,
-    TDH_INTYPE_UINT16,
-    TDH_INTYPE_INT32,
-    TDH_INTYPE_UINT32,
-    TDH_INTYPE_INT64,
-    TDH_INTYPE_UINT64,
-    TDH_INTYPE_FLOAT,
-    TDH_INTYPE_DOUBLE,
-    TDH_INTYPE_BOOLEAN,
-    TDH_INTYPE_BINARY,
-    TDH_INTYPE_GUID,
-    TDH_INTYPE_POINTER,
-    TDH_INTYPE_FILETIME,
-    TDH_INTYPE_SYSTEMTIME,
-    TDH_INTYPE_SID,
-    TDH_INTYPE_HEXINT32,
-    TDH_INTYPE_HEXINT64,                    // End of winmeta intypes.
-    TDH_INTYPE_COUNTEDSTRING = 300,         // Start of TDH intypes for WBEM.
-    TDH_INTYPE_COUNTEDANSISTRING,
-    TDH_INTYPE_REVERSEDCOUNTEDSTRING,
-    TDH_INTYPE_REVERSEDCOUNTEDANSISTRING,
-    TDH_INTYPE_NONNULLTERMINATEDSTRING,
-    TDH_INTYPE_NONNULLTERMINATEDANSISTRING,
-    TDH_INTYPE_UNICODECHAR,
-    TDH_INTYPE_ANSICHAR,
-    TDH_INTYPE_SIZET,
-    TDH_INTYPE_HEXDUMP,
-    TDH_INTYPE_WBEMSID
-};
-
-enum _TDH_OUT_TYPE {
-    TDH_OUTTYPE_NULL,
-    TDH_OUTTYPE_STRING,
-    TDH_OUTTYPE_DATETIME,
-    TDH_OUTTYPE_BYTE,
-    TDH_OUTTYPE_UNSIGNEDBYTE,
-    TDH_OUTTYPE_SHORT,
-    TDH_OUTTYPE_UNSIGNEDSHORT,
-    TDH_OUTTYPE_INT,
-    TDH_OUTTYPE_UNSIGNEDINT,
-    TDH_OUTTYPE_LONG,
-    TDH_OUTTYPE_UNSIGNEDLONG,
-    TDH_OUTTYPE_FLOAT,
-    TDH_OUTTYPE_DOUBLE,
-    TDH_OUTTYPE_BOOLEAN,
-    TDH_OUTTYPE_GUID,
-    TDH_OUTTYPE_HEXBINARY,
-    TDH_OUTTYPE_HEXINT8,
-    TDH_OUTTYPE_HEXINT16,
-    TDH_OUTTYPE_HEXINT32,
-    TDH_OUTTYPE_HEXINT64,
-    TDH_OUTTYPE_PID,
-    TDH_OUTTYPE_TID,
-    TDH_OUTTYPE_PORT,
-    TDH_OUTTYPE_IPV4,
-    TDH_OUTTYPE_IPV6,
-    TDH_OUTTYPE_SOCKETADDRESS,
-    TDH_OUTTYPE_CIMDATETIME,
-    TDH_OUTTYPE_ETWTIME,
-    TDH_OUTTYPE_XML,
-    TDH_OUTTYPE_ERRORCODE,
-    TDH_OUTTYPE_WIN32ERROR,
-    TDH_OUTTYPE_NTSTATUS,
-    TDH_OUTTYPE_HRESULT,             // End of winmeta outtypes.
-    TDH_OUTTYPE_CULTURE_INSENSITIVE_DATETIME, //Culture neutral datetime string.
-    TDH_OUTTYPE_REDUCEDSTRING = 300, // Start of TDH outtypes for WBEM.
-    TDH_OUTTYPE_NOPRINT
-};
-
-typedef struct _TRACE_PROVIDER_INFO {
-  GUID  ProviderGuid;
-  ULONG SchemaSource;
-  ULONG ProviderNameOffset;
-} TRACE_PROVIDER_INFO;
-
-typedef struct _PROVIDER_ENUMERATION_INFO {
-  ULONG               NumberOfProviders;
-  ULONG               Padding;
-  TRACE_PROVIDER_INFO TraceProviderInfoArray[ANYSIZE_ARRAY];
-} PROVIDER_ENUMERATION_INFO;
+#include "tdhdefs.h"
 
 /*
  * Stubs for TDH functions
@@ -394,6 +69,13 @@ HANDLE gTdhDllHandle;
 
 #endif
 
+#include "tdhcache.h"
+#include "etlfile.h"
+#include "etwbatch.h"
+#include "etwsession.h"
+#include "etwwriter.h"
+#include "mofdecode.h"
+
 #ifndef EVENT_HEADER_FLAG_PROCESSOR_INDEX
 # define EVENT_HEADER_FLAG_PROCESSOR_INDEX 0x0200 /* Win 8, not in older SDKs */
 #endif
@@ -442,15 +124,58 @@ struct TwapiETWContext {
 
     int   buffer_cmdlen;        /* length of buffer_cmdObj */
     ULONG pointer_size;         /* Used if event itself does not specify */
-    ULONG timer_resolution;
-    ULONG user_mode;
-} gETWContext;                  /* IMPORTANT : Sync access via gETWCS */
 
+    /*
+     * If non-NULL, events are decoded lazily and are collected in batchP
+     * instead of eventsObj, which is then only used to pass the batch.
+     */
+    TwapiEtwBatch *batchP;
+
+    /*
+     * Non-NULL on session threads started by Twapi_ETWSessionStart.
+     * Events are then passed on to the session and none of the fields
+     * above other than pointer_size are used as they belong to the
+     * interp thread.
+     */
+    TwapiEtwSession *sessionP;
+};
+
+/*
+ * ProcessTrace calls back on the thread that called it so the context of
+ * the trace being processed on a thread is kept in thread local storage.
+ * Traces can therefore be processed concurrently on different threads
+ * but not recursively on the same one.
+ */
+static DWORD gETWContextTlsIndex = TLS_OUT_OF_INDEXES;
+#define ETW_CURRENT_CONTEXT() ((struct TwapiETWContext *) TlsGetValue(gETWContextTlsIndex))
+
+typedef struct _TwapiETWSessionSource TwapiETWSessionSource;
+ZLINK_CREATE_TYPEDEFS(TwapiETWSessionSource);
+ZLIST_CREATE_TYPEDEFS(TwapiETWSessionSource);
 
-/* IMPORTANT : Sync access via gETWCS */
+/* Per-interpreter state, stored in ticP->module.data.pval */
+typedef struct _TwapiETWInterpContext {
+    TwapiTdhCache *schema_cacheP; /* Event schemas seen by consumers */
+    ZLIST_DECL(TwapiETWSessionSource) sessions; /* Started by ETWSessionStart */
+} TwapiETWInterpContext;
+#define ETW_CONTEXT(ticP_) ((TwapiETWInterpContext *)(ticP_)->module.data.pval)
 
+#define TWAPI_ETW_SCHEMA_CACHE_SIZE 256
 
-CRITICAL_SECTION gETWCS; /* Access to gETWContext */
+static int TwapiETWSessionCallbackFn(TwapiCallback *cbP);
+#define TwapiETWSessionSourceRef(p_, incr_) InterlockedExchangeAdd(&(p_)->nrefs, (incr_))
+static ULONG TwapiETWSessionBufferDone(TwapiEtwSession *sessionP, EVENT_TRACE_LOGFILEW *etlP);
+
+/*
+ * Tcl objects built from a cached schema, attached to it so they are
+ * shared by all events with that schema.
+ */
+typedef struct _TwapiETWSchemaObjs {
+    Tcl_Obj *infoObj;           /* Event info fields other than properties */
+    int nnames;
+    Tcl_Obj *nameObjs[1];       /* Names of the fixed layout properties.
+                                   Actually nnames in size */
+} TwapiETWSchemaObjs;
 
 /* Used for testing old MOF based APIs on newer Windows OS'es */
 static int gForceMofAPI = 0;
@@ -518,12 +243,14 @@ static TCL_RESULT ObjToTRACEHANDLE(Tcl_Interp *interp, Tcl_Obj *objP, TRACEHANDL
 
 static int TwapiCalcPointerSize(EVENT_RECORD *evrP)
 {
+    struct TwapiETWContext *etwcP;
+
     if (evrP->EventHeader.Flags & EVENT_HEADER_FLAG_32_BIT_HEADER)
         return 4;
     else if (evrP->EventHeader.Flags & EVENT_HEADER_FLAG_64_BIT_HEADER)
         return 8;
-    else
-        return gETWContext.pointer_size;
+    etwcP = ETW_CURRENT_CONTEXT();
+    return etwcP ? etwcP->pointer_size : sizeof(void*);
 }
 
 static Tcl_Obj *ObjFromTRACE_LOGFILE_HEADER(TRACE_LOGFILE_HEADER *tlhP)
@@ -1152,16 +879,23 @@ void WINAPI TwapiETWEventCallback(
 )
 {
     Tcl_Obj *objs[5];
+    struct TwapiETWContext *etwcP;
+
+    /* Called back from Win32 ProcessTrace call on the thread that called it */
+    etwcP = ETW_CURRENT_CONTEXT();
+    TWAPI_ASSERT(etwcP != NULL);
 
-    /* Called back from Win32 ProcessTrace call. Assumed that gETWContext is locked */
+    /* Sessions only handle EVENT_RECORDs, see Twapi_ETWSessionStart */
+    if (etwcP->sessionP)
+        return;
 
-    if (gETWContext.status != TCL_OK)   /* If some previous error occurred, return */
+    if (etwcP->status != TCL_OK)   /* If some previous error occurred, return */
         return;
 
     if (evP->Header.Class.Type == EVENT_TRACE_TYPE_INFO &&
         IsEqualGUID(&evP->Header.Guid, &EventTraceGuid)) {
         /* If further events do not indicate pointer size, we will use this size*/
-        gETWContext.pointer_size = ((TRACE_LOGFILE_HEADER *) evP->MofData)->PointerSize;
+        etwcP->pointer_size = ((TRACE_LOGFILE_HEADER *) evP->MofData)->PointerSize;
     }
 
 
@@ -1175,7 +909,7 @@ void WINAPI TwapiETWEventCallback(
     else
         objs[4] = ObjFromEmptyString();
     
-    ObjAppendElement(NULL, gETWContext.eventsObj, ObjNewList(ARRAYSIZE(objs), objs));
+    ObjAppendElement(NULL, etwcP->eventsObj, ObjNewList(ARRAYSIZE(objs), objs));
 }
 
 /* Used in constructing a Tcl_Obj for TRACE_EVENT_INFO when a name is 
@@ -1535,12 +1269,7 @@ static TCL_RESULT TwapiTdhPropertyValue(
     case TDH_INTYPE_WBEMSID:
         /* TOKEN_USER structure followed by SID. Sizeof TOKEN_USER
            depends on 32/64 bittedness of event stream. */
-        if (evrP->EventHeader.Flags & EVENT_HEADER_FLAG_32_BIT_HEADER)
-            dw = 4;
-        else if (evrP->EventHeader.Flags & EVENT_HEADER_FLAG_64_BIT_HEADER)
-            dw = 8;
-        else
-            dw = gETWContext.pointer_size;
+        dw = TwapiCalcPointerSize(evrP);
         dw *= 2; /* sizeof(TOKEN_USER) == 16 on 64bit arch, 8 on 32bit */
         if (prop_size < (dw+sizeof(SID)))
             goto size_error;
@@ -1851,34 +1580,60 @@ static TCL_RESULT TwapiDecodeEVENT_PROPERTY_INFO(
 }
 
 
-/* Uses memlifo frame. Caller responsible for cleanup */
-static TCL_RESULT TwapiTdhGetEventInformation(TwapiInterpContext *ticP, EVENT_RECORD *evrP, Tcl_Obj **teiObjP)
+static void TwapiETWSchemaObjsFree(void *pv)
+{
+    TwapiETWSchemaObjs *schemaobjsP = pv;
+    int i;
+
+    ObjDecrRefs(schemaobjsP->infoObj);
+    for (i = 0; i < schemaobjsP->nnames; ++i)
+        ObjDecrRefs(schemaobjsP->nameObjs[i]);
+    TwapiFree(schemaobjsP);
+}
+
+/*
+ * Uses memlifo frame. Caller responsible for cleanup. The property list
+ * is left empty unless properties is non-0. If schemaP is NULL, the
+ * schema is looked up in the interp's cache, else it is one already
+ * resolved for the event on a session thread.
+ */
+static TCL_RESULT TwapiTdhGetEventInformation(TwapiInterpContext *ticP, EVENT_RECORD *evrP, int properties, TwapiTdhSchema *schemaP, Tcl_Obj **teiObjP)
 {
     DWORD sz, winerr;
     Tcl_Obj *objs[13];
+    Tcl_Obj **infoObjs;
     TCL_RESULT status;
     TRACE_EVENT_INFO *teiP;
     EVENT_DESCRIPTOR *edP;
     TDH_CONTEXT tdhctx;
-    int i, classic;
+    int i, classic, ninfo;
     Tcl_Obj *emptyObj;
+    TwapiETWSchemaObjs *schemaobjsP;
+
+    if (schemaP == NULL)
+        schemaP = TwapiTdhCacheGet(ETW_CONTEXT(ticP)->schema_cacheP, evrP,
+                                   TwapiCalcPointerSize(evrP));
+    if (schemaP) {
+        teiP = schemaP->teiP;
+        winerr = schemaP->status;
+    } else {
+        /* Not cacheable. Get the schema directly from TDH */
+        teiP = MemLifoAlloc(ticP->memlifoP, 1000, &sz);
 
-    /* TBD - instrument how much to try for initially */
-    teiP = MemLifoAlloc(ticP->memlifoP, 1000, &sz);
+        tdhctx.ParameterValue = TwapiCalcPointerSize(evrP);
+        tdhctx.ParameterType = TDH_CONTEXT_POINTERSIZE;
+        tdhctx.ParameterSize = 0;   /* Reserved value */
 
-    tdhctx.ParameterValue = TwapiCalcPointerSize(evrP);
-    tdhctx.ParameterType = TDH_CONTEXT_POINTERSIZE;
-    tdhctx.ParameterSize = 0;   /* Reserved value */
+        winerr = TdhGetEventInformation(evrP, 1, &tdhctx, teiP, &sz);
+        if (winerr == ERROR_INSUFFICIENT_BUFFER) {
+            teiP = MemLifoAlloc(ticP->memlifoP, sz, NULL);
+            winerr = TdhGetEventInformation(evrP, 1, &tdhctx, teiP, &sz);
+        }
+    }
 
     emptyObj = ObjFromEmptyString();
     ObjIncrRefs(emptyObj);  /* Since we DecrRefs it for error handling */
 
-    winerr = TdhGetEventInformation(evrP, 1, &tdhctx, teiP, &sz);
-    if (winerr == ERROR_INSUFFICIENT_BUFFER) {
-        teiP = MemLifoAlloc(ticP->memlifoP, sz, NULL);
-        winerr = TdhGetEventInformation(evrP, 1, &tdhctx, teiP, &sz);
-    }
-    
     if (winerr != ERROR_SUCCESS) {
         /* Dummy up data */
         for (i = 0; i < ARRAYSIZE(objs); ++i)
@@ -1907,50 +1662,94 @@ static TCL_RESULT TwapiTdhGetEventInformation(TwapiInterpContext *ticP, EVENT_RE
                                   Tcl_ObjPrintf("Unsupported ETW decoding source (%d)", teiP->DecodingSource));
     }
 
+    schemaobjsP = schemaP ? schemaP->clientP : NULL;
+    if (schemaobjsP) {
+        /* Fields built when the schema was first seen */
+        ObjGetElements(NULL, schemaobjsP->infoObj, &ninfo, &infoObjs);
+        TWAPI_ASSERT(ninfo == 12);
+        for (i = 0; i < 12; ++i)
+            objs[i] = infoObjs[i];
+    } else {
 
 #define OFFSET_TO_OBJ(field_) (teiP->field_ ? ObjFromWinCharsNoTrailingSpace((LPWSTR)(teiP->field_ + (char*)teiP)) : emptyObj)
 
-    /* Provider GUID and EventDescriptor are already returned as part
-       of EVENT_HEADER. We prefer to do it there so that we can return
-       partial info even when the TdhGetEventInformation call fails
-       due to the MOF not having been registered
-    */
+        /* Provider GUID and EventDescriptor are already returned as part
+           of EVENT_HEADER. We prefer to do it there so that we can return
+           partial info even when the TdhGetEventInformation call fails
+           due to the MOF not having been registered
+        */
+
+        //objs[] = ObjFromGUID(&teiP->ProviderGuid);
+        objs[0] = classic ? ObjFromGUID(&teiP->EventGuid) : emptyObj;
+        //objs[] = ObjFromEVENT_DESCRIPTOR(&teiP->EventDescriptor);
+        objs[1] = ObjFromLong(teiP->DecodingSource);
+        objs[2] = OFFSET_TO_OBJ(ProviderNameOffset);
+        objs[3] = TwapiTEIWinCharsObj(teiP, teiP->LevelNameOffset, edP->Level);
+        objs[4] = TwapiTEIWinCharsObj(teiP, teiP->ChannelNameOffset, edP->Channel);
+        if (teiP->KeywordsNameOffset)
+            objs[5] = ObjFromMultiSz((LPWSTR) (teiP->KeywordsNameOffset + (char*)teiP), -1);
+        else
+            objs[5] = emptyObj;
+        objs[6] = TwapiTEIWinCharsObj(teiP, teiP->TaskNameOffset, edP->Task);
+        objs[7] = TwapiTEIWinCharsObj(teiP, teiP->OpcodeNameOffset, edP->Opcode);
+        objs[8] = OFFSET_TO_OBJ(EventMessageOffset);
+        objs[9] = OFFSET_TO_OBJ(ProviderMessageOffset);
+        if (classic) {
+            objs[10] = OFFSET_TO_OBJ(ActivityIDNameOffset);
+            objs[11] = OFFSET_TO_OBJ(RelatedActivityIDNameOffset);
+        } else {
+            objs[10] = emptyObj;
+            objs[11] = emptyObj;
+        }
 
-    //objs[] = ObjFromGUID(&teiP->ProviderGuid);
-    objs[0] = classic ? ObjFromGUID(&teiP->EventGuid) : emptyObj;
-    //objs[] = ObjFromEVENT_DESCRIPTOR(&teiP->EventDescriptor);
-    objs[1] = ObjFromLong(teiP->DecodingSource);
-    objs[2] = OFFSET_TO_OBJ(ProviderNameOffset);
-    objs[3] = TwapiTEIWinCharsObj(teiP, teiP->LevelNameOffset, edP->Level);
-    objs[4] = TwapiTEIWinCharsObj(teiP, teiP->ChannelNameOffset, edP->Channel);
-    if (teiP->KeywordsNameOffset)
-        objs[5] = ObjFromMultiSz((LPWSTR) (teiP->KeywordsNameOffset + (char*)teiP), -1);
-    else
-        objs[5] = emptyObj;
-    objs[6] = TwapiTEIWinCharsObj(teiP, teiP->TaskNameOffset, edP->Task);
-    objs[7] = TwapiTEIWinCharsObj(teiP, teiP->OpcodeNameOffset, edP->Opcode);
-    objs[8] = OFFSET_TO_OBJ(EventMessageOffset);
-    objs[9] = OFFSET_TO_OBJ(ProviderMessageOffset);
-    if (classic) {
-        objs[10] = OFFSET_TO_OBJ(ActivityIDNameOffset);
-        objs[11] = OFFSET_TO_OBJ(RelatedActivityIDNameOffset);
-    } else {
-        objs[10] = emptyObj;
-        objs[11] = emptyObj;
+        if (schemaP) {
+            schemaobjsP = TwapiAlloc(sizeof(*schemaobjsP) + schemaP->nfixed * sizeof(schemaobjsP->nameObjs[0]));
+            schemaobjsP->infoObj = ObjNewList(12, objs);
+            ObjIncrRefs(schemaobjsP->infoObj);
+            schemaobjsP->nnames = schemaP->nfixed;
+            for (i = 0; i < schemaP->nfixed; ++i) {
+                schemaobjsP->nameObjs[i] = ObjFromWinChars((WCHAR *)(teiP->EventPropertyInfoArray[i].NameOffset + (char*)teiP));
+                ObjIncrRefs(schemaobjsP->nameObjs[i]);
+            }
+            schemaP->clientP = schemaobjsP;
+        }
     }
 
-    objs[12] = ObjNewList(2 * teiP->TopLevelPropertyCount, NULL);
-    if (evrP->EventHeader.Flags & EVENT_HEADER_FLAG_STRING_ONLY) {
+    objs[12] = ObjNewList(properties ? 2 * teiP->TopLevelPropertyCount : 0, NULL);
+    if (! properties) {
+        /* Caller does not need them */
+    } else if (evrP->EventHeader.Flags & EVENT_HEADER_FLAG_STRING_ONLY) {
         ObjAppendElement(NULL, objs[12], STRING_LITERAL_OBJ("_stringdata"));
         ObjAppendElement(NULL, objs[12],
                          ObjFromWinCharsLimited(evrP->UserData,
                                                evrP->UserDataLength/sizeof(WCHAR), NULL));
     } else {
-        USHORT i;
+        USHORT i, nfixed;
+
+        /*
+         * Leading fixed size properties are read straight from the user
+         * data at the offsets computed for the schema instead of going
+         * through TdhGetPropertySize and TdhGetProperty.
+         */
+        nfixed = 0;
+        if (schemaobjsP && evrP->UserDataLength >= schemaP->fixed_size)
+            nfixed = schemaP->nfixed;
 
         for (i = 0; i < teiP->TopLevelPropertyCount; ++i) {
             Tcl_Obj *propnameObj, *propvalObj;
-            status = TwapiDecodeEVENT_PROPERTY_INFO(ticP, evrP, teiP, i, NULL, 0, &propnameObj, &propvalObj);
+            EVENT_PROPERTY_INFO *epiP = &teiP->EventPropertyInfoArray[i];
+            if (i < nfixed && epiP->nonStructType.MapNameOffset == 0) {
+                status = TwapiTdhPropertyValue(ticP, evrP, epiP,
+                                               schemaP->offsetsP[i] + (char *)evrP->UserData,
+                                               schemaP->sizesP[i], NULL,
+                                               &propvalObj);
+                if (status == TCL_OK) {
+                    propvalObj = ObjNewList(1, &propvalObj);
+                    propnameObj = schemaobjsP->nameObjs[i];
+                }
+            } else {
+                status = TwapiDecodeEVENT_PROPERTY_INFO(ticP, evrP, teiP, i, NULL, 0, &propnameObj, &propvalObj);
+            }
             if (status != TCL_OK) {
                 /* Cannot use ObjDecrArrayRefs here to free objs[] because
                    it contains multiple occurences of emptyObj. Explicitly
@@ -1971,6 +1770,74 @@ static TCL_RESULT TwapiTdhGetEventInformation(TwapiInterpContext *ticP, EVENT_RE
     return TCL_OK;
 }
 
+/*
+ * TwapiETWBatch is a Tcl "type" holding the events of one buffer when
+ * events are decoded lazily. The Tcl_Obj.internalRep.twoPtrValue.ptr1
+ * holds a reference to the TwapiEtwBatch. The string representation
+ * only identifies the batch and cannot be converted back.
+ */
+static void DupETWBatchType(Tcl_Obj *srcP, Tcl_Obj *dstP);
+static void FreeETWBatchType(Tcl_Obj *objP);
+static void UpdateETWBatchTypeString(Tcl_Obj *objP);
+static struct Tcl_ObjType gETWBatchType = {
+    "TwapiETWBatch",
+    FreeETWBatchType,
+    DupETWBatchType,
+    UpdateETWBatchTypeString,
+    NULL,     /* jenglish says keep this NULL */
+};
+
+static void FreeETWBatchType(Tcl_Obj *objP)
+{
+    TwapiEtwBatchRelease(objP->internalRep.twoPtrValue.ptr1);
+    objP->internalRep.twoPtrValue.ptr1 = NULL;
+    objP->typePtr = NULL;
+}
+
+static void DupETWBatchType(Tcl_Obj *srcP, Tcl_Obj *dstP)
+{
+    TwapiEtwBatchRetain(srcP->internalRep.twoPtrValue.ptr1);
+    dstP->internalRep.twoPtrValue.ptr1 = srcP->internalRep.twoPtrValue.ptr1;
+    dstP->internalRep.twoPtrValue.ptr2 = NULL;
+    dstP->typePtr = &gETWBatchType;
+}
+
+static void UpdateETWBatchTypeString(Tcl_Obj *objP)
+{
+    char buf[64];
+    int len;
+
+    TWAPI_ASSERT(objP->bytes == NULL);
+    _snprintf(buf, sizeof(buf), "etwbatch%p", objP->internalRep.twoPtrValue.ptr1);
+    buf[sizeof(buf)-1] = 0;
+    len = lstrlenA(buf);
+    objP->length = len;
+    objP->bytes = ckalloc(len + 1);
+    CopyMemory(objP->bytes, buf, len + 1);
+}
+
+/* Takes over the caller's reference to batchP */
+static Tcl_Obj *ObjFromETWBatch(TwapiEtwBatch *batchP)
+{
+    Tcl_Obj *objP;
+
+    objP = Tcl_NewObj();
+    Tcl_InvalidateStringRep(objP);
+    objP->internalRep.twoPtrValue.ptr1 = batchP;
+    objP->internalRep.twoPtrValue.ptr2 = NULL;
+    objP->typePtr = &gETWBatchType;
+    return objP;
+}
+
+static TCL_RESULT ObjToETWBatch(Tcl_Interp *interp, Tcl_Obj *objP, TwapiEtwBatch **batchPP)
+{
+    if (objP->typePtr != &gETWBatchType)
+        return TwapiReturnErrorMsg(interp, TWAPI_INVALID_ARGS,
+                                   "Not an ETW event batch or batch has been converted to a string");
+    *batchPP = objP->internalRep.twoPtrValue.ptr1;
+    return TCL_OK;
+}
+
 static VOID WINAPI TwapiETWEventRecordCallback(PEVENT_RECORD evrP)
 {
     int i;
@@ -1978,12 +1845,14 @@ static VOID WINAPI TwapiETWEventRecordCallback(PEVENT_RECORD evrP)
     Tcl_Obj *objs[3];
     MemLifoMarkHandle mark;
     TwapiInterpContext *ticP;
+    ULONG winerr;
+    struct TwapiETWContext *etwcP;
 
-    /* Called back from Win32 ProcessTrace call. Assumed that gETWContext is locked */
-    TWAPI_ASSERT(gETWContext.ticP != NULL);
-    TWAPI_ASSERT(gETWContext.ticP->interp != NULL);
+    /* Called back from Win32 ProcessTrace call on the thread that called it */
+    etwcP = ETW_CURRENT_CONTEXT();
+    TWAPI_ASSERT(etwcP != NULL);
 
-    if (gETWContext.status != TCL_OK) /* If some previous error occurred, return */
+    if (etwcP->status != TCL_OK) /* If some previous error occurred, return */
         return;
 
     if ((evrP->EventHeader.Flags & EVENT_HEADER_FLAG_TRACE_MESSAGE) != 0)
@@ -1995,10 +1864,28 @@ static VOID WINAPI TwapiETWEventRecordCallback(PEVENT_RECORD evrP)
          * This event is generated per log file. If an individual event do not
          * indicate pointer size, we will use this size.
          */
-        gETWContext.pointer_size = ((TRACE_LOGFILE_HEADER *) evrP->UserData)->PointerSize;
+        etwcP->pointer_size = ((TRACE_LOGFILE_HEADER *) evrP->UserData)->PointerSize;
+    }
+
+    if (etwcP->sessionP) {
+        /* Session thread. Copied and handed to the interp by buffer */
+        if (TwapiEtwSessionEvent(etwcP->sessionP, evrP, etwcP->pointer_size) != ERROR_SUCCESS)
+            etwcP->status = TCL_ERROR; /* Cannot touch the interp here */
+        return;
+    }
+
+    TWAPI_ASSERT(etwcP->ticP != NULL);
+    TWAPI_ASSERT(etwcP->ticP->interp != NULL);
+
+    if (etwcP->batchP) {
+        /* Decoded only when the script asks for the fields */
+        winerr = TwapiEtwBatchAppend(etwcP->batchP, evrP, etwcP->pointer_size);
+        if (winerr != ERROR_SUCCESS)
+            etwcP->status = Twapi_AppendSystemError(etwcP->ticP->interp, winerr);
+        return;
     }
 
-    ticP = gETWContext.ticP;
+    ticP = etwcP->ticP;
     mark = MemLifoPushMark(ticP->memlifoP);
 
     recObjs[0] = ObjFromEVENT_HEADER(&evrP->EventHeader);
@@ -2051,9 +1938,9 @@ static VOID WINAPI TwapiETWEventRecordCallback(PEVENT_RECORD evrP)
         }
     }
     
-    gETWContext.status = TwapiTdhGetEventInformation(ticP, evrP, &recObjs[3]);
-    if (gETWContext.status == TCL_OK)
-        ObjAppendElement(ticP->interp, gETWContext.eventsObj, ObjNewList(ARRAYSIZE(recObjs), recObjs));
+    etwcP->status = TwapiTdhGetEventInformation(ticP, evrP, 1, NULL, &recObjs[3]);
+    if (etwcP->status == TCL_OK)
+        ObjAppendElement(ticP->interp, etwcP->eventsObj, ObjNewList(ARRAYSIZE(recObjs), recObjs));
     else
         ObjDecrArrayRefs(3, recObjs);
 
@@ -2062,6 +1949,28 @@ static VOID WINAPI TwapiETWEventRecordCallback(PEVENT_RECORD evrP)
 }
 
 
+/*
+ * Returns the buffer descriptor passed to scripts along with the events
+ * of the buffer.
+ */
+static Tcl_Obj *ObjFromEVENT_TRACE_LOGFILEW(EVENT_TRACE_LOGFILEW *etlP)
+{
+    Tcl_Obj *objs[8];
+
+    objs[0] = etlP->LogFileName ? ObjFromWinChars(etlP->LogFileName) : ObjFromEmptyString();
+    objs[1] = etlP->LoggerName ? ObjFromWinChars(etlP->LoggerName) : ObjFromEmptyString();
+    objs[2] = ObjFromULONGLONG(etlP->CurrentTime);
+    objs[3] = ObjFromLong(etlP->BuffersRead);
+    //  ObjFromLong(etlP->LogFileMode) - docs say do not use
+    objs[4] = ObjFromTRACE_LOGFILE_HEADER(&etlP->LogfileHeader);
+    objs[5] = ObjFromLong(etlP->BufferSize);
+    objs[6] = ObjFromLong(etlP->Filled);
+    // Docs say unused -  ObjFromLong(etlP->EventsLost));
+    objs[7] = ObjFromLong(etlP->IsKernelTrace);
+
+    return ObjNewList(ARRAYSIZE(objs), objs);
+}
+
 ULONG WINAPI TwapiETWBufferCallback(
   PEVENT_TRACE_LOGFILEW etlP
 )
@@ -2071,82 +1980,90 @@ ULONG WINAPI TwapiETWBufferCallback(
     Tcl_Obj *args[2];
     Tcl_Interp *interp;
     int code;
-    Tcl_Obj *objs[8];
+    struct TwapiETWContext *etwcP;
 
-    /* Called back from Win32 ProcessTrace call. Assumed that gETWContext is locked */
-    TWAPI_ASSERT(gETWContext.ticP != NULL);
-    TWAPI_ASSERT(gETWContext.ticP->interp != NULL);
-    interp = gETWContext.ticP->interp;
+    /* Called back from Win32 ProcessTrace call on the thread that called it */
+    etwcP = ETW_CURRENT_CONTEXT();
+    TWAPI_ASSERT(etwcP != NULL);
 
-    if (Tcl_InterpDeleted(interp))
+    if (etwcP->status != TCL_OK) /* If some previous error occurred, return */
         return FALSE;
 
-    if (gETWContext.status != TCL_OK) /* If some previous error occurred, return */
+    if (etwcP->sessionP)
+        return TwapiETWSessionBufferDone(etwcP->sessionP, etlP);
+
+    TWAPI_ASSERT(etwcP->ticP != NULL);
+    TWAPI_ASSERT(etwcP->ticP->interp != NULL);
+    interp = etwcP->ticP->interp;
+
+    if (Tcl_InterpDeleted(interp))
         return FALSE;
 
-    TWAPI_ASSERT(gETWContext.eventsObj);
+    TWAPI_ASSERT(etwcP->eventsObj);
+
+    if (etwcP->batchP) {
+        /* Pass the events as a batch. The timing fields of the log file
+           header are at the same offset irrespective of pointer size */
+        TwapiEtwBatchSetTiming(etwcP->batchP,
+                               etlP->LogfileHeader.TimerResolution,
+                               (etlP->LogfileHeader.LogFileMode & EVENT_TRACE_PRIVATE_LOGGER_MODE) != 0);
+        TwapiEtwBatchSeal(etwcP->batchP);
+        ObjDecrRefs(etwcP->eventsObj);
+        etwcP->eventsObj = ObjFromETWBatch(etwcP->batchP);
+        ObjIncrRefs(etwcP->eventsObj);
+        etwcP->batchP = TwapiEtwBatchNew();
+    }
 
-    if (gETWContext.buffer_cmdlen == 0) {
+    if (etwcP->buffer_cmdlen == 0) {
         /* We are simply collecting events without invoking callback */
-        TWAPI_ASSERT(gETWContext.buffer.listObj != NULL);
+        TWAPI_ASSERT(etwcP->buffer.listObj != NULL);
     } else {
         /*
          * Construct a command to call with the event. 
-         * gETWContext.buffer_cmdObj could be a shared object, either
+         * etwcP->buffer_cmdObj could be a shared object, either
          * initially itself or result in a shared object in the callback.
          * So we need to check for that and Dup it if necessary
          */
 
-        if (Tcl_IsShared(gETWContext.buffer.cmdObj)) {
-            evalObj = ObjDuplicate(gETWContext.buffer.cmdObj);
+        if (Tcl_IsShared(etwcP->buffer.cmdObj)) {
+            evalObj = ObjDuplicate(etwcP->buffer.cmdObj);
             ObjIncrRefs(evalObj);
         } else
-            evalObj = gETWContext.buffer.cmdObj;
+            evalObj = etwcP->buffer.cmdObj;
     }
 
-    objs[0] = etlP->LogFileName ? ObjFromWinChars(etlP->LogFileName) : ObjFromEmptyString();
-    objs[1] = etlP->LoggerName ? ObjFromWinChars(etlP->LoggerName) : ObjFromEmptyString();
-    objs[2] = ObjFromULONGLONG(etlP->CurrentTime);
-    objs[3] = ObjFromLong(etlP->BuffersRead);
-    //  ObjFromLong(etlP->LogFileMode) - docs say do not use
-    objs[4] = ObjFromTRACE_LOGFILE_HEADER(&etlP->LogfileHeader);
-    objs[5] = ObjFromLong(etlP->BufferSize);
-    objs[6] = ObjFromLong(etlP->Filled);
-    // Docs say unused -  ObjFromLong(etlP->EventsLost));
-    objs[7] = ObjFromLong(etlP->IsKernelTrace);
-
-    bufObj = ObjNewList(ARRAYSIZE(objs), objs);
+    bufObj = ObjFromEVENT_TRACE_LOGFILEW(etlP);
 
-    if (gETWContext.buffer_cmdlen) {
+    if (etwcP->buffer_cmdlen) {
         args[0] = bufObj;
-        args[1] = gETWContext.eventsObj;
-        Tcl_ListObjReplace(interp, evalObj, gETWContext.buffer_cmdlen, ARRAYSIZE(args), ARRAYSIZE(args), args);
-        code = Tcl_EvalObjEx(gETWContext.ticP->interp, evalObj, TCL_EVAL_DIRECT | TCL_EVAL_GLOBAL);
+        args[1] = etwcP->eventsObj;
+        Tcl_ListObjReplace(interp, evalObj, etwcP->buffer_cmdlen, ARRAYSIZE(args), ARRAYSIZE(args), args);
+        code = Tcl_EvalObjEx(interp, evalObj, TCL_EVAL_DIRECT | TCL_EVAL_GLOBAL);
 
         /* Get rid of the command obj if we created it */
-        if (evalObj != gETWContext.buffer.cmdObj)
+        if (evalObj != etwcP->buffer.cmdObj)
             ObjDecrRefs(evalObj);
     } else {
         /* No callback. Just collect */
-        ObjAppendElement(NULL, gETWContext.buffer.listObj, bufObj);
-        ObjAppendElement(NULL, gETWContext.buffer.listObj, gETWContext.eventsObj);
+        ObjAppendElement(NULL, etwcP->buffer.listObj, bufObj);
+        ObjAppendElement(NULL, etwcP->buffer.listObj, etwcP->eventsObj);
         code = TCL_OK;
     }
 
     /* Note bufObj is ref'ed only in one of the lists above. Do not Decr it */
     /* eventObjs needs a DecrRefs to match the one when it was created */
-    ObjDecrRefs(gETWContext.eventsObj);
-    gETWContext.eventsObj = ObjNewList(0, NULL);/* For next set of events */
-    ObjIncrRefs(gETWContext.eventsObj);
+    ObjDecrRefs(etwcP->eventsObj);
+    etwcP->eventsObj = ObjNewList(0, NULL);/* For next set of events */
+    ObjIncrRefs(etwcP->eventsObj);
 
     switch (code) {
     case TCL_BREAK:
         /* Any other value - not an error, but stop processing */
         return FALSE;
     case TCL_ERROR:
-        gETWContext.status = TCL_ERROR;
-        ObjDecrRefs(gETWContext.eventsObj);
-        gETWContext.eventsObj = NULL;
+        etwcP->status = TCL_ERROR;
+        ObjDecrRefs(etwcP->eventsObj);
+        etwcP->eventsObj = NULL;
         return FALSE;
     case TCL_OK:
     default:        /* Any other value - proceed as normal - TBD */
@@ -2325,480 +2242,817 @@ TCL_RESULT Twapi_CloseTrace(ClientData clientdata, Tcl_Interp *interp, int objc,
 }
 
 
-TCL_RESULT Twapi_ProcessTrace(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+/*
+ * Sets up etwcP to collect events from TwapiETWEventRecordCallback
+ * and TwapiETWBufferCallback, as batches for lazy decoding if lazy is
+ * non-0, and makes it the context for the current thread. On success the
+ * caller must call TwapiETWEndProcessing once done.
+ */
+static TCL_RESULT TwapiETWBeginProcessing(struct TwapiETWContext *etwcP, TwapiInterpContext *ticP, Tcl_Obj *cmdObj, int buffer_cmdlen, TRACEHANDLE htrace, int lazy)
 {
-    TwapiInterpContext *ticP = (TwapiInterpContext*) clientdata;
-    int i;
-    FILETIME start, end, *startP, *endP;
-    struct TwapiETWContext etwc;
-    int buffer_cmdlen;
-    DWORD winerr;
-    Tcl_Obj **htraceObjs;
-    TRACEHANDLE htraces[8];
-    int       ntraces;
-
-    if (objc != 5)
-        return TwapiReturnError(interp, TWAPI_BAD_ARG_COUNT);
-
-    if (ObjGetElements(interp, objv[1], &ntraces, &htraceObjs) != TCL_OK)
-        return TCL_ERROR;
-
-    for (i = 0; i < ntraces; ++i) {
-        if (ObjToTRACEHANDLE(interp, htraceObjs[i], &htraces[i]) != TCL_OK)
-            return TCL_ERROR;
-    }
-
-    /* Verify callback command prefix is a list. If empty, data
-     * is returned instead.
-     */
-    if (ObjListLength(interp, objv[2], &buffer_cmdlen) != TCL_OK)
-        return TCL_ERROR;
-
-    if (Tcl_GetCharLength(objv[3]) == 0)
-        startP = NULL;
-    else if (ObjToFILETIME(interp, objv[3], &start) != TCL_OK)
-            return TCL_ERROR;
-    else
-        startP = &start;
-    
-    if (Tcl_GetCharLength(objv[4]) == 0)
-        endP = NULL;
-    else if (ObjToFILETIME(interp, objv[4], &end) != TCL_OK)
-            return TCL_ERROR;
-    else
-        endP = &end;
-    
-    EnterCriticalSection(&gETWCS);
-    
-    if (gETWContext.ticP != NULL) {
-        LeaveCriticalSection(&gETWCS);
-        ObjSetStaticResult(interp, "Recursive call to ProcessTrace");
+    if (ETW_CURRENT_CONTEXT() != NULL) {
+        ObjSetStaticResult(ticP->interp, "Recursive call to ProcessTrace");
         return TCL_ERROR;
     }
 
-    gETWContext.traceH = htraces[0];
-    gETWContext.buffer_cmdlen = buffer_cmdlen;
+    ZeroMemory(etwcP, sizeof(*etwcP));
+    etwcP->traceH = htrace;
+    etwcP->buffer_cmdlen = buffer_cmdlen;
     if (buffer_cmdlen)
-        gETWContext.buffer.cmdObj = objv[2];
+        etwcP->buffer.cmdObj = cmdObj;
     else
-        gETWContext.buffer.listObj = ObjNewList(0, NULL);
-    gETWContext.eventsObj = ObjNewList(0, NULL);
-    ObjIncrRefs(gETWContext.eventsObj);
-    gETWContext.status = TCL_OK;
-    gETWContext.ticP = ticP;
-    gETWContext.pointer_size = sizeof(void*); /* Default unless otherwise indicated */
-
-
-    winerr = ProcessTrace(htraces, ntraces, startP, endP);
-
-    /* Copy and reset context before unlocking */
-    etwc = gETWContext;
-    gETWContext.buffer.cmdObj = NULL;
-    gETWContext.eventsObj = NULL;
-    gETWContext.status = TCL_OK;
-    gETWContext.ticP = NULL;
+        etwcP->buffer.listObj = ObjNewList(0, NULL);
+    etwcP->eventsObj = ObjNewList(0, NULL);
+    ObjIncrRefs(etwcP->eventsObj);
+    etwcP->status = TCL_OK;
+    etwcP->ticP = ticP;
+    etwcP->pointer_size = sizeof(void*); /* Default unless otherwise indicated */
+    etwcP->batchP = lazy ? TwapiEtwBatchNew() : NULL;
+
+    if (! TlsSetValue(gETWContextTlsIndex, etwcP)) {
+        DWORD winerr = GetLastError();
+        ObjDecrRefs(etwcP->eventsObj);
+        if (buffer_cmdlen == 0)
+            ObjDecrRefs(etwcP->buffer.listObj);
+        if (etwcP->batchP)
+            TwapiEtwBatchRelease(etwcP->batchP);
+        return Twapi_AppendSystemError(ticP->interp, winerr);
+    }
+    return TCL_OK;
+}
 
-    LeaveCriticalSection(&gETWCS);
+/* Detaches etwcP from the thread, releases its contents and sets the interp result */
+static TCL_RESULT TwapiETWEndProcessing(struct TwapiETWContext *etwcP, Tcl_Interp *interp, DWORD winerr)
+{
+    TlsSetValue(gETWContextTlsIndex, NULL);
 
-    if (etwc.eventsObj)
-        ObjDecrRefs(etwc.eventsObj);
+    if (etwcP->eventsObj)
+        ObjDecrRefs(etwcP->eventsObj);
+    if (etwcP->batchP)
+        TwapiEtwBatchRelease(etwcP->batchP); /* Events after last buffer */
 
-    if (etwc.status != TCL_OK) {
-        if (etwc.buffer_cmdlen == 0)
-            ObjDecrRefs(etwc.buffer.listObj);
+    if (etwcP->status != TCL_OK) {
+        if (etwcP->buffer_cmdlen == 0)
+            ObjDecrRefs(etwcP->buffer.listObj);
         /* interp should already have the error */
-        return etwc.status;
+        return etwcP->status;
     }
 
     /* A winerr of ERROR_CANCELLED means the callback returned TCL_BREAK
      * to terminate the processing. That is not treated as an error
      */
-    if (winerr && winerr != ERROR_CANCELLED)
+    if (winerr && winerr != ERROR_CANCELLED) {
+        if (etwcP->buffer_cmdlen == 0)
+            ObjDecrRefs(etwcP->buffer.listObj);
         return Twapi_AppendSystemError(interp, winerr);
+    }
 
-    if (etwc.buffer_cmdlen == 0) {
+    if (etwcP->buffer_cmdlen == 0) {
         /* No callback so return collected events */
-        ObjSetResult(interp, etwc.buffer.listObj);
+        ObjSetResult(interp, etwcP->buffer.listObj);
     } else
         Tcl_ResetResult(interp); /* For any holdover from callbacks */
 
     return TCL_OK;
 }
 
-TCL_RESULT Twapi_ParseEventMofData(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+/*
+ * Parses the trace handle list and time range arguments of ProcessTrace.
+ * The handles are returned in memlifo storage. Caller responsible for cleanup.
+ */
+static TCL_RESULT TwapiETWParseTraceArgs(TwapiInterpContext *ticP,
+                                         Tcl_Obj *htracesObj,
+                                         Tcl_Obj *startObj, Tcl_Obj *endObj,
+                                         TRACEHANDLE **htracesP, int *ntracesP,
+                                         FILETIME *startP, FILETIME *endP,
+                                         int *have_startP, int *have_endP)
 {
-    int       i, eaten, remain;
-    Tcl_Obj **types;            /* Field types */
-    int       ntypes;           /* Number of fields/types */
-    BYTE     *bytesP;
-    int       nbytes;
-    Tcl_Obj  *resultObj = NULL;
-    WCHAR     wc;
-    GUID      guid;
-    int       pointer_size;     /* Of target system, NOT us */
-    union {
-        SID sid;                /* For alignment */
-        char buf[SECURITY_MAX_SID_SIZE];
-    } u;
-    short     port;
-
-    /* TBD - objv[1] and other objv[] may be samve and shimmer.
-       Fix by using TwapiGetArgsEx
-    */
-    if (objc != 4)
-        return TwapiReturnError(interp, TWAPI_BAD_ARG_COUNT);
-    
-    bytesP = ObjToByteArray(objv[1], &nbytes);
+    Tcl_Interp *interp = ticP->interp;
+    Tcl_Obj **htraceObjs;
+    int i, ntraces;
 
-    /* The field descriptor is a list of alternating field types and names */
-    if (ObjGetElements(interp, objv[2], &ntypes, &types) != TCL_OK ||
-        ObjToInt(interp, objv[3], &pointer_size) != TCL_OK)
+    if (ObjGetElements(interp, htracesObj, &ntraces, &htraceObjs) != TCL_OK)
         return TCL_ERROR;
-        
-    if (ntypes & 1) {
+    /* ProcessTrace takes at most as many handles as there can be sessions */
+    if (ntraces == 0 || ntraces > MAX_SESSIONS)
         return TwapiReturnErrorEx(interp, TWAPI_INVALID_ARGS,
-                           Tcl_ObjPrintf("Field descriptor argument has odd number of elements (%d).", ntypes));
-    }
+                                  Tcl_ObjPrintf("Number of trace handles must be between 1 and %d.", MAX_SESSIONS));
 
-    if (pointer_size != 4 && pointer_size != 8) {
-        return TwapiReturnErrorEx(interp, TWAPI_INVALID_ARGS,
-                           Tcl_ObjPrintf("Invalid pointer size parameter (%d), must be 4 or 8", pointer_size));
+    *htracesP = MemLifoAlloc(ticP->memlifoP, ntraces * sizeof(TRACEHANDLE), NULL);
+    for (i = 0; i < ntraces; ++i) {
+        if (ObjToTRACEHANDLE(interp, htraceObjs[i], &(*htracesP)[i]) != TCL_OK)
+            return TCL_ERROR;
     }
-    
-    resultObj = Tcl_NewDictObj();
+    *ntracesP = ntraces;
 
-    for (i = 0, remain = nbytes; i < ntypes && remain > 0; i += 2, bytesP += eaten, remain -= eaten) {
-        int typeenum;
-        Tcl_Obj *objP;
+    if (Tcl_GetCharLength(startObj) == 0)
+        *have_startP = 0;
+    else if (ObjToFILETIME(interp, startObj, startP) != TCL_OK)
+            return TCL_ERROR;
+    else
+        *have_startP = 1;
+    
+    if (Tcl_GetCharLength(endObj) == 0)
+        *have_endP = 0;
+    else if (ObjToFILETIME(interp, endObj, endP) != TCL_OK)
+            return TCL_ERROR;
+    else
+        *have_endP = 1;
 
-        /* Index i is field name, i+1 is field type */
+    return TCL_OK;
+}
 
-        if (ObjToInt(interp, types[i+1], &typeenum) != TCL_OK) {
-            goto error_handler;
-        }
+TCL_RESULT Twapi_ProcessTrace(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiInterpContext *ticP = (TwapiInterpContext*) clientdata;
+    FILETIME start, end;
+    int have_start, have_end;
+    int buffer_cmdlen;
+    DWORD winerr;
+    TRACEHANDLE *htraces;
+    int       ntraces;
+    int       lazy = 0;
+    struct TwapiETWContext etwc;
+    MemLifoMarkHandle mark;
+    TCL_RESULT res;
 
-        if (typeenum == 0) {
-            /*
-             * The type is valid but we don't support it and have no idea
-             * how long it is so we cannot loop further.
-             */
-            break;
-        }
+    if (objc != 5 && objc != 6)
+        return TwapiReturnError(interp, TWAPI_BAD_ARG_COUNT);
 
-        /* IMPORTANT: switch values based on _etw_decipher_mof_event_field_type proc */
-        switch (typeenum) {
-        case 1: // string / stringnullterminated
-            /* We cannot rely on event being formatted correctly with a \0
-               do not directly call Tcl_NewStringObj */
-            objP = ObjFromStringLimited((char *)bytesP, remain, &eaten);
-            /* eaten is num remaining. Prime for loop iteration to
-               be num used */
-            eaten = remain - eaten;
-            break;
+    /* Optional sixth argument requests events in batches, see ETWBatch */
+    if (objc == 6) {
+        if (ObjToBoolean(interp, objv[5], &lazy) != TCL_OK)
+            return TCL_ERROR;
+        /* Batches hold EVENT_RECORDs which only TDH can decode */
+        if (lazy && (gTdhStatus <= 0 || gForceMofAPI))
+            return Twapi_AppendSystemError(interp, ERROR_PROC_NOT_FOUND);
+    }
 
-        case 2: // wstring / wstringnullterminated
-            /* Data may not be aligned ! Copy to align if necessary? TBD */
-            /* We cannot rely on event being formatted correctly with a \0
-               do not directly call Tcl_NewStringObj */
-            objP = ObjFromWinCharsLimited((WCHAR *)bytesP, remain/sizeof(WCHAR), &eaten);
-            /* eaten is num WCHARS remaining. Prime for loop iteration to
-               be num used */
-            eaten = remain - (sizeof(WCHAR)*eaten);
-            break;
+    /* Verify callback command prefix is a list. If empty, data
+     * is returned instead.
+     */
+    if (ObjListLength(interp, objv[2], &buffer_cmdlen) != TCL_OK)
+        return TCL_ERROR;
 
-        case 3: // stringcounted
-        case 4: // stringreversecounted
-            if (remain < 2)
-                goto done;      /* Data truncation */
-            eaten = *(unsigned short UNALIGNED *)bytesP;
-            if (typeenum == 4)  /* Need to swap bytes */
-                eaten = ((eaten & 0xff) << 8) | (eaten >> 8);
-            if (remain < (2+eaten)) {
-                /* truncated */
-                eaten = remain-2;
-            }
-            objP = ObjFromStringN((char *)(bytesP+2), eaten);
-            eaten += 2;         /* include the length field */
-            break;
+    mark = MemLifoPushMark(ticP->memlifoP);
+    res = TwapiETWParseTraceArgs(ticP, objv[1], objv[3], objv[4],
+                                 &htraces, &ntraces, &start, &end,
+                                 &have_start, &have_end);
+    if (res == TCL_OK)
+        res = TwapiETWBeginProcessing(&etwc, ticP, objv[2], buffer_cmdlen, htraces[0], lazy);
+    if (res == TCL_OK) {
+        winerr = ProcessTrace(htraces, ntraces,
+                              have_start ? &start : NULL,
+                              have_end ? &end : NULL);
+        res = TwapiETWEndProcessing(&etwc, interp, winerr);
+    }
+    MemLifoPopMark(mark);
+    return res;
+}
 
-        case 5: // wstringcounted
-        case 6: // wstringreversecounted
-            if (remain < 2)
-                goto done;      /* Data truncation */
-            eaten = *(unsigned short UNALIGNED *)bytesP;
-            if (typeenum == 6)  /* Need to swap bytes */
-                eaten = ((eaten & 0xff) << 8) | (eaten >> 8);
-            /* Note eaten is num *characters*, not bytes at this point */
-            /* TBD - there is much confusion as to whether the this
-               is actually true. The latest SDK docs (Windows 7) states
-               this is the case and its code example also treats it
-               this way. On the other hand, older SDK's treat this
-               as number of *bytes* in their sample code as does the
-               well know LogParser utility. On XP there does not seem
-               to be a MoF that actually uses this so maybe it is moot.
-               For now leave as is 
-            */
-
-            if ((remain-2) < (sizeof(WCHAR)*eaten)) {
-                /* truncated */
-                objP = ObjFromWinCharsN((WCHAR *)(bytesP+2), (remain-2)/sizeof(WCHAR));
-                eaten = remain; /* We used up all */
-            } else {
-                objP = ObjFromWinCharsN((WCHAR *)(bytesP+2), eaten);
-                eaten = (sizeof(WCHAR)*eaten) + 2; /* include length field */
-            }
-            break;
+/*
+ * A trace processed asynchronously by ETWSessionStart. ProcessTrace runs
+ * on a session thread of its own, see etwsession.h, so any number of
+ * traces can be processed at the same time without blocking the interp.
+ * The events of each buffer are queued by the session as a batch and
+ * taken off one at a time by callbacks queued to the interp, so other
+ * events are not held up while a backlog is worked through. References
+ * are held by the interp's list of sessions while linked, by the session
+ * thread until its final notification and by each queued callback.
+ */
+struct _TwapiETWSessionSource {
+    TwapiInterpContext *ticP;   /* Referenced until the source is freed */
+    ZLINK_DECL(TwapiETWSessionSource);
+    LONG volatile nrefs;
+    int linked;                 /* On the interp's list of sessions */
+    int ended;                  /* End of processing has been reported */
+    TwapiId id;
+    TwapiEtwSession *sessionP;
+    FILETIME start, end;
+    int have_start, have_end;
+    int ntraces;
+    TRACEHANDLE htraces[1];     /* Actually ntraces in size */
+};
 
-        case 7: // boolean
-            if (remain < sizeof(int))
-                goto done;      /* Data truncation */
-            objP = ObjFromBoolean((*(int UNALIGNED *)bytesP) ? 1 : 0);
-            eaten = sizeof(int);
-            break;
+/*
+ * Copy of the EVENT_TRACE_LOGFILEW passed to the buffer callback, with
+ * the names it points to. Queued by the session with the events of the
+ * buffer.
+ */
+typedef struct _TwapiETWSessionBuffer {
+    EVENT_TRACE_LOGFILEW etl;
+    /* Log file and logger names follow */
+} TwapiETWSessionBuffer;
 
-        case 8: // sint8
-        case 9: // uint8
-            objP = ObjFromInt(typeenum == 8 ? *(signed char *)bytesP : *(unsigned char *)bytesP);
-            eaten = sizeof(char);
-            break;
-            
-        case 10: // csint8
-        case 11: // cuint8
-            /* Return as an ascii char */
-            objP = ObjFromStringN((char *)bytesP, 1);
-            eaten = sizeof(char);
-            break;
+/* Also called by the session for buffers it drops */
+static void TwapiETWSessionBufferFree(void *bufferP)
+{
+    TwapiFree(bufferP);
+}
 
-        case 12: // sint16
-        case 13: // uint16
-            if (remain < sizeof(short))
-                goto done;      /* Data truncation */
-            objP = ObjFromInt(typeenum == 12 ?
-                                 *(signed short UNALIGNED *)bytesP :
-                                 *(unsigned short UNALIGNED *)bytesP);
-            eaten = sizeof(short);
-            break;
+static void TwapiETWSessionSourceUnref(TwapiETWSessionSource *srcP, int decr)
+{
+    if (InterlockedExchangeAdd(&srcP->nrefs, -decr) <= decr) {
+        TWAPI_ASSERT(! srcP->linked);
+        TwapiEtwSessionRelease(srcP->sessionP);
+        TwapiInterpContextUnref(srcP->ticP, 1);
+        TwapiFree(srcP);
+    }
+}
 
-        case 14: // sint32
-            if (remain < sizeof(int))
-                goto done;      /* Data truncation */
-            objP = ObjFromInt(*(signed int UNALIGNED *)bytesP);
-            eaten = sizeof(int);
-            break;
+/* Removes the source from the interp's list. srcP may be GONE on return */
+static void TwapiETWSessionSourceUnlink(TwapiETWSessionSource *srcP)
+{
+    if (srcP->linked) {
+        ZLIST_REMOVE(&ETW_CONTEXT(srcP->ticP)->sessions, srcP);
+        srcP->linked = 0;
+        TwapiETWSessionSourceUnref(srcP, 1);
+    }
+}
 
-        case 15: // uint32
-            if (remain < sizeof(int))
-                goto done;      /* Data truncation */
-            objP = ObjFromDWORD(*(unsigned int UNALIGNED *)bytesP);
-            eaten = sizeof(int);
-            break;
+/* Called from TwapiETWBufferCallback on a session thread */
+static ULONG TwapiETWSessionBufferDone(TwapiEtwSession *sessionP,
+                                       EVENT_TRACE_LOGFILEW *etlP)
+{
+    TwapiETWSessionBuffer *bufP;
+    TRACE_LOGFILE_HEADER *tlhP;
+    int file_len, logger_len;
+    WCHAR *p;
+
+    /* Fields after the name pointers move if the trace came from a
+       different architecture. See ObjFromTRACE_LOGFILE_HEADER */
+    tlhP = &etlP->LogfileHeader;
+    if (tlhP->PointerSize == 4 || tlhP->PointerSize == 8)
+        tlhP = (TRACE_LOGFILE_HEADER *)
+            ((PUCHAR)tlhP + 2 * ((int)tlhP->PointerSize - (int)sizeof(PVOID)));
+    TwapiEtwSessionLost(sessionP, etlP->LogfileHeader.EventsLost,
+                        tlhP->BuffersLost);
+
+    file_len = etlP->LogFileName ? lstrlenW(etlP->LogFileName) + 1 : 0;
+    logger_len = etlP->LoggerName ? lstrlenW(etlP->LoggerName) + 1 : 0;
+    bufP = TwapiAlloc(sizeof(*bufP) + (file_len + logger_len) * sizeof(WCHAR));
+    bufP->etl = *etlP;
+    p = (WCHAR *) (bufP + 1);
+    if (file_len) {
+        CopyMemory(p, etlP->LogFileName, file_len * sizeof(WCHAR));
+        bufP->etl.LogFileName = p;
+        p += file_len;
+    }
+    if (logger_len) {
+        CopyMemory(p, etlP->LoggerName, logger_len * sizeof(WCHAR));
+        bufP->etl.LoggerName = p;
+    }
 
-        case 16: // sint64
-        case 17: // uint64
-            if (remain < sizeof(__int64))
-                goto done;      /* Data truncation */
-            if (typeenum == 17) {
-                objP = ObjFromULONGLONG(*(unsigned __int64 UNALIGNED *)bytesP);
-            } else {
-                objP = ObjFromWideInt(*(__int64 UNALIGNED *)bytesP);
-            }
-            eaten = sizeof(__int64);
-            break;
+    /* The timing fields of the log file header are at the same offset
+       irrespective of pointer size */
+    return TwapiEtwSessionBufferDone(
+        sessionP, etlP->LogfileHeader.TimerResolution,
+        (etlP->LogfileHeader.LogFileMode & EVENT_TRACE_PRIVATE_LOGGER_MODE) != 0,
+        bufP);
+}
 
-        case 18: // xsint16
-        case 19: // xuint16
-            if (remain < sizeof(short))
-                goto done;      /* Data truncation */
-            objP = Tcl_ObjPrintf("0x%x", *(unsigned short UNALIGNED *)bytesP);
-            eaten = sizeof(short);
-            break;
+/* Source for the session thread. See TwapiEtwSessionSourceFn */
+static ULONG TwapiETWSessionProcessTrace(TwapiEtwSession *sessionP, void *pv)
+{
+    TwapiETWSessionSource *srcP = pv;
+    struct TwapiETWContext etwc;
+    ULONG winerr;
+
+    ZeroMemory(&etwc, sizeof(etwc));
+    etwc.status = TCL_OK;
+    etwc.pointer_size = sizeof(void*); /* Default unless otherwise indicated */
+    etwc.sessionP = sessionP;
+    if (! TlsSetValue(gETWContextTlsIndex, &etwc))
+        return GetLastError();
+
+    winerr = ProcessTrace(srcP->htraces, srcP->ntraces,
+                          srcP->have_start ? &srcP->start : NULL,
+                          srcP->have_end ? &srcP->end : NULL);
+    TlsSetValue(gETWContextTlsIndex, NULL);
+
+    /* Events could not be copied into the batch */
+    if (etwc.status != TCL_OK)
+        winerr = ERROR_NOT_ENOUGH_MEMORY;
+    return winerr;
+}
 
-        case 20: // xsint32
-        case 21: // xuint32
-            if (remain < sizeof(int))
-                goto done;      /* Data truncation */
-            objP = ObjFromULONGHex((ULONG) *(int UNALIGNED *)bytesP);
-            eaten = sizeof(int);
-            break;
+/*
+ * Queues a callback to the interp to take the next buffer off the
+ * session's queue. Called on the session thread, see
+ * TwapiEtwSessionNotifyFn, and from the interp thread while buffers
+ * remain.
+ */
+static void TwapiETWSessionNotify(void *pv, int final)
+{
+    TwapiETWSessionSource *srcP = pv;
+    TwapiCallback *cbP;
+
+    cbP = TwapiCallbackNew(srcP->ticP, TwapiETWSessionCallbackFn, sizeof(*cbP));
+    cbP->clientdata = (DWORD_PTR) srcP;
+    TwapiETWSessionSourceRef(srcP, 1); /* Since it is being queued */
+    TwapiEnqueueCallback(srcP->ticP, cbP, TWAPI_ENQUEUE_DIRECT, 0, NULL);
+
+    /* The session thread is done with srcP. Does not free it as the
+       callback just queued holds a reference */
+    if (final)
+        TwapiETWSessionSourceUnref(srcP, 1);
+}
 
-        case 22: //xsint64
-        case 23: //xuint64
-            if (remain < sizeof(__int64))
-                goto done;      /* Data truncation */
-            objP = ObjFromULONGLONGHex(*(unsigned __int64 UNALIGNED *)bytesP);
-            eaten = sizeof(__int64);
-            break;
-            
-        case 24: // real32
-            if (remain < 4)
-                goto done;      /* Data truncation */
-            objP = Tcl_NewDoubleObj((double)(*(float UNALIGNED *)bytesP));
-            eaten = 4;
-            break;
+/*
+ * Called in the interp thread to take the next buffer off the session's
+ * queue. Invokes
+ *   twapi::_etw_session_handler ID buffer BUFDESC BATCH
+ * which returns 0 if processing should stop, or once the session thread
+ * has finished and the queue is empty
+ *   twapi::_etw_session_handler ID end WINERR
+ */
+static int TwapiETWSessionCallbackFn(TwapiCallback *cbP)
+{
+    TwapiETWSessionSource *srcP;
+    TwapiETWSessionBuffer *bufP;
+    TwapiEtwBatch *batchP;
+    void *pv;
+    Tcl_Obj *objs[5];
+    int nobjs, status, tcl_status;
+    ULONG nevents, winerr;
+    ULONGLONG start;
+
+    srcP = (TwapiETWSessionSource *) cbP->clientdata;
+    cbP->clientdata = 0;
+
+    if (srcP->ticP->interp == NULL ||
+        Tcl_InterpDeleted(srcP->ticP->interp)) {
+        /* No one to hand the events to. Once stopped, the session
+           discards the queue on the next call. */
+        TwapiEtwSessionStop(srcP->sessionP);
+        TwapiEtwSessionNext(srcP->sessionP, &batchP, &pv, &winerr);
+        /* Unref to match ref when the callback was queued */
+        TwapiETWSessionSourceUnref(srcP, 1); /* srcP may be GONE! */
+        cbP->winerr = ERROR_INVALID_FUNCTION;
+        cbP->response.type = TRT_EMPTY;
+        return TCL_ERROR;
+    }
 
-        case 25: // real64
-            if (remain < 8)
-                goto done;      /* Data truncation */
-            objP = Tcl_NewDoubleObj((*(double UNALIGNED *)bytesP));
-            eaten = 8;
-            break;
+    status = TwapiEtwSessionNext(srcP->sessionP, &batchP, &pv, &winerr);
+    if (status == 0 || (status < 0 && srcP->ended)) {
+        /* Nothing left. Buffers were dropped or taken by an earlier
+           callback, or the end was already reported. */
+        TwapiETWSessionSourceUnref(srcP, 1);
+        cbP->winerr = ERROR_SUCCESS;
+        cbP->response.type = TRT_EMPTY;
+        return TCL_OK;
+    }
 
-        case 26: // object
-            /* We should never see this except for a bad MoF definition where
-             * the object does not have an associated qualifier. We can
-             * only punt 
-             */
-            goto done;
-
-        case 27: // char16
-            if (remain < sizeof(WCHAR))
-                goto done;      /* Data truncation */
-            wc = *(WCHAR UNALIGNED *) bytesP;
-            objP = ObjFromWinCharsN(&wc, 1);
-            eaten = sizeof(WCHAR);
-            break;
+    nevents = 0;
+    if (status < 0) {
+        /* Session thread has finished so no more callbacks for srcP.
+           Unlinked after the handler so it can still get the stats. */
+        srcP->ended = 1;
+        objs[2] = STRING_LITERAL_OBJ("end");
+        objs[3] = ObjFromULONG(winerr);
+        nobjs = 4;
+    } else {
+        bufP = pv;
+        objs[2] = STRING_LITERAL_OBJ("buffer");
+        objs[3] = ObjFromEVENT_TRACE_LOGFILEW(&bufP->etl);
+        nevents = TwapiEtwBatchCount(batchP);
+        objs[4] = ObjFromETWBatch(batchP); /* Takes over reference */
+        TwapiETWSessionBufferFree(bufP);
+        nobjs = 5;
+    }
+    objs[0] = STRING_LITERAL_OBJ(TWAPI_TCL_NAMESPACE "::_etw_session_handler");
+    objs[1] = ObjFromTwapiId(srcP->id);
+
+    start = TwapiEtwSessionClock();
+    tcl_status = TwapiEvalAndUpdateCallback(cbP, nobjs, objs, TRT_INT);
+    if (nobjs == 5) {
+        TwapiEtwSessionConsumed(srcP->sessionP, nevents,
+                                TwapiEtwSessionClock() - start, 0);
+        if (tcl_status != TCL_OK || cbP->winerr != ERROR_SUCCESS ||
+            cbP->response.value.ival == 0)
+            TwapiEtwSessionStop(srcP->sessionP);
+        /* Come back for the next buffer, or the end, after other events */
+        TwapiETWSessionNotify(srcP, 0);
+    } else
+        TwapiETWSessionSourceUnlink(srcP);
 
-        case 28: // uint8guid
-        case 29: // objectguid
-            if (remain < sizeof(GUID))
-                goto done;      /* Data truncation */
-            CopyMemory(&guid, bytesP, sizeof(GUID)); /* For alignment reasons */
-            objP = ObjFromGUID(&guid);
-            eaten = sizeof(GUID);
-            break;
+    /* Unref to match ref when the callback was queued */
+    TwapiETWSessionSourceUnref(srcP, 1); /* srcP may be GONE! */
+    return tcl_status;
+}
 
-        case 30: // objectipaddr, objectipaddrv4, uint32ipaddr
-            if (remain < sizeof(DWORD))
-                goto done;      /* Data truncation */
-            objP = IPAddrObjFromDWORD(*(DWORD UNALIGNED *)bytesP);
-            eaten = sizeof(DWORD);
-            break;
-            
-        case 31: // objectipaddrv6
-            if (remain < sizeof(IN6_ADDR))
-                goto done;      /* Data truncation */
-            objP = ObjFromIPv6Addr(bytesP, 0);
-            eaten = sizeof(IN6_ADDR);
-            break;
+/*
+ * ETWSessionStart HTRACES START END MAXQUEUE OVERFLOW SAMPLEINTERVAL
+ * Processes the traces, which must have been opened with OpenTrace, on
+ * a session thread. Returns an id identifying the session in calls to
+ * _etw_session_handler. MAXQUEUE is the number of buffers that may be
+ * queued for the interp, 0 if unbounded, and OVERFLOW and SAMPLEINTERVAL
+ * are as for TwapiEtwSessionConfig.
+ */
+static TCL_RESULT Twapi_ETWSessionStartObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiInterpContext *ticP = (TwapiInterpContext*) clientdata;
+    TwapiETWSessionSource *srcP;
+    TwapiEtwSessionConfig config;
+    TRACEHANDLE *htraces;
+    FILETIME start, end;
+    int ntraces, have_start, have_end;
+    MemLifoMarkHandle mark;
+    ULONG winerr;
+    DWORD max_queue_depth, overflow, sample_interval;
+
+    ERROR_IF_UNTHREADED(interp);
+    CHECK_NARGS(interp, objc, 7);
+    if (ObjToDWORD(interp, objv[4], &max_queue_depth) != TCL_OK ||
+        ObjToDWORD(interp, objv[5], &overflow) != TCL_OK ||
+        ObjToDWORD(interp, objv[6], &sample_interval) != TCL_OK)
+        return TCL_ERROR;
+    if (overflow > TWAPI_ETW_OVERFLOW_SAMPLE)
+        return TwapiReturnErrorMsg(interp, TWAPI_INVALID_ARGS,
+                                   "Invalid overflow policy.");
 
-        case 32: // objectvariant
-            eaten = *(ULONG UNALIGNED *)bytesP;
-            if (remain < (eaten + sizeof(ULONG)))
-                goto done;      /* Data truncation */
-            objP = ObjFromByteArray(sizeof(ULONG)+bytesP, eaten);
-            eaten += sizeof(ULONG);
-            break;
+    /* Session threads only handle EVENT_RECORDs which need TDH */
+    if (gTdhStatus <= 0 || gForceMofAPI)
+        return Twapi_AppendSystemError(interp, ERROR_PROC_NOT_FOUND);
 
-        case 33: // objectsid
-            if (remain < sizeof(ULONG))
-                goto done;      /* Data truncation */
-            if (*(ULONG UNALIGNED *)bytesP == 0) {
-                /* Empty SID */
-                eaten = sizeof(ULONG);
-                objP = ObjFromEmptyString();
-                break;
-            }
+    mark = MemLifoPushMark(ticP->memlifoP);
+    if (TwapiETWParseTraceArgs(ticP, objv[1], objv[2], objv[3],
+                               &htraces, &ntraces, &start, &end,
+                               &have_start, &have_end) != TCL_OK) {
+        MemLifoPopMark(mark);
+        return TCL_ERROR;
+    }
+    srcP = TwapiAllocZero(sizeof(*srcP) + (ntraces - 1) * sizeof(TRACEHANDLE));
+    CopyMemory(srcP->htraces, htraces, ntraces * sizeof(TRACEHANDLE));
+    srcP->ntraces = ntraces;
+    MemLifoPopMark(mark);
+    srcP->start = start;
+    srcP->end = end;
+    srcP->have_start = have_start;
+    srcP->have_end = have_end;
+    srcP->id = TWAPI_NEWID(ticP);
+    srcP->ticP = ticP;
+    ZLINK_INIT(srcP);
+
+    ZeroMemory(&config, sizeof(config));
+    config.sourceFn = TwapiETWSessionProcessTrace;
+    config.sourceP = srcP;
+    config.notifyFn = TwapiETWSessionNotify;
+    config.notifyP = srcP;
+    config.discardFn = TwapiETWSessionBufferFree;
+    config.max_queue_depth = max_queue_depth;
+    config.overflow = (TwapiEtwSessionOverflow) overflow;
+    config.sample_interval = sample_interval;
+    /* Schemas are resolved on the session thread with a cache of its own */
+    config.getFn = TdhGetEventInformation;
+    config.schema_cache_size = TWAPI_ETW_SCHEMA_CACHE_SIZE;
 
-            /* From MSDN -
-             * A property with the Sid extension is actually a 
-             * TOKEN_USER structure followed by the SID. The size
-             * of the TOKEN_USER structure differs depending on 
-             * whether the events were generated on a 32-bit or 
-             * 64-bit architecture. Also the structure is aligned
-             * on an 8-byte boundary, so its size is 8 bytes on a
-             * 32-bit computer and 16 bytes on a 64-bit computer.
-             * Doubling the pointer size handles both cases.
-             *
-             * Note that the ULONG * check above is part of this
-             * structure so don't double count that and move bytesP
-             * by another 4 bytes.
-             */
-            eaten = pointer_size * 2; /* Skip TOKEN_USER */
-            remain -= eaten;
-            bytesP += eaten;
-            if (remain < sizeof(SID))
-                goto done;      /* Truncation. Note sizeof(sid) is MIN size */
-            MoveMemory(u.buf, bytesP,
-                       remain > sizeof(u.buf) ? sizeof(u.buf) : remain);
-            /* Sanity check before passing to SID converter */
-            if (u.sid.Revision != SID_REVISION ||
-                u.sid.SubAuthorityCount > SID_MAX_SUB_AUTHORITIES)
-                goto done;
-
-            eaten = TWAPI_SID_LENGTH(&u.sid);
-            if (eaten > sizeof(u.buf) || eaten > remain)
-                goto done;      /* Bad SID length */
-
-            objP = ObjFromSIDNoFail(&u.sid);
-
-            /* We have adjusted remain and bytesP for TOKEN_USER. eaten
-             * contains actual SID length only without TOKEN_USER. SO
-             * we are all set up for top of loop. Note as an aside
-             * that not all bytes that were copied to u.buf[]
-             * were necessarily used up
-             */
-            break;
+    /*
+     * Link BEFORE starting the thread. One ref for the list and one for
+     * the thread. Note the list is only accessed from this interp thread.
+     */
+    srcP->nrefs = 2;
+    srcP->linked = 1;
+    ZLIST_PREPEND(&ETW_CONTEXT(ticP)->sessions, srcP);
+    TwapiInterpContextRef(ticP, 1);
 
-        case 34: // uint64wmitime - TBD
-        case 35: // objectwmitime - TBD
-            if (remain < sizeof(ULONGLONG))
-                goto done;      /* Data truncation */
-            objP = ObjFromULONGLONG(*(ULONGLONG UNALIGNED *)bytesP);
-            eaten = sizeof(ULONGLONG);
-            break;
+    winerr = TwapiEtwSessionStart(&config, &srcP->sessionP);
+    if (winerr != ERROR_SUCCESS) {
+        /* Thread not started, undo everything */
+        ZLIST_REMOVE(&ETW_CONTEXT(ticP)->sessions, srcP);
+        TwapiInterpContextUnref(ticP, 1);
+        TwapiFree(srcP);
+        return Twapi_AppendSystemError(interp, winerr);
+    }
 
-        case 38: // uint16port
-        case 39: // objectport
-            if (remain < sizeof(short))
-                goto done;      /* Data truncation */
-            port = *(short UNALIGNED *)bytesP;
-            objP = ObjFromInt((WORD)port);
-            eaten = sizeof(short);
-            break;
+    return ObjSetResult(interp, ObjFromTwapiId(srcP->id));
+}
 
-        case 40: // datetime - TBD
-            goto done;          /* TBD */
-            break;
-            
-        case 41: // stringnotcounted
-            objP = ObjFromStringN((char *) bytesP, remain);
-            eaten = remain;
-            break;
+/*
+ * ETWSessionStop ID
+ * Stops the session at the end of the buffer being processed. Buffers
+ * already queued to the interp are discarded. Real time traces must also
+ * be closed with CloseTrace if no more buffers might arrive.
+ */
+static TCL_RESULT Twapi_ETWSessionStopObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiInterpContext *ticP = (TwapiInterpContext*) clientdata;
+    TwapiETWSessionSource *srcP;
+    TwapiId id;
 
-        case 42: // wstringnotcounted
-            objP = ObjFromWinCharsN((WCHAR *)bytesP, remain/sizeof(WCHAR));
-            eaten = remain;
-            break;
+    CHECK_NARGS(interp, objc, 2);
+    if (ObjToTwapiId(interp, objv[1], &id) != TCL_OK)
+        return TCL_ERROR;
+    ZLIST_LOCATE(srcP, &ETW_CONTEXT(ticP)->sessions, id, id);
+    if (srcP == NULL)
+        return TwapiReturnErrorMsg(interp, TWAPI_INVALID_ARGS,
+                                   "No ETW session with the specified id or processing has finished");
+    TwapiEtwSessionStop(srcP->sessionP);
+    return TCL_OK;
+}
 
-        case 43: // pointer
-            if (pointer_size == 8)
-                objP = ObjFromULONGLONGHex(*(ULONGLONG UNALIGNED *)bytesP);
-            else
-                objP = ObjFromULONGHex(*(ULONG UNALIGNED *)bytesP);
-            eaten = pointer_size;
-            break;
+/*
+ * ETWSessionStats ID
+ * Returns the counters for a session as a dictionary. Times are in
+ * microseconds.
+ */
+static TCL_RESULT Twapi_ETWSessionStatsObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiInterpContext *ticP = (TwapiInterpContext*) clientdata;
+    TwapiETWSessionSource *srcP;
+    TwapiEtwSessionStats stats;
+    TwapiId id;
+    Tcl_Obj *objs[28];
 
-        default:
-            ObjSetResult(interp, Tcl_ObjPrintf("Internal error: unknown mof typeenum %d", typeenum));
-            goto error_handler;
+    CHECK_NARGS(interp, objc, 2);
+    if (ObjToTwapiId(interp, objv[1], &id) != TCL_OK)
+        return TCL_ERROR;
+    ZLIST_LOCATE(srcP, &ETW_CONTEXT(ticP)->sessions, id, id);
+    if (srcP == NULL)
+        return TwapiReturnErrorMsg(interp, TWAPI_INVALID_ARGS,
+                                   "No ETW session with the specified id or processing has finished");
+    TwapiEtwSessionGetStats(srcP->sessionP, &stats);
+    objs[0] = STRING_LITERAL_OBJ("events");
+    objs[1] = ObjFromWideInt(stats.events);
+    objs[2] = STRING_LITERAL_OBJ("buffers");
+    objs[3] = ObjFromWideInt(stats.buffers);
+    objs[4] = STRING_LITERAL_OBJ("bytes");
+    objs[5] = ObjFromWideInt(stats.bytes);
+    objs[6] = STRING_LITERAL_OBJ("tdhcalls");
+    objs[7] = ObjFromWideInt(stats.tdh_calls);
+    objs[8] = STRING_LITERAL_OBJ("decodetime");
+    objs[9] = ObjFromWideInt(stats.decode_time);
+    objs[10] = STRING_LITERAL_OBJ("callbacktime");
+    objs[11] = ObjFromWideInt(stats.callback_time);
+    objs[12] = STRING_LITERAL_OBJ("queuedepth");
+    objs[13] = ObjFromULONG(stats.queue_depth);
+    objs[14] = STRING_LITERAL_OBJ("maxqueuedepth");
+    objs[15] = ObjFromULONG(stats.max_queue_depth);
+    objs[16] = STRING_LITERAL_OBJ("droppedevents");
+    objs[17] = ObjFromWideInt(stats.dropped_events);
+    objs[18] = STRING_LITERAL_OBJ("droppedbuffers");
+    objs[19] = ObjFromWideInt(stats.dropped_buffers);
+    objs[20] = STRING_LITERAL_OBJ("eventslost");
+    objs[21] = ObjFromULONG(stats.events_lost);
+    objs[22] = STRING_LITERAL_OBJ("bufferslost");
+    objs[23] = ObjFromULONG(stats.buffers_lost);
+    objs[24] = STRING_LITERAL_OBJ("blockedtime");
+    objs[25] = ObjFromWideInt(stats.blocked_time);
+    objs[26] = STRING_LITERAL_OBJ("stopping");
+    objs[27] = ObjFromBoolean(TwapiEtwSessionStopping(srcP->sessionP));
+    return ObjSetResult(interp, ObjNewList(ARRAYSIZE(objs), objs));
+}
+
+/*
+ * Compiled MOF field descriptor as a Tcl_ObjType. The descriptor for an
+ * event class comes from the _etw_event_defs cache in etw.tcl so the same
+ * Tcl_Obj is passed for every event of that class and is only compiled
+ * the first time. The string rep is always retained.
+ */
+typedef struct _TwapiMofDecoder {
+    int nrefs;
+    TwapiMofProgram *progP;
+    TwapiMofField *fieldsP;     /* Scratch, progP->nops entries */
+    Tcl_Obj *names[1];          /* Field names, progP->nops entries */
+} TwapiMofDecoder;
+
+static void DupMofDecoderType(Tcl_Obj *srcP, Tcl_Obj *dstP);
+static void FreeMofDecoderType(Tcl_Obj *objP);
+static void UpdateMofDecoderTypeString(Tcl_Obj *objP);
+static struct Tcl_ObjType gMofDecoderType = {
+    "TwapiMofDecoder",
+    FreeMofDecoderType,
+    DupMofDecoderType,
+    UpdateMofDecoderTypeString, /* Will panic. String rep is never freed */
+    NULL,     /* jenglish says keep this NULL */
+};
+
+static void TwapiMofDecoderDecrRefs(TwapiMofDecoder *decP)
+{
+    int i;
+    if (--decP->nrefs > 0)
+        return;
+    for (i = 0; i < decP->progP->nops; ++i)
+        ObjDecrRefs(decP->names[i]);
+    if (decP->fieldsP)
+        TwapiFree(decP->fieldsP);
+    TwapiMofProgramFree(decP->progP);
+    TwapiFree(decP);
+}
+
+static void DupMofDecoderType(Tcl_Obj *srcP, Tcl_Obj *dstP)
+{
+    TwapiMofDecoder *decP = srcP->internalRep.twoPtrValue.ptr1;
+    decP->nrefs += 1;
+    dstP->internalRep.twoPtrValue.ptr1 = decP;
+    dstP->internalRep.twoPtrValue.ptr2 = NULL;
+    dstP->typePtr = &gMofDecoderType;
+}
+
+static void FreeMofDecoderType(Tcl_Obj *objP)
+{
+    TwapiMofDecoderDecrRefs(objP->internalRep.twoPtrValue.ptr1);
+    objP->internalRep.twoPtrValue.ptr1 = NULL;
+    objP->typePtr = NULL;
+}
+
+static void UpdateMofDecoderTypeString(Tcl_Obj *objP)
+{
+    Tcl_Panic("UpdateMofDecoderTypeString called.");
+}
+
+/*
+ * Returns the decoder for a field descriptor, a list of alternating field
+ * names and types, compiling it if necessary. The returned decoder is
+ * only valid as long as objP is not shimmered.
+ */
+static TwapiMofDecoder *ObjToMofDecoder(Tcl_Interp *interp, Tcl_Obj *objP)
+{
+    Tcl_Obj **objs;
+    int i, nobjs, bad;
+    int *typesP;
+    TwapiMofProgram *progP;
+    TwapiMofDecoder *decP;
+    ULONG winerr;
+
+    if (objP->typePtr == &gMofDecoderType)
+        return objP->internalRep.twoPtrValue.ptr1;
+
+    /* String rep must exist before conversion as we cannot generate it */
+    ObjToString(objP);
+
+    if (ObjGetElements(interp, objP, &nobjs, &objs) != TCL_OK)
+        return NULL;
+    if (nobjs & 1) {
+        TwapiReturnErrorEx(interp, TWAPI_INVALID_ARGS,
+                           Tcl_ObjPrintf("Field descriptor argument has odd number of elements (%d).", nobjs));
+        return NULL;
+    }
+
+    typesP = TwapiAlloc(((nobjs / 2) + 1) * sizeof(int));
+    for (i = 0; i < nobjs; i += 2) {
+        if (ObjToInt(interp, objs[i+1], &typesP[i/2]) != TCL_OK) {
+            TwapiFree(typesP);
+            return NULL;
         }
+    }
+    winerr = TwapiMofCompile(nobjs / 2, typesP, &progP, &bad);
+    if (winerr != ERROR_SUCCESS) {
+        if (winerr == ERROR_INVALID_PARAMETER)
+            ObjSetResult(interp, Tcl_ObjPrintf("Internal error: unknown mof typeenum %d", typesP[bad]));
+        else
+            Twapi_AppendSystemError(interp, winerr);
+        TwapiFree(typesP);
+        return NULL;
+    }
+    TwapiFree(typesP);
+
+    decP = TwapiAlloc(sizeof(*decP) + progP->nops * sizeof(decP->names[0]));
+    decP->nrefs = 1;
+    decP->progP = progP;
+    decP->fieldsP = progP->nops ? TwapiAlloc(progP->nops * sizeof(TwapiMofField)) : NULL;
+    for (i = 0; i < progP->nops; ++i) {
+        decP->names[i] = objs[2*i];
+        ObjIncrRefs(decP->names[i]);
+    }
+
+    if (objP->typePtr && objP->typePtr->freeIntRepProc)
+        objP->typePtr->freeIntRepProc(objP);
+    objP->internalRep.twoPtrValue.ptr1 = decP;
+    objP->internalRep.twoPtrValue.ptr2 = NULL;
+    objP->typePtr = &gMofDecoderType;
+    return decP;
+}
+
+/* Converts a field located by TwapiMofDecode to a Tcl_Obj */
+static Tcl_Obj *ObjFromMofField(const BYTE *bytesP, const TwapiMofField *fieldP)
+{
+    const BYTE *p = bytesP + fieldP->offset;
+    WCHAR     wc;
+    GUID      guid;
+    union {
+        SID sid;                /* For alignment */
+        char buf[SECURITY_MAX_SID_SIZE];
+    } u;
+
+    switch (fieldP->opcode) {
+    case TWAPI_MOF_OP_STRING:
+    case TWAPI_MOF_OP_STRING_COUNTED:
+    case TWAPI_MOF_OP_STRING_RCOUNTED:
+    case TWAPI_MOF_OP_STRING_REST:
+        return ObjFromStringN((char *)p, fieldP->len);
+    case TWAPI_MOF_OP_WSTRING:
+    case TWAPI_MOF_OP_WSTRING_COUNTED:
+    case TWAPI_MOF_OP_WSTRING_RCOUNTED:
+    case TWAPI_MOF_OP_WSTRING_REST:
+        /* Data may not be aligned ! Copy to align if necessary? TBD */
+        return ObjFromWinCharsN((WCHAR *)p, fieldP->len / sizeof(WCHAR));
+    case TWAPI_MOF_OP_BOOLEAN:
+        return ObjFromBoolean((*(int UNALIGNED *)p) ? 1 : 0);
+    case TWAPI_MOF_OP_INT8:
+        return ObjFromInt(*(signed char *)p);
+    case TWAPI_MOF_OP_UINT8:
+        return ObjFromInt(*(unsigned char *)p);
+    case TWAPI_MOF_OP_CHAR8:
+        /* Return as an ascii char */
+        return ObjFromStringN((char *)p, 1);
+    case TWAPI_MOF_OP_INT16:
+        return ObjFromInt(*(signed short UNALIGNED *)p);
+    case TWAPI_MOF_OP_UINT16:
+        return ObjFromInt(*(unsigned short UNALIGNED *)p);
+    case TWAPI_MOF_OP_INT32:
+        return ObjFromInt(*(signed int UNALIGNED *)p);
+    case TWAPI_MOF_OP_UINT32:
+        return ObjFromDWORD(*(unsigned int UNALIGNED *)p);
+    case TWAPI_MOF_OP_INT64:
+        return ObjFromWideInt(*(__int64 UNALIGNED *)p);
+    case TWAPI_MOF_OP_UINT64:
+        return ObjFromULONGLONG(*(unsigned __int64 UNALIGNED *)p);
+    case TWAPI_MOF_OP_HEX16:
+        return Tcl_ObjPrintf("0x%x", *(unsigned short UNALIGNED *)p);
+    case TWAPI_MOF_OP_HEX32:
+        return ObjFromULONGHex((ULONG) *(int UNALIGNED *)p);
+    case TWAPI_MOF_OP_HEX64:
+        return ObjFromULONGLONGHex(*(unsigned __int64 UNALIGNED *)p);
+    case TWAPI_MOF_OP_REAL32:
+        return Tcl_NewDoubleObj((double)(*(float UNALIGNED *)p));
+    case TWAPI_MOF_OP_REAL64:
+        return Tcl_NewDoubleObj((*(double UNALIGNED *)p));
+    case TWAPI_MOF_OP_CHAR16:
+        wc = *(WCHAR UNALIGNED *) p;
+        return ObjFromWinCharsN(&wc, 1);
+    case TWAPI_MOF_OP_GUID:
+        CopyMemory(&guid, p, sizeof(GUID)); /* For alignment reasons */
+        return ObjFromGUID(&guid);
+    case TWAPI_MOF_OP_IPADDR:
+        return IPAddrObjFromDWORD(*(DWORD UNALIGNED *)p);
+    case TWAPI_MOF_OP_IPADDR6:
+        return ObjFromIPv6Addr(p, 0);
+    case TWAPI_MOF_OP_VARIANT:
+        return ObjFromByteArray(p, fieldP->len);
+    case TWAPI_MOF_OP_SID:
+        if (fieldP->len == 0)
+            return ObjFromEmptyString(); /* Empty SID */
+        /* Length already checked against SECURITY_MAX_SID_SIZE */
+        CopyMemory(u.buf, p, fieldP->len);
+        return ObjFromSIDNoFail(&u.sid);
+    case TWAPI_MOF_OP_PORT:
+        return ObjFromInt(*(WORD UNALIGNED *)p);
+    case TWAPI_MOF_OP_POINTER:
+        if (fieldP->len == 8)
+            return ObjFromULONGLONGHex(*(ULONGLONG UNALIGNED *)p);
+        else
+            return ObjFromULONGHex(*(ULONG UNALIGNED *)p);
+    default:
+        return NULL;
+    }
+}
+
+TCL_RESULT Twapi_ParseEventMofData(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    int       i, nfields;
+    BYTE     *bytesP;
+    int       nbytes;
+    Tcl_Obj  *resultObj;
+    Tcl_Obj  *objP;
+    int       pointer_size;     /* Of target system, NOT us */
+    TwapiMofDecoder *decP;
 
+    if (objc != 4)
+        return TwapiReturnError(interp, TWAPI_BAD_ARG_COUNT);
+    
+    if (ObjToInt(interp, objv[3], &pointer_size) != TCL_OK)
+        return TCL_ERROR;
+    if (pointer_size != 4 && pointer_size != 8) {
+        return TwapiReturnErrorEx(interp, TWAPI_INVALID_ARGS,
+                           Tcl_ObjPrintf("Invalid pointer size parameter (%d), must be 4 or 8", pointer_size));
+    }
+
+    /* The field descriptor is a list of alternating field names and types */
+    decP = ObjToMofDecoder(interp, objv[2]);
+    if (decP == NULL)
+        return TCL_ERROR;
+    /*
+     * Hold on to the decoder in case objv[1] is the same Tcl_Obj as
+     * objv[2] and converting it to a byte array frees the decoder.
+     */
+    decP->nrefs += 1;
+    bytesP = ObjToByteArray(objv[1], &nbytes);
+
+    nfields = TwapiMofDecode(decP->progP, bytesP, nbytes, pointer_size,
+                             decP->fieldsP);
+    resultObj = Tcl_NewDictObj();
+    for (i = 0; i < nfields; ++i) {
+        objP = ObjFromMofField(bytesP, &decP->fieldsP[i]);
         /* Some calls may result in objP being NULL */
         if (objP == NULL)
             objP = ObjFromEmptyString();
-        Tcl_DictObjPut(interp, resultObj, types[i], objP);
+        Tcl_DictObjPut(NULL, resultObj, decP->names[i], objP);
     }
-    
-    done:
+    TwapiMofDecoderDecrRefs(decP);
+
     ObjSetResult(interp, resultObj);
     return TCL_OK;
-
-error_handler:
-    /* Tcl interp should already hold error code and result */
-
-    if (resultObj)
-        ObjDecrRefs(resultObj);
-    return TCL_ERROR;
 }
 
 
@@ -2835,6 +3089,967 @@ static int Twapi_ETWCallObjCmd(ClientData clientdata, Tcl_Interp *interp, int ob
 }
 
 
+static TCL_RESULT Twapi_ETWSchemaCacheStatsObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiInterpContext *ticP = (TwapiInterpContext*) clientdata;
+    TwapiTdhCacheStats stats;
+    Tcl_Obj *objs[16];
+
+    CHECK_NARGS(interp, objc, 1);
+    TwapiTdhCacheGetStats(ETW_CONTEXT(ticP)->schema_cacheP, &stats);
+    objs[0] = STRING_LITERAL_OBJ("hits");
+    objs[1] = ObjFromWideInt(stats.hits);
+    objs[2] = STRING_LITERAL_OBJ("misses");
+    objs[3] = ObjFromWideInt(stats.misses);
+    objs[4] = STRING_LITERAL_OBJ("evictions");
+    objs[5] = ObjFromWideInt(stats.evictions);
+    objs[6] = STRING_LITERAL_OBJ("uncached");
+    objs[7] = ObjFromWideInt(stats.uncached);
+    objs[8] = STRING_LITERAL_OBJ("tdhcalls");
+    objs[9] = ObjFromWideInt(stats.tdh_calls);
+    objs[10] = STRING_LITERAL_OBJ("entries");
+    objs[11] = ObjFromWideInt(stats.nentries);
+    objs[12] = STRING_LITERAL_OBJ("maxentries");
+    objs[13] = ObjFromWideInt(stats.maxentries);
+    objs[14] = STRING_LITERAL_OBJ("bytes");
+    objs[15] = ObjFromWideInt(stats.nbytes);
+    return ObjSetResult(interp, ObjNewList(ARRAYSIZE(objs), objs));
+}
+
+/* Replaces the cache, discarding its contents and counters */
+static TCL_RESULT Twapi_ETWSchemaCacheConfigureObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiInterpContext *ticP = (TwapiInterpContext*) clientdata;
+    TwapiTdhCache *cacheP;
+    int maxentries;
+
+    if (TwapiGetArgs(interp, objc-1, objv+1,
+                     GETINT(maxentries), ARGEND) != TCL_OK)
+        return TCL_ERROR;
+    if (maxentries < 0)
+        return TwapiReturnErrorMsg(interp, TWAPI_INVALID_ARGS,
+                                   "Cache size must not be negative");
+
+    /* TwapiAlloc panics rather than fail so cacheP is never NULL */
+    cacheP = TwapiTdhCacheNew(maxentries, TdhGetEventInformation,
+                              TwapiETWSchemaObjsFree);
+    TwapiTdhCacheFree(ETW_CONTEXT(ticP)->schema_cacheP);
+    ETW_CONTEXT(ticP)->schema_cacheP = cacheP;
+    return TCL_OK;
+}
+
+static TCL_RESULT Twapi_ETWSchemaCacheClearObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiInterpContext *ticP = (TwapiInterpContext*) clientdata;
+    CHECK_NARGS(interp, objc, 1);
+    TwapiTdhCacheClear(ETW_CONTEXT(ticP)->schema_cacheP);
+    return TCL_OK;
+}
+
+/*
+ * Offline reading of .etl files without OpenTrace/ProcessTrace. Events
+ * are passed to the same callbacks as ProcessTrace and are therefore
+ * returned in the same form.
+ */
+typedef struct _TwapiEtlReader {
+    HANDLE hfile;
+    TwapiEtlFile *etlP;
+    WCHAR path[1];              /* Actually as long as needed */
+} TwapiEtlReader;
+
+static ULONG TwapiEtlReaderRead(void *ctxP, ULONGLONG offset, void *bufP, ULONG len)
+{
+    TwapiEtlReader *readerP = ctxP;
+    OVERLAPPED ov;
+    DWORD nread;
+
+    ZeroMemory(&ov, sizeof(ov));
+    ov.Offset = (DWORD) offset;
+    ov.OffsetHigh = (DWORD) (offset >> 32);
+    if (! ReadFile(readerP->hfile, bufP, len, &nread, &ov))
+        return GetLastError();
+    return nread == len ? ERROR_SUCCESS : ERROR_HANDLE_EOF;
+}
+
+static void TwapiEtlReaderFree(TwapiEtlReader *readerP)
+{
+    if (readerP->etlP)
+        TwapiEtlClose(readerP->etlP);
+    if (readerP->hfile != INVALID_HANDLE_VALUE)
+        CloseHandle(readerP->hfile);
+    TwapiFree(readerP);
+}
+
+/* EtlOpen PATH ?RAWTIMESTAMPS? */
+static TCL_RESULT Twapi_EtlOpenObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiEtlReader *readerP;
+    WCHAR *path;
+    int pathlen;
+    int raw = 0;
+    LARGE_INTEGER size;
+    ULONG winerr;
+
+    if (TwapiGetArgs(interp, objc-1, objv+1,
+                     GETWSTRN(path, pathlen), ARGUSEDEFAULT, GETBOOL(raw),
+                     ARGEND) != TCL_OK)
+        return TCL_ERROR;
+
+    readerP = TwapiAlloc(sizeof(*readerP) + pathlen * sizeof(WCHAR));
+    readerP->etlP = NULL;
+    CopyMemory(readerP->path, path, (pathlen+1) * sizeof(WCHAR));
+
+    /* Permit reading a file that is still being logged to */
+    readerP->hfile = CreateFileW(path, GENERIC_READ,
+                                 FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                 NULL, OPEN_EXISTING,
+                                 FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (readerP->hfile == INVALID_HANDLE_VALUE
+        || ! GetFileSizeEx(readerP->hfile, &size)) {
+        winerr = GetLastError();
+        TwapiEtlReaderFree(readerP);
+        return Twapi_AppendSystemError(interp, winerr);
+    }
+
+    winerr = TwapiEtlOpen(TwapiEtlReaderRead, readerP, size.QuadPart,
+                          raw ? TWAPI_ETL_RAW_TIMESTAMP : 0, &readerP->etlP);
+    if (winerr != ERROR_SUCCESS) {
+        TwapiEtlReaderFree(readerP);
+        return Twapi_AppendSystemError(interp, winerr);
+    }
+
+    if (TwapiRegisterPointer(interp, readerP, TwapiEtlReaderFree) != TCL_OK) {
+        TwapiEtlReaderFree(readerP);
+        return TCL_ERROR;
+    }
+    return ObjSetResult(interp, ObjFromOpaque(readerP, "TwapiEtlReader"));
+}
+
+static TCL_RESULT Twapi_EtlCloseObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiEtlReader *readerP;
+
+    if (TwapiGetArgs(interp, objc-1, objv+1,
+                     GETVERIFIEDPTR(readerP, TwapiEtlReader, TwapiEtlReaderFree),
+                     ARGEND) != TCL_OK
+        || TwapiUnregisterPointer(interp, readerP, TwapiEtlReaderFree) != TCL_OK)
+        return TCL_ERROR;
+    TwapiEtlReaderFree(readerP);
+    return TCL_OK;
+}
+
+/* EtlSeek READER BUFFERINDEX */
+static TCL_RESULT Twapi_EtlSeekObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiEtlReader *readerP;
+    int index;
+
+    if (TwapiGetArgs(interp, objc-1, objv+1,
+                     GETVERIFIEDPTR(readerP, TwapiEtlReader, TwapiEtlReaderFree),
+                     GETINT(index), ARGEND) != TCL_OK)
+        return TCL_ERROR;
+
+    if (index < 0 || (ULONG) index > TwapiEtlBufferCount(readerP->etlP))
+        return TwapiReturnErrorMsg(interp, TWAPI_INVALID_ARGS,
+                                   "Buffer index out of range");
+    TwapiEtlSeekBuffer(readerP->etlP, index);
+    return TCL_OK;
+}
+
+static TCL_RESULT Twapi_EtlInfoObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiEtlReader *readerP;
+    const TwapiEtlHeader *hdrP;
+    TwapiEtlStats stats;
+    Tcl_Obj *objs[50];
+    int n;
+
+    if (TwapiGetArgs(interp, objc-1, objv+1,
+                     GETVERIFIEDPTR(readerP, TwapiEtlReader, TwapiEtlReaderFree),
+                     ARGEND) != TCL_OK)
+        return TCL_ERROR;
+
+    hdrP = TwapiEtlGetHeader(readerP->etlP);
+    TwapiEtlGetStats(readerP->etlP, &stats);
+
+    n = 0;
+    objs[n++] = STRING_LITERAL_OBJ("logfile");
+    objs[n++] = ObjFromWinChars(readerP->path);
+    objs[n++] = STRING_LITERAL_OBJ("loggername");
+    objs[n++] = ObjFromWinChars((WCHAR *) hdrP->logger_nameP);
+    objs[n++] = STRING_LITERAL_OBJ("buffersize");
+    objs[n++] = ObjFromULONG(hdrP->buffer_size);
+    objs[n++] = STRING_LITERAL_OBJ("buffercount");
+    objs[n++] = ObjFromULONG(TwapiEtlBufferCount(readerP->etlP));
+    objs[n++] = STRING_LITERAL_OBJ("version");
+    objs[n++] = ObjFromULONG(hdrP->version);
+    objs[n++] = STRING_LITERAL_OBJ("providerversion");
+    objs[n++] = ObjFromULONG(hdrP->provider_version);
+    objs[n++] = STRING_LITERAL_OBJ("processorcount");
+    objs[n++] = ObjFromULONG(hdrP->nprocessors);
+    objs[n++] = STRING_LITERAL_OBJ("timerresolution");
+    objs[n++] = ObjFromULONG(hdrP->timer_resolution);
+    objs[n++] = STRING_LITERAL_OBJ("maxfilesize");
+    objs[n++] = ObjFromULONG(hdrP->max_file_size);
+    objs[n++] = STRING_LITERAL_OBJ("logfilemode");
+    objs[n++] = ObjFromULONG(hdrP->log_file_mode);
+    objs[n++] = STRING_LITERAL_OBJ("bufferswritten");
+    objs[n++] = ObjFromULONG(hdrP->buffers_written);
+    objs[n++] = STRING_LITERAL_OBJ("pointersize");
+    objs[n++] = ObjFromULONG(hdrP->pointer_size);
+    objs[n++] = STRING_LITERAL_OBJ("eventslost");
+    objs[n++] = ObjFromULONG(hdrP->events_lost);
+    objs[n++] = STRING_LITERAL_OBJ("bufferslost");
+    objs[n++] = ObjFromULONG(hdrP->buffers_lost);
+    objs[n++] = STRING_LITERAL_OBJ("cpumhz");
+    objs[n++] = ObjFromULONG(hdrP->cpu_speed);
+    objs[n++] = STRING_LITERAL_OBJ("clocktype");
+    objs[n++] = ObjFromULONG(hdrP->clock_type);
+    objs[n++] = STRING_LITERAL_OBJ("perffreq");
+    objs[n++] = ObjFromWideInt(hdrP->perf_freq);
+    objs[n++] = STRING_LITERAL_OBJ("boottime");
+    objs[n++] = ObjFromWideInt(hdrP->boot_time);
+    objs[n++] = STRING_LITERAL_OBJ("starttime");
+    objs[n++] = ObjFromWideInt(hdrP->start_time);
+    objs[n++] = STRING_LITERAL_OBJ("endtime");
+    objs[n++] = ObjFromWideInt(hdrP->end_time);
+    objs[n++] = STRING_LITERAL_OBJ("eventsread");
+    objs[n++] = ObjFromULONGLONG(stats.events);
+    objs[n++] = STRING_LITERAL_OBJ("buffersread");
+    objs[n++] = ObjFromULONGLONG(stats.buffers);
+    objs[n++] = STRING_LITERAL_OBJ("skippedrecords");
+    objs[n++] = ObjFromULONGLONG(stats.skipped_records);
+    objs[n++] = STRING_LITERAL_OBJ("skippedbuffers");
+    objs[n++] = ObjFromULONGLONG(stats.skipped_buffers);
+    objs[n++] = STRING_LITERAL_OBJ("badrecords");
+    objs[n++] = ObjFromULONGLONG(stats.bad_records);
+    TWAPI_ASSERT(n <= ARRAYSIZE(objs));
+    return ObjSetResult(interp, ObjNewList(n, objs));
+}
+
+/*
+ * EtlProcess READER CALLBACK START END MAXBUFFERS ?LAZY?
+ * Same as ProcessTrace except that at most MAXBUFFERS buffers (all if
+ * MAXBUFFERS is 0 or negative) are read from the current position.
+ */
+static TCL_RESULT Twapi_EtlProcessObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiInterpContext *ticP = (TwapiInterpContext*) clientdata;
+    TwapiEtlReader *readerP;
+    const TwapiEtlHeader *hdrP;
+    const TwapiEtlBufferInfo *infoP;
+    EVENT_RECORD *evrP;
+    EVENT_TRACE_LOGFILEW etl;
+    Tcl_Obj *cmdObj, *startObj, *endObj;
+    LONGLONG start, end;
+    FILETIME ft;
+    int buffer_cmdlen, maxbuffers, nbuffers, lazy = 0;
+    ULONG winerr;
+    struct TwapiETWContext etwc;
+
+    if (TwapiGetArgs(interp, objc-1, objv+1,
+                     GETVERIFIEDPTR(readerP, TwapiEtlReader, TwapiEtlReaderFree),
+                     GETOBJ(cmdObj), GETOBJ(startObj), GETOBJ(endObj),
+                     GETINT(maxbuffers), ARGUSEDEFAULT, GETBOOL(lazy),
+                     ARGEND) != TCL_OK)
+        return TCL_ERROR;
+
+    /* The events are decoded with TDH only */
+    if (gTdhStatus <= 0 || gForceMofAPI)
+        return Twapi_AppendSystemError(interp, ERROR_PROC_NOT_FOUND);
+
+    if (ObjListLength(interp, cmdObj, &buffer_cmdlen) != TCL_OK)
+        return TCL_ERROR;
+
+    if (Tcl_GetCharLength(startObj) == 0)
+        start = 0;
+    else if (ObjToFILETIME(interp, startObj, &ft) != TCL_OK)
+        return TCL_ERROR;
+    else
+        start = ((LONGLONG) ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+
+    if (Tcl_GetCharLength(endObj) == 0)
+        end = MAXLONGLONG;
+    else if (ObjToFILETIME(interp, endObj, &ft) != TCL_OK)
+        return TCL_ERROR;
+    else
+        end = ((LONGLONG) ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+
+    if (TwapiETWBeginProcessing(&etwc, ticP, cmdObj, buffer_cmdlen, 0, lazy) != TCL_OK)
+        return TCL_ERROR;
+
+    hdrP = TwapiEtlGetHeader(readerP->etlP);
+    ZeroMemory(&etl, sizeof(etl));
+    etl.LogFileName = readerP->path;
+    etl.LoggerName = (WCHAR *) hdrP->logger_nameP;
+    etl.BufferSize = hdrP->buffer_size;
+    etl.IsKernelTrace = lstrcmpiW(hdrP->logger_nameP, KERNEL_LOGGER_NAMEW) == 0;
+    /* ObjFromTRACE_LOGFILE_HEADER adjusts for the file's pointer size */
+    CopyMemory(&etl.LogfileHeader, hdrP->rawP,
+               hdrP->raw_size < sizeof(etl.LogfileHeader) ? hdrP->raw_size : sizeof(etl.LogfileHeader));
+
+    nbuffers = 0;
+    while ((winerr = TwapiEtlReadBuffer(readerP->etlP, &infoP)) == ERROR_SUCCESS) {
+        while (TwapiEtlNextEvent(readerP->etlP, &evrP) == ERROR_SUCCESS) {
+            if (evrP->EventHeader.TimeStamp.QuadPart < start ||
+                evrP->EventHeader.TimeStamp.QuadPart > end)
+                continue;
+            TwapiETWEventRecordCallback(evrP);
+            if (etwc.status != TCL_OK)
+                break;
+        }
+        etl.CurrentTime = infoP->timestamp;
+        etl.BuffersRead = infoP->index + 1;
+        etl.Filled = infoP->filled;
+        if (! TwapiETWBufferCallback(&etl)) {
+            winerr = ERROR_CANCELLED;
+            break;
+        }
+        if (maxbuffers > 0 && ++nbuffers >= maxbuffers)
+            break;
+    }
+    if (winerr == ERROR_HANDLE_EOF)
+        winerr = ERROR_SUCCESS;
+
+    return TwapiETWEndProcessing(&etwc, interp, winerr);
+}
+
+/*
+ * Fields of formatted events in the order of the etw_event record
+ * in etw.tcl. IMPORTANT: keep the two in sync.
+ */
+static const char *gETWEventFields[] = {
+    "-eventid", "-version", "-channel", "-level", "-opcode", "-task",
+    "-keywordmask", "-timecreated", "-tid", "-pid", "-providerguid",
+    "-usertime", "-kerneltime", "-providername", "-eventguid",
+    "-channelname", "-levelname", "-opcodename", "-taskname",
+    "-keywords", "-properties", "-message", "-sid", NULL
+};
+enum {
+    ETW_FIELD_EVENTID, ETW_FIELD_VERSION, ETW_FIELD_CHANNEL, ETW_FIELD_LEVEL,
+    ETW_FIELD_OPCODE, ETW_FIELD_TASK, ETW_FIELD_KEYWORDMASK,
+    ETW_FIELD_TIMECREATED, ETW_FIELD_TID, ETW_FIELD_PID,
+    ETW_FIELD_PROVIDERGUID, ETW_FIELD_USERTIME, ETW_FIELD_KERNELTIME,
+    /* Fields from here on, except -sid, need TdhGetEventInformation */
+    ETW_FIELD_PROVIDERNAME, ETW_FIELD_EVENTGUID, ETW_FIELD_CHANNELNAME,
+    ETW_FIELD_LEVELNAME, ETW_FIELD_OPCODENAME, ETW_FIELD_TASKNAME,
+    ETW_FIELD_KEYWORDS, ETW_FIELD_PROPERTIES, ETW_FIELD_MESSAGE,
+    ETW_FIELD_SID,
+    ETW_FIELD_COUNT
+};
+
+/*
+ * Index of the field in the list built by TwapiTdhGetEventInformation
+ * for fields ETW_FIELD_PROVIDERNAME to ETW_FIELD_MESSAGE.
+ */
+static const int gETWEventInfoIndex[] = {2, 0, 4, 3, 7, 6, 5, 12, 8};
+
+/* Returns the value of a field of an event from a batch */
+static Tcl_Obj *TwapiETWBatchEventField(TwapiEtwBatch *batchP,
+                                        EVENT_RECORD *evrP, int field,
+                                        Tcl_Obj **infoObjs)
+{
+    EVENT_HEADER *evhP = &evrP->EventHeader;
+    Tcl_WideInt resolution;
+    int i;
+
+    resolution = TwapiEtwBatchTimerResolution(batchP);
+    switch (field) {
+    case ETW_FIELD_EVENTID: return ObjFromLong(evhP->EventDescriptor.Id);
+    case ETW_FIELD_VERSION: return ObjFromLong(evhP->EventDescriptor.Version);
+    case ETW_FIELD_CHANNEL: return ObjFromLong(evhP->EventDescriptor.Channel);
+    case ETW_FIELD_LEVEL: return ObjFromLong(evhP->EventDescriptor.Level);
+    case ETW_FIELD_OPCODE: return ObjFromLong(evhP->EventDescriptor.Opcode);
+    case ETW_FIELD_TASK: return ObjFromLong(evhP->EventDescriptor.Task);
+    case ETW_FIELD_KEYWORDMASK: return ObjFromULONGLONG(evhP->EventDescriptor.Keyword);
+    case ETW_FIELD_TIMECREATED: return ObjFromLARGE_INTEGER(evhP->TimeStamp);
+    case ETW_FIELD_TID: return ObjFromLong(evhP->ThreadId);
+    case ETW_FIELD_PID: return ObjFromLong(evhP->ProcessId);
+    case ETW_FIELD_PROVIDERGUID: return ObjFromGUID(&evhP->ProviderId);
+    case ETW_FIELD_USERTIME:
+        /* Private sessions only have the total processor time */
+        if (TwapiEtwBatchPrivateSession(batchP))
+            return ObjFromWideInt(evhP->ProcessorTime * resolution);
+        return ObjFromWideInt(evhP->UserTime * resolution);
+    case ETW_FIELD_KERNELTIME:
+        if (TwapiEtwBatchPrivateSession(batchP))
+            return ObjFromLong(0);
+        return ObjFromWideInt(evhP->KernelTime * resolution);
+    case ETW_FIELD_SID:
+        for (i = 0; i < evrP->ExtendedDataCount; ++i) {
+            EVENT_HEADER_EXTENDED_DATA_ITEM *ehdrP = &evrP->ExtendedData[i];
+            if (ehdrP->ExtType == EVENT_HEADER_EXT_TYPE_SID && ehdrP->DataPtr)
+                return ObjFromSIDNoFail((SID *)(ehdrP->DataPtr));
+        }
+        return ObjFromEmptyString();
+    default:
+        TWAPI_ASSERT(field >= ETW_FIELD_PROVIDERNAME && field <= ETW_FIELD_MESSAGE);
+        return infoObjs[gETWEventInfoIndex[field - ETW_FIELD_PROVIDERNAME]];
+    }
+}
+
+/*
+ * Batches from session threads come with their schemas resolved. Local
+ * copies are used so the Tcl objects built for each can be attached to
+ * it as for those in the interp's cache. Returns NULL if the batch has
+ * none. The copies must be freed with TwapiETWBatchSchemasFree before
+ * the memlifo is popped.
+ */
+static TwapiTdhSchema *TwapiETWBatchSchemas(TwapiInterpContext *ticP,
+                                            TwapiEtwBatch *batchP,
+                                            ULONG *countP)
+{
+    TwapiTdhSchema *schemasP;
+    ULONG i;
+
+    *countP = TwapiEtwBatchSchemaCount(batchP);
+    if (*countP == 0)
+        return NULL;
+    schemasP = MemLifoAlloc(ticP->memlifoP, *countP * sizeof(*schemasP), NULL);
+    for (i = 0; i < *countP; ++i)
+        schemasP[i] = *TwapiEtwBatchGetSchema(batchP, i);
+    return schemasP;
+}
+
+static void TwapiETWBatchSchemasFree(TwapiTdhSchema *schemasP, ULONG count)
+{
+    ULONG i;
+
+    for (i = 0; i < count; ++i) {
+        if (schemasP[i].clientP)
+            TwapiETWSchemaObjsFree(schemasP[i].clientP);
+    }
+}
+
+/*
+ * Decodes the given fields of all events in a batch. The result is
+ * a list of rows, one per event, or if columnar is non-0, a dictionary
+ * mapping each field name to the list of its values. Event information
+ * and properties are only retrieved from TDH if a field needs them.
+ */
+static TCL_RESULT TwapiETWBatchDecode(TwapiInterpContext *ticP,
+                                      TwapiEtwBatch *batchP,
+                                      int nfields, int *fields, int columnar,
+                                      Tcl_Obj **resultObjP)
+{
+    Tcl_Obj **outObjs, **infoObjs, *infoObj, *rowObj;
+    EVENT_RECORD evr;
+    MemLifoMarkHandle mark;
+    ULONG i, nevents, nschemas;
+    int j, ninfo, need_info, need_properties, schema_index;
+    TwapiTdhSchema *schemasP;
+    TCL_RESULT res;
+
+    need_info = 0;
+    need_properties = 0;
+    for (j = 0; j < nfields; ++j) {
+        if (fields[j] >= ETW_FIELD_PROVIDERNAME && fields[j] != ETW_FIELD_SID)
+            need_info = 1;
+        if (fields[j] == ETW_FIELD_PROPERTIES)
+            need_properties = 1;
+    }
+
+    nevents = TwapiEtwBatchCount(batchP);
+    mark = MemLifoPushMark(ticP->memlifoP);
+    if (columnar) {
+        outObjs = MemLifoAlloc(ticP->memlifoP, nfields * sizeof(*outObjs), NULL);
+        for (j = 0; j < nfields; ++j)
+            outObjs[j] = ObjNewList(nevents, NULL);
+    } else
+        outObjs = MemLifoAlloc(ticP->memlifoP, (nevents ? nevents : 1) * sizeof(*outObjs), NULL);
+
+    nschemas = 0;
+    schemasP = need_info ? TwapiETWBatchSchemas(ticP, batchP, &nschemas) : NULL;
+
+    res = TCL_OK;
+    for (i = 0; i < nevents; ++i) {
+        MemLifoMarkHandle event_mark;
+
+        TwapiEtwBatchGet(batchP, i, &evr, NULL);
+        infoObj = NULL;
+        infoObjs = NULL;
+        event_mark = MemLifoPushMark(ticP->memlifoP);
+        if (need_info) {
+            schema_index = schemasP ? TwapiEtwBatchEventSchema(batchP, i) : -1;
+            res = TwapiTdhGetEventInformation(ticP, &evr, need_properties,
+                                              schema_index < 0 ? NULL : &schemasP[schema_index],
+                                              &infoObj);
+            if (res != TCL_OK) {
+                MemLifoPopMark(event_mark);
+                break;
+            }
+            ObjIncrRefs(infoObj);
+            ObjGetElements(NULL, infoObj, &ninfo, &infoObjs);
+            TWAPI_ASSERT(ninfo == 13);
+        }
+        if (columnar) {
+            for (j = 0; j < nfields; ++j)
+                ObjAppendElement(NULL, outObjs[j],
+                                 TwapiETWBatchEventField(batchP, &evr, fields[j], infoObjs));
+        } else {
+            rowObj = ObjNewList(nfields, NULL);
+            for (j = 0; j < nfields; ++j)
+                ObjAppendElement(NULL, rowObj,
+                                 TwapiETWBatchEventField(batchP, &evr, fields[j], infoObjs));
+            outObjs[i] = rowObj;
+        }
+        if (infoObj)
+            ObjDecrRefs(infoObj);
+        MemLifoPopMark(event_mark);
+    }
+
+    if (res != TCL_OK) {
+        if (columnar)
+            ObjDecrArrayRefs(nfields, outObjs);
+        else
+            ObjDecrArrayRefs(i, outObjs);
+    } else if (columnar) {
+        *resultObjP = ObjNewList(0, NULL);
+        for (j = 0; j < nfields; ++j) {
+            ObjAppendElement(NULL, *resultObjP, ObjFromString(gETWEventFields[fields[j]]));
+            ObjAppendElement(NULL, *resultObjP, outObjs[j]);
+        }
+    } else
+        *resultObjP = ObjNewList(nevents, outObjs);
+
+    TwapiETWBatchSchemasFree(schemasP, nschemas);
+    MemLifoPopMark(mark);
+    return res;
+}
+
+static TCL_RESULT Twapi_ETWBatchCountObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiEtwBatch *batchP;
+
+    CHECK_NARGS(interp, objc, 2);
+    if (ObjToETWBatch(interp, objv[1], &batchP) != TCL_OK)
+        return TCL_ERROR;
+    return ObjSetResult(interp, ObjFromULONG(TwapiEtwBatchCount(batchP)));
+}
+
+/*
+ * ETWBatchColumns BATCH ?FIELDS?
+ * Returns a dictionary keyed by field, all fields if FIELDS is not
+ * specified, whose values are lists holding that field for every event.
+ */
+static TCL_RESULT Twapi_ETWBatchColumnsObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiInterpContext *ticP = (TwapiInterpContext*) clientdata;
+    TwapiEtwBatch *batchP;
+    Tcl_Obj **fieldObjs;
+    Tcl_Obj *resultObj;
+    int fields[ETW_FIELD_COUNT];
+    int i, nfields;
+
+    CHECK_NARGS_RANGE(interp, objc, 2, 3);
+    if (ObjToETWBatch(interp, objv[1], &batchP) != TCL_OK)
+        return TCL_ERROR;
+
+    if (objc == 2) {
+        nfields = ETW_FIELD_COUNT;
+        for (i = 0; i < nfields; ++i)
+            fields[i] = i;
+    } else {
+        if (ObjGetElements(interp, objv[2], &nfields, &fieldObjs) != TCL_OK)
+            return TCL_ERROR;
+        if (nfields > ETW_FIELD_COUNT)
+            return TwapiReturnErrorMsg(interp, TWAPI_INVALID_ARGS,
+                                       "Duplicate event fields specified");
+        for (i = 0; i < nfields; ++i) {
+            if (Tcl_GetIndexFromObj(interp, fieldObjs[i], gETWEventFields,
+                                    "event field", TCL_EXACT, &fields[i]) != TCL_OK)
+                return TCL_ERROR;
+        }
+    }
+
+    if (TwapiETWBatchDecode(ticP, batchP, nfields, fields, 1, &resultObj) != TCL_OK)
+        return TCL_ERROR;
+    return ObjSetResult(interp, resultObj);
+}
+
+/*
+ * ETWBatchFormat BATCH
+ * Returns the events in the batch as a list of rows of the etw_event
+ * record, as etw_format_events does for unbatched events.
+ */
+static TCL_RESULT Twapi_ETWBatchFormatObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiInterpContext *ticP = (TwapiInterpContext*) clientdata;
+    TwapiEtwBatch *batchP;
+    Tcl_Obj *resultObj;
+    int fields[ETW_FIELD_COUNT];
+    int i;
+
+    CHECK_NARGS(interp, objc, 2);
+    if (ObjToETWBatch(interp, objv[1], &batchP) != TCL_OK)
+        return TCL_ERROR;
+    for (i = 0; i < ETW_FIELD_COUNT; ++i)
+        fields[i] = i;
+    if (TwapiETWBatchDecode(ticP, batchP, ETW_FIELD_COUNT, fields, 0, &resultObj) != TCL_OK)
+        return TCL_ERROR;
+    return ObjSetResult(interp, resultObj);
+}
+
+static TCL_RESULT Twapi_ETWIsBatchObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    CHECK_NARGS(interp, objc, 2);
+    return ObjSetResult(interp, ObjFromBoolean(objv[1]->typePtr == &gETWBatchType));
+}
+
+/*
+ * Native writer for etw_dump_to_file. Events in batches are formatted
+ * straight into the writer's buffer which is written to the channel
+ * when full, without building a Tcl list or dictionary per event.
+ */
+typedef struct _TwapiETWDumpWriter {
+    Tcl_Channel chan;
+    int error;                  /* errno of failed channel write */
+    int json;                   /* Else CSV */
+    TwapiEtwWriter *writerP;
+    int nfields;
+    int fields[1];              /* Actually nfields long */
+} TwapiETWDumpWriter;
+
+/*
+ * The writer only passes whole characters so Tcl_WriteChars converts all
+ * of them. Its count is of bytes in the channel encoding, which is not
+ * comparable to len, so a write that did not complete shows up as -1.
+ */
+static ULONG TwapiETWDumpWriterFlush(void *pv, const char *bytesP, size_t len)
+{
+    TwapiETWDumpWriter *dwP = pv;
+
+    if (Tcl_WriteChars(dwP->chan, bytesP, (int) len) < 0) {
+        dwP->error = Tcl_GetErrno();
+        return ERROR_WRITE_FAULT;
+    }
+    return ERROR_SUCCESS;
+}
+
+static void TwapiETWDumpWriterFree(TwapiETWDumpWriter *dwP)
+{
+    if (dwP->writerP)
+        TwapiEtwWriterFree(dwP->writerP);
+    TwapiFree(dwP);
+}
+
+static TCL_RESULT TwapiETWDumpWriterError(Tcl_Interp *interp,
+                                          TwapiETWDumpWriter *dwP, ULONG winerr)
+{
+    if (winerr == ERROR_WRITE_FAULT && dwP->error) {
+        Tcl_SetErrno(dwP->error);
+        Tcl_SetObjResult(interp,
+                         Tcl_ObjPrintf("Error writing channel %s: %s",
+                                       Tcl_GetChannelName(dwP->chan),
+                                       Tcl_PosixError(interp)));
+        return TCL_ERROR;
+    }
+    return Twapi_AppendSystemError(interp, winerr);
+}
+
+/*
+ * Splits the properties dictionary of an event into name value pairs,
+ * joining the elements of each value, which is always a list, with ", "
+ * as etw_format_event_message does for message inserts. The strings
+ * are allocated from the memlifo. Returns the number of pairs.
+ */
+static int TwapiETWJoinProperties(TwapiInterpContext *ticP, Tcl_Obj *propsObj,
+                                  const char ***strsP, size_t **lensP)
+{
+    Tcl_Obj **objs, **valObjs;
+    const char **strs;
+    size_t *lens, total;
+    char *p, *s;
+    int i, j, n, nvals, len;
+
+    if (ObjGetElements(NULL, propsObj, &n, &objs) != TCL_OK || (n & 1))
+        n = 0;
+    strs = MemLifoAlloc(ticP->memlifoP, (n ? n : 1) * sizeof(*strs), NULL);
+    lens = MemLifoAlloc(ticP->memlifoP, (n ? n : 1) * sizeof(*lens), NULL);
+    for (i = 0; i < n; i += 2) {
+        strs[i] = ObjToStringN(objs[i], &len);
+        lens[i] = len;
+        if (ObjGetElements(NULL, objs[i+1], &nvals, &valObjs) != TCL_OK) {
+            strs[i+1] = ObjToStringN(objs[i+1], &len);
+            lens[i+1] = len;
+            continue;
+        }
+        if (nvals == 1) {
+            strs[i+1] = ObjToStringN(valObjs[0], &len);
+            lens[i+1] = len;
+            continue;
+        }
+        total = 0;
+        for (j = 0; j < nvals; ++j) {
+            ObjToStringN(valObjs[j], &len);
+            total += len + 2;
+        }
+        p = MemLifoAlloc(ticP->memlifoP, total + 1, NULL);
+        strs[i+1] = p;
+        for (j = 0; j < nvals; ++j) {
+            if (j) {
+                *p++ = ',';
+                *p++ = ' ';
+            }
+            s = ObjToStringN(valObjs[j], &len);
+            CopyMemory(p, s, len);
+            p += len;
+        }
+        lens[i+1] = p - strs[i+1];
+    }
+    *strsP = strs;
+    *lensP = lens;
+    return n / 2;
+}
+
+static ULONG TwapiETWDumpWriterString(TwapiEtwWriter *writerP, Tcl_Obj *objP)
+{
+    int len;
+    char *s = ObjToStringN(objP, &len);
+    return TwapiEtwWriterString(writerP, s, len);
+}
+
+/* Writes one field of an event, see TwapiETWBatchEventField */
+static ULONG TwapiETWDumpWriterField(TwapiInterpContext *ticP,
+                                     TwapiETWDumpWriter *dwP,
+                                     TwapiEtwBatch *batchP,
+                                     EVENT_RECORD *evrP, int field,
+                                     Tcl_Obj **infoObjs)
+{
+    TwapiEtwWriter *writerP = dwP->writerP;
+    EVENT_HEADER *evhP = &evrP->EventHeader;
+    Tcl_Obj *objP;
+    const char **strs, **params;
+    size_t *lens, *param_lens;
+    char *fmt;
+    int i, npairs, len;
+    ULONG winerr;
+
+    switch (field) {
+    case ETW_FIELD_EVENTID: return TwapiEtwWriterInteger(writerP, evhP->EventDescriptor.Id);
+    case ETW_FIELD_VERSION: return TwapiEtwWriterInteger(writerP, evhP->EventDescriptor.Version);
+    case ETW_FIELD_CHANNEL: return TwapiEtwWriterInteger(writerP, evhP->EventDescriptor.Channel);
+    case ETW_FIELD_LEVEL: return TwapiEtwWriterInteger(writerP, evhP->EventDescriptor.Level);
+    case ETW_FIELD_OPCODE: return TwapiEtwWriterInteger(writerP, evhP->EventDescriptor.Opcode);
+    case ETW_FIELD_TASK: return TwapiEtwWriterInteger(writerP, evhP->EventDescriptor.Task);
+    case ETW_FIELD_KEYWORDMASK: return TwapiEtwWriterUnsigned(writerP, evhP->EventDescriptor.Keyword);
+    case ETW_FIELD_TIMECREATED: return TwapiEtwWriterInteger(writerP, evhP->TimeStamp.QuadPart);
+    case ETW_FIELD_TID: return TwapiEtwWriterInteger(writerP, (LONG) evhP->ThreadId);
+    case ETW_FIELD_PID: return TwapiEtwWriterInteger(writerP, (LONG) evhP->ProcessId);
+    case ETW_FIELD_USERTIME:
+        /* Private sessions only have the total processor time */
+        if (TwapiEtwBatchPrivateSession(batchP))
+            return TwapiEtwWriterInteger(writerP, evhP->ProcessorTime * (LONGLONG) TwapiEtwBatchTimerResolution(batchP));
+        return TwapiEtwWriterInteger(writerP, evhP->UserTime * (LONGLONG) TwapiEtwBatchTimerResolution(batchP));
+    case ETW_FIELD_KERNELTIME:
+        if (TwapiEtwBatchPrivateSession(batchP))
+            return TwapiEtwWriterInteger(writerP, 0);
+        return TwapiEtwWriterInteger(writerP, evhP->KernelTime * (LONGLONG) TwapiEtwBatchTimerResolution(batchP));
+    case ETW_FIELD_PROPERTIES:
+        /* CSV has the dictionary as is, JSON an object */
+        objP = infoObjs[gETWEventInfoIndex[field - ETW_FIELD_PROVIDERNAME]];
+        if (! dwP->json)
+            return TwapiETWDumpWriterString(writerP, objP);
+        npairs = TwapiETWJoinProperties(ticP, objP, &strs, &lens);
+        return TwapiEtwWriterPairs(writerP, npairs, strs, lens);
+    case ETW_FIELD_MESSAGE:
+        fmt = ObjToStringN(infoObjs[gETWEventInfoIndex[field - ETW_FIELD_PROVIDERNAME]], &len);
+        npairs = TwapiETWJoinProperties(ticP, infoObjs[gETWEventInfoIndex[ETW_FIELD_PROPERTIES - ETW_FIELD_PROVIDERNAME]], &strs, &lens);
+        params = MemLifoAlloc(ticP->memlifoP, (npairs ? npairs : 1) * sizeof(*params), NULL);
+        param_lens = MemLifoAlloc(ticP->memlifoP, (npairs ? npairs : 1) * sizeof(*param_lens), NULL);
+        for (i = 0; i < npairs; ++i) {
+            params[i] = strs[2*i + 1];
+            param_lens[i] = lens[2*i + 1];
+        }
+        return TwapiEtwWriterMessage(writerP, fmt, len, npairs, params, param_lens);
+    default:
+        objP = TwapiETWBatchEventField(batchP, evrP, field, infoObjs);
+        ObjIncrRefs(objP);
+        winerr = TwapiETWDumpWriterString(writerP, objP);
+        ObjDecrRefs(objP);
+        return winerr;
+    }
+}
+
+/*
+ * ETWWriterOpen CHANNEL FORMAT SEPARATOR FIELDS BUFFERSIZE
+ * Returns a writer for the channel that formats the given fields of
+ * events as CSV, starting with a header row, or JSON Lines. The channel
+ * must stay open until the writer is closed.
+ */
+static TCL_RESULT Twapi_ETWWriterOpenObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    static const char *formats[] = {"csv", "jsonl", NULL};
+    TwapiETWDumpWriter *dwP;
+    Tcl_Channel chan;
+    Tcl_Obj **fieldObjs;
+    const char **names;
+    char *chan_name, *separator;
+    int i, mode, format, nfields, buffer_size;
+    ULONG winerr;
+
+    if (TwapiGetArgs(interp, objc-1, objv+1,
+                     GETASTR(chan_name), ARGSKIP, GETASTR(separator),
+                     ARGSKIP, GETINT(buffer_size), ARGEND) != TCL_OK)
+        return TCL_ERROR;
+
+    chan = Tcl_GetChannel(interp, chan_name, &mode);
+    if (chan == NULL)
+        return TCL_ERROR;
+    if (! (mode & TCL_WRITABLE))
+        return TwapiReturnErrorMsg(interp, TWAPI_INVALID_ARGS,
+                                   "Channel is not open for writing");
+    if (Tcl_GetIndexFromObj(interp, objv[2], formats, "format",
+                            TCL_EXACT, &format) != TCL_OK)
+        return TCL_ERROR;
+    /* The writer only deals with single byte separators */
+    if (separator[0] == 0 || separator[1] != 0 || (separator[0] & 0x80))
+        return TwapiReturnErrorMsg(interp, TWAPI_INVALID_ARGS,
+                                   "Separator must be a single ASCII character");
+    if (ObjGetElements(interp, objv[4], &nfields, &fieldObjs) != TCL_OK)
+        return TCL_ERROR;
+
+    dwP = TwapiAlloc(sizeof(*dwP) + nfields * sizeof(dwP->fields[0]));
+    dwP->chan = chan;
+    dwP->error = 0;
+    dwP->json = format == 1;
+    dwP->writerP = NULL;
+    dwP->nfields = nfields;
+    for (i = 0; i < nfields; ++i) {
+        if (Tcl_GetIndexFromObj(interp, fieldObjs[i], gETWEventFields,
+                                "event field", TCL_EXACT, &dwP->fields[i]) != TCL_OK) {
+            TwapiETWDumpWriterFree(dwP);
+            return TCL_ERROR;
+        }
+    }
+
+    names = TwapiAlloc((nfields ? nfields : 1) * sizeof(*names));
+    for (i = 0; i < nfields; ++i)
+        names[i] = gETWEventFields[dwP->fields[i]];
+    dwP->writerP = TwapiEtwWriterNew(dwP->json ? TWAPI_ETW_WRITER_JSONL : TWAPI_ETW_WRITER_CSV,
+                                     separator[0], nfields, names,
+                                     buffer_size < 0 ? 0 : buffer_size,
+                                     TwapiETWDumpWriterFlush, dwP);
+    TwapiFree((void *) names);
+    if (dwP->writerP == NULL) {
+        TwapiETWDumpWriterFree(dwP);
+        return Twapi_AppendSystemError(interp, ERROR_NOT_ENOUGH_MEMORY);
+    }
+    winerr = TwapiEtwWriterHeader(dwP->writerP);
+    if (winerr != ERROR_SUCCESS) {
+        TwapiETWDumpWriterError(interp, dwP, winerr);
+        TwapiETWDumpWriterFree(dwP);
+        return TCL_ERROR;
+    }
+
+    if (TwapiRegisterPointer(interp, dwP, TwapiETWDumpWriterFree) != TCL_OK) {
+        TwapiETWDumpWriterFree(dwP);
+        return TCL_ERROR;
+    }
+    return ObjSetResult(interp, ObjFromOpaque(dwP, "TwapiETWDumpWriter"));
+}
+
+/*
+ * ETWWriterWrite WRITER BATCH MAXEVENTS
+ * Writes up to MAXEVENTS events from the batch, all if negative, and
+ * returns the number written.
+ */
+static TCL_RESULT Twapi_ETWWriterWriteObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiInterpContext *ticP = (TwapiInterpContext*) clientdata;
+    TwapiETWDumpWriter *dwP;
+    TwapiEtwBatch *batchP;
+    TwapiTdhSchema *schemasP;
+    Tcl_Obj **infoObjs, *infoObj;
+    EVENT_RECORD evr;
+    MemLifoMarkHandle mark, event_mark;
+    ULONG i, nevents, nschemas, winerr;
+    int j, ninfo, need_info, need_properties, schema_index, maxevents;
+    TCL_RESULT res;
+
+    if (TwapiGetArgs(interp, objc-1, objv+1,
+                     GETVERIFIEDPTR(dwP, TwapiETWDumpWriter, TwapiETWDumpWriterFree),
+                     ARGSKIP, GETINT(maxevents), ARGEND) != TCL_OK
+        || ObjToETWBatch(interp, objv[2], &batchP) != TCL_OK)
+        return TCL_ERROR;
+
+    need_info = 0;
+    need_properties = 0;
+    for (j = 0; j < dwP->nfields; ++j) {
+        if (dwP->fields[j] >= ETW_FIELD_PROVIDERNAME && dwP->fields[j] != ETW_FIELD_SID)
+            need_info = 1;
+        /* Messages are formatted with the properties */
+        if (dwP->fields[j] == ETW_FIELD_PROPERTIES || dwP->fields[j] == ETW_FIELD_MESSAGE)
+            need_properties = 1;
+    }
+
+    nevents = TwapiEtwBatchCount(batchP);
+    if (maxevents >= 0 && (ULONG) maxevents < nevents)
+        nevents = maxevents;
+
+    mark = MemLifoPushMark(ticP->memlifoP);
+    nschemas = 0;
+    schemasP = need_info ? TwapiETWBatchSchemas(ticP, batchP, &nschemas) : NULL;
+
+    res = TCL_OK;
+    for (i = 0; i < nevents; ++i) {
+        TwapiEtwBatchGet(batchP, i, &evr, NULL);
+        infoObj = NULL;
+        infoObjs = NULL;
+        event_mark = MemLifoPushMark(ticP->memlifoP);
+        if (need_info) {
+            schema_index = schemasP ? TwapiEtwBatchEventSchema(batchP, i) : -1;
+            res = TwapiTdhGetEventInformation(ticP, &evr, need_properties,
+                                              schema_index < 0 ? NULL : &schemasP[schema_index],
+                                              &infoObj);
+            if (res != TCL_OK) {
+                MemLifoPopMark(event_mark);
+                break;
+            }
+            ObjIncrRefs(infoObj);
+            ObjGetElements(NULL, infoObj, &ninfo, &infoObjs);
+            TWAPI_ASSERT(ninfo == 13);
+        }
+        winerr = ERROR_SUCCESS;
+        for (j = 0; j < dwP->nfields && winerr == ERROR_SUCCESS; ++j)
+            winerr = TwapiETWDumpWriterField(ticP, dwP, batchP, &evr,
+                                             dwP->fields[j], infoObjs);
+        if (winerr == ERROR_SUCCESS)
+            winerr = TwapiEtwWriterEndRow(dwP->writerP);
+        if (infoObj)
+            ObjDecrRefs(infoObj);
+        MemLifoPopMark(event_mark);
+        if (winerr != ERROR_SUCCESS) {
+            res = TwapiETWDumpWriterError(interp, dwP, winerr);
+            break;
+        }
+    }
+
+    TwapiETWBatchSchemasFree(schemasP, nschemas);
+    MemLifoPopMark(mark);
+    if (res != TCL_OK)
+        return res;
+    return ObjSetResult(interp, ObjFromULONG(nevents));
+}
+
+/* ETWWriterClose WRITER - flushes buffered output and frees the writer */
+static TCL_RESULT Twapi_ETWWriterCloseObjCmd(ClientData clientdata, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    TwapiETWDumpWriter *dwP;
+    ULONG winerr;
+    TCL_RESULT res;
+
+    if (TwapiGetArgs(interp, objc-1, objv+1,
+                     GETVERIFIEDPTR(dwP, TwapiETWDumpWriter, TwapiETWDumpWriterFree),
+                     ARGEND) != TCL_OK
+        || TwapiUnregisterPointer(interp, dwP, TwapiETWDumpWriterFree) != TCL_OK)
+        return TCL_ERROR;
+    winerr = TwapiEtwWriterFlush(dwP->writerP);
+    res = winerr == ERROR_SUCCESS ? TCL_OK : TwapiETWDumpWriterError(interp, dwP, winerr);
+    TwapiETWDumpWriterFree(dwP);
+    return res;
+}
+
 static int TwapiETWInitCalls(Tcl_Interp *interp, TwapiInterpContext *ticP)
 {
     struct tcl_dispatch_s EtwDispatch[] = {
@@ -2850,6 +4065,24 @@ static int TwapiETWInitCalls(Tcl_Interp *interp, TwapiInterpContext *ticP)
         DEFINE_TCL_CMD(Twapi_ParseEventMofData, Twapi_ParseEventMofData),
         DEFINE_TCL_CMD(QueryAllTraces, Twapi_QueryAllTracesObjCmd),
         DEFINE_TCL_CMD(Twapi_TdhEnumerateProviders, Twapi_TdhEnumerateProvidersObjCmd),
+        DEFINE_TCL_CMD(Twapi_ETWSchemaCacheStats, Twapi_ETWSchemaCacheStatsObjCmd),
+        DEFINE_TCL_CMD(Twapi_ETWSchemaCacheConfigure, Twapi_ETWSchemaCacheConfigureObjCmd),
+        DEFINE_TCL_CMD(Twapi_ETWSchemaCacheClear, Twapi_ETWSchemaCacheClearObjCmd),
+        DEFINE_TCL_CMD(Twapi_EtlOpen, Twapi_EtlOpenObjCmd),
+        DEFINE_TCL_CMD(Twapi_EtlClose, Twapi_EtlCloseObjCmd),
+        DEFINE_TCL_CMD(Twapi_EtlSeek, Twapi_EtlSeekObjCmd),
+        DEFINE_TCL_CMD(Twapi_EtlInfo, Twapi_EtlInfoObjCmd),
+        DEFINE_TCL_CMD(Twapi_EtlProcess, Twapi_EtlProcessObjCmd),
+        DEFINE_TCL_CMD(Twapi_ETWIsBatch, Twapi_ETWIsBatchObjCmd),
+        DEFINE_TCL_CMD(Twapi_ETWBatchCount, Twapi_ETWBatchCountObjCmd),
+        DEFINE_TCL_CMD(Twapi_ETWBatchColumns, Twapi_ETWBatchColumnsObjCmd),
+        DEFINE_TCL_CMD(Twapi_ETWBatchFormat, Twapi_ETWBatchFormatObjCmd),
+        DEFINE_TCL_CMD(Twapi_ETWSessionStart, Twapi_ETWSessionStartObjCmd),
+        DEFINE_TCL_CMD(Twapi_ETWSessionStop, Twapi_ETWSessionStopObjCmd),
+        DEFINE_TCL_CMD(Twapi_ETWSessionStats, Twapi_ETWSessionStatsObjCmd),
+        DEFINE_TCL_CMD(Twapi_ETWWriterOpen, Twapi_ETWWriterOpenObjCmd),
+        DEFINE_TCL_CMD(Twapi_ETWWriterWrite, Twapi_ETWWriterWriteObjCmd),
+        DEFINE_TCL_CMD(Twapi_ETWWriterClose, Twapi_ETWWriterCloseObjCmd),
     };
 
     struct fncode_dispatch_s EtwCallDispatch[] = {
@@ -2929,7 +4162,10 @@ static int ETWModuleOneTimeInit(void *arg)
             gInvalidTraceHandle = 0xFFFFFFFFFFFFFFFF;
     }
     gETWProviderSessionHandle = gInvalidTraceHandle;
-    InitializeCriticalSection(&gETWCS);
+    gETWContextTlsIndex = TlsAlloc();
+    if (gETWContextTlsIndex == TLS_OUT_OF_INDEXES)
+        return TCL_ERROR;
+
 
     return TCL_OK;
 }
@@ -2937,7 +4173,23 @@ static int ETWModuleOneTimeInit(void *arg)
 /* Called when interp is deleted */
 static void TwapiETWCleanup(TwapiInterpContext *ticP)
 {
+    TwapiETWSessionSource *srcP;
+
     /* TBD - should we unregister providers or close sessions ? */
+    if (ETW_CONTEXT(ticP)) {
+        /*
+         * Session threads reading files stop at the next buffer. Those
+         * waiting on real time traces finish when the traces are closed.
+         * Either way their callbacks find the interp gone.
+         */
+        while ((srcP = ZLIST_HEAD(&ETW_CONTEXT(ticP)->sessions)) != NULL) {
+            TwapiEtwSessionStop(srcP->sessionP);
+            TwapiETWSessionSourceUnlink(srcP);
+        }
+        TwapiTdhCacheFree(ETW_CONTEXT(ticP)->schema_cacheP);
+        TwapiFree(ETW_CONTEXT(ticP));
+        ticP->module.data.pval = NULL;
+    }
 }
 
 #ifndef TWAPI_SINGLE_MODULE
@@ -2960,6 +4212,8 @@ int Twapi_etw_Init(Tcl_Interp *interp)
         TwapiETWInitCalls,
         TwapiETWCleanup
     };
+    TwapiInterpContext *ticP;
+    TwapiETWInterpContext *eicP;
 
     /* IMPORTANT */
     /* MUST BE FIRST CALL as it initializes Tcl stubs */
@@ -2971,7 +4225,19 @@ int Twapi_etw_Init(Tcl_Interp *interp)
     if (! TwapiDoOneTimeInit(&gETWInitialized, ETWModuleOneTimeInit, interp))
         return TCL_ERROR;
 
-    /* NEW_TIC since we have a cleanup routine */
-    return TwapiRegisterModule(interp, MODULE_HANDLE, &gModuleDef, NEW_TIC) ? TCL_OK : TCL_ERROR;
+    /* NEW_TIC since we have a cleanup routine and use the
+     * ticP->module.data area
+     */
+    ticP = TwapiRegisterModule(interp, MODULE_HANDLE, &gModuleDef, NEW_TIC);
+    if (ticP == NULL)
+        return TCL_ERROR;
+
+    eicP = TwapiAlloc(sizeof(TwapiETWInterpContext));
+    eicP->schema_cacheP = TwapiTdhCacheNew(TWAPI_ETW_SCHEMA_CACHE_SIZE,
+                                           TdhGetEventInformation,
+                                           TwapiETWSchemaObjsFree);
+    ZLIST_INIT(&eicP->sessions);
+    ticP->module.data.pval = eicP;
+    return TCL_OK;
 }
 
@@ -0,0 +1,394 @@
+/*
+ * Copyright (c) 2018, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ */
+
+/*
+ * Storage for the raw events of an ETW buffer so that decoding can be
+ * put off until, and limited to, what a script actually asks for.
+ * Copying an event costs far less than building its Tcl list, and much
+ * less than decoding its properties.
+ */
+
+#ifdef ETW_STANDALONE
+# include <stdlib.h>
+# define BatchAlloc(n_) malloc(n_)
+# define BatchRealloc(p_, n_) realloc((p_), (n_))
+# define BatchFree(p_) free(p_)
+#else
+# include "twapi.h"
+# include <evntrace.h>
+# include <ntverp.h>
+# if (VER_PRODUCTBUILD < 7600) || (_WIN32_WINNT <= 0x600)
+#  include "tdhdefs.h"
+# else
+#  include <tdh.h>
+# endif
+# define BatchAlloc(n_) TwapiAlloc(n_)
+# define BatchRealloc(p_, n_) TwapiReallocTry((p_), (n_))
+# define BatchFree(p_) TwapiFree(p_)
+#endif
+
+#include <string.h>
+
+#include "etwbatch.h"
+
+#define BATCH_ALIGN8(n_) (((n_) + 7) & ~(ULONG)7)
+
+typedef struct _TwapiEtwBatchEntry {
+    EVENT_HEADER header;        /* Flags always include the pointer size */
+    ETW_BUFFER_CONTEXT context;
+    USHORT flags;               /* Header flags as logged */
+    USHORT next;                /* Number of extended data items */
+    USHORT user_data_length;
+    USHORT schema;              /* 1 + index into schemasP, 0 if none */
+    ULONG ext_offset;           /* Offset of extended data items in arena */
+    ULONG user_offset;          /* Offset of user data in arena */
+} TwapiEtwBatchEntry;
+
+/*
+ * Copy of a schema resolved by the producer, shared by events with its
+ * key. The key is the same as for the TDH schema cache.
+ */
+typedef struct _TwapiEtwBatchSchema {
+    GUID provider;
+    USHORT id;
+    UCHAR version;
+    UCHAR opcode;
+    UCHAR level;
+    UCHAR channel;
+    USHORT task;
+    ULONG pointer_size;
+    TwapiTdhSchema schema;      /* teiP, offsetsP and sizesP in one block */
+} TwapiEtwBatchSchema;
+
+struct _TwapiEtwBatch {
+    ULONG nrefs;
+    ULONG nentries;
+    ULONG max_entries;
+    ULONG arena_used;
+    ULONG arena_size;
+    ULONG timer_resolution;
+    int private_session;
+    int sealed;
+    ULONG nschemas;
+    ULONG max_schemas;
+    ULONG last_schema;          /* Most recently matched, 1-based */
+    TwapiEtwBatchSchema *schemasP;
+    TwapiEtwBatchEntry *entriesP;
+    /*
+     * Until sealed, DataPtr of the extended data items holds the offset
+     * of the data in the arena as the arena may be moved when it grows.
+     */
+    BYTE *arenaP;
+};
+
+TwapiEtwBatch *TwapiEtwBatchNew(void)
+{
+    TwapiEtwBatch *batchP = BatchAlloc(sizeof(*batchP));
+    if (batchP == NULL)
+        return NULL;
+    memset(batchP, 0, sizeof(*batchP));
+    batchP->nrefs = 1;
+    return batchP;
+}
+
+void TwapiEtwBatchRetain(TwapiEtwBatch *batchP)
+{
+    batchP->nrefs += 1;
+}
+
+void TwapiEtwBatchRelease(TwapiEtwBatch *batchP)
+{
+    ULONG i;
+
+    if (--batchP->nrefs > 0)
+        return;
+    for (i = 0; i < batchP->nschemas; ++i) {
+        if (batchP->schemasP[i].schema.teiP)
+            BatchFree(batchP->schemasP[i].schema.teiP);
+    }
+    if (batchP->schemasP)
+        BatchFree(batchP->schemasP);
+    if (batchP->entriesP)
+        BatchFree(batchP->entriesP);
+    if (batchP->arenaP)
+        BatchFree(batchP->arenaP);
+    BatchFree(batchP);
+}
+
+/* Returns offset of len bytes reserved in the arena or ~0 on failure */
+static ULONG BatchArenaReserve(TwapiEtwBatch *batchP, ULONG len)
+{
+    ULONG offset, size;
+    BYTE *p;
+
+    /* Keep everything 8 byte aligned as the data is read in place */
+    offset = batchP->arena_used;
+    len = BATCH_ALIGN8(len);
+    if (len > (0x3fffffff - offset))
+        return ~(ULONG)0;
+    if ((offset + len) > batchP->arena_size) {
+        size = batchP->arena_size ? batchP->arena_size : 4096;
+        while (size < (offset + len))
+            size *= 2;
+        p = BatchRealloc(batchP->arenaP, size);
+        if (p == NULL)
+            return ~(ULONG)0;
+        batchP->arenaP = p;
+        batchP->arena_size = size;
+    }
+    batchP->arena_used = offset + len;
+    return offset;
+}
+
+ULONG TwapiEtwBatchAppend(TwapiEtwBatch *batchP, const EVENT_RECORD *evrP,
+                          ULONG pointer_size)
+{
+    TwapiEtwBatchEntry *entryP;
+    EVENT_HEADER_EXTENDED_DATA_ITEM *itemsP;
+    ULONG i, offset, used;
+    USHORT next;
+
+    if (batchP->sealed)
+        return ERROR_INVALID_PARAMETER;
+
+    if (batchP->nentries == batchP->max_entries) {
+        ULONG n = batchP->max_entries ? 2 * batchP->max_entries : 64;
+        entryP = BatchRealloc(batchP->entriesP, n * sizeof(*entryP));
+        if (entryP == NULL)
+            return ERROR_NOT_ENOUGH_MEMORY;
+        batchP->entriesP = entryP;
+        batchP->max_entries = n;
+    }
+
+    /* Reserved space is not given back on failure. Harmless as it is rare. */
+    used = batchP->arena_used;
+    next = evrP->ExtendedData ? evrP->ExtendedDataCount : 0;
+    offset = 0;
+    if (next) {
+        offset = BatchArenaReserve(batchP, next * sizeof(*itemsP));
+        if (offset == ~(ULONG)0)
+            goto nomem;
+        for (i = 0; i < next; ++i) {
+            const EVENT_HEADER_EXTENDED_DATA_ITEM *srcP = &evrP->ExtendedData[i];
+            ULONG data_offset = 0;
+            if (srcP->DataPtr && srcP->DataSize) {
+                data_offset = BatchArenaReserve(batchP, srcP->DataSize);
+                if (data_offset == ~(ULONG)0)
+                    goto nomem;
+                memcpy(batchP->arenaP + data_offset,
+                       (const void *)(size_t) srcP->DataPtr, srcP->DataSize);
+            }
+            /* Arena may have moved so recompute each time */
+            itemsP = (EVENT_HEADER_EXTENDED_DATA_ITEM *) (batchP->arenaP + offset);
+            itemsP[i] = *srcP;
+            itemsP[i].DataPtr = srcP->DataPtr && srcP->DataSize ? data_offset : 0;
+            if (itemsP[i].DataPtr == 0)
+                itemsP[i].DataSize = 0;
+        }
+    }
+
+    entryP = &batchP->entriesP[batchP->nentries];
+    entryP->schema = 0;
+    entryP->ext_offset = offset;
+    entryP->next = next;
+    entryP->user_offset = 0;
+    entryP->user_data_length = 0;
+    if (evrP->UserData && evrP->UserDataLength) {
+        entryP->user_offset = BatchArenaReserve(batchP, evrP->UserDataLength);
+        if (entryP->user_offset == ~(ULONG)0)
+            goto nomem;
+        memcpy(batchP->arenaP + entryP->user_offset, evrP->UserData,
+               evrP->UserDataLength);
+        entryP->user_data_length = evrP->UserDataLength;
+    }
+
+    entryP->header = evrP->EventHeader;
+    entryP->context = evrP->BufferContext;
+    entryP->flags = evrP->EventHeader.Flags;
+    if ((entryP->flags & (EVENT_HEADER_FLAG_32_BIT_HEADER | EVENT_HEADER_FLAG_64_BIT_HEADER)) == 0)
+        entryP->header.Flags |= pointer_size == 4 ?
+            EVENT_HEADER_FLAG_32_BIT_HEADER : EVENT_HEADER_FLAG_64_BIT_HEADER;
+    batchP->nentries += 1;
+    return ERROR_SUCCESS;
+
+nomem:
+    batchP->arena_used = used;
+    return ERROR_NOT_ENOUGH_MEMORY;
+}
+
+/* Returns non-0 if the schema copy was resolved for the event's key */
+static int BatchSchemaMatch(const TwapiEtwBatchSchema *bsP,
+                            const EVENT_HEADER *hdrP, ULONG pointer_size)
+{
+    return bsP->id == hdrP->EventDescriptor.Id &&
+        bsP->version == hdrP->EventDescriptor.Version &&
+        bsP->opcode == hdrP->EventDescriptor.Opcode &&
+        bsP->level == hdrP->EventDescriptor.Level &&
+        bsP->channel == hdrP->EventDescriptor.Channel &&
+        bsP->task == hdrP->EventDescriptor.Task &&
+        bsP->pointer_size == pointer_size &&
+        memcmp(&bsP->provider, &hdrP->ProviderId, sizeof(GUID)) == 0;
+}
+
+ULONG TwapiEtwBatchSetSchema(TwapiEtwBatch *batchP, const TwapiTdhSchema *schemaP)
+{
+    TwapiEtwBatchEntry *entryP;
+    TwapiEtwBatchSchema *bsP;
+    ULONG i, pointer_size, size;
+    BYTE *p;
+
+    if (batchP->sealed || batchP->nentries == 0)
+        return ERROR_INVALID_PARAMETER;
+    entryP = &batchP->entriesP[batchP->nentries - 1];
+    pointer_size = (entryP->header.Flags & EVENT_HEADER_FLAG_32_BIT_HEADER) ? 4 : 8;
+
+    /* Events with the same schema tend to come in runs */
+    if (batchP->last_schema &&
+        BatchSchemaMatch(&batchP->schemasP[batchP->last_schema-1],
+                         &entryP->header, pointer_size)) {
+        entryP->schema = (USHORT) batchP->last_schema;
+        return ERROR_SUCCESS;
+    }
+    for (i = 0; i < batchP->nschemas; ++i) {
+        if (BatchSchemaMatch(&batchP->schemasP[i], &entryP->header, pointer_size)) {
+            batchP->last_schema = i + 1;
+            entryP->schema = (USHORT) (i + 1);
+            return ERROR_SUCCESS;
+        }
+    }
+    if (batchP->nschemas == 0xffff)
+        return ERROR_SUCCESS;   /* Left for the consumer to resolve */
+
+    if (batchP->nschemas == batchP->max_schemas) {
+        ULONG n = batchP->max_schemas ? 2 * batchP->max_schemas : 8;
+        bsP = BatchRealloc(batchP->schemasP, n * sizeof(*bsP));
+        if (bsP == NULL)
+            return ERROR_NOT_ENOUGH_MEMORY;
+        batchP->schemasP = bsP;
+        batchP->max_schemas = n;
+    }
+
+    bsP = &batchP->schemasP[batchP->nschemas];
+    memset(bsP, 0, sizeof(*bsP));
+    bsP->schema.status = schemaP->status;
+    if (schemaP->teiP) {
+        size = BATCH_ALIGN8(schemaP->tei_size);
+        p = BatchAlloc(size + schemaP->nfixed * (sizeof(ULONG) + sizeof(USHORT)));
+        if (p == NULL)
+            return ERROR_NOT_ENOUGH_MEMORY;
+        memcpy(p, schemaP->teiP, schemaP->tei_size);
+        bsP->schema.teiP = (TRACE_EVENT_INFO *) p;
+        bsP->schema.tei_size = schemaP->tei_size;
+        bsP->schema.nfixed = schemaP->nfixed;
+        bsP->schema.fixed_size = schemaP->fixed_size;
+        if (schemaP->nfixed) {
+            bsP->schema.offsetsP = (ULONG *) (p + size);
+            bsP->schema.sizesP = (USHORT *) (bsP->schema.offsetsP + schemaP->nfixed);
+            memcpy(bsP->schema.offsetsP, schemaP->offsetsP, schemaP->nfixed * sizeof(ULONG));
+            memcpy(bsP->schema.sizesP, schemaP->sizesP, schemaP->nfixed * sizeof(USHORT));
+        }
+    }
+    bsP->provider = entryP->header.ProviderId;
+    bsP->id = entryP->header.EventDescriptor.Id;
+    bsP->version = entryP->header.EventDescriptor.Version;
+    bsP->opcode = entryP->header.EventDescriptor.Opcode;
+    bsP->level = entryP->header.EventDescriptor.Level;
+    bsP->channel = entryP->header.EventDescriptor.Channel;
+    bsP->task = entryP->header.EventDescriptor.Task;
+    bsP->pointer_size = pointer_size;
+    batchP->nschemas += 1;
+    batchP->last_schema = batchP->nschemas;
+    entryP->schema = (USHORT) batchP->nschemas;
+    return ERROR_SUCCESS;
+}
+
+void TwapiEtwBatchSeal(TwapiEtwBatch *batchP)
+{
+    ULONG i, j;
+
+    if (batchP->sealed)
+        return;
+    batchP->sealed = 1;
+    for (i = 0; i < batchP->nentries; ++i) {
+        TwapiEtwBatchEntry *entryP = &batchP->entriesP[i];
+        EVENT_HEADER_EXTENDED_DATA_ITEM *itemsP;
+        if (entryP->next == 0)
+            continue;
+        itemsP = (EVENT_HEADER_EXTENDED_DATA_ITEM *) (batchP->arenaP + entryP->ext_offset);
+        for (j = 0; j < entryP->next; ++j) {
+            if (itemsP[j].DataSize)
+                itemsP[j].DataPtr = (ULONGLONG) (size_t) (batchP->arenaP + itemsP[j].DataPtr);
+        }
+    }
+}
+
+ULONG TwapiEtwBatchCount(const TwapiEtwBatch *batchP)
+{
+    return batchP->nentries;
+}
+
+ULONG TwapiEtwBatchSize(const TwapiEtwBatch *batchP)
+{
+    ULONG i, size;
+
+    size = sizeof(*batchP) + batchP->max_entries * sizeof(batchP->entriesP[0])
+        + batchP->arena_size + batchP->max_schemas * sizeof(batchP->schemasP[0]);
+    for (i = 0; i < batchP->nschemas; ++i)
+        size += batchP->schemasP[i].schema.tei_size;
+    return size;
+}
+
+ULONG TwapiEtwBatchSchemaCount(const TwapiEtwBatch *batchP)
+{
+    return batchP->nschemas;
+}
+
+const TwapiTdhSchema *TwapiEtwBatchGetSchema(const TwapiEtwBatch *batchP,
+                                             ULONG schema_index)
+{
+    return &batchP->schemasP[schema_index].schema;
+}
+
+int TwapiEtwBatchEventSchema(const TwapiEtwBatch *batchP, ULONG index)
+{
+    return batchP->entriesP[index].schema - 1;
+}
+
+void TwapiEtwBatchGet(const TwapiEtwBatch *batchP, ULONG index,
+                      EVENT_RECORD *evrP, USHORT *flagsP)
+{
+    const TwapiEtwBatchEntry *entryP = &batchP->entriesP[index];
+
+    memset(evrP, 0, sizeof(*evrP));
+    evrP->EventHeader = entryP->header;
+    evrP->BufferContext = entryP->context;
+    evrP->ExtendedDataCount = entryP->next;
+    if (entryP->next)
+        evrP->ExtendedData = (EVENT_HEADER_EXTENDED_DATA_ITEM *) (batchP->arenaP + entryP->ext_offset);
+    evrP->UserDataLength = entryP->user_data_length;
+    if (entryP->user_data_length)
+        evrP->UserData = batchP->arenaP + entryP->user_offset;
+    if (flagsP)
+        *flagsP = entryP->flags;
+}
+
+void TwapiEtwBatchSetTiming(TwapiEtwBatch *batchP, ULONG timer_resolution,
+                            int private_session)
+{
+    batchP->timer_resolution = timer_resolution;
+    batchP->private_session = private_session;
+}
+
+ULONG TwapiEtwBatchTimerResolution(const TwapiEtwBatch *batchP)
+{
+    return batchP->timer_resolution;
+}
+
+int TwapiEtwBatchPrivateSession(const TwapiEtwBatch *batchP)
+{
+    return batchP->private_session;
+}
@@ -0,0 +1,81 @@
+#ifndef TWAPI_ETWBATCH_H
+#define TWAPI_ETWBATCH_H
+
+/*
+ * Batch of the events delivered for one ETW buffer, stored as copies of
+ * the raw records so they can be decoded after ProcessTrace has moved on.
+ * The fixed event headers are held in an array, one entry per event, so
+ * a field of every event can be read by walking that array. Extended
+ * data and user data are appended to a separate arena. Once all events
+ * have been added the batch is sealed, after which it is read only and
+ * may be shared through reference counts.
+ *
+ * Builds standalone without Tcl or TWAPI when ETW_STANDALONE is defined,
+ * in which case the definitions come from etwtypes.h.
+ */
+
+#ifdef ETW_STANDALONE
+# include "etwtypes.h"
+#endif
+
+#include "tdhcache.h"
+
+typedef struct _TwapiEtwBatch TwapiEtwBatch;
+
+/*
+ * Returns a new empty batch with a reference count of 1. The timer
+ * resolution and private session setting of the log file, needed to
+ * compute CPU times from the headers, are stored with it by the caller.
+ */
+TwapiEtwBatch *TwapiEtwBatchNew(void);
+void TwapiEtwBatchRetain(TwapiEtwBatch *batchP);
+void TwapiEtwBatchRelease(TwapiEtwBatch *batchP);
+
+/*
+ * Copies an event into the batch. pointer_size is the pointer size of
+ * the log file, recorded in the copy if the event header does not
+ * itself specify it. Returns ERROR_SUCCESS, ERROR_NOT_ENOUGH_MEMORY or
+ * ERROR_INVALID_PARAMETER if the batch is sealed.
+ */
+ULONG TwapiEtwBatchAppend(TwapiEtwBatch *batchP, const EVENT_RECORD *evrP,
+                          ULONG pointer_size);
+
+/*
+ * Stores a copy of the schema of the event last appended, as resolved by
+ * the producer, so the consumer need not look it up. Events with the same
+ * key share the copy. Returns ERROR_SUCCESS, ERROR_NOT_ENOUGH_MEMORY or
+ * ERROR_INVALID_PARAMETER if the batch is sealed or empty.
+ */
+ULONG TwapiEtwBatchSetSchema(TwapiEtwBatch *batchP, const TwapiTdhSchema *schemaP);
+
+/* Makes the batch read only. Must be called before TwapiEtwBatchGet. */
+void TwapiEtwBatchSeal(TwapiEtwBatch *batchP);
+
+ULONG TwapiEtwBatchCount(const TwapiEtwBatch *batchP);
+ULONG TwapiEtwBatchSize(const TwapiEtwBatch *batchP); /* Bytes of storage */
+
+/*
+ * Fills in *evrP for the event at index. ExtendedData and UserData
+ * point into the batch. The header flags always specify the pointer
+ * size; those the event was logged with are returned in *flagsP.
+ */
+void TwapiEtwBatchGet(const TwapiEtwBatch *batchP, ULONG index,
+                      EVENT_RECORD *evrP, USHORT *flagsP);
+
+/*
+ * Schemas stored with TwapiEtwBatchSetSchema. TwapiEtwBatchEventSchema
+ * returns the index of the schema of the event at index, or -1 if none
+ * was stored for it. The clientP field of the schemas is always NULL.
+ */
+ULONG TwapiEtwBatchSchemaCount(const TwapiEtwBatch *batchP);
+const TwapiTdhSchema *TwapiEtwBatchGetSchema(const TwapiEtwBatch *batchP,
+                                             ULONG schema_index);
+int TwapiEtwBatchEventSchema(const TwapiEtwBatch *batchP, ULONG index);
+
+/* Stored by the caller, see TwapiEtwBatchNew */
+void TwapiEtwBatchSetTiming(TwapiEtwBatch *batchP, ULONG timer_resolution,
+                            int private_session);
+ULONG TwapiEtwBatchTimerResolution(const TwapiEtwBatch *batchP);
+int TwapiEtwBatchPrivateSession(const TwapiEtwBatch *batchP);
+
+#endif
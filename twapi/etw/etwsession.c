@@ -0,0 +1,520 @@
+/*
+ * Copyright (c) 2018, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ */
+
+/*
+ * Event consumer sessions run on their own threads. ProcessTrace blocks
+ * the calling thread until the trace is done, and a real time trace is
+ * never done, so running it on the interpreter thread allows only one
+ * trace to be consumed at a time and stalls the interpreter meanwhile.
+ * A session thread only copies events and resolves their schemas,
+ * leaving the building of Tcl objects to the interpreter thread.
+ *
+ * Batches are passed to the consumer through a queue owned by the
+ * session rather than the interpreter's event queue so that the session
+ * can bound it and discard buffers the consumer has not yet seen.
+ */
+
+#ifdef ETW_STANDALONE
+# include <stdlib.h>
+# define SessionAlloc(n_) malloc(n_)
+# define SessionFree(p_) free(p_)
+# ifdef _WIN32
+#  include <windows.h>
+# else
+#  include <pthread.h>
+#  include <time.h>
+# endif
+#else
+# include "twapi.h"
+# include <evntrace.h>
+# include <ntverp.h>
+# if (VER_PRODUCTBUILD < 7600) || (_WIN32_WINNT <= 0x600)
+#  include "tdhdefs.h"
+# else
+#  include <tdh.h>
+# endif
+# define SessionAlloc(n_) TwapiAlloc(n_)
+# define SessionFree(p_) TwapiFree(p_)
+#endif
+
+#include <string.h>
+
+#include "etwsession.h"
+
+#ifdef _WIN32
+typedef CRITICAL_SECTION SessionLock;
+# define SessionLockInit(l_) InitializeCriticalSection(l_)
+# define SessionLockDelete(l_) DeleteCriticalSection(l_)
+# define SessionLockEnter(l_) EnterCriticalSection(l_)
+# define SessionLockLeave(l_) LeaveCriticalSection(l_)
+/*
+ * Only the session thread ever waits so an auto-reset event serves as a
+ * condition variable without needing Vista. A signal sent before the
+ * wait is not lost as the event stays set.
+ */
+typedef HANDLE SessionCond;
+# define SessionCondInit(c_) ((*(c_) = CreateEventW(NULL, FALSE, FALSE, NULL)) != NULL)
+# define SessionCondDelete(c_) CloseHandle(*(c_))
+# define SessionCondSignal(c_) SetEvent(*(c_))
+# define SessionCondWait(c_, l_)                        \
+    do {                                                \
+        LeaveCriticalSection(l_);                       \
+        WaitForSingleObject(*(c_), INFINITE);           \
+        EnterCriticalSection(l_);                       \
+    } while (0)
+typedef HANDLE SessionThread;
+#else
+typedef pthread_mutex_t SessionLock;
+# define SessionLockInit(l_) pthread_mutex_init((l_), NULL)
+# define SessionLockDelete(l_) pthread_mutex_destroy(l_)
+# define SessionLockEnter(l_) pthread_mutex_lock(l_)
+# define SessionLockLeave(l_) pthread_mutex_unlock(l_)
+typedef pthread_cond_t SessionCond;
+# define SessionCondInit(c_) (pthread_cond_init((c_), NULL) == 0)
+# define SessionCondDelete(c_) pthread_cond_destroy(c_)
+# define SessionCondSignal(c_) pthread_cond_signal(c_)
+# define SessionCondWait(c_, l_) pthread_cond_wait((c_), (l_))
+typedef pthread_t SessionThread;
+#endif
+
+typedef struct _SessionEntry {
+    struct _SessionEntry *nextP;
+    TwapiEtwBatch *batchP;
+    void *bufferP;
+} SessionEntry;
+
+struct _TwapiEtwSession {
+    TwapiEtwSessionConfig config;
+    SessionLock lock;           /* Protects the fields below it */
+    ULONG nrefs;
+    int stop;
+    int joined;                 /* Thread has been waited for */
+    int idle;                   /* Consumer waiting for a notification */
+    int done;                   /* Source has returned */
+    ULONG winerr;               /* Returned by the source */
+    SessionEntry *headP;        /* Queue, stats.queue_depth entries */
+    SessionEntry *tailP;
+    SessionCond space;          /* Signalled when queue space is freed */
+    ULONG overflows;            /* For TWAPI_ETW_OVERFLOW_SAMPLE */
+    TwapiEtwSessionStats stats;
+    /* Following are only accessed from the session thread */
+    SessionThread thread;
+    TwapiEtwBatch *batchP;      /* Events of the current buffer */
+    TwapiTdhCache *schema_cacheP;
+    ULONGLONG buffer_start;     /* Clock at first event of the buffer */
+};
+
+/* Frees a list of entries not taken by the consumer */
+static void SessionDiscard(TwapiEtwSession *sessionP, SessionEntry *entryP)
+{
+    SessionEntry *nextP;
+
+    for ( ; entryP; entryP = nextP) {
+        nextP = entryP->nextP;
+        TwapiEtwBatchRelease(entryP->batchP);
+        if (sessionP->config.discardFn)
+            sessionP->config.discardFn(entryP->bufferP);
+        SessionFree(entryP);
+    }
+}
+
+/* Counts a list of entries as dropped. Caller must hold the lock. */
+static void SessionCountDropped(TwapiEtwSession *sessionP, SessionEntry *entryP)
+{
+    for ( ; entryP; entryP = entryP->nextP) {
+        sessionP->stats.dropped_buffers += 1;
+        sessionP->stats.dropped_events += TwapiEtwBatchCount(entryP->batchP);
+    }
+}
+
+static void SessionDelete(TwapiEtwSession *sessionP)
+{
+    SessionDiscard(sessionP, sessionP->headP);
+    if (sessionP->batchP)
+        TwapiEtwBatchRelease(sessionP->batchP);
+    if (sessionP->schema_cacheP)
+        TwapiTdhCacheFree(sessionP->schema_cacheP);
+#ifdef _WIN32
+    CloseHandle(sessionP->thread);
+#else
+    if (! sessionP->joined)
+        pthread_detach(sessionP->thread);
+#endif
+    SessionCondDelete(&sessionP->space);
+    SessionLockDelete(&sessionP->lock);
+    SessionFree(sessionP);
+}
+
+void TwapiEtwSessionRetain(TwapiEtwSession *sessionP)
+{
+    SessionLockEnter(&sessionP->lock);
+    sessionP->nrefs += 1;
+    SessionLockLeave(&sessionP->lock);
+}
+
+void TwapiEtwSessionRelease(TwapiEtwSession *sessionP)
+{
+    ULONG nrefs;
+
+    SessionLockEnter(&sessionP->lock);
+    nrefs = --sessionP->nrefs;
+    SessionLockLeave(&sessionP->lock);
+    if (nrefs == 0)
+        SessionDelete(sessionP);
+}
+
+static void SessionRun(TwapiEtwSession *sessionP)
+{
+    ULONG winerr;
+
+    winerr = sessionP->config.sourceFn(sessionP, sessionP->config.sourceP);
+    /* Events after the last buffer boundary are not delivered, as with
+       ProcessTrace itself */
+    SessionLockEnter(&sessionP->lock);
+    sessionP->winerr = winerr;
+    sessionP->done = 1;
+    sessionP->idle = 0;
+    SessionLockLeave(&sessionP->lock);
+    sessionP->config.notifyFn(sessionP->config.notifyP, 1);
+    TwapiEtwSessionRelease(sessionP); /* Reference held by the thread */
+}
+
+#ifdef _WIN32
+static DWORD WINAPI SessionThreadProc(LPVOID pv)
+{
+    SessionRun((TwapiEtwSession *) pv);
+    return 0;
+}
+#else
+static void *SessionThreadProc(void *pv)
+{
+    SessionRun((TwapiEtwSession *) pv);
+    return NULL;
+}
+#endif
+
+ULONG TwapiEtwSessionStart(const TwapiEtwSessionConfig *configP,
+                           TwapiEtwSession **sessionPP)
+{
+    TwapiEtwSession *sessionP;
+
+    sessionP = SessionAlloc(sizeof(*sessionP));
+    if (sessionP == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+    memset(sessionP, 0, sizeof(*sessionP));
+    sessionP->config = *configP;
+    sessionP->batchP = TwapiEtwBatchNew();
+    if (sessionP->batchP == NULL)
+        goto nomem;
+    if (configP->getFn) {
+        sessionP->schema_cacheP = TwapiTdhCacheNew(configP->schema_cache_size,
+                                                   configP->getFn, NULL);
+        if (sessionP->schema_cacheP == NULL)
+            goto nomem;
+    }
+    if (! SessionCondInit(&sessionP->space))
+        goto nomem;
+    SessionLockInit(&sessionP->lock);
+    sessionP->nrefs = 2;        /* Caller and thread */
+    sessionP->idle = 1;
+    if (sessionP->config.sample_interval == 0)
+        sessionP->config.sample_interval = 1;
+
+#ifdef _WIN32
+    /* Thread does not use the CRT so CreateThread is safe */
+    sessionP->thread = CreateThread(NULL, 0, SessionThreadProc, sessionP, 0, NULL);
+    if (sessionP->thread == NULL) {
+        ULONG winerr = GetLastError();
+        SessionCondDelete(&sessionP->space);
+        SessionLockDelete(&sessionP->lock);
+        TwapiEtwBatchRelease(sessionP->batchP);
+        if (sessionP->schema_cacheP)
+            TwapiTdhCacheFree(sessionP->schema_cacheP);
+        SessionFree(sessionP);
+        return winerr;
+    }
+#else
+    if (pthread_create(&sessionP->thread, NULL, SessionThreadProc, sessionP) != 0) {
+        SessionCondDelete(&sessionP->space);
+        SessionLockDelete(&sessionP->lock);
+        TwapiEtwBatchRelease(sessionP->batchP);
+        if (sessionP->schema_cacheP)
+            TwapiTdhCacheFree(sessionP->schema_cacheP);
+        SessionFree(sessionP);
+        return ERROR_NOT_ENOUGH_MEMORY;
+    }
+#endif
+    *sessionPP = sessionP;
+    return ERROR_SUCCESS;
+
+nomem:
+    if (sessionP->batchP)
+        TwapiEtwBatchRelease(sessionP->batchP);
+    if (sessionP->schema_cacheP)
+        TwapiTdhCacheFree(sessionP->schema_cacheP);
+    SessionFree(sessionP);
+    return ERROR_NOT_ENOUGH_MEMORY;
+}
+
+ULONG TwapiEtwSessionEvent(TwapiEtwSession *sessionP,
+                           const EVENT_RECORD *evrP, ULONG pointer_size)
+{
+    TwapiTdhSchema *schemaP;
+    ULONG winerr;
+
+    if (sessionP->batchP == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY; /* See TwapiEtwSessionBufferDone */
+    if (TwapiEtwBatchCount(sessionP->batchP) == 0)
+        sessionP->buffer_start = TwapiEtwSessionClock();
+    winerr = TwapiEtwBatchAppend(sessionP->batchP, evrP, pointer_size);
+    if (winerr != ERROR_SUCCESS) {
+        SessionLockEnter(&sessionP->lock);
+        sessionP->stats.dropped_events += 1;
+        SessionLockLeave(&sessionP->lock);
+        return winerr;
+    }
+    if (sessionP->schema_cacheP == NULL)
+        return ERROR_SUCCESS;
+
+    if (evrP->EventHeader.Flags & EVENT_HEADER_FLAG_32_BIT_HEADER)
+        pointer_size = 4;
+    else if (evrP->EventHeader.Flags & EVENT_HEADER_FLAG_64_BIT_HEADER)
+        pointer_size = 8;
+    schemaP = TwapiTdhCacheGet(sessionP->schema_cacheP,
+                               (EVENT_RECORD *) evrP, pointer_size);
+    /* Uncacheable events are looked up by the consumer */
+    if (schemaP == NULL)
+        return ERROR_SUCCESS;
+    return TwapiEtwBatchSetSchema(sessionP->batchP, schemaP);
+}
+
+int TwapiEtwSessionBufferDone(TwapiEtwSession *sessionP,
+                              ULONG timer_resolution, int private_session,
+                              void *bufferP)
+{
+    TwapiEtwBatch *batchP;
+    TwapiTdhCacheStats cache_stats;
+    SessionEntry *entryP, *droppedP;
+    ULONGLONG decode_time, start;
+    ULONG max_depth;
+    int notify;
+
+    batchP = sessionP->batchP;
+    if (batchP == NULL)
+        return 0;
+    TwapiEtwBatchSetTiming(batchP, timer_resolution, private_session);
+    TwapiEtwBatchSeal(batchP);
+    decode_time = 0;
+    if (TwapiEtwBatchCount(batchP))
+        decode_time = TwapiEtwSessionClock() - sessionP->buffer_start;
+    sessionP->batchP = TwapiEtwBatchNew();
+
+    entryP = SessionAlloc(sizeof(*entryP));
+    if (entryP == NULL) {
+        /* Out of memory. Drop the buffer and stop the source. */
+        SessionLockEnter(&sessionP->lock);
+        sessionP->stats.buffers += 1;
+        sessionP->stats.events += TwapiEtwBatchCount(batchP);
+        sessionP->stats.dropped_buffers += 1;
+        sessionP->stats.dropped_events += TwapiEtwBatchCount(batchP);
+        SessionLockLeave(&sessionP->lock);
+        TwapiEtwBatchRelease(batchP);
+        if (sessionP->config.discardFn)
+            sessionP->config.discardFn(bufferP);
+        return 0;
+    }
+    entryP->nextP = NULL;
+    entryP->batchP = batchP;
+    entryP->bufferP = bufferP;
+    max_depth = sessionP->config.max_queue_depth;
+    droppedP = NULL;
+    notify = 0;
+
+    SessionLockEnter(&sessionP->lock);
+    sessionP->stats.buffers += 1;
+    sessionP->stats.events += TwapiEtwBatchCount(batchP);
+    sessionP->stats.bytes += TwapiEtwBatchSize(batchP);
+    sessionP->stats.decode_time += decode_time;
+    if (sessionP->schema_cacheP) {
+        TwapiTdhCacheGetStats(sessionP->schema_cacheP, &cache_stats);
+        sessionP->stats.tdh_calls = cache_stats.tdh_calls;
+    }
+
+    if (max_depth && sessionP->stats.queue_depth >= max_depth) {
+        switch (sessionP->config.overflow) {
+        case TWAPI_ETW_OVERFLOW_BLOCK:
+            start = TwapiEtwSessionClock();
+            while (! sessionP->stop && sessionP->stats.queue_depth >= max_depth)
+                SessionCondWait(&sessionP->space, &sessionP->lock);
+            sessionP->stats.blocked_time += TwapiEtwSessionClock() - start;
+            if (sessionP->stop)
+                droppedP = entryP;
+            break;
+        case TWAPI_ETW_OVERFLOW_SAMPLE:
+            if (++sessionP->overflows % sessionP->config.sample_interval) {
+                droppedP = entryP;
+                break;
+            }
+            /* FALLTHRU */
+        case TWAPI_ETW_OVERFLOW_DROP_OLDEST:
+            droppedP = sessionP->headP;
+            sessionP->headP = droppedP->nextP;
+            if (sessionP->headP == NULL)
+                sessionP->tailP = NULL;
+            droppedP->nextP = NULL;
+            sessionP->stats.queue_depth -= 1;
+            break;
+        case TWAPI_ETW_OVERFLOW_DROP_NEWEST:
+        default:
+            droppedP = entryP;
+            break;
+        }
+    }
+
+    if (droppedP)
+        SessionCountDropped(sessionP, droppedP);
+    if (droppedP != entryP) {
+        if (sessionP->tailP)
+            sessionP->tailP->nextP = entryP;
+        else
+            sessionP->headP = entryP;
+        sessionP->tailP = entryP;
+        if (++sessionP->stats.queue_depth > sessionP->stats.max_queue_depth)
+            sessionP->stats.max_queue_depth = sessionP->stats.queue_depth;
+        if (sessionP->idle) {
+            sessionP->idle = 0;
+            notify = 1;
+        }
+    }
+    SessionLockLeave(&sessionP->lock);
+
+    if (droppedP)
+        SessionDiscard(sessionP, droppedP);
+    if (notify)
+        sessionP->config.notifyFn(sessionP->config.notifyP, 0);
+    /* Checked after notifying so the consumer can stop the source */
+    return !TwapiEtwSessionStopping(sessionP) && sessionP->batchP != NULL;
+}
+
+int TwapiEtwSessionNext(TwapiEtwSession *sessionP, TwapiEtwBatch **batchPP,
+                        void **bufferPP, ULONG *winerrP)
+{
+    SessionEntry *entryP, *droppedP;
+    int status;
+
+    droppedP = NULL;
+    SessionLockEnter(&sessionP->lock);
+    if (sessionP->stop && sessionP->headP) {
+        droppedP = sessionP->headP;
+        sessionP->headP = sessionP->tailP = NULL;
+        sessionP->stats.queue_depth = 0;
+        SessionCountDropped(sessionP, droppedP);
+    }
+    entryP = sessionP->headP;
+    if (entryP) {
+        sessionP->headP = entryP->nextP;
+        if (sessionP->headP == NULL)
+            sessionP->tailP = NULL;
+        sessionP->stats.queue_depth -= 1;
+        SessionCondSignal(&sessionP->space);
+        status = 1;
+    } else if (sessionP->done) {
+        *winerrP = sessionP->winerr;
+        status = -1;
+    } else {
+        sessionP->idle = 1;
+        status = 0;
+    }
+    SessionLockLeave(&sessionP->lock);
+
+    if (droppedP)
+        SessionDiscard(sessionP, droppedP);
+    if (entryP) {
+        *batchPP = entryP->batchP;
+        *bufferPP = entryP->bufferP;
+        SessionFree(entryP);
+    }
+    return status;
+}
+
+void TwapiEtwSessionLost(TwapiEtwSession *sessionP, ULONG events_lost,
+                         ULONG buffers_lost)
+{
+    SessionLockEnter(&sessionP->lock);
+    sessionP->stats.events_lost = events_lost;
+    sessionP->stats.buffers_lost = buffers_lost;
+    SessionLockLeave(&sessionP->lock);
+}
+
+void TwapiEtwSessionConsumed(TwapiEtwSession *sessionP, ULONG nevents,
+                             ULONGLONG callback_time, int dropped)
+{
+    SessionLockEnter(&sessionP->lock);
+    sessionP->stats.callback_time += callback_time;
+    if (dropped) {
+        sessionP->stats.dropped_buffers += 1;
+        sessionP->stats.dropped_events += nevents;
+    }
+    SessionLockLeave(&sessionP->lock);
+}
+
+ULONGLONG TwapiEtwSessionClock(void)
+{
+#ifdef _WIN32
+    static LARGE_INTEGER freq; /* Fixed at system boot */
+    LARGE_INTEGER now;
+
+    QueryPerformanceCounter(&now);
+    if (freq.QuadPart == 0)
+        QueryPerformanceFrequency(&freq);
+    /* Split to avoid overflow */
+    return (now.QuadPart / freq.QuadPart) * 1000000
+        + ((now.QuadPart % freq.QuadPart) * 1000000) / freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ULONGLONG) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+void TwapiEtwSessionStop(TwapiEtwSession *sessionP)
+{
+    SessionLockEnter(&sessionP->lock);
+    sessionP->stop = 1;
+    SessionCondSignal(&sessionP->space);
+    SessionLockLeave(&sessionP->lock);
+}
+
+int TwapiEtwSessionStopping(TwapiEtwSession *sessionP)
+{
+    int stop;
+
+    SessionLockEnter(&sessionP->lock);
+    stop = sessionP->stop;
+    SessionLockLeave(&sessionP->lock);
+    return stop;
+}
+
+void TwapiEtwSessionWait(TwapiEtwSession *sessionP)
+{
+    if (sessionP->joined)
+        return;
+#ifdef _WIN32
+    WaitForSingleObject(sessionP->thread, INFINITE);
+#else
+    pthread_join(sessionP->thread, NULL);
+#endif
+    sessionP->joined = 1;
+}
+
+void TwapiEtwSessionGetStats(TwapiEtwSession *sessionP,
+                             TwapiEtwSessionStats *statsP)
+{
+    SessionLockEnter(&sessionP->lock);
+    *statsP = sessionP->stats;
+    SessionLockLeave(&sessionP->lock);
+}
@@ -0,0 +1,183 @@
+#ifndef TWAPI_ETWSESSION_H
+#define TWAPI_ETWSESSION_H
+
+/*
+ * Consumer sessions that collect events on a thread of their own so
+ * that any number of traces can be processed at the same time without
+ * blocking the interpreter. A session thread runs the event source,
+ * normally ProcessTrace, which feeds events to the session one at a
+ * time. These are copied into a batch, resolving the schema of each
+ * through a cache private to the session so that TDH lookups are also
+ * done on the session thread. At the end of each buffer the sealed
+ * batch is put on the session's queue and the consumer, normally the
+ * interpreter, notified to take it with TwapiEtwSessionNext.
+ *
+ * The queue may be bounded so that a consumer that cannot keep up with
+ * a real time trace does not use up memory. When it is full, the session
+ * thread either waits for the consumer, which holds up ProcessTrace
+ * until ETW itself starts losing buffers, or discards buffers as per
+ * the overflow policy of the session.
+ *
+ * Builds standalone without Tcl or TWAPI when ETW_STANDALONE is defined,
+ * in which case the definitions come from etwtypes.h and threads are
+ * created with pthreads on platforms other than Windows.
+ */
+
+#ifdef ETW_STANDALONE
+# include "etwtypes.h"
+#endif
+
+#include "tdhcache.h"
+#include "etwbatch.h"
+
+typedef struct _TwapiEtwSession TwapiEtwSession;
+
+/*
+ * Run on the session thread. Passes events to TwapiEtwSessionEvent and
+ * calls TwapiEtwSessionBufferDone at the end of each buffer until there
+ * are no more events or TwapiEtwSessionBufferDone returns 0. Returns
+ * ERROR_SUCCESS or a Win32 error code.
+ */
+typedef ULONG TwapiEtwSessionSourceFn(TwapiEtwSession *sessionP, void *sourceP);
+
+/*
+ * Called on the session thread when a buffer is queued while the
+ * consumer is idle, i.e. since TwapiEtwSessionNext last returned 0. The
+ * consumer should then call TwapiEtwSessionNext until it returns 0 or
+ * -1. Called one last time with final set once the source is done, after
+ * which the session no longer refers to notifyP. Must not block.
+ */
+typedef void TwapiEtwSessionNotifyFn(void *notifyP, int final);
+
+/*
+ * Frees the bufferP given to TwapiEtwSessionBufferDone for a buffer
+ * discarded by the session. May be called on any thread, including
+ * after the consumer has released the session.
+ */
+typedef void TwapiEtwSessionDiscardFn(void *bufferP);
+
+/* What to do with a buffer when the queue is full */
+typedef enum {
+    TWAPI_ETW_OVERFLOW_BLOCK,       /* Wait for the consumer */
+    TWAPI_ETW_OVERFLOW_DROP_OLDEST, /* Discard the oldest queued buffer */
+    TWAPI_ETW_OVERFLOW_DROP_NEWEST, /* Discard the buffer */
+    /*
+     * Discard the buffer except for one in every sample_interval, which
+     * replaces the oldest queued buffer instead, so that a consumer that
+     * is behind still sees buffers from across the overload.
+     */
+    TWAPI_ETW_OVERFLOW_SAMPLE
+} TwapiEtwSessionOverflow;
+
+typedef struct _TwapiEtwSessionConfig {
+    TwapiEtwSessionSourceFn *sourceFn;
+    void *sourceP;
+    TwapiEtwSessionNotifyFn *notifyFn;
+    void *notifyP;
+    TwapiEtwSessionDiscardFn *discardFn; /* May be NULL */
+    /* Schemas are not resolved if getFn is NULL */
+    TwapiTdhGetEventInformationFn *getFn;
+    size_t schema_cache_size;
+    ULONG max_queue_depth;      /* Buffers, 0 if unbounded */
+    TwapiEtwSessionOverflow overflow;
+    ULONG sample_interval;      /* For TWAPI_ETW_OVERFLOW_SAMPLE */
+} TwapiEtwSessionConfig;
+
+/*
+ * Counters for a session. Times are in microseconds. The queue depth
+ * shows how far the consumer is behind the session thread.
+ */
+typedef struct _TwapiEtwSessionStats {
+    ULONGLONG events;           /* Read by the session thread */
+    ULONGLONG buffers;          /* Read by the session thread */
+    ULONGLONG bytes;            /* Size of the batches read */
+    ULONGLONG tdh_calls;        /* Made on the session thread */
+    /*
+     * Session thread time from the first event of each buffer to its
+     * end, covering the parsing of the buffer by the source, copying of
+     * events and resolution of schemas.
+     */
+    ULONGLONG decode_time;
+    ULONGLONG callback_time;    /* Consumer time spent on buffers */
+    ULONGLONG blocked_time;     /* Session thread waiting for queue space */
+    ULONG queue_depth;          /* Buffers queued and not yet taken */
+    ULONG max_queue_depth;
+    ULONGLONG dropped_events;   /* Discarded or not copied */
+    ULONGLONG dropped_buffers;  /* Discarded on overflow, stop or by consumer */
+    ULONG events_lost;          /* As reported by ETW for the trace */
+    ULONG buffers_lost;
+} TwapiEtwSessionStats;
+
+/*
+ * Starts a session thread running configP->sourceFn. On success stores
+ * the session, holding one reference for the caller, in *sessionPP.
+ */
+ULONG TwapiEtwSessionStart(const TwapiEtwSessionConfig *configP,
+                           TwapiEtwSession **sessionPP);
+
+/*
+ * Called by the source. Copies the event into the batch for the current
+ * buffer. pointer_size is as for TwapiEtwBatchAppend.
+ */
+ULONG TwapiEtwSessionEvent(TwapiEtwSession *sessionP,
+                           const EVENT_RECORD *evrP, ULONG pointer_size);
+
+/*
+ * Called by the source at the end of each buffer. Queues the batch
+ * along with bufferP, applying the overflow policy if the queue is full.
+ * Returns 0 if the source should stop, either because TwapiEtwSessionStop
+ * was called or because memory could not be allocated.
+ */
+int TwapiEtwSessionBufferDone(TwapiEtwSession *sessionP,
+                              ULONG timer_resolution, int private_session,
+                              void *bufferP);
+
+/*
+ * Called by the source with the number of events and buffers ETW reports
+ * as lost for the trace, e.g. from the log file header.
+ */
+void TwapiEtwSessionLost(TwapiEtwSession *sessionP, ULONG events_lost,
+                         ULONG buffers_lost);
+
+/*
+ * Called by the consumer. Takes the oldest buffer off the queue, storing
+ * its batch, whose reference passes to the caller, in *batchPP and its
+ * bufferP in *bufferPP, and returns 1. Returns 0 if the queue is empty,
+ * in which case the consumer is notified when a buffer is next queued.
+ * Returns -1 once the source is done and the queue empty, storing the
+ * error code returned by the source in *winerrP. If the session has been
+ * stopped, queued buffers are discarded.
+ */
+int TwapiEtwSessionNext(TwapiEtwSession *sessionP, TwapiEtwBatch **batchPP,
+                        void **bufferPP, ULONG *winerrP);
+
+/*
+ * Called by the consumer, from any thread, when it is done with a batch
+ * of nevents events. callback_time is the time it spent on the batch. If
+ * dropped is non-0, the batch was discarded unseen.
+ */
+void TwapiEtwSessionConsumed(TwapiEtwSession *sessionP, ULONG nevents,
+                             ULONGLONG callback_time, int dropped);
+
+/* Monotonic clock in microseconds for measuring callback_time */
+ULONGLONG TwapiEtwSessionClock(void);
+
+/*
+ * May be called from any thread. The source is stopped at the end of
+ * the current buffer, or at once if it is waiting for queue space. Real
+ * time sources that are waiting for events must also be woken up, e.g.
+ * by closing the trace.
+ */
+void TwapiEtwSessionStop(TwapiEtwSession *sessionP);
+int TwapiEtwSessionStopping(TwapiEtwSession *sessionP);
+
+/* Waits for the session thread to finish. The caller must hold a reference. */
+void TwapiEtwSessionWait(TwapiEtwSession *sessionP);
+
+void TwapiEtwSessionGetStats(TwapiEtwSession *sessionP,
+                             TwapiEtwSessionStats *statsP);
+
+void TwapiEtwSessionRetain(TwapiEtwSession *sessionP);
+void TwapiEtwSessionRelease(TwapiEtwSession *sessionP);
+
+#endif
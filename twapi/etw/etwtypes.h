@@ -0,0 +1,49 @@
+#ifndef TWAPI_ETWTYPES_H
+#define TWAPI_ETWTYPES_H
+
+/*
+ * Windows and event record definitions for the standalone builds
+ * (ETW_STANDALONE) of the ETW helpers that do not depend on Tcl or
+ * TWAPI, so they can be tested and benchmarked on any platform.
+ */
+
+#ifdef _WIN32
+# include <windows.h>
+# include <evntrace.h>
+# include <tdh.h>
+#else
+# include <stddef.h>
+# define __stdcall
+typedef unsigned char UCHAR, BYTE, *PBYTE;
+typedef unsigned short USHORT, WCHAR, *LPWSTR;
+typedef unsigned int ULONG, DWORD;
+typedef long long LONGLONG;
+typedef unsigned long long ULONGLONG, ULONG64;
+typedef void *PVOID;
+typedef union _LARGE_INTEGER {
+    long long QuadPart;
+} LARGE_INTEGER;
+typedef struct _GUID {
+    ULONG Data1;
+    USHORT Data2;
+    USHORT Data3;
+    UCHAR Data4[8];
+} GUID;
+typedef struct _ETW_BUFFER_CONTEXT {
+    UCHAR ProcessorNumber;
+    UCHAR Alignment;
+    USHORT LoggerId;
+} ETW_BUFFER_CONTEXT, *PETW_BUFFER_CONTEXT;
+# define ANYSIZE_ARRAY 1
+# define ERROR_SUCCESS 0
+# define ERROR_NOT_ENOUGH_MEMORY 8
+# define ERROR_BAD_FORMAT 11
+# define ERROR_HANDLE_EOF 38
+# define ERROR_INVALID_PARAMETER 87
+# define ERROR_INSUFFICIENT_BUFFER 122
+# define ERROR_NO_MORE_ITEMS 259
+# define ERROR_NOT_FOUND 1168
+# include "tdhdefs.h"
+#endif
+
+#endif
@@ -0,0 +1,522 @@
+/*
+ * Copyright (c) 2018, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ */
+
+/*
+ * Formats events straight into an output buffer for etw_dump_to_file
+ * instead of building a list, a dictionary and a CSV line for every
+ * event in Tcl. Fields are quoted or escaped as they are copied and
+ * the buffer is only handed to the channel when it fills.
+ */
+
+#ifdef ETW_STANDALONE
+# include <stdlib.h>
+# define WriterAlloc(n_) malloc(n_)
+# define WriterRealloc(p_, n_) realloc((p_), (n_))
+# define WriterFree(p_) free(p_)
+#else
+# include "twapi.h"
+# define WriterAlloc(n_) TwapiAlloc(n_)
+# define WriterRealloc(p_, n_) TwapiReallocTry((p_), (n_))
+# define WriterFree(p_) TwapiFree(p_)
+#endif
+
+#include <string.h>
+
+#include "etwwriter.h"
+
+/* Large enough for any escape sequence or formatted integer */
+#define WRITER_MIN_BUFFER 256
+
+struct _TwapiEtwWriter {
+    TwapiEtwWriterFormat format;
+    char separator;
+    int nfields;
+    int field;                  /* Index of next field in the current row */
+    ULONGLONG rows;
+    TwapiEtwWriterFlushFn *flushFn;
+    void *flushP;
+    const char **names;         /* Field names as given */
+    const char **keys;          /* JSON "name": prefixes, already escaped */
+    size_t *key_lens;
+    char *scratchP;             /* Expanded messages */
+    size_t scratch_size;
+    size_t used;
+    size_t size;
+    char *bufP;
+};
+
+/*
+ * Returns the length of the first len bytes of bufP without a trailing
+ * UTF-8 sequence that is not yet complete.
+ */
+static size_t WriterCompleteLength(const char *bufP, size_t len)
+{
+    size_t i, need;
+    unsigned char c;
+
+    for (i = len; i > 0 && len - i < 4; ) {
+        c = (unsigned char) bufP[--i];
+        if ((c & 0xC0) == 0x80)
+            continue;           /* Continuation byte */
+        if (c < 0xC0)
+            return len;
+        need = c >= 0xF0 ? 4 : (c >= 0xE0 ? 3 : 2);
+        return len - i >= need ? len : i;
+    }
+    return len;                 /* Not UTF-8, nothing to hold back */
+}
+
+/*
+ * Passes the buffered output to the flush callback. Unless all is set,
+ * a character whose bytes are still being added is kept back for the
+ * next flush since the callback may write it with Tcl_WriteChars which
+ * stops at an incomplete character.
+ */
+static ULONG WriterDrain(TwapiEtwWriter *writerP, int all)
+{
+    ULONG winerr;
+    size_t n;
+
+    n = all ? writerP->used : WriterCompleteLength(writerP->bufP, writerP->used);
+    if (n == 0)
+        return ERROR_SUCCESS;
+    winerr = writerP->flushFn(writerP->flushP, writerP->bufP, n);
+    if (winerr != ERROR_SUCCESS) {
+        writerP->used = 0;
+        return winerr;
+    }
+    writerP->used -= n;
+    memmove(writerP->bufP, writerP->bufP + n, writerP->used);
+    return ERROR_SUCCESS;
+}
+
+static ULONG WriterPut(TwapiEtwWriter *writerP, const char *s, size_t n)
+{
+    size_t room;
+    ULONG winerr;
+
+    while (n > (room = writerP->size - writerP->used)) {
+        memcpy(writerP->bufP + writerP->used, s, room);
+        writerP->used += room;
+        s += room;
+        n -= room;
+        winerr = WriterDrain(writerP, 0);
+        if (winerr != ERROR_SUCCESS)
+            return winerr;
+    }
+    memcpy(writerP->bufP + writerP->used, s, n);
+    writerP->used += n;
+    return ERROR_SUCCESS;
+}
+
+static ULONG WriterPutc(TwapiEtwWriter *writerP, char c)
+{
+    if (writerP->used == writerP->size) {
+        ULONG winerr = WriterDrain(writerP, 0);
+        if (winerr != ERROR_SUCCESS)
+            return winerr;
+    }
+    writerP->bufP[writerP->used++] = c;
+    return ERROR_SUCCESS;
+}
+
+/* Quotes the string as csv::join does, only if it needs quoting */
+static ULONG WriterPutCsv(TwapiEtwWriter *writerP, const char *s, size_t len)
+{
+    const char *endP = s + len;
+    const char *p;
+    ULONG winerr;
+
+    for (p = s; p < endP; ++p) {
+        if (*p == '"' || *p == '\r' || *p == '\n' || *p == writerP->separator)
+            break;
+    }
+    if (p == endP)
+        return WriterPut(writerP, s, len);
+
+    if ((winerr = WriterPutc(writerP, '"')) != ERROR_SUCCESS)
+        return winerr;
+    while ((p = memchr(s, '"', endP - s)) != NULL) {
+        /* Include the quote and then double it */
+        if ((winerr = WriterPut(writerP, s, p - s + 1)) != ERROR_SUCCESS
+            || (winerr = WriterPutc(writerP, '"')) != ERROR_SUCCESS)
+            return winerr;
+        s = p + 1;
+    }
+    if ((winerr = WriterPut(writerP, s, endP - s)) != ERROR_SUCCESS)
+        return winerr;
+    return WriterPutc(writerP, '"');
+}
+
+/*
+ * Writes a quoted JSON string. Tcl's internal encoding represents a null
+ * character as the bytes C0 80, which must become \u0000 as well.
+ */
+static ULONG WriterPutJson(TwapiEtwWriter *writerP, const char *s, size_t len)
+{
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char *p = (const unsigned char *) s;
+    const unsigned char *endP = p + len;
+    const unsigned char *runP;
+    char esc[6];
+    size_t esclen;
+    ULONG winerr;
+
+    if ((winerr = WriterPutc(writerP, '"')) != ERROR_SUCCESS)
+        return winerr;
+    while (p < endP) {
+        runP = p;
+        while (p < endP && *p >= 0x20 && *p != '"' && *p != '\\'
+               && !(*p == 0xC0 && p + 1 < endP && p[1] == 0x80))
+            ++p;
+        if (p > runP &&
+            (winerr = WriterPut(writerP, (const char *) runP, p - runP)) != ERROR_SUCCESS)
+            return winerr;
+        if (p == endP)
+            break;
+        esc[0] = '\\';
+        esclen = 2;
+        switch (*p) {
+        case '"': esc[1] = '"'; break;
+        case '\\': esc[1] = '\\'; break;
+        case '\n': esc[1] = 'n'; break;
+        case '\r': esc[1] = 'r'; break;
+        case '\t': esc[1] = 't'; break;
+        default:
+            if (*p == 0xC0)
+                ++p;            /* Null, skip the first of its two bytes */
+            esc[1] = 'u';
+            esc[2] = '0';
+            esc[3] = '0';
+            esc[4] = hex[(*p & 0x80 ? 0 : *p) >> 4];
+            esc[5] = hex[(*p & 0x80 ? 0 : *p) & 0xf];
+            esclen = 6;
+            break;
+        }
+        if ((winerr = WriterPut(writerP, esc, esclen)) != ERROR_SUCCESS)
+            return winerr;
+        ++p;
+    }
+    return WriterPutc(writerP, '"');
+}
+
+/* Writes whatever precedes the value of the next field */
+static ULONG WriterBeginField(TwapiEtwWriter *writerP)
+{
+    int field = writerP->field;
+    ULONG winerr;
+
+    if (field >= writerP->nfields)
+        return ERROR_INVALID_PARAMETER;
+    writerP->field += 1;
+    if (writerP->format == TWAPI_ETW_WRITER_CSV)
+        return field ? WriterPutc(writerP, writerP->separator) : ERROR_SUCCESS;
+
+    winerr = WriterPutc(writerP, field ? ',' : '{');
+    if (winerr != ERROR_SUCCESS)
+        return winerr;
+    return WriterPut(writerP, writerP->keys[field], writerP->key_lens[field]);
+}
+
+/* Returns the escaped "name": prefix of a JSON member, or NULL if out of memory */
+static char *WriterMakeKey(const char *name, size_t *lenP)
+{
+    const char *p;
+    char *keyP, *q;
+
+    if (*name == '-')
+        ++name;
+    /* Worst case every character becomes \u00XX */
+    keyP = WriterAlloc(6 * strlen(name) + 4);
+    if (keyP == NULL)
+        return NULL;
+    q = keyP;
+    *q++ = '"';
+    for (p = name; *p; ++p) {
+        if (*p == '"' || *p == '\\') {
+            *q++ = '\\';
+            *q++ = *p;
+        } else if ((unsigned char) *p < 0x20) {
+            static const char hex[] = "0123456789abcdef";
+            *q++ = '\\';
+            *q++ = 'u';
+            *q++ = '0';
+            *q++ = '0';
+            *q++ = hex[(unsigned char) *p >> 4];
+            *q++ = hex[*p & 0xf];
+        } else
+            *q++ = *p;
+    }
+    *q++ = '"';
+    *q++ = ':';
+    *lenP = q - keyP;
+    return keyP;
+}
+
+TwapiEtwWriter *TwapiEtwWriterNew(TwapiEtwWriterFormat format, char separator,
+                                  int nfields, const char * const *names,
+                                  size_t buffer_size,
+                                  TwapiEtwWriterFlushFn *flushFn, void *flushP)
+{
+    TwapiEtwWriter *writerP;
+    size_t len;
+    int i;
+
+    if (buffer_size < WRITER_MIN_BUFFER)
+        buffer_size = WRITER_MIN_BUFFER;
+    writerP = WriterAlloc(sizeof(*writerP));
+    if (writerP == NULL)
+        return NULL;
+    memset(writerP, 0, sizeof(*writerP));
+    writerP->format = format;
+    writerP->separator = separator;
+    writerP->nfields = nfields;
+    writerP->flushFn = flushFn;
+    writerP->flushP = flushP;
+    writerP->size = buffer_size;
+    writerP->bufP = WriterAlloc(buffer_size);
+    writerP->names = WriterAlloc((nfields ? nfields : 1) * sizeof(*writerP->names));
+    writerP->keys = WriterAlloc((nfields ? nfields : 1) * sizeof(*writerP->keys));
+    writerP->key_lens = WriterAlloc((nfields ? nfields : 1) * sizeof(*writerP->key_lens));
+    if (writerP->bufP == NULL || writerP->names == NULL
+        || writerP->keys == NULL || writerP->key_lens == NULL)
+        goto nomem;
+    memset((void *) writerP->names, 0, (nfields ? nfields : 1) * sizeof(*writerP->names));
+    memset((void *) writerP->keys, 0, (nfields ? nfields : 1) * sizeof(*writerP->keys));
+
+    for (i = 0; i < nfields; ++i) {
+        len = strlen(names[i]) + 1;
+        writerP->names[i] = WriterAlloc(len);
+        if (writerP->names[i] == NULL)
+            goto nomem;
+        memcpy((char *) writerP->names[i], names[i], len);
+        writerP->keys[i] = WriterMakeKey(names[i], &writerP->key_lens[i]);
+        if (writerP->keys[i] == NULL)
+            goto nomem;
+    }
+    return writerP;
+
+nomem:
+    TwapiEtwWriterFree(writerP);
+    return NULL;
+}
+
+void TwapiEtwWriterFree(TwapiEtwWriter *writerP)
+{
+    int i;
+
+    for (i = 0; i < writerP->nfields; ++i) {
+        if (writerP->names && writerP->names[i])
+            WriterFree((void *) writerP->names[i]);
+        if (writerP->keys && writerP->keys[i])
+            WriterFree((void *) writerP->keys[i]);
+    }
+    if (writerP->names)
+        WriterFree((void *) writerP->names);
+    if (writerP->keys)
+        WriterFree((void *) writerP->keys);
+    if (writerP->key_lens)
+        WriterFree(writerP->key_lens);
+    if (writerP->scratchP)
+        WriterFree(writerP->scratchP);
+    if (writerP->bufP)
+        WriterFree(writerP->bufP);
+    WriterFree(writerP);
+}
+
+ULONG TwapiEtwWriterHeader(TwapiEtwWriter *writerP)
+{
+    ULONG winerr;
+    int i;
+
+    if (writerP->format != TWAPI_ETW_WRITER_CSV)
+        return ERROR_SUCCESS;
+    for (i = 0; i < writerP->nfields; ++i) {
+        if (i && (winerr = WriterPutc(writerP, writerP->separator)) != ERROR_SUCCESS)
+            return winerr;
+        winerr = WriterPutCsv(writerP, writerP->names[i], strlen(writerP->names[i]));
+        if (winerr != ERROR_SUCCESS)
+            return winerr;
+    }
+    return WriterPutc(writerP, '\n');
+}
+
+ULONG TwapiEtwWriterString(TwapiEtwWriter *writerP, const char *s, size_t len)
+{
+    ULONG winerr = WriterBeginField(writerP);
+    if (winerr != ERROR_SUCCESS)
+        return winerr;
+    if (writerP->format == TWAPI_ETW_WRITER_CSV)
+        return WriterPutCsv(writerP, s, len);
+    return WriterPutJson(writerP, s, len);
+}
+
+/* Numbers never need quoting in either format */
+static ULONG WriterPutUnsigned(TwapiEtwWriter *writerP, ULONGLONG value, int negative)
+{
+    char digits[24];
+    char *p = digits + sizeof(digits);
+    ULONG winerr;
+
+    winerr = WriterBeginField(writerP);
+    if (winerr != ERROR_SUCCESS)
+        return winerr;
+    do {
+        *--p = (char) ('0' + value % 10);
+        value /= 10;
+    } while (value);
+    if (negative)
+        *--p = '-';
+    return WriterPut(writerP, p, digits + sizeof(digits) - p);
+}
+
+ULONG TwapiEtwWriterInteger(TwapiEtwWriter *writerP, LONGLONG value)
+{
+    if (value < 0)
+        return WriterPutUnsigned(writerP, 0 - (ULONGLONG) value, 1);
+    return WriterPutUnsigned(writerP, (ULONGLONG) value, 0);
+}
+
+ULONG TwapiEtwWriterUnsigned(TwapiEtwWriter *writerP, ULONGLONG value)
+{
+    return WriterPutUnsigned(writerP, value, 0);
+}
+
+static int WriterScratchAppend(TwapiEtwWriter *writerP, size_t *usedP,
+                               const char *s, size_t n)
+{
+    if (n == 0)
+        return 1;
+    if (*usedP + n > writerP->scratch_size) {
+        size_t size = 2 * (*usedP + n) + 64;
+        char *p = WriterRealloc(writerP->scratchP, size);
+        if (p == NULL)
+            return 0;
+        writerP->scratchP = p;
+        writerP->scratch_size = size;
+    }
+    memcpy(writerP->scratchP + *usedP, s, n);
+    *usedP += n;
+    return 1;
+}
+
+ULONG TwapiEtwWriterMessage(TwapiEtwWriter *writerP, const char *fmt, size_t len,
+                            int nparams, const char * const *params,
+                            const size_t *param_lens)
+{
+    size_t i, j, k, used, start;
+    int index;
+    const char *repP;
+    size_t replen;
+
+    used = 0;
+    start = 0;
+    for (i = 0; i + 1 < len; ++i) {
+        if (fmt[i] != '%')
+            continue;
+        if (! WriterScratchAppend(writerP, &used, fmt + start, i - start))
+            return ERROR_NOT_ENOUGH_MEMORY;
+        repP = NULL;
+        replen = 0;
+        j = i + 2;              /* Past the insert */
+        switch (fmt[i+1]) {
+        case '%': repP = "%"; replen = 1; break;
+        case 'r': repP = "\r"; replen = 1; break;
+        case 'n': repP = "\n"; replen = 1; break;
+        case 't': repP = "\t"; replen = 1; break;
+        case '0': break;        /* Suppresses the trailing newline */
+        default:
+            if (fmt[i+1] < '1' || fmt[i+1] > '9') {
+                /* Not an insert, keep the character */
+                repP = fmt + i + 1;
+                replen = 1;
+                break;
+            }
+            index = fmt[i+1] - '0';
+            if (j < len && fmt[j] >= '0' && fmt[j] <= '9')
+                index = 10 * index + (fmt[j++] - '0');
+            /*
+             * The type in !...! is ignored but each * width in it takes
+             * a parameter, so the value follows them. Only this insert
+             * is shifted, the numbers of others are parameter positions.
+             */
+            if (j + 1 < len && fmt[j] == '!' && fmt[j+1] != '!') {
+                for (k = j + 1; k < len && fmt[k] != '!'; ++k)
+                    ;
+                if (k < len) {
+                    for (j = j + 1; j < k; ++j) {
+                        if (fmt[j] == '*')
+                            ++index;
+                    }
+                    j = k + 1;
+                }
+            }
+            /* Inserts are numbered from 1 */
+            if (index - 1 < nparams) {
+                repP = params[index - 1];
+                replen = param_lens[index - 1];
+            }
+            break;
+        }
+        if (replen && ! WriterScratchAppend(writerP, &used, repP, replen))
+            return ERROR_NOT_ENOUGH_MEMORY;
+        start = j;
+        i = j - 1;
+    }
+    if (start < len && ! WriterScratchAppend(writerP, &used, fmt + start, len - start))
+        return ERROR_NOT_ENOUGH_MEMORY;
+    return TwapiEtwWriterString(writerP, writerP->scratchP ? writerP->scratchP : "", used);
+}
+
+ULONG TwapiEtwWriterPairs(TwapiEtwWriter *writerP, int npairs,
+                          const char * const *strs, const size_t *lens)
+{
+    ULONG winerr;
+    int i;
+
+    if (writerP->format != TWAPI_ETW_WRITER_JSONL)
+        return ERROR_INVALID_PARAMETER;
+    winerr = WriterBeginField(writerP);
+    if (winerr != ERROR_SUCCESS)
+        return winerr;
+    if ((winerr = WriterPutc(writerP, '{')) != ERROR_SUCCESS)
+        return winerr;
+    for (i = 0; i < 2 * npairs; i += 2) {
+        if ((i && (winerr = WriterPutc(writerP, ',')) != ERROR_SUCCESS)
+            || (winerr = WriterPutJson(writerP, strs[i], lens[i])) != ERROR_SUCCESS
+            || (winerr = WriterPutc(writerP, ':')) != ERROR_SUCCESS
+            || (winerr = WriterPutJson(writerP, strs[i+1], lens[i+1])) != ERROR_SUCCESS)
+            return winerr;
+    }
+    return WriterPutc(writerP, '}');
+}
+
+ULONG TwapiEtwWriterEndRow(TwapiEtwWriter *writerP)
+{
+    ULONG winerr;
+
+    if (writerP->format == TWAPI_ETW_WRITER_JSONL) {
+        if (writerP->field == 0)
+            winerr = WriterPut(writerP, "{}\n", 3);
+        else
+            winerr = WriterPut(writerP, "}\n", 2);
+    } else
+        winerr = WriterPutc(writerP, '\n');
+    writerP->field = 0;
+    writerP->rows += 1;
+    return winerr;
+}
+
+ULONG TwapiEtwWriterFlush(TwapiEtwWriter *writerP)
+{
+    return WriterDrain(writerP, 1);
+}
+
+ULONGLONG TwapiEtwWriterRows(const TwapiEtwWriter *writerP)
+{
+    return writerP->rows;
+}
@@ -0,0 +1,77 @@
+#ifndef TWAPI_ETWWRITER_H
+#define TWAPI_ETWWRITER_H
+
+/*
+ * Writer that formats decoded events as rows of CSV or as JSON Lines,
+ * one object per event, into a buffer that is passed to a flush callback
+ * whenever it fills. Values are appended one field at a time in the
+ * order of the field names given when the writer is created, and each
+ * row is terminated with TwapiEtwWriterEndRow. All strings are UTF-8
+ * and are quoted or escaped as required by the format.
+ *
+ * Builds standalone without Tcl or TWAPI when ETW_STANDALONE is defined,
+ * in which case the definitions come from etwtypes.h.
+ */
+
+#ifdef ETW_STANDALONE
+# include "etwtypes.h"
+#endif
+
+typedef struct _TwapiEtwWriter TwapiEtwWriter;
+
+typedef enum {
+    TWAPI_ETW_WRITER_CSV,
+    TWAPI_ETW_WRITER_JSONL
+} TwapiEtwWriterFormat;
+
+/*
+ * Called with the buffered output, which always ends on a complete UTF-8
+ * character. Returns ERROR_SUCCESS or an error code which is then
+ * returned by the writer call that caused the flush.
+ */
+typedef ULONG TwapiEtwWriterFlushFn(void *flushP, const char *bytesP, size_t len);
+
+/*
+ * Returns a new writer or NULL if out of memory. names are the field
+ * names, used for the CSV header and, without any leading "-", as JSON
+ * member names. They are copied. separator is only used for CSV.
+ */
+TwapiEtwWriter *TwapiEtwWriterNew(TwapiEtwWriterFormat format, char separator,
+                                  int nfields, const char * const *names,
+                                  size_t buffer_size,
+                                  TwapiEtwWriterFlushFn *flushFn, void *flushP);
+
+/* Frees the writer. Buffered output that was not flushed is discarded. */
+void TwapiEtwWriterFree(TwapiEtwWriter *writerP);
+
+/* Writes the row of field names for CSV. Does nothing for JSON Lines. */
+ULONG TwapiEtwWriterHeader(TwapiEtwWriter *writerP);
+
+/* Each of these appends the value of the next field of the current row */
+ULONG TwapiEtwWriterString(TwapiEtwWriter *writerP, const char *s, size_t len);
+ULONG TwapiEtwWriterInteger(TwapiEtwWriter *writerP, LONGLONG value);
+ULONG TwapiEtwWriterUnsigned(TwapiEtwWriter *writerP, ULONGLONG value);
+
+/*
+ * Appends an event message after replacing its insert sequences with
+ * params the same way as format_message -fmtstring does in base.tcl.
+ */
+ULONG TwapiEtwWriterMessage(TwapiEtwWriter *writerP, const char *fmt, size_t len,
+                            int nparams, const char * const *params,
+                            const size_t *param_lens);
+
+/*
+ * Appends a field made of name value pairs, such as event properties.
+ * Only supported for JSON Lines, where it is written as an object.
+ */
+ULONG TwapiEtwWriterPairs(TwapiEtwWriter *writerP, int npairs,
+                          const char * const *strs, const size_t *lens);
+
+ULONG TwapiEtwWriterEndRow(TwapiEtwWriter *writerP);
+
+/* Passes any buffered output to the flush callback */
+ULONG TwapiEtwWriterFlush(TwapiEtwWriter *writerP);
+
+ULONGLONG TwapiEtwWriterRows(const TwapiEtwWriter *writerP);
+
+#endif
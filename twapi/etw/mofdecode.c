@@ -0,0 +1,275 @@
+/*
+ * Copyright (c) 2018, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ */
+
+/*
+ * Compiled decoders for MOF event data. Every event of a MOF class has
+ * the same field types so rather than converting and switching on the
+ * type list for each event, the list is compiled once into an array of
+ * field readers. Readers for fields of fixed size only need a bounds
+ * check, which covers the bulk of the fields in kernel events.
+ */
+
+#ifdef ETW_STANDALONE
+# include <stdlib.h>
+# define MofAlloc(n_) malloc(n_)
+# define MofFree(p_) free(p_)
+#else
+# include "twapi.h"
+# define MofAlloc(n_) TwapiAlloc(n_)
+# define MofFree(p_) TwapiFree(p_)
+#endif
+
+#include <stddef.h>
+#include <string.h>
+
+#include "mofdecode.h"
+
+#define MOF_STOP    0xfe        /* Type of unknown size, ends the program */
+#define MOF_INVALID 0xff
+
+/*
+ * Readers indexed by MOF type. IMPORTANT: must match the numbering in
+ * _etw_decipher_mof_event_field_type in etw.tcl. Note 14 and 15 decode
+ * as signed and unsigned respectively as they always have.
+ */
+static const TwapiMofOp gMofTypeOps[] = {
+    {MOF_STOP, 0},                      /* 0 - unsupported */
+    {TWAPI_MOF_OP_STRING, 0},           /* 1 - string, stringnullterminated */
+    {TWAPI_MOF_OP_WSTRING, 0},          /* 2 - wstring, wstringnullterminated */
+    {TWAPI_MOF_OP_STRING_COUNTED, 0},   /* 3 - stringcounted */
+    {TWAPI_MOF_OP_STRING_RCOUNTED, 0},  /* 4 - stringreversecounted */
+    {TWAPI_MOF_OP_WSTRING_COUNTED, 0},  /* 5 - wstringcounted */
+    {TWAPI_MOF_OP_WSTRING_RCOUNTED, 0}, /* 6 - wstringreversecounted */
+    {TWAPI_MOF_OP_BOOLEAN, 4},          /* 7 - boolean */
+    {TWAPI_MOF_OP_INT8, 1},             /* 8 - sint8 */
+    {TWAPI_MOF_OP_UINT8, 1},            /* 9 - uint8 */
+    {TWAPI_MOF_OP_CHAR8, 1},            /* 10 - csint8 */
+    {TWAPI_MOF_OP_CHAR8, 1},            /* 11 - cuint8 */
+    {TWAPI_MOF_OP_INT16, 2},            /* 12 - sint16 */
+    {TWAPI_MOF_OP_UINT16, 2},           /* 13 - uint16 */
+    {TWAPI_MOF_OP_INT32, 4},            /* 14 */
+    {TWAPI_MOF_OP_UINT32, 4},           /* 15 */
+    {TWAPI_MOF_OP_INT64, 8},            /* 16 - sint64 */
+    {TWAPI_MOF_OP_UINT64, 8},           /* 17 - uint64 */
+    {TWAPI_MOF_OP_HEX16, 2},            /* 18 - xsint16 */
+    {TWAPI_MOF_OP_HEX16, 2},            /* 19 - xuint16 */
+    {TWAPI_MOF_OP_HEX32, 4},            /* 20 - xsint32 */
+    {TWAPI_MOF_OP_HEX32, 4},            /* 21 - xuint32 */
+    {TWAPI_MOF_OP_HEX64, 8},            /* 22 - xsint64 */
+    {TWAPI_MOF_OP_HEX64, 8},            /* 23 - xuint64 */
+    {TWAPI_MOF_OP_REAL32, 4},           /* 24 - real32 */
+    {TWAPI_MOF_OP_REAL64, 8},           /* 25 - real64 */
+    {MOF_STOP, 0},                      /* 26 - object without qualifier */
+    {TWAPI_MOF_OP_CHAR16, 2},           /* 27 - char16 */
+    {TWAPI_MOF_OP_GUID, 16},            /* 28 - uint8guid */
+    {TWAPI_MOF_OP_GUID, 16},            /* 29 - objectguid */
+    {TWAPI_MOF_OP_IPADDR, 4},           /* 30 - objectipaddr(v4), uint32ipaddr */
+    {TWAPI_MOF_OP_IPADDR6, 16},         /* 31 - objectipaddrv6 */
+    {TWAPI_MOF_OP_VARIANT, 0},          /* 32 - objectvariant */
+    {TWAPI_MOF_OP_SID, 0},              /* 33 - objectsid */
+    {TWAPI_MOF_OP_UINT64, 8},           /* 34 - uint64wmitime */
+    {TWAPI_MOF_OP_UINT64, 8},           /* 35 - objectwmitime */
+    {MOF_INVALID, 0},                   /* 36 */
+    {MOF_INVALID, 0},                   /* 37 */
+    {TWAPI_MOF_OP_PORT, 2},             /* 38 - uint16port */
+    {TWAPI_MOF_OP_PORT, 2},             /* 39 - objectport */
+    {MOF_STOP, 0},                      /* 40 - datetime */
+    {TWAPI_MOF_OP_STRING_REST, 0},      /* 41 - stringnotcounted */
+    {TWAPI_MOF_OP_WSTRING_REST, 0},     /* 42 - wstringnotcounted */
+    {TWAPI_MOF_OP_POINTER, 0},          /* 43 - pointer */
+};
+#define MOF_NTYPES ((int) (sizeof(gMofTypeOps) / sizeof(gMofTypeOps[0])))
+
+/* Min size of a SID. Same as sizeof(SID) on Windows. */
+#define MOF_MIN_SID_SIZE 12
+#define MOF_MAX_SUB_AUTHORITIES 15 /* SID_MAX_SUB_AUTHORITIES */
+
+ULONG TwapiMofCompile(int ntypes, const int *typesP,
+                      TwapiMofProgram **progPP, int *badP)
+{
+    TwapiMofProgram *progP;
+    int i, nops;
+
+    nops = -1;
+    for (i = 0; i < ntypes; ++i) {
+        if (typesP[i] < 0 || typesP[i] >= MOF_NTYPES ||
+            gMofTypeOps[typesP[i]].opcode == MOF_INVALID) {
+            *badP = i;
+            return ERROR_INVALID_PARAMETER;
+        }
+        if (nops < 0 && gMofTypeOps[typesP[i]].opcode == MOF_STOP)
+            nops = i;
+    }
+    if (nops < 0)
+        nops = ntypes;
+
+    progP = MofAlloc(offsetof(TwapiMofProgram, ops)
+                     + (nops ? nops : 1) * sizeof(TwapiMofOp));
+    if (progP == NULL)
+        return ERROR_NOT_ENOUGH_MEMORY;
+    progP->nfields = ntypes;
+    progP->nops = nops;
+    for (i = 0; i < nops; ++i)
+        progP->ops[i] = gMofTypeOps[typesP[i]];
+    *progPP = progP;
+    return ERROR_SUCCESS;
+}
+
+void TwapiMofProgramFree(TwapiMofProgram *progP)
+{
+    MofFree(progP);
+}
+
+/* Counts are in native byte order and not necessarily aligned */
+static ULONG MofReadCount16(const BYTE *p, int reversed)
+{
+    USHORT count;
+    memcpy(&count, p, sizeof(count));
+    if (reversed)
+        count = (USHORT) (((count & 0xff) << 8) | (count >> 8));
+    return count;
+}
+
+int TwapiMofDecode(const TwapiMofProgram *progP, const BYTE *bytesP,
+                   ULONG nbytes, ULONG pointer_size, TwapiMofField *fieldsP)
+{
+    const TwapiMofOp *opP;
+    TwapiMofField *fieldP;
+    const BYTE *p;
+    ULONG pos, remain, eaten, len, n;
+    int i;
+
+    for (i = 0, pos = 0, remain = nbytes;
+         i < progP->nops && remain > 0;
+         ++i, pos += eaten, remain -= eaten) {
+        opP = &progP->ops[i];
+        fieldP = &fieldsP[i];
+        fieldP->opcode = opP->opcode;
+        fieldP->offset = pos;
+
+        if (opP->size) {
+            if (remain < opP->size)
+                break;          /* Data truncation */
+            fieldP->len = eaten = opP->size;
+            continue;
+        }
+
+        p = bytesP + pos;
+        switch (opP->opcode) {
+        case TWAPI_MOF_OP_STRING:
+            /* Events are not always terminated so cannot use strlen */
+            for (len = 0; len < remain && p[len]; ++len)
+                ;
+            fieldP->len = len;
+            eaten = len < remain ? len + 1 : remain;
+            break;
+
+        case TWAPI_MOF_OP_WSTRING:
+            n = remain / sizeof(WCHAR);
+            for (len = 0; len < n && (p[2*len] | p[2*len+1]); ++len)
+                ;
+            fieldP->len = len * sizeof(WCHAR);
+            eaten = len < n ? (len + 1) * sizeof(WCHAR) : remain;
+            break;
+
+        case TWAPI_MOF_OP_STRING_COUNTED:
+        case TWAPI_MOF_OP_STRING_RCOUNTED:
+            if (remain < 2)
+                goto done;      /* Data truncation */
+            len = MofReadCount16(p, opP->opcode == TWAPI_MOF_OP_STRING_RCOUNTED);
+            if (len > remain - 2)
+                len = remain - 2; /* Truncated */
+            fieldP->offset += 2;
+            fieldP->len = len;
+            eaten = len + 2;
+            break;
+
+        case TWAPI_MOF_OP_WSTRING_COUNTED:
+        case TWAPI_MOF_OP_WSTRING_RCOUNTED:
+            if (remain < 2)
+                goto done;      /* Data truncation */
+            /*
+             * Count is of characters, not bytes, as per the Windows 7
+             * SDK docs and sample. TBD - older SDK samples and LogParser
+             * treat it as bytes. No XP MOF seems to use it so maybe moot.
+             */
+            len = MofReadCount16(p, opP->opcode == TWAPI_MOF_OP_WSTRING_RCOUNTED);
+            fieldP->offset += 2;
+            if ((remain - 2) / sizeof(WCHAR) < len) {
+                /* Truncated, use up all */
+                fieldP->len = ((remain - 2) / sizeof(WCHAR)) * sizeof(WCHAR);
+                eaten = remain;
+            } else {
+                fieldP->len = len * sizeof(WCHAR);
+                eaten = fieldP->len + 2;
+            }
+            break;
+
+        case TWAPI_MOF_OP_STRING_REST:
+            fieldP->len = eaten = remain;
+            break;
+
+        case TWAPI_MOF_OP_WSTRING_REST:
+            fieldP->len = (remain / sizeof(WCHAR)) * sizeof(WCHAR);
+            eaten = remain;
+            break;
+
+        case TWAPI_MOF_OP_VARIANT:
+            if (remain < sizeof(ULONG))
+                goto done;      /* Data truncation */
+            memcpy(&len, p, sizeof(ULONG));
+            if (len > remain - sizeof(ULONG))
+                goto done;      /* Data truncation */
+            fieldP->offset += sizeof(ULONG);
+            fieldP->len = len;
+            eaten = len + sizeof(ULONG);
+            break;
+
+        case TWAPI_MOF_OP_SID:
+            if (remain < sizeof(ULONG))
+                goto done;      /* Data truncation */
+            memcpy(&len, p, sizeof(ULONG));
+            if (len == 0) {
+                /* Empty SID */
+                fieldP->len = 0;
+                eaten = sizeof(ULONG);
+                break;
+            }
+            /*
+             * The SID is preceded by a TOKEN_USER structure, aligned to 8
+             * bytes, whose size is twice the pointer size of the system
+             * that logged the event. The ULONG above is part of it.
+             */
+            n = 2 * pointer_size;
+            if (remain < n || remain - n < MOF_MIN_SID_SIZE)
+                goto done;      /* Data truncation */
+            p += n;
+            /* Sanity check - p[0] is Revision, p[1] SubAuthorityCount */
+            if (p[0] != 1 || p[1] > MOF_MAX_SUB_AUTHORITIES)
+                goto done;
+            len = 8 + 4 * p[1];
+            if (len > remain - n)
+                goto done;      /* Bad SID length */
+            fieldP->offset += n;
+            fieldP->len = len;
+            eaten = n + len;
+            break;
+
+        case TWAPI_MOF_OP_POINTER:
+            if (remain < pointer_size)
+                goto done;      /* Data truncation */
+            fieldP->len = eaten = pointer_size;
+            break;
+
+        default:
+            goto done;          /* Cannot happen */
+        }
+    }
+
+done:
+    return i;
+}
@@ -0,0 +1,101 @@
+#ifndef TWAPI_MOFDECODE_H
+#define TWAPI_MOFDECODE_H
+
+/*
+ * Decoder for the user data of MOF (classic) events. The field types of
+ * an event class, as numbered by _etw_decipher_mof_event_field_type in
+ * etw.tcl, are compiled once into a program of field readers. Running
+ * the program over the user data of an event locates each field without
+ * any further interpretation of the type list. Converting the located
+ * fields to values is left to the caller.
+ *
+ * Builds standalone without Tcl or TWAPI when ETW_STANDALONE is defined,
+ * in which case the definitions come from etwtypes.h.
+ */
+
+#ifdef ETW_STANDALONE
+# include "etwtypes.h"
+#endif
+
+/* Field readers. Each names the layout of a field and its value type. */
+typedef enum {
+    TWAPI_MOF_OP_STRING,          /* Nul terminated */
+    TWAPI_MOF_OP_WSTRING,
+    TWAPI_MOF_OP_STRING_COUNTED,  /* Preceded by USHORT byte count */
+    TWAPI_MOF_OP_STRING_RCOUNTED, /* Same but count is big endian */
+    TWAPI_MOF_OP_WSTRING_COUNTED, /* Preceded by USHORT char count */
+    TWAPI_MOF_OP_WSTRING_RCOUNTED,
+    TWAPI_MOF_OP_STRING_REST,     /* Rest of the data */
+    TWAPI_MOF_OP_WSTRING_REST,
+    TWAPI_MOF_OP_BOOLEAN,
+    TWAPI_MOF_OP_INT8,
+    TWAPI_MOF_OP_UINT8,
+    TWAPI_MOF_OP_CHAR8,
+    TWAPI_MOF_OP_INT16,
+    TWAPI_MOF_OP_UINT16,
+    TWAPI_MOF_OP_INT32,
+    TWAPI_MOF_OP_UINT32,
+    TWAPI_MOF_OP_INT64,
+    TWAPI_MOF_OP_UINT64,
+    TWAPI_MOF_OP_HEX16,
+    TWAPI_MOF_OP_HEX32,
+    TWAPI_MOF_OP_HEX64,
+    TWAPI_MOF_OP_REAL32,
+    TWAPI_MOF_OP_REAL64,
+    TWAPI_MOF_OP_CHAR16,
+    TWAPI_MOF_OP_GUID,
+    TWAPI_MOF_OP_IPADDR,
+    TWAPI_MOF_OP_IPADDR6,
+    TWAPI_MOF_OP_VARIANT,         /* Preceded by ULONG byte count */
+    TWAPI_MOF_OP_SID,             /* Preceded by TOKEN_USER */
+    TWAPI_MOF_OP_PORT,
+    TWAPI_MOF_OP_POINTER
+} TwapiMofOpcode;
+
+typedef struct _TwapiMofOp {
+    UCHAR opcode;               /* TwapiMofOpcode */
+    UCHAR size;                 /* Size if fixed and independent of
+                                   pointer size, else 0 */
+} TwapiMofOp;
+
+typedef struct _TwapiMofProgram {
+    int nfields;                /* Number of types compiled */
+    /*
+     * Number of ops. Less than nfields if a type of unknown size, such as
+     * an embedded object, was seen since no field after it can be located.
+     */
+    int nops;
+    TwapiMofOp ops[1];          /* Actually nops entries */
+} TwapiMofProgram;
+
+/* A field located by TwapiMofDecode */
+typedef struct _TwapiMofField {
+    UCHAR opcode;
+    /*
+     * Offset and length in bytes of the value within the event data,
+     * excluding any count, terminator or TOKEN_USER.
+     */
+    ULONG offset;
+    ULONG len;
+} TwapiMofField;
+
+/*
+ * Compiles the field types into *progPP. Returns ERROR_SUCCESS,
+ * ERROR_NOT_ENOUGH_MEMORY, or ERROR_INVALID_PARAMETER with the index of
+ * the bad type stored in *badP if a type is not known.
+ */
+ULONG TwapiMofCompile(int ntypes, const int *typesP,
+                      TwapiMofProgram **progPP, int *badP);
+void TwapiMofProgramFree(TwapiMofProgram *progP);
+
+/*
+ * Locates the fields of the event data, which need not be aligned, in
+ * fieldsP which must have room for progP->nops entries. pointer_size is
+ * that of the system that logged the event. Returns the number of fields
+ * located, which is less than progP->nops if the data is truncated or
+ * malformed.
+ */
+int TwapiMofDecode(const TwapiMofProgram *progP, const BYTE *bytesP,
+                   ULONG nbytes, ULONG pointer_size, TwapiMofField *fieldsP);
+
+#endif
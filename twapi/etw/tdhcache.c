@@ -0,0 +1,338 @@
+/*
+ * Copyright (c) 2018, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ */
+
+/*
+ * Cache of event schemas. TdhGetEventInformation locates the manifest or
+ * MOF class for an event and builds a TRACE_EVENT_INFO from it, which
+ * costs far more than decoding the event itself. Every event with the
+ * same provider, id, version and opcode has the same schema so a trace
+ * with millions of events typically needs only a few dozen lookups.
+ */
+
+#ifdef ETW_STANDALONE
+# include <stdlib.h>
+# define CacheAlloc(n_) malloc(n_)
+# define CacheFree(p_) free(p_)
+#else
+# include "twapi.h"
+# include <evntrace.h>
+# include <ntverp.h>
+# if (VER_PRODUCTBUILD < 7600) || (_WIN32_WINNT <= 0x600)
+#  include "tdhdefs.h"
+# else
+#  include <tdh.h>
+# endif
+# define CacheAlloc(n_) TwapiAlloc(n_)
+# define CacheFree(p_) TwapiFree(p_)
+#endif
+
+#include <string.h>
+
+#include "twapi_lru.h"
+#include "tdhcache.h"
+
+typedef struct _TwapiTdhSchemaKey {
+    GUID provider;
+    USHORT id;
+    UCHAR version;
+    UCHAR opcode;
+    UCHAR level;
+    UCHAR channel;
+    USHORT task;
+    ULONG pointer_size;
+} TwapiTdhSchemaKey;
+
+typedef struct _TwapiTdhCacheEntry {
+    TwapiLruLink link;          /* Must be first */
+    TwapiTdhSchemaKey key;
+    TwapiTdhSchema schema;
+} TwapiTdhCacheEntry;
+
+struct _TwapiTdhCache {
+    TwapiTdhGetEventInformationFn *getFn;
+    TwapiTdhCacheFreeFn *freeFn;
+    TwapiLruTable table;
+    ULONG size_hint;            /* Initial buffer size for TDH calls */
+    TwapiTdhCacheStats stats;
+};
+
+TwapiTdhCache *TwapiTdhCacheNew(size_t maxentries,
+                                TwapiTdhGetEventInformationFn *getFn,
+                                TwapiTdhCacheFreeFn *freeFn)
+{
+    TwapiTdhCache *cacheP;
+
+    cacheP = CacheAlloc(sizeof(*cacheP));
+    if (cacheP == NULL)
+        return NULL;
+    memset(cacheP, 0, sizeof(*cacheP));
+    cacheP->getFn = getFn;
+    cacheP->freeFn = freeFn;
+    cacheP->size_hint = 1000;
+    cacheP->stats.maxentries = maxentries;
+    cacheP->table.nbuckets = TwapiLruBucketCount(maxentries);
+    cacheP->table.bucketsP = CacheAlloc(cacheP->table.nbuckets * sizeof(cacheP->table.bucketsP[0]));
+    if (cacheP->table.bucketsP == NULL) {
+        CacheFree(cacheP);
+        return NULL;
+    }
+    TwapiLruReset(&cacheP->table);
+    return cacheP;
+}
+
+static void TwapiTdhCacheFreeEntry(TwapiTdhCache *cacheP,
+                                   TwapiTdhCacheEntry *entryP)
+{
+    if (entryP->schema.clientP && cacheP->freeFn)
+        cacheP->freeFn(entryP->schema.clientP);
+    cacheP->stats.nbytes -= entryP->schema.tei_size;
+    if (entryP->schema.teiP)
+        CacheFree(entryP->schema.teiP);
+    if (entryP->schema.offsetsP)
+        CacheFree(entryP->schema.offsetsP);
+    CacheFree(entryP);
+}
+
+void TwapiTdhCacheClear(TwapiTdhCache *cacheP)
+{
+    TwapiLruLink *linkP, *nextP;
+
+    for (linkP = cacheP->table.headP; linkP; linkP = nextP) {
+        nextP = linkP->lru_nextP;
+        TwapiTdhCacheFreeEntry(cacheP, (TwapiTdhCacheEntry *) linkP);
+    }
+    TwapiLruReset(&cacheP->table);
+    cacheP->stats.nentries = 0;
+}
+
+void TwapiTdhCacheFree(TwapiTdhCache *cacheP)
+{
+    TwapiTdhCacheClear(cacheP);
+    CacheFree(cacheP->table.bucketsP);
+    CacheFree(cacheP);
+}
+
+void TwapiTdhCacheGetStats(TwapiTdhCache *cacheP, TwapiTdhCacheStats *statsP)
+{
+    *statsP = cacheP->stats;
+}
+
+static size_t TwapiTdhCacheHash(const TwapiTdhSchemaKey *keyP)
+{
+    /* FNV-1a over the key fields. GUIDs of a provider's events only
+       differ in the id, version and opcode so those must be mixed in */
+    const unsigned char *p = (const unsigned char *) &keyP->provider;
+    unsigned int h = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < sizeof(keyP->provider); ++i)
+        h = (h ^ p[i]) * 16777619u;
+    h = (h ^ (keyP->id & 0xff)) * 16777619u;
+    h = (h ^ (keyP->id >> 8)) * 16777619u;
+    h = (h ^ keyP->version) * 16777619u;
+    h = (h ^ keyP->opcode) * 16777619u;
+    h = (h ^ keyP->level) * 16777619u;
+    h = (h ^ keyP->channel) * 16777619u;
+    h = (h ^ (keyP->task & 0xff)) * 16777619u;
+    h = (h ^ (keyP->task >> 8)) * 16777619u;
+    h = (h ^ keyP->pointer_size) * 16777619u;
+    return h;
+}
+
+static int TwapiTdhCacheKeyEqual(const TwapiTdhSchemaKey *aP,
+                                 const TwapiTdhSchemaKey *bP)
+{
+    return aP->id == bP->id && aP->version == bP->version &&
+        aP->opcode == bP->opcode && aP->level == bP->level &&
+        aP->channel == bP->channel && aP->task == bP->task &&
+        aP->pointer_size == bP->pointer_size &&
+        memcmp(&aP->provider, &bP->provider, sizeof(aP->provider)) == 0;
+}
+
+/* Returns the size of a property if it is a scalar of fixed size, else 0 */
+static USHORT TwapiTdhFixedPropertySize(const EVENT_PROPERTY_INFO *epiP,
+                                        ULONG pointer_size)
+{
+    if (epiP->Flags & (PropertyStruct|PropertyParamLength|PropertyParamCount))
+        return 0;
+    if (epiP->count != 1)
+        return 0;
+    switch (epiP->nonStructType.InType) {
+    case TDH_INTYPE_INT8:
+    case TDH_INTYPE_UINT8:
+        return 1;
+    case TDH_INTYPE_INT16:
+    case TDH_INTYPE_UINT16:
+        return 2;
+    case TDH_INTYPE_INT32:
+    case TDH_INTYPE_UINT32:
+    case TDH_INTYPE_HEXINT32:
+    case TDH_INTYPE_FLOAT:
+    case TDH_INTYPE_BOOLEAN:
+        return 4;
+    case TDH_INTYPE_INT64:
+    case TDH_INTYPE_UINT64:
+    case TDH_INTYPE_HEXINT64:
+    case TDH_INTYPE_DOUBLE:
+    case TDH_INTYPE_FILETIME:
+        return 8;
+    case TDH_INTYPE_GUID:
+    case TDH_INTYPE_SYSTEMTIME:
+        return 16;
+    case TDH_INTYPE_POINTER:
+    case TDH_INTYPE_SIZET:
+        return (USHORT) pointer_size;
+    default:
+        return 0;
+    }
+}
+
+/* Fills in the fixed property layout. Returns 0 if out of memory */
+static int TwapiTdhSchemaLayout(TwapiTdhSchema *schemaP, ULONG pointer_size)
+{
+    TRACE_EVENT_INFO *teiP = schemaP->teiP;
+    ULONG i, n, offset;
+    USHORT size;
+
+    for (n = 0; n < teiP->TopLevelPropertyCount; ++n) {
+        if (TwapiTdhFixedPropertySize(&teiP->EventPropertyInfoArray[n],
+                                      pointer_size) == 0)
+            break;
+    }
+    if (n == 0)
+        return 1;
+
+    /* One allocation for both arrays */
+    schemaP->offsetsP = CacheAlloc(n * (sizeof(ULONG) + sizeof(USHORT)));
+    if (schemaP->offsetsP == NULL)
+        return 0;
+    schemaP->sizesP = (USHORT *) (schemaP->offsetsP + n);
+    offset = 0;
+    for (i = 0; i < n; ++i) {
+        size = TwapiTdhFixedPropertySize(&teiP->EventPropertyInfoArray[i],
+                                         pointer_size);
+        schemaP->offsetsP[i] = offset;
+        schemaP->sizesP[i] = size;
+        offset += size;
+    }
+    schemaP->nfixed = (USHORT) n;
+    schemaP->fixed_size = offset;
+    return 1;
+}
+
+/* Calls TDH for the schema. Returns 0 if out of memory */
+static int TwapiTdhSchemaFetch(TwapiTdhCache *cacheP, EVENT_RECORD *evrP,
+                               ULONG pointer_size, TwapiTdhSchema *schemaP)
+{
+    TDH_CONTEXT tdhctx;
+    ULONG sz;
+
+    memset(schemaP, 0, sizeof(*schemaP));
+    tdhctx.ParameterValue = pointer_size;
+    tdhctx.ParameterType = TDH_CONTEXT_POINTERSIZE;
+    tdhctx.ParameterSize = 0;   /* Reserved value */
+
+    sz = cacheP->size_hint;
+    schemaP->teiP = CacheAlloc(sz);
+    if (schemaP->teiP == NULL)
+        return 0;
+    cacheP->stats.tdh_calls++;
+    schemaP->status = cacheP->getFn(evrP, 1, &tdhctx, schemaP->teiP, &sz);
+    if (schemaP->status == ERROR_INSUFFICIENT_BUFFER) {
+        CacheFree(schemaP->teiP);
+        schemaP->teiP = CacheAlloc(sz);
+        if (schemaP->teiP == NULL)
+            return 0;
+        /* Start bigger next time since schemas of a trace are similar */
+        if (sz > cacheP->size_hint)
+            cacheP->size_hint = sz;
+        cacheP->stats.tdh_calls++;
+        schemaP->status = cacheP->getFn(evrP, 1, &tdhctx, schemaP->teiP, &sz);
+    }
+
+    if (schemaP->status != ERROR_SUCCESS) {
+        CacheFree(schemaP->teiP);
+        schemaP->teiP = NULL;
+        return 1;
+    }
+
+    schemaP->tei_size = sz;
+    if (! TwapiTdhSchemaLayout(schemaP, pointer_size)) {
+        CacheFree(schemaP->teiP);
+        schemaP->teiP = NULL;
+        return 0;
+    }
+    return 1;
+}
+
+TwapiTdhSchema *TwapiTdhCacheGet(TwapiTdhCache *cacheP, EVENT_RECORD *evrP,
+                                 ULONG pointer_size)
+{
+    TwapiTdhSchemaKey key;
+    TwapiTdhCacheEntry *entryP;
+    TwapiLruLink *linkP;
+    size_t hash;
+    int i;
+
+    if (cacheP->stats.maxentries == 0) {
+        cacheP->stats.uncached++;
+        return NULL;
+    }
+
+    /* TraceLogging events share ids but carry their schema with them */
+    for (i = 0; i < evrP->ExtendedDataCount; ++i) {
+        if (evrP->ExtendedData[i].ExtType == EVENT_HEADER_EXT_TYPE_EVENT_SCHEMA_TL) {
+            cacheP->stats.uncached++;
+            return NULL;
+        }
+    }
+
+    memset(&key, 0, sizeof(key));
+    key.provider = evrP->EventHeader.ProviderId;
+    key.id = evrP->EventHeader.EventDescriptor.Id;
+    key.version = evrP->EventHeader.EventDescriptor.Version;
+    key.opcode = evrP->EventHeader.EventDescriptor.Opcode;
+    key.level = evrP->EventHeader.EventDescriptor.Level;
+    key.channel = evrP->EventHeader.EventDescriptor.Channel;
+    key.task = evrP->EventHeader.EventDescriptor.Task;
+    key.pointer_size = pointer_size;
+    hash = TwapiTdhCacheHash(&key);
+
+    for (linkP = TwapiLruBucket(&cacheP->table, hash); linkP; linkP = linkP->hash_nextP) {
+        entryP = (TwapiTdhCacheEntry *) linkP;
+        if (linkP->hash == hash && TwapiTdhCacheKeyEqual(&entryP->key, &key)) {
+            cacheP->stats.hits++;
+            TwapiLruTouch(&cacheP->table, linkP);
+            return &entryP->schema;
+        }
+    }
+
+    cacheP->stats.misses++;
+    entryP = CacheAlloc(sizeof(*entryP));
+    if (entryP == NULL) {
+        cacheP->stats.uncached++;
+        return NULL;
+    }
+    if (! TwapiTdhSchemaFetch(cacheP, evrP, pointer_size, &entryP->schema)) {
+        CacheFree(entryP);
+        cacheP->stats.uncached++;
+        return NULL;
+    }
+
+    /* Evict after the fetch so a failed fetch does not lose an entry */
+    if (cacheP->stats.nentries >= cacheP->stats.maxentries) {
+        linkP = TwapiLruRemoveTail(&cacheP->table);
+        TwapiTdhCacheFreeEntry(cacheP, (TwapiTdhCacheEntry *) linkP);
+        cacheP->stats.nentries--;
+        cacheP->stats.evictions++;
+    }
+    entryP->key = key;
+    TwapiLruAdd(&cacheP->table, &entryP->link, hash);
+    cacheP->stats.nentries++;
+    cacheP->stats.nbytes += entryP->schema.tei_size;
+    return &entryP->schema;
+}
@@ -0,0 +1,86 @@
+#ifndef TWAPI_TDHCACHE_H
+#define TWAPI_TDHCACHE_H
+
+/*
+ * Bounded cache of event schemas returned by TdhGetEventInformation,
+ * keyed by provider GUID and the event descriptor's id, version, opcode,
+ * level, channel and task along with the pointer size of the event. The
+ * last three are fixed for a manifest event id but vary between MOF
+ * events of the same class, and the returned schema, along with the
+ * names derived from it, describes the event's own values. Failures are cached as well so events
+ * whose provider has no registered schema are not looked up each time.
+ * For each schema, the offsets of the leading top level properties that
+ * have a fixed size are computed once so decoders can read them
+ * directly from the event user data. The least recently used schema is
+ * evicted when full. Not thread safe; callers keep one per interpreter.
+ *
+ * Builds standalone without Tcl or TWAPI when ETW_STANDALONE is defined,
+ * in which case the definitions come from etwtypes.h.
+ */
+
+#ifdef ETW_STANDALONE
+# include "etwtypes.h"
+#endif
+
+#ifndef EVENT_HEADER_EXT_TYPE_EVENT_SCHEMA_TL
+# define EVENT_HEADER_EXT_TYPE_EVENT_SCHEMA_TL 0x000B /* Not in older SDKs */
+#endif
+
+typedef ULONG __stdcall TwapiTdhGetEventInformationFn(EVENT_RECORD *evrP, ULONG, TDH_CONTEXT *, TRACE_EVENT_INFO *, ULONG *);
+
+typedef struct _TwapiTdhCache TwapiTdhCache;
+
+typedef struct _TwapiTdhSchema {
+    ULONG status;             /* Result of TdhGetEventInformation */
+    TRACE_EVENT_INFO *teiP;   /* NULL unless status is ERROR_SUCCESS */
+    ULONG tei_size;
+    /*
+     * The first nfixed top level properties are scalars of fixed size,
+     * and hence at fixed offsets, taking up fixed_size bytes in all.
+     * Their offsets and sizes are in the offsetsP and sizesP arrays.
+     */
+    USHORT nfixed;
+    ULONG fixed_size;
+    ULONG *offsetsP;
+    USHORT *sizesP;
+    void *clientP;            /* For use by the caller. See below */
+} TwapiTdhSchema;
+
+/* Called for a non-NULL clientP when its schema is evicted or cleared */
+typedef void TwapiTdhCacheFreeFn(void *clientP);
+
+typedef struct _TwapiTdhCacheStats {
+    ULONGLONG hits;
+    ULONGLONG misses;
+    ULONGLONG evictions;
+    ULONGLONG uncached;       /* Events that could not be cached */
+    ULONGLONG tdh_calls;      /* Calls to TdhGetEventInformation */
+    size_t nentries;
+    size_t maxentries;
+    size_t nbytes;            /* Size of cached TRACE_EVENT_INFO blobs */
+} TwapiTdhCacheStats;
+
+/*
+ * Returns a new cache holding at most maxentries schemas, or NULL if out
+ * of memory. A maxentries of 0 disables caching.
+ */
+TwapiTdhCache *TwapiTdhCacheNew(size_t maxentries,
+                                TwapiTdhGetEventInformationFn *getFn,
+                                TwapiTdhCacheFreeFn *freeFn);
+void TwapiTdhCacheFree(TwapiTdhCache *cacheP);
+void TwapiTdhCacheClear(TwapiTdhCache *cacheP);
+
+/*
+ * Returns the schema for the event, calling TdhGetEventInformation on a
+ * miss. The schema, whose status may indicate failure, belongs to the
+ * cache and is only valid until the next call. Returns NULL if the event
+ * cannot be cached, e.g. for TraceLogging events which carry their own
+ * schema, when caching is disabled or when out of memory. The caller
+ * should then get the information from TDH itself.
+ */
+TwapiTdhSchema *TwapiTdhCacheGet(TwapiTdhCache *cacheP, EVENT_RECORD *evrP,
+                                 ULONG pointer_size);
+
+void TwapiTdhCacheGetStats(TwapiTdhCache *cacheP, TwapiTdhCacheStats *statsP);
+
+#endif
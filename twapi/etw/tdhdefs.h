@@ -0,0 +1,337 @@
+#ifndef TWAPI_TDHDEFS_H
+#define TWAPI_TDHDEFS_H
+
+/*
+ * Event record and TDH definitions missing from SDKs older than Windows 7,
+ * in which case TDH is loaded at run time. Also used by the standalone
+ * builds (see etwtypes.h) on platforms other than Windows.
+ */
+
+#if !defined(ETW_BUFFER_CONTEXT_DEF) && !defined(__GNUC__)
+/* TBD - note this struct has changed in the post-Win7 SDKs */
+typedef struct _ETW_BUFFER_CONTEXT {
+    UCHAR ProcessorNumber;
+    UCHAR Alignment;
+    USHORT LoggerId;
+} ETW_BUFFER_CONTEXT, *PETW_BUFFER_CONTEXT;
+#endif
+
+#define EVENT_HEADER_PROPERTY_XML               0x0001
+#define EVENT_HEADER_PROPERTY_FORWARDED_XML     0x0002
+#define EVENT_HEADER_PROPERTY_LEGACY_EVENTLOG   0x0004
+
+#define EVENT_HEADER_FLAG_EXTENDED_INFO         0x0001
+#define EVENT_HEADER_FLAG_PRIVATE_SESSION       0x0002
+#define EVENT_HEADER_FLAG_STRING_ONLY           0x0004
+#define EVENT_HEADER_FLAG_TRACE_MESSAGE         0x0008
+#define EVENT_HEADER_FLAG_NO_CPUTIME            0x0010
+#define EVENT_HEADER_FLAG_32_BIT_HEADER         0x0020
+#define EVENT_HEADER_FLAG_64_BIT_HEADER         0x0040
+#define EVENT_HEADER_FLAG_CLASSIC_HEADER        0x0100
+
+#define EVENT_HEADER_EXT_TYPE_RELATED_ACTIVITYID   0x0001
+#define EVENT_HEADER_EXT_TYPE_SID                  0x0002
+#define EVENT_HEADER_EXT_TYPE_TS_ID                0x0003
+#define EVENT_HEADER_EXT_TYPE_INSTANCE_INFO        0x0004
+#define EVENT_HEADER_EXT_TYPE_STACK_TRACE32        0x0005
+#define EVENT_HEADER_EXT_TYPE_STACK_TRACE64        0x0006
+#define EVENT_HEADER_EXT_TYPE_MAX                  0x0007
+
+typedef struct _EVENT_DESCRIPTOR {
+
+    USHORT      Id;
+    UCHAR       Version;
+    UCHAR       Channel;
+    UCHAR       Level;
+    UCHAR       Opcode;
+    USHORT      Task;
+    ULONGLONG   Keyword;
+
+} EVENT_DESCRIPTOR, *PEVENT_DESCRIPTOR;
+
+typedef const EVENT_DESCRIPTOR *PCEVENT_DESCRIPTOR;
+
+typedef struct _EVENT_HEADER {
+    USHORT Size;
+    USHORT HeaderType;
+    USHORT Flags;
+    USHORT EventProperty;
+    ULONG ThreadId;
+    ULONG ProcessId;
+    LARGE_INTEGER TimeStamp;
+    GUID ProviderId;
+    EVENT_DESCRIPTOR EventDescriptor;
+    union {
+        struct {
+            ULONG KernelTime;
+            ULONG UserTime;
+        };
+        ULONG64 ProcessorTime;
+    };
+    GUID ActivityId;
+
+} EVENT_HEADER, *PEVENT_HEADER;
+
+typedef struct _EVENT_EXTENDED_ITEM_TS_ID {
+  ULONG SessionId;
+} EVENT_EXTENDED_ITEM_TS_ID, *PEVENT_EXTENDED_ITEM_TS_ID;
+
+typedef struct _EVENT_EXTENDED_ITEM_RELATED_ACTIVITYID {
+  GUID RelatedActivityId;
+} EVENT_EXTENDED_ITEM_RELATED_ACTIVITYID, *PEVENT_EXTENDED_ITEM_RELATED_ACTIVITYID;
+
+typedef struct _EVENT_EXTENDED_ITEM_INSTANCE {
+  ULONG InstanceId;
+  ULONG ParentInstanceId;
+  GUID  ParentGuid;
+} EVENT_EXTENDED_ITEM_INSTANCE, *PEVENT_EXTENDED_ITEM_INSTANCE;
+
+typedef struct _EVENT_HEADER_EXTENDED_DATA_ITEM {
+    USHORT Reserved1;
+    USHORT ExtType;
+    struct {
+        USHORT Linkage :  1;
+        USHORT Reserved2 : 15;
+    };
+    USHORT DataSize;
+    ULONGLONG  DataPtr;
+
+} EVENT_HEADER_EXTENDED_DATA_ITEM, *PEVENT_HEADER_EXTENDED_DATA_ITEM;
+
+typedef struct _EVENT_RECORD {
+
+    EVENT_HEADER EventHeader;
+    ETW_BUFFER_CONTEXT BufferContext;
+    USHORT ExtendedDataCount;
+    USHORT UserDataLength;
+    PEVENT_HEADER_EXTENDED_DATA_ITEM ExtendedData;
+    PVOID UserData;
+    PVOID UserContext;
+} EVENT_RECORD, *PEVENT_RECORD;
+
+#define EVENT_ENABLE_PROPERTY_SID                   0x00000001
+#define EVENT_ENABLE_PROPERTY_TS_ID                 0x00000002
+#define EVENT_ENABLE_PROPERTY_STACK_TRACE           0x00000004
+
+#define PROCESS_TRACE_MODE_REAL_TIME                0x00000100
+#define PROCESS_TRACE_MODE_RAW_TIMESTAMP            0x00001000
+#define PROCESS_TRACE_MODE_EVENT_RECORD             0x10000000
+
+typedef enum _TDH_CONTEXT_TYPE { 
+    TDH_CONTEXT_WPP_TMFFILE = 0,
+    TDH_CONTEXT_WPP_TMFSEARCHPATH = 1,
+    TDH_CONTEXT_WPP_GMT = 2,
+    TDH_CONTEXT_POINTERSIZE = 3,
+    TDH_CONTEXT_PDB_PATH = 4,
+    TDH_CONTEXT_MAXIMUM = 5
+} TDH_CONTEXT_TYPE;
+
+typedef struct _TDH_CONTEXT {
+    ULONGLONG ParameterValue;
+    TDH_CONTEXT_TYPE ParameterType;
+    ULONG ParameterSize;
+} TDH_CONTEXT;
+
+typedef enum _DECODING_SOURCE { 
+  DecodingSourceXMLFile  = 0,
+  DecodingSourceWbem     = 1,
+  DecodingSourceWPP      = 2
+} DECODING_SOURCE;
+
+typedef enum _TEMPLATE_FLAGS
+{
+    TEMPLATE_EVENT_DATA = 1,
+    TEMPLATE_USER_DATA = 2
+} TEMPLATE_FLAGS;
+
+
+typedef enum _PROPERTY_FLAGS
+{
+   PropertyStruct        = 0x1,      // Type is struct.
+   PropertyParamLength   = 0x2,      // Length field is index of param with length.
+   PropertyParamCount    = 0x4,      // Count file is index of param with count.
+   PropertyWBEMXmlFragment = 0x8,    // WBEM extension flag for property.
+   PropertyParamFixedLength = 0x10   // Length of the parameter is fixed.
+} PROPERTY_FLAGS;
+
+typedef struct _EVENT_PROPERTY_INFO {
+    PROPERTY_FLAGS Flags;
+    ULONG NameOffset;
+    union {
+        struct _nonStructType {
+            USHORT InType;
+            USHORT OutType;
+            ULONG MapNameOffset;
+        } nonStructType;
+        struct _structType {
+            USHORT StructStartIndex;
+            USHORT NumOfStructMembers;
+            ULONG padding;
+        } structType;
+    };
+    union {
+        USHORT count;
+        USHORT countPropertyIndex;
+    };
+    union {
+        USHORT length;
+        USHORT lengthPropertyIndex;
+    };
+    ULONG Reserved;
+} EVENT_PROPERTY_INFO;
+typedef EVENT_PROPERTY_INFO *PEVENT_PROPERTY_INFO;
+
+typedef struct _TRACE_EVENT_INFO {
+  GUID ProviderGuid;
+  GUID EventGuid;
+  EVENT_DESCRIPTOR EventDescriptor;
+  DECODING_SOURCE DecodingSource;
+  ULONG ProviderNameOffset;
+  ULONG LevelNameOffset;
+  ULONG ChannelNameOffset;
+  ULONG KeywordsNameOffset;
+  ULONG TaskNameOffset;
+  ULONG OpcodeNameOffset;
+  ULONG EventMessageOffset;
+  ULONG ProviderMessageOffset;
+  ULONG BinaryXMLOffset;
+  ULONG BinaryXMLSize;
+  ULONG ActivityIDNameOffset;
+  ULONG RelatedActivityIDNameOffset;
+  ULONG PropertyCount;
+  ULONG TopLevelPropertyCount;
+  TEMPLATE_FLAGS Flags;
+  EVENT_PROPERTY_INFO EventPropertyInfoArray[ANYSIZE_ARRAY];
+} TRACE_EVENT_INFO;
+
+typedef struct _PROPERTY_DATA_DESCRIPTOR {
+    ULONGLONG PropertyName;
+    ULONG ArrayIndex;
+    ULONG Reserved;
+} PROPERTY_DATA_DESCRIPTOR;
+typedef PROPERTY_DATA_DESCRIPTOR *PPROPERTY_DATA_DESCRIPTOR;
+
+typedef struct _EVENT_MAP_ENTRY {
+    ULONG OutputOffset;
+    union {
+        ULONG Value;
+        ULONG InputOffset;
+    };
+} EVENT_MAP_ENTRY;
+typedef EVENT_MAP_ENTRY *PEVENT_MAP_ENTRY;
+
+typedef enum _MAP_FLAGS {
+    EVENTMAP_INFO_FLAG_MANIFEST_VALUEMAP   = 0x1,
+    EVENTMAP_INFO_FLAG_MANIFEST_BITMAP     = 0x2,
+    EVENTMAP_INFO_FLAG_MANIFEST_PATTERNMAP = 0x4,
+    EVENTMAP_INFO_FLAG_WBEM_VALUEMAP       = 0x8,
+    EVENTMAP_INFO_FLAG_WBEM_BITMAP         = 0x10,
+    EVENTMAP_INFO_FLAG_WBEM_FLAG           = 0x20,
+    EVENTMAP_INFO_FLAG_WBEM_NO_MAP         = 0x40
+} MAP_FLAGS;
+
+typedef enum _MAP_VALUETYPE {
+    EVENTMAP_ENTRY_VALUETYPE_ULONG,
+    EVENTMAP_ENTRY_VALUETYPE_STRING
+}  MAP_VALUETYPE;
+
+typedef struct _EVENT_MAP_INFO {
+    ULONG NameOffset;
+    MAP_FLAGS Flag;
+    ULONG EntryCount;
+    union {
+        MAP_VALUETYPE MapEntryValueType;
+        ULONG FormatStringOffset;
+    };
+    EVENT_MAP_ENTRY MapEntryArray[ANYSIZE_ARRAY];
+} EVENT_MAP_INFO;
+typedef EVENT_MAP_INFO *PEVENT_MAP_INFO;
+
+enum _TDH_IN_TYPE {
+    TDH_INTYPE_NULL,
+    TDH_INTYPE_UNICODESTRING,
+    TDH_INTYPE_ANSISTRING,
+    TDH_INTYPE_INT8,
+    TDH_INTYPE_UINT8,
+    TDH_INTYPE_INT16,
+    TDH_INTYPE_UINT16,
+    TDH_INTYPE_INT32,
+    TDH_INTYPE_UINT32,
+    TDH_INTYPE_INT64,
+    TDH_INTYPE_UINT64,
+    TDH_INTYPE_FLOAT,
+    TDH_INTYPE_DOUBLE,
+    TDH_INTYPE_BOOLEAN,
+    TDH_INTYPE_BINARY,
+    TDH_INTYPE_GUID,
+    TDH_INTYPE_POINTER,
+    TDH_INTYPE_FILETIME,
+    TDH_INTYPE_SYSTEMTIME,
+    TDH_INTYPE_SID,
+    TDH_INTYPE_HEXINT32,
+    TDH_INTYPE_HEXINT64,                    // End of winmeta intypes.
+    TDH_INTYPE_COUNTEDSTRING = 300,         // Start of TDH intypes for WBEM.
+    TDH_INTYPE_COUNTEDANSISTRING,
+    TDH_INTYPE_REVERSEDCOUNTEDSTRING,
+    TDH_INTYPE_REVERSEDCOUNTEDANSISTRING,
+    TDH_INTYPE_NONNULLTERMINATEDSTRING,
+    TDH_INTYPE_NONNULLTERMINATEDANSISTRING,
+    TDH_INTYPE_UNICODECHAR,
+    TDH_INTYPE_ANSICHAR,
+    TDH_INTYPE_SIZET,
+    TDH_INTYPE_HEXDUMP,
+    TDH_INTYPE_WBEMSID
+};
+
+enum _TDH_OUT_TYPE {
+    TDH_OUTTYPE_NULL,
+    TDH_OUTTYPE_STRING,
+    TDH_OUTTYPE_DATETIME,
+    TDH_OUTTYPE_BYTE,
+    TDH_OUTTYPE_UNSIGNEDBYTE,
+    TDH_OUTTYPE_SHORT,
+    TDH_OUTTYPE_UNSIGNEDSHORT,
+    TDH_OUTTYPE_INT,
+    TDH_OUTTYPE_UNSIGNEDINT,
+    TDH_OUTTYPE_LONG,
+    TDH_OUTTYPE_UNSIGNEDLONG,
+    TDH_OUTTYPE_FLOAT,
+    TDH_OUTTYPE_DOUBLE,
+    TDH_OUTTYPE_BOOLEAN,
+    TDH_OUTTYPE_GUID,
+    TDH_OUTTYPE_HEXBINARY,
+    TDH_OUTTYPE_HEXINT8,
+    TDH_OUTTYPE_HEXINT16,
+    TDH_OUTTYPE_HEXINT32,
+    TDH_OUTTYPE_HEXINT64,
+    TDH_OUTTYPE_PID,
+    TDH_OUTTYPE_TID,
+    TDH_OUTTYPE_PORT,
+    TDH_OUTTYPE_IPV4,
+    TDH_OUTTYPE_IPV6,
+    TDH_OUTTYPE_SOCKETADDRESS,
+    TDH_OUTTYPE_CIMDATETIME,
+    TDH_OUTTYPE_ETWTIME,
+    TDH_OUTTYPE_XML,
+    TDH_OUTTYPE_ERRORCODE,
+    TDH_OUTTYPE_WIN32ERROR,
+    TDH_OUTTYPE_NTSTATUS,
+    TDH_OUTTYPE_HRESULT,             // End of winmeta outtypes.
+    TDH_OUTTYPE_CULTURE_INSENSITIVE_DATETIME, //Culture neutral datetime string.
+    TDH_OUTTYPE_REDUCEDSTRING = 300, // Start of TDH outtypes for WBEM.
+    TDH_OUTTYPE_NOPRINT
+};
+
+typedef struct _TRACE_PROVIDER_INFO {
+  GUID  ProviderGuid;
+  ULONG SchemaSource;
+  ULONG ProviderNameOffset;
+} TRACE_PROVIDER_INFO;
+
+typedef struct _PROVIDER_ENUMERATION_INFO {
+  ULONG               NumberOfProviders;
+  ULONG               Padding;
+  TRACE_PROVIDER_INFO TraceProviderInfoArray[ANYSIZE_ARRAY];
+} PROVIDER_ENUMERATION_INFO;
+
+#endif
@@ -1685,6 +1685,8 @@ TWAPI_EXTERN TCL_RESULT TwapiCStructParse (Tcl_Interp *interp, MemLifo *memlifoP
 TWAPI_EXTERN TCL_RESULT ObjFromCStruct(Tcl_Interp *interp, void *pv, int nbytes, Tcl_Obj *csObj, DWORD flags, Tcl_Obj **objPP);
 /* ObjFromCStruct flags definitions */
 #define CSTRUCT_RETURN_DICT 0x1
+#define CSTRUCT_RETURN_RECORDARRAY 0x2
+TWAPI_EXTERN TCL_RESULT ObjFromCStructArray(Tcl_Interp *interp, void *pv, int count, int stride, Tcl_Obj *csObj, DWORD flags, Tcl_Obj **objPP);
 
 /* Wrappers for memlifo based s/w stack */
 typedef MemLifo *SWStack;
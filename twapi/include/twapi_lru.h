@@ -0,0 +1,134 @@
+#ifndef TWAPI_LRU_H
+#define TWAPI_LRU_H
+
+/*
+ * Hash table whose entries are also kept on a list in order of use so
+ * the least recently used one can be evicted. Shared by the bounded
+ * caches, e.g. of certificate information and event schemas, which
+ * differ only in their keys, values and statistics.
+ *
+ * Entries embed a TwapiLruLink as their first member and are cast to
+ * and from it. The table does not allocate or free entries, nor its
+ * bucket array, so it can be used with any allocator. Callers compute
+ * the hash of their key, walk the bucket chain with TwapiLruBucket
+ * comparing keys, and call TwapiLruTouch on a hit.
+ *
+ * Has no dependencies so it can be used in standalone builds of the
+ * caches for testing.
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#ifndef TWAPI_STATIC_INLINE
+# ifdef _MSC_VER
+#  define TWAPI_STATIC_INLINE static __inline
+# else
+#  define TWAPI_STATIC_INLINE static inline
+# endif
+#endif
+
+typedef struct _TwapiLruLink {
+    struct _TwapiLruLink *hash_nextP;  /* Bucket chain */
+    struct _TwapiLruLink *lru_prevP;   /* Towards most recent */
+    struct _TwapiLruLink *lru_nextP;   /* Towards least recent */
+    size_t hash;
+} TwapiLruLink;
+
+typedef struct _TwapiLruTable {
+    TwapiLruLink **bucketsP;
+    size_t nbuckets;            /* Power of 2 */
+    TwapiLruLink *headP;        /* Most recently used */
+    TwapiLruLink *tailP;        /* Evicted first */
+} TwapiLruTable;
+
+/*
+ * Returns the number of buckets for a table of up to maxentries
+ * entries. Keeps chains short, about one entry per bucket when full.
+ */
+TWAPI_STATIC_INLINE size_t TwapiLruBucketCount(size_t maxentries)
+{
+    size_t n;
+    for (n = 16; n < maxentries; n *= 2)
+        ;
+    return n;
+}
+
+/* First entry in the chain for a hash value */
+#define TwapiLruBucket(tableP_, hash_) \
+    ((tableP_)->bucketsP[(hash_) & ((tableP_)->nbuckets - 1)])
+
+/*
+ * Empties the table without touching the entries. Callers free them
+ * first by walking from headP along lru_nextP.
+ */
+TWAPI_STATIC_INLINE void TwapiLruReset(TwapiLruTable *tableP)
+{
+    memset(tableP->bucketsP, 0, tableP->nbuckets * sizeof(tableP->bucketsP[0]));
+    tableP->headP = tableP->tailP = NULL;
+}
+
+TWAPI_STATIC_INLINE void TwapiLruUnlink(TwapiLruTable *tableP,
+                                        TwapiLruLink *linkP)
+{
+    if (linkP->lru_prevP)
+        linkP->lru_prevP->lru_nextP = linkP->lru_nextP;
+    else
+        tableP->headP = linkP->lru_nextP;
+    if (linkP->lru_nextP)
+        linkP->lru_nextP->lru_prevP = linkP->lru_prevP;
+    else
+        tableP->tailP = linkP->lru_prevP;
+}
+
+TWAPI_STATIC_INLINE void TwapiLruLinkHead(TwapiLruTable *tableP,
+                                          TwapiLruLink *linkP)
+{
+    linkP->lru_prevP = NULL;
+    linkP->lru_nextP = tableP->headP;
+    if (tableP->headP)
+        tableP->headP->lru_prevP = linkP;
+    else
+        tableP->tailP = linkP;
+    tableP->headP = linkP;
+}
+
+/* Marks an entry found in the table as the most recently used */
+TWAPI_STATIC_INLINE void TwapiLruTouch(TwapiLruTable *tableP,
+                                       TwapiLruLink *linkP)
+{
+    if (linkP != tableP->headP) {
+        TwapiLruUnlink(tableP, linkP);
+        TwapiLruLinkHead(tableP, linkP);
+    }
+}
+
+/* Adds an entry as the most recently used */
+TWAPI_STATIC_INLINE void TwapiLruAdd(TwapiLruTable *tableP,
+                                     TwapiLruLink *linkP, size_t hash)
+{
+    TwapiLruLink **bucketPP = &TwapiLruBucket(tableP, hash);
+
+    linkP->hash = hash;
+    linkP->hash_nextP = *bucketPP;
+    *bucketPP = linkP;
+    TwapiLruLinkHead(tableP, linkP);
+}
+
+/*
+ * Removes the least recently used entry and returns it for the caller
+ * to free. The table must not be empty.
+ */
+TWAPI_STATIC_INLINE TwapiLruLink *TwapiLruRemoveTail(TwapiLruTable *tableP)
+{
+    TwapiLruLink *linkP = tableP->tailP;
+    TwapiLruLink **linkPP = &TwapiLruBucket(tableP, linkP->hash);
+
+    while (*linkPP != linkP)
+        linkPP = &(*linkPP)->hash_nextP;
+    *linkPP = linkP->hash_nextP;
+    TwapiLruUnlink(tableP, linkP);
+    return linkP;
+}
+
+#endif
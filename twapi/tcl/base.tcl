@@ -31,6 +31,10 @@ namespace eval twapi {
     # Dictionary of FFI libraries to handles and back
     variable _ffi_paths {}
     variable _ffi_handles {}
+
+    # Prepared FFI call commands for each FFI library handle
+    variable _ffi_prepared {}
+    variable _ffi_prepared_id 0
 }
 
 
@@ -238,9 +242,6 @@ proc twapi::format_message {args} {
         return $msg
     }
 
-    # Use of * in format specifiers will change where the actual parameters
-    # are positioned
-    set num_asterisks 0
     set msg2 ""
     set prev_end 0
     foreach placeholder $placeholder_indices {
@@ -272,12 +273,11 @@ proc twapi::format_message {args} {
                         # No fmt spec
                     } else {
                         # Since everything is a string in Tcl, we happily
-                        # do not have to worry about type. However, the
-                        # format spec could have * specifiers which will
-                        # change the parameter indexing for subsequent
-                        # arguments
-                        incr num_asterisks [expr {[llength [split $fmt *]]-1}]
-                        incr param_index $num_asterisks
+                        # do not have to worry about type. However, each
+                        # * specifier in the format spec takes a parameter
+                        # so the value of this insert follows them. Other
+                        # inserts are not affected.
+                        incr param_index [expr {[llength [split $fmt *]]-1}]
                     }
                     # TBD - we ignore the actual format type
                     append msg2 [lindex $opts(params) $param_index]
@@ -515,29 +515,24 @@ proc twapi::_init_security_defs {} {
 proc twapi::_access_rights_to_mask {args} {
     _init_security_defs
 
+    # Symbol table is built once and held in a variable so that its
+    # compiled form is cached by _parse_symbolic_bitmask.
+    # The mandatory label access rights are not in security_defs
+    # because we do not want them to mess up the int->name mapping
+    # for DACL's
+    variable _access_rights_syms
+    set _access_rights_syms [concat [array get security_defs] {
+        no_write_up 1
+        system_mandatory_label_no_write_up 1
+        no_read_up 2
+        system_mandatory_label_no_read_up  2
+        no_execute_up 4
+        system_mandatory_label_no_execute_up 4
+    }]
+
     proc _access_rights_to_mask args {
-        variable security_defs
-        set rights 0
-        foreach right [concat {*}$args] {
-            # The mandatory label access rights are not in security_defs
-            # because we do not want them to mess up the int->name mapping
-            # for DACL's
-            set right [dict* {
-                no_write_up 1
-                system_mandatory_label_no_write_up 1
-                no_read_up 2
-                system_mandatory_label_no_read_up  2
-                no_execute_up 4
-                system_mandatory_label_no_execute_up 4
-            } $right]
-            if {![string is integer $right]} {
-                if {[catch {set right $security_defs([string toupper $right])}]} {
-                    error "Invalid access right symbol '$right'"
-                }
-            }
-            set rights [expr {$rights | $right}]
-        }
-        return $rights
+        variable _access_rights_syms
+        return [_parse_symbolic_bitmask [concat {*}$args] $_access_rights_syms 1 "access right symbol"]
     }
     return [_access_rights_to_mask {*}$args]
 }
@@ -548,11 +543,11 @@ proc twapi::_access_mask_to_rights {access_mask {type ""}} {
     _init_security_defs
 
     proc _access_mask_to_rights {access_mask {type ""}} {
-        variable security_defs
-
-        set rights [list ]
+        variable _access_mask_all_syms
+        variable _access_mask_consume_syms
 
         if {$type eq "mandatory_label"} {
+            set rights {}
             if {$access_mask & 1} {
                 lappend rights system_mandatory_label_no_write_up
             }
@@ -565,144 +560,132 @@ proc twapi::_access_mask_to_rights {access_mask {type ""}} {
             return $rights
         }
 
-        # The returned list will include rights that map to multiple bits
-        # as well as the individual bits. We first add the multiple bits
-        # and then the individual bits (since we clear individual bits
-        # after adding)
-
-        #
-        # Check standard multiple bit masks
-        #
-        foreach x {STANDARD_RIGHTS_REQUIRED STANDARD_RIGHTS_READ STANDARD_RIGHTS_WRITE STANDARD_RIGHTS_EXECUTE STANDARD_RIGHTS_ALL SPECIFIC_RIGHTS_ALL} {
-            if {($security_defs($x) & $access_mask) == $security_defs($x)} {
-                lappend rights [string tolower $x]
-            }
-        }
-
-        #
-        # Check type specific multiple bit masks.
-        #
-        
-        set type_mask_map {
-            file {FILE_ALL_ACCESS FILE_GENERIC_READ FILE_GENERIC_WRITE FILE_GENERIC_EXECUTE}
-            process {PROCESS_ALL_ACCESS}
-            pipe {FILE_ALL_ACCESS}
-            policy {POLICY_READ POLICY_WRITE POLICY_EXECUTE POLICY_ALL_ACCESS}
-            registry {KEY_READ KEY_WRITE KEY_EXECUTE KEY_ALL_ACCESS}
-            service {SERVICE_ALL_ACCESS}
-            thread {THREAD_ALL_ACCESS}
-            token {TOKEN_READ TOKEN_WRITE TOKEN_EXECUTE TOKEN_ALL_ACCESS}
-            desktop {}
-            winsta {WINSTA_ALL_ACCESS}
-        }
-        if {[dict exists $type_mask_map $type]} {
-            foreach x [dict get $type_mask_map $type] {
-                if {($security_defs($x) & $access_mask) == $security_defs($x)} {
-                    lappend rights [string tolower $x]
-                }
-            }
-        }
-
-        #
-        # OK, now map individual bits
-
-        # First map the common bits
-        foreach x {DELETE READ_CONTROL WRITE_DAC WRITE_OWNER SYNCHRONIZE} {
-            if {$security_defs($x) & $access_mask} {
-                lappend rights [string tolower $x]
-                resetbits access_mask $security_defs($x)
-            }
-        }
-
-        # Then the generic bits
-        foreach x {GENERIC_READ GENERIC_WRITE GENERIC_EXECUTE GENERIC_ALL} {
-            if {$security_defs($x) & $access_mask} {
-                lappend rights [string tolower $x]
-                resetbits access_mask $security_defs($x)
-            }
+        if {![info exists _access_mask_all_syms($type)]} {
+            _init_access_mask_syms $type
         }
 
-        # Then the type specific
-        set type_mask_map {
-            file { FILE_READ_DATA FILE_WRITE_DATA FILE_APPEND_DATA
-                FILE_READ_EA FILE_WRITE_EA FILE_EXECUTE
-                FILE_DELETE_CHILD FILE_READ_ATTRIBUTES
-                FILE_WRITE_ATTRIBUTES }
-            pipe { FILE_READ_DATA FILE_WRITE_DATA FILE_CREATE_PIPE_INSTANCE
-                FILE_READ_ATTRIBUTES FILE_WRITE_ATTRIBUTES }
-            service { SERVICE_QUERY_CONFIG SERVICE_CHANGE_CONFIG
-                SERVICE_QUERY_STATUS SERVICE_ENUMERATE_DEPENDENTS
-                SERVICE_START SERVICE_STOP SERVICE_PAUSE_CONTINUE
-                SERVICE_INTERROGATE SERVICE_USER_DEFINED_CONTROL }
-            registry { KEY_QUERY_VALUE KEY_SET_VALUE KEY_CREATE_SUB_KEY
-                KEY_ENUMERATE_SUB_KEYS KEY_NOTIFY KEY_CREATE_LINK
-                KEY_WOW64_32KEY KEY_WOW64_64KEY KEY_WOW64_RES }
-            policy { POLICY_VIEW_LOCAL_INFORMATION POLICY_VIEW_AUDIT_INFORMATION
-                POLICY_GET_PRIVATE_INFORMATION POLICY_TRUST_ADMIN
-                POLICY_CREATE_ACCOUNT POLICY_CREATE_SECRET
-                POLICY_CREATE_PRIVILEGE POLICY_SET_DEFAULT_QUOTA_LIMITS
-                POLICY_SET_AUDIT_REQUIREMENTS POLICY_AUDIT_LOG_ADMIN
-                POLICY_SERVER_ADMIN POLICY_LOOKUP_NAMES }
-            process { PROCESS_TERMINATE PROCESS_CREATE_THREAD
-                PROCESS_SET_SESSIONID PROCESS_VM_OPERATION
-                PROCESS_VM_READ PROCESS_VM_WRITE PROCESS_DUP_HANDLE
-                PROCESS_CREATE_PROCESS PROCESS_SET_QUOTA
-                PROCESS_SET_INFORMATION PROCESS_QUERY_INFORMATION
-                PROCESS_SUSPEND_RESUME} 
-            thread { THREAD_TERMINATE THREAD_SUSPEND_RESUME
-                THREAD_GET_CONTEXT THREAD_SET_CONTEXT
-                THREAD_SET_INFORMATION THREAD_QUERY_INFORMATION
-                THREAD_SET_THREAD_TOKEN THREAD_IMPERSONATE
-                THREAD_DIRECT_IMPERSONATION
-                THREAD_SET_LIMITED_INFORMATION
-                THREAD_QUERY_LIMITED_INFORMATION }
-            token { TOKEN_ASSIGN_PRIMARY TOKEN_DUPLICATE TOKEN_IMPERSONATE
-                TOKEN_QUERY TOKEN_QUERY_SOURCE TOKEN_ADJUST_PRIVILEGES
-                TOKEN_ADJUST_GROUPS TOKEN_ADJUST_DEFAULT TOKEN_ADJUST_SESSIONID }
-            desktop { DESKTOP_READOBJECTS DESKTOP_CREATEWINDOW
-                DESKTOP_CREATEMENU DESKTOP_HOOKCONTROL
-                DESKTOP_JOURNALRECORD DESKTOP_JOURNALPLAYBACK
-                DESKTOP_ENUMERATE DESKTOP_WRITEOBJECTS DESKTOP_SWITCHDESKTOP }
-            windowstation { WINSTA_ENUMDESKTOPS WINSTA_READATTRIBUTES
-                WINSTA_ACCESSCLIPBOARD WINSTA_CREATEDESKTOP
-                WINSTA_WRITEATTRIBUTES WINSTA_ACCESSGLOBALATOMS
-                WINSTA_EXITWINDOWS WINSTA_ENUMERATE WINSTA_READSCREEN }
-            winsta { WINSTA_ENUMDESKTOPS WINSTA_READATTRIBUTES
-                WINSTA_ACCESSCLIPBOARD WINSTA_CREATEDESKTOP
-                WINSTA_WRITEATTRIBUTES WINSTA_ACCESSGLOBALATOMS
-                WINSTA_EXITWINDOWS WINSTA_ENUMERATE WINSTA_READSCREEN }
-            com { COM_RIGHTS_EXECUTE COM_RIGHTS_EXECUTE_LOCAL 
-                COM_RIGHTS_EXECUTE_REMOTE COM_RIGHTS_ACTIVATE_LOCAL 
-                COM_RIGHTS_ACTIVATE_REMOTE 
-            }
-        }
+        # The returned list will include rights that map to multiple bits
+        # as well as the individual bits. The multiple bit masks are
+        # only included if all their bits are set. Individual bits are
+        # then mapped in order, each bit only being mapped once. Any
+        # bits left over are returned as hex values.
+        return [concat \
+                    [bitmask_to_symbols $access_mask $_access_mask_all_syms($type) all none] \
+                    [bitmask_to_symbols $access_mask $_access_mask_consume_syms($type) consume bits]]
+    }
 
-        if {[min_os_version 6]} {
-            dict lappend type_mask_map process PROCESS_QUERY_LIMITED_INFORMATION
-        }
+    return [_access_mask_to_rights $access_mask $type]
+}
 
-        if {[dict exists $type_mask_map $type]} {
-            foreach x [dict get $type_mask_map $type] {
-                if {$security_defs($x) & $access_mask} {
-                    lappend rights [string tolower $x]
-                    # Reset the bit so is it not included in unknown bits below
-                    resetbits access_mask $security_defs($x)
-                }
-            }
+# Builds the symbol tables used by _access_mask_to_rights for a
+# specific object type. These are held in namespace arrays so
+# their compiled forms are cached.
+proc twapi::_init_access_mask_syms {type} {
+    variable security_defs
+    variable _access_mask_all_syms
+    variable _access_mask_consume_syms
+
+    set all_syms {}
+    set consume_syms {}
+
+    # Check standard multiple bit masks
+    set names {STANDARD_RIGHTS_REQUIRED STANDARD_RIGHTS_READ STANDARD_RIGHTS_WRITE STANDARD_RIGHTS_EXECUTE STANDARD_RIGHTS_ALL SPECIFIC_RIGHTS_ALL}
+
+    # Type specific multiple bit masks.
+    set type_mask_map {
+        file {FILE_ALL_ACCESS FILE_GENERIC_READ FILE_GENERIC_WRITE FILE_GENERIC_EXECUTE}
+        process {PROCESS_ALL_ACCESS}
+        pipe {FILE_ALL_ACCESS}
+        policy {POLICY_READ POLICY_WRITE POLICY_EXECUTE POLICY_ALL_ACCESS}
+        registry {KEY_READ KEY_WRITE KEY_EXECUTE KEY_ALL_ACCESS}
+        service {SERVICE_ALL_ACCESS}
+        thread {THREAD_ALL_ACCESS}
+        token {TOKEN_READ TOKEN_WRITE TOKEN_EXECUTE TOKEN_ALL_ACCESS}
+        desktop {}
+        winsta {WINSTA_ALL_ACCESS}
+    }
+    if {[dict exists $type_mask_map $type]} {
+        lappend names {*}[dict get $type_mask_map $type]
+    }
+    foreach x $names {
+        lappend all_syms [string tolower $x] $security_defs($x)
+    }
+
+    # Now individual bits. First the common bits, then the generic bits
+    set names {
+        DELETE READ_CONTROL WRITE_DAC WRITE_OWNER SYNCHRONIZE
+        GENERIC_READ GENERIC_WRITE GENERIC_EXECUTE GENERIC_ALL
+    }
+
+    # Then the type specific
+    set type_mask_map {
+        file { FILE_READ_DATA FILE_WRITE_DATA FILE_APPEND_DATA
+            FILE_READ_EA FILE_WRITE_EA FILE_EXECUTE
+            FILE_DELETE_CHILD FILE_READ_ATTRIBUTES
+            FILE_WRITE_ATTRIBUTES }
+        pipe { FILE_READ_DATA FILE_WRITE_DATA FILE_CREATE_PIPE_INSTANCE
+            FILE_READ_ATTRIBUTES FILE_WRITE_ATTRIBUTES }
+        service { SERVICE_QUERY_CONFIG SERVICE_CHANGE_CONFIG
+            SERVICE_QUERY_STATUS SERVICE_ENUMERATE_DEPENDENTS
+            SERVICE_START SERVICE_STOP SERVICE_PAUSE_CONTINUE
+            SERVICE_INTERROGATE SERVICE_USER_DEFINED_CONTROL }
+        registry { KEY_QUERY_VALUE KEY_SET_VALUE KEY_CREATE_SUB_KEY
+            KEY_ENUMERATE_SUB_KEYS KEY_NOTIFY KEY_CREATE_LINK
+            KEY_WOW64_32KEY KEY_WOW64_64KEY KEY_WOW64_RES }
+        policy { POLICY_VIEW_LOCAL_INFORMATION POLICY_VIEW_AUDIT_INFORMATION
+            POLICY_GET_PRIVATE_INFORMATION POLICY_TRUST_ADMIN
+            POLICY_CREATE_ACCOUNT POLICY_CREATE_SECRET
+            POLICY_CREATE_PRIVILEGE POLICY_SET_DEFAULT_QUOTA_LIMITS
+            POLICY_SET_AUDIT_REQUIREMENTS POLICY_AUDIT_LOG_ADMIN
+            POLICY_SERVER_ADMIN POLICY_LOOKUP_NAMES }
+        process { PROCESS_TERMINATE PROCESS_CREATE_THREAD
+            PROCESS_SET_SESSIONID PROCESS_VM_OPERATION
+            PROCESS_VM_READ PROCESS_VM_WRITE PROCESS_DUP_HANDLE
+            PROCESS_CREATE_PROCESS PROCESS_SET_QUOTA
+            PROCESS_SET_INFORMATION PROCESS_QUERY_INFORMATION
+            PROCESS_SUSPEND_RESUME} 
+        thread { THREAD_TERMINATE THREAD_SUSPEND_RESUME
+            THREAD_GET_CONTEXT THREAD_SET_CONTEXT
+            THREAD_SET_INFORMATION THREAD_QUERY_INFORMATION
+            THREAD_SET_THREAD_TOKEN THREAD_IMPERSONATE
+            THREAD_DIRECT_IMPERSONATION
+            THREAD_SET_LIMITED_INFORMATION
+            THREAD_QUERY_LIMITED_INFORMATION }
+        token { TOKEN_ASSIGN_PRIMARY TOKEN_DUPLICATE TOKEN_IMPERSONATE
+            TOKEN_QUERY TOKEN_QUERY_SOURCE TOKEN_ADJUST_PRIVILEGES
+            TOKEN_ADJUST_GROUPS TOKEN_ADJUST_DEFAULT TOKEN_ADJUST_SESSIONID }
+        desktop { DESKTOP_READOBJECTS DESKTOP_CREATEWINDOW
+            DESKTOP_CREATEMENU DESKTOP_HOOKCONTROL
+            DESKTOP_JOURNALRECORD DESKTOP_JOURNALPLAYBACK
+            DESKTOP_ENUMERATE DESKTOP_WRITEOBJECTS DESKTOP_SWITCHDESKTOP }
+        windowstation { WINSTA_ENUMDESKTOPS WINSTA_READATTRIBUTES
+            WINSTA_ACCESSCLIPBOARD WINSTA_CREATEDESKTOP
+            WINSTA_WRITEATTRIBUTES WINSTA_ACCESSGLOBALATOMS
+            WINSTA_EXITWINDOWS WINSTA_ENUMERATE WINSTA_READSCREEN }
+        winsta { WINSTA_ENUMDESKTOPS WINSTA_READATTRIBUTES
+            WINSTA_ACCESSCLIPBOARD WINSTA_CREATEDESKTOP
+            WINSTA_WRITEATTRIBUTES WINSTA_ACCESSGLOBALATOMS
+            WINSTA_EXITWINDOWS WINSTA_ENUMERATE WINSTA_READSCREEN }
+        com { COM_RIGHTS_EXECUTE COM_RIGHTS_EXECUTE_LOCAL 
+            COM_RIGHTS_EXECUTE_REMOTE COM_RIGHTS_ACTIVATE_LOCAL 
+            COM_RIGHTS_ACTIVATE_REMOTE 
         }
+    }
 
-        # Finally add left over bits if any
-        for {set i 0} {$i < 32} {incr i} {
-            set x [expr {1 << $i}]
-            if {$access_mask & $x} {
-                lappend rights [hex32 $x]
-            }
-        }
+    if {[min_os_version 6]} {
+        dict lappend type_mask_map process PROCESS_QUERY_LIMITED_INFORMATION
+    }
 
-        return $rights
+    if {[dict exists $type_mask_map $type]} {
+        lappend names {*}[dict get $type_mask_map $type]
+    }
+    foreach x $names {
+        lappend consume_syms [string tolower $x] $security_defs($x)
     }
 
-    return [_access_mask_to_rights $access_mask $type]
+    set _access_mask_all_syms($type) $all_syms
+    set _access_mask_consume_syms($type) $consume_syms
+    return
 }
 
 # Map the symbolic CreateDisposition parameter of CreateFile to integer values
@@ -1651,6 +1634,7 @@ proc twapi::ffi_load {path} {
 proc twapi::ffi_unload {h} {
     variable _ffi_handles
     variable _ffi_paths
+    variable _ffi_prepared
 
     if {![dict exists $_ffi_handles $h]} {
         error "FFI handle $h does not exist."
@@ -1663,11 +1647,20 @@ proc twapi::ffi_unload {h} {
         }
     }
 
+    if {![dict exists $_ffi_handles $h] && [dict exists $_ffi_prepared $h]} {
+        foreach cmd [dict get $_ffi_prepared $h] {
+            rename $cmd ""
+        }
+        dict unset _ffi_prepared $h
+    }
+
     return
 }
 
 proc twapi::ffi_cfuncs {dllh cprotos {ns ::}} {
     variable _ffi_handles
+    variable _ffi_prepared
+    variable _ffi_prepared_id
 
     if {![dict exists $_ffi_handles $dllh]} {
     #    error "Unknown FFI handle \"$dllh\"."
@@ -1681,30 +1674,35 @@ proc twapi::ffi_cfuncs {dllh cprotos {ns ::}} {
     }
     set cprotos $l
 
+    # The function address and type signature are bound once into a
+    # prepared call command so each call only marshals argument values.
     set def {
         proc %NAME% {%PARAMNAMES%} {
             if {![dict exists $%TWAPINS%::_ffi_handles %DLLH%]} {
                 error "Attempt to call function in unloaded library."
             }
-            %TWAPINS%::%CALL% %FNADDR% %FNTYPE% %PARAMS% [list %PARAMREFS%]
+            %PREPARED% %PARAMREFS%
         }
     }
 
-    if {$::tcl_platform(pointerSize) == 8} {
-        # Win64 has single calling convention
-        set callmap {"" ffi_call _cdecl ffi_call _stdcall ffi_call}
-    } else {
-        set callmap {"" ffi_call _cdecl ffi_call _stdcall ffi_stdcall}
-    } 
+    # Win64 has single calling convention so stdcall is ignored there
+    set callmap {"" 0 _cdecl 0 _stdcall 1}
 
     foreach cproto $cprotos {
         lassign $cproto callconv fntype fnname params
-        set call [dict get $callmap $callconv]
+        set stdcall [dict get $callmap $callconv]
             
         set fnaddr [GetProcAddress $dllh $fnname]
         if {[pointer_null? $fnaddr]} {
             error "Entry point $fnname not found in shared library."
         }
+        # Note that fntype is doubly listified because the C ffi expects
+        # it in same format as params, ie. a list of type definitions
+        # _parse_cproto however returns it as a single type definition
+        set prepared [namespace current]::_ffi_prepared_[incr _ffi_prepared_id]
+        ffi_prepare $prepared $fnaddr [list $fntype] $params $stdcall
+        dict lappend _ffi_prepared $dllh $prepared
+
         set paramnames {}
         set paramrefs {}
         foreach arg $params {
@@ -1713,19 +1711,13 @@ proc twapi::ffi_cfuncs {dllh cprotos {ns ::}} {
             lappend paramrefs \$$name
         }
 
-        # Note that fntype is doubly listified because the C ffi expects
-        # it in same format as params, ie. a list of type definitions
-        # _parse_cproto however returns it as a single type definition
         append defs [string map [list \
-                                     %CALL%    $call \
+                                     %PREPARED% [list $prepared] \
                                      %DLLH%    [list $dllh] \
                                      %NAME%    ${ns}::$fnname \
                                      %PARAMNAMES% [join $paramnames { }] \
                                      %PARAMREFS% [join $paramrefs { }] \
-                                     %TWAPINS% [namespace current] \
-                                     %FNADDR%  [list $fnaddr] \
-                                     %FNTYPE%  [list [list $fntype]] \
-                                     %PARAMS%  [list $params]] \
+                                     %TWAPINS% [namespace current]] \
                          $def] \n
     }
     
@@ -61,34 +61,77 @@ proc twapi::capi_hash_verify {hhash sig hkey args} {
     return [CryptVerifySignature $hhash $sig $hkey "" $flags]
 }
 
-proc twapi::_do_hash {csptype alg s {enc ""}} {
+proc twapi::_do_hash {alg s {enc ""}} {
     if {$enc ne ""} {
         set s [encoding convertto $enc $s]
     }
-    set hcrypt [crypt_acquire -csptype $csptype]
+    return [Twapi_Hash $alg $s]
+}
+
+interp alias {} twapi::md5 {} twapi::_do_hash md5
+interp alias {} twapi::sha1 {} twapi::_do_hash sha1
+interp alias {} twapi::sha256 {} twapi::_do_hash sha256
+interp alias {} twapi::sha384 {} twapi::_do_hash sha384
+interp alias {} twapi::sha512 {} twapi::_do_hash sha512
+
+# Streaming hashes computed natively without going through a CSP
+proc twapi::hash_create {alg args} {
+    parseargs args {
+        hmackey.arg
+    } -maxleftover 0 -setvars
+    if {[info exists hmackey]} {
+        return [Twapi_HashCreate $alg $hmackey]
+    }
+    return [Twapi_HashCreate $alg]
+}
+
+interp alias {} twapi::hash_update {} twapi::Twapi_HashUpdate
+interp alias {} twapi::hash_final {} twapi::Twapi_HashFinal
+interp alias {} twapi::hash_free {} twapi::Twapi_HashFree
+
+proc twapi::hash_update_channel {hhash chan {maxbytes -1}} {
+    set translation [fconfigure $chan -translation]
+    fconfigure $chan -translation binary
     trap {
-        set hhash [capi_hash_create $hcrypt $alg]
-        capi_hash_bytes $hhash $s
-        return [capi_hash_value $hhash]
+        return [Twapi_HashUpdateChannel $hhash $chan $maxbytes]
     } finally {
+        fconfigure $chan -translation $translation
+    }
+}
+
+proc twapi::hash_file {alg path args} {
+    set fd [open $path r]
+    trap {
+        set hhash [hash_create $alg {*}$args]
+        hash_update_channel $hhash $fd
+        return [hash_final $hhash]
+    } onerror {} {
         if {[info exists hhash]} {
-            capi_hash_free $hhash
+            hash_free $hhash
         }
-        crypt_free $hcrypt
+        rethrow
+    } finally {
+        close $fd
     }
 }
 
-interp alias {} twapi::md5 {} twapi::_do_hash prov_rsa_full md5
-interp alias {} twapi::sha1 {} twapi::_do_hash prov_rsa_full sha1
-interp alias {} twapi::sha256 {} twapi::_do_hash prov_rsa_aes sha_256
-interp alias {} twapi::sha384 {} twapi::_do_hash prov_rsa_aes sha_384
-interp alias {} twapi::sha512 {} twapi::_do_hash prov_rsa_aes sha_512
-
 proc twapi::hmac {data key {prf sha1} {charset {}}} {
     if {$charset ne ""} {
         set data [encoding convertto $charset $data]
     }
 
+    # MD5, SHA-1 and SHA-2 are computed natively. Others go through the CSP.
+    variable _hmac_native_algids
+    if {![info exists _hmac_native_algids]} {
+        set _hmac_native_algids [lmap alg {md5 sha1 sha_256 sha_384 sha_512} {
+            capi_algid $alg
+        }]
+    }
+    set algid [capi_algid $prf]
+    if {$algid in $_hmac_native_algids} {
+        return [Twapi_Hash $algid $data $key]
+    }
+
     # Choose prov_rsa_aes because older CSP's do not support sha256
     set hcrypt [crypt_acquire -csptype prov_rsa_aes]
     try {
@@ -392,7 +435,9 @@ proc twapi::cert_store_add_encoded_certificate {hstore enccert args} {
 
 proc twapi::cert_store_export_pem {hstore} {
     set pem {}
-    cert_store_iterate $hstore c {append pem [cert_export $c]\n}
+    cert_store_iterate $hstore c {
+        append pem [Twapi_PemEncode [lindex [Twapi_CertGetEncoded $c] 1] CERTIFICATE] \n
+    }
     return $pem
 }
 
@@ -642,22 +687,21 @@ proc twapi::cert_thumbprint {hcert} {
 proc twapi::cert_info {hcert} {
     # TBD - add option to cook extensions using _cert_decode_extension
     # instead of returning the raw form
-    set info [twine {
-        -version -serialnumber -signaturealgorithm -issuer
-        -start -end -subject -publickey -issuerid -subjectid -extensions} \
-                [Twapi_CertGetInfo $hcert]]
-    dict set info -start \
-        [clock format \
-             [large_system_time_to_secs_since_1970 [dict get $info -start]] \
-             -timezone :UTC \
-             -format "%Y-%m-%d %H:%M:%S"]
-    dict set info -end \
-        [clock format \
-             [large_system_time_to_secs_since_1970 [dict get $info -end]] \
-             -timezone :UTC \
-             -format "%Y-%m-%d %H:%M:%S"]
-
-    return $info
+    # The dictionary, including the formatted -start and -end, is built
+    # and cached by Twapi_CertGetInfo.
+    return [Twapi_CertGetInfo $hcert]
+}
+
+interp alias {} twapi::cert_info_cache_stats {} twapi::Twapi_CertInfoCacheStats
+interp alias {} twapi::cert_info_cache_clear {} twapi::Twapi_CertInfoCacheClear
+
+proc twapi::cert_info_cache_configure {args} {
+    set stats [Twapi_CertInfoCacheStats]
+    parseargs args [list \
+                        [list maxentries.int [dict get $stats maxentries]] \
+                        [list hash.arg [dict get $stats hash] {sha1 sha256}]] \
+        -maxleftover 0 -setvars
+    Twapi_CertInfoCacheConfigure $maxentries $hash
 }
 
 proc twapi::cert_extension {hcert oid} {
@@ -1234,7 +1278,7 @@ proc twapi::cert_request_parse {req args} {
 
     # 3 -> CRYPT_STRING_BASE64REQUESTHEADER 
     # 4 -> X509_CERT_REQUEST_TO_BE_SIGNED 
-    lassign [::twapi::CryptDecodeObjectEx 4 [_pem_decode $req $encoding 3]] ver subject pubkey attrs
+    lassign [::twapi::CryptDecodeObjectEx 4 [_pem_decode $req $encoding]] ver subject pubkey attrs
     lappend reqdict version $ver pubkey $pubkey attributes $attrs
     lappend reqdict subject [cert_blob_to_name $subject]
     foreach attr $attrs {
@@ -2116,8 +2160,9 @@ proc twapi::_capi_parse {type arg args} {
             set fd [open $arg]
             trap {
                 fconfigure $fd -translation binary
-                set content [_pem_decode [read $fd] $encoding]
+                set content [read $fd]
                 set is_pem  [_is_pem $content]
+                set content [_pem_decode $content $encoding]
             } finally {
                 close $fd
             }
@@ -2226,14 +2271,21 @@ proc twapi::asn1_decode_string {bin} {
 
 # TBD - document
 proc twapi::asn1_encode_string {s {encformat utf8}} {
-    # 24 -> X509_UNICODE_ANY_STRING
-    return [twapi::CryptEncodeObjectEx 24 [list [dict! {
+    set type [dict! {
         numeric 3 printable 4 teletex 5 t61 5 videotex 6 ia5 7 graphic 8
         visible 9 iso646 9 general 10 universal 11 int4 11
         bmp 12 unicode 12 utf8 13
-    } $encformat] $s]]
+    } $encformat]
+    # Leave the 8-bit string types, whose character set CAPI chooses,
+    # to CAPI. 24 -> X509_UNICODE_ANY_STRING
+    if {$type in {5 6 8 10}} {
+        return [twapi::CryptEncodeObjectEx 24 [list $type $s]]
+    }
+    return [Twapi_Asn1EncodeString $type $s]
 }
 
+interp alias {} twapi::asn1_decode {} twapi::Twapi_Asn1Decode
+
 ###
 # Key procs
 
@@ -3270,9 +3322,7 @@ proc twapi::_parse_store_open_opts {optvals} {
 # Helper to return as der/pem based on encoding option
 proc twapi::_as_pem_or_der {bin tag encoding} {
     if {$encoding eq "pem"} {
-        # 1 -> CRYPT_STRING_BASE64
-        # 0x80000000 -> LF-only, not CRLF
-        return "-----BEGIN $tag-----\n[CryptBinaryToString $bin 0x80000001]-----END $tag-----\n"
+        return [Twapi_PemEncode $bin $tag]
     } else {
         return $bin
     }
@@ -3281,25 +3331,21 @@ proc twapi::_as_pem_or_der {bin tag encoding} {
 # Helper for converting input parameters if they are in PEM format
 # pem_or_der is the data
 # enc specifies the type of pem_or_der. If empty, we guess.
-# pemtype should generally be
-# 0 -> CRYPT_STRING_BASE64HEADER for certificates
-# 1 -> CRYPT_STRING_BASE64 (no header)
-# 3 -> CRYPT_STRING_BASE64REQUESTHEADER
-# 6 -> CRYPT_STRING_BASE64_ANY (actually same as 0 or 1)
-proc twapi::_pem_decode {pem_or_der enc {pemtype 6}} {
+# PEM data may also be plain base64 without the BEGIN/END lines. Only
+# the first block of a PEM bundle is returned.
+proc twapi::_pem_decode {pem_or_der enc} {
     if {$enc eq "der"} {
         return $pem_or_der
     }
-    if {$enc eq "pem" || 
-        [regexp -nocase {^\s*-----\s*BEGIN\s+} $pem_or_der]} {
-        return [CryptStringToBinary $pem_or_der $pemtype]
+    if {$enc eq "pem" || [Twapi_IsPem $pem_or_der]} {
+        return [lindex [Twapi_PemDecode $pem_or_der 1] 1]
     }
     return $pem_or_der
 }
 
-proc twapi::_is_pem {pem_or_der} {
-    return [regexp -nocase {^\s*-----\s*BEGIN\s+} $pem_or_der]
-}
+interp alias {} twapi::_is_pem {} twapi::Twapi_IsPem
+interp alias {} twapi::pem_decode {} twapi::Twapi_PemDecode
+interp alias {} twapi::pem_encode {} twapi::Twapi_PemEncode
 
 # Utility proc to generate certs in a memory store - 
 # one self signed which is used to sign a client and a server cert
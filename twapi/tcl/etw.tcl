@@ -715,21 +715,155 @@ proc twapi::etw_close_session {htrace} {
     return
 }
 
+interp alias {} twapi::etw_schema_cache_stats {} twapi::Twapi_ETWSchemaCacheStats
+interp alias {} twapi::etw_schema_cache_clear {} twapi::Twapi_ETWSchemaCacheClear
+
+proc twapi::etw_schema_cache_configure {args} {
+    parseargs args [list \
+                        [list maxentries.int [dict get [Twapi_ETWSchemaCacheStats] maxentries]]] \
+        -maxleftover 0 -setvars
+    Twapi_ETWSchemaCacheConfigure $maxentries
+}
+
 
 proc twapi::etw_process_events {args} {
     array set opts [parseargs args {
         callback.arg
         start.arg
         end.arg
+        lazy.bool
     } -nulldefault]
 
     if {[llength $args] == 0} {
         error "At least one trace handle must be specified."
     }
 
+    if {$opts(lazy)} {
+        return [ProcessTrace $args $opts(callback) $opts(start) $opts(end) 1]
+    }
     return [ProcessTrace $args $opts(callback) $opts(start) $opts(end)]
 }
 
+# Processes the traces on a thread of their own, invoking -callback from
+# the event loop with each buffer descriptor and its batch of events
+proc twapi::etw_start_processing {args} {
+    variable _etw_sessions
+
+    array set opts [parseargs args {
+        callback.arg
+        completioncallback.arg
+        start.arg
+        end.arg
+        {maxqueue.int 0}
+        {overflow.arg block {block dropoldest dropnewest sample}}
+        {sampleinterval.int 10}
+    } -nulldefault]
+
+    if {[llength $args] == 0} {
+        error "At least one trace handle must be specified."
+    }
+    if {[llength $opts(callback)] == 0} {
+        badargs! "Option -callback must be specified."
+    }
+
+    if {$opts(maxqueue) < 0} {
+        badargs! "Option -maxqueue must not be negative."
+    }
+    if {$opts(sampleinterval) < 1} {
+        badargs! "Option -sampleinterval must be greater than 0."
+    }
+    # Order must match TwapiEtwSessionOverflow
+    set overflow [lsearch -exact {block dropoldest dropnewest sample} $opts(overflow)]
+    set id [Twapi_ETWSessionStart $args $opts(start) $opts(end) \
+                $opts(maxqueue) $overflow $opts(sampleinterval)]
+    set _etw_sessions($id) [list $opts(callback) $opts(completioncallback)]
+    return $id
+}
+
+proc twapi::etw_stop_processing {id} {
+    variable _etw_sessions
+
+    if {![info exists _etw_sessions($id)]} {
+        badargs! "No ETW processing session with id $id."
+    }
+    Twapi_ETWSessionStop $id
+    return
+}
+
+proc twapi::etw_processing_stats {id} {
+    variable _etw_sessions
+
+    if {![info exists _etw_sessions($id)]} {
+        badargs! "No ETW processing session with id $id."
+    }
+    return [Twapi_ETWSessionStats $id]
+}
+
+# Called from the event loop with each buffer processed by a session
+# thread and when the thread is done. Returns 0 if processing should stop.
+proc twapi::_etw_session_handler {id type args} {
+    variable _etw_sessions
+
+    if {![info exists _etw_sessions($id)]} {
+        return 0;               # Not an error, could have been queued after stop
+    }
+    lassign $_etw_sessions($id) callback completion
+
+    if {$type eq "end"} {
+        # Unset after the completion callback so it can retrieve stats
+        if {[llength $completion] &&
+            [catch {uplevel #0 [linsert $completion end $id {*}$args]} msg] == 1} {
+            after 0 [list error $msg $::errorInfo $::errorCode]
+        }
+        unset _etw_sessions($id)
+        return 0
+    }
+
+    set code [catch {uplevel #0 [linsert $callback end {*}$args]} msg]
+    switch -exact -- $code {
+        0 - 4 { return 1 }
+        3     { return 0 }
+        default {
+            # Error - put in background and stop processing
+            after 0 [list error $msg $::errorInfo $::errorCode]
+            return 0
+        }
+    }
+}
+
+proc twapi::etw_open_etl {path args} {
+    parseargs args {
+        rawtimestamps.bool
+    } -maxleftover 0 -setvars -nulldefault
+
+    return [Twapi_EtlOpen [file nativename [file normalize $path]] $rawtimestamps]
+}
+
+interp alias {} twapi::etw_close_etl {} twapi::Twapi_EtlClose
+interp alias {} twapi::etw_etl_info {} twapi::Twapi_EtlInfo
+interp alias {} twapi::etw_etl_seek {} twapi::Twapi_EtlSeek
+
+proc twapi::etw_process_etl {etl args} {
+    array set opts [parseargs args {
+        callback.arg
+        start.arg
+        end.arg
+        maxbuffers.int
+        lazy.bool
+    } -maxleftover 0 -nulldefault]
+
+    return [Twapi_EtlProcess $etl $opts(callback) $opts(start) $opts(end) $opts(maxbuffers) $opts(lazy)]
+}
+
+interp alias {} twapi::etw_batch_count {} twapi::Twapi_ETWBatchCount
+
+proc twapi::etw_batch_columns {batch args} {
+    if {[llength $args] == 0} {
+        return [Twapi_ETWBatchColumns $batch]
+    }
+    return [Twapi_ETWBatchColumns $batch $args]
+}
+
 proc twapi::etw_open_formatter {} {
     variable _etw_formatters
 
@@ -791,7 +925,11 @@ proc twapi::etw_format_events {formatter args} {
 }
 
 proc twapi::_etw_format_tdh_events {bufdesc events} {
-    
+    # Events collected with -lazy are decoded in one go
+    if {[Twapi_ETWIsBatch $events]} {
+        return [Twapi_ETWBatchFormat $events]
+    }
+
     set bufhdr [etw_event_trace_logfile trace_logfile_header $bufdesc]
     set timer_resolution [etw_trace_logfile_header timer_resolution $bufhdr]
     set private_session [expr {0x800 & [etw_trace_logfile_header logfile_mode $bufhdr]}]
@@ -814,6 +952,44 @@ proc twapi::_etw_format_tdh_events {bufdesc events} {
     return $formatted_events
 }
 
+# Returns the class name, event type name and field types for a MOF
+# event, or just the class name and the type if there is no definition.
+proc twapi::_etw_mof_event_def {guid version type} {
+    variable _etw_event_defs
+
+    if {[dict exists $_etw_event_defs $guid $version -definitions $type]} {
+        set mof [dict get $_etw_event_defs $guid $version -definitions $type]
+        return [list \
+                    [dict get $_etw_event_defs $guid $version -classname] \
+                    [dict get $mof -eventtypename] \
+                    [dict get $mof -fieldtypes]]
+    }
+    if {[dict exists $_etw_event_defs $guid "" -definitions $type]} {
+        # If exact version not present, use one without
+        # a version
+        set mof [dict get $_etw_event_defs $guid "" -definitions $type]
+        return [list \
+                    [dict get $_etw_event_defs $guid "" -classname] \
+                    [dict get $mof -eventtypename] \
+                    [dict get $mof -fieldtypes]]
+    }
+
+    # No definition. Create an entry so we know we already tried
+    # looking this up and don't keep retrying later
+    dict set _etw_event_defs $guid {}
+
+    # Nothing we can add to the event. Pass on with defaults
+    # Try to get at least the class name
+    if {[dict exists $_etw_event_defs $guid $version -classname]} {
+        set eventclass [dict get $_etw_event_defs $guid $version -classname]
+    } elseif {[dict exists $_etw_event_defs $guid "" -classname]} {
+        set eventclass [dict get $_etw_event_defs $guid "" -classname]
+    } else {
+        set eventclass ""
+    }
+    return [list $eventclass $type]
+}
+
 proc twapi::_etw_format_mof_events {oswbemservices bufdesc events} {
     variable _etw_event_defs
 
@@ -855,39 +1031,20 @@ proc twapi::_etw_format_mof_events {oswbemservices bufdesc events} {
             lappend formatted_event [expr {$hdr(user_time) * $timer_resolution}] [expr {$hdr(kernel_time) * $timer_resolution}]
         }
 
-        if {[dict exists $_etw_event_defs $hdr(guid) $hdr(version) -definitions $hdr(type)]} {
-            set eventclass [dict get $_etw_event_defs $hdr(guid) $hdr(version) -classname]
-            set mof [dict get $_etw_event_defs $hdr(guid) $hdr(version) -definitions $hdr(type)]
-            set eventtypename [dict get $mof -eventtypename]
-            set properties [Twapi_ParseEventMofData \
-                                [mof_event data $event] \
-                                [dict get $mof -fieldtypes] \
-                                $pointer_size]
-        } elseif {[dict exists $_etw_event_defs $hdr(guid) "" -definitions $hdr(type)]} {
-            # If exact version not present, use one without
-            # a version
-            set eventclass [dict get $_etw_event_defs $hdr(guid) "" -classname]
-            set mof [dict get $_etw_event_defs $hdr(guid) "" -definitions $hdr(type)]
-            set eventtypename [dict get $mof -eventtypename]
+        # Look up the definition once per event class and type. The
+        # field types are then compiled by Twapi_ParseEventMofData the
+        # first time and reused for every event of the class.
+        set defkey [list $hdr(guid) $hdr(version) $hdr(type)]
+        if {![info exists eventdefs($defkey)]} {
+            set eventdefs($defkey) [_etw_mof_event_def $hdr(guid) $hdr(version) $hdr(type)]
+        }
+        lassign $eventdefs($defkey) eventclass eventtypename fieldtypes
+        if {[llength $eventdefs($defkey)] == 3} {
             set properties [Twapi_ParseEventMofData \
                                 [mof_event data $event] \
-                                [dict get $mof -fieldtypes] \
+                                $fieldtypes \
                                 $pointer_size]
         } else {
-            # No definition. Create an entry so we know we already tried
-            # looking this up and don't keep retrying later
-            dict set _etw_event_defs $hdr(guid) {}
-
-            # Nothing we can add to the event. Pass on with defaults
-            set eventtypename $hdr(type)
-            # Try to get at least the class name
-            if {[dict exists $_etw_event_defs $hdr(guid) $hdr(version) -classname]} {
-                set eventclass [dict get $_etw_event_defs $hdr(guid) $hdr(version) -classname]
-            } elseif {[dict exists $_etw_event_defs $hdr(guid) "" -classname]} {
-                set eventclass [dict get $_etw_event_defs $hdr(guid) "" -classname]
-            } else {
-                set eventclass ""
-            }
             set properties [list _mofdata [mof_event data $event]]
         }
 
@@ -923,13 +1080,23 @@ proc twapi::etw_dump_to_file {args} {
     array set opts [parseargs args {
         {output.arg stdout}
         {limit.int -1}
-        {format.arg csv {csv list}}
+        {format.arg csv {csv jsonl list}}
         {separator.arg ,}
         {fields.arg {-timecreated -levelname -providername -pid -taskname -opcodename -message}}
         {filter.arg {}}
+        {buffersize.int 65536}
     }]
 
-    if {$opts(format) eq "csv"} {
+    # Events are written from C unless they have to be filtered as
+    # records or decoded through MOF, neither of which is possible there
+    set native [expr {
+        $opts(format) ne "list" && [llength $opts(filter)] == 0 &&
+        ![etw_force_mof] && [min_os_version 6 0]
+    }]
+    if {$opts(format) eq "jsonl" && !$native} {
+        error "Format jsonl is not supported with -filter or MOF based event decoding."
+    }
+    if {$opts(format) eq "csv" && !$native} {
         package require csv
     }
     if {$opts(output) in [chan names]} {
@@ -957,6 +1124,33 @@ proc twapi::etw_dump_to_file {args} {
             }
         }
 
+        if {$native} {
+            # Also writes the CSV header
+            set writer [Twapi_ETWWriterOpen $outfd $opts(format) $opts(separator) $opts(fields) $opts(buffersize)]
+            if {[llength $htraces]} {
+                set callback [list apply {
+                    {writer counter_varname max bufd events}
+                    {
+                        if {$max < 0} {
+                            Twapi_ETWWriterWrite $writer $events -1
+                            return
+                        }
+                        incr $counter_varname [Twapi_ETWWriterWrite $writer $events [expr {$max - [set $counter_varname]}]]
+                        if {[set $counter_varname] >= $max} {
+                            return -code break
+                        }
+                    }
+                    ::twapi
+                } $writer $varname $opts(limit)]
+                etw_process_events -lazy 1 -callback $callback {*}$htraces
+            }
+            # Flush remaining output here so write errors are raised
+            set w $writer
+            unset writer
+            Twapi_ETWWriterClose $w
+            return
+        }
+
         if {$opts(format) eq "csv"} {
             puts $outfd [csv::join $opts(fields) $opts(separator)]
         }
@@ -1008,6 +1202,11 @@ proc twapi::etw_dump_to_file {args} {
         foreach htrace $htraces {
             etw_close_session $htrace
         }
+        # Only still open on errors, which take precedence over any
+        # failure to flush
+        if {[info exists writer]} {
+            catch {Twapi_ETWWriterClose $writer}
+        }
         if {$do_close} {
             close $outfd
         } else {
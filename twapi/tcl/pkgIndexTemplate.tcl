@@ -48,18 +48,31 @@ proc twapi::package_setup {dir pkg version type {file {}} {commands {}}} {
         }
     }
 
-    if {[llength $commands] == 0} {
+    foreach {ns cmds} $commands {
+        foreach cmd $cmds {
+            if {[string index $cmd 0] ne "_"} {
+                dict lappend ::twapi::exports $ns $cmd
+            }
+        }
+    }
+
+    if {$type eq "load"} {
+        # Binary modules are always loaded right away as other modules
+        # call their C commands directly. Creating those is cheap. With
+        # lazy loading, the module initializer only sets up auto_index
+        # entries for the commands defined by the module script which is
+        # then decompressed and evaluated on first use of one of them.
+        if {[llength $commands] && $pkg ne "twapi_base"} {
+            set ::twapi::_deferred_scripts($pkg) $commands
+        }
+        uplevel #0 $loadcmd
+    } elseif {[llength $commands] == 0} {
         # No commands specified, load the package right away
-        # TBD - what about the exports table?
         uplevel #0 $loadcmd
     } else {
         # Set up the load for when commands are actually accessed
-        # TBD - add a line to export commands here ?
         foreach {ns cmds} $commands {
             foreach cmd $cmds {
-                if {[string index $cmd 0] ne "_"} {
-                    dict lappend ::twapi::exports $ns $cmd
-                }
                 set auto_index(${ns}::$cmd) $loadcmd
             }
         }
@@ -276,6 +276,10 @@ proc twapi::sspi_delete_context {ctx} {
     if {[llength $h]} {
         DeleteSecurityContext $h
     }
+    set buf [dict get $_sspi_state($ctx) StreamBuffer]
+    if {$buf ne ""} {
+        StreamBufferFree $buf
+    }
     unset _sspi_state($ctx)
 }
 
@@ -335,7 +339,7 @@ proc twapi::sspi_step {ctx {received ""}} {
     dict with _sspi_state($ctx) {
         # Note the dictionary content variables are
         #   State, Handle, Output, Outattr, Expiration,
-        #   Ctxtype, Inattr, Target, Datarep, Credentials
+        #   Ctxtype, Inattr, Target, Datarep, Credentials, StreamSizes
 
         # Append new input to existing input
         append Input $received
@@ -343,6 +347,8 @@ proc twapi::sspi_step {ctx {received ""}} {
             ok {
                 set data [_gather_secbuf_data $Output]
                 set Output {}
+                # Sizes may change if the handshake was a renegotiation
+                set StreamSizes {}
 
                 # $Input at this point contains left over input that is
                 # actually application data (streaming case).
@@ -560,8 +566,6 @@ proc twapi::sspi_encrypt {ctx data args} {
 }
 
 proc twapi::sspi_encrypt_stream {ctx data args} {
-    variable _sspi_state
-    
     set h [_sspi_context_handle $ctx]
 
     # TBD - docment options
@@ -569,19 +573,11 @@ proc twapi::sspi_encrypt_stream {ctx data args} {
         {qop.int 0}
     } -maxleftover 0 -setvars
 
-    set enc ""
-    while {[string length $data]} {
-        lassign [EncryptStream $h $qop $data] fragment data
-        lappend enc $fragment
-    }
-
-    return [join $enc ""]
+    return [EncryptStream $h $qop $data [_sspi_stream_sizes $ctx]]
 }
 
 # chan must be in binary mode
 proc twapi::sspi_encrypt_and_write {ctx data chan args} {
-    variable _sspi_state
-    
     set h [_sspi_context_handle $ctx]
 
     parseargs args {
@@ -589,10 +585,7 @@ proc twapi::sspi_encrypt_and_write {ctx data chan args} {
         {flush.bool 1}
     } -maxleftover 0 -setvars
 
-    while {[string length $data]} {
-        lassign [EncryptStream $h $qop $data] fragment data
-        puts -nonewline $chan $fragment
-    }
+    puts -nonewline $chan [EncryptStream $h $qop $data [_sspi_stream_sizes $ctx]]
 
     if {$flush} {
         chan flush $chan
@@ -641,25 +634,17 @@ proc twapi::sspi_decrypt_stream {ctx data} {
     variable _sspi_state
     set hctx [_sspi_context_handle $ctx]
 
-    # SSL decryption is done in max size chunks.
-    # We will loop collecting as much data as possible. Collecting
-    # as a list and joining at end minimizes internal byte copies
-    set plaintext {}
-    lassign [DecryptStream $hctx [dict get $_sspi_state($ctx) Input] $data] status decrypted extra
-    lappend plaintext $decrypted
-    
-    # TBD - handle renegotiate status
-    while {$status eq "ok" && [string length $extra]} {
-        # See if additional data and loop again
-        lassign [DecryptStream $hctx $extra] status decrypted extra
-        lappend plaintext $decrypted
+    # Ciphertext of incomplete records is retained in the native
+    # buffer for the next call so no concatenation is needed here
+    set buf [dict get $_sspi_state($ctx) StreamBuffer]
+    if {$buf eq ""} {
+        set buf [StreamBufferCreate]
+        dict set _sspi_state($ctx) StreamBuffer $buf
     }
 
-    dict set _sspi_state($ctx) Input $extra
-    if {$status eq "incomplete_message"} {
-        set status ok
-    }
-    return [list $status [join $plaintext ""]]
+    # TBD - handle renegotiate status
+    set status [DecryptStream $hctx $buf $data]
+    return [list $status [StreamBufferRead $buf]]
 }
 
 
@@ -676,7 +661,9 @@ proc twapi::_construct_sspi_security_context {id rawctx ctxtype inattr target cr
                                           Inattr $inattr \
                                           Target $target \
                                           Datarep $datarep \
-                                          Credentials $credentials] \
+                                          Credentials $credentials \
+                                          StreamSizes {} \
+                                          StreamBuffer {}] \
                               [twine \
                                    {State Handle Output Outattr Expiration Input} \
                                    $rawctx]]
@@ -702,6 +689,39 @@ proc twapi::_sspi_context_handle {ctx} {
     return [dict get $_sspi_state($ctx) Handle]
 }
 
+# Returns the state dictionary of a context
+proc twapi::_sspi_context_state {ctx} {
+    variable _sspi_state
+    _sspi_validate_handle $ctx
+    return $_sspi_state($ctx)
+}
+
+# Forgets a context without deleting the security handle, for when
+# ownership of the handle passes elsewhere, e.g. to a native TLS channel
+proc twapi::_sspi_detach_context {ctx} {
+    variable _sspi_state
+    _sspi_validate_handle $ctx
+    set buf [dict get $_sspi_state($ctx) StreamBuffer]
+    if {$buf ne ""} {
+        StreamBufferFree $buf
+    }
+    unset _sspi_state($ctx)
+}
+
+# Returns the stream sizes for a context, querying them on first use
+# after the handshake instead of on every encryption
+proc twapi::_sspi_stream_sizes {ctx} {
+    variable _sspi_state
+
+    set sizes [dict get $_sspi_state($ctx) StreamSizes]
+    if {[llength $sizes] == 0} {
+        # 4 -> SECPKG_ATTR_STREAM_SIZES
+        set sizes [QueryContextAttributes [dict get $_sspi_state($ctx) Handle] 4]
+        dict set _sspi_state($ctx) StreamSizes $sizes
+    }
+    return $sizes
+}
+
 proc twapi::_gather_secbuf_data {bufs} {
     if {[llength $bufs] == 1} {
         return [lindex [lindex $bufs 0] 1]
@@ -15,13 +15,22 @@ namespace eval twapi::tls {
     #    accept callback. On client and on servers sockets initialized
     #    with starttls, this key must NOT be present
     #  SspiContext - SSPI context for the connection
-    #  Input  - plaintext data to pass to app
-    #  Output - plaintext data to encrypt and output
+    #  Buffer - native stream buffer holding received data not yet
+    #    decrypted and plaintext data not yet passed to app
+    #  Output - plaintext data to encrypt and output. Also holds small
+    #    writes held back for coalescing on an open connection
+    #  CoalesceSize - writes are held back until this many bytes are
+    #    pending. 0 disables coalescing
+    #  CoalesceDelay - max milliseconds to hold back coalesced writes
+    #  CoalesceTimer - id of the after timer that flushes coalesced writes
     #  ReadEventPosted - if this key exists, a chan postevent for read
     #    is already in progress and a second one should not be posted
     #  WriteEventPosted - if this key exists, a chan postevent for write
     #    is already in progress and a second one should not be posted
     #  WriteDisabled - 0 normally. Set to 1 on a half-close
+    #
+    # Channels created with -native only have an entry here until the
+    # handshake completes and the native driver is stacked on the socket.
 
     variable _channels
     array set _channels {}
@@ -45,8 +54,18 @@ proc twapi::tls::_socket {args} {
         requestclientcert
         {credentials.arg {}}
         {verifier.arg {}}
+        {coalescesize.int 0}
+        {coalescedelay.int 10}
+        native
     } -setvars
 
+    _validate_coalesce_option -coalescesize $coalescesize
+    _validate_coalesce_option -coalescedelay $coalescedelay
+
+    if {$native && ($async || [info exists server])} {
+        badargs! "Option -native cannot be used with -async or -server."
+    }
+
     set chan [chan create {read write} [list [namespace current]]]
     # NOTE: We were originally using badargs! instead of error to raise
     # exceptions. However that lands up bypassing the trap because of
@@ -91,6 +110,8 @@ proc twapi::tls::_socket {args} {
     trap {
         set so [socket {*}$socket_args {*}$args]
         _init $chan $type $so $credentials $peersubject $requestclientcert [lrange $verifier 0 end] $server
+        dict set _channels($chan) CoalesceSize $coalescesize
+        dict set _channels($chan) CoalesceDelay $coalescedelay
 
         if {$type eq "CLIENT"} {
             if {! $async} {
@@ -104,6 +125,9 @@ proc twapi::tls::_socket {args} {
                         error "TLS negotiation aborted"
                     }
                 }
+                if {$native} {
+                    set chan [_stack_native $chan]
+                }
             }
         }
     } onerror {} {
@@ -138,8 +162,21 @@ proc twapi::tls::_starttls {so args} {
             peersubject.arg
             {credentials.arg {}}
             {verifier.arg {}}
+            {coalescesize.int 0}
+            {coalescedelay.int 10}
+            native
         } -setvars -maxleftover 0
 
+        _validate_coalesce_option -coalescesize $coalescesize
+        _validate_coalesce_option -coalescedelay $coalescedelay
+
+        if {$native && $server} {
+            badargs! "Option -native cannot be used with -server."
+        }
+        if {$native && ![chan configure $so -blocking]} {
+            badargs! "Option -native requires a blocking channel."
+        }
+
         if {$server} {
             if {[info exists peersubject]} {
                 badargs! "Option -peersubject cannot be specified with -server."
@@ -181,6 +218,8 @@ proc twapi::tls::_starttls {so args} {
         chan event $so readable {}
         chan event $so writable {}
         _init $chan $type $so $credentials $peersubject $requestclientcert [lrange $verifier 0 end] ""
+        dict set _channels($chan) CoalesceSize $coalescesize
+        dict set _channels($chan) CoalesceDelay $coalescedelay
         # Copy saved config to wrapper channel
         chan configure $chan {*}$so_opts
         if {$type eq "CLIENT"} {
@@ -210,6 +249,12 @@ proc twapi::tls::_starttls {so args} {
             }
             _negotiate $chan
         }
+        if {$native} {
+            if {[dict get $_channels($chan) State] ne "OPEN"} {
+                error "TLS negotiation failed on blocking channel"
+            }
+            set chan [_stack_native $chan]
+        }
     } onerror {} {
         # If _init did not even go as far initializing _channels($chan),
         # close socket ourselves. If it was initialized, the socket
@@ -285,6 +330,8 @@ proc twapi::tls::_accept {listener so raddr raport} {
     trap {
         set chan [chan create {read write} [list [namespace current]]]
         _init $chan SERVER $so [dict get $_channels($listener) Credentials] "" [dict get $_channels($listener) RequestClientCert] [dict get $_channels($listener) Verifier] [linsert [dict get $_channels($listener) AcceptCallback] end $chan $raddr $raport]
+        dict set _channels($chan) CoalesceSize [dict get $_channels($listener) CoalesceSize]
+        dict set _channels($chan) CoalesceDelay [dict get $_channels($listener) CoalesceDelay]
         # If we negotiate the connection, the socket is blocking so
         # will hang the whole operation. Instead we mark it non-blocking
         # and the switch back to blocking when the connection gets opened.
@@ -363,7 +410,7 @@ proc twapi::tls::watch {chan watchmask} {
             # TBD - do we have a mechanism for continuously posting
             # events when socket has gone away ? Do we even post once
             # when socket is closed (on error for example)
-            if {[string length $Input] || ![info exists Socket]} {
+            if {[StreamBufferSize $Buffer] || ![info exists Socket]} {
                 _post_read_event $chan
             }
             # Turn read handler back on in case it had been turned off.
@@ -410,10 +457,20 @@ proc twapi::tls::read {chan nbytes} {
         }
     }
 
+    # Send any writes held back for coalescing before reading. The peer
+    # may be waiting for them before replying, and the coalescing timer
+    # cannot fire while a blocking read waits.
+    if {[dict get $_channels($chan) State] eq "OPEN" &&
+        ![dict get $_channels($chan) WriteDisabled] &&
+        [string length [dict get $_channels($chan) Output]]} {
+        _flush_pending_output $chan
+        flush [dict get $_channels($chan) Socket]
+    }
+
     dict with _channels($chan) {
         # Try to read more bytes if don't have enough AND conn is open
         set status ok
-        if {[string length $Input] < $nbytes && $State eq "OPEN"} {
+        if {[StreamBufferSize $Buffer] < $nbytes && $State eq "OPEN"} {
             if {$Blocking} {
                 # For blocking channels, we do not want to block if some
                 # bytes are already available. The refchan will call us
@@ -421,17 +478,16 @@ proc twapi::tls::read {chan nbytes} {
                 # not what app's read call has asked. It expects us
                 # to return whatever we have (but at least one byte)
                 # and block only if nothing is available
-                while {[string length $Input] == 0 && $status eq "ok"} {
+                while {[StreamBufferSize $Buffer] == 0 && $status eq "ok"} {
                     # The channel does not compress so we need to read in
                     # at least $needed bytes. Because of TLS overhead, we may
                     # actually need even more
                     set status ok
                     set data [_blocking_read $Socket]
                     if {[string length $data]} {
-                        lassign [sspi_decrypt_stream $SspiContext $data] status plaintext
-                        # Note plaintext might be "" if complete cipher block
-                        # was not received
-                        append Input $plaintext
+                        # Note no plaintext might result if complete
+                        # cipher block was not received
+                        set status [_decrypt $SspiContext $Buffer $data]
                     } else {
                         set status eof
                     }
@@ -441,14 +497,13 @@ proc twapi::tls::read {chan nbytes} {
                 set status ok
                 set data [chan read $Socket]
                 if {[string length $data]} {
-                    lassign [sspi_decrypt_stream $SspiContext $data] status plaintext
-                    append Input $plaintext
+                    set status [_decrypt $SspiContext $Buffer $data]
                 } else {
                     if {[chan eof $Socket]} {
                         set status eof
                     }
                 }
-                if {[string length $Input] == 0} {
+                if {[StreamBufferSize $Buffer] == 0} {
                     # Do not have enough data. See if connection closed
                     # TBD - also handle status == renegotiate
                     if {$status eq "ok"} {
@@ -459,11 +514,10 @@ proc twapi::tls::read {chan nbytes} {
             }
         }
 
-        # TBD - use inline K operator to make this faster? Probably no use
-        # since Input is also referred to from _channels($chan)
-        set ret [string range $Input 0 $nbytes-1]
-        set Input [string range $Input $nbytes end]
-        if {"read" in [dict get $_channels($chan) WatchMask] && [string length $Input]} {
+        # Plaintext is handed out from the native buffer so the
+        # remainder is not copied on every read
+        set ret [StreamBufferRead $Buffer $nbytes]
+        if {"read" in [dict get $_channels($chan) WatchMask] && [StreamBufferSize $Buffer]} {
             _post_read_event $chan
         }
         if {$status ne "ok"} {
@@ -522,12 +576,44 @@ proc twapi::tls::write {chan data} {
                 if {$WriteDisabled} {
                     error "Channel closed for output."
                 }
-                # There might be pending output if channel has just
-                # transitioned to OPEN state
-                _flush_pending_output $chan
-                # TBD - use sspi_encrypt_and_write instead
-                chan puts -nonewline $Socket [sspi_encrypt_stream $SspiContext $data]
-                flush $Socket
+                # Small writes are held back when coalescing is enabled
+                # so they go out together as one record. With -buffering
+                # full, Tcl only calls us when its buffer fills or on an
+                # explicit flush so the data has to go out right away.
+                if {$CoalesceSize > 0 &&
+                    ([string length $Output] + $datalen) < $CoalesceSize &&
+                    [chan configure $chan -buffering] ne "full"} {
+                    append Output $data
+                    if {$CoalesceTimer eq ""} {
+                        set CoalesceTimer [after $CoalesceDelay [list [namespace current]::_coalesce_flush $chan]]
+                    }
+                } else {
+                    # There might be pending output if channel has just
+                    # transitioned to OPEN state or from coalescing.
+                    if {[string length $Output]} {
+                        append Output $data
+                        set data $Output
+                        set Output ""
+                    }
+                    if {$CoalesceTimer ne ""} {
+                        after cancel $CoalesceTimer
+                        set CoalesceTimer ""
+                    }
+                    if {$CoalesceSize > 0 &&
+                        [chan configure $chan -buffering] ne "full"} {
+                        # Only send whole multiples of the coalesce size
+                        # so records stay full. Hold back the rest.
+                        set n [expr {[string length $data] / $CoalesceSize * $CoalesceSize}]
+                        if {$n < [string length $data]} {
+                            set Output [string range $data $n end]
+                            set data [string range $data 0 $n-1]
+                            set CoalesceTimer [after $CoalesceDelay [list [namespace current]::_coalesce_flush $chan]]
+                        }
+                    }
+                    # TBD - use sspi_encrypt_and_write instead
+                    chan puts -nonewline $Socket [sspi_encrypt_stream $SspiContext $data]
+                    flush $Socket
+                }
             }
             default {
                 append Output $data
@@ -540,6 +626,8 @@ proc twapi::tls::write {chan data} {
 
 proc twapi::tls::configure {chan opt val} {
     debuglog [info level 0]
+    variable _channels
+
     # Does not make sense to change creds and verifier after creation
     switch $opt {
         -context -
@@ -547,6 +635,14 @@ proc twapi::tls::configure {chan opt val} {
         -credentials {
             error "$opt is a read-only option."
         }
+        -coalescesize {
+            _validate_coalesce_option $opt $val
+            dict set _channels($chan) CoalesceSize $val
+        }
+        -coalescedelay {
+            _validate_coalesce_option $opt $val
+            dict set _channels($chan) CoalesceDelay $val
+        }
         default {
             chan configure [_chansocket $chan] $opt $val
         }
@@ -569,6 +665,12 @@ proc twapi::tls::cget {chan opt} {
         -context {
             return [dict get $_channels($chan) SspiContext]
         }
+        -coalescesize {
+            return [dict get $_channels($chan) CoalesceSize]
+        }
+        -coalescedelay {
+            return [dict get $_channels($chan) CoalesceDelay]
+        }
         default {
             return [chan configure [_chansocket $chan] $opt]
         }
@@ -587,7 +689,9 @@ proc twapi::tls::cgetall {chan} {
         }
         lappend config -credentials $Credentials \
         -verifier $Verifier \
-        -context $SspiContext
+        -context $SspiContext \
+        -coalescesize $CoalesceSize \
+        -coalescedelay $CoalesceDelay
     }
     return $config
 }
@@ -654,7 +758,10 @@ proc twapi::tls::_init {chan type so creds peersubject requestclientcert verifie
                               Verifier $verifier \
                               SspiContext {} \
                               PeerSubject $peersubject \
-                              Input {} Output {}]
+                              Buffer [StreamBufferCreate] Output {} \
+                              CoalesceSize 0 \
+                              CoalesceDelay 0 \
+                              CoalesceTimer {}]
 
     if {[llength $creds]} {
         set free_creds 0
@@ -678,8 +785,19 @@ proc twapi::tls::_cleanup {chan} {
         # Note _cleanup can be called in inconsistent state so not all
         # keys may be set up
         dict with _channels($chan) {
+            if {[info exists CoalesceTimer] && $CoalesceTimer ne ""} {
+                after cancel $CoalesceTimer
+            }
             if {[info exists SspiContext]} {
                 if {$State eq "OPEN"} {
+                    # Send any data held back for coalescing before
+                    # the close_notify
+                    if {[string length $Output] && [info exists Socket] &&
+                        !$WriteDisabled} {
+                        if {[catch {puts -nonewline $Socket [sspi_encrypt_stream $SspiContext $Output]} msg]} {
+                            # TBD - debug log
+                        }
+                    }
                     lassign [sspi_shutdown_context $SspiContext] _ outdata
                     if {[string length $outdata] && [info exists Socket]} {
                         if {[catch {puts -nonewline $Socket $outdata} msg]} {
@@ -701,11 +819,48 @@ proc twapi::tls::_cleanup {chan} {
                     # TBD - debug log
                 }
             }
+            if {[info exists Buffer]} {
+                StreamBufferFree $Buffer
+            }
         }
         unset _channels($chan)
     }
 }
 
+# Replaces the reflected channel for an open connection with the native
+# TLS driver stacked on the socket, and returns the socket. The driver
+# takes over the security context, stream buffer and credentials.
+proc twapi::tls::_stack_native {chan} {
+    variable _channels
+
+    foreach opt {
+        -blocking -buffering -buffersize -encoding -eofchar -translation
+    } {
+        lappend chan_opts $opt [chan configure $chan $opt]
+    }
+    flush $chan
+    _flush_pending_output $chan
+
+    dict with _channels($chan) {
+        chan event $Socket readable {}
+        chan event $Socket writable {}
+        set sspi [_sspi_context_state $SspiContext]
+        TlsChannelStack $Socket [dict get $sspi Handle] $Credentials \
+            $FreeCredentials [expr {[dict get $sspi Ctxtype] eq "server"}] \
+            [dict get $sspi Target] [dict get $sspi Inattr] \
+            [dict get $sspi Datarep] [_sspi_stream_sizes $SspiContext] \
+            $Buffer
+        _sspi_detach_context $SspiContext
+        set so $Socket
+        # Now owned by the driver so _cleanup must not touch them
+        unset Socket SspiContext Buffer
+        set FreeCredentials 0
+    }
+    chan close $chan
+    chan configure $so {*}$chan_opts
+    return $so
+}
+
 proc twapi::tls::_cleanup_failed_accept {chan} {
     debuglog [info level 0]
     variable _channels
@@ -832,8 +987,7 @@ proc twapi::tls::_negotiate2 {chan} {
                 switch $status {
                     done {
                         if {[string length $leftover]} {
-                            lassign [sspi_decrypt_stream $SspiContext $leftover] status plaintext
-                            dict append _channels($chan) Input $plaintext
+                            set status [_decrypt $SspiContext $Buffer $leftover]
                             if {$status ne "ok"} {
                                 # TBD - shutdown channel or let _cleanup do it?
                             }
@@ -904,8 +1058,7 @@ proc twapi::tls::_negotiate2 {chan} {
                     switch $status {
                         done {
                             if {[string length $leftover]} {
-                                lassign [sspi_decrypt_stream $SspiContext $leftover] status plaintext
-                                dict append _channels($chan) Input $plaintext
+                                set status [_decrypt $SspiContext $Buffer $leftover]
                                 if {$status ne "ok"} {
                                     # TBD - shut down channel
                                 }
@@ -996,8 +1149,7 @@ proc twapi::tls::_blocking_negotiate_loop {chan} {
 
     if {$status eq "done"} {
         if {[string length $leftover]} {
-            lassign [sspi_decrypt_stream $SspiContext $leftover] status plaintext
-            dict append _channels($chan) Input $plaintext
+            set status [_decrypt $SspiContext $Buffer $leftover]
             if {$status ne "ok"} {
                 error "Error status $status decrypting data"
             }
@@ -1012,6 +1164,12 @@ proc twapi::tls::_blocking_negotiate_loop {chan} {
     return
 }
 
+# Decrypts received data into the channel's stream buffer. Returns
+# ok, expired or renegotiate
+proc twapi::tls::_decrypt {ctx buf data} {
+    return [DecryptStream [_sspi_context_handle $ctx] $buf $data]
+}
+
 proc twapi::tls::_blocking_read {so} {
     debuglog [info level 0]
     # Read from a blocking socket. We do not know how much data is needed
@@ -1030,6 +1188,10 @@ proc twapi::tls::_flush_pending_output {chan} {
     variable _channels
 
     dict with _channels($chan) {
+        if {$CoalesceTimer ne ""} {
+            after cancel $CoalesceTimer
+            set CoalesceTimer ""
+        }
         if {[string length $Output]} {
             debuglog "_flush_pending_output: flushing output"
             puts -nonewline $Socket [sspi_encrypt_stream $SspiContext $Output]
@@ -1039,6 +1201,34 @@ proc twapi::tls::_flush_pending_output {chan} {
     return
 }
 
+# Timer callback to send data held back for coalescing once the
+# configured delay has passed.
+proc twapi::tls::_coalesce_flush {chan} {
+    variable _channels
+
+    if {![info exists _channels($chan)]} {
+        return
+    }
+    dict set _channels($chan) CoalesceTimer ""
+    if {[dict get $_channels($chan) State] ne "OPEN" ||
+        [dict get $_channels($chan) WriteDisabled]} {
+        return
+    }
+    if {[catch {
+        _flush_pending_output $chan
+        flush [dict get $_channels($chan) Socket]
+    } msg]} {
+        debuglog "_coalesce_flush: $msg"
+    }
+    return
+}
+
+proc twapi::tls::_validate_coalesce_option {opt val} {
+    if {![string is integer -strict $val] || $val < 0} {
+        error "Invalid value \"$val\" for option $opt. Must be a non-negative integer."
+    }
+}
+
 # Transitions connection to OPEN or throws error if verifier returns false
 # or fails
 proc twapi::tls::_open {chan} {
@@ -190,6 +190,54 @@ proc twapi::pkgconfig {subcommand {arg {}}} {
     }
 }
 
+proc twapi::startup_profile {} {
+    variable _startup_profile
+    set profile {}
+    foreach mod [lsort [array names _startup_profile]] {
+        dict set profile $mod $_startup_profile($mod)
+    }
+    return $profile
+}
+
+# Loads module scripts whose loading was deferred by the package index
+# and which have not been loaded on demand already
+proc twapi::_load_deferred_scripts {} {
+    variable _script_loaders
+    variable _startup_profile
+    foreach {mod loader} [array get _script_loaders] {
+        if {![dict exists $_startup_profile($mod) eval]} {
+            uplevel #0 $loader
+        }
+    }
+}
+
+# Returns the commands in the twapi and metoo namespaces as a
+# {NAMESPACE COMMANDS ...} list, excluding those in before, which is
+# a list in the same form. Used to record the commands defined by a
+# module script.
+proc twapi::_namespace_commands {{before {}}} {
+    foreach {ns names} $before {
+        foreach name $names {
+            set seen(${ns}::$name) 1
+        }
+    }
+    set cmds {}
+    foreach ns {::twapi ::metoo} {
+        set nslist [list $ns]
+        while {[llength $nslist]} {
+            set nslist [lassign $nslist ns]
+            if {![namespace exists $ns]} continue
+            foreach cmd [info commands ${ns}::*] {
+                if {![info exists seen($cmd)]} {
+                    dict lappend cmds $ns [namespace tail $cmd]
+                }
+            }
+            lappend nslist {*}[namespace children $ns]
+        }
+    }
+    return $cmds
+}
+
 # TBD - document
 proc twapi::support_report {} {
     set report "Operating system: [get_os_description]\n"
@@ -304,97 +352,24 @@ proc twapi::resetbits {v_bits mask} {
     return $bits
 }
 
-# Return a bitmask corresponding to a list of symbolic and integer values
-# If symvals is a single item, it is an array else a list of sym bitmask pairs
-proc twapi::_parse_symbolic_bitmask {syms symvals} {
-    if {[llength $symvals] == 1} {
-        upvar $symvals lookup
-    } else {
-        array set lookup $symvals
-    }
-    set bits 0
-    foreach sym $syms {
-        if {[info exists lookup($sym)]} {
-            set bits [expr {$bits | $lookup($sym)}]
-        } else {
-            set bits [expr {$bits | $sym}]
-        }
-    }
-    return $bits
-}
-
-# Return a list of symbols corresponding to a bitmask
-proc twapi::_make_symbolic_bitmask {bits symvals {append_unknown 1}} {
-    if {[llength $symvals] == 1} {
-        upvar $symvals lookup
-        set map [array get lookup]
-    } else {
-        set map $symvals
-    }
-    set symbits 0
-    set symmask [list ]
-    foreach {sym val} $map {
-        if {$bits & $val} {
-            set symbits [expr {$symbits | $val}]
-            lappend symmask $sym
-        }
-    }
-
-    # Get rid of bits that mapped to symbols
-    set bits [expr {$bits & ~$symbits}]
-    # If any left over, add them
-    if {$bits && $append_unknown} {
-        lappend symmask $bits
-    }
-    return $symmask
-}
-
-# Return a bitmask corresponding to a list of symbolic and integer values
-# If symvals is a single item, it is an array else a list of sym bitmask pairs
-# Ditto for switches - an array or flat list of switch boolean pairs
-proc twapi::_switches_to_bitmask {switches symvals {bits 0}} {
-    if {[llength $symvals] == 1} {
-        upvar $symvals lookup
-    } else {
-        array set lookup $symvals
-    }
-    if {[llength $switches] == 1} {
-        upvar $switches swtable
-    } else {
-        array set swtable $switches
-    }
-
-    foreach {switch bool} [array get swtable] {
-        if {$bool} {
-            set bits [expr {$bits | $lookup($switch)}]
-        } else {
-            set bits [expr {$bits & ~ $lookup($switch)}]
-        }
-    }
-    return $bits
-}
-
-# Return a list of switche bool pairs corresponding to a bitmask
-proc twapi::_bitmask_to_switches {bits symvals} {
-    if {[llength $symvals] == 1} {
-        upvar $symvals lookup
-        set map [array get lookup]
-    } else {
-        set map $symvals
-    }
-    set symbits 0
-    set symmask [list ]
-    foreach {sym val} $map {
-        if {$bits & $val} {
-            set symbits [expr {$symbits | $val}]
-            lappend symmask $sym 1
-        } else {
-            lappend symmask $sym 0
-        }
-    }
-
-    return $symmask
-}
+# The following symbolic bitmask conversion commands are implemented
+# in base/bitmask.c. In all of them, symvals is either a flat list of
+# symbol and bitmask value pairs or, if a single item, the name of an
+# array in the caller's context containing the same. The list form is
+# compiled once and cached so should be preferred.
+#
+#   _parse_symbolic_bitmask syms symvals ?nocase? ?errlabel?
+#     Returns the OR of a list of symbols and integers.
+#   _make_symbolic_bitmask bits symvals ?append_unknown?
+#     Returns the list of symbols with any bit in common with bits,
+#     followed by left over bits as an integer if append_unknown is true.
+#   _switches_to_bitmask switches symvals ?bits?
+#     Sets or clears bits in bits based on a list (or array) of
+#     symbol boolean pairs.
+#   _bitmask_to_switches bits symvals
+#     Returns a list of symbol boolean pairs for a bitmask.
+#   bitmask_to_symbols bits symvals ?any|all|consume? ?none|mask|bits?
+#     General form of _make_symbolic_bitmask. See bitmask.c for details.
 
 # Make and return a keyed list
 proc twapi::kl_create {args} {
@@ -843,6 +818,8 @@ proc twapi::export_public_commands {} {
 }
 
 proc twapi::import_commands {} {
+    # Commands cannot be imported before their deferred scripts define them
+    _load_deferred_scripts
     export_public_commands
     uplevel namespace import twapi::*
 }
@@ -0,0 +1,280 @@
+#
+# Copyright (c) 2018, Ashok P. Nadkarni
+# All rights reserved.
+#
+# See the file LICENSE for license
+
+# Script level implementations of the symbolic bitmask conversion
+# commands as they existed before being moved to C (base/bitmask.c).
+# Used as the reference for correctness tests and as the baseline for
+# performance comparisons. Must not be loaded into the twapi namespace.
+
+namespace eval bitmask_ref {
+    namespace path ::twapi
+}
+
+proc bitmask_ref::_parse_symbolic_bitmask {syms symvals} {
+    if {[llength $symvals] == 1} {
+        upvar $symvals lookup
+    } else {
+        array set lookup $symvals
+    }
+    set bits 0
+    foreach sym $syms {
+        if {[info exists lookup($sym)]} {
+            set bits [expr {$bits | $lookup($sym)}]
+        } else {
+            set bits [expr {$bits | $sym}]
+        }
+    }
+    return $bits
+}
+
+proc bitmask_ref::_make_symbolic_bitmask {bits symvals {append_unknown 1}} {
+    if {[llength $symvals] == 1} {
+        upvar $symvals lookup
+        set map [array get lookup]
+    } else {
+        set map $symvals
+    }
+    set symbits 0
+    set symmask [list ]
+    foreach {sym val} $map {
+        if {$bits & $val} {
+            set symbits [expr {$symbits | $val}]
+            lappend symmask $sym
+        }
+    }
+
+    # Get rid of bits that mapped to symbols
+    set bits [expr {$bits & ~$symbits}]
+    # If any left over, add them
+    if {$bits && $append_unknown} {
+        lappend symmask $bits
+    }
+    return $symmask
+}
+
+proc bitmask_ref::_switches_to_bitmask {switches symvals {bits 0}} {
+    if {[llength $symvals] == 1} {
+        upvar $symvals lookup
+    } else {
+        array set lookup $symvals
+    }
+    if {[llength $switches] == 1} {
+        upvar $switches swtable
+    } else {
+        array set swtable $switches
+    }
+
+    foreach {switch bool} [array get swtable] {
+        if {$bool} {
+            set bits [expr {$bits | $lookup($switch)}]
+        } else {
+            set bits [expr {$bits & ~ $lookup($switch)}]
+        }
+    }
+    return $bits
+}
+
+proc bitmask_ref::_bitmask_to_switches {bits symvals} {
+    if {[llength $symvals] == 1} {
+        upvar $symvals lookup
+        set map [array get lookup]
+    } else {
+        set map $symvals
+    }
+    set symbits 0
+    set symmask [list ]
+    foreach {sym val} $map {
+        if {$bits & $val} {
+            set symbits [expr {$symbits | $val}]
+            lappend symmask $sym 1
+        } else {
+            lappend symmask $sym 0
+        }
+    }
+
+    return $symmask
+}
+
+proc bitmask_ref::_access_rights_to_mask args {
+    upvar #0 ::twapi::security_defs security_defs
+    set rights 0
+    foreach right [concat {*}$args] {
+        # The mandatory label access rights are not in security_defs
+        # because we do not want them to mess up the int->name mapping
+        # for DACL's
+        set right [dict* {
+            no_write_up 1
+            system_mandatory_label_no_write_up 1
+            no_read_up 2
+            system_mandatory_label_no_read_up  2
+            no_execute_up 4
+            system_mandatory_label_no_execute_up 4
+        } $right]
+        if {![string is integer $right]} {
+            if {[catch {set right $security_defs([string toupper $right])}]} {
+                error "Invalid access right symbol '$right'"
+            }
+        }
+        set rights [expr {$rights | $right}]
+    }
+    return $rights
+}
+
+proc bitmask_ref::_access_mask_to_rights {access_mask {type ""}} {
+    upvar #0 ::twapi::security_defs security_defs
+
+    set rights [list ]
+
+    if {$type eq "mandatory_label"} {
+        if {$access_mask & 1} {
+            lappend rights system_mandatory_label_no_write_up
+        }
+        if {$access_mask & 2} {
+            lappend rights system_mandatory_label_no_read_up
+        }
+        if {$access_mask & 4} {
+            lappend rights system_mandatory_label_no_execute_up
+        }
+        return $rights
+    }
+
+    # The returned list will include rights that map to multiple bits
+    # as well as the individual bits. We first add the multiple bits
+    # and then the individual bits (since we clear individual bits
+    # after adding)
+
+    #
+    # Check standard multiple bit masks
+    #
+    foreach x {STANDARD_RIGHTS_REQUIRED STANDARD_RIGHTS_READ STANDARD_RIGHTS_WRITE STANDARD_RIGHTS_EXECUTE STANDARD_RIGHTS_ALL SPECIFIC_RIGHTS_ALL} {
+        if {($security_defs($x) & $access_mask) == $security_defs($x)} {
+            lappend rights [string tolower $x]
+        }
+    }
+
+    #
+    # Check type specific multiple bit masks.
+    #
+    
+    set type_mask_map {
+        file {FILE_ALL_ACCESS FILE_GENERIC_READ FILE_GENERIC_WRITE FILE_GENERIC_EXECUTE}
+        process {PROCESS_ALL_ACCESS}
+        pipe {FILE_ALL_ACCESS}
+        policy {POLICY_READ POLICY_WRITE POLICY_EXECUTE POLICY_ALL_ACCESS}
+        registry {KEY_READ KEY_WRITE KEY_EXECUTE KEY_ALL_ACCESS}
+        service {SERVICE_ALL_ACCESS}
+        thread {THREAD_ALL_ACCESS}
+        token {TOKEN_READ TOKEN_WRITE TOKEN_EXECUTE TOKEN_ALL_ACCESS}
+        desktop {}
+        winsta {WINSTA_ALL_ACCESS}
+    }
+    if {[dict exists $type_mask_map $type]} {
+        foreach x [dict get $type_mask_map $type] {
+            if {($security_defs($x) & $access_mask) == $security_defs($x)} {
+                lappend rights [string tolower $x]
+            }
+        }
+    }
+
+    #
+    # OK, now map individual bits
+
+    # First map the common bits
+    foreach x {DELETE READ_CONTROL WRITE_DAC WRITE_OWNER SYNCHRONIZE} {
+        if {$security_defs($x) & $access_mask} {
+            lappend rights [string tolower $x]
+            resetbits access_mask $security_defs($x)
+        }
+    }
+
+    # Then the generic bits
+    foreach x {GENERIC_READ GENERIC_WRITE GENERIC_EXECUTE GENERIC_ALL} {
+        if {$security_defs($x) & $access_mask} {
+            lappend rights [string tolower $x]
+            resetbits access_mask $security_defs($x)
+        }
+    }
+
+    # Then the type specific
+    set type_mask_map {
+        file { FILE_READ_DATA FILE_WRITE_DATA FILE_APPEND_DATA
+            FILE_READ_EA FILE_WRITE_EA FILE_EXECUTE
+            FILE_DELETE_CHILD FILE_READ_ATTRIBUTES
+            FILE_WRITE_ATTRIBUTES }
+        pipe { FILE_READ_DATA FILE_WRITE_DATA FILE_CREATE_PIPE_INSTANCE
+            FILE_READ_ATTRIBUTES FILE_WRITE_ATTRIBUTES }
+        service { SERVICE_QUERY_CONFIG SERVICE_CHANGE_CONFIG
+            SERVICE_QUERY_STATUS SERVICE_ENUMERATE_DEPENDENTS
+            SERVICE_START SERVICE_STOP SERVICE_PAUSE_CONTINUE
+            SERVICE_INTERROGATE SERVICE_USER_DEFINED_CONTROL }
+        registry { KEY_QUERY_VALUE KEY_SET_VALUE KEY_CREATE_SUB_KEY
+            KEY_ENUMERATE_SUB_KEYS KEY_NOTIFY KEY_CREATE_LINK
+            KEY_WOW64_32KEY KEY_WOW64_64KEY KEY_WOW64_RES }
+        policy { POLICY_VIEW_LOCAL_INFORMATION POLICY_VIEW_AUDIT_INFORMATION
+            POLICY_GET_PRIVATE_INFORMATION POLICY_TRUST_ADMIN
+            POLICY_CREATE_ACCOUNT POLICY_CREATE_SECRET
+            POLICY_CREATE_PRIVILEGE POLICY_SET_DEFAULT_QUOTA_LIMITS
+            POLICY_SET_AUDIT_REQUIREMENTS POLICY_AUDIT_LOG_ADMIN
+            POLICY_SERVER_ADMIN POLICY_LOOKUP_NAMES }
+        process { PROCESS_TERMINATE PROCESS_CREATE_THREAD
+            PROCESS_SET_SESSIONID PROCESS_VM_OPERATION
+            PROCESS_VM_READ PROCESS_VM_WRITE PROCESS_DUP_HANDLE
+            PROCESS_CREATE_PROCESS PROCESS_SET_QUOTA
+            PROCESS_SET_INFORMATION PROCESS_QUERY_INFORMATION
+            PROCESS_SUSPEND_RESUME} 
+        thread { THREAD_TERMINATE THREAD_SUSPEND_RESUME
+            THREAD_GET_CONTEXT THREAD_SET_CONTEXT
+            THREAD_SET_INFORMATION THREAD_QUERY_INFORMATION
+            THREAD_SET_THREAD_TOKEN THREAD_IMPERSONATE
+            THREAD_DIRECT_IMPERSONATION
+            THREAD_SET_LIMITED_INFORMATION
+            THREAD_QUERY_LIMITED_INFORMATION }
+        token { TOKEN_ASSIGN_PRIMARY TOKEN_DUPLICATE TOKEN_IMPERSONATE
+            TOKEN_QUERY TOKEN_QUERY_SOURCE TOKEN_ADJUST_PRIVILEGES
+            TOKEN_ADJUST_GROUPS TOKEN_ADJUST_DEFAULT TOKEN_ADJUST_SESSIONID }
+        desktop { DESKTOP_READOBJECTS DESKTOP_CREATEWINDOW
+            DESKTOP_CREATEMENU DESKTOP_HOOKCONTROL
+            DESKTOP_JOURNALRECORD DESKTOP_JOURNALPLAYBACK
+            DESKTOP_ENUMERATE DESKTOP_WRITEOBJECTS DESKTOP_SWITCHDESKTOP }
+        windowstation { WINSTA_ENUMDESKTOPS WINSTA_READATTRIBUTES
+            WINSTA_ACCESSCLIPBOARD WINSTA_CREATEDESKTOP
+            WINSTA_WRITEATTRIBUTES WINSTA_ACCESSGLOBALATOMS
+            WINSTA_EXITWINDOWS WINSTA_ENUMERATE WINSTA_READSCREEN }
+        winsta { WINSTA_ENUMDESKTOPS WINSTA_READATTRIBUTES
+            WINSTA_ACCESSCLIPBOARD WINSTA_CREATEDESKTOP
+            WINSTA_WRITEATTRIBUTES WINSTA_ACCESSGLOBALATOMS
+            WINSTA_EXITWINDOWS WINSTA_ENUMERATE WINSTA_READSCREEN }
+        com { COM_RIGHTS_EXECUTE COM_RIGHTS_EXECUTE_LOCAL 
+            COM_RIGHTS_EXECUTE_REMOTE COM_RIGHTS_ACTIVATE_LOCAL 
+            COM_RIGHTS_ACTIVATE_REMOTE 
+        }
+    }
+
+    if {[min_os_version 6]} {
+        dict lappend type_mask_map process PROCESS_QUERY_LIMITED_INFORMATION
+    }
+
+    if {[dict exists $type_mask_map $type]} {
+        foreach x [dict get $type_mask_map $type] {
+            if {$security_defs($x) & $access_mask} {
+                lappend rights [string tolower $x]
+                # Reset the bit so is it not included in unknown bits below
+                resetbits access_mask $security_defs($x)
+            }
+        }
+    }
+
+    # Finally add left over bits if any
+    for {set i 0} {$i < 32} {incr i} {
+        set x [expr {1 << $i}]
+        if {$access_mask & $x} {
+            lappend rights [hex32 $x]
+        }
+    }
+
+    return $rights
+}
+
@@ -0,0 +1,180 @@
+/*
+ * Copyright (c) 2018, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ */
+
+/*
+ * Measures walking the recorded certificates in tests/certs with the
+ * native DER tokenizer, converting every OID, integer, time and string
+ * as asn1_decode and the certificate extension decoders do. Does not
+ * need Tcl or Windows. Build and run from this directory, e.g.
+ *
+ *   cc -O2 -DCRYPTO_STANDALONE -I../../crypto -o asn1_bench asn1_bench.c \
+ *       ../../crypto/asn1.c ../../crypto/pem.c
+ *   ./asn1_bench ?-certs DIR? ?-iterations N?
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "asn1.h"
+#include "pem.h"
+
+static const char *fixtures[] = {
+    "twapitestca.cer", "twapitestintermediate.cer", "twapitestserver.cer",
+    "twapitestaltserver.cer", "twapitestclient.cer", "twapitestfull.cer",
+    "twapitestmin.cer", "verisignrevoked.cer", "grcrevoked.pem",
+    "www.google.com.pem", "www.google.com-expired.pem", "www.yahoo.com.pem",
+};
+
+static double now_usecs(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* Reads a fixture, decoding it if PEM. Returns NULL on error. */
+static unsigned char *read_cert(const char *dir, const char *name, size_t *nP)
+{
+    char path[1024];
+    FILE *f;
+    char *text;
+    unsigned char *der;
+    long n;
+    TwapiPemBlock block;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    f = fopen(path, "rb");
+    if (f == NULL)
+        return NULL;
+    fseek(f, 0, SEEK_END);
+    n = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    text = malloc(n + 1);
+    der = malloc(TWAPI_BASE64_DECODED_MAX(n) + n);
+    if (fread(text, 1, n, f) != (size_t) n) {
+        fclose(f);
+        return NULL;
+    }
+    fclose(f);
+    if (TwapiIsPem(text, n)) {
+        if (TwapiPemNext(text, n, &block) != 1 ||
+            TwapiBase64Decode(block.bodyP, block.nbody, der, nP) != 0)
+            return NULL;
+    } else {
+        memcpy(der, text, n);
+        *nP = n;
+    }
+    free(text);
+    return der;
+}
+
+static unsigned long scratch[4096];
+
+/* Walks and converts all elements. Returns number of elements or -1. */
+static long walk(const unsigned char *p, size_t n, int depth)
+{
+    TwapiDerTlv tlv;
+    size_t used;
+    long count = 0, sub;
+    long long val;
+    char buf[256];
+
+    while (n) {
+        used = TwapiDerParse(p, n, &tlv);
+        if (used == 0)
+            return -1;
+        ++count;
+        if (tlv.constructed) {
+            if (depth >= TWAPI_DER_MAX_DEPTH)
+                return -1;
+            sub = walk(tlv.valueP, tlv.len, depth + 1);
+            if (sub < 0)
+                return -1;
+            count += sub;
+        } else if (tlv.tagclass == TWAPI_DER_UNIVERSAL) {
+            switch (tlv.tag) {
+            case TWAPI_DER_OID:
+                TwapiDerOidToString(tlv.valueP, tlv.len, buf, sizeof(buf));
+                break;
+            case TWAPI_DER_INTEGER:
+                TwapiDerIntegerToWide(tlv.valueP, tlv.len, &val);
+                break;
+            case TWAPI_DER_UTC_TIME:
+            case TWAPI_DER_GENERALIZED_TIME:
+                TwapiDerTimeToString(tlv.tag, tlv.valueP, tlv.len, buf);
+                break;
+            default:
+                if (tlv.len <= sizeof(scratch) / sizeof(scratch[0]))
+                    TwapiDerStringToUnicode(tlv.tag, tlv.valueP, tlv.len,
+                                            scratch);
+                break;
+            }
+        }
+        p += used;
+        n -= used;
+    }
+    return count;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *dir = "../certs";
+    unsigned char *ders[sizeof(fixtures) / sizeof(fixtures[0])];
+    size_t sizes[sizeof(fixtures) / sizeof(fixtures[0])];
+    size_t i, j, nfixtures = sizeof(fixtures) / sizeof(fixtures[0]);
+    size_t total_bytes = 0;
+    long iterations = 20000, elems, total_elems = 0;
+    double start, usecs, best, total_usecs = 0;
+    int round;
+
+    for (i = 1; i + 1 < (size_t) argc; i += 2) {
+        if (strcmp(argv[i], "-certs") == 0)
+            dir = argv[i+1];
+        else if (strcmp(argv[i], "-iterations") == 0)
+            iterations = atol(argv[i+1]);
+    }
+
+    printf("%-28s %6s %6s %12s %10s\n", "certificate", "bytes", "elems",
+           "certs/sec", "MB/s");
+    for (i = 0; i < nfixtures; ++i) {
+        ders[i] = read_cert(dir, fixtures[i], &sizes[i]);
+        if (ders[i] == NULL) {
+            printf("Could not read %s/%s\n", dir, fixtures[i]);
+            return 1;
+        }
+        elems = walk(ders[i], sizes[i], 0);
+        if (elems < 0 || !TwapiDerValidate(ders[i], sizes[i], TWAPI_DER_MAX_DEPTH)) {
+            printf("Could not decode %s\n", fixtures[i]);
+            return 1;
+        }
+        best = 0;
+        for (round = 0; round < 5; ++round) {
+            start = now_usecs();
+            for (j = 0; j < (size_t) iterations; ++j)
+                walk(ders[i], sizes[i], 0);
+            usecs = now_usecs() - start;
+            if (round == 0 || usecs < best)
+                best = usecs;
+        }
+        printf("%-28s %6lu %6ld %12.0f %10.0f\n", fixtures[i],
+               (unsigned long) sizes[i], elems, iterations * 1e6 / best,
+               iterations * sizes[i] / best);
+        total_usecs += best;
+        total_bytes += sizes[i];
+        total_elems += elems;
+    }
+    printf("%-28s %6lu %6ld %12.0f %10.0f\n", "all",
+           (unsigned long) total_bytes, total_elems,
+           nfixtures * iterations * 1e6 / total_usecs,
+           iterations * total_bytes / total_usecs);
+
+    for (i = 0; i < nfixtures; ++i)
+        free(ders[i]);
+    return 0;
+}
@@ -0,0 +1,260 @@
+/*
+ * Copyright (c) 2018, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ */
+
+/*
+ * Fuzzes the native DER tokenizer. Every input is copied to a buffer of
+ * exactly its size so that AddressSanitizer catches any read past the
+ * end, and is then walked with every value decoder applied to every
+ * primitive. Decoded OIDs and strings are reencoded and compared with
+ * the original. Can be built as a libFuzzer target,
+ *
+ *   clang -g -O1 -fsanitize=fuzzer,address,undefined -DCRYPTO_STANDALONE \
+ *       -DTWAPI_LIBFUZZER -I../../crypto asn1_fuzz.c ../../crypto/asn1.c \
+ *       ../../crypto/pem.c
+ *
+ * or standalone, in which case it mutates the certificates in tests/certs,
+ *
+ *   cc -g -O1 -fsanitize=address,undefined -DCRYPTO_STANDALONE \
+ *       -I../../crypto -o asn1_fuzz asn1_fuzz.c ../../crypto/asn1.c \
+ *       ../../crypto/pem.c
+ *   ./asn1_fuzz ?-certs DIR? ?-iterations N? ?-seed N?
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "asn1.h"
+#include "pem.h"
+
+#define CHECK(cond_)                                                    \
+    do {                                                                \
+        if (!(cond_)) {                                                 \
+            fprintf(stderr, "Check failed at line %d: %s\n", __LINE__, #cond_); \
+            abort();                                                    \
+        }                                                               \
+    } while (0)
+
+static void check_primitive(TwapiDerTlv *tlvP)
+{
+    char oid[128], timebuf[20];
+    unsigned char *bytesP;
+    unsigned long *codesP;
+    size_t n, nbytes;
+    long long val;
+
+    switch (tlvP->tag) {
+    case TWAPI_DER_OID:
+        n = TwapiDerOidToString(tlvP->valueP, tlvP->len, oid, sizeof(oid));
+        if (n) {
+            CHECK(strlen(oid) == n);
+            bytesP = malloc(tlvP->len);
+            CHECK(TwapiDerOidFromString(oid, bytesP, tlvP->len) == tlvP->len);
+            CHECK(memcmp(bytesP, tlvP->valueP, tlvP->len) == 0);
+            free(bytesP);
+        }
+        return;
+    case TWAPI_DER_INTEGER:
+        if (TwapiDerIntegerToWide(tlvP->valueP, tlvP->len, &val))
+            CHECK(tlvP->len > 0 && tlvP->len <= 8);
+        return;
+    case TWAPI_DER_UTC_TIME:
+    case TWAPI_DER_GENERALIZED_TIME:
+        if (TwapiDerTimeToString(tlvP->tag, tlvP->valueP, tlvP->len, timebuf))
+            CHECK(strlen(timebuf) == 19);
+        return;
+    }
+
+    /* Exactly sized so overruns are caught */
+    codesP = malloc(tlvP->len * sizeof(*codesP) + 1);
+    n = TwapiDerStringToUnicode(tlvP->tag, tlvP->valueP, tlvP->len, codesP);
+    if (n != (size_t) -1) {
+        CHECK(n <= tlvP->len);
+        bytesP = malloc(4 * n + 1);
+        nbytes = TwapiDerStringFromUnicode(tlvP->tag, codesP, n, bytesP);
+        /* 7-bit types are only checked for the character set on encode */
+        if (nbytes != (size_t) -1) {
+            CHECK(nbytes == tlvP->len);
+            CHECK(memcmp(bytesP, tlvP->valueP, nbytes) == 0);
+        } else {
+            CHECK(tlvP->tag == TWAPI_DER_NUMERIC_STRING ||
+                  tlvP->tag == TWAPI_DER_PRINTABLE_STRING ||
+                  tlvP->tag == TWAPI_DER_VISIBLE_STRING);
+        }
+        free(bytesP);
+    }
+    free(codesP);
+}
+
+/* Returns 1 if walked without error */
+static int walk(const unsigned char *p, size_t n, int depth)
+{
+    TwapiDerTlv tlv;
+    size_t used;
+
+    while (n) {
+        used = TwapiDerParse(p, n, &tlv);
+        if (used == 0)
+            return 0;
+        CHECK(used <= n && tlv.valueP + tlv.len == p + used);
+        if (tlv.constructed) {
+            if (depth >= TWAPI_DER_MAX_DEPTH ||
+                !walk(tlv.valueP, tlv.len, depth + 1))
+                return 0;
+        } else {
+            if (tlv.tagclass == TWAPI_DER_UNIVERSAL)
+                check_primitive(&tlv);
+            /* Contents of OCTET and BIT STRINGs are often DER as well */
+            if (tlv.len > 1)
+                walk(tlv.valueP + (tlv.tag == TWAPI_DER_BIT_STRING),
+                     tlv.len - (tlv.tag == TWAPI_DER_BIT_STRING), depth + 1);
+        }
+        p += used;
+        n -= used;
+    }
+    return 1;
+}
+
+int LLVMFuzzerTestOneInput(const unsigned char *data, size_t size)
+{
+    unsigned char *p = malloc(size ? size : 1);
+    memcpy(p, data, size);
+    CHECK(walk(p, size, 0) == TwapiDerValidate(p, size, TWAPI_DER_MAX_DEPTH));
+    free(p);
+    return 0;
+}
+
+#ifndef TWAPI_LIBFUZZER
+
+static const char *fixtures[] = {
+    "twapitestca.cer", "twapitestintermediate.cer", "twapitestserver.cer",
+    "twapitestaltserver.cer", "twapitestclient.cer", "twapitestfull.cer",
+    "twapitestmin.cer", "verisignrevoked.cer", "grcrevoked.pem",
+    "www.google.com.pem", "www.google.com-expired.pem", "www.yahoo.com.pem",
+    "rsa-1024-public.pem", "rsa-2048-private.pem",
+};
+
+static unsigned char *read_cert(const char *dir, const char *name, size_t *nP)
+{
+    char path[1024];
+    FILE *f;
+    char *text;
+    unsigned char *der;
+    long n;
+    TwapiPemBlock block;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    f = fopen(path, "rb");
+    if (f == NULL)
+        return NULL;
+    fseek(f, 0, SEEK_END);
+    n = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    text = malloc(n + 1);
+    der = malloc(TWAPI_BASE64_DECODED_MAX(n) + n);
+    if (fread(text, 1, n, f) != (size_t) n)
+        n = 0;
+    fclose(f);
+    if (TwapiIsPem(text, n)) {
+        if (TwapiPemNext(text, n, &block) != 1 ||
+            TwapiBase64Decode(block.bodyP, block.nbody, der, nP) != 0)
+            n = 0;
+    } else {
+        memcpy(der, text, n);
+        *nP = n;
+    }
+    free(text);
+    if (n == 0) {
+        free(der);
+        return NULL;
+    }
+    return der;
+}
+
+/* Applies a few random edits aimed at the tag and length octets */
+static size_t mutate(unsigned char *p, size_t n, size_t maxn)
+{
+    size_t i, pos, len;
+    int nedits = 1 + rand() % 4;
+
+    for (i = 0; i < (size_t) nedits && n; ++i) {
+        pos = rand() % n;
+        switch (rand() % 7) {
+        case 0: p[pos] ^= 1 << (rand() % 8); break;
+        case 1: p[pos] = (unsigned char) rand(); break;
+        case 2: p[pos] = "\x00\x7f\x80\x81\x82\x84\x85\xff\x1f\x30"[rand() % 10]; break;
+        case 3: n = pos; break;
+        case 4:                 /* Duplicate a slice */
+            len = rand() % 64;
+            if (len > n - pos || n + len > maxn)
+                break;
+            memmove(p + pos + len, p + pos, n - pos);
+            n += len;
+            break;
+        case 5:                 /* Delete a slice */
+            len = rand() % 16;
+            if (len > n - pos)
+                len = n - pos;
+            memmove(p + pos, p + pos + len, n - pos - len);
+            n -= len;
+            break;
+        case 6: p[pos] = (unsigned char) (p[pos] + 1); break;
+        }
+    }
+    return n;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *dir = "../certs";
+    unsigned char *ders[sizeof(fixtures) / sizeof(fixtures[0])], *buf;
+    size_t sizes[sizeof(fixtures) / sizeof(fixtures[0])];
+    size_t i, n, nfixtures = sizeof(fixtures) / sizeof(fixtures[0]);
+    long iterations = 200000, iter, nvalid = 0;
+    unsigned seed = 1;
+
+    for (i = 1; i + 1 < (size_t) argc; i += 2) {
+        if (strcmp(argv[i], "-certs") == 0)
+            dir = argv[i+1];
+        else if (strcmp(argv[i], "-iterations") == 0)
+            iterations = atol(argv[i+1]);
+        else if (strcmp(argv[i], "-seed") == 0)
+            seed = (unsigned) atol(argv[i+1]);
+    }
+    srand(seed);
+
+    for (i = 0; i < nfixtures; ++i) {
+        ders[i] = read_cert(dir, fixtures[i], &sizes[i]);
+        if (ders[i] == NULL) {
+            printf("Could not read %s/%s\n", dir, fixtures[i]);
+            return 1;
+        }
+        if (!TwapiDerValidate(ders[i], sizes[i], TWAPI_DER_MAX_DEPTH)) {
+            printf("Could not decode %s\n", fixtures[i]);
+            return 1;
+        }
+        LLVMFuzzerTestOneInput(ders[i], sizes[i]);
+    }
+
+    buf = malloc(8192);
+    for (iter = 0; iter < iterations; ++iter) {
+        i = rand() % nfixtures;
+        n = sizes[i] < 4096 ? sizes[i] : 4096;
+        memcpy(buf, ders[i], n);
+        n = mutate(buf, n, 8192);
+        LLVMFuzzerTestOneInput(buf, n);
+        nvalid += TwapiDerValidate(buf, n, TWAPI_DER_MAX_DEPTH);
+    }
+    printf("%ld inputs, %ld well formed\n", iterations, nvalid);
+
+    free(buf);
+    for (i = 0; i < nfixtures; ++i)
+        free(ders[i]);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,54 @@
+#
+# Copyright (c) 2018, Ashok P. Nadkarni
+# All rights reserved.
+#
+# See the file LICENSE for license
+
+# Throughput of the native symbolic bitmask commands compared to the
+# script implementations they replaced.
+
+source [file join [file dirname [info script]] perfutil.tcl]
+source [file join [file dirname [info script]] .. bitmask_ref.tcl]
+load_twapi_package twapi_base
+
+namespace eval perf::bitmask {
+    twapi::_init_security_defs
+
+    set symvals {
+        read 1 write 2 readwrite 3 execute 4 delete 0x10000
+        read_control 0x20000 write_dac 0x40000 write_owner 0x80000
+        synchronize 0x100000 generic_read 0x80000000
+    }
+    set mask 0x80150007
+
+    puts [format "%-40s %15s %15s %9s" "command" "script" "native" "speedup"]
+
+    perf::compare "_make_symbolic_bitmask" \
+        [perf::measure {bitmask_ref::_make_symbolic_bitmask $mask $symvals}] \
+        [perf::measure {twapi::_make_symbolic_bitmask $mask $symvals}]
+
+    set syms {read write delete synchronize 0x100}
+    perf::compare "_parse_symbolic_bitmask" \
+        [perf::measure {bitmask_ref::_parse_symbolic_bitmask $syms $symvals}] \
+        [perf::measure {twapi::_parse_symbolic_bitmask $syms $symvals}]
+
+    set switches {read 1 write 0 execute 1 synchronize 1}
+    perf::compare "_switches_to_bitmask" \
+        [perf::measure {bitmask_ref::_switches_to_bitmask $switches $symvals}] \
+        [perf::measure {twapi::_switches_to_bitmask $switches $symvals}]
+
+    perf::compare "_bitmask_to_switches" \
+        [perf::measure {bitmask_ref::_bitmask_to_switches $mask $symvals}] \
+        [perf::measure {twapi::_bitmask_to_switches $mask $symvals}]
+
+    set rights {process_vm_read process_query_information synchronize}
+    perf::compare "_access_rights_to_mask" \
+        [perf::measure {bitmask_ref::_access_rights_to_mask $rights}] \
+        [perf::measure {twapi::_access_rights_to_mask $rights}]
+
+    foreach type {file process token} {
+        perf::compare "_access_mask_to_rights $type" \
+            [perf::measure {bitmask_ref::_access_mask_to_rights 0x001f01ff $type}] \
+            [perf::measure {twapi::_access_mask_to_rights 0x001f01ff $type}]
+    }
+}
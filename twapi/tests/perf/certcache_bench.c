@@ -0,0 +1,303 @@
+/*
+ * Copyright (c) 2018, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ */
+
+/*
+ * Checks and measures the decoded certificate cache used by cert_info.
+ * Decoding is stood in for by walking the DER with the native tokenizer
+ * -decodecost times. A single walk is cheaper than hashing the
+ * certificate so with the default of 1 the cache is slower and the
+ * figures show the cost of computing the key. The CAPI decode and Tcl
+ * object construction the cache saves are several times the cost of a
+ * walk. Does not need Tcl or Windows. Build and run from this
+ * directory, e.g.
+ *
+ *   cc -O2 -DCRYPTO_STANDALONE -I../../crypto -I../../include \
+ *       -o certcache_bench certcache_bench.c ../../crypto/certcache.c \
+ *       ../../crypto/hash.c ../../crypto/asn1.c ../../crypto/pem.c
+ *   ./certcache_bench ?-certs DIR? ?-iterations N? ?-decodecost N?
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "asn1.h"
+#include "pem.h"
+#include "certcache.h"
+
+#define CHECK(cond_)                                                    \
+    do {                                                                \
+        if (!(cond_)) {                                                 \
+            fprintf(stderr, "Check failed at line %d: %s\n", __LINE__, #cond_); \
+            abort();                                                    \
+        }                                                               \
+    } while (0)
+
+static const char *fixtures[] = {
+    "twapitestca.cer", "twapitestintermediate.cer", "twapitestserver.cer",
+    "twapitestaltserver.cer", "twapitestclient.cer", "twapitestfull.cer",
+    "twapitestmin.cer", "verisignrevoked.cer", "grcrevoked.pem",
+    "www.google.com.pem", "www.google.com-expired.pem", "www.yahoo.com.pem",
+};
+#define NFIXTURES (sizeof(fixtures) / sizeof(fixtures[0]))
+
+static long ndecodes;
+static int decodecost = 1;
+static long nfreed;
+
+static double now_usecs(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* Reads a fixture, decoding it if PEM. Returns NULL on error. */
+static unsigned char *read_cert(const char *dir, const char *name, size_t *nP)
+{
+    char path[1024];
+    FILE *f;
+    char *text;
+    unsigned char *der;
+    long n;
+    TwapiPemBlock block;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    f = fopen(path, "rb");
+    if (f == NULL)
+        return NULL;
+    fseek(f, 0, SEEK_END);
+    n = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    text = malloc(n + 1);
+    der = malloc(TWAPI_BASE64_DECODED_MAX(n) + n);
+    if (fread(text, 1, n, f) != (size_t) n)
+        n = 0;
+    fclose(f);
+    if (TwapiIsPem(text, n)) {
+        if (TwapiPemNext(text, n, &block) != 1 ||
+            TwapiBase64Decode(block.bodyP, block.nbody, der, nP) != 0)
+            n = 0;
+    } else {
+        memcpy(der, text, n);
+        *nP = n;
+    }
+    free(text);
+    if (n == 0) {
+        free(der);
+        return NULL;
+    }
+    return der;
+}
+
+/* Stand-in decoded value: the number of elements in the certificate */
+static long walk(const unsigned char *p, size_t n, int depth)
+{
+    TwapiDerTlv tlv;
+    size_t used;
+    long count = 0, sub;
+    char buf[256];
+
+    while (n) {
+        used = TwapiDerParse(p, n, &tlv);
+        if (used == 0)
+            return -1;
+        ++count;
+        if (tlv.constructed) {
+            if (depth >= TWAPI_DER_MAX_DEPTH)
+                return -1;
+            sub = walk(tlv.valueP, tlv.len, depth + 1);
+            if (sub < 0)
+                return -1;
+            count += sub;
+        } else if (tlv.tagclass == TWAPI_DER_UNIVERSAL &&
+                   tlv.tag == TWAPI_DER_OID) {
+            TwapiDerOidToString(tlv.valueP, tlv.len, buf, sizeof(buf));
+        }
+        p += used;
+        n -= used;
+    }
+    return count;
+}
+
+static long *decode(const unsigned char *p, size_t n)
+{
+    long *valueP = malloc(sizeof(*valueP));
+    int i;
+    ++ndecodes;
+    *valueP = 0;
+    for (i = 0; i < decodecost; ++i)
+        *valueP = walk(p, n, 0);
+    return valueP;
+}
+
+static void free_value(void *valueP)
+{
+    ++nfreed;
+    free(valueP);
+}
+
+/* Mirrors Twapi_CertGetInfoObjCmd */
+static long cert_info(TwapiCertCache *cacheP, const unsigned char *p, size_t n)
+{
+    TwapiCertCacheKey key;
+    long *valueP, result;
+
+    if (cacheP == NULL) {
+        valueP = decode(p, n);
+        result = *valueP;
+        free(valueP);
+        return result;
+    }
+    TwapiCertCacheKeyInit(cacheP, p, n, &key);
+    valueP = TwapiCertCacheLookup(cacheP, &key);
+    if (valueP)
+        return *valueP;
+    valueP = decode(p, n);
+    result = *valueP;
+    if (!TwapiCertCacheInsert(cacheP, &key, valueP))
+        free(valueP);
+    return result;
+}
+
+static void check_cache(unsigned char **ders, size_t *sizes)
+{
+    TwapiCertCache *cacheP;
+    TwapiCertCacheStats stats;
+    long expected[NFIXTURES];
+    unsigned char *copyP;
+    size_t i;
+
+    for (i = 0; i < NFIXTURES; ++i)
+        expected[i] = walk(ders[i], sizes[i], 0);
+
+    /* Everything fits: one decode per certificate however often asked */
+    cacheP = TwapiCertCacheNew(TwapiHashAlgFromName("sha256"), 64, free_value);
+    ndecodes = nfreed = 0;
+    for (i = 0; i < 10 * NFIXTURES; ++i)
+        CHECK(cert_info(cacheP, ders[i % NFIXTURES], sizes[i % NFIXTURES]) ==
+              expected[i % NFIXTURES]);
+    CHECK(ndecodes == NFIXTURES);
+    TwapiCertCacheGetStats(cacheP, &stats);
+    CHECK(stats.hits == 9 * NFIXTURES && stats.misses == NFIXTURES);
+    CHECK(stats.evictions == 0 && stats.nentries == NFIXTURES);
+
+    /* Keyed by content, not by address */
+    copyP = malloc(sizes[0]);
+    memcpy(copyP, ders[0], sizes[0]);
+    CHECK(cert_info(cacheP, copyP, sizes[0]) == expected[0]);
+    CHECK(ndecodes == NFIXTURES);
+    copyP[sizes[0] - 1] ^= 1;
+    cert_info(cacheP, copyP, sizes[0]);
+    CHECK(ndecodes == NFIXTURES + 1);
+    free(copyP);
+
+    TwapiCertCacheClear(cacheP);
+    CHECK(nfreed == NFIXTURES + 1);
+    TwapiCertCacheGetStats(cacheP, &stats);
+    CHECK(stats.nentries == 0);
+    TwapiCertCacheFree(cacheP);
+
+    /* Least recently used is evicted */
+    cacheP = TwapiCertCacheNew(TwapiHashAlgFromName("sha1"), 2, free_value);
+    ndecodes = nfreed = 0;
+    cert_info(cacheP, ders[0], sizes[0]);
+    cert_info(cacheP, ders[1], sizes[1]);
+    cert_info(cacheP, ders[0], sizes[0]);   /* 1 is now least recent */
+    cert_info(cacheP, ders[2], sizes[2]);   /* Evicts 1 */
+    CHECK(nfreed == 1);
+    cert_info(cacheP, ders[0], sizes[0]);
+    CHECK(ndecodes == 3);
+    cert_info(cacheP, ders[1], sizes[1]);   /* Evicts 2 */
+    CHECK(ndecodes == 4);
+    cert_info(cacheP, ders[2], sizes[2]);
+    CHECK(ndecodes == 5);
+    TwapiCertCacheGetStats(cacheP, &stats);
+    CHECK(stats.hits == 2 && stats.misses == 5 && stats.evictions == 3);
+    CHECK(stats.nentries == 2);
+    TwapiCertCacheFree(cacheP);
+    CHECK(nfreed == 5);
+
+    /* Size 0 disables */
+    cacheP = TwapiCertCacheNew(TwapiHashAlgFromName("sha256"), 0, free_value);
+    ndecodes = nfreed = 0;
+    for (i = 0; i < 3; ++i)
+        cert_info(cacheP, ders[0], sizes[0]);
+    CHECK(ndecodes == 3 && nfreed == 0);
+    TwapiCertCacheFree(cacheP);
+}
+
+static double time_lookups(TwapiCertCache *cacheP, unsigned char **ders,
+                           size_t *sizes, long iterations)
+{
+    double start, usecs, best = 0;
+    long j;
+    int round;
+    size_t i;
+
+    for (round = 0; round < 5; ++round) {
+        start = now_usecs();
+        for (j = 0; j < iterations; ++j)
+            for (i = 0; i < NFIXTURES; ++i)
+                cert_info(cacheP, ders[i], sizes[i]);
+        usecs = now_usecs() - start;
+        if (round == 0 || usecs < best)
+            best = usecs;
+    }
+    return best;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *dir = "../certs";
+    const char *algs[] = {"sha1", "sha256"};
+    unsigned char *ders[NFIXTURES];
+    size_t sizes[NFIXTURES];
+    size_t i;
+    long iterations = 20000;
+    double uncached, cached;
+    TwapiCertCache *cacheP;
+
+    for (i = 1; i + 1 < (size_t) argc; i += 2) {
+        if (strcmp(argv[i], "-certs") == 0)
+            dir = argv[i+1];
+        else if (strcmp(argv[i], "-iterations") == 0)
+            iterations = atol(argv[i+1]);
+        else if (strcmp(argv[i], "-decodecost") == 0)
+            decodecost = atoi(argv[i+1]);
+    }
+    if (decodecost < 1)
+        decodecost = 1;
+
+    for (i = 0; i < NFIXTURES; ++i) {
+        ders[i] = read_cert(dir, fixtures[i], &sizes[i]);
+        if (ders[i] == NULL || walk(ders[i], sizes[i], 0) < 0) {
+            printf("Could not read %s/%s\n", dir, fixtures[i]);
+            return 1;
+        }
+    }
+
+    check_cache(ders, sizes);
+
+    printf("%-10s %12s %8s\n", "key", "certs/sec", "speedup");
+    uncached = time_lookups(NULL, ders, sizes, iterations);
+    printf("%-10s %12.0f %8s\n", "uncached",
+           NFIXTURES * iterations * 1e6 / uncached, "");
+    for (i = 0; i < sizeof(algs) / sizeof(algs[0]); ++i) {
+        cacheP = TwapiCertCacheNew(TwapiHashAlgFromName(algs[i]), 256,
+                                   free_value);
+        cached = time_lookups(cacheP, ders, sizes, iterations);
+        printf("%-10s %12.0f %8.1f\n", algs[i],
+               NFIXTURES * iterations * 1e6 / cached, uncached / cached);
+        TwapiCertCacheFree(cacheP);
+    }
+
+    for (i = 0; i < NFIXTURES; ++i)
+        free(ders[i]);
+    return 0;
+}
@@ -0,0 +1,84 @@
+#
+# Copyright (c) 2018, Ashok P. Nadkarni
+# All rights reserved.
+#
+# See the file LICENSE for license
+
+# Structs/sec decoding an array of cstructs with a single cstruct_decode
+# call compared to decoding one element per call.
+
+source [file join [file dirname [info script]] perfutil.tcl]
+load_twapi_package twapi_base
+
+namespace eval perf::cstruct {
+    set def {{id i4} {flags ui2} {kind ui2} {when i8} {value r8}}
+    set size 24
+
+    proc make_buffer {n} {
+        set bin ""
+        for {set i 0} {$i < $n} {incr i} {
+            append bin [binary format issWd $i 1 2 [expr {$i * 1000}] [expr {$i / 3.0}]]
+        }
+        return $bin
+    }
+
+    proc looped {def bin n size {format list}} {
+        set l {}
+        for {set i 0} {$i < $n} {incr i} {
+            lappend l {*}[twapi::cstruct_decode $def $bin 1 0 [expr {$i * $size}] $format]
+        }
+        return $l
+    }
+
+    puts [format "%-40s %15s %15s %9s" "decode" "looped" "bulk" "speedup"]
+    foreach n {10 100 1000 10000} {
+        set bin [make_buffer $n]
+        set iters [expr {max(10, 100000 / $n)}]
+        foreach format {list dict recordarray} {
+            if {$format eq "recordarray"} {
+                set base [perf::measure {looped $def $bin $n $size list} $iters]
+            } else {
+                set base [perf::measure {looped $def $bin $n $size $format} $iters]
+            }
+            set new [perf::measure {twapi::cstruct_decode $def $bin $n 0 0 $format} $iters]
+            perf::compare "$n structs ($format)" $base $new
+            perf::report "  bulk $format" $new $n
+        }
+    }
+}
+
+# Reading a single field from one element of a large buffer through a
+# cstruct view compared to decoding that element.
+namespace eval perf::cstruct {
+    set n 100000
+    set bin [make_buffer $n]
+    twapi::cstruct_view [namespace current]::view $def $bin
+    set i [expr {$n / 2}]
+    set off [expr {$i * $size}]
+
+    puts ""
+    puts [format "%-40s %15s %15s %9s" "single field" "decode" "view" "speedup"]
+    perf::compare "field of element $i" \
+        [perf::measure {lindex [twapi::cstruct_decode $def $bin 1 0 $off] 3}] \
+        [perf::measure {view get $i when}]
+    perf::compare "field of all $n elements" \
+        [perf::measure {
+            foreach rec [twapi::cstruct_decode $def $bin] {
+                lindex $rec 3
+            }
+        } 10] \
+        [perf::measure {
+            for {set j 0} {$j < $n} {incr j} {
+                view get $j when
+            }
+        } 10]
+    perf::compare "update field of element $i" \
+        [perf::measure {
+            set rec [lindex [twapi::cstruct_decode $def $bin 1 0 $off] 0]
+            lset rec 3 12345
+            set bin [string replace $bin $off [expr {$off + $size - 1}] \
+                         [binary format issWd {*}$rec]]
+        } 100] \
+        [perf::measure {view set $i when 12345}]
+    rename view ""
+}
@@ -0,0 +1,717 @@
+/*
+ * Copyright (c) 2018, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ */
+
+/*
+ * Checks and measures the .etl file parser. No .etl files can be
+ * generated without Windows so the files are written here, buffer by
+ * buffer, in the layout the kernel logger uses: a log file header event
+ * followed by kernel events with system headers, classic events logged
+ * with TraceEvent, manifest events with extended data, and WPP messages
+ * the parser skips, spread over buffers from several processors along
+ * with compressed and unused buffers. The checks compare every field of
+ * the returned EVENT_RECORD structures with what was written. The timing
+ * is of parsing a large file from memory and from disk, sequentially
+ * and by random buffer. Does not need Tcl or Windows. Build and run
+ * from this directory, e.g.
+ *
+ *   cc -O2 -DETW_STANDALONE -I../../etw -o etlfile_bench \
+ *       etlfile_bench.c ../../etw/etlfile.c
+ *   ./etlfile_bench ?-mbytes N? ?-buffersize N?
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "etlfile.h"
+
+#define CHECK(cond_)                                                    \
+    do {                                                                \
+        if (!(cond_)) {                                                 \
+            fprintf(stderr, "Check failed at line %d: %s\n", __LINE__, #cond_); \
+            abort();                                                    \
+        }                                                               \
+    } while (0)
+
+#define ALIGN8(n_) (((n_) + 7) & ~7)
+
+static const GUID event_trace_guid = {0x68fdd900, 0x4a3e, 0x11d1, {0x84, 0xf4, 0x00, 0x00, 0xf8, 0x04, 0x64, 0xe3}};
+static const GUID process_guid = {0x3d6fa8d0, 0xfe05, 0x11d0, {0x9d, 0xda, 0x00, 0xc0, 0x4f, 0xd7, 0xba, 0x7c}};
+static const GUID thread_guid = {0x3d6fa8d1, 0xfe05, 0x11d0, {0x9d, 0xda, 0x00, 0xc0, 0x4f, 0xd7, 0xba, 0x7c}};
+static const GUID perfinfo_guid = {0xce1dbfb4, 0x137e, 0x4da6, {0x87, 0xb0, 0x3f, 0x59, 0xaa, 0x10, 0x2c, 0xbc}};
+/* The twapi MOF event class and a manifest provider */
+static const GUID twapi_guid = {0xd5b52e95, 0x8447, 0x40c1, {0xb3, 0x16, 0x53, 0x98, 0x94, 0x44, 0x9b, 0x36}};
+static const GUID provider_guid = {0x22fb2cd6, 0x0e7b, 0x422b, {0xa0, 0xc7, 0x2f, 0xad, 0x1f, 0xd0, 0xe7, 0x16}};
+
+/* Log file header values */
+#define START_TIME  131000000000000000LL /* FILETIME */
+#define START_QPC   5000000000LL
+#define PERF_FREQ   2500000LL         /* So one tick is 4 FILETIME units */
+#define TS(ticks_)  (START_QPC + (ticks_))
+#define FT(ticks_)  (START_TIME + 4 * (ticks_))
+
+typedef struct {
+    unsigned char *p;
+    size_t size;
+    size_t cap;
+    ULONG buffer_size;
+    size_t buf_start;           /* Offset of current buffer in p */
+    ULONG pos;                  /* Next record offset in current buffer */
+} Writer;
+
+static void put16(unsigned char *p, unsigned v) { p[0] = v; p[1] = v >> 8; }
+static void put32(unsigned char *p, ULONG v) { put16(p, v & 0xffff); put16(p + 2, v >> 16); }
+static void put64(unsigned char *p, LONGLONG v) { put32(p, (ULONG) v); put32(p + 4, (ULONG) ((ULONGLONG) v >> 32)); }
+
+static void start_buffer(Writer *wP, UCHAR proc, UCHAR align, USHORT flags, LONGLONG ts)
+{
+    unsigned char *bufP;
+
+    if (wP->size + wP->buffer_size > wP->cap) {
+        wP->cap = 2 * (wP->cap + wP->buffer_size);
+        wP->p = realloc(wP->p, wP->cap);
+        CHECK(wP->p);
+    }
+    wP->buf_start = wP->size;
+    wP->size += wP->buffer_size;
+    bufP = wP->p + wP->buf_start;
+    memset(bufP, 0, wP->buffer_size);
+    put32(bufP, wP->buffer_size);
+    put64(bufP + 16, ts);
+    bufP[40] = proc;
+    bufP[41] = align;
+    put16(bufP + 42, 1);        /* Logger id */
+    put16(bufP + 52, flags);
+    wP->pos = 72;
+}
+
+/* Records the filled size and marks the rest unused as the logger does */
+static void end_buffer(Writer *wP, int fill)
+{
+    unsigned char *bufP = wP->p + wP->buf_start;
+    put32(bufP + 4, wP->pos);
+    put32(bufP + 48, wP->pos);
+    memset(bufP + wP->pos, fill, wP->buffer_size - wP->pos);
+}
+
+static int add_record(Writer *wP, const unsigned char *recP, ULONG len)
+{
+    if (wP->pos + len > wP->buffer_size)
+        return 0;
+    memcpy(wP->p + wP->buf_start + wP->pos, recP, len);
+    wP->pos += ALIGN8(len);
+    if (wP->pos > wP->buffer_size)
+        wP->pos = wP->buffer_size;
+    return 1;
+}
+
+/* System header of 32 (full), 24 (compact) or 16 (perfinfo) bytes */
+static ULONG system_record(unsigned char *recP, int hdrlen, int is64,
+                           UCHAR group, UCHAR opcode, USHORT version,
+                           ULONG tid, ULONG pid, LONGLONG ts,
+                           const void *dataP, ULONG ndata)
+{
+    int htype = hdrlen == 32 ? 1 : (hdrlen == 24 ? 3 : 16);
+    ULONG size = hdrlen + ndata;
+
+    memset(recP, 0, hdrlen);
+    put16(recP, version);
+    recP[2] = htype + (is64 ? 1 : 0);
+    recP[3] = 0xc0;
+    put16(recP + 4, size);
+    recP[6] = opcode;
+    recP[7] = group;
+    if (hdrlen == 16)
+        put64(recP + 8, ts);
+    else {
+        put32(recP + 8, tid);
+        put32(recP + 12, pid);
+        put64(recP + 16, ts);
+        if (hdrlen == 32) {
+            put32(recP + 24, tid * 3); /* Kernel time */
+            put32(recP + 28, tid * 5); /* User time */
+        }
+    }
+    memcpy(recP + hdrlen, dataP, ndata);
+    return size;
+}
+
+static ULONG full_record(unsigned char *recP, int is64, const GUID *guidP,
+                         UCHAR type, UCHAR level, USHORT version,
+                         ULONG tid, ULONG pid, LONGLONG ts,
+                         const void *dataP, ULONG ndata)
+{
+    ULONG size = 48 + ndata;
+
+    memset(recP, 0, 48);
+    put16(recP, size);
+    recP[2] = is64 ? 20 : 10;
+    recP[3] = 0xc0;
+    recP[4] = type;
+    recP[5] = level;
+    put16(recP + 6, version);
+    put32(recP + 8, tid);
+    put32(recP + 12, pid);
+    put64(recP + 16, ts);
+    memcpy(recP + 24, guidP, sizeof(GUID));
+    put32(recP + 40, 11);
+    put32(recP + 44, 13);
+    if (ndata)
+        memcpy(recP + 48, dataP, ndata);
+    return size;
+}
+
+typedef struct {
+    USHORT type;
+    USHORT size;
+    const void *dataP;
+} ExtItem;
+
+static ULONG event_record(unsigned char *recP, int is64, const GUID *guidP,
+                          USHORT id, UCHAR version, UCHAR opcode,
+                          ULONG tid, ULONG pid, LONGLONG ts,
+                          int next, const ExtItem *extP,
+                          const void *dataP, ULONG ndata)
+{
+    ULONG pos = 80;
+    int i;
+
+    memset(recP, 0, 80);
+    recP[2] = is64 ? 19 : 18;
+    recP[3] = 0xc0;
+    put16(recP + 4, next ? 0x0001 : 0); /* EVENT_HEADER_FLAG_EXTENDED_INFO */
+    put32(recP + 8, tid);
+    put32(recP + 12, pid);
+    put64(recP + 16, ts);
+    memcpy(recP + 24, guidP, sizeof(GUID));
+    put16(recP + 40, id);
+    recP[42] = version;
+    recP[44] = 4;               /* Level */
+    recP[45] = opcode;
+    put64(recP + 48, 0x8000000000000010LL); /* Keywords */
+    for (i = 0; i < next; ++i) {
+        memset(recP + pos, 0, 8);
+        put16(recP + pos + 2, extP[i].type);
+        put16(recP + pos + 4, i < next - 1);
+        put16(recP + pos + 6, extP[i].size);
+        memcpy(recP + pos + 8, extP[i].dataP, extP[i].size);
+        pos = ALIGN8(pos + 8 + extP[i].size);
+    }
+    memcpy(recP + pos, dataP, ndata);
+    put16(recP, pos + ndata);
+    return pos + ndata;
+}
+
+/* A WPP message. Not decoded by the parser */
+static ULONG message_record(unsigned char *recP)
+{
+    memset(recP, 0, 40);
+    put16(recP, 40);
+    recP[2] = 15;
+    recP[3] = 0xc0;
+    return 40;
+}
+
+static ULONG put_wstr(unsigned char *p, const char *s)
+{
+    ULONG n = 0;
+    do {
+        put16(p + n, (unsigned char) *s);
+        n += 2;
+    } while (*s++);
+    return n;
+}
+
+/* The TRACE_LOGFILE_HEADER event data for the given pointer size */
+static ULONG logfile_header(unsigned char *p, ULONG buffer_size, ULONG ptrsize,
+                            ULONG clock_type)
+{
+    ULONG pos;
+
+    memset(p, 0, 512);
+    put32(p, buffer_size);
+    put32(p + 4, 0x0a000001);   /* Version */
+    put32(p + 12, 4);           /* Processors */
+    put64(p + 16, START_TIME + 600000000LL);
+    put32(p + 24, 156001);      /* Timer resolution */
+    put32(p + 32, 0x00000001);  /* EVENT_TRACE_FILE_MODE_SEQUENTIAL */
+    put32(p + 36, 6);           /* Buffers written */
+    put32(p + 44, ptrsize);
+    put32(p + 48, 3);           /* Events lost */
+    put32(p + 52, 2600);        /* CPU MHz */
+    pos = ALIGN8(56 + 2 * ptrsize + 172);
+    put64(p + pos, START_TIME - 36000000000LL);
+    put64(p + pos + 8, PERF_FREQ);
+    put64(p + pos + 16, START_TIME);
+    put32(p + pos + 24, clock_type);
+    put32(p + pos + 28, 1);     /* Buffers lost */
+    pos += 32;
+    pos += put_wstr(p + pos, "Twapi Test Logger");
+    pos += put_wstr(p + pos, "C:\\temp\\twapi.etl");
+    return pos;
+}
+
+static int wstr_equal(const WCHAR *ws, const char *s)
+{
+    do {
+        if (*ws++ != (unsigned char) *s)
+            return 0;
+    } while (*s++);
+    return 1;
+}
+
+typedef struct {
+    const unsigned char *p;
+    size_t size;
+    long nreads;
+} MemFile;
+
+static ULONG mem_read(void *ctxP, ULONGLONG offset, void *bufP, ULONG len)
+{
+    MemFile *mfP = ctxP;
+    ++mfP->nreads;
+    if (offset + len > mfP->size)
+        return ERROR_HANDLE_EOF;
+    memcpy(bufP, mfP->p + offset, len);
+    return ERROR_SUCCESS;
+}
+
+static ULONG file_read(void *ctxP, ULONGLONG offset, void *bufP, ULONG len)
+{
+    FILE *fp = ctxP;
+    if (fseek(fp, (long) offset, SEEK_SET) != 0)
+        return ERROR_HANDLE_EOF;
+    return fread(bufP, 1, len, fp) == len ? ERROR_SUCCESS : ERROR_HANDLE_EOF;
+}
+
+static double now_usecs(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/*
+ * Buffers of the check file:
+ *  0  cpu 0 - header, system, compact and perfinfo kernel events, a WPP
+ *           message, a classic event, a manifest event with extended data
+ *  1  cpu 257 (processor index) - 32 bit events
+ *  2  compressed - skipped
+ *  3  never written - skipped
+ *  4  cpu 2 - one event followed by a record with an invalid size
+ *  5  cpu 3 - manifest events filling the buffer
+ */
+static unsigned char payload[128];
+static const GUID related_guid = {0x11111111, 0x2222, 0x3333, {4, 4, 4, 4, 4, 4, 4, 4}};
+static const ULONG ts_session = 7;
+
+static void write_check_file(Writer *wP)
+{
+    unsigned char rec[1024], lfh[512];
+    ExtItem ext[2] = {{0x0001, 16, &related_guid}, {0x0003, 4, &ts_session}};
+    ULONG n;
+    int i;
+
+    wP->buffer_size = 4096;
+    for (i = 0; i < (int) sizeof(payload); ++i)
+        payload[i] = (unsigned char) (i + 1);
+
+    start_buffer(wP, 0, 0, 0, TS(0));
+    n = logfile_header(lfh, 4096, 8, 1);
+    CHECK(add_record(wP, rec, system_record(rec, 32, 1, 0, 0, 2, 0, 0, TS(0), lfh, n)));
+    CHECK(add_record(wP, rec, system_record(rec, 32, 1, 0x03, 1, 4, 100, 4, TS(10), payload, 40)));
+    CHECK(add_record(wP, rec, system_record(rec, 24, 1, 0x05, 1, 3, 101, 4, TS(20), payload, 8)));
+    CHECK(add_record(wP, rec, system_record(rec, 16, 1, 0x0F, 0x2E, 2, 0, 0, TS(30), payload, 16)));
+    CHECK(add_record(wP, rec, message_record(rec)));
+    CHECK(add_record(wP, rec, full_record(rec, 1, &twapi_guid, 10, 4, 2, 102, 200, TS(40), "hello", 5)));
+    CHECK(add_record(wP, rec, event_record(rec, 1, &provider_guid, 1, 3, 1, 103, 300, TS(50), 2, ext, payload, 12)));
+    end_buffer(wP, 0xff);
+
+    start_buffer(wP, 1, 1, 0x0020, TS(60));
+    CHECK(add_record(wP, rec, system_record(rec, 32, 0, 0x03, 2, 4, 104, 400, TS(70), payload, 24)));
+    CHECK(add_record(wP, rec, event_record(rec, 0, &provider_guid, 2, 0, 2, 105, 400, TS(80), 0, NULL, payload, 7)));
+    CHECK(add_record(wP, rec, full_record(rec, 0, &twapi_guid, 11, 5, 0, 106, 400, TS(90), NULL, 0)));
+    end_buffer(wP, 0);
+
+    start_buffer(wP, 2, 0, 0x0040, TS(100));
+    CHECK(add_record(wP, rec, system_record(rec, 32, 1, 0x03, 1, 4, 100, 4, TS(110), payload, 40)));
+    end_buffer(wP, 0);
+
+    start_buffer(wP, 0, 0, 0, 0);
+    memset(wP->p + wP->buf_start, 0, wP->buffer_size);
+
+    start_buffer(wP, 2, 0, 0, TS(120));
+    CHECK(add_record(wP, rec, system_record(rec, 32, 1, 0x05, 2, 3, 107, 4, TS(130), payload, 8)));
+    n = system_record(rec, 32, 1, 0x05, 2, 3, 108, 4, TS(140), payload, 8);
+    put16(rec + 4, 4000);       /* Extends past the filled part */
+    CHECK(add_record(wP, rec, n));
+    end_buffer(wP, 0);
+
+    start_buffer(wP, 3, 0, 0, TS(150));
+    for (i = 0; add_record(wP, rec, event_record(rec, 1, &provider_guid, 5, 0, 0, 109, 500, TS(160 + i), 0, NULL, payload, i % 50)); ++i)
+        ;
+    end_buffer(wP, 0);
+}
+
+static void check_events(void)
+{
+    Writer w;
+    MemFile mf;
+    TwapiEtlFile *etlP;
+    const TwapiEtlHeader *hP;
+    const TwapiEtlBufferInfo *infoP;
+    TwapiEtlStats stats;
+    EVENT_RECORD *evrP;
+    EVENT_HEADER *ehP;
+    ULONG n;
+    int i;
+
+    memset(&w, 0, sizeof(w));
+    write_check_file(&w);
+    mf.p = w.p;
+    mf.size = w.size;
+
+    CHECK(TwapiEtlOpen(mem_read, &mf, mf.size, 0, &etlP) == ERROR_SUCCESS);
+    hP = TwapiEtlGetHeader(etlP);
+    CHECK(hP->buffer_size == 4096 && hP->pointer_size == 8);
+    CHECK(hP->nprocessors == 4 && hP->version == 0x0a000001);
+    CHECK(hP->timer_resolution == 156001 && hP->log_file_mode == 1);
+    CHECK(hP->buffers_written == 6 && hP->events_lost == 3 && hP->buffers_lost == 1);
+    CHECK(hP->cpu_speed == 2600 && hP->clock_type == 1);
+    CHECK(hP->start_time == START_TIME && hP->perf_freq == PERF_FREQ);
+    CHECK(hP->end_time == START_TIME + 600000000LL);
+    CHECK(hP->boot_time == START_TIME - 36000000000LL);
+    CHECK(wstr_equal(hP->logger_nameP, "Twapi Test Logger"));
+    CHECK(wstr_equal(hP->log_file_nameP, "C:\\temp\\twapi.etl"));
+    CHECK(TwapiEtlBufferCount(etlP) == 6);
+
+    /* Buffer 0 */
+    CHECK(TwapiEtlReadBuffer(etlP, &infoP) == ERROR_SUCCESS);
+    CHECK(infoP->index == 0 && infoP->timestamp == FT(0));
+    CHECK(infoP->context.ProcessorNumber == 0 && infoP->context.LoggerId == 1);
+
+    /* Header event as ProcessTrace returns it, with the raw header data */
+    CHECK(TwapiEtlNextEvent(etlP, &evrP) == ERROR_SUCCESS);
+    ehP = &evrP->EventHeader;
+    CHECK(memcmp(&ehP->ProviderId, &event_trace_guid, sizeof(GUID)) == 0);
+    CHECK(ehP->EventDescriptor.Opcode == 0 && ehP->EventDescriptor.Version == 2);
+    CHECK(ehP->TimeStamp.QuadPart == START_TIME);
+    CHECK(evrP->UserDataLength == hP->raw_size);
+    CHECK(memcmp(evrP->UserData, hP->rawP, hP->raw_size) == 0);
+    CHECK(((unsigned char *) evrP->UserData)[44] == 8);
+
+    /* Kernel event with full system header */
+    CHECK(TwapiEtlNextEvent(etlP, &evrP) == ERROR_SUCCESS);
+    CHECK(memcmp(&ehP->ProviderId, &process_guid, sizeof(GUID)) == 0);
+    CHECK(ehP->Flags == (EVENT_HEADER_FLAG_CLASSIC_HEADER | EVENT_HEADER_FLAG_64_BIT_HEADER));
+    CHECK(ehP->EventDescriptor.Opcode == 1 && ehP->EventDescriptor.Version == 4);
+    CHECK(ehP->EventDescriptor.Id == 0);
+    CHECK(ehP->ThreadId == 100 && ehP->ProcessId == 4);
+    CHECK(ehP->KernelTime == 300 && ehP->UserTime == 500);
+    CHECK(ehP->TimeStamp.QuadPart == FT(10) && ehP->Size == 72);
+    CHECK(evrP->UserDataLength == 40 && memcmp(evrP->UserData, payload, 40) == 0);
+    CHECK(evrP->ExtendedDataCount == 0);
+
+    /* Compact header has no CPU times */
+    CHECK(TwapiEtlNextEvent(etlP, &evrP) == ERROR_SUCCESS);
+    CHECK(memcmp(&ehP->ProviderId, &thread_guid, sizeof(GUID)) == 0);
+    CHECK(ehP->Flags == (EVENT_HEADER_FLAG_CLASSIC_HEADER | EVENT_HEADER_FLAG_64_BIT_HEADER | EVENT_HEADER_FLAG_NO_CPUTIME));
+    CHECK(ehP->ThreadId == 101 && ehP->KernelTime == 0);
+    CHECK(ehP->TimeStamp.QuadPart == FT(20));
+    CHECK(evrP->UserDataLength == 8);
+
+    /* Perfinfo header has no thread */
+    CHECK(TwapiEtlNextEvent(etlP, &evrP) == ERROR_SUCCESS);
+    CHECK(memcmp(&ehP->ProviderId, &perfinfo_guid, sizeof(GUID)) == 0);
+    CHECK(ehP->EventDescriptor.Opcode == 0x2E);
+    CHECK(ehP->ThreadId == (ULONG) -1 && ehP->ProcessId == (ULONG) -1);
+    CHECK(ehP->TimeStamp.QuadPart == FT(30));
+    CHECK(evrP->UserDataLength == 16 && memcmp(evrP->UserData, payload, 16) == 0);
+
+    /* WPP message skipped. Classic event from TraceEvent */
+    CHECK(TwapiEtlNextEvent(etlP, &evrP) == ERROR_SUCCESS);
+    CHECK(memcmp(&ehP->ProviderId, &twapi_guid, sizeof(GUID)) == 0);
+    CHECK(ehP->Flags == (EVENT_HEADER_FLAG_CLASSIC_HEADER | EVENT_HEADER_FLAG_64_BIT_HEADER));
+    CHECK(ehP->EventDescriptor.Opcode == 10 && ehP->EventDescriptor.Level == 4);
+    CHECK(ehP->EventDescriptor.Version == 2);
+    CHECK(ehP->ThreadId == 102 && ehP->ProcessId == 200);
+    CHECK(ehP->KernelTime == 11 && ehP->UserTime == 13);
+    CHECK(ehP->TimeStamp.QuadPart == FT(40));
+    CHECK(evrP->UserDataLength == 5 && memcmp(evrP->UserData, "hello", 5) == 0);
+
+    /* Manifest event with extended data */
+    CHECK(TwapiEtlNextEvent(etlP, &evrP) == ERROR_SUCCESS);
+    CHECK(memcmp(&ehP->ProviderId, &provider_guid, sizeof(GUID)) == 0);
+    CHECK(ehP->Flags == (EVENT_HEADER_FLAG_EXTENDED_INFO | EVENT_HEADER_FLAG_64_BIT_HEADER));
+    CHECK(ehP->EventDescriptor.Id == 1 && ehP->EventDescriptor.Version == 3);
+    CHECK(ehP->EventDescriptor.Opcode == 1 && ehP->EventDescriptor.Level == 4);
+    CHECK(ehP->EventDescriptor.Keyword == 0x8000000000000010ULL);
+    CHECK(ehP->ThreadId == 103 && ehP->ProcessId == 300);
+    CHECK(ehP->TimeStamp.QuadPart == FT(50));
+    CHECK(evrP->ExtendedDataCount == 2);
+    CHECK(evrP->ExtendedData[0].ExtType == 0x0001 && evrP->ExtendedData[0].DataSize == 16);
+    CHECK(memcmp((void *) (size_t) evrP->ExtendedData[0].DataPtr, &related_guid, 16) == 0);
+    CHECK(evrP->ExtendedData[1].ExtType == 0x0003 && evrP->ExtendedData[1].DataSize == 4);
+    CHECK(*(ULONG *) (size_t) evrP->ExtendedData[1].DataPtr == ts_session);
+    CHECK(evrP->UserDataLength == 12 && memcmp(evrP->UserData, payload, 12) == 0);
+
+    /* Rest of buffer is filler */
+    CHECK(TwapiEtlNextEvent(etlP, &evrP) == ERROR_NO_MORE_ITEMS);
+    CHECK(TwapiEtlNextEvent(etlP, &evrP) == ERROR_NO_MORE_ITEMS);
+
+    /* Buffer 1 - 32 bit events from a processor given by index */
+    CHECK(TwapiEtlReadBuffer(etlP, &infoP) == ERROR_SUCCESS);
+    CHECK(infoP->index == 1 && infoP->flags == TWAPI_ETL_BUFFER_FLAG_PROC_INDEX);
+    CHECK(TwapiEtlNextEvent(etlP, &evrP) == ERROR_SUCCESS);
+    CHECK(ehP->Flags == (EVENT_HEADER_FLAG_CLASSIC_HEADER | EVENT_HEADER_FLAG_32_BIT_HEADER | EVENT_HEADER_FLAG_PROCESSOR_INDEX));
+    CHECK(evrP->BufferContext.ProcessorNumber + (evrP->BufferContext.Alignment << 8) == 257);
+    CHECK(ehP->ThreadId == 104 && ehP->TimeStamp.QuadPart == FT(70));
+    CHECK(TwapiEtlNextEvent(etlP, &evrP) == ERROR_SUCCESS);
+    CHECK(ehP->Flags == (EVENT_HEADER_FLAG_32_BIT_HEADER | EVENT_HEADER_FLAG_PROCESSOR_INDEX));
+    CHECK(ehP->EventDescriptor.Id == 2 && evrP->UserDataLength == 7);
+    CHECK(evrP->ExtendedDataCount == 0 && evrP->ExtendedData == NULL);
+    CHECK(TwapiEtlNextEvent(etlP, &evrP) == ERROR_SUCCESS);
+    CHECK(ehP->EventDescriptor.Opcode == 11 && ehP->EventDescriptor.Level == 5);
+    CHECK(evrP->UserDataLength == 0 && evrP->UserData == NULL);
+    CHECK(TwapiEtlNextEvent(etlP, &evrP) == ERROR_NO_MORE_ITEMS);
+
+    /* Buffers 2 and 3 skipped. Buffer 4 has a bad record */
+    CHECK(TwapiEtlReadBuffer(etlP, &infoP) == ERROR_SUCCESS);
+    CHECK(infoP->index == 4 && infoP->context.ProcessorNumber == 2);
+    CHECK(TwapiEtlNextEvent(etlP, &evrP) == ERROR_SUCCESS);
+    CHECK(ehP->ThreadId == 107);
+    CHECK(TwapiEtlNextEvent(etlP, &evrP) == ERROR_NO_MORE_ITEMS);
+
+    /* Buffer 5 */
+    CHECK(TwapiEtlReadBuffer(etlP, &infoP) == ERROR_SUCCESS);
+    CHECK(infoP->index == 5);
+    for (i = 0; TwapiEtlNextEvent(etlP, &evrP) == ERROR_SUCCESS; ++i) {
+        CHECK(ehP->ThreadId == 109 && ehP->TimeStamp.QuadPart == FT(160 + i));
+        CHECK(evrP->UserDataLength == i % 50);
+        CHECK(evrP->UserDataLength == 0 || memcmp(evrP->UserData, payload, evrP->UserDataLength) == 0);
+    }
+    n = i;
+    CHECK(n > 30);
+    CHECK(TwapiEtlReadBuffer(etlP, &infoP) == ERROR_HANDLE_EOF);
+
+    TwapiEtlGetStats(etlP, &stats);
+    CHECK(stats.buffers == 4 && stats.skipped_buffers == 2);
+    CHECK(stats.events == 6 + 3 + 1 + n);
+    CHECK(stats.skipped_records == 1 && stats.bad_records == 1);
+
+    /* Random access */
+    mf.nreads = 0;
+    CHECK(TwapiEtlSeekBuffer(etlP, 4) == ERROR_SUCCESS);
+    CHECK(TwapiEtlReadBuffer(etlP, &infoP) == ERROR_SUCCESS && infoP->index == 4);
+    CHECK(TwapiEtlNextEvent(etlP, &evrP) == ERROR_SUCCESS && ehP->ThreadId == 107);
+    CHECK(mf.nreads == 1);
+    CHECK(TwapiEtlSeekBuffer(etlP, 1) == ERROR_SUCCESS);
+    CHECK(TwapiEtlReadBuffer(etlP, &infoP) == ERROR_SUCCESS && infoP->index == 1);
+    CHECK(TwapiEtlNextEvent(etlP, &evrP) == ERROR_SUCCESS && ehP->ThreadId == 104);
+    CHECK(TwapiEtlSeekBuffer(etlP, 2) == ERROR_SUCCESS);
+    CHECK(TwapiEtlReadBuffer(etlP, &infoP) == ERROR_SUCCESS && infoP->index == 4);
+    CHECK(TwapiEtlSeekBuffer(etlP, 6) == ERROR_SUCCESS);
+    CHECK(TwapiEtlReadBuffer(etlP, &infoP) == ERROR_HANDLE_EOF);
+    CHECK(TwapiEtlNextEvent(etlP, &evrP) == ERROR_NO_MORE_ITEMS);
+    CHECK(TwapiEtlSeekBuffer(etlP, 7) == ERROR_INVALID_PARAMETER);
+    TwapiEtlClose(etlP);
+
+    /* Raw timestamps */
+    CHECK(TwapiEtlOpen(mem_read, &mf, mf.size, TWAPI_ETL_RAW_TIMESTAMP, &etlP) == ERROR_SUCCESS);
+    CHECK(TwapiEtlReadBuffer(etlP, &infoP) == ERROR_SUCCESS && infoP->timestamp == TS(0));
+    CHECK(TwapiEtlNextEvent(etlP, &evrP) == ERROR_SUCCESS);
+    CHECK(TwapiEtlNextEvent(etlP, &evrP) == ERROR_SUCCESS);
+    CHECK(evrP->EventHeader.TimeStamp.QuadPart == TS(10));
+    TwapiEtlClose(etlP);
+
+    /* Not .etl files */
+    CHECK(TwapiEtlOpen(mem_read, &mf, 4095, 0, &etlP) == ERROR_BAD_FORMAT);
+    memset(w.p + 72, 0, 4096 - 72);
+    CHECK(TwapiEtlOpen(mem_read, &mf, mf.size, 0, &etlP) == ERROR_BAD_FORMAT);
+    memset(w.p, 0, 4096);
+    CHECK(TwapiEtlOpen(mem_read, &mf, mf.size, 0, &etlP) == ERROR_BAD_FORMAT);
+    memset(w.p, 'x', 4096);
+    CHECK(TwapiEtlOpen(mem_read, &mf, mf.size, 0, &etlP) == ERROR_BAD_FORMAT);
+    free(w.p);
+}
+
+/* A log from a 32 bit logger with CPU cycle timestamps */
+static void check_header32(void)
+{
+    Writer w;
+    MemFile mf;
+    TwapiEtlFile *etlP;
+    const TwapiEtlHeader *hP;
+    const TwapiEtlBufferInfo *infoP;
+    EVENT_RECORD *evrP;
+    unsigned char rec[1024], lfh[512];
+    ULONG n;
+
+    memset(&w, 0, sizeof(w));
+    w.buffer_size = 8192;
+    start_buffer(&w, 0, 0, 0, TS(0));
+    n = logfile_header(lfh, 8192, 4, 3);
+    CHECK(add_record(&w, rec, system_record(rec, 32, 0, 0, 0, 2, 0, 0, TS(0), lfh, n)));
+    CHECK(add_record(&w, rec, system_record(rec, 32, 0, 0x03, 1, 4, 100, 4, TS(2600000000LL), payload, 4)));
+    end_buffer(&w, 0);
+    mf.p = w.p;
+    mf.size = w.size;
+
+    CHECK(TwapiEtlOpen(mem_read, &mf, mf.size, 0, &etlP) == ERROR_SUCCESS);
+    hP = TwapiEtlGetHeader(etlP);
+    CHECK(hP->pointer_size == 4 && hP->clock_type == 3);
+    CHECK(hP->start_time == START_TIME && hP->perf_freq == PERF_FREQ);
+    CHECK(wstr_equal(hP->logger_nameP, "Twapi Test Logger"));
+    CHECK(TwapiEtlReadBuffer(&*etlP, &infoP) == ERROR_SUCCESS);
+    CHECK(TwapiEtlNextEvent(etlP, &evrP) == ERROR_SUCCESS);
+    CHECK(TwapiEtlNextEvent(etlP, &evrP) == ERROR_SUCCESS);
+    /* One second at 2600 MHz */
+    CHECK(evrP->EventHeader.TimeStamp.QuadPart == START_TIME + 10000000);
+    TwapiEtlClose(etlP);
+    free(w.p);
+}
+
+/*
+ * Writes a file of the given size made up mostly of manifest events with
+ * payloads of 16-112 bytes, one in eight with extended data, plus kernel
+ * events, round robin across four processors.
+ */
+static void write_bench_file(Writer *wP, size_t mbytes, ULONG buffer_size,
+                             long *neventsP)
+{
+    unsigned char rec[1024], lfh[512];
+    ExtItem ext[1] = {{0x0001, 16, &related_guid}};
+    long nevents = 0, ticks = 0;
+    ULONG n;
+    int cpu = 0;
+
+    wP->buffer_size = buffer_size;
+    start_buffer(wP, 0, 0, 0, TS(0));
+    n = logfile_header(lfh, buffer_size, 8, 1);
+    add_record(wP, rec, system_record(rec, 32, 1, 0, 0, 2, 0, 0, TS(0), lfh, n));
+    ++nevents;
+    while (wP->size < mbytes * 1024 * 1024) {
+        for (;;) {
+            ++ticks;
+            if (ticks % 16 == 0)
+                n = system_record(rec, 32, 1, 0x05, 36, 2, 100 + cpu, 4, TS(ticks), payload, 24);
+            else
+                n = event_record(rec, 1, &provider_guid, ticks % 7, 0, 0, 100 + cpu, 400, TS(ticks), ticks % 8 == 0, ext, payload, 16 + 16 * (ticks % 7));
+            if (! add_record(wP, rec, n))
+                break;
+            ++nevents;
+        }
+        end_buffer(wP, 0);
+        cpu = (cpu + 1) % 4;
+        start_buffer(wP, cpu, 0, 0, TS(ticks));
+        CHECK(add_record(wP, rec, n));
+        ++nevents;
+    }
+    end_buffer(wP, 0);
+    *neventsP = nevents;
+}
+
+static ULONGLONG parse_all(TwapiEtlFile *etlP, long *neventsP)
+{
+    const TwapiEtlBufferInfo *infoP;
+    EVENT_RECORD *evrP;
+    ULONGLONG sum = 0;
+    long nevents = 0;
+
+    TwapiEtlSeekBuffer(etlP, 0);
+    while (TwapiEtlReadBuffer(etlP, &infoP) == ERROR_SUCCESS) {
+        while (TwapiEtlNextEvent(etlP, &evrP) == ERROR_SUCCESS) {
+            sum += evrP->EventHeader.TimeStamp.QuadPart + evrP->UserDataLength;
+            ++nevents;
+        }
+    }
+    *neventsP = nevents;
+    return sum;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t mbytes = 64;
+    ULONG buffer_size = 64 * 1024;
+    Writer w;
+    MemFile mf;
+    TwapiEtlFile *etlP;
+    const TwapiEtlBufferInfo *infoP;
+    EVENT_RECORD *evrP;
+    FILE *fp;
+    char path[256];
+    const char *tmpdir;
+    double start, mem_usecs, file_usecs, seek_usecs;
+    long nwritten, nmem, nfile, nseeks = 10000, i;
+    ULONGLONG sum1, sum2;
+    unsigned int seed = 1;
+    int argi;
+
+    for (argi = 1; argi + 1 < argc; argi += 2) {
+        if (strcmp(argv[argi], "-mbytes") == 0)
+            mbytes = atol(argv[argi+1]);
+        else if (strcmp(argv[argi], "-buffersize") == 0)
+            buffer_size = atol(argv[argi+1]);
+        else {
+            fprintf(stderr, "Usage: %s ?-mbytes N? ?-buffersize N?\n", argv[0]);
+            return 1;
+        }
+    }
+
+    check_events();
+    check_header32();
+    printf("Checks passed\n");
+
+    memset(&w, 0, sizeof(w));
+    write_bench_file(&w, mbytes, buffer_size, &nwritten);
+    mf.p = w.p;
+    mf.size = w.size;
+
+    CHECK(TwapiEtlOpen(mem_read, &mf, mf.size, 0, &etlP) == ERROR_SUCCESS);
+    start = now_usecs();
+    sum1 = parse_all(etlP, &nmem);
+    mem_usecs = now_usecs() - start;
+    CHECK(nmem == nwritten);
+
+    start = now_usecs();
+    for (i = 0; i < nseeks; ++i) {
+        seed = seed * 1103515245 + 12345;
+        TwapiEtlSeekBuffer(etlP, (seed >> 8) % TwapiEtlBufferCount(etlP));
+        CHECK(TwapiEtlReadBuffer(etlP, &infoP) == ERROR_SUCCESS);
+        CHECK(TwapiEtlNextEvent(etlP, &evrP) == ERROR_SUCCESS);
+    }
+    seek_usecs = now_usecs() - start;
+    TwapiEtlClose(etlP);
+
+    tmpdir = getenv("TMPDIR");
+    snprintf(path, sizeof(path), "%s/etlfile_bench.etl", tmpdir ? tmpdir : "/tmp");
+    fp = fopen(path, "wb");
+    CHECK(fp && fwrite(w.p, 1, w.size, fp) == w.size);
+    fclose(fp);
+    fp = fopen(path, "rb");
+    CHECK(fp);
+    CHECK(TwapiEtlOpen(file_read, fp, w.size, 0, &etlP) == ERROR_SUCCESS);
+    start = now_usecs();
+    sum2 = parse_all(etlP, &nfile);
+    file_usecs = now_usecs() - start;
+    CHECK(nfile == nwritten && sum1 == sum2);
+    TwapiEtlClose(etlP);
+    fclose(fp);
+    remove(path);
+
+    printf("%zu MB, %lu byte buffers, %ld events\n", w.size >> 20,
+           (unsigned long) buffer_size, nwritten);
+    printf("%-12s %14s %10s\n", "source", "events/sec", "MB/sec");
+    printf("%-12s %14.0f %10.0f\n", "memory", nmem * 1e6 / mem_usecs,
+           w.size / mem_usecs);
+    printf("%-12s %14.0f %10.0f\n", "file", nfile * 1e6 / file_usecs,
+           w.size / file_usecs);
+    printf("random buffer reads/sec %.0f\n", nseeks * 1e6 / seek_usecs);
+    free(w.p);
+    return 0;
+}
@@ -0,0 +1,360 @@
+/*
+ * Copyright (c) 2018, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ */
+
+/*
+ * Checks the event batch store used for lazy decoding by the ETW
+ * consumer and measures the cost of copying events into batches, which
+ * is all that is done per event while the trace is processed, and of
+ * reading back a header field of every event. Events are synthesized
+ * unless a recorded log file is given with -etl, in which case they are
+ * read with the .etl parser. The comparison with eager decoding into
+ * Tcl lists is made by etwbatch_perf.tcl. Does not need Tcl or
+ * Windows. Build and run from this directory, e.g.
+ *
+ *   cc -O2 -DETW_STANDALONE -I../../etw -o etwbatch_bench \
+ *       etwbatch_bench.c ../../etw/etwbatch.c ../../etw/etlfile.c
+ *   ./etwbatch_bench ?-events N? ?-etl PATH?
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "etwbatch.h"
+#include "etlfile.h"
+
+#define CHECK(cond_)                                                    \
+    do {                                                                \
+        if (!(cond_)) {                                                 \
+            fprintf(stderr, "Check failed at line %d: %s\n", __LINE__, #cond_); \
+            abort();                                                    \
+        }                                                               \
+    } while (0)
+
+/* Events per batch when synthesizing, about what a 64K buffer holds */
+#define EVENTS_PER_BATCH 500
+
+static double now_usecs(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* Event i has i%3 extended data items and (i*7)%200 bytes of user data */
+typedef struct {
+    EVENT_RECORD evr;
+    EVENT_HEADER_EXTENDED_DATA_ITEM items[2];
+    BYTE ext[2][24];
+    BYTE user[200];
+} SynthEvent;
+
+static void synth_event(SynthEvent *sP, ULONG i)
+{
+    ULONG j;
+
+    memset(sP, 0, sizeof(*sP));
+    sP->evr.EventHeader.Size = sizeof(EVENT_HEADER);
+    sP->evr.EventHeader.Flags = (USHORT) ((i & 1) ? EVENT_HEADER_FLAG_64_BIT_HEADER : 0);
+    sP->evr.EventHeader.ThreadId = i * 4;
+    sP->evr.EventHeader.ProcessId = 1000 + i % 17;
+    sP->evr.EventHeader.TimeStamp.QuadPart = 131000000000000000LL + i;
+    sP->evr.EventHeader.ProviderId.Data1 = 0xabcd0000 + i % 5;
+    sP->evr.EventHeader.EventDescriptor.Id = (USHORT) (i % 40);
+    sP->evr.BufferContext.ProcessorNumber = (UCHAR) (i % 4);
+    sP->evr.BufferContext.LoggerId = 7;
+
+    sP->evr.ExtendedDataCount = (USHORT) (i % 3);
+    if (sP->evr.ExtendedDataCount)
+        sP->evr.ExtendedData = sP->items;
+    for (j = 0; j < sP->evr.ExtendedDataCount; ++j) {
+        sP->items[j].ExtType = (USHORT) (EVENT_HEADER_EXT_TYPE_SID + j);
+        sP->items[j].DataSize = (USHORT) (12 + 4 * j + (i % 5));
+        sP->items[j].DataPtr = (ULONGLONG) (size_t) sP->ext[j];
+        memset(sP->ext[j], (int) (i + j), sizeof(sP->ext[j]));
+    }
+
+    sP->evr.UserDataLength = (USHORT) ((i * 7) % 200);
+    if (sP->evr.UserDataLength)
+        sP->evr.UserData = sP->user;
+    for (j = 0; j < sP->evr.UserDataLength; ++j)
+        sP->user[j] = (BYTE) (i ^ j);
+}
+
+static void check_batch(void)
+{
+    TwapiEtwBatch *batchP;
+    SynthEvent s;
+    EVENT_RECORD evr;
+    USHORT flags;
+    ULONG i, j, n = 1000;
+
+    batchP = TwapiEtwBatchNew();
+    CHECK(batchP != NULL);
+    CHECK(TwapiEtwBatchCount(batchP) == 0);
+    for (i = 0; i < n; ++i) {
+        synth_event(&s, i);
+        CHECK(TwapiEtwBatchAppend(batchP, &s.evr, 4) == ERROR_SUCCESS);
+        /* The source is reused so the batch must not point into it */
+        memset(&s, 0xee, sizeof(s));
+    }
+    TwapiEtwBatchSeal(batchP);
+    TwapiEtwBatchSeal(batchP);  /* Must be idempotent */
+    synth_event(&s, 0);
+    CHECK(TwapiEtwBatchAppend(batchP, &s.evr, 4) == ERROR_INVALID_PARAMETER);
+    CHECK(TwapiEtwBatchCount(batchP) == n);
+
+    TwapiEtwBatchRetain(batchP);
+    TwapiEtwBatchRelease(batchP);
+
+    for (i = 0; i < n; ++i) {
+        synth_event(&s, i);
+        TwapiEtwBatchGet(batchP, i, &evr, &flags);
+        CHECK(flags == s.evr.EventHeader.Flags);
+        /* Pointer size flag added only when not already present */
+        if (flags)
+            CHECK(evr.EventHeader.Flags == flags);
+        else
+            CHECK(evr.EventHeader.Flags == EVENT_HEADER_FLAG_32_BIT_HEADER);
+        evr.EventHeader.Flags = s.evr.EventHeader.Flags;
+        CHECK(memcmp(&evr.EventHeader, &s.evr.EventHeader, sizeof(EVENT_HEADER)) == 0);
+        CHECK(memcmp(&evr.BufferContext, &s.evr.BufferContext, sizeof(ETW_BUFFER_CONTEXT)) == 0);
+        CHECK(evr.UserDataLength == s.evr.UserDataLength);
+        CHECK((evr.UserData == NULL) == (s.evr.UserDataLength == 0));
+        if (evr.UserDataLength) {
+            CHECK(((size_t) evr.UserData & 7) == 0);
+            CHECK(memcmp(evr.UserData, s.user, evr.UserDataLength) == 0);
+        }
+        CHECK(evr.ExtendedDataCount == s.evr.ExtendedDataCount);
+        CHECK((evr.ExtendedData == NULL) == (s.evr.ExtendedDataCount == 0));
+        for (j = 0; j < evr.ExtendedDataCount; ++j) {
+            CHECK(evr.ExtendedData[j].ExtType == s.items[j].ExtType);
+            CHECK(evr.ExtendedData[j].DataSize == s.items[j].DataSize);
+            CHECK((evr.ExtendedData[j].DataPtr & 7) == 0);
+            CHECK(memcmp((void *)(size_t) evr.ExtendedData[j].DataPtr,
+                         s.ext[j], s.items[j].DataSize) == 0);
+        }
+    }
+    CHECK(TwapiEtwBatchSize(batchP) > 0);
+    TwapiEtwBatchRelease(batchP);
+
+    /* Empty batches and events without any data */
+    batchP = TwapiEtwBatchNew();
+    TwapiEtwBatchSeal(batchP);
+    CHECK(TwapiEtwBatchCount(batchP) == 0);
+    TwapiEtwBatchRelease(batchP);
+
+    batchP = TwapiEtwBatchNew();
+    memset(&s, 0, sizeof(s));
+    s.evr.ExtendedDataCount = 3;    /* No ExtendedData pointer */
+    s.evr.UserDataLength = 10;      /* No UserData pointer */
+    CHECK(TwapiEtwBatchAppend(batchP, &s.evr, 8) == ERROR_SUCCESS);
+    TwapiEtwBatchSeal(batchP);
+    TwapiEtwBatchGet(batchP, 0, &evr, NULL);
+    CHECK(evr.ExtendedDataCount == 0 && evr.ExtendedData == NULL);
+    CHECK(evr.UserDataLength == 0 && evr.UserData == NULL);
+    CHECK(evr.EventHeader.Flags == EVENT_HEADER_FLAG_64_BIT_HEADER);
+    TwapiEtwBatchRelease(batchP);
+}
+
+/*
+ * Events that differ only in level, channel or task, as MOF events may,
+ * must each keep the schema stored for them and not share the first.
+ */
+static void check_schemas(void)
+{
+    TwapiEtwBatch *batchP;
+    TwapiTdhSchema schema;
+    const TwapiTdhSchema *schemaP;
+    TRACE_EVENT_INFO tei;
+    SynthEvent s;
+    ULONG i;
+    int si;
+
+    batchP = TwapiEtwBatchNew();
+    for (i = 0; i < 8; ++i) {
+        synth_event(&s, 0);
+        /* Events 0 and 4 have the same key, so do 1 and 5 and so on */
+        s.evr.EventHeader.EventDescriptor.Level = (UCHAR) (i % 4 == 1 ? 2 : 4);
+        s.evr.EventHeader.EventDescriptor.Channel = (UCHAR) (i % 4 == 2 ? 16 : 0);
+        s.evr.EventHeader.EventDescriptor.Task = (USHORT) (i % 4 == 3 ? 5 : 0);
+        CHECK(TwapiEtwBatchAppend(batchP, &s.evr, 8) == ERROR_SUCCESS);
+        memset(&tei, 0, sizeof(tei));
+        tei.EventDescriptor = s.evr.EventHeader.EventDescriptor;
+        memset(&schema, 0, sizeof(schema));
+        schema.status = ERROR_SUCCESS;
+        schema.teiP = &tei;
+        schema.tei_size = sizeof(tei);
+        CHECK(TwapiEtwBatchSetSchema(batchP, &schema) == ERROR_SUCCESS);
+    }
+    TwapiEtwBatchSeal(batchP);
+    CHECK(TwapiEtwBatchSchemaCount(batchP) == 4);
+    for (i = 0; i < 8; ++i) {
+        si = TwapiEtwBatchEventSchema(batchP, i);
+        CHECK(si == (int) (i % 4));
+        schemaP = TwapiEtwBatchGetSchema(batchP, si);
+        CHECK(schemaP->teiP->EventDescriptor.Level == (i % 4 == 1 ? 2 : 4));
+        CHECK(schemaP->teiP->EventDescriptor.Channel == (i % 4 == 2 ? 16 : 0));
+        CHECK(schemaP->teiP->EventDescriptor.Task == (i % 4 == 3 ? 5 : 0));
+    }
+    TwapiEtwBatchRelease(batchP);
+}
+
+/* Sums a header field of every event as a column would be built */
+static ULONGLONG scan_batch(TwapiEtwBatch *batchP)
+{
+    EVENT_RECORD evr;
+    ULONGLONG sum = 0;
+    ULONG i, n = TwapiEtwBatchCount(batchP);
+
+    for (i = 0; i < n; ++i) {
+        TwapiEtwBatchGet(batchP, i, &evr, NULL);
+        sum += evr.EventHeader.ProcessId;
+    }
+    return sum;
+}
+
+static void bench_synthetic(long nevents)
+{
+    SynthEvent *eventsP;
+    TwapiEtwBatch *batchP;
+    double start, copy_usecs, scan_usecs;
+    ULONGLONG sum, expected;
+    long i, n;
+
+    eventsP = malloc(EVENTS_PER_BATCH * sizeof(*eventsP));
+    CHECK(eventsP != NULL);
+    expected = 0;
+    for (i = 0; i < EVENTS_PER_BATCH; ++i) {
+        synth_event(&eventsP[i], i);
+        expected += eventsP[i].evr.EventHeader.ProcessId;
+    }
+
+    copy_usecs = scan_usecs = 0;
+    for (n = 0; n < nevents; n += EVENTS_PER_BATCH) {
+        start = now_usecs();
+        batchP = TwapiEtwBatchNew();
+        for (i = 0; i < EVENTS_PER_BATCH; ++i)
+            CHECK(TwapiEtwBatchAppend(batchP, &eventsP[i].evr, 8) == ERROR_SUCCESS);
+        TwapiEtwBatchSeal(batchP);
+        copy_usecs += now_usecs() - start;
+        start = now_usecs();
+        sum = scan_batch(batchP);
+        scan_usecs += now_usecs() - start;
+        CHECK(sum == expected);
+        TwapiEtwBatchRelease(batchP);
+    }
+    free(eventsP);
+
+    printf("%ld synthetic events, %d per batch\n", n, EVENTS_PER_BATCH);
+    printf("%-16s %12s\n", "operation", "events/sec");
+    printf("%-16s %12.0f\n", "copy", n / (copy_usecs / 1e6));
+    printf("%-16s %12.0f\n", "column scan", n / (scan_usecs / 1e6));
+}
+
+static ULONG file_read(void *ctxP, ULONGLONG offset, void *bufP, ULONG len)
+{
+    FILE *fp = ctxP;
+    if (fseek(fp, (long) offset, SEEK_SET) != 0)
+        return ERROR_HANDLE_EOF;
+    return fread(bufP, 1, len, fp) == len ? ERROR_SUCCESS : ERROR_HANDLE_EOF;
+}
+
+/* One batch per buffer as the consumer does */
+static void bench_etl(const char *path)
+{
+    FILE *fp;
+    long size;
+    TwapiEtlFile *etlP;
+    const TwapiEtlBufferInfo *infoP;
+    EVENT_RECORD *evrP;
+    TwapiEtwBatch *batchP;
+    double start, parse_usecs, copy_usecs, scan_usecs;
+    ULONGLONG sum1, sum2;
+    long nevents, nbatches;
+
+    fp = fopen(path, "rb");
+    if (fp == NULL) {
+        perror(path);
+        exit(1);
+    }
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    CHECK(TwapiEtlOpen(file_read, fp, size, 0, &etlP) == ERROR_SUCCESS);
+
+    /* Parse alone first so its cost can be subtracted */
+    start = now_usecs();
+    sum1 = 0;
+    while (TwapiEtlReadBuffer(etlP, &infoP) == ERROR_SUCCESS) {
+        while (TwapiEtlNextEvent(etlP, &evrP) == ERROR_SUCCESS)
+            sum1 += evrP->EventHeader.ProcessId;
+    }
+    parse_usecs = now_usecs() - start;
+
+    TwapiEtlSeekBuffer(etlP, 0);
+    copy_usecs = scan_usecs = 0;
+    sum2 = 0;
+    nevents = nbatches = 0;
+    start = now_usecs();
+    while (TwapiEtlReadBuffer(etlP, &infoP) == ERROR_SUCCESS) {
+        double scan_start;
+        batchP = TwapiEtwBatchNew();
+        while (TwapiEtlNextEvent(etlP, &evrP) == ERROR_SUCCESS)
+            CHECK(TwapiEtwBatchAppend(batchP, evrP, TwapiEtlGetHeader(etlP)->pointer_size) == ERROR_SUCCESS);
+        TwapiEtwBatchSeal(batchP);
+        scan_start = now_usecs();
+        sum2 += scan_batch(batchP);
+        scan_usecs += now_usecs() - scan_start;
+        nevents += TwapiEtwBatchCount(batchP);
+        ++nbatches;
+        TwapiEtwBatchRelease(batchP);
+    }
+    copy_usecs = now_usecs() - start - scan_usecs - parse_usecs;
+    CHECK(sum1 == sum2);
+    TwapiEtlClose(etlP);
+    fclose(fp);
+
+    if (nevents == 0) {
+        printf("%s: no events\n", path);
+        return;
+    }
+    printf("%s: %ld events in %ld buffers\n", path, nevents, nbatches);
+    printf("%-16s %12s\n", "operation", "events/sec");
+    printf("%-16s %12.0f\n", "parse", nevents / (parse_usecs / 1e6));
+    if (copy_usecs > 0)
+        printf("%-16s %12.0f\n", "copy", nevents / (copy_usecs / 1e6));
+    printf("%-16s %12.0f\n", "column scan", nevents / (scan_usecs / 1e6));
+}
+
+int main(int argc, char *argv[])
+{
+    long nevents = 2000000;
+    const char *etl = NULL;
+    int argi;
+
+    for (argi = 1; argi + 1 < argc; argi += 2) {
+        if (strcmp(argv[argi], "-events") == 0)
+            nevents = atol(argv[argi+1]);
+        else if (strcmp(argv[argi], "-etl") == 0)
+            etl = argv[argi+1];
+        else {
+            fprintf(stderr, "Usage: %s ?-events N? ?-etl PATH?\n", argv[0]);
+            return 1;
+        }
+    }
+
+    check_batch();
+    check_schemas();
+    printf("Checks passed\n");
+
+    if (etl)
+        bench_etl(etl);
+    else
+        bench_synthetic(nevents);
+    return 0;
+}
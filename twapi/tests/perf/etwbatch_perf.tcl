@@ -0,0 +1,95 @@
+#
+# Copyright (c) 2018, Ashok P. Nadkarni
+# All rights reserved.
+#
+# See the file LICENSE for license
+
+# Time to read and decode all events in a log file with and without
+# -lazy, both when every field is formatted and when only a few
+# columns are wanted.
+#
+#   tclsh etwbatch_perf.tcl ?-etl PATH? ?-iterations N?
+#
+# Without -etl a kernel trace is recorded first which needs an elevated
+# administrator account.
+
+source [file join [file dirname [info script]] perfutil.tcl]
+load_twapi_package twapi
+
+namespace eval perf::etwbatch {
+    set iters 5
+    if {[set pos [lsearch -exact $::argv -iterations]] >= 0} {
+        set iters [lindex $::argv [incr pos]]
+    }
+
+    if {[set pos [lsearch -exact $::argv -etl]] >= 0} {
+        set path [lindex $::argv [incr pos]]
+    } else {
+        set path [file join [pwd] etwbatch[pid].etl]
+        set htrace [twapi::etw_start_kernel_trace {process thread registry diskio diskfileio} -logfile $path]
+        foreach dir [list [pwd] [info library] $::env(WINDIR)] {
+            glob -nocomplain -directory $dir *
+        }
+        foreach key {HKEY_CLASSES_ROOT\\.cmd HKEY_CLASSES_ROOT\\.exe} {
+            catch {registry get $key {}}
+        }
+        twapi::etw_stop_trace $htrace
+    }
+
+    set formatter [twapi::etw_open_formatter]
+    set etl [twapi::etw_open_etl $path]
+
+    # Returns the number of events read and decoded
+    proc format_all {etl formatter args} {
+        twapi::etw_etl_seek $etl 0
+        set n 0
+        foreach {buf evl} [twapi::etw_process_etl $etl {*}$args] {
+            incr n [twapi::recordarray size [twapi::etw_format_events $formatter $buf $evl]]
+        }
+        return $n
+    }
+
+    proc columns_eager {etl formatter} {
+        twapi::etw_etl_seek $etl 0
+        set n 0
+        foreach {buf evl} [twapi::etw_process_etl $etl] {
+            set ra [twapi::etw_format_events $formatter $buf $evl]
+            incr n [llength [twapi::recordarray column $ra -timecreated]]
+            twapi::recordarray column $ra -pid
+            twapi::recordarray column $ra -taskname
+        }
+        return $n
+    }
+
+    proc columns_lazy {etl} {
+        twapi::etw_etl_seek $etl 0
+        set n 0
+        foreach {buf evl} [twapi::etw_process_etl $etl -lazy 1] {
+            set cols [twapi::etw_batch_columns $evl -timecreated -pid -taskname]
+            incr n [llength [dict get $cols -timecreated]]
+        }
+        return $n
+    }
+
+    set nevents [format_all $etl $formatter]
+    if {[format_all $etl $formatter -lazy 1] != $nevents ||
+        [columns_lazy $etl] != $nevents} {
+        puts stderr "FAILED: event counts differ"
+        exit 1
+    }
+    puts "$nevents events in $path"
+    puts [format "%-40s %15s %15s %9s" "operation" "eager" "lazy" "speedup"]
+
+    perf::compare "format all fields" \
+        [perf::measure {format_all $etl $formatter} $iters] \
+        [perf::measure {format_all $etl $formatter -lazy 1} $iters]
+    perf::compare "-timecreated -pid -taskname" \
+        [perf::measure {columns_eager $etl $formatter} $iters] \
+        [perf::measure {columns_lazy $etl} $iters]
+
+    twapi::etw_close_etl $etl
+    twapi::etw_close_formatter $formatter
+    if {[info exists htrace]} {
+        file delete $path
+    }
+}
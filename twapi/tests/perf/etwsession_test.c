@@ -0,0 +1,637 @@
+/*
+ * Copyright (c) 2018, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ */
+
+/*
+ * Checks consumer sessions running concurrently on their own threads.
+ * Each session is fed by a stub source that replays a table of fixture
+ * events, split into buffers, in place of ProcessTrace. The main thread
+ * consumes the queued batches of every session, only when notified, and
+ * compares them with its fixtures, including the schemas resolved on
+ * the session thread by a stub TdhGetEventInformation, which also checks
+ * it is never called on the main thread. Stopping a session from the
+ * consumer and while its source would go on forever, as for real time
+ * traces, is checked as well, as are the session counters with a slow
+ * consumer and each overflow policy of a bounded queue, using the stub
+ * source as a producer that outpaces the consumer.
+ * Finally times one session against several running at once, with the
+ * stub spinning for -tdhcost microseconds per lookup. Does not need Tcl
+ * or Windows. Build and run from this directory, e.g.
+ *
+ *   cc -O2 -DETW_STANDALONE -I../../etw -I../../include -o etwsession_test \
+ *       etwsession_test.c ../../etw/etwsession.c ../../etw/etwbatch.c \
+ *       ../../etw/tdhcache.c -lpthread
+ *   ./etwsession_test ?-sessions N? ?-events N? ?-tdhcost USECS?
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef _WIN32
+# include <windows.h>
+#else
+# include <pthread.h>
+# include <sched.h>
+#endif
+
+#include "etwsession.h"
+
+#define CHECK(cond_)                                                    \
+    do {                                                                \
+        if (!(cond_)) {                                                 \
+            fprintf(stderr, "Check failed at line %d: %s\n", __LINE__, #cond_); \
+            abort();                                                    \
+        }                                                               \
+    } while (0)
+
+#define MAX_SESSIONS 64
+#define EVENTS_PER_BUFFER 300
+#define NPROVIDERS 6            /* Last one has no schema */
+#define NIDS 8
+#define NOT_DONE 0xffffffff     /* TestSession.winerr until done */
+#define ALL_BUFFERS 0xffffffff
+
+static double now_usecs(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+#ifdef _WIN32
+typedef CRITICAL_SECTION Lock;
+# define LockInit(l_) InitializeCriticalSection(l_)
+# define LockEnter(l_) EnterCriticalSection(l_)
+# define LockLeave(l_) LeaveCriticalSection(l_)
+static DWORD main_thread;
+# define ON_MAIN_THREAD() (GetCurrentThreadId() == main_thread)
+# define SET_MAIN_THREAD() (main_thread = GetCurrentThreadId())
+# define YIELD() Sleep(0)
+#else
+typedef pthread_mutex_t Lock;
+# define LockInit(l_) pthread_mutex_init((l_), NULL)
+# define LockEnter(l_) pthread_mutex_lock(l_)
+# define LockLeave(l_) pthread_mutex_unlock(l_)
+static pthread_t main_thread;
+# define ON_MAIN_THREAD() pthread_equal(pthread_self(), main_thread)
+# define SET_MAIN_THREAD() (main_thread = pthread_self())
+# define YIELD() sched_yield()
+#endif
+
+static double tdhcost;          /* Microseconds spent per stub TDH call */
+
+/*
+ * Schemas served by the stub. Sizes differ so the copies kept by
+ * batches are checked for length.
+ */
+static ULONG __stdcall stub_TdhGetEventInformation(EVENT_RECORD *evrP, ULONG nctx, TDH_CONTEXT *ctxP, TRACE_EVENT_INFO *teiP, ULONG *sizeP)
+{
+    ULONG provider = evrP->EventHeader.ProviderId.Data1 - 0x1000;
+    ULONG size = sizeof(TRACE_EVENT_INFO) + 8 * provider;
+    double start = now_usecs();
+
+    CHECK(! ON_MAIN_THREAD());
+    CHECK(nctx == 1 && ctxP->ParameterType == TDH_CONTEXT_POINTERSIZE);
+    while (now_usecs() - start < tdhcost)
+        ;
+    if (provider == NPROVIDERS - 1)
+        return ERROR_NOT_FOUND;
+    if (*sizeP < size) {
+        *sizeP = size;
+        return ERROR_INSUFFICIENT_BUFFER;
+    }
+    memset(teiP, (int) provider, size);
+    teiP->ProviderGuid = evrP->EventHeader.ProviderId;
+    teiP->EventDescriptor = evrP->EventHeader.EventDescriptor;
+    teiP->DecodingSource = DecodingSourceXMLFile;
+    teiP->PropertyCount = 0;
+    teiP->TopLevelPropertyCount = 0;
+    *sizeP = size;
+    return ERROR_SUCCESS;
+}
+
+typedef struct {
+    EVENT_RECORD evr;
+    EVENT_HEADER_EXTENDED_DATA_ITEM item;
+    BYTE user[64];
+} Fixture;
+
+/*
+ * Event seq of session s. Every 50th event carries a TraceLogging schema
+ * so cannot be cached and is left for the consumer to resolve.
+ */
+static void fixture_event(Fixture *fP, ULONG s, ULONG seq)
+{
+    ULONG j;
+
+    memset(fP, 0, sizeof(*fP));
+    fP->evr.EventHeader.Size = sizeof(EVENT_HEADER);
+    fP->evr.EventHeader.Flags = EVENT_HEADER_FLAG_64_BIT_HEADER;
+    fP->evr.EventHeader.ProcessId = s;
+    fP->evr.EventHeader.ThreadId = seq;
+    fP->evr.EventHeader.TimeStamp.QuadPart = 131000000000000000LL + seq;
+    fP->evr.EventHeader.ProviderId.Data1 = 0x1000 + (seq + s) % NPROVIDERS;
+    fP->evr.EventHeader.EventDescriptor.Id = (USHORT) ((seq / 7) % NIDS);
+    if (seq % 50 == 0) {
+        fP->evr.ExtendedDataCount = 1;
+        fP->evr.ExtendedData = &fP->item;
+        fP->item.ExtType = EVENT_HEADER_EXT_TYPE_EVENT_SCHEMA_TL;
+        fP->item.DataSize = 8;
+        fP->item.DataPtr = (ULONGLONG) (size_t) fP->user;
+    }
+    fP->evr.UserDataLength = (USHORT) (seq % 64);
+    fP->evr.UserData = fP->user;
+    for (j = 0; j < sizeof(fP->user); ++j)
+        fP->user[j] = (BYTE) (s + seq + j);
+}
+
+typedef struct {
+    ULONG index;
+    ULONG nevents;              /* Replayed by the source */
+    int endless;                /* Replay until stopped, like real time */
+    ULONG stop_after;           /* Consumer stops after this many buffers */
+    ULONG consume_cost;         /* Microseconds consumer spends per buffer */
+    TwapiEtwSession *sessionP;
+    Lock lock;                  /* Protects notified and final */
+    int notified;
+    int final;
+    /* Following are only accessed by the consumer */
+    TwapiEtwBatch **batches;
+    ULONG *buffer_ids;          /* bufferP of each batch */
+    ULONG nbatches;
+    ULONG max_batches;
+    ULONG winerr;
+} TestSession;
+
+static Lock discard_lock;
+static ULONG ndiscarded;        /* Buffers discarded by all sessions */
+
+static ULONG stub_source(TwapiEtwSession *sessionP, void *pv)
+{
+    TestSession *tsP = pv;
+    Fixture f;
+    ULONG seq, nbuffers = 0;
+    ULONG winerr;
+
+    for (seq = 0; tsP->endless || seq < tsP->nevents; ++seq) {
+        fixture_event(&f, tsP->index, seq);
+        winerr = TwapiEtwSessionEvent(sessionP, &f.evr, 8);
+        if (winerr != ERROR_SUCCESS)
+            return winerr;
+        /* The source buffer is reused so batches must not point into it */
+        memset(&f, 0xee, sizeof(f));
+        if ((seq + 1) % EVENTS_PER_BUFFER == 0 || seq + 1 == tsP->nevents) {
+            ++nbuffers;
+            if (! TwapiEtwSessionBufferDone(sessionP, 15625, 0,
+                                            (void *) (size_t) nbuffers))
+                return 1223;    /* ERROR_CANCELLED as from ProcessTrace */
+        }
+    }
+    return ERROR_SUCCESS;
+}
+
+static void notify_consumer(void *pv, int final)
+{
+    TestSession *tsP = pv;
+
+    CHECK(! ON_MAIN_THREAD());
+    LockEnter(&tsP->lock);
+    CHECK(! tsP->final);
+    tsP->notified = 1;
+    tsP->final = final;
+    LockLeave(&tsP->lock);
+}
+
+static void discard_buffer(void *bufferP)
+{
+    CHECK(bufferP != NULL);
+    LockEnter(&discard_lock);
+    ndiscarded += 1;
+    LockLeave(&discard_lock);
+}
+
+/*
+ * Takes buffers off the queue until the session is done or max buffers
+ * have been taken. Only looks at the queue when notified, so hangs if
+ * the session misses a notification.
+ */
+static void consume(TestSession *tsP, ULONG max)
+{
+    TwapiEtwBatch *batchP;
+    void *bufferP;
+    ULONGLONG start;
+    int notified, status;
+
+    while (tsP->winerr == NOT_DONE && tsP->nbatches < max) {
+        LockEnter(&tsP->lock);
+        notified = tsP->notified;
+        tsP->notified = 0;
+        LockLeave(&tsP->lock);
+        if (! notified) {
+            YIELD();
+            continue;
+        }
+        while ((status = TwapiEtwSessionNext(tsP->sessionP, &batchP, &bufferP,
+                                             &tsP->winerr)) == 1) {
+            CHECK(bufferP != NULL);
+            if (tsP->nbatches == tsP->max_batches) {
+                tsP->max_batches = tsP->max_batches ? 2 * tsP->max_batches : 16;
+                tsP->batches = realloc(tsP->batches, tsP->max_batches * sizeof(*tsP->batches));
+                tsP->buffer_ids = realloc(tsP->buffer_ids, tsP->max_batches * sizeof(*tsP->buffer_ids));
+                CHECK(tsP->batches != NULL && tsP->buffer_ids != NULL);
+            }
+            tsP->batches[tsP->nbatches] = batchP;
+            tsP->buffer_ids[tsP->nbatches] = (ULONG) (size_t) bufferP;
+            tsP->nbatches += 1;
+            start = TwapiEtwSessionClock();
+            while (TwapiEtwSessionClock() - start < tsP->consume_cost)
+                ;
+            TwapiEtwSessionConsumed(tsP->sessionP, TwapiEtwBatchCount(batchP),
+                                    TwapiEtwSessionClock() - start, 0);
+            if (tsP->stop_after && tsP->nbatches == tsP->stop_after)
+                TwapiEtwSessionStop(tsP->sessionP);
+            if (tsP->nbatches == max)
+                break;
+        }
+        if (status == 1) {
+            /* Not idle so no notification will come for the rest */
+            LockEnter(&tsP->lock);
+            tsP->notified = 1;
+            LockLeave(&tsP->lock);
+        } else if (status < 0) {
+            CHECK(tsP->winerr != NOT_DONE);
+            /* Stays done */
+            CHECK(TwapiEtwSessionNext(tsP->sessionP, &batchP, &bufferP, &tsP->winerr) == -1);
+        }
+    }
+}
+
+/* queueP, if not NULL, supplies the queue bound and overflow policy */
+static void start_session(TestSession *tsP, ULONG index, ULONG nevents,
+                          int endless, ULONG stop_after,
+                          const TwapiEtwSessionConfig *queueP)
+{
+    TwapiEtwSessionConfig config;
+
+    memset(tsP, 0, sizeof(*tsP));
+    tsP->index = index;
+    tsP->nevents = nevents;
+    tsP->endless = endless;
+    tsP->stop_after = stop_after;
+    tsP->winerr = NOT_DONE;
+    LockInit(&tsP->lock);
+    memset(&config, 0, sizeof(config));
+    config.sourceFn = stub_source;
+    config.sourceP = tsP;
+    config.notifyFn = notify_consumer;
+    config.notifyP = tsP;
+    config.discardFn = discard_buffer;
+    config.getFn = stub_TdhGetEventInformation;
+    config.schema_cache_size = 256;
+    if (queueP) {
+        config.max_queue_depth = queueP->max_queue_depth;
+        config.overflow = queueP->overflow;
+        config.sample_interval = queueP->sample_interval;
+    }
+    CHECK(TwapiEtwSessionStart(&config, &tsP->sessionP) == ERROR_SUCCESS);
+}
+
+static void finish_session(TestSession *tsP)
+{
+    ULONG i;
+
+    TwapiEtwSessionWait(tsP->sessionP);
+    CHECK(tsP->final);
+    TwapiEtwSessionRelease(tsP->sessionP);
+    for (i = 0; i < tsP->nbatches; ++i)
+        TwapiEtwBatchRelease(tsP->batches[i]);
+    free(tsP->batches);
+    free(tsP->buffer_ids);
+}
+
+/*
+ * Compares the batches taken with the fixtures. Buffers may have been
+ * dropped but those taken must be in order. Returns events seen.
+ */
+static ULONG verify_session(TestSession *tsP)
+{
+    EVENT_RECORD evr;
+    Fixture f;
+    const TwapiTdhSchema *schemaP;
+    TwapiEtwSessionStats stats;
+    ULONG b, i, n, seq, seen = 0;
+    int si;
+
+    for (b = 0; b < tsP->nbatches; ++b) {
+        TwapiEtwBatch *batchP = tsP->batches[b];
+        CHECK(b == 0 || tsP->buffer_ids[b] > tsP->buffer_ids[b-1]);
+        seq = (tsP->buffer_ids[b] - 1) * EVENTS_PER_BUFFER;
+        n = TwapiEtwBatchCount(batchP);
+        CHECK(n == EVENTS_PER_BUFFER || (!tsP->endless && seq + n == tsP->nevents));
+        CHECK(TwapiEtwBatchTimerResolution(batchP) == 15625);
+        for (i = 0; i < n; ++i, ++seq) {
+            fixture_event(&f, tsP->index, seq);
+            TwapiEtwBatchGet(batchP, i, &evr, NULL);
+            CHECK(memcmp(&evr.EventHeader, &f.evr.EventHeader, sizeof(EVENT_HEADER)) == 0);
+            CHECK(evr.UserDataLength == f.evr.UserDataLength);
+            CHECK(evr.UserDataLength == 0 ||
+                  memcmp(evr.UserData, f.user, evr.UserDataLength) == 0);
+            si = TwapiEtwBatchEventSchema(batchP, i);
+            if (f.evr.ExtendedDataCount) {
+                CHECK(si == -1);
+                continue;
+            }
+            CHECK(si >= 0 && (ULONG) si < TwapiEtwBatchSchemaCount(batchP));
+            schemaP = TwapiEtwBatchGetSchema(batchP, si);
+            CHECK(schemaP->clientP == NULL);
+            if (f.evr.EventHeader.ProviderId.Data1 == 0x1000 + NPROVIDERS - 1) {
+                CHECK(schemaP->status == ERROR_NOT_FOUND && schemaP->teiP == NULL);
+            } else {
+                CHECK(schemaP->status == ERROR_SUCCESS);
+                CHECK(schemaP->tei_size == sizeof(TRACE_EVENT_INFO) + 8 * (f.evr.EventHeader.ProviderId.Data1 - 0x1000));
+                CHECK(memcmp(&schemaP->teiP->ProviderGuid, &f.evr.EventHeader.ProviderId, sizeof(GUID)) == 0);
+                CHECK(schemaP->teiP->EventDescriptor.Id == f.evr.EventHeader.EventDescriptor.Id);
+            }
+        }
+        seen += n;
+        /* Each distinct schema is copied once per batch */
+        CHECK(TwapiEtwBatchSchemaCount(batchP) <= NPROVIDERS * NIDS);
+    }
+
+    TwapiEtwSessionGetStats(tsP->sessionP, &stats);
+    CHECK(stats.events == seen + stats.dropped_events);
+    CHECK(stats.buffers == tsP->nbatches + stats.dropped_buffers);
+    CHECK(stats.queue_depth == 0);
+    /* Schemas are cached per session so each key is looked up once, and
+       those larger than the initial buffer twice */
+    CHECK(stats.tdh_calls >= NPROVIDERS * NIDS && stats.tdh_calls <= 2 * NPROVIDERS * NIDS);
+    return seen;
+}
+
+static void check_sessions(ULONG nsessions, ULONG nevents)
+{
+    TestSession *sessions;
+    TwapiEtwSessionStats stats;
+    ULONG i;
+
+    sessions = calloc(nsessions, sizeof(*sessions));
+    CHECK(sessions != NULL);
+    for (i = 0; i < nsessions; ++i)
+        start_session(&sessions[i], i, nevents + 37 * i, 0, 0, NULL);
+    for (i = 0; i < nsessions; ++i) {
+        consume(&sessions[i], ALL_BUFFERS);
+        TwapiEtwSessionWait(sessions[i].sessionP);
+        CHECK(sessions[i].winerr == ERROR_SUCCESS);
+        CHECK(verify_session(&sessions[i]) == nevents + 37 * i);
+        TwapiEtwSessionGetStats(sessions[i].sessionP, &stats);
+        CHECK(stats.dropped_buffers == 0 && stats.blocked_time == 0);
+        finish_session(&sessions[i]);
+    }
+    free(sessions);
+}
+
+static void check_stop(void)
+{
+    TestSession ts;
+    TwapiEtwSessionStats stats;
+    ULONG discarded;
+
+    /* Stopped by the consumer. Buffers queued after are discarded */
+    LockEnter(&discard_lock);
+    discarded = ndiscarded;
+    LockLeave(&discard_lock);
+    start_session(&ts, 1, 100 * EVENTS_PER_BUFFER, 0, 3, NULL);
+    consume(&ts, ALL_BUFFERS);
+    TwapiEtwSessionWait(ts.sessionP);
+    CHECK(ts.winerr == 1223 && ts.nbatches == 3);
+    verify_session(&ts);
+    TwapiEtwSessionGetStats(ts.sessionP, &stats);
+    LockEnter(&discard_lock);
+    CHECK(ndiscarded - discarded == stats.dropped_buffers);
+    LockLeave(&discard_lock);
+    finish_session(&ts);
+
+    /* Stopped from the main thread while the source would go on forever */
+    start_session(&ts, 2, 0, 1, 0, NULL);
+    consume(&ts, 5);
+    CHECK(ts.nbatches == 5);
+    CHECK(! TwapiEtwSessionStopping(ts.sessionP));
+    TwapiEtwSessionStop(ts.sessionP);
+    CHECK(TwapiEtwSessionStopping(ts.sessionP));
+    consume(&ts, ALL_BUFFERS);
+    TwapiEtwSessionWait(ts.sessionP);
+    CHECK(ts.winerr == 1223 && ts.nbatches >= 5);
+    verify_session(&ts);
+    finish_session(&ts);
+
+    /* Released before the thread finishes, with buffers still queued */
+    LockEnter(&discard_lock);
+    discarded = ndiscarded;
+    LockLeave(&discard_lock);
+    start_session(&ts, 3, 10 * EVENTS_PER_BUFFER, 0, 0, NULL);
+    TwapiEtwSessionRetain(ts.sessionP);
+    TwapiEtwSessionRelease(ts.sessionP);
+    finish_session(&ts);
+    LockEnter(&discard_lock);
+    CHECK(ndiscarded - discarded == 10);
+    LockLeave(&discard_lock);
+}
+
+/* The consumer is slower than the session thread */
+static void check_stats(void)
+{
+    TestSession ts;
+    TwapiEtwSessionStats stats;
+    ULONGLONG bytes = 0;
+    ULONG i;
+
+    start_session(&ts, 4, 20 * EVENTS_PER_BUFFER + 11, 0, 0, NULL);
+    ts.consume_cost = 200;
+    consume(&ts, ALL_BUFFERS);
+    TwapiEtwSessionWait(ts.sessionP);
+    CHECK(ts.winerr == ERROR_SUCCESS && ts.nbatches == 21);
+    verify_session(&ts);
+    for (i = 0; i < ts.nbatches; ++i)
+        bytes += TwapiEtwBatchSize(ts.batches[i]);
+
+    TwapiEtwSessionGetStats(ts.sessionP, &stats);
+    CHECK(stats.events == 20 * EVENTS_PER_BUFFER + 11 && stats.buffers == 21);
+    CHECK(stats.bytes == bytes);
+    CHECK(stats.max_queue_depth >= 1 && stats.max_queue_depth <= 21);
+    CHECK(stats.callback_time >= 21 * 200);
+    CHECK(stats.dropped_buffers == 0 && stats.dropped_events == 0);
+    CHECK(stats.events_lost == 0 && stats.buffers_lost == 0);
+    TwapiEtwSessionLost(ts.sessionP, 7, 2);
+    TwapiEtwSessionConsumed(ts.sessionP, 5, 0, 1);
+    TwapiEtwSessionGetStats(ts.sessionP, &stats);
+    CHECK(stats.events_lost == 7 && stats.buffers_lost == 2);
+    CHECK(stats.dropped_buffers == 1 && stats.dropped_events == 5);
+    finish_session(&ts);
+}
+
+/*
+ * Runs a session of nbuffers buffers through a queue of depth buffers.
+ * For the dropping policies the consumer waits for the source to finish
+ * so the queue overflows from the start. The buffers taken are checked
+ * against a model of the queue.
+ */
+static void check_overflow(TwapiEtwSessionOverflow overflow,
+                           ULONG sample_interval)
+{
+    enum { nbuffers = 40, depth = 4 };
+    TestSession ts;
+    TwapiEtwSessionConfig queue;
+    TwapiEtwSessionStats stats;
+    ULONG model[nbuffers], nmodel = 0, overflows = 0;
+    ULONG id, i, discarded;
+    ULONGLONG start;
+
+    for (id = 1; id <= nbuffers; ++id) {
+        if (overflow == TWAPI_ETW_OVERFLOW_BLOCK || nmodel < depth) {
+            model[nmodel++] = id;
+            continue;
+        }
+        if (overflow == TWAPI_ETW_OVERFLOW_DROP_NEWEST ||
+            (overflow == TWAPI_ETW_OVERFLOW_SAMPLE &&
+             ++overflows % sample_interval))
+            continue;
+        memmove(model, model + 1, (depth - 1) * sizeof(model[0]));
+        model[depth - 1] = id;
+    }
+
+    memset(&queue, 0, sizeof(queue));
+    queue.max_queue_depth = depth;
+    queue.overflow = overflow;
+    queue.sample_interval = sample_interval;
+    LockEnter(&discard_lock);
+    discarded = ndiscarded;
+    LockLeave(&discard_lock);
+    start_session(&ts, 5, nbuffers * EVENTS_PER_BUFFER, 0, 0, &queue);
+    if (overflow == TWAPI_ETW_OVERFLOW_BLOCK) {
+        /* Once the buffer after a full queue is counted the source is
+           waiting, so give it time to have waited */
+        do {
+            YIELD();
+            TwapiEtwSessionGetStats(ts.sessionP, &stats);
+        } while (stats.buffers <= depth);
+        start = TwapiEtwSessionClock();
+        while (TwapiEtwSessionClock() - start < 1000)
+            ;
+        ts.consume_cost = 100;
+    } else
+        TwapiEtwSessionWait(ts.sessionP);
+    consume(&ts, ALL_BUFFERS);
+    TwapiEtwSessionWait(ts.sessionP);
+    CHECK(ts.winerr == ERROR_SUCCESS);
+    verify_session(&ts);
+
+    CHECK(ts.nbatches == nmodel);
+    for (i = 0; i < nmodel; ++i)
+        CHECK(ts.buffer_ids[i] == model[i]);
+    TwapiEtwSessionGetStats(ts.sessionP, &stats);
+    CHECK(stats.buffers == nbuffers);
+    CHECK(stats.dropped_buffers == nbuffers - nmodel);
+    CHECK(stats.max_queue_depth <= depth);
+    if (overflow == TWAPI_ETW_OVERFLOW_BLOCK)
+        CHECK(stats.blocked_time > 0);
+    else
+        CHECK(stats.max_queue_depth == depth && stats.blocked_time == 0);
+    LockEnter(&discard_lock);
+    CHECK(ndiscarded - discarded == nbuffers - nmodel);
+    LockLeave(&discard_lock);
+    finish_session(&ts);
+}
+
+/* A source blocked on a full queue is woken by a stop */
+static void check_overflow_stop(void)
+{
+    TestSession ts;
+    TwapiEtwSessionConfig queue;
+    TwapiEtwSessionStats stats;
+
+    memset(&queue, 0, sizeof(queue));
+    queue.max_queue_depth = 2;
+    queue.overflow = TWAPI_ETW_OVERFLOW_BLOCK;
+    start_session(&ts, 6, 0, 1, 0, &queue);
+    do {
+        YIELD();
+        TwapiEtwSessionGetStats(ts.sessionP, &stats);
+    } while (stats.buffers < 3);
+    TwapiEtwSessionStop(ts.sessionP);
+    TwapiEtwSessionWait(ts.sessionP);
+    consume(&ts, ALL_BUFFERS);
+    CHECK(ts.winerr == 1223 && ts.nbatches == 0);
+    TwapiEtwSessionGetStats(ts.sessionP, &stats);
+    CHECK(stats.buffers == 3 && stats.dropped_buffers == 3);
+    CHECK(stats.queue_depth == 0 && stats.max_queue_depth == 2);
+    finish_session(&ts);
+}
+
+static double time_sessions(ULONG nsessions, ULONG nevents)
+{
+    TestSession *sessions;
+    double start, usecs;
+    ULONG i;
+
+    sessions = calloc(nsessions, sizeof(*sessions));
+    CHECK(sessions != NULL);
+    start = now_usecs();
+    for (i = 0; i < nsessions; ++i)
+        start_session(&sessions[i], i, nevents, 0, 0, NULL);
+    for (i = 0; i < nsessions; ++i)
+        consume(&sessions[i], ALL_BUFFERS);
+    usecs = now_usecs() - start;
+    for (i = 0; i < nsessions; ++i) {
+        CHECK(sessions[i].winerr == ERROR_SUCCESS);
+        finish_session(&sessions[i]);
+    }
+    free(sessions);
+    return usecs;
+}
+
+int main(int argc, char *argv[])
+{
+    ULONG nsessions = 8, nevents = 200000;
+    double one, all;
+    int i;
+
+    for (i = 1; i < argc - 1; i += 2) {
+        if (strcmp(argv[i], "-sessions") == 0)
+            nsessions = strtoul(argv[i+1], NULL, 10);
+        else if (strcmp(argv[i], "-events") == 0)
+            nevents = strtoul(argv[i+1], NULL, 10);
+        else if (strcmp(argv[i], "-tdhcost") == 0)
+            tdhcost = atof(argv[i+1]);
+    }
+    if (nsessions == 0 || nsessions > MAX_SESSIONS) {
+        fprintf(stderr, "Number of sessions must be between 1 and %d\n", MAX_SESSIONS);
+        return 1;
+    }
+    SET_MAIN_THREAD();
+    LockInit(&discard_lock);
+
+    check_sessions(1, 1000);
+    check_sessions(nsessions, 5000);
+    check_stop();
+    check_stats();
+    check_overflow(TWAPI_ETW_OVERFLOW_BLOCK, 0);
+    check_overflow(TWAPI_ETW_OVERFLOW_DROP_OLDEST, 0);
+    check_overflow(TWAPI_ETW_OVERFLOW_DROP_NEWEST, 0);
+    check_overflow(TWAPI_ETW_OVERFLOW_SAMPLE, 5);
+    check_overflow(TWAPI_ETW_OVERFLOW_SAMPLE, 1);
+    check_overflow_stop();
+    printf("Checks passed\n");
+
+    one = time_sessions(1, nevents);
+    all = time_sessions(nsessions, nevents);
+    printf("%lu events per session, %lu per buffer\n",
+           (unsigned long) nevents, (unsigned long) EVENTS_PER_BUFFER);
+    printf("%-24s %14s\n", "sessions", "events/sec");
+    printf("%-24d %14.0f\n", 1, nevents * 1e6 / one);
+    printf("%-24lu %14.0f\n", (unsigned long) nsessions, nsessions * (double) nevents * 1e6 / all);
+    return 0;
+}
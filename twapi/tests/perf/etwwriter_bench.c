@@ -0,0 +1,487 @@
+/*
+ * Copyright (c) 2018, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ */
+
+/*
+ * Checks the CSV and JSON Lines event writer used by etw_dump_to_file
+ * and measures the rows written per second for different output buffer
+ * sizes. Rows are made from the headers of synthesized events, along
+ * with the kind of names and message TDH would supply, unless a recorded
+ * log file is given with -etl, in which case its events are read with
+ * the .etl parser and only header fields are written since names need
+ * TDH. Output goes to a sink that only counts bytes unless -out is
+ * given. Does not need Tcl or Windows. Build and run from this
+ * directory, e.g.
+ *
+ *   cc -O2 -DETW_STANDALONE -I../../etw -o etwwriter_bench \
+ *       etwwriter_bench.c ../../etw/etwwriter.c ../../etw/etlfile.c
+ *   ./etwwriter_bench ?-events N? ?-etl PATH? ?-out PATH?
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "etwwriter.h"
+#include "etlfile.h"
+
+#define CHECK(cond_)                                                    \
+    do {                                                                \
+        if (!(cond_)) {                                                 \
+            fprintf(stderr, "Check failed at line %d: %s\n", __LINE__, #cond_); \
+            abort();                                                    \
+        }                                                               \
+    } while (0)
+
+static double now_usecs(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* Collects output in memory for the checks */
+typedef struct {
+    char buf[4096];
+    size_t len;
+    int flushes;
+    int fail_after;             /* Fail flushes after this many, if > 0 */
+} MemSink;
+
+static ULONG mem_flush(void *pv, const char *bytesP, size_t len)
+{
+    MemSink *sinkP = pv;
+    if (sinkP->fail_after > 0 && sinkP->flushes >= sinkP->fail_after)
+        return 29;              /* ERROR_WRITE_FAULT */
+    CHECK(sinkP->len + len < sizeof(sinkP->buf));
+    memcpy(sinkP->buf + sinkP->len, bytesP, len);
+    sinkP->len += len;
+    sinkP->buf[sinkP->len] = 0;
+    sinkP->flushes += 1;
+    return ERROR_SUCCESS;
+}
+
+static ULONG count_flush(void *pv, const char *bytesP, size_t len)
+{
+    ULONGLONG *countP = pv;
+    *countP += len;
+    (void) bytesP;
+    return ERROR_SUCCESS;
+}
+
+static ULONG file_flush(void *pv, const char *bytesP, size_t len)
+{
+    return fwrite(bytesP, 1, len, (FILE *) pv) == len ? ERROR_SUCCESS : 29;
+}
+
+#define S(s_) s_, sizeof(s_) - 1
+
+static void check_csv(void)
+{
+    static const char *names[] = {"-pid", "-message", "sep,name"};
+    TwapiEtwWriter *writerP;
+    MemSink sink;
+
+    memset(&sink, 0, sizeof(sink));
+    writerP = TwapiEtwWriterNew(TWAPI_ETW_WRITER_CSV, ',', 3, names, 0, mem_flush, &sink);
+    CHECK(writerP != NULL);
+    CHECK(TwapiEtwWriterHeader(writerP) == ERROR_SUCCESS);
+    CHECK(TwapiEtwWriterInteger(writerP, -42) == ERROR_SUCCESS);
+    CHECK(TwapiEtwWriterString(writerP, S("plain text")) == ERROR_SUCCESS);
+    CHECK(TwapiEtwWriterString(writerP, S("a,b")) == ERROR_SUCCESS);
+    /* Too many fields */
+    CHECK(TwapiEtwWriterString(writerP, S("x")) == ERROR_INVALID_PARAMETER);
+    CHECK(TwapiEtwWriterEndRow(writerP) == ERROR_SUCCESS);
+    CHECK(TwapiEtwWriterUnsigned(writerP, 18446744073709551615ULL) == ERROR_SUCCESS);
+    CHECK(TwapiEtwWriterString(writerP, S("say \"hi\"")) == ERROR_SUCCESS);
+    CHECK(TwapiEtwWriterString(writerP, S("two\nlines")) == ERROR_SUCCESS);
+    CHECK(TwapiEtwWriterEndRow(writerP) == ERROR_SUCCESS);
+    /* Short rows are allowed */
+    CHECK(TwapiEtwWriterEndRow(writerP) == ERROR_SUCCESS);
+    CHECK(sink.len == 0);       /* Nothing flushed yet */
+    CHECK(TwapiEtwWriterPairs(writerP, 0, NULL, NULL) == ERROR_INVALID_PARAMETER);
+    CHECK(TwapiEtwWriterFlush(writerP) == ERROR_SUCCESS);
+    CHECK(TwapiEtwWriterRows(writerP) == 3);
+    CHECK(strcmp(sink.buf,
+                 "-pid,-message,\"sep,name\"\n"
+                 "-42,plain text,\"a,b\"\n"
+                 "18446744073709551615,\"say \"\"hi\"\"\",\"two\nlines\"\n"
+                 "\n") == 0);
+    TwapiEtwWriterFree(writerP);
+
+    /* Other separators */
+    memset(&sink, 0, sizeof(sink));
+    writerP = TwapiEtwWriterNew(TWAPI_ETW_WRITER_CSV, '\t', 2, names, 0, mem_flush, &sink);
+    CHECK(TwapiEtwWriterString(writerP, S("a,b")) == ERROR_SUCCESS);
+    CHECK(TwapiEtwWriterString(writerP, S("c\td")) == ERROR_SUCCESS);
+    CHECK(TwapiEtwWriterEndRow(writerP) == ERROR_SUCCESS);
+    CHECK(TwapiEtwWriterFlush(writerP) == ERROR_SUCCESS);
+    CHECK(strcmp(sink.buf, "a,b\t\"c\td\"\n") == 0);
+    TwapiEtwWriterFree(writerP);
+}
+
+static void check_jsonl(void)
+{
+    static const char *names[] = {"-pid", "-message", "-properties", "odd\"name"};
+    static const char *pairs[] = {"FileName", "C:\\x.txt", "Size", "10, 20"};
+    size_t pair_lens[4];
+    TwapiEtwWriter *writerP;
+    MemSink sink;
+    int i;
+
+    for (i = 0; i < 4; ++i)
+        pair_lens[i] = strlen(pairs[i]);
+    memset(&sink, 0, sizeof(sink));
+    writerP = TwapiEtwWriterNew(TWAPI_ETW_WRITER_JSONL, ',', 4, names, 0, mem_flush, &sink);
+    CHECK(writerP != NULL);
+    CHECK(TwapiEtwWriterHeader(writerP) == ERROR_SUCCESS);
+    CHECK(TwapiEtwWriterInteger(writerP, 1234) == ERROR_SUCCESS);
+    /* Tcl's internal encoding of the null character is C0 80 */
+    CHECK(TwapiEtwWriterString(writerP, S("q\"b\\\x01\t\xC0\x80\xC3\xA9")) == ERROR_SUCCESS);
+    CHECK(TwapiEtwWriterPairs(writerP, 2, pairs, pair_lens) == ERROR_SUCCESS);
+    CHECK(TwapiEtwWriterString(writerP, S("")) == ERROR_SUCCESS);
+    CHECK(TwapiEtwWriterEndRow(writerP) == ERROR_SUCCESS);
+    CHECK(TwapiEtwWriterEndRow(writerP) == ERROR_SUCCESS);
+    CHECK(TwapiEtwWriterFlush(writerP) == ERROR_SUCCESS);
+    CHECK(strcmp(sink.buf,
+                 "{\"pid\":1234,\"message\":\"q\\\"b\\\\\\u0001\\t\\u0000\xC3\xA9\","
+                 "\"properties\":{\"FileName\":\"C:\\\\x.txt\",\"Size\":\"10, 20\"},"
+                 "\"odd\\\"name\":\"\"}\n"
+                 "{}\n") == 0);
+    TwapiEtwWriterFree(writerP);
+}
+
+/* Expands fmt and returns the CSV field written for it */
+static const char *expand(const char *fmt, int nparams, const char **params)
+{
+    static const char *names[] = {"-message"};
+    static MemSink sink;
+    size_t lens[8];
+    TwapiEtwWriter *writerP;
+    int i;
+
+    for (i = 0; i < nparams; ++i)
+        lens[i] = strlen(params[i]);
+    memset(&sink, 0, sizeof(sink));
+    /* No separator in the messages so the field is never quoted */
+    writerP = TwapiEtwWriterNew(TWAPI_ETW_WRITER_CSV, '|', 1, names, 0, mem_flush, &sink);
+    CHECK(TwapiEtwWriterMessage(writerP, fmt, strlen(fmt), nparams, params, lens) == ERROR_SUCCESS);
+    CHECK(TwapiEtwWriterFlush(writerP) == ERROR_SUCCESS);
+    TwapiEtwWriterFree(writerP);
+    return sink.buf;
+}
+
+/* Expected results are those of format_message -fmtstring in base.tcl */
+static void check_message(void)
+{
+    static const char *params[] = {"one", "two", "three", "four"};
+
+    CHECK(strcmp(expand("", 0, NULL), "") == 0);
+    CHECK(strcmp(expand("no inserts", 4, params), "no inserts") == 0);
+    CHECK(strcmp(expand("%1 and %2", 4, params), "one and two") == 0);
+    CHECK(strcmp(expand("%2%1%3", 4, params), "twoonethree") == 0);
+    CHECK(strcmp(expand("100%% %x%0", 4, params), "100% x") == 0);
+    CHECK(strcmp(expand("trailing %", 4, params), "trailing %") == 0);
+    CHECK(strcmp(expand("missing %9.", 4, params), "missing .") == 0);
+    CHECK(strcmp(expand("%12", 4, params), "") == 0);
+    CHECK(strcmp(expand("%1!s! %2!d!", 4, params), "one two") == 0);
+    /* Each * in a type shifts only the insert it is in */
+    CHECK(strcmp(expand("%1!*s! %2!s! %3", 4, params), "two two three") == 0);
+    CHECK(strcmp(expand("%1!*d! %2", 4, params), "two two") == 0);
+    CHECK(strcmp(expand("%1!*.*s! %4 %2!*s!", 4, params), "three four three") == 0);
+    CHECK(strcmp(expand("%1!!", 4, params), "one!!") == 0);
+    CHECK(strcmp(expand("%1!s", 4, params), "one!s") == 0);
+    CHECK(strcmp(expand("a%tb", 4, params), "a\tb") == 0);
+}
+
+/* Output must not depend on the buffer size, and flush errors must surface */
+static void check_buffering(void)
+{
+    static const char *names[] = {"-a", "-b"};
+    char expected[sizeof(((MemSink *)0)->buf)];
+    TwapiEtwWriter *writerP;
+    MemSink sink;
+    ULONG winerr;
+    int i, pass;
+
+    for (pass = 0; pass < 2; ++pass) {
+        memset(&sink, 0, sizeof(sink));
+        writerP = TwapiEtwWriterNew(TWAPI_ETW_WRITER_JSONL, ',', 2, names,
+                                    pass ? 1 : 100000, mem_flush, &sink);
+        for (i = 0; i < 40; ++i) {
+            CHECK(TwapiEtwWriterInteger(writerP, i) == ERROR_SUCCESS);
+            CHECK(TwapiEtwWriterString(writerP, S("\"quoted\" and a fairly long string")) == ERROR_SUCCESS);
+            CHECK(TwapiEtwWriterEndRow(writerP) == ERROR_SUCCESS);
+        }
+        CHECK(TwapiEtwWriterFlush(writerP) == ERROR_SUCCESS);
+        TwapiEtwWriterFree(writerP);
+        if (pass == 0) {
+            CHECK(sink.flushes == 1);
+            memcpy(expected, sink.buf, sink.len + 1);
+        } else {
+            CHECK(sink.flushes > 1);
+            CHECK(strcmp(expected, sink.buf) == 0);
+        }
+    }
+
+    memset(&sink, 0, sizeof(sink));
+    sink.fail_after = 1;
+    writerP = TwapiEtwWriterNew(TWAPI_ETW_WRITER_CSV, ',', 2, names, 1, mem_flush, &sink);
+    winerr = ERROR_SUCCESS;
+    for (i = 0; i < 40 && winerr == ERROR_SUCCESS; ++i) {
+        winerr = TwapiEtwWriterString(writerP, S("some text to fill the buffer"));
+        if (winerr == ERROR_SUCCESS)
+            winerr = TwapiEtwWriterEndRow(writerP);
+    }
+    CHECK(winerr == 29);
+    TwapiEtwWriterFree(writerP);
+}
+
+/* Every flush must end on a whole character, checked by utf8_flush */
+static ULONG utf8_flush(void *pv, const char *bytesP, size_t len)
+{
+    size_t i = len;
+    unsigned char c;
+
+    /* Find the lead byte of the last character and check it is complete */
+    while (i > 0 && (((unsigned char) bytesP[i-1]) & 0xC0) == 0x80)
+        --i;
+    CHECK(i > 0);
+    c = (unsigned char) bytesP[i-1];
+    if (c >= 0xC0)
+        CHECK(len - (i - 1) == (size_t) (c >= 0xF0 ? 4 : (c >= 0xE0 ? 3 : 2)));
+    else
+        CHECK(i == len);
+    return mem_flush(pv, bytesP, len);
+}
+
+static void check_utf8_boundaries(void)
+{
+    static const char *names[] = {"-message"};
+    /* Two, three and four byte characters at every alignment */
+    static const char text[] = "\xc3\xa9t\xc3\xa9 \xe2\x82\xac" "5 \xf0\x9f\x98\x80!";
+    char expected[sizeof(((MemSink *)0)->buf)];
+    char row[sizeof(text) + 8];
+    TwapiEtwWriter *writerP;
+    MemSink sink;
+    int i, pass, pad;
+
+    for (pass = 0; pass < 2; ++pass) {
+        memset(&sink, 0, sizeof(sink));
+        writerP = TwapiEtwWriterNew(TWAPI_ETW_WRITER_CSV, ',', 1, names,
+                                    pass ? 1 : 100000, utf8_flush, &sink);
+        for (i = 0; i < 60; ++i) {
+            /* Padding moves the characters by a byte each row */
+            pad = i % 7;
+            memset(row, 'x', pad);
+            memcpy(row + pad, text, sizeof(text) - 1);
+            CHECK(TwapiEtwWriterString(writerP, row, pad + sizeof(text) - 1) == ERROR_SUCCESS);
+            CHECK(TwapiEtwWriterEndRow(writerP) == ERROR_SUCCESS);
+        }
+        CHECK(TwapiEtwWriterFlush(writerP) == ERROR_SUCCESS);
+        TwapiEtwWriterFree(writerP);
+        if (pass == 0)
+            memcpy(expected, sink.buf, sink.len + 1);
+        else {
+            CHECK(sink.flushes > 1);
+            CHECK(strcmp(expected, sink.buf) == 0);
+        }
+    }
+}
+
+/* Fields written for each row, as by etw_dump_to_file's defaults */
+static const char *gFields[] = {
+    "-timecreated", "-levelname", "-providername", "-pid", "-tid",
+    "-taskname", "-opcodename", "-message"
+};
+#define NFIELDS (sizeof(gFields) / sizeof(gFields[0]))
+
+static ULONG write_synthetic_row(TwapiEtwWriter *writerP, long i)
+{
+    static const char *levels[] = {"Information", "Warning", "Error"};
+    static const char *tasks[] = {"Process", "DiskIo", "Registry", "FileIo"};
+    char path[64];
+    const char *params[2];
+    size_t lens[2];
+    ULONG winerr;
+
+    lens[0] = snprintf(path, sizeof(path), "C:\\Windows\\System32\\file%ld.dll", i % 1000);
+    params[0] = path;
+    params[1] = (i & 1) ? "Opened, \"shared\"" : "Closed";
+    lens[1] = strlen(params[1]);
+    if ((winerr = TwapiEtwWriterInteger(writerP, 131000000000000000LL + i)) != ERROR_SUCCESS
+        || (winerr = TwapiEtwWriterString(writerP, levels[i % 3], strlen(levels[i % 3]))) != ERROR_SUCCESS
+        || (winerr = TwapiEtwWriterString(writerP, S("MSNT_SystemTrace"))) != ERROR_SUCCESS
+        || (winerr = TwapiEtwWriterInteger(writerP, 1000 + i % 17)) != ERROR_SUCCESS
+        || (winerr = TwapiEtwWriterInteger(writerP, i * 4)) != ERROR_SUCCESS
+        || (winerr = TwapiEtwWriterString(writerP, tasks[i % 4], strlen(tasks[i % 4]))) != ERROR_SUCCESS
+        || (winerr = TwapiEtwWriterString(writerP, S("Info"))) != ERROR_SUCCESS
+        || (winerr = TwapiEtwWriterMessage(writerP, S("File %1 was %2.%0"), 2, params, lens)) != ERROR_SUCCESS)
+        return winerr;
+    return TwapiEtwWriterEndRow(writerP);
+}
+
+static const char *gEtlFields[] = {
+    "-timecreated", "-providerguid", "-eventid", "-version", "-opcode",
+    "-level", "-pid", "-tid"
+};
+#define NETLFIELDS (sizeof(gEtlFields) / sizeof(gEtlFields[0]))
+
+static ULONG write_etl_row(TwapiEtwWriter *writerP, const EVENT_RECORD *evrP)
+{
+    const EVENT_HEADER *evhP = &evrP->EventHeader;
+    const GUID *guidP = &evhP->ProviderId;
+    char guid[40];
+    ULONG winerr;
+
+    snprintf(guid, sizeof(guid), "{%08X-%04X-%04X-%02X%02X-%02X%02X%02X%02X%02X%02X}",
+             guidP->Data1, guidP->Data2, guidP->Data3,
+             guidP->Data4[0], guidP->Data4[1], guidP->Data4[2], guidP->Data4[3],
+             guidP->Data4[4], guidP->Data4[5], guidP->Data4[6], guidP->Data4[7]);
+    if ((winerr = TwapiEtwWriterInteger(writerP, evhP->TimeStamp.QuadPart)) != ERROR_SUCCESS
+        || (winerr = TwapiEtwWriterString(writerP, guid, 38)) != ERROR_SUCCESS
+        || (winerr = TwapiEtwWriterInteger(writerP, evhP->EventDescriptor.Id)) != ERROR_SUCCESS
+        || (winerr = TwapiEtwWriterInteger(writerP, evhP->EventDescriptor.Version)) != ERROR_SUCCESS
+        || (winerr = TwapiEtwWriterInteger(writerP, evhP->EventDescriptor.Opcode)) != ERROR_SUCCESS
+        || (winerr = TwapiEtwWriterInteger(writerP, evhP->EventDescriptor.Level)) != ERROR_SUCCESS
+        || (winerr = TwapiEtwWriterInteger(writerP, evhP->ProcessId)) != ERROR_SUCCESS
+        || (winerr = TwapiEtwWriterInteger(writerP, evhP->ThreadId)) != ERROR_SUCCESS)
+        return winerr;
+    return TwapiEtwWriterEndRow(writerP);
+}
+
+static ULONG file_read(void *ctxP, ULONGLONG offset, void *bufP, ULONG len)
+{
+    FILE *fp = ctxP;
+    if (fseek(fp, (long) offset, SEEK_SET) != 0)
+        return ERROR_HANDLE_EOF;
+    return fread(bufP, 1, len, fp) == len ? ERROR_SUCCESS : ERROR_HANDLE_EOF;
+}
+
+/*
+ * Writes all rows once with the given format and buffer size and prints
+ * the rate. The log file, if any, is parsed on every run so the parse
+ * rate is printed as well for comparison.
+ */
+static void bench_one(TwapiEtwWriterFormat format, size_t buffer_size,
+                      long nevents, TwapiEtlFile *etlP, FILE *outP)
+{
+    TwapiEtwWriter *writerP;
+    const TwapiEtlBufferInfo *infoP;
+    EVENT_RECORD *evrP;
+    ULONGLONG nbytes = 0;
+    double start, usecs;
+    long i, nrows;
+
+    if (outP)
+        writerP = TwapiEtwWriterNew(format, ',', etlP ? NETLFIELDS : NFIELDS,
+                                    etlP ? gEtlFields : gFields,
+                                    buffer_size, file_flush, outP);
+    else
+        writerP = TwapiEtwWriterNew(format, ',', etlP ? NETLFIELDS : NFIELDS,
+                                    etlP ? gEtlFields : gFields,
+                                    buffer_size, count_flush, &nbytes);
+    CHECK(writerP != NULL);
+    CHECK(TwapiEtwWriterHeader(writerP) == ERROR_SUCCESS);
+
+    start = now_usecs();
+    nrows = 0;
+    if (etlP) {
+        TwapiEtlSeekBuffer(etlP, 0);
+        while (TwapiEtlReadBuffer(etlP, &infoP) == ERROR_SUCCESS) {
+            while (TwapiEtlNextEvent(etlP, &evrP) == ERROR_SUCCESS) {
+                CHECK(write_etl_row(writerP, evrP) == ERROR_SUCCESS);
+                ++nrows;
+            }
+        }
+    } else {
+        for (i = 0; i < nevents; ++i)
+            CHECK(write_synthetic_row(writerP, i) == ERROR_SUCCESS);
+        nrows = nevents;
+    }
+    CHECK(TwapiEtwWriterFlush(writerP) == ERROR_SUCCESS);
+    usecs = now_usecs() - start;
+    CHECK(TwapiEtwWriterRows(writerP) == (ULONGLONG) nrows);
+    TwapiEtwWriterFree(writerP);
+
+    if (nrows == 0 || usecs <= 0)
+        return;
+    printf("%-8s %10lu %14.0f", format == TWAPI_ETW_WRITER_CSV ? "csv" : "jsonl",
+           (unsigned long) buffer_size, nrows / (usecs / 1e6));
+    if (outP == NULL)
+        printf(" %10.1f", nbytes / usecs);
+    printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+    static const size_t buffer_sizes[] = {256, 4096, 65536, 1048576};
+    long nevents = 2000000;
+    const char *etl = NULL;
+    const char *out = NULL;
+    FILE *etlfp = NULL, *outP = NULL;
+    TwapiEtlFile *etlP = NULL;
+    int argi, f;
+    size_t b;
+
+    for (argi = 1; argi + 1 < argc; argi += 2) {
+        if (strcmp(argv[argi], "-events") == 0)
+            nevents = atol(argv[argi+1]);
+        else if (strcmp(argv[argi], "-etl") == 0)
+            etl = argv[argi+1];
+        else if (strcmp(argv[argi], "-out") == 0)
+            out = argv[argi+1];
+        else {
+            fprintf(stderr, "Usage: %s ?-events N? ?-etl PATH? ?-out PATH?\n", argv[0]);
+            return 1;
+        }
+    }
+
+    check_csv();
+    check_jsonl();
+    check_message();
+    check_buffering();
+    check_utf8_boundaries();
+    printf("Checks passed\n");
+
+    if (etl) {
+        long size;
+        etlfp = fopen(etl, "rb");
+        if (etlfp == NULL) {
+            perror(etl);
+            return 1;
+        }
+        fseek(etlfp, 0, SEEK_END);
+        size = ftell(etlfp);
+        CHECK(TwapiEtlOpen(file_read, etlfp, size, 0, &etlP) == ERROR_SUCCESS);
+        printf("%s: header fields only\n", etl);
+    } else
+        printf("%ld synthetic events\n", nevents);
+    if (out) {
+        outP = fopen(out, "wb");
+        if (outP == NULL) {
+            perror(out);
+            return 1;
+        }
+    }
+
+    printf("%-8s %10s %14s%s\n", "format", "buffer", "rows/sec",
+           outP ? "" : "       MB/s");
+    for (f = 0; f < 2; ++f) {
+        for (b = 0; b < sizeof(buffer_sizes) / sizeof(buffer_sizes[0]); ++b)
+            bench_one(f ? TWAPI_ETW_WRITER_JSONL : TWAPI_ETW_WRITER_CSV,
+                      buffer_sizes[b], nevents, etlP, outP);
+    }
+
+    if (etlP) {
+        TwapiEtlClose(etlP);
+        fclose(etlfp);
+    }
+    if (outP)
+        fclose(outP);
+    return 0;
+}
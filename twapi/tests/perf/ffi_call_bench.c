@@ -0,0 +1,331 @@
+/*
+ * Copyright (c) 2018, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ */
+
+/*
+ * Portable harness measuring per-call overhead of the generic ffi_call
+ * path against prepared calls (ffi_prepare). It mirrors the marshalling
+ * structure of base/ffi.c on top of the plain Tcl C API so it can be
+ * built and run on any platform with a Tcl installation. Calls go to
+ * local C functions through a minimal fixed-arity dispatcher standing in
+ * for dyncall.
+ *
+ *    cc -O2 -o ffi_call_bench ffi_call_bench.c -I/usr/include/tcl -ltcl
+ *    ./ffi_call_bench ?ITERATIONS?
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <tcl.h>
+
+enum {
+    T_VOID, T_INT, T_UINT, T_INT64, T_PTR, T_STRING
+};
+static const char *type_names[] = {
+    "void", "i4", "ui4", "i8", "handle", "lpstr", NULL
+};
+
+#define MAXARGS 4
+typedef intptr_t (*fn0_t)(void);
+typedef intptr_t (*fn1_t)(intptr_t);
+typedef intptr_t (*fn2_t)(intptr_t, intptr_t);
+typedef intptr_t (*fn3_t)(intptr_t, intptr_t, intptr_t);
+typedef intptr_t (*fn4_t)(intptr_t, intptr_t, intptr_t, intptr_t);
+
+/* Stand-in for the dyncall VM */
+typedef struct CallVM {
+    int nargs;
+    intptr_t args[MAXARGS];
+} CallVM;
+
+static intptr_t VMCall(CallVM *vmP, void *fn)
+{
+    switch (vmP->nargs) {
+    case 0: return ((fn0_t)fn)();
+    case 1: return ((fn1_t)fn)(vmP->args[0]);
+    case 2: return ((fn2_t)fn)(vmP->args[0], vmP->args[1]);
+    case 3: return ((fn3_t)fn)(vmP->args[0], vmP->args[1], vmP->args[2]);
+    default: return ((fn4_t)fn)(vmP->args[0], vmP->args[1], vmP->args[2], vmP->args[3]);
+    }
+}
+
+/* Local functions being called */
+static intptr_t fn_nop(void) { return 0; }
+static intptr_t fn_add2(intptr_t a, intptr_t b) { return a + b; }
+static intptr_t fn_sum4(intptr_t a, intptr_t b, intptr_t c, intptr_t d) { return a + b + c + d; }
+static intptr_t fn_strlen(intptr_t s) { return (intptr_t) strlen((const char *) s); }
+
+/*
+ * Type signature parsed into an internal rep, equivalent of the cstruct
+ * Tcl_ObjType. Like ffi.c, the parse is cached in the Tcl_Obj and the
+ * generic path only pays for the type check and per-call classification.
+ */
+typedef struct SigRep {
+    int nrefs;
+    int ntypes;
+    char types[MAXARGS];
+} SigRep;
+
+static void SigDecrRefs(SigRep *sigP) {
+    if (--sigP->nrefs <= 0)
+        ckfree((char *) sigP);
+}
+static void FreeSig(Tcl_Obj *objP) {
+    SigDecrRefs(objP->internalRep.twoPtrValue.ptr1);
+}
+static void DupSig(Tcl_Obj *srcP, Tcl_Obj *dstP) {
+    dstP->internalRep = srcP->internalRep;
+    dstP->typePtr = srcP->typePtr;
+    ((SigRep *)dstP->internalRep.twoPtrValue.ptr1)->nrefs++;
+}
+static Tcl_ObjType gSigType = {"BenchSig", FreeSig, DupSig, NULL, NULL};
+
+static int ObjCastToSig(Tcl_Interp *interp, Tcl_Obj *objP)
+{
+    Tcl_Obj **elems;
+    int i, n, t;
+    SigRep *sigP;
+
+    if (objP->typePtr == &gSigType)
+        return TCL_OK;
+    if (Tcl_ListObjGetElements(interp, objP, &n, &elems) != TCL_OK)
+        return TCL_ERROR;
+    if (n > MAXARGS) {
+        Tcl_SetResult(interp, "Too many types", TCL_STATIC);
+        return TCL_ERROR;
+    }
+    sigP = (SigRep *) ckalloc(sizeof(*sigP));
+    sigP->nrefs = 1;
+    sigP->ntypes = n;
+    for (i = 0; i < n; ++i) {
+        Tcl_Obj *typeObj;
+        if (Tcl_ListObjIndex(interp, elems[i], 1, &typeObj) != TCL_OK ||
+            typeObj == NULL ||
+            Tcl_GetIndexFromObj(interp, typeObj, type_names, "type", TCL_EXACT, &t) != TCL_OK) {
+            ckfree((char *) sigP);
+            return TCL_ERROR;
+        }
+        sigP->types[i] = (char) t;
+    }
+    Tcl_GetString(objP);    /* No string generation proc so keep it */
+    if (objP->typePtr && objP->typePtr->freeIntRepProc)
+        objP->typePtr->freeIntRepProc(objP);
+    objP->internalRep.twoPtrValue.ptr1 = sigP;
+    objP->typePtr = &gSigType;
+    return TCL_OK;
+}
+
+static int CheckParamType(Tcl_Interp *interp, int type)
+{
+    if (type == T_VOID) {
+        Tcl_SetResult(interp, "Unsupported parameter type", TCL_STATIC);
+        return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+static int PushArgs(Tcl_Interp *interp, CallVM *vmP, int nparams, const char *types, Tcl_Obj *const params[])
+{
+    int i;
+    Tcl_WideInt w;
+    vmP->nargs = nparams;
+    for (i = 0; i < nparams; ++i) {
+        switch (types[i]) {
+        case T_INT: case T_UINT: case T_INT64: case T_PTR:
+            if (Tcl_GetWideIntFromObj(interp, params[i], &w) != TCL_OK)
+                return TCL_ERROR;
+            vmP->args[i] = (intptr_t) w;
+            break;
+        case T_STRING:
+            vmP->args[i] = (intptr_t) Tcl_GetString(params[i]);
+            break;
+        default:
+            Tcl_SetResult(interp, "Unsupported parameter type", TCL_STATIC);
+            return TCL_ERROR;
+        }
+    }
+    return TCL_OK;
+}
+
+static int Invoke(Tcl_Interp *interp, CallVM *vmP, void *fn, int rettype)
+{
+    intptr_t r = VMCall(vmP, fn);
+    switch (rettype) {
+    case T_VOID: Tcl_ResetResult(interp); break;
+    case T_INT: Tcl_SetObjResult(interp, Tcl_NewIntObj((int) r)); break;
+    default: Tcl_SetObjResult(interp, Tcl_NewWideIntObj((Tcl_WideInt) r)); break;
+    }
+    return TCL_OK;
+}
+
+/* call FNADDR RETTYPE PARAMTYPES PARAMS - the generic ffi_call path */
+static int CallObjCmd(ClientData cd, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+{
+    CallVM *vmP = (CallVM *) cd;
+    Tcl_WideInt fnaddr;
+    SigRep *retP, *paramsP;
+    Tcl_Obj *paramObj, **params;
+    char types[MAXARGS];
+    int i, nparams, res;
+
+    if (objc != 5) {
+        Tcl_WrongNumArgs(interp, 1, objv, "fnaddr rettype paramtypes params");
+        return TCL_ERROR;
+    }
+    if (Tcl_GetWideIntFromObj(interp, objv[1], &fnaddr) != TCL_OK ||
+        ObjCastToSig(interp, objv[2]) != TCL_OK ||
+        ObjCastToSig(interp, objv[3]) != TCL_OK)
+        return TCL_ERROR;
+    retP = objv[2]->internalRep.twoPtrValue.ptr1;
+    paramsP = objv[3]->internalRep.twoPtrValue.ptr1;
+    retP->nrefs++;
+    paramsP->nrefs++;
+
+    paramObj = Tcl_DuplicateObj(objv[4]);
+    Tcl_IncrRefCount(paramObj);
+    res = Tcl_ListObjGetElements(interp, paramObj, &nparams, &params);
+    if (res == TCL_OK && nparams != paramsP->ntypes) {
+        Tcl_SetResult(interp, "Wrong number of arguments", TCL_STATIC);
+        res = TCL_ERROR;
+    }
+    for (i = 0; res == TCL_OK && i < nparams; ++i) {
+        res = CheckParamType(interp, paramsP->types[i]);
+        types[i] = paramsP->types[i];
+    }
+    if (res == TCL_OK)
+        res = PushArgs(interp, vmP, nparams, types, params);
+    if (res == TCL_OK)
+        res = Invoke(interp, vmP, (void *)(intptr_t) fnaddr, retP->types[0]);
+
+    SigDecrRefs(retP);
+    SigDecrRefs(paramsP);
+    Tcl_DecrRefCount(paramObj);
+    return res;
+}
+
+typedef struct Prepared {
+    CallVM vm;
+    void *fn;
+    int nparams;
+    char rettype;
+    char paramtypes[MAXARGS];
+} Prepared;
+
+static int PreparedObjCmd(ClientData cd, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+{
+    Prepared *prepP = (Prepared *) cd;
+    if ((objc - 1) != prepP->nparams) {
+        Tcl_SetResult(interp, "Wrong number of arguments", TCL_STATIC);
+        return TCL_ERROR;
+    }
+    if (PushArgs(interp, &prepP->vm, prepP->nparams, prepP->paramtypes, objv + 1) != TCL_OK)
+        return TCL_ERROR;
+    return Invoke(interp, &prepP->vm, prepP->fn, prepP->rettype);
+}
+
+static void PreparedDelete(ClientData cd) { ckfree((char *) cd); }
+
+/* prepare NAME FNADDR RETTYPE PARAMTYPES */
+static int PrepareObjCmd(ClientData cd, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[])
+{
+    Tcl_WideInt fnaddr;
+    SigRep *retP, *paramsP;
+    Prepared *prepP;
+    int i;
+
+    if (objc != 5) {
+        Tcl_WrongNumArgs(interp, 1, objv, "name fnaddr rettype paramtypes");
+        return TCL_ERROR;
+    }
+    if (Tcl_GetWideIntFromObj(interp, objv[2], &fnaddr) != TCL_OK ||
+        ObjCastToSig(interp, objv[3]) != TCL_OK ||
+        ObjCastToSig(interp, objv[4]) != TCL_OK)
+        return TCL_ERROR;
+    retP = objv[3]->internalRep.twoPtrValue.ptr1;
+    paramsP = objv[4]->internalRep.twoPtrValue.ptr1;
+    for (i = 0; i < paramsP->ntypes; ++i) {
+        if (CheckParamType(interp, paramsP->types[i]) != TCL_OK)
+            return TCL_ERROR;
+    }
+    prepP = (Prepared *) ckalloc(sizeof(*prepP));
+    prepP->fn = (void *)(intptr_t) fnaddr;
+    prepP->nparams = paramsP->ntypes;
+    prepP->rettype = retP->types[0];
+    memcpy(prepP->paramtypes, paramsP->types, paramsP->ntypes);
+    Tcl_CreateObjCommand(interp, Tcl_GetString(objv[1]), PreparedObjCmd, prepP, PreparedDelete);
+    return TCL_OK;
+}
+
+static const char *bench_script =
+    "proc measure {script iters} {\n"
+    "    uplevel 1 $script\n"
+    "    return [lindex [uplevel 1 [list time $script $iters]] 0]\n"
+    "}\n"
+    "proc compare {label base new} {\n"
+    "    puts [format {%-28s %10.3f us %10.3f us %7.2fx} $label $base $new [expr {$base/$new}]]\n"
+    "}\n"
+    "proc run {iters} {\n"
+    "    global fn\n"
+    "    prepare p_nop $fn(nop) {{r i4}} {}\n"
+    "    prepare p_add2 $fn(add2) {{r i8}} {{a i4} {b i4}}\n"
+    "    prepare p_sum4 $fn(sum4) {{r i8}} {{a i8} {b i8} {c i8} {d i8}}\n"
+    "    prepare p_strlen $fn(strlen) {{r i4}} {{s lpstr}}\n"
+    "    set a 1; set b 2; set c 3; set d 4; set s abcdefgh\n"
+    "    if {[call $fn(add2) {{r i8}} {{a i4} {b i4}} [list $a $b]] != [p_add2 $a $b] ||\n"
+    "        [call $fn(strlen) {{r i4}} {{s lpstr}} [list $s]] != [p_strlen $s]} {\n"
+    "        error \"Mismatched results\"\n"
+    "    }\n"
+    "    puts [format {%-28s %13s %13s %8s} call ffi_call prepared speedup]\n"
+    "    compare \"nop()\" \\\n"
+    "        [measure {call $fn(nop) {{r i4}} {} {}} $iters] \\\n"
+    "        [measure {p_nop} $iters]\n"
+    "    compare \"add2(int,int)\" \\\n"
+    "        [measure {call $fn(add2) {{r i8}} {{a i4} {b i4}} [list $a $b]} $iters] \\\n"
+    "        [measure {p_add2 $a $b} $iters]\n"
+    "    compare \"sum4(i8,i8,i8,i8)\" \\\n"
+    "        [measure {call $fn(sum4) {{r i8}} {{a i8} {b i8} {c i8} {d i8}} [list $a $b $c $d]} $iters] \\\n"
+    "        [measure {p_sum4 $a $b $c $d} $iters]\n"
+    "    compare \"strlen(char*)\" \\\n"
+    "        [measure {call $fn(strlen) {{r i4}} {{s lpstr}} [list $s]} $iters] \\\n"
+    "        [measure {p_strlen $s} $iters]\n"
+    "    # Same comparison through a proc wrapper as generated by ffi_cfuncs\n"
+    "    proc w_generic {a b} {global fn; call $fn(add2) {{r i8}} {{a i4} {b i4}} [list $a $b]}\n"
+    "    proc w_prepared {a b} {p_add2 $a $b}\n"
+    "    compare \"add2 via proc\" \\\n"
+    "        [measure {w_generic $a $b} $iters] [measure {w_prepared $a $b} $iters]\n"
+    "}\n";
+
+int main(int argc, char *argv[])
+{
+    Tcl_Interp *interp;
+    CallVM vm;
+    char buf[128];
+    int iters = argc > 1 ? atoi(argv[1]) : 1000000;
+
+    Tcl_FindExecutable(argv[0]);
+    interp = Tcl_CreateInterp();
+    Tcl_CreateObjCommand(interp, "call", CallObjCmd, &vm, NULL);
+    Tcl_CreateObjCommand(interp, "prepare", PrepareObjCmd, NULL, NULL);
+
+#define SETFN(name_, fn_)                                               \
+    snprintf(buf, sizeof(buf), "set fn(%s) %lld", name_, (long long)(intptr_t)(fn_)); \
+    Tcl_Eval(interp, buf)
+    SETFN("nop", fn_nop);
+    SETFN("add2", fn_add2);
+    SETFN("sum4", fn_sum4);
+    SETFN("strlen", fn_strlen);
+
+    snprintf(buf, sizeof(buf), "run %d", iters);
+    if (Tcl_Eval(interp, bench_script) != TCL_OK ||
+        Tcl_Eval(interp, buf) != TCL_OK) {
+        fprintf(stderr, "%s\n", Tcl_GetStringResult(interp));
+        return 1;
+    }
+    Tcl_DeleteInterp(interp);
+    return 0;
+}
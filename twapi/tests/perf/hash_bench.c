@@ -0,0 +1,196 @@
+/*
+ * Copyright (c) 2018, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ */
+
+/*
+ * Checks the native hashes against known digests and reports the
+ * throughput in GB/s for hashing a memory buffer and a file read in 64K
+ * chunks, as done by hash_update_channel. Does not need Tcl or Windows.
+ * Build and run from this directory, e.g.
+ *
+ *   cc -O2 -DCRYPTO_STANDALONE -I../../crypto -o hash_bench hash_bench.c \
+ *       ../../crypto/hash.c
+ *   ./hash_bench ?-size MB? ?-file PATH?
+ *
+ * If no file is specified, a temporary file of the given size is created.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef _WIN32
+# include <windows.h>
+#endif
+#include "hash.h"
+
+static const struct {
+    const char *alg;
+    const char *data;
+    const char *key;            /* NULL for plain hashes */
+    const char *hex;
+} vectors[] = {
+    {"md5", "abc", NULL, "900150983cd24fb0d6963f7d28e17f72"},
+    {"sha1", "abc", NULL, "a9993e364706816aba3e25717850c26c9cd0d89d"},
+    {"sha224", "abc", NULL,
+     "23097d223405d8228642a477bda255b32aadbce4bda0b3f7e36c9da7"},
+    {"sha256", "abc", NULL,
+     "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"},
+    {"sha384", "abc", NULL,
+     "cb00753f45a35e8bb5a03d699ac65007272c32ab0eded1631a8b605a43ff5bed"
+     "8086072ba1e7cc2358baeca134c825a7"},
+    {"sha512", "abc", NULL,
+     "ddaf35a193617abacc417349ae20413112e6fa4e89a97ea20a9eeee64b55d39a"
+     "2192992a274fc1a836ba3c23a3feebbd454d4423643ce80e2a9ac94fa54ca49f"},
+    {"sha256", "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", NULL,
+     "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1"},
+    /* RFC 4231 test case 2 */
+    {"sha256", "what do ya want for nothing?", "Jefe",
+     "5bdcc146bf60754e6a042426089575c75a003f089d2739839dec58b964ec3843"},
+    {"sha512", "what do ya want for nothing?", "Jefe",
+     "164b7a7bfcf819e2e395fbe73b56e0a387bd64222e831fd610270cd7ea250554"
+     "9758bf75c05a994a6d034f65f8f0e6fdcaeab1a34d4a6b4b636e070a38bce737"},
+};
+
+static const char *algs[] = {
+    "md5", "sha1", "sha224", "sha256", "sha384", "sha512"
+};
+
+static double now_usecs(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int check_vectors(void)
+{
+    unsigned char digest[TWAPI_HASH_MAX_DIGEST_SIZE];
+    char hex[2*TWAPI_HASH_MAX_DIGEST_SIZE + 1];
+    TwapiHmacCtx ctx;
+    const TwapiHashAlg *algP;
+    DWORD i, j, n;
+    int failures = 0;
+
+    for (i = 0; i < sizeof(vectors)/sizeof(vectors[0]); ++i) {
+        algP = TwapiHashAlgFromName(vectors[i].alg);
+        TwapiHmacInit(&ctx, algP, (const unsigned char *) vectors[i].key,
+                      vectors[i].key ? strlen(vectors[i].key) : 0);
+        /* Feed one byte at a time to exercise partial block handling */
+        for (j = 0; vectors[i].data[j]; ++j)
+            TwapiHmacUpdate(&ctx, (const unsigned char *) vectors[i].data + j, 1);
+        TwapiHmacFinal(&ctx, digest);
+        n = TwapiHashDigestSize(algP);
+        for (j = 0; j < n; ++j)
+            sprintf(hex + 2 * j, "%02x", digest[j]);
+        if (strcmp(hex, vectors[i].hex) != 0) {
+            printf("Vector %u: got %s, expected %s\n", i, hex, vectors[i].hex);
+            ++failures;
+        }
+    }
+    printf("%u test vectors, %d failures\n\n",
+           (unsigned) (sizeof(vectors)/sizeof(vectors[0])), failures);
+    return failures;
+}
+
+/* Returns GB/s, best of three */
+static double bench_buffer(const TwapiHashAlg *algP, const unsigned char *p,
+                           size_t n)
+{
+    unsigned char digest[TWAPI_HASH_MAX_DIGEST_SIZE];
+    TwapiHashCtx ctx;
+    double start, usecs, best = 0;
+    int round;
+
+    for (round = 0; round < 3; ++round) {
+        start = now_usecs();
+        TwapiHashInit(&ctx, algP);
+        TwapiHashUpdate(&ctx, p, n);
+        TwapiHashFinal(&ctx, digest);
+        usecs = now_usecs() - start;
+        if (round == 0 || usecs < best)
+            best = usecs;
+    }
+    return n / (best * 1e3);
+}
+
+static double bench_file(const TwapiHashAlg *algP, const char *path)
+{
+    unsigned char digest[TWAPI_HASH_MAX_DIGEST_SIZE];
+    static unsigned char buf[65536];
+    TwapiHashCtx ctx;
+    double start, usecs, best = 0;
+    size_t nread, total = 0;
+    FILE *f;
+    int round;
+
+    for (round = 0; round < 3; ++round) {
+        f = fopen(path, "rb");
+        if (f == NULL)
+            return 0;
+        start = now_usecs();
+        total = 0;
+        TwapiHashInit(&ctx, algP);
+        while ((nread = fread(buf, 1, sizeof(buf), f)) > 0) {
+            TwapiHashUpdate(&ctx, buf, nread);
+            total += nread;
+        }
+        TwapiHashFinal(&ctx, digest);
+        usecs = now_usecs() - start;
+        fclose(f);
+        if (round == 0 || usecs < best)
+            best = usecs;
+    }
+    return total / (best * 1e3);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *path = NULL;
+    char tmp_path[] = "hash_bench.tmp";
+    size_t size = 256, i;
+    unsigned char *p;
+    FILE *f;
+    int j;
+
+    for (j = 1; j + 1 < argc; j += 2) {
+        if (strcmp(argv[j], "-size") == 0)
+            size = atoi(argv[j+1]);
+        else if (strcmp(argv[j], "-file") == 0)
+            path = argv[j+1];
+    }
+    size *= 1024 * 1024;
+
+    if (check_vectors())
+        return 1;
+
+    p = malloc(size);
+    if (p == NULL)
+        return 1;
+    for (i = 0; i < size; ++i)
+        p[i] = (unsigned char) (i * 2654435761u >> 24);
+
+    if (path == NULL) {
+        f = fopen(tmp_path, "wb");
+        if (f == NULL || fwrite(p, 1, size, f) != size)
+            return 1;
+        fclose(f);
+        path = tmp_path;
+    }
+
+    printf("%-8s %12s %12s\n", "alg", "buffer GB/s", "file GB/s");
+    for (j = 0; j < (int) (sizeof(algs)/sizeof(algs[0])); ++j) {
+        const TwapiHashAlg *algP = TwapiHashAlgFromName(algs[j]);
+        printf("%-8s %12.3f %12.3f\n", algs[j],
+               bench_buffer(algP, p, size), bench_file(algP, path));
+    }
+
+    if (path == tmp_path)
+        remove(tmp_path);
+    free(p);
+    return 0;
+}
@@ -0,0 +1,66 @@
+#
+# Copyright (c) 2018, Ashok P. Nadkarni
+# All rights reserved.
+#
+# See the file LICENSE for license
+
+# Throughput of hashing a large file through CAPI hash objects fed
+# 64K chunks read at script level, compared with the native hash
+# reading the channel itself, e.g.
+#    tclsh hash_perf.tcl ?-iterations N? ?-size MB?
+
+source [file join [file dirname [info script]] perfutil.tcl]
+load_twapi_package twapi
+
+namespace eval perf::hash {
+    if {[lsearch -exact $::argv -iterations] < 0} {
+        set perf::iterations 3
+    }
+    set size 256
+    if {[set pos [lsearch -exact $::argv -size]] >= 0} {
+        set size [lindex $::argv [incr pos]]
+    }
+    set size [expr {$size * 1024 * 1024}]
+
+    set path [file join [pwd] hash_perf.tmp]
+    set fd [open $path wb]
+    set chunk [string repeat [binary format I* {1 2 3 4 5 6 7 8}] 2048]
+    for {set n 0} {$n < $size} {incr n [string length $chunk]} {
+        puts -nonewline $fd $chunk
+    }
+    close $fd
+
+    proc capi_file {csptype alg path} {
+        set hcrypt [twapi::crypt_acquire -csptype $csptype]
+        set hhash [twapi::capi_hash_create $hcrypt $alg]
+        set fd [open $path rb]
+        while {[string length [set data [read $fd 65536]]]} {
+            twapi::capi_hash_bytes $hhash $data
+        }
+        close $fd
+        set digest [twapi::capi_hash_value $hhash]
+        twapi::capi_hash_free $hhash
+        twapi::crypt_free $hcrypt
+        return $digest
+    }
+
+    puts [format "%-40s %15s %15s %9s" "file hash" "capi" "native" "speedup"]
+    foreach {csptype alg native} {
+        prov_rsa_full md5 md5
+        prov_rsa_full sha1 sha1
+        prov_rsa_aes sha_256 sha256
+        prov_rsa_aes sha_512 sha512
+    } {
+        if {[capi_file $csptype $alg $path] ne [twapi::hash_file $native $path]} {
+            error "Digest mismatch for $native"
+        }
+        set capi [perf::measure [list capi_file $csptype $alg $path]]
+        set ours [perf::measure [list twapi::hash_file $native $path]]
+        perf::compare "$native [expr {$size >> 20}] MB" $capi $ours
+        puts [format "%-40s %12.3f GB/s %9.3f GB/s" "" \
+                  [expr {$size / ($capi * 1000.0)}] \
+                  [expr {$size / ($ours * 1000.0)}]]
+    }
+
+    file delete $path
+}
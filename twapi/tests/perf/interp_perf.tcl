@@ -0,0 +1,53 @@
+#
+# Copyright (c) 2018, Ashok P. Nadkarni
+# All rights reserved.
+#
+# See the file LICENSE for license
+
+# Cost of loading twapi into each additional interpreter in a process
+# with and without the per-process script cache and deferral of module
+# scripts already evaluated in another interpreter. The settings are
+# process wide so the configurations are measured in order of
+# increasing caching, e.g.
+#    tclsh interp_perf.tcl ?-iterations N?
+
+source [file join [file dirname [info script]] perfutil.tcl]
+load_twapi_package twapi
+
+namespace eval perf::interp {
+    if {[lsearch -exact $::argv -iterations] < 0} {
+        set perf::iterations 20
+    }
+
+    proc load_in_new_interp {} {
+        set ip [interp create]
+        $ip eval [list set ::auto_path $::auto_path]
+        $ip eval {package require twapi}
+        interp delete $ip
+    }
+
+    proc create_only {} {
+        interp delete [interp create]
+    }
+
+    set empty [perf::measure create_only]
+
+    puts [format "%-40s %15s %15s" "configuration" "per interp" "saving"]
+    set uncached [perf::measure load_in_new_interp]
+    perf::report "no caching" $uncached
+
+    set ::twapi::settings(cache_scripts) 1
+    # First interp fills the cache, the rest use it
+    load_in_new_interp
+    set cached [perf::measure load_in_new_interp]
+    puts [format "%-40s %12.0f us %12.0f us" "cache_scripts" \
+              $cached [expr {$uncached - $cached}]]
+
+    set ::twapi::settings(defer_cached_scripts) 1
+    load_in_new_interp
+    set deferred [perf::measure load_in_new_interp]
+    puts [format "%-40s %12.0f us %12.0f us" "cache_scripts + defer_cached_scripts" \
+              $deferred [expr {$uncached - $deferred}]]
+
+    perf::report "interp creation only" $empty
+}
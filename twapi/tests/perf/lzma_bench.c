@@ -0,0 +1,212 @@
+/*
+ * Copyright (c) 2018, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ */
+
+/*
+ * Decode throughput of the LZMA decoder used for embedded TWAPI scripts.
+ * Does not need Tcl or Windows. Build and run from this directory, e.g.
+ *
+ *   cc -O2 -I../../base -o lzma_bench lzma_bench.c ../../base/lzmadec.c
+ *   ./lzma_bench ?-iterations N? FILE ?FILE...?
+ *
+ * For each FILE, FILE.lzma must hold its compressed form in the
+ * .lzma (LZMA "alone") format written by the build with tools/lzma.exe.
+ * Files written by "xz --format=lzma" or "lzma" which do not record the
+ * uncompressed size in the header are also accepted. Every decode is
+ * compared byte for byte with FILE. The reported time is the mean of the
+ * fastest of five rounds of N decodes. If no files are given, synthetic
+ * corpora are generated, which then need xz or lzma in the PATH to
+ * compress them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "lzmadec.h"
+
+static void *BenchAlloc(void *unused, size_t size) { return malloc(size); }
+static void BenchFree(void *unused, void *address) { free(address); }
+static ISzAlloc gBenchAlloc = { BenchAlloc, BenchFree };
+
+static double now_usecs(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static unsigned char *read_file(const char *path, size_t *lenP)
+{
+    FILE *f = fopen(path, "rb");
+    unsigned char *data;
+    long len;
+
+    if (f == NULL)
+        return NULL;
+    fseek(f, 0, SEEK_END);
+    len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    data = malloc(len ? len : 1);
+    if (fread(data, 1, len, f) != (size_t) len) {
+        free(data);
+        data = NULL;
+    }
+    fclose(f);
+    *lenP = len;
+    return data;
+}
+
+static int write_file(const char *path, const unsigned char *data, size_t len)
+{
+    FILE *f = fopen(path, "wb");
+    if (f == NULL)
+        return 0;
+    fwrite(data, 1, len, f);
+    fclose(f);
+    return 1;
+}
+
+/* Same decode call and checks as TwapiLzmaUncompressBuffer */
+static int decode(const unsigned char *in, size_t insz,
+                  unsigned char *out, size_t outsz)
+{
+    SizeT inlen = insz - LZMA_PROPS_SIZE - 8;
+    SizeT outlen = outsz;
+    ELzmaStatus status;
+    SRes res;
+
+    res = LzmaDecode(out, &outlen, in + LZMA_PROPS_SIZE + 8, &inlen,
+                     in, LZMA_PROPS_SIZE, LZMA_FINISH_END, &status,
+                     &gBenchAlloc);
+    return res == SZ_OK && outlen == outsz &&
+        inlen == insz - LZMA_PROPS_SIZE - 8 &&
+        (status == LZMA_STATUS_FINISHED_WITH_MARK ||
+         status == LZMA_STATUS_MAYBE_FINISHED_WITHOUT_MARK);
+}
+
+static int bench(const char *path, int iterations)
+{
+    char lzpath[1024];
+    unsigned char *orig, *in, *out;
+    size_t origsz, insz;
+    double start, usecs;
+    int i, round;
+
+    snprintf(lzpath, sizeof(lzpath), "%s.lzma", path);
+    orig = read_file(path, &origsz);
+    in = read_file(lzpath, &insz);
+    if (orig == NULL || in == NULL || insz < LZMA_PROPS_SIZE + 8) {
+        fprintf(stderr, "Could not read %s and %s\n", path, lzpath);
+        return 0;
+    }
+    /* Fill in the size if the compressor did not know it */
+    for (i = 0; i < 8; ++i)
+        in[LZMA_PROPS_SIZE + i] = (unsigned char) (((unsigned long long) origsz) >> (8 * i));
+
+    out = malloc(origsz ? origsz : 1);
+    if (!decode(in, insz, out, origsz) || memcmp(out, orig, origsz) != 0) {
+        fprintf(stderr, "%s: decoded data does not match\n", path);
+        return 0;
+    }
+    /* Best of several rounds to reduce noise from other processes */
+    usecs = 0;
+    for (round = 0; round < 5; ++round) {
+        double round_usecs;
+        start = now_usecs();
+        for (i = 0; i < iterations; ++i)
+            decode(in, insz, out, origsz);
+        round_usecs = (now_usecs() - start) / iterations;
+        if (round == 0 || round_usecs < usecs)
+            usecs = round_usecs;
+    }
+    printf("%-32s %10lu %10lu %12.1f us %8.1f MB/s\n",
+           strrchr(path, '/') ? strrchr(path, '/') + 1 : path,
+           (unsigned long) origsz, (unsigned long) insz, usecs,
+           origsz / usecs);
+    free(orig);
+    free(in);
+    free(out);
+    return 1;
+}
+
+/* Writes the synthetic corpora and returns their number */
+static int make_corpora(const char *dir, char paths[][256])
+{
+    static const char *words[] = {
+        "proc", "twapi::", "set", "return", "variable", "if", "foreach",
+        "dict", "lappend", "namespace", "eval", "expr", "{", "}", "$opts",
+        "\n    ", "[", "]", "#", "list",
+    };
+    size_t sz = 1 << 20, i;
+    unsigned char *data = malloc(sz);
+    unsigned int seed = 12345;
+    int n = 0;
+    char cmd[4096];
+
+#define NEXTRAND (seed = seed * 1103515245 + 12345, (seed >> 16) & 0x7fff)
+    /* Text made of a small vocabulary - long literal runs and short matches */
+    for (i = 0; i < sz; ) {
+        const char *w = words[NEXTRAND % (sizeof(words)/sizeof(words[0]))];
+        while (*w && i < sz)
+            data[i++] = *w++;
+        if (i < sz)
+            data[i++] = ' ';
+    }
+    snprintf(paths[n], 256, "%s/synthetic_words", dir);
+    write_file(paths[n++], data, sz);
+
+    /* Highly repetitive - long matches */
+    for (i = 0; i < sz; ++i)
+        data[i] = "0123456789abcdef"[(i / 7) % 16];
+    snprintf(paths[n], 256, "%s/synthetic_repeat", dir);
+    write_file(paths[n++], data, sz);
+
+    /* Random bytes - all literals */
+    for (i = 0; i < sz; ++i)
+        data[i] = (unsigned char) NEXTRAND;
+    snprintf(paths[n], 256, "%s/synthetic_random", dir);
+    write_file(paths[n++], data, sz);
+
+    free(data);
+    for (i = 0; i < (size_t) n; ++i) {
+        snprintf(cmd, sizeof(cmd),
+                 "xz --format=lzma -k -f -c \"%s\" > \"%s.lzma\" || lzma e \"%s\" \"%s.lzma\"",
+                 paths[i], paths[i], paths[i], paths[i]);
+        if (system(cmd) != 0)
+            return 0;
+    }
+    return n;
+}
+
+int main(int argc, char *argv[])
+{
+    int iterations = 20;
+    int i, n, status = 0;
+    char corpora[3][256];
+
+    if (argc > 2 && strcmp(argv[1], "-iterations") == 0) {
+        iterations = atoi(argv[2]);
+        argc -= 2;
+        argv += 2;
+    }
+
+    printf("%-32s %10s %10s %15s %13s\n", "file", "size", "compressed",
+           "decode", "throughput");
+    if (argc > 1) {
+        for (i = 1; i < argc; ++i)
+            status |= !bench(argv[i], iterations);
+    } else {
+        n = make_corpora(".", corpora);
+        if (n == 0) {
+            fprintf(stderr, "Could not compress synthetic corpora\n");
+            return 1;
+        }
+        for (i = 0; i < n; ++i)
+            status |= !bench(corpora[i], iterations);
+    }
+    return status;
+}
@@ -0,0 +1,566 @@
+/*
+ * Copyright (c) 2018, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ */
+
+/*
+ * Checks and measures the compiled decoders for MOF event data. The
+ * fixtures are payloads of common kernel MOF events as logged on 32 and
+ * 64 bit systems, along with the field types etw.tcl computes for their
+ * classes. Results of the compiled program are compared against a
+ * straightforward decoder that switches on the field type of every
+ * field of every event, as Twapi_ParseEventMofData used to, for each
+ * fixture, every truncation of it and random data. Does not need Tcl
+ * or Windows. Build and run from this directory, e.g.
+ *
+ *   cc -O2 -DETW_STANDALONE -I../../etw -o mofdecode_bench \
+ *       mofdecode_bench.c ../../etw/mofdecode.c
+ *   ./mofdecode_bench ?-events N?
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mofdecode.h"
+
+#define CHECK(cond_)                                                    \
+    do {                                                                \
+        if (!(cond_)) {                                                 \
+            fprintf(stderr, "Check failed at line %d: %s\n", __LINE__, #cond_); \
+            abort();                                                    \
+        }                                                               \
+    } while (0)
+
+#define MAX_FIELDS 32
+#define MAX_PAYLOAD 512
+
+static double now_usecs(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/*
+ * Field types of some kernel MOF classes as numbered by
+ * _etw_decipher_mof_event_field_type. P is a pointer.
+ */
+#define P 43
+typedef struct {
+    const char *name;
+    int ntypes;
+    int types[MAX_FIELDS];
+} MofClass;
+
+static const MofClass classes[] = {
+    {"Process_V4_TypeGroup1", 12,
+     {P, 14, 14, 14, 15, P, 14, 33, 1, 2, 2, 2}},
+    {"Thread_V3_TypeGroup1", 14,
+     {14, 14, P, P, P, P, P, P, P, 14, 9, 9, 9, 9}},
+    {"FileIo_Name", 2, {P, 2}},
+    {"TcpIp_TypeGroup1", 8, {14, 14, 30, 30, 39, 39, P, 14}},
+    {"Image_Load", 12, {P, P, 14, 14, 14, 14, P, 14, 14, 14, 14, 2}},
+    {"Registry_TypeGroup1", 5, {16, 14, 14, P, 2}},
+    /* Not a real class. Covers the remaining field layouts. */
+    {"Synthetic", 18,
+     {3, 4, 5, 6, 7, 8, 11, 12, 18, 21, 23, 24, 25, 27, 29, 31, 32, 42}},
+    {"Object", 3, {14, 26, 14}},
+};
+#define NCLASSES (sizeof(classes) / sizeof(classes[0]))
+
+typedef struct {
+    int class_index;
+    unsigned int pointer_size;
+    unsigned char data[MAX_PAYLOAD];
+    unsigned int len;
+} Payload;
+
+static void put(Payload *pP, const void *p, unsigned int n)
+{
+    CHECK(pP->len + n <= MAX_PAYLOAD);
+    memcpy(pP->data + pP->len, p, n);
+    pP->len += n;
+}
+static void put8(Payload *pP, unsigned char v) { put(pP, &v, 1); }
+static void put16(Payload *pP, unsigned short v) { put(pP, &v, 2); }
+static void put32(Payload *pP, unsigned int v) { put(pP, &v, 4); }
+static void put64(Payload *pP, unsigned long long v) { put(pP, &v, 8); }
+static void putptr(Payload *pP, unsigned long long v)
+{
+    if (pP->pointer_size == 8)
+        put64(pP, v);
+    else
+        put32(pP, (unsigned int) v);
+}
+static void putstr(Payload *pP, const char *s)
+{
+    put(pP, s, (unsigned int) strlen(s) + 1);
+}
+static void putwstr(Payload *pP, const char *s, int terminate)
+{
+    do {
+        if (*s == 0 && !terminate)
+            break;
+        put16(pP, (unsigned char) *s);
+    } while (*s++);
+}
+/* SID preceded by TOKEN_USER */
+static void putsid(Payload *pP, unsigned int nsubauth)
+{
+    unsigned int i;
+    putptr(pP, 0xffffb0001234ULL);
+    putptr(pP, 0);
+    put8(pP, 1);
+    put8(pP, (unsigned char) nsubauth);
+    put32(pP, 0);
+    put16(pP, 0x0500);          /* Authority 5, big endian */
+    for (i = 0; i < nsubauth; ++i)
+        put32(pP, i == 0 ? 21 : 1000 + i);
+}
+
+static void build_payload(Payload *pP, int class_index, unsigned int pointer_size)
+{
+    static const unsigned char guid[16] = {
+        0xd0, 0xa8, 0x6f, 0x3d, 0x05, 0xfe, 0xd0, 0x11,
+        0x9d, 0xda, 0x00, 0xc0, 0x4f, 0xd7, 0xba, 0x7c};
+    int i;
+
+    pP->class_index = class_index;
+    pP->pointer_size = pointer_size;
+    pP->len = 0;
+    switch (class_index) {
+    case 0:
+        putptr(pP, 0xffffa00012345678ULL);
+        put32(pP, 1234);
+        put32(pP, 4);
+        put32(pP, 1);
+        put32(pP, 259);
+        putptr(pP, 0x1aa000ULL);
+        put32(pP, 0);
+        putsid(pP, 5);
+        putstr(pP, "svchost.exe");
+        putwstr(pP, "C:\\Windows\\system32\\svchost.exe -k netsvcs -p -s Schedule", 1);
+        putwstr(pP, "", 1);
+        putwstr(pP, "", 1);
+        break;
+    case 1:
+        put32(pP, 1234);
+        put32(pP, 5678);
+        for (i = 0; i < 7; ++i)
+            putptr(pP, 0xfffff80000001000ULL * (i + 1));
+        put32(pP, 0);
+        put8(pP, 8);
+        put8(pP, 5);
+        put8(pP, 2);
+        put8(pP, 0);
+        break;
+    case 2:
+        putptr(pP, 0xffffc00011112222ULL);
+        putwstr(pP, "\\Device\\HarddiskVolume3\\Windows\\System32\\kernel32.dll", 1);
+        break;
+    case 3:
+        put32(pP, 1234);
+        put32(pP, 1460);
+        put32(pP, 0x0100000a);
+        put32(pP, 0x0100007f);
+        put16(pP, 0x5000);
+        put16(pP, 0xbb01);
+        putptr(pP, 0xffffd00000004444ULL);
+        put32(pP, 42);
+        break;
+    case 4:
+        putptr(pP, 0x7ff812340000ULL);
+        putptr(pP, 0x1b000);
+        put32(pP, 1234);
+        put32(pP, 0x2a1b3);
+        put32(pP, 0x5c0f2a11);
+        put32(pP, 0);
+        putptr(pP, 0x180000000ULL);
+        for (i = 0; i < 4; ++i)
+            put32(pP, 0);
+        putwstr(pP, "\\Windows\\System32\\ntdll.dll", 1);
+        break;
+    case 5:
+        put64(pP, (unsigned long long) -1500);
+        put32(pP, 0);
+        put32(pP, 0);
+        putptr(pP, 0xffffe00000005555ULL);
+        putwstr(pP, "\\REGISTRY\\MACHINE\\SOFTWARE\\Microsoft\\Windows NT\\CurrentVersion", 1);
+        break;
+    case 6:
+        put16(pP, 5);
+        put(pP, "hello", 5);
+        put16(pP, 0x0300);      /* Reversed count of 3 */
+        put(pP, "abc", 3);
+        put16(pP, 4);
+        putwstr(pP, "wide", 0);
+        put16(pP, 0x0200);
+        putwstr(pP, "ok", 0);
+        put32(pP, 1);
+        put8(pP, 0xfe);
+        put8(pP, 'x');
+        put16(pP, 0xfffe);
+        put16(pP, 0xbeef);
+        put32(pP, 0xdeadbeef);
+        put64(pP, 0x0123456789abcdefULL);
+        {
+            float f = 1.5f;
+            double d = 2.25;
+            put(pP, &f, 4);
+            put(pP, &d, 8);
+        }
+        put16(pP, 'W');
+        put(pP, guid, 16);
+        put(pP, guid, 16);      /* As an IPv6 address */
+        put32(pP, 3);
+        put(pP, "\x01\x02\x03", 3);
+        putwstr(pP, "rest", 0);
+        break;
+    case 7:
+        put32(pP, 1);
+        put32(pP, 2);
+        put32(pP, 3);
+        break;
+    }
+}
+
+/*
+ * Decodes field by field, switching on the field type each time, the
+ * way Twapi_ParseEventMofData did before the type list was compiled.
+ */
+static int ref_decode(const int *types, int ntypes, const BYTE *bytesP,
+                      ULONG nbytes, ULONG pointer_size, TwapiMofField *fieldsP)
+{
+    ULONG remain, pos, eaten, len, n;
+    unsigned short count;
+    const BYTE *p;
+    int i;
+
+    for (i = 0, pos = 0, remain = nbytes; i < ntypes && remain > 0;
+         ++i, pos += eaten, remain -= eaten) {
+        TwapiMofField *fP = &fieldsP[i];
+        p = bytesP + pos;
+        fP->offset = pos;
+        switch (types[i]) {
+        case 1:
+            fP->opcode = TWAPI_MOF_OP_STRING;
+            for (len = 0; len < remain && p[len]; ++len)
+                ;
+            fP->len = len;
+            eaten = len < remain ? len + 1 : remain;
+            break;
+        case 2:
+            fP->opcode = TWAPI_MOF_OP_WSTRING;
+            n = remain / 2;
+            for (len = 0; len < n && (p[2*len] || p[2*len+1]); ++len)
+                ;
+            fP->len = 2 * len;
+            eaten = len < n ? 2 * len + 2 : remain;
+            break;
+        case 3: case 4:
+            fP->opcode = types[i] == 3 ? TWAPI_MOF_OP_STRING_COUNTED : TWAPI_MOF_OP_STRING_RCOUNTED;
+            if (remain < 2)
+                return i;
+            memcpy(&count, p, 2);
+            if (types[i] == 4)
+                count = (unsigned short) ((count << 8) | (count >> 8));
+            len = count;
+            if (remain < 2 + len)
+                len = remain - 2;
+            fP->offset += 2;
+            fP->len = len;
+            eaten = len + 2;
+            break;
+        case 5: case 6:
+            fP->opcode = types[i] == 5 ? TWAPI_MOF_OP_WSTRING_COUNTED : TWAPI_MOF_OP_WSTRING_RCOUNTED;
+            if (remain < 2)
+                return i;
+            memcpy(&count, p, 2);
+            if (types[i] == 6)
+                count = (unsigned short) ((count << 8) | (count >> 8));
+            fP->offset += 2;
+            if (remain - 2 < 2 * (ULONG) count) {
+                fP->len = ((remain - 2) / 2) * 2;
+                eaten = remain;
+            } else {
+                fP->len = 2 * count;
+                eaten = 2 * count + 2;
+            }
+            break;
+#define FIXED(type_, op_, size_)                \
+        case type_:                             \
+            fP->opcode = op_;                   \
+            if (remain < size_)                 \
+                return i;                       \
+            fP->len = eaten = size_;            \
+            break
+        FIXED(7, TWAPI_MOF_OP_BOOLEAN, 4);
+        FIXED(8, TWAPI_MOF_OP_INT8, 1);
+        FIXED(9, TWAPI_MOF_OP_UINT8, 1);
+        FIXED(10, TWAPI_MOF_OP_CHAR8, 1);
+        FIXED(11, TWAPI_MOF_OP_CHAR8, 1);
+        FIXED(12, TWAPI_MOF_OP_INT16, 2);
+        FIXED(13, TWAPI_MOF_OP_UINT16, 2);
+        FIXED(14, TWAPI_MOF_OP_INT32, 4);
+        FIXED(15, TWAPI_MOF_OP_UINT32, 4);
+        FIXED(16, TWAPI_MOF_OP_INT64, 8);
+        FIXED(17, TWAPI_MOF_OP_UINT64, 8);
+        FIXED(18, TWAPI_MOF_OP_HEX16, 2);
+        FIXED(19, TWAPI_MOF_OP_HEX16, 2);
+        FIXED(20, TWAPI_MOF_OP_HEX32, 4);
+        FIXED(21, TWAPI_MOF_OP_HEX32, 4);
+        FIXED(22, TWAPI_MOF_OP_HEX64, 8);
+        FIXED(23, TWAPI_MOF_OP_HEX64, 8);
+        FIXED(24, TWAPI_MOF_OP_REAL32, 4);
+        FIXED(25, TWAPI_MOF_OP_REAL64, 8);
+        FIXED(27, TWAPI_MOF_OP_CHAR16, 2);
+        FIXED(28, TWAPI_MOF_OP_GUID, 16);
+        FIXED(29, TWAPI_MOF_OP_GUID, 16);
+        FIXED(30, TWAPI_MOF_OP_IPADDR, 4);
+        FIXED(31, TWAPI_MOF_OP_IPADDR6, 16);
+        FIXED(34, TWAPI_MOF_OP_UINT64, 8);
+        FIXED(35, TWAPI_MOF_OP_UINT64, 8);
+        FIXED(38, TWAPI_MOF_OP_PORT, 2);
+        FIXED(39, TWAPI_MOF_OP_PORT, 2);
+        case 32:
+            fP->opcode = TWAPI_MOF_OP_VARIANT;
+            if (remain < 4)
+                return i;
+            memcpy(&len, p, 4);
+            if (remain - 4 < len)
+                return i;
+            fP->offset += 4;
+            fP->len = len;
+            eaten = len + 4;
+            break;
+        case 33:
+            fP->opcode = TWAPI_MOF_OP_SID;
+            if (remain < 4)
+                return i;
+            memcpy(&len, p, 4);
+            if (len == 0) {
+                fP->len = 0;
+                eaten = 4;
+                break;
+            }
+            n = 2 * pointer_size;
+            if (remain < n + 12 || p[n] != 1 || p[n+1] > 15)
+                return i;
+            len = 8 + 4 * p[n+1];
+            if (remain - n < len)
+                return i;
+            fP->offset += n;
+            fP->len = len;
+            eaten = n + len;
+            break;
+        case 41:
+            fP->opcode = TWAPI_MOF_OP_STRING_REST;
+            fP->len = eaten = remain;
+            break;
+        case 42:
+            fP->opcode = TWAPI_MOF_OP_WSTRING_REST;
+            fP->len = (remain / 2) * 2;
+            eaten = remain;
+            break;
+        case 43:
+            fP->opcode = TWAPI_MOF_OP_POINTER;
+            if (remain < pointer_size)
+                return i;
+            fP->len = eaten = pointer_size;
+            break;
+        default:
+            return i;           /* 0, object, datetime */
+        }
+    }
+    return i;
+}
+
+static void compare(const TwapiMofProgram *progP, const MofClass *clsP,
+                    const BYTE *data, ULONG len, ULONG pointer_size)
+{
+    TwapiMofField fields[MAX_FIELDS], ref_fields[MAX_FIELDS];
+    int i, n, ref_n;
+
+    n = TwapiMofDecode(progP, data, len, pointer_size, fields);
+    ref_n = ref_decode(clsP->types, clsP->ntypes, data, len, pointer_size, ref_fields);
+    CHECK(n == ref_n);
+    for (i = 0; i < n; ++i) {
+        CHECK(fields[i].opcode == ref_fields[i].opcode);
+        CHECK(fields[i].offset == ref_fields[i].offset);
+        CHECK(fields[i].len == ref_fields[i].len);
+        CHECK(fields[i].offset + fields[i].len <= len);
+    }
+}
+
+static unsigned int read32(const Payload *pP, const TwapiMofField *fP)
+{
+    unsigned int v;
+    CHECK(fP->len == 4);
+    memcpy(&v, pP->data + fP->offset, 4);
+    return v;
+}
+
+/* Spot checks of decoded values against what the fixtures were built with */
+static void check_values(const Payload *pP, const TwapiMofField *fields, int n)
+{
+    unsigned long long ull;
+
+    switch (pP->class_index) {
+    case 0:
+        CHECK(n == 12);
+        CHECK(fields[0].opcode == TWAPI_MOF_OP_POINTER);
+        CHECK(fields[0].len == pP->pointer_size);
+        memcpy(&ull, pP->data, 8);
+        CHECK(pP->pointer_size == 4 || ull == 0xffffa00012345678ULL);
+        CHECK(read32(pP, &fields[1]) == 1234);
+        CHECK(fields[4].opcode == TWAPI_MOF_OP_UINT32 && read32(pP, &fields[4]) == 259);
+        CHECK(fields[7].opcode == TWAPI_MOF_OP_SID && fields[7].len == 28);
+        CHECK(pP->data[fields[7].offset] == 1 && pP->data[fields[7].offset+1] == 5);
+        CHECK(fields[8].len == 11);
+        CHECK(memcmp(pP->data + fields[8].offset, "svchost.exe", 11) == 0);
+        CHECK(fields[9].len == 2 * 57);
+        CHECK(fields[10].len == 0 && fields[11].len == 0);
+        CHECK(fields[11].offset + 2 == pP->len);
+        break;
+    case 3:
+        CHECK(n == 8);
+        CHECK(fields[2].opcode == TWAPI_MOF_OP_IPADDR && read32(pP, &fields[2]) == 0x0100000a);
+        CHECK(fields[4].opcode == TWAPI_MOF_OP_PORT && fields[4].len == 2);
+        CHECK(read32(pP, &fields[7]) == 42);
+        break;
+    case 6:
+        CHECK(n == 18);
+        CHECK(fields[0].len == 5 && memcmp(pP->data + fields[0].offset, "hello", 5) == 0);
+        CHECK(fields[1].len == 3 && memcmp(pP->data + fields[1].offset, "abc", 3) == 0);
+        CHECK(fields[2].len == 8 && fields[3].len == 4);
+        CHECK(fields[16].opcode == TWAPI_MOF_OP_VARIANT && fields[16].len == 3);
+        CHECK(fields[17].len == 8 && fields[17].offset + 8 == pP->len);
+        break;
+    case 7:
+        /* Nothing after an embedded object can be located */
+        CHECK(n == 1);
+        break;
+    default:
+        CHECK(n == classes[pP->class_index].ntypes);
+        CHECK(fields[n-1].offset + fields[n-1].len <= pP->len);
+        break;
+    }
+}
+
+static void run_checks(TwapiMofProgram **progs, Payload *payloads, int npayloads)
+{
+    TwapiMofField fields[MAX_FIELDS];
+    TwapiMofProgram *progP;
+    unsigned char random_data[MAX_PAYLOAD];
+    int i, j, n, bad, types[4];
+    unsigned int len;
+
+    /* Compilation */
+    types[0] = 14;
+    types[1] = 36;
+    CHECK(TwapiMofCompile(2, types, &progP, &bad) == ERROR_INVALID_PARAMETER && bad == 1);
+    types[1] = 44;
+    CHECK(TwapiMofCompile(2, types, &progP, &bad) == ERROR_INVALID_PARAMETER && bad == 1);
+    types[1] = -1;
+    CHECK(TwapiMofCompile(2, types, &progP, &bad) == ERROR_INVALID_PARAMETER && bad == 1);
+    /* Types after one of unknown size are still validated */
+    types[1] = 40;
+    types[2] = 37;
+    CHECK(TwapiMofCompile(3, types, &progP, &bad) == ERROR_INVALID_PARAMETER && bad == 2);
+    types[2] = 14;
+    CHECK(TwapiMofCompile(3, types, &progP, &bad) == ERROR_SUCCESS);
+    CHECK(progP->nfields == 3 && progP->nops == 1);
+    TwapiMofProgramFree(progP);
+    CHECK(TwapiMofCompile(0, types, &progP, &bad) == ERROR_SUCCESS);
+    CHECK(progP->nops == 0);
+    CHECK(TwapiMofDecode(progP, random_data, 4, 8, fields) == 0);
+    TwapiMofProgramFree(progP);
+
+    for (i = 0; i < npayloads; ++i) {
+        const Payload *pP = &payloads[i];
+        const MofClass *clsP = &classes[pP->class_index];
+        n = TwapiMofDecode(progs[pP->class_index], pP->data, pP->len,
+                           pP->pointer_size, fields);
+        check_values(pP, fields, n);
+        /* Every truncation, which is how malformed events are seen */
+        for (len = 0; len <= pP->len; ++len)
+            compare(progs[pP->class_index], clsP, pP->data, len, pP->pointer_size);
+    }
+
+    /* Random data, mostly short and with plausible counts and SIDs */
+    srand(1);
+    for (i = 0; i < 20000; ++i) {
+        int class_index = rand() % NCLASSES;
+        len = rand() % 128;
+        for (j = 0; j < (int) len; ++j)
+            random_data[j] = (unsigned char) (rand() % 4 == 0 ? rand() : rand() % 8);
+        if (len > 16 && rand() % 2)
+            random_data[16] = 1;
+        compare(progs[class_index], &classes[class_index], random_data, len,
+                rand() % 2 ? 8 : 4);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    TwapiMofProgram *progs[NCLASSES];
+    TwapiMofField fields[MAX_FIELDS];
+    Payload payloads[2 * NCLASSES];
+    int i, npayloads, bad, argi;
+    long nevents = 2000000, ev;
+    unsigned long long nfields;
+    double start, usecs, ref_usecs;
+
+    for (argi = 1; argi < argc; argi += 2) {
+        if (strcmp(argv[argi], "-events") == 0 && argi+1 < argc)
+            nevents = atol(argv[argi+1]);
+        else {
+            fprintf(stderr, "Usage: %s ?-events N?\n", argv[0]);
+            return 1;
+        }
+    }
+
+    for (i = 0; i < (int) NCLASSES; ++i)
+        CHECK(TwapiMofCompile(classes[i].ntypes, classes[i].types, &progs[i], &bad) == ERROR_SUCCESS);
+    npayloads = 0;
+    for (i = 0; i < (int) NCLASSES; ++i) {
+        build_payload(&payloads[npayloads++], i, 8);
+        build_payload(&payloads[npayloads++], i, 4);
+    }
+
+    run_checks(progs, payloads, npayloads);
+    printf("Checks passed\n");
+
+    /* Kernel classes only, as in a kernel trace */
+    nfields = 0;
+    start = now_usecs();
+    for (ev = 0; ev < nevents; ++ev) {
+        const Payload *pP = &payloads[ev % 12];
+        nfields += TwapiMofDecode(progs[pP->class_index], pP->data, pP->len,
+                                  pP->pointer_size, fields);
+    }
+    usecs = now_usecs() - start;
+
+    start = now_usecs();
+    for (ev = 0; ev < nevents; ++ev) {
+        const Payload *pP = &payloads[ev % 12];
+        const MofClass *clsP = &classes[pP->class_index];
+        nfields -= ref_decode(clsP->types, clsP->ntypes, pP->data, pP->len,
+                              pP->pointer_size, fields);
+    }
+    ref_usecs = now_usecs() - start;
+    CHECK(nfields == 0);
+
+    printf("%ld events\n", nevents);
+    printf("%-12s %14s\n", "decoder", "events/sec");
+    printf("%-12s %14.0f\n", "per-field", nevents / (ref_usecs / 1e6));
+    printf("%-12s %14.0f\n", "compiled", nevents / (usecs / 1e6));
+
+    for (i = 0; i < (int) NCLASSES; ++i)
+        TwapiMofProgramFree(progs[i]);
+    return 0;
+}
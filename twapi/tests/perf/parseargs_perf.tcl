@@ -0,0 +1,69 @@
+#
+# Copyright (c) 2018, Ashok P. Nadkarni
+# All rights reserved.
+#
+# See the file LICENSE for license
+
+# Micro-benchmark for parseargs with varying option list sizes.
+# Option lookup cost should be independent of the number of options
+# in the descriptor list.
+
+source [file join [file dirname [info script]] perfutil.tcl]
+load_twapi_package twapi_base
+
+namespace eval perf::parseargs {
+    # Builds an option descriptor list with n options of mixed types
+    proc make_optlist {n} {
+        set opts {}
+        for {set i 0} {$i < $n} {incr i} {
+            switch -exact -- [expr {$i % 4}] {
+                0 { lappend opts [list option$i.arg ""] }
+                1 { lappend opts [list option$i.int 0] }
+                2 { lappend opts [list option$i.bool 0] }
+                3 { lappend opts option$i }
+            }
+        }
+        return $opts
+    }
+
+    # Builds an argument list that specifies the option at each
+    # index in $indices
+    proc make_args {n indices} {
+        set args {}
+        foreach i $indices {
+            switch -exact -- [expr {$i % 4}] {
+                0 { lappend args -option$i value$i }
+                1 { lappend args -option$i $i }
+                2 { lappend args -option$i 1 }
+                3 { lappend args -option$i }
+            }
+        }
+        return $args
+    }
+
+    puts [format "%-40s %15s" "parseargs" "time/call"]
+    foreach n {5 20 50} {
+        set optlist [make_optlist $n]
+        # Pick options at the start, middle and end of the list since
+        # a linear search would favour the first
+        set args [make_args $n [list 0 [expr {$n/2}] [expr {$n-1}]]]
+        set t [perf::measure {
+            set argv $args
+            twapi::parseargs argv $optlist
+        }]
+        perf::report "$n options, 3 supplied" $t
+
+        set t [perf::measure {
+            set argv {}
+            twapi::parseargs argv $optlist
+        }]
+        perf::report "$n options, none supplied" $t
+
+        # Unknown options force a full miss on every lookup
+        set t [perf::measure {
+            set argv {-nosuchoption x -another y}
+            twapi::parseargs argv $optlist -ignoreunknown
+        }]
+        perf::report "$n options, 2 unknown" $t
+    }
+}
@@ -0,0 +1,157 @@
+/*
+ * Copyright (c) 2018, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ */
+
+/*
+ * Checks the native PBKDF2 against the RFC 6070 (HMAC-SHA1) and
+ * RFC 7914 (HMAC-SHA256) test vectors and reports iterations per second
+ * for keys of one output block, which are derived in a single thread,
+ * and of several blocks, which are derived in parallel. Does not need
+ * Tcl or Windows. Build and run from this directory, e.g.
+ *
+ *   cc -O2 -DCRYPTO_STANDALONE -I../../crypto -o pbkdf2_bench pbkdf2_bench.c \
+ *       ../../crypto/pbkdf2.c ../../crypto/hash.c -lpthread
+ *   ./pbkdf2_bench ?-iterations N?
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef _WIN32
+# include <windows.h>
+#else
+typedef unsigned int DWORD;
+typedef int BOOL;
+#endif
+#include "pbkdf2.h"
+
+static const struct {
+    const char *prf;
+    const char *password;
+    DWORD cbPassword;
+    const char *salt;
+    DWORD cbSalt;
+    DWORD iterations;
+    const char *hex;
+} vectors[] = {
+    /* RFC 6070 */
+    {"sha1", "password", 8, "salt", 4, 1,
+     "0c60c80f961f0e71f3a9b524af6012062fe037a6"},
+    {"sha1", "password", 8, "salt", 4, 2,
+     "ea6c014dc72d6f8ccd1ed92ace1d41f0d8de8957"},
+    {"sha1", "password", 8, "salt", 4, 4096,
+     "4b007901b765489abead49d926f721d065a429c1"},
+    {"sha1", "password", 8, "salt", 4, 16777216,
+     "eefe3d61cd4da4e4e9945b3d6ba2158c2634e984"},
+    {"sha1", "passwordPASSWORDpassword", 24,
+     "saltSALTsaltSALTsaltSALTsaltSALTsalt", 36, 4096,
+     "3d2eec4fe41c849b80c8d83662c0e44a8b291a964cf2f07038"},
+    {"sha1", "pass\0word", 9, "sa\0lt", 5, 4096,
+     "56fa6aa75548099dcc37d7f03425e0c3"},
+    /* RFC 7914 */
+    {"sha256", "passwd", 6, "salt", 4, 1,
+     "55ac046e56e3089fec1691c22544b605f94185216dde0465e68b9d57c20dacbc"
+     "49ca9cccf179b645991664b39d77ef317c71b845b1e30bd509112041d3a19783"},
+    {"sha256", "Password", 8, "NaCl", 4, 80000,
+     "4ddcd8f60b98be21830cee5ef22701f9641a4418d04c0414aeff08876b34ab56"
+     "a1d425a1225833549adb841b51c9b3176a272bdebba1d078478f62b397f33c8d"},
+    /* Pass phrase longer than the HMAC block size (RFC 3962) */
+    {"sha1",
+     "XXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXX", 65,
+     "pass phrase exceeds block size", 30, 1200,
+     "9ccad6d468770cd51b10e6a68721be611a8b4d282601db3b36be9246915ec82a"},
+};
+
+static double now_usecs(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static PRF *prf_by_name(const char *name)
+{
+    return strcmp(name, "sha1") == 0 ? &sha1Prf : &sha256Prf;
+}
+
+static int check_vectors(void)
+{
+    unsigned char key[64];
+    char hex[129];
+    DWORD i, j, cbKey;
+    int failures = 0;
+
+    for (i = 0; i < sizeof(vectors)/sizeof(vectors[0]); ++i) {
+        cbKey = (DWORD) strlen(vectors[i].hex) / 2;
+        if (!PBKDF2(prf_by_name(vectors[i].prf),
+                    (unsigned char *) vectors[i].password, vectors[i].cbPassword,
+                    (unsigned char *) vectors[i].salt, vectors[i].cbSalt,
+                    vectors[i].iterations, key, cbKey)) {
+            printf("Vector %u: PBKDF2 failed\n", i);
+            ++failures;
+            continue;
+        }
+        for (j = 0; j < cbKey; ++j)
+            sprintf(hex + 2 * j, "%02x", key[j]);
+        if (strcmp(hex, vectors[i].hex) != 0) {
+            printf("Vector %u: got %s, expected %s\n", i, hex, vectors[i].hex);
+            ++failures;
+        }
+    }
+    printf("%u test vectors, %d failures\n\n",
+           (unsigned) (sizeof(vectors)/sizeof(vectors[0])), failures);
+    return failures;
+}
+
+/* Returns iterations per second summed over all output blocks */
+static double bench(PRF *prf, DWORD nblocks, DWORD iterations)
+{
+    unsigned char key[16 * 32];
+    double start, usecs, best = 0;
+    int round;
+
+    for (round = 0; round < 3; ++round) {
+        start = now_usecs();
+        PBKDF2(prf, (unsigned char *) "password", 8, (unsigned char *) "salt", 4,
+               iterations, key, nblocks * prf->cbHmacLength);
+        usecs = now_usecs() - start;
+        if (round == 0 || usecs < best)
+            best = usecs;
+    }
+    return (1e6 * nblocks * iterations) / best;
+}
+
+int main(int argc, char *argv[])
+{
+    static const char *prfs[] = {"sha1", "sha256"};
+    static const DWORD nblocks[] = {1, 2, 4, 8, 16};
+    DWORD iterations = 200000;
+    double single, rate;
+    int i, j;
+
+    if (argc > 2 && strcmp(argv[1], "-iterations") == 0)
+        iterations = atoi(argv[2]);
+
+    if (check_vectors())
+        return 1;
+
+    printf("%-8s %8s %10s %16s %9s\n", "prf", "blocks", "iterations",
+           "iterations/sec", "speedup");
+    for (i = 0; i < 2; ++i) {
+        PRF *prf = prf_by_name(prfs[i]);
+        single = 0;
+        for (j = 0; j < (int) (sizeof(nblocks)/sizeof(nblocks[0])); ++j) {
+            rate = bench(prf, nblocks[j], iterations);
+            if (j == 0)
+                single = rate;
+            printf("%-8s %8u %10u %16.0f %8.2fx\n", prfs[i], nblocks[j],
+                   iterations, rate, rate / single);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,161 @@
+/*
+ * Copyright (c) 2018, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ */
+
+/*
+ * Measures encoding and decoding of PEM bundles with the native codec
+ * using the portable loops and, where the processor supports it, the
+ * SSSE3 loops. The bundle is round tripped and checked before timing.
+ * Does not need Tcl or Windows. Build and run from this directory, e.g.
+ *
+ *   cc -O2 -DCRYPTO_STANDALONE -I../../crypto -o pem_bench pem_bench.c \
+ *       ../../crypto/pem.c
+ *   ./pem_bench ?-certs N? ?-size BYTES?
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "pem.h"
+
+static double now_usecs(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* Encodes ncerts certificates of size bytes each into a bundle */
+static size_t encode_bundle(const unsigned char *ders, size_t ncerts,
+                            size_t size, char *outP)
+{
+    size_t i, n = 0;
+    for (i = 0; i < ncerts; ++i)
+        n += TwapiPemEncode("CERTIFICATE", 11, ders + i * size, size, outP + n);
+    return n;
+}
+
+/* Returns number of blocks decoded or -1 on error */
+static long decode_bundle(const char *p, size_t n, unsigned char *outP)
+{
+    TwapiPemBlock block;
+    size_t nbytes;
+    long nblocks = 0;
+    int status;
+
+    while ((status = TwapiPemNext(p, n, &block)) == 1) {
+        if (TwapiBase64Decode(block.bodyP, block.nbody, outP, &nbytes) != 0)
+            return -1;
+        outP += nbytes;
+        p += block.next;
+        n -= block.next;
+        ++nblocks;
+    }
+    return status < 0 ? -1 : nblocks;
+}
+
+/*
+ * TwapiIsPem and TwapiPemNext must agree on what starts a block. Returns
+ * 0 on success.
+ */
+static int check_markers(void)
+{
+    static const char *texts[] = {
+        "-----BEGIN X-----\nAAAA\n-----END X-----\n",
+        "  -----begin X-----\nAAAA\n-----end X-----\n",
+        "----- Begin  X-----\nAAAA\n----- END X-----\n",
+        "-----BEGINX-----\nAAAA\n-----END X-----\n",
+        "-----BEGIN",
+        "AAAA",
+    };
+    TwapiPemBlock block;
+    size_t i, n;
+    int status;
+
+    for (i = 0; i < sizeof(texts) / sizeof(texts[0]); ++i) {
+        n = strlen(texts[i]);
+        status = TwapiPemNext(texts[i], n, &block);
+        if (TwapiIsPem(texts[i], n) != (status != 0) ||
+            (status == 1 && (block.nlabel != 1 || block.labelP[0] != 'X' ||
+                             block.nbody != 5 || block.next != n))) {
+            printf("Marker check failed for \"%s\"\n", texts[i]);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t ncerts = 5000, size = 1200, i, nbundle;
+    unsigned char *ders, *decoded;
+    char *bundle;
+    double start, enc_usecs, dec_usecs, best_enc, best_dec;
+    int simd, round, have_simd;
+
+    for (i = 1; i + 1 < (size_t) argc; i += 2) {
+        if (strcmp(argv[i], "-certs") == 0)
+            ncerts = atoi(argv[i+1]);
+        else if (strcmp(argv[i], "-size") == 0)
+            size = atoi(argv[i+1]);
+    }
+
+    if (check_markers() != 0)
+        return 1;
+
+    ders = malloc(ncerts * size);
+    decoded = malloc(ncerts * size + 3);
+    bundle = malloc(ncerts * TwapiPemEncodedSize(11, size));
+    if (ders == NULL || decoded == NULL || bundle == NULL)
+        return 1;
+    srand(1);
+    for (i = 0; i < ncerts * size; ++i)
+        ders[i] = (unsigned char) rand();
+
+    /* Forces the processor check */
+    gTwapiBase64Simd = -1;
+    encode_bundle(ders, 1, size, bundle);
+    have_simd = gTwapiBase64Simd > 0;
+
+    printf("%lu certificates of %lu bytes\n\n",
+           (unsigned long) ncerts, (unsigned long) size);
+    printf("%-10s %14s %14s %14s\n", "loops", "encode MB/s", "decode MB/s",
+           "certs/sec");
+    for (simd = 0; simd <= have_simd; ++simd) {
+        gTwapiBase64Simd = simd;
+        nbundle = encode_bundle(ders, ncerts, size, bundle);
+        memset(decoded, 0, ncerts * size);
+        if (decode_bundle(bundle, nbundle, decoded) != (long) ncerts ||
+            memcmp(decoded, ders, ncerts * size) != 0) {
+            printf("Round trip failed\n");
+            return 1;
+        }
+        best_enc = best_dec = 0;
+        for (round = 0; round < 5; ++round) {
+            start = now_usecs();
+            encode_bundle(ders, ncerts, size, bundle);
+            enc_usecs = now_usecs() - start;
+            start = now_usecs();
+            decode_bundle(bundle, nbundle, decoded);
+            dec_usecs = now_usecs() - start;
+            if (round == 0 || enc_usecs < best_enc)
+                best_enc = enc_usecs;
+            if (round == 0 || dec_usecs < best_dec)
+                best_dec = dec_usecs;
+        }
+        /* Rates are in terms of the PEM text */
+        printf("%-10s %14.0f %14.0f %14.0f\n", simd ? "ssse3" : "portable",
+               nbundle / best_enc, nbundle / best_dec,
+               ncerts * 1e6 / best_dec);
+    }
+
+    free(ders);
+    free(decoded);
+    free(bundle);
+    return 0;
+}
@@ -0,0 +1,77 @@
+#
+# Copyright (c) 2018, Ashok P. Nadkarni
+# All rights reserved.
+#
+# See the file LICENSE for license
+
+# Decoding and encoding a PEM bundle of certificates through
+# CryptStringToBinary/CryptBinaryToString with script level splitting,
+# as done previously by _pem_decode and cert_store_export_pem, compared
+# with the native codec, e.g.
+#    tclsh pem_perf.tcl ?-iterations N? ?-certs N?
+
+source [file join [file dirname [info script]] perfutil.tcl]
+load_twapi_package twapi
+
+namespace eval perf::pem {
+    if {[lsearch -exact $::argv -iterations] < 0} {
+        set perf::iterations 5
+    }
+    set ncerts 5000
+    if {[set pos [lsearch -exact $::argv -certs]] >= 0} {
+        set ncerts [lindex $::argv [incr pos]]
+    }
+
+    # Content does not need to be a valid certificate for the codec
+    set ders {}
+    for {set i 0} {$i < $ncerts} {incr i} {
+        lappend ders [twapi::random_bytes 1200]
+    }
+
+    proc capi_encode {ders} {
+        set pem {}
+        foreach der $ders {
+            append pem "-----BEGIN CERTIFICATE-----\n[twapi::CryptBinaryToString $der 0x80000001]-----END CERTIFICATE-----\n" \n
+        }
+        return $pem
+    }
+
+    proc native_encode {ders} {
+        set pem {}
+        foreach der $ders {
+            append pem [twapi::pem_encode $der CERTIFICATE] \n
+        }
+        return $pem
+    }
+
+    proc capi_decode {bundle} {
+        set ders {}
+        foreach block [regexp -all -inline {-----BEGIN CERTIFICATE-----.*?-----END CERTIFICATE-----} $bundle] {
+            # 6 -> CRYPT_STRING_BASE64_ANY
+            lappend ders [twapi::CryptStringToBinary $block 6]
+        }
+        return $ders
+    }
+
+    proc native_decode {bundle} {
+        set ders {}
+        foreach {label der} [twapi::pem_decode $bundle] {
+            lappend ders $der
+        }
+        return $ders
+    }
+
+    set bundle [capi_encode $ders]
+    if {$bundle ne [native_encode $ders] ||
+        [capi_decode $bundle] ne [native_decode $bundle]} {
+        error "Native and CAPI results differ"
+    }
+
+    puts [format "%-40s %15s %15s %9s" "$ncerts certificates" "capi" "native" "speedup"]
+    perf::compare "encode bundle" \
+        [perf::measure [list capi_encode $ders]] \
+        [perf::measure [list native_encode $ders]]
+    perf::compare "decode bundle" \
+        [perf::measure [list capi_decode $bundle]] \
+        [perf::measure [list native_decode $bundle]]
+}
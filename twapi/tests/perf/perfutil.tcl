@@ -0,0 +1,53 @@
+#
+# Copyright (c) 2018, Ashok P. Nadkarni
+# All rights reserved.
+#
+# See the file LICENSE for license
+
+# Common procedures for the performance measurement scripts in this
+# directory. These are not tcltest tests - each script prints a table
+# of timings. Run from the tests/perf directory, e.g.
+#    tclsh parseargs_perf.tcl ?-iterations N?
+
+source [file join [file dirname [info script]] .. testutil.tcl]
+
+namespace eval perf {
+    variable iterations 10000
+    if {[set pos [lsearch -exact $::argv -iterations]] >= 0} {
+        set iterations [lindex $::argv [incr pos]]
+    }
+}
+
+# Runs script $iterations times in the caller's context and returns
+# microseconds per iteration
+proc perf::measure {script {iters {}}} {
+    variable iterations
+    if {$iters eq ""} {
+        set iters $iterations
+    }
+    # Warm up so any lazily compiled internal reps are in place
+    uplevel 1 $script
+    return [lindex [uplevel 1 [list time $script $iters]] 0]
+}
+
+# Prints a row of the result table. label is the measurement name,
+# usecs is microseconds per iteration and optional items is the number
+# of items processed per iteration for computing throughput.
+proc perf::report {label usecs {items {}}} {
+    if {$items eq "" || $usecs == 0} {
+        puts [format "%-40s %12.3f us" $label $usecs]
+    } else {
+        puts [format "%-40s %12.3f us %14.0f items/sec" $label $usecs \
+                  [expr {(1000000.0 * $items) / $usecs}]]
+    }
+}
+
+# Prints a row comparing two timings of the same operation
+proc perf::compare {label base_usecs new_usecs} {
+    if {$new_usecs == 0} {
+        set ratio inf
+    } else {
+        set ratio [format %.2f [expr {double($base_usecs)/$new_usecs}]]
+    }
+    puts [format "%-40s %12.3f us %12.3f us %8sx" $label $base_usecs $new_usecs $ratio]
+}
@@ -0,0 +1,225 @@
+/*
+ * Copyright (c) 2018, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ */
+
+/*
+ * Mock SSPI stream provider shared by the sspistream and tlschan
+ * tests. Records have a TLS style header carrying the record type, data
+ * length and trailer length, and the data is XORed with 0x5C. The
+ * header and trailer can be shortened as schannel does for some
+ * ciphers. Included by a single source file, so all definitions are
+ * static.
+ */
+
+#ifndef TWAPI_SSPIMOCK_H
+#define TWAPI_SSPIMOCK_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CHECK(cond_)                                                    \
+    do {                                                                \
+        if (!(cond_)) {                                                 \
+            fprintf(stderr, "Check failed at line %d: %s\n", __LINE__, #cond_); \
+            abort();                                                    \
+        }                                                               \
+    } while (0)
+
+/* Mock provider state */
+static SecPkgContext_StreamSizes gSizes;
+static int gShortHeader;        /* Header shortened by this much */
+static int gVariableTrailer;    /* Trailer shortened by data length % 16 */
+static long gFailRecord = -1;   /* Record number to fail */
+static long gRecords;
+
+static SECURITY_STATUS MockEncryptMessage(PCtxtHandle ctxP, ULONG qop,
+                                          PSecBufferDesc sbdP, ULONG seqnum)
+{
+    SecBuffer *hdrP, *dataP, *trlP;
+    unsigned char *p;
+    ULONG i, hdrlen, trllen;
+
+    CHECK(sbdP->ulVersion == SECBUFFER_VERSION && sbdP->cBuffers == 4);
+    hdrP = &sbdP->pBuffers[0];
+    dataP = &sbdP->pBuffers[1];
+    trlP = &sbdP->pBuffers[2];
+    CHECK(hdrP->BufferType == SECBUFFER_STREAM_HEADER);
+    CHECK(dataP->BufferType == SECBUFFER_DATA);
+    CHECK(trlP->BufferType == SECBUFFER_STREAM_TRAILER);
+    CHECK(sbdP->pBuffers[3].BufferType == SECBUFFER_EMPTY);
+    CHECK(hdrP->cbBuffer == gSizes.cbHeader && trlP->cbBuffer == gSizes.cbTrailer);
+    /* schannel requires the buffers to be contiguous */
+    CHECK((unsigned char *) hdrP->pvBuffer + hdrP->cbBuffer == dataP->pvBuffer);
+    CHECK((unsigned char *) dataP->pvBuffer + dataP->cbBuffer == trlP->pvBuffer);
+
+    if (dataP->cbBuffer > gSizes.cbMaximumMessage || dataP->cbBuffer == 0)
+        return SEC_E_INVALID_TOKEN;
+    if (gRecords++ == gFailRecord)
+        return SEC_E_INVALID_TOKEN;
+
+    hdrlen = gSizes.cbHeader - gShortHeader;
+    trllen = gSizes.cbTrailer - (gVariableTrailer ? dataP->cbBuffer % 16 : 0);
+
+    /* Data stays where it was passed in, header is right justified */
+    p = (unsigned char *) dataP->pvBuffer - hdrlen;
+    p[0] = 0x17;
+    p[1] = (unsigned char) (dataP->cbBuffer >> 8);
+    p[2] = (unsigned char) dataP->cbBuffer;
+    p[3] = (unsigned char) trllen;
+    for (i = 4; i < hdrlen; ++i)
+        p[i] = 0xAA;
+    hdrP->pvBuffer = p;
+    hdrP->cbBuffer = hdrlen;
+
+    p = dataP->pvBuffer;
+    for (i = 0; i < dataP->cbBuffer; ++i)
+        p[i] ^= 0x5C;
+
+    memset(trlP->pvBuffer, 0xEE, trllen);
+    trlP->cbBuffer = trllen;
+    return SEC_E_OK;
+}
+
+/* Record types other than data that the mock decrypt understands */
+#define MOCK_CLOSE_NOTIFY 0x15
+#define MOCK_HELLO_REQUEST 0x16
+
+static SECURITY_STATUS MockDecryptMessage(PCtxtHandle ctxP, PSecBufferDesc sbdP,
+                                          ULONG seqnum, ULONG *qopP)
+{
+    SecBuffer *bufs = sbdP->pBuffers;
+    unsigned char *p = bufs[0].pvBuffer;
+    ULONG i, n = bufs[0].cbBuffer, hdrlen = gSizes.cbHeader - gShortHeader;
+    ULONG datalen, trllen, total;
+
+    CHECK(sbdP->ulVersion == SECBUFFER_VERSION && sbdP->cBuffers == 4);
+    CHECK(bufs[0].BufferType == SECBUFFER_DATA);
+    for (i = 1; i < 4; ++i)
+        CHECK(bufs[i].BufferType == SECBUFFER_EMPTY);
+
+    if (n < hdrlen)
+        return SEC_E_INCOMPLETE_MESSAGE;
+    datalen = (p[1] << 8) | p[2];
+    trllen = p[3];
+    total = hdrlen + datalen + trllen;
+    if (n < total)
+        return SEC_E_INCOMPLETE_MESSAGE;
+
+    ++gRecords;
+    bufs[0].BufferType = SECBUFFER_STREAM_HEADER;
+    bufs[0].cbBuffer = hdrlen;
+    bufs[1].BufferType = SECBUFFER_DATA;
+    bufs[1].pvBuffer = p + hdrlen;
+    bufs[1].cbBuffer = datalen;
+    bufs[2].BufferType = SECBUFFER_STREAM_TRAILER;
+    bufs[2].pvBuffer = p + hdrlen + datalen;
+    bufs[2].cbBuffer = trllen;
+    if (n > total) {
+        bufs[3].BufferType = SECBUFFER_EXTRA;
+        /* Deliberately wrong, callers must not rely on it */
+        bufs[3].pvBuffer = NULL;
+        bufs[3].cbBuffer = n - total;
+    }
+
+    switch (p[0]) {
+    case 0x17:
+        for (i = 0; i < datalen; ++i)
+            p[hdrlen + i] ^= 0x5C;
+        return SEC_E_OK;
+    case MOCK_CLOSE_NOTIFY:
+        bufs[1].cbBuffer = 0;
+        return SEC_I_CONTEXT_EXPIRED;
+    case MOCK_HELLO_REQUEST:
+        bufs[1].cbBuffer = 0;
+        return SEC_I_RENEGOTIATE;
+    default:
+        return SEC_E_INVALID_TOKEN;
+    }
+}
+
+
+/* Set on the context handle by ApplyControlToken */
+#define MOCK_SHUTDOWN 0x1
+
+static long gDeletedContexts;
+static long gFreedCredentials;
+
+static SECURITY_STATUS MockApplyControlToken(PCtxtHandle ctxP,
+                                             PSecBufferDesc sbdP)
+{
+    CHECK(sbdP->cBuffers == 1 && sbdP->pBuffers[0].BufferType == SECBUFFER_TOKEN);
+    CHECK(*(ULONG *) sbdP->pBuffers[0].pvBuffer == SCHANNEL_SHUTDOWN);
+    ctxP->dwUpper |= MOCK_SHUTDOWN;
+    return SEC_E_OK;
+}
+
+/* Only supports generating the close_notify after ApplyControlToken */
+static SECURITY_STATUS MockShutdownToken(PCtxtHandle ctxP, ULONG req,
+                                         PSecBufferDesc sbdP)
+{
+    ULONG hdrlen = gSizes.cbHeader - gShortHeader;
+    unsigned char *p;
+
+    CHECK(ctxP && (ctxP->dwUpper & MOCK_SHUTDOWN));
+    CHECK(req & ISC_REQ_ALLOCATE_MEMORY);
+    CHECK(sbdP->cBuffers == 1 && sbdP->pBuffers[0].BufferType == SECBUFFER_TOKEN);
+    p = calloc(1, hdrlen);
+    p[0] = MOCK_CLOSE_NOTIFY;
+    sbdP->pBuffers[0].pvBuffer = p;
+    sbdP->pBuffers[0].cbBuffer = hdrlen;
+    return SEC_E_OK;
+}
+
+static SECURITY_STATUS MockInitializeSecurityContextW(
+    PCredHandle credP, PCtxtHandle ctxP, SEC_WCHAR *targetP, ULONG req,
+    ULONG reserved1, ULONG datarep, PSecBufferDesc inP, ULONG reserved2,
+    PCtxtHandle newctxP, PSecBufferDesc outP, ULONG *attrP,
+    PTimeStamp expiryP)
+{
+    CHECK(inP == NULL);
+    return MockShutdownToken(ctxP, req, outP);
+}
+
+static SECURITY_STATUS MockAcceptSecurityContext(
+    PCredHandle credP, PCtxtHandle ctxP, PSecBufferDesc inP, ULONG req,
+    ULONG datarep, PCtxtHandle newctxP, PSecBufferDesc outP, ULONG *attrP,
+    PTimeStamp expiryP)
+{
+    CHECK(inP == NULL);
+    return MockShutdownToken(ctxP, req, outP);
+}
+
+static SECURITY_STATUS MockFreeContextBuffer(void *pv)
+{
+    free(pv);
+    return SEC_E_OK;
+}
+
+static SECURITY_STATUS MockDeleteSecurityContext(PCtxtHandle ctxP)
+{
+    ++gDeletedContexts;
+    return SEC_E_OK;
+}
+
+static SECURITY_STATUS MockFreeCredentialsHandle(PCredHandle credP)
+{
+    ++gFreedCredentials;
+    return SEC_E_OK;
+}
+
+static SecurityFunctionTableW gMockFns = {
+    MockEncryptMessage,
+    MockDecryptMessage,
+    MockInitializeSecurityContextW,
+    MockAcceptSecurityContext,
+    MockApplyControlToken,
+    MockDeleteSecurityContext,
+    MockFreeCredentialsHandle,
+    MockFreeContextBuffer,
+};
+
+#endif
@@ -0,0 +1,459 @@
+/*
+ * Copyright (c) 2018, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ */
+
+/*
+ * Checks multi-record stream encryption and buffered decryption against
+ * the mock SSPI provider table in sspimock.h. The mock enforces the
+ * record size limit as schannel does, frames each record with a TLS
+ * style header carrying the length, and can shorten the header and
+ * trailer or fail a given record. Its cipher is a trivial XOR so the
+ * timings mostly reflect buffer management. The encrypted output is
+ * parsed back record by record and compared with the input, and is
+ * then fed in random sized pieces through a TwapiStreamBuffer. Also
+ * times both directions against the previous per call copying. Does not
+ * need Tcl or Windows.
+ * Build and run from this directory, e.g.
+ *
+ *   cc -O2 -DCRYPTO_STANDALONE -I../../crypto -o sspistream_test \
+ *       sspistream_test.c ../../crypto/sspistream.c
+ *   ./sspistream_test ?-iterations N?
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sspistream.h"
+#include "sspimock.h"
+
+/* Decodes records written by the mock. Returns plaintext length or -1. */
+static long parse_records(const unsigned char *p, size_t n,
+                          unsigned char *plainP, long *nrecordsP)
+{
+    size_t hdrlen = gSizes.cbHeader - gShortHeader;
+    size_t datalen, trllen, i;
+    long nplain = 0;
+
+    *nrecordsP = 0;
+    while (n) {
+        if (n < hdrlen || p[0] != 0x17)
+            return -1;
+        datalen = (p[1] << 8) | p[2];
+        trllen = p[3];
+        if (datalen > gSizes.cbMaximumMessage || n < hdrlen + datalen + trllen)
+            return -1;
+        for (i = 0; i < datalen; ++i)
+            plainP[nplain++] = p[hdrlen + i] ^ 0x5C;
+        for (i = 0; i < trllen; ++i)
+            if (p[hdrlen + datalen + i] != 0xEE)
+                return -1;
+        p += hdrlen + datalen + trllen;
+        n -= hdrlen + datalen + trllen;
+        ++*nrecordsP;
+    }
+    return nplain;
+}
+
+static void check_encrypt(const unsigned char *dataP, size_t n)
+{
+    CtxtHandle ctx = {0, 0};
+    unsigned char *outP, *plainP;
+    size_t nout, maxout;
+    long nrecords;
+    SECURITY_STATUS ss;
+
+    maxout = TWAPI_ENCRYPT_STREAM_MAX(&gSizes, n);
+    outP = malloc(maxout ? maxout : 1);
+    plainP = malloc(n ? n : 1);
+    gRecords = 0;
+    ss = TwapiEncryptStream(&gMockFns, &ctx, 0, &gSizes, dataP, n, outP, &nout);
+    CHECK(ss == SEC_E_OK);
+    CHECK(nout <= maxout);
+    CHECK(gRecords == (long) ((n + gSizes.cbMaximumMessage - 1) / gSizes.cbMaximumMessage));
+    CHECK(parse_records(outP, nout, plainP, &nrecords) == (long) n);
+    CHECK(nrecords == gRecords);
+    CHECK(n == 0 || memcmp(plainP, dataP, n) == 0);
+    free(outP);
+    free(plainP);
+}
+
+static double now_usecs(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/*
+ * The previous EncryptStream: one record per call into a new buffer
+ * with the remainder copied out for the next call, and the fragments
+ * joined at the end.
+ */
+static size_t encrypt_per_record(const unsigned char *dataP, size_t n,
+                                 unsigned char *outP)
+{
+    CtxtHandle ctx = {0, 0};
+    unsigned char *leftP, *recP;
+    size_t chunk, nrec, nout = 0;
+
+    leftP = malloc(n);
+    memcpy(leftP, dataP, n);
+    while (n) {
+        chunk = n < gSizes.cbMaximumMessage ? n : gSizes.cbMaximumMessage;
+        recP = malloc(gSizes.cbHeader + chunk + gSizes.cbTrailer);
+        TwapiEncryptStream(&gMockFns, &ctx, 0, &gSizes, leftP, chunk, recP, &nrec);
+        memmove(leftP, leftP + chunk, n - chunk);
+        n -= chunk;
+        memcpy(outP + nout, recP, nrec);
+        nout += nrec;
+        free(recP);
+    }
+    free(leftP);
+    return nout;
+}
+
+static void check_stream_buffer(const TwapiStreamBuffer *sbP)
+{
+    CHECK(sbP->pstart <= sbP->pend && sbP->pend <= sbP->cstart);
+    CHECK(sbP->cstart <= sbP->cend && sbP->cend <= sbP->size);
+}
+
+/*
+ * Encrypts n bytes and feeds the records to a stream buffer in random
+ * sized pieces, reading random amounts of plaintext in between.
+ */
+static void check_decrypt(const unsigned char *dataP, size_t n, size_t maxpiece)
+{
+    CtxtHandle ctx = {0, 0};
+    TwapiStreamBuffer *sbP;
+    unsigned char *encP, *plainP;
+    size_t nenc, off, piece, nplain, nread;
+
+    encP = malloc(TWAPI_ENCRYPT_STREAM_MAX(&gSizes, n));
+    plainP = malloc(n ? n : 1);
+    CHECK(TwapiEncryptStream(&gMockFns, &ctx, 0, &gSizes, dataP, n, encP, &nenc) == SEC_E_OK);
+
+    sbP = TwapiStreamBufferNew();
+    nplain = 0;
+    for (off = 0; off < nenc; off += piece) {
+        piece = 1 + rand() % maxpiece;
+        if (piece > nenc - off)
+            piece = nenc - off;
+        CHECK(TwapiStreamBufferAppend(sbP, encP + off, piece));
+        check_stream_buffer(sbP);
+        CHECK(TwapiStreamBufferDecrypt(&gMockFns, &ctx, sbP) == SEC_E_OK);
+        check_stream_buffer(sbP);
+        /* Leave some plaintext behind at times so it accumulates */
+        nread = TwapiStreamBufferPlaintextSize(sbP);
+        if (rand() % 3 == 0)
+            nread = rand() % (nread + 1);
+        if (nread)
+            memcpy(plainP + nplain, TwapiStreamBufferPlaintext(sbP), nread);
+        nplain += nread;
+        TwapiStreamBufferConsume(sbP, nread);
+        check_stream_buffer(sbP);
+    }
+    nread = TwapiStreamBufferPlaintextSize(sbP);
+    if (nread)
+        memcpy(plainP + nplain, TwapiStreamBufferPlaintext(sbP), nread);
+    nplain += nread;
+    TwapiStreamBufferConsume(sbP, nread);
+
+    CHECK(nplain == n);
+    CHECK(n == 0 || memcmp(plainP, dataP, n) == 0);
+    CHECK(sbP->pstart == 0 && sbP->cend == 0);
+    TwapiStreamBufferFree(sbP);
+    free(encP);
+    free(plainP);
+}
+
+/* Data record, then a control record, then more data */
+static void check_decrypt_status(unsigned char type, SECURITY_STATUS expected)
+{
+    CtxtHandle ctx = {0, 0};
+    TwapiStreamBuffer *sbP;
+    unsigned char enc[200], ctl[5] = {0, 0, 0, 0, 0xAA};
+    size_t nenc;
+
+    CHECK(TwapiEncryptStream(&gMockFns, &ctx, 0, &gSizes,
+                             (const unsigned char *) "abc", 3, enc, &nenc) == SEC_E_OK);
+    sbP = TwapiStreamBufferNew();
+    TwapiStreamBufferAppend(sbP, enc, nenc);
+    ctl[0] = type;
+    TwapiStreamBufferAppend(sbP, ctl, sizeof(ctl));
+    TwapiStreamBufferAppend(sbP, enc, nenc);
+    CHECK(TwapiStreamBufferDecrypt(&gMockFns, &ctx, sbP) == expected);
+    CHECK(TwapiStreamBufferPlaintextSize(sbP) == 3);
+    CHECK(memcmp(TwapiStreamBufferPlaintext(sbP), "abc", 3) == 0);
+    CHECK(sbP->cend - sbP->cstart == nenc);
+    check_stream_buffer(sbP);
+
+    /* Decrypting continues from there. Garbage is an error. */
+    TwapiStreamBufferConsume(sbP, 3);
+    TwapiStreamBufferAppend(sbP, (const unsigned char *) "\x42\0\0\0\0", 5);
+    CHECK(TwapiStreamBufferDecrypt(&gMockFns, &ctx, sbP) == SEC_E_INVALID_TOKEN);
+    CHECK(TwapiStreamBufferPlaintextSize(sbP) == 3);
+    TwapiStreamBufferFree(sbP);
+}
+
+/*
+ * The previous receive path for each read from the socket. DecryptStream
+ * copied the saved remainder and the new data into one buffer and
+ * returned the plaintext and remainder of each record as new objects,
+ * sspi_decrypt_stream joined the plaintext and tls::read appended it to
+ * Input, handing out readsize bytes at a time with the rest recopied
+ * by string range.
+ */
+typedef struct {
+    unsigned char *extraP;
+    size_t nextra;
+    unsigned char *inputP;
+    size_t ninput;
+} OldReceiveState;
+
+static size_t old_receive(OldReceiveState *stP, const unsigned char *dataP,
+                          size_t n, size_t readsize, unsigned char *outP)
+{
+    CtxtHandle ctx = {0, 0};
+    SecBuffer sbufs[4];
+    SecBufferDesc sbd;
+    SECURITY_STATUS ss;
+    unsigned char *inP, *plainP, *joinedP, *p;
+    unsigned char *pieces[64];
+    size_t npieces[64], i, npiece = 0, njoined = 0, nin, nout = 0, chunk;
+
+    nin = stP->nextra + n;
+    for (;;) {
+        inP = malloc(nin ? nin : 1);
+        if (stP->nextra)
+            memcpy(inP, stP->extraP, stP->nextra);
+        if (n)
+            memcpy(inP + stP->nextra, dataP, n);
+        n = 0;
+        sbufs[0].BufferType = SECBUFFER_DATA;
+        sbufs[0].pvBuffer = inP;
+        sbufs[0].cbBuffer = (ULONG) nin;
+        for (i = 1; i < 4; ++i) {
+            sbufs[i].BufferType = SECBUFFER_EMPTY;
+            sbufs[i].cbBuffer = 0;
+        }
+        sbd.ulVersion = SECBUFFER_VERSION;
+        sbd.cBuffers = 4;
+        sbd.pBuffers = sbufs;
+        ss = MockDecryptMessage(&ctx, &sbd, 0, NULL);
+        free(stP->extraP);
+        if (ss != SEC_E_OK) {
+            stP->extraP = inP;  /* Incomplete, returned as extra */
+            stP->nextra = nin;
+            break;
+        }
+        plainP = malloc(sbufs[1].cbBuffer);
+        memcpy(plainP, sbufs[1].pvBuffer, sbufs[1].cbBuffer);
+        pieces[npiece] = plainP;
+        npieces[npiece++] = sbufs[1].cbBuffer;
+        njoined += sbufs[1].cbBuffer;
+        nin = sbufs[3].BufferType == SECBUFFER_EXTRA ? sbufs[3].cbBuffer : 0;
+        stP->extraP = malloc(nin ? nin : 1);
+        memcpy(stP->extraP, inP + sbufs[0].cbBuffer + sbufs[1].cbBuffer + sbufs[2].cbBuffer, nin);
+        stP->nextra = nin;
+        free(inP);
+        if (nin == 0 || npiece == 64)
+            break;
+    }
+
+    joinedP = malloc(njoined ? njoined : 1);
+    for (p = joinedP, i = 0; i < npiece; ++i) {
+        memcpy(p, pieces[i], npieces[i]);
+        p += npieces[i];
+        free(pieces[i]);
+    }
+    stP->inputP = realloc(stP->inputP, stP->ninput + njoined + 1);
+    memcpy(stP->inputP + stP->ninput, joinedP, njoined);
+    stP->ninput += njoined;
+    free(joinedP);
+
+    while (stP->ninput) {
+        chunk = stP->ninput < readsize ? stP->ninput : readsize;
+        memcpy(outP + nout, stP->inputP, chunk);
+        nout += chunk;
+        p = malloc(stP->ninput - chunk + 1);
+        memcpy(p, stP->inputP + chunk, stP->ninput - chunk);
+        free(stP->inputP);
+        stP->inputP = p;
+        stP->ninput -= chunk;
+    }
+    return nout;
+}
+
+static size_t new_receive(TwapiStreamBuffer *sbP, const unsigned char *dataP,
+                          size_t n, size_t readsize, unsigned char *outP)
+{
+    CtxtHandle ctx = {0, 0};
+    size_t nout = 0, chunk;
+
+    TwapiStreamBufferAppend(sbP, dataP, n);
+    TwapiStreamBufferDecrypt(&gMockFns, &ctx, sbP);
+    while ((chunk = TwapiStreamBufferPlaintextSize(sbP)) != 0) {
+        if (chunk > readsize)
+            chunk = readsize;
+        memcpy(outP + nout, TwapiStreamBufferPlaintext(sbP), chunk);
+        TwapiStreamBufferConsume(sbP, chunk);
+        nout += chunk;
+    }
+    return nout;
+}
+
+static void time_decrypt(const unsigned char *dataP, size_t n, long iterations)
+{
+    static const size_t sockreads[] = {1460, 4096, 65536};
+    CtxtHandle ctx = {0, 0};
+    unsigned char *encP, *outP;
+    size_t nenc, off, piece, nout, i;
+    long iter;
+    double start, usecs_old, usecs_new;
+    OldReceiveState old;
+    TwapiStreamBuffer *sbP;
+
+    encP = malloc(TWAPI_ENCRYPT_STREAM_MAX(&gSizes, n));
+    outP = malloc(n);
+    TwapiEncryptStream(&gMockFns, &ctx, 0, &gSizes, dataP, n, encP, &nenc);
+    /* The mock decrypts in place so work on a copy each time */
+    printf("%10s %14s %14s\n", "read size", "buffer MB/s", "previous MB/s");
+    for (i = 0; i < sizeof(sockreads) / sizeof(sockreads[0]); ++i) {
+        unsigned char *workP = malloc(nenc);
+        usecs_old = usecs_new = 0;
+        for (iter = 0; iter < iterations; ++iter) {
+            memcpy(workP, encP, nenc);
+            start = now_usecs();
+            sbP = TwapiStreamBufferNew();
+            for (nout = 0, off = 0; off < nenc; off += piece) {
+                piece = nenc - off < sockreads[i] ? nenc - off : sockreads[i];
+                nout += new_receive(sbP, workP + off, piece, 4096, outP + nout);
+            }
+            TwapiStreamBufferFree(sbP);
+            usecs_new += now_usecs() - start;
+            CHECK(nout == n && memcmp(outP, dataP, n) == 0);
+
+            memcpy(workP, encP, nenc);
+            start = now_usecs();
+            memset(&old, 0, sizeof(old));
+            for (nout = 0, off = 0; off < nenc; off += piece) {
+                piece = nenc - off < sockreads[i] ? nenc - off : sockreads[i];
+                nout += old_receive(&old, workP + off, piece, 4096, outP + nout);
+            }
+            free(old.extraP);
+            free(old.inputP);
+            usecs_old += now_usecs() - start;
+            CHECK(nout == n && memcmp(outP, dataP, n) == 0);
+        }
+        printf("%10lu %14.0f %14.0f\n", (unsigned long) sockreads[i],
+               iterations * n / usecs_new, iterations * n / usecs_old);
+        free(workP);
+    }
+    free(encP);
+    free(outP);
+}
+
+int main(int argc, char *argv[])
+{
+    static const size_t lens[] = {
+        0, 1, 15, 16, 100, 16383, 16384, 16385, 32768, 32769, 100000, 1000000
+    };
+    CtxtHandle ctx = {0, 0};
+    unsigned char *dataP, *outP;
+    size_t i, nout, n;
+    long iterations = 200, iter;
+    double start, single, per_record;
+    SECURITY_STATUS ss;
+
+    for (i = 1; i + 1 < (size_t) argc; i += 2) {
+        if (strcmp(argv[i], "-iterations") == 0)
+            iterations = atol(argv[i+1]);
+    }
+
+    dataP = malloc(1000000);
+    for (i = 0; i < 1000000; ++i)
+        dataP[i] = (unsigned char) (i * 7 + (i >> 8));
+
+    /* schannel TLS 1.2 sizes, then a small limit to force many records */
+    gSizes.cbHeader = 5;
+    gSizes.cbTrailer = 36;
+    gSizes.cbMaximumMessage = 16384;
+    gSizes.cBuffers = 4;
+    gSizes.cbBlockSize = 16;
+    for (i = 0; i < sizeof(lens) / sizeof(lens[0]); ++i)
+        check_encrypt(dataP, lens[i]);
+
+    gSizes.cbMaximumMessage = 100;
+    gVariableTrailer = 1;
+    gShortHeader = 1;
+    for (i = 0; i < sizeof(lens) / sizeof(lens[0]); ++i)
+        check_encrypt(dataP, lens[i]);
+    for (n = 0; n < 1000; ++n)
+        check_encrypt(dataP + n, n);
+
+    /* Errors in the middle are returned along with the records so far */
+    outP = malloc(TWAPI_ENCRYPT_STREAM_MAX(&gSizes, 1000));
+    gRecords = 0;
+    gFailRecord = 3;
+    ss = TwapiEncryptStream(&gMockFns, &ctx, 0, &gSizes, dataP, 1000, outP, &nout);
+    CHECK(ss == SEC_E_INVALID_TOKEN && gRecords == 4);
+    CHECK(nout == 3 * (gSizes.cbHeader - gShortHeader + 100 + gSizes.cbTrailer - 100 % 16));
+    gFailRecord = -1;
+    free(outP);
+
+    gSizes.cbMaximumMessage = 0;
+    outP = malloc(1);
+    CHECK(TwapiEncryptStream(&gMockFns, &ctx, 0, &gSizes, dataP, 10, outP, &nout) != SEC_E_OK);
+    CHECK(nout == 0);
+    free(outP);
+    printf("Record splitting checks passed\n");
+
+    gSizes.cbMaximumMessage = 16384;
+    gVariableTrailer = 1;
+    gShortHeader = 0;
+    for (i = 0; i < sizeof(lens) / sizeof(lens[0]); ++i) {
+        check_decrypt(dataP, lens[i], 1);
+        check_decrypt(dataP, lens[i], 100);
+        check_decrypt(dataP, lens[i], 20000);
+        check_decrypt(dataP, lens[i], 100000);
+    }
+    gSizes.cbMaximumMessage = 100;
+    for (n = 0; n < 2000; ++n)
+        check_decrypt(dataP + n, n, 1 + n % 300);
+    check_decrypt_status(MOCK_CLOSE_NOTIFY, SEC_I_CONTEXT_EXPIRED);
+    check_decrypt_status(MOCK_HELLO_REQUEST, SEC_I_RENEGOTIATE);
+    printf("Stream buffer checks passed\n");
+
+    gSizes.cbMaximumMessage = 16384;
+    gVariableTrailer = 0;
+    gShortHeader = 0;
+    outP = malloc(TWAPI_ENCRYPT_STREAM_MAX(&gSizes, 1000000));
+    printf("%10s %14s %14s\n", "bytes", "single MB/s", "per-record MB/s");
+    for (i = 0; i < sizeof(lens) / sizeof(lens[0]); ++i) {
+        n = lens[i];
+        if (n < 1000)
+            continue;
+        start = now_usecs();
+        for (iter = 0; iter < iterations; ++iter)
+            TwapiEncryptStream(&gMockFns, &ctx, 0, &gSizes, dataP, n, outP, &nout);
+        single = now_usecs() - start;
+        start = now_usecs();
+        for (iter = 0; iter < iterations; ++iter)
+            encrypt_per_record(dataP, n, outP);
+        per_record = now_usecs() - start;
+        printf("%10lu %14.0f %14.0f\n", (unsigned long) n,
+               iterations * n / single, iterations * n / per_record);
+    }
+
+    time_decrypt(dataP, 1000000, iterations / 10 ? iterations / 10 : 1);
+
+    free(outP);
+    free(dataP);
+    return 0;
+}
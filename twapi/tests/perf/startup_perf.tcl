@@ -0,0 +1,223 @@
+#
+# Copyright (c) 2018, Ashok P. Nadkarni
+# All rights reserved.
+#
+# See the file LICENSE for license
+
+# Startup cost of evaluating all TWAPI module scripts versus loading only
+# the base script and deferring the rest to auto_index stubs as done by
+# lazy package loading. Unlike the other scripts in this directory, this
+# does not load twapi. The module scripts are read from the tcl directory
+# and grouped into modules as per the module makefiles. C commands are
+# stubbed so the harness runs on any platform with Tcl 8.6, e.g.
+#    tclsh startup_perf.tcl ?-iterations N?
+
+namespace eval perf::startup {
+    variable iterations 20
+    if {[set pos [lsearch -exact $::argv -iterations]] >= 0} {
+        set iterations [lindex $::argv [incr pos]]
+    }
+
+    variable srcdir [file normalize [file join [file dirname [info script]] .. ..]]
+
+    # Script text of each module keyed by module name (twapi_base etc.)
+    variable scripts [dict create]
+}
+
+# Reads the module scripts in the order given by the TCLFILES definitions
+# in the module makefiles
+proc perf::startup::read_scripts {} {
+    variable srcdir
+    variable scripts
+    foreach makefile [lsort [glob [file join $srcdir * makefile]]] {
+        set fd [open $makefile]
+        set content [read $fd]
+        close $fd
+        # Join continuation lines
+        regsub -all {\\\n} $content " " content
+        if {![regexp -line {^TCLFILES\s*=(.*)$} $content -> files]} {
+            continue
+        }
+        set mod twapi_[file tail [file dirname $makefile]]
+        set text ""
+        foreach file [regexp -all -inline {[\w]+\.tcl} $files] {
+            set fd [open [file join $srcdir tcl $file]]
+            append text [read $fd] \n
+            close $fd
+        }
+        # As when the files are combined into a resource
+        dict set scripts $mod "set ::twapi::${mod}_rc_sourced 1\n$text"
+    }
+}
+
+# Creates an interpreter where the module scripts can be evaluated without
+# the TWAPI C commands. Unknown commands return an empty string unless
+# they have auto_index entries. Script errors resulting from the stubs
+# are ignored as they only cut evaluation short.
+proc perf::startup::new_interp {} {
+    set ip [interp create]
+    $ip eval {
+        rename package _package
+        proc package {subcmd args} {
+            if {$subcmd eq "require" && [lindex $args 0] ne "Tcl" &&
+                [lindex $args 0] ne "TclOO"} {
+                return ""
+            }
+            tailcall _package $subcmd {*}$args
+        }
+        rename unknown _unknown
+        proc unknown {cmd args} {
+            if {[auto_load $cmd [uplevel 1 {::namespace current}]]} {
+                return [uplevel 1 [list $cmd {*}$args]]
+            }
+            return ""
+        }
+        namespace eval twapi {
+            set version(twapi_base) 4.3.0
+            # Only returns option defaults
+            proc parseargs {argsvar optdefs args} {
+                set result {}
+                foreach def $optdefs {
+                    if {[llength $def] < 2} {
+                        lappend def 0
+                    }
+                    lappend result [lindex [split [lindex $def 0] .] 0] \
+                        [lindex $def 1]
+                }
+                return $result
+            }
+            proc GetVersionEx {} {
+                return {dwOSVersionInfoSize 0 dwMajorVersion 10 dwMinorVersion 0
+                    dwBuildNumber 0 dwPlatformId 2 szCSDVersion ""
+                    wServicePackMajor 0 wServicePackMinor 0 wSuiteMask 0
+                    wProductType 1 wReserved 0}
+            }
+        }
+    }
+    return $ip
+}
+
+proc perf::startup::commands {ip} {
+    return [lsort [$ip eval {
+        set cmds {}
+        foreach ns {::twapi ::metoo} {
+            set nslist [list $ns]
+            while {[llength $nslist]} {
+                set nslist [lassign $nslist ns]
+                if {![namespace exists $ns]} continue
+                lappend cmds {*}[info commands ${ns}::*]
+                lappend nslist {*}[namespace children $ns]
+            }
+        }
+        set cmds
+    }]]
+}
+
+# Returns the commands defined by each module script as a dictionary
+# mapping module names to {NAMESPACE COMMANDS ...} lists in the form
+# used by the package index
+proc perf::startup::build_index {} {
+    variable scripts
+    set ip [new_interp]
+    catch {$ip eval [dict get $scripts twapi_base]}
+    set seen [commands $ip]
+    set index [dict create]
+    dict for {mod script} $scripts {
+        if {$mod eq "twapi_base"} continue
+        if {[catch {$ip eval $script} msg]} {
+            puts "Note: stubbed evaluation of $mod stopped early: $msg"
+        }
+        set cmds {}
+        foreach cmd [commands $ip] {
+            if {$cmd ni $seen} {
+                dict lappend cmds [namespace qualifiers $cmd] [namespace tail $cmd]
+                lappend seen $cmd
+            }
+        }
+        dict set index $mod $cmds
+    }
+    interp delete $ip
+    return $index
+}
+
+proc perf::startup::load_eager {} {
+    variable scripts
+    set ip [new_interp]
+    dict for {mod script} $scripts {
+        catch {$ip eval $script}
+    }
+    return $ip
+}
+
+proc perf::startup::load_lazy {index} {
+    variable scripts
+    set ip [new_interp]
+    catch {$ip eval [dict get $scripts twapi_base]}
+    dict for {mod cmds} $index {
+        set loader [list uplevel #0 [dict get $scripts $mod]]
+        foreach {ns names} $cmds {
+            foreach name $names {
+                $ip eval [list set ::auto_index(${ns}::$name) $loader]
+            }
+        }
+    }
+    return $ip
+}
+
+# Returns microseconds per iteration for creating an interpreter using the
+# load command and then running script in it
+proc perf::startup::measure {loadcmd {script {}}} {
+    variable iterations
+    set total 0
+    for {set i 0} {$i < $iterations} {incr i} {
+        set start [clock microseconds]
+        set ip [{*}$loadcmd]
+        $ip eval $script
+        incr total [expr {[clock microseconds] - $start}]
+        interp delete $ip
+    }
+    return [expr {double($total) / $iterations}]
+}
+
+proc perf::startup::report {label usecs {base_usecs {}}} {
+    if {$base_usecs eq ""} {
+        puts [format "%-40s %12.0f us" $label $usecs]
+    } else {
+        puts [format "%-40s %12.0f us %8.2fx" $label $usecs \
+                  [expr {$base_usecs / $usecs}]]
+    }
+}
+
+namespace eval perf::startup {
+    read_scripts
+    set index [build_index]
+    set empty [measure new_interp]
+
+    # Per module evaluation cost, most expensive first
+    set modtimes {}
+    dict for {mod script} $scripts {
+        set ip [new_interp]
+        if {$mod ne "twapi_base"} {
+            catch {$ip eval [dict get $scripts twapi_base]}
+        }
+        set usecs [lindex [time {catch {$ip eval $script}}] 0]
+        interp delete $ip
+        lappend modtimes [list $mod $usecs [string length $script]]
+    }
+    puts [format "%-40s %12s %10s" "module script" "eval" "size"]
+    foreach modtime [lsort -integer -decreasing -index 1 $modtimes] {
+        lassign $modtime mod usecs size
+        puts [format "%-40s %12d us %10d" $mod $usecs $size]
+    }
+
+    puts ""
+    puts [format "%-40s %15s %9s" "startup" "time" "speedup"]
+    report "interp creation only" $empty
+    set eager [measure load_eager]
+    report "eager (all module scripts)" $eager
+    report "lazy (base script + stubs)" [measure [list load_lazy $index]] $eager
+    # First use of a command pays for its module script only
+    set cmd [lindex [dict get $index twapi_process] 1 0]
+    report "lazy + first use of twapi_process" \
+        [measure [list load_lazy $index] [list auto_load ::twapi::$cmd]] $eager
+}
@@ -0,0 +1,548 @@
+/*
+ * Copyright (c) 2018, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ */
+
+/*
+ * Checks and measures the event schema cache used by the ETW consumer.
+ * TdhGetEventInformation is replaced by a stub that serves
+ * TRACE_EVENT_INFO blobs laid out as TDH returns them for the event
+ * definitions in the fixtures table below, and spins for -tdhcost
+ * microseconds per call to stand in for the manifest lookup. Decoding
+ * of the fixed size properties is compared between the cached offsets
+ * and a walk of the schema per event as TdhGetProperty does. Does not
+ * need Tcl or Windows. Build and run from this directory, e.g.
+ *
+ *   cc -O2 -DETW_STANDALONE -I../../etw -I../../include -o tdhcache_bench \
+ *       tdhcache_bench.c ../../etw/tdhcache.c
+ *   ./tdhcache_bench ?-events N? ?-tdhcost USECS?
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "tdhcache.h"
+
+#define CHECK(cond_)                                                    \
+    do {                                                                \
+        if (!(cond_)) {                                                 \
+            fprintf(stderr, "Check failed at line %d: %s\n", __LINE__, #cond_); \
+            abort();                                                    \
+        }                                                               \
+    } while (0)
+
+typedef struct {
+    const char *name;
+    USHORT intype;
+    USHORT outtype;
+    ULONG flags;
+    USHORT count;
+} FixtureProperty;
+
+/*
+ * Event definitions as reported by TDH for some common providers. The
+ * padding property in the last one makes its TRACE_EVENT_INFO larger
+ * than the initial 1000 byte guess.
+ */
+typedef struct {
+    GUID provider;
+    USHORT id;
+    UCHAR version;
+    UCHAR opcode;
+    DECODING_SOURCE source;
+    const char *provider_name;
+    const char *task_name;
+    int nprops;
+    FixtureProperty props[40];
+} Fixture;
+
+#define KERNEL_PROCESS {0x22fb2cd6, 0x0e7b, 0x422b, {0xa0, 0xc7, 0x2f, 0xad, 0x1f, 0xd0, 0xe7, 0x16}}
+#define KERNEL_FILE {0xedd08927, 0x9cc4, 0x4e65, {0xb9, 0x70, 0xc2, 0x56, 0x0f, 0xb5, 0xc2, 0x89}}
+#define KERNEL_NETWORK {0x7dd42a49, 0x5329, 0x4832, {0x8d, 0xfd, 0x43, 0xd9, 0x79, 0x15, 0x3a, 0x88}}
+#define MOF_PROCESS {0x3d6fa8d0, 0xfe05, 0x11d0, {0x9d, 0xda, 0x00, 0xc0, 0x4f, 0xd7, 0xba, 0x7c}}
+
+static const Fixture fixtures[] = {
+    {KERNEL_PROCESS, 1, 3, 1, DecodingSourceXMLFile,
+     "Microsoft-Windows-Kernel-Process", "ProcessStart", 10, {
+         {"ProcessID", TDH_INTYPE_UINT32, TDH_OUTTYPE_NULL, 0, 1},
+         {"CreateTime", TDH_INTYPE_FILETIME, TDH_OUTTYPE_NULL, 0, 1},
+         {"ParentProcessID", TDH_INTYPE_UINT32, TDH_OUTTYPE_NULL, 0, 1},
+         {"SessionID", TDH_INTYPE_UINT32, TDH_OUTTYPE_NULL, 0, 1},
+         {"Flags", TDH_INTYPE_UINT32, TDH_OUTTYPE_NULL, 0, 1},
+         {"ImageName", TDH_INTYPE_UNICODESTRING, TDH_OUTTYPE_NULL, 0, 1},
+         {"ImageChecksum", TDH_INTYPE_UINT32, TDH_OUTTYPE_NULL, 0, 1},
+         {"TimeDateStamp", TDH_INTYPE_UINT32, TDH_OUTTYPE_NULL, 0, 1},
+         {"PackageFullName", TDH_INTYPE_UNICODESTRING, TDH_OUTTYPE_NULL, 0, 1},
+         {"PackageRelativeAppId", TDH_INTYPE_UNICODESTRING, TDH_OUTTYPE_NULL, 0, 1}}},
+    {KERNEL_PROCESS, 3, 1, 1, DecodingSourceXMLFile,
+     "Microsoft-Windows-Kernel-Process", "ThreadStart", 9, {
+         {"ProcessID", TDH_INTYPE_UINT32, TDH_OUTTYPE_NULL, 0, 1},
+         {"ThreadID", TDH_INTYPE_UINT32, TDH_OUTTYPE_NULL, 0, 1},
+         {"StackBase", TDH_INTYPE_POINTER, TDH_OUTTYPE_NULL, 0, 1},
+         {"StackLimit", TDH_INTYPE_POINTER, TDH_OUTTYPE_NULL, 0, 1},
+         {"UserStackBase", TDH_INTYPE_POINTER, TDH_OUTTYPE_NULL, 0, 1},
+         {"UserStackLimit", TDH_INTYPE_POINTER, TDH_OUTTYPE_NULL, 0, 1},
+         {"StartAddr", TDH_INTYPE_POINTER, TDH_OUTTYPE_NULL, 0, 1},
+         {"Win32StartAddr", TDH_INTYPE_POINTER, TDH_OUTTYPE_NULL, 0, 1},
+         {"TebBase", TDH_INTYPE_POINTER, TDH_OUTTYPE_NULL, 0, 1}}},
+    {KERNEL_FILE, 12, 1, 0, DecodingSourceXMLFile,
+     "Microsoft-Windows-Kernel-File", "Create", 7, {
+         {"Irp", TDH_INTYPE_POINTER, TDH_OUTTYPE_NULL, 0, 1},
+         {"FileObject", TDH_INTYPE_POINTER, TDH_OUTTYPE_NULL, 0, 1},
+         {"IssuingThreadId", TDH_INTYPE_UINT32, TDH_OUTTYPE_NULL, 0, 1},
+         {"CreateOptions", TDH_INTYPE_UINT32, TDH_OUTTYPE_HEXINT32, 0, 1},
+         {"CreateAttributes", TDH_INTYPE_UINT32, TDH_OUTTYPE_HEXINT32, 0, 1},
+         {"ShareAccess", TDH_INTYPE_UINT32, TDH_OUTTYPE_HEXINT32, 0, 1},
+         {"FileName", TDH_INTYPE_UNICODESTRING, TDH_OUTTYPE_NULL, 0, 1}}},
+    {KERNEL_NETWORK, 10, 0, 11, DecodingSourceXMLFile,
+     "Microsoft-Windows-Kernel-Network", "KERNEL_NETWORK_TASK_TCPIP", 8, {
+         {"PID", TDH_INTYPE_UINT32, TDH_OUTTYPE_NULL, 0, 1},
+         {"size", TDH_INTYPE_UINT32, TDH_OUTTYPE_NULL, 0, 1},
+         {"daddr", TDH_INTYPE_UINT32, TDH_OUTTYPE_IPV4, 0, 1},
+         {"saddr", TDH_INTYPE_UINT32, TDH_OUTTYPE_IPV4, 0, 1},
+         {"dport", TDH_INTYPE_UINT16, TDH_OUTTYPE_PORT, 0, 1},
+         {"sport", TDH_INTYPE_UINT16, TDH_OUTTYPE_PORT, 0, 1},
+         {"startime", TDH_INTYPE_UINT32, TDH_OUTTYPE_NULL, 0, 1},
+         {"endtime", TDH_INTYPE_UINT32, TDH_OUTTYPE_NULL, 0, 1}}},
+    /* Classic kernel Process_TypeGroup1 Start. Id is 0, opcode is the type */
+    {MOF_PROCESS, 0, 3, 1, DecodingSourceWbem,
+     "MSNT_SystemTrace", "Process", 5, {
+         {"UniqueProcessKey", TDH_INTYPE_POINTER, TDH_OUTTYPE_NULL, 0, 1},
+         {"ProcessId", TDH_INTYPE_UINT32, TDH_OUTTYPE_NULL, 0, 1},
+         {"ParentId", TDH_INTYPE_UINT32, TDH_OUTTYPE_NULL, 0, 1},
+         {"SessionId", TDH_INTYPE_UINT32, TDH_OUTTYPE_NULL, 0, 1},
+         {"ExitStatus", TDH_INTYPE_INT32, TDH_OUTTYPE_NULL, 0, 1}}},
+    {MOF_PROCESS, 0, 3, 2, DecodingSourceWbem,
+     "MSNT_SystemTrace", "Process", 5, {
+         {"UniqueProcessKey", TDH_INTYPE_POINTER, TDH_OUTTYPE_NULL, 0, 1},
+         {"ProcessId", TDH_INTYPE_UINT32, TDH_OUTTYPE_NULL, 0, 1},
+         {"ParentId", TDH_INTYPE_UINT32, TDH_OUTTYPE_NULL, 0, 1},
+         {"SessionId", TDH_INTYPE_UINT32, TDH_OUTTYPE_NULL, 0, 1},
+         {"ExitStatus", TDH_INTYPE_INT32, TDH_OUTTYPE_NULL, 0, 1}}},
+    {KERNEL_FILE, 14, 0, 0, DecodingSourceXMLFile,
+     "Microsoft-Windows-Kernel-File", "Close", 40, {
+         {"Irp", TDH_INTYPE_POINTER, TDH_OUTTYPE_NULL, 0, 1},
+         {"FileObject", TDH_INTYPE_POINTER, TDH_OUTTYPE_NULL, 0, 1},
+         {"FileKey", TDH_INTYPE_POINTER, TDH_OUTTYPE_NULL, 0, 1},
+         {"IssuingThreadId", TDH_INTYPE_UINT32, TDH_OUTTYPE_NULL, 0, 1},
+         {"Data", TDH_INTYPE_UINT8, TDH_OUTTYPE_NULL, PropertyParamCount, 3},
+         {"PaddingPropertyWithAVeryLongNameToGrowTheSchema01", TDH_INTYPE_UINT32, 0, 0, 1},
+         {"PaddingPropertyWithAVeryLongNameToGrowTheSchema02", TDH_INTYPE_UINT32, 0, 0, 1},
+         {"PaddingPropertyWithAVeryLongNameToGrowTheSchema03", TDH_INTYPE_UINT32, 0, 0, 1},
+         {"PaddingPropertyWithAVeryLongNameToGrowTheSchema04", TDH_INTYPE_UINT32, 0, 0, 1},
+         {"PaddingPropertyWithAVeryLongNameToGrowTheSchema05", TDH_INTYPE_UINT32, 0, 0, 1},
+         {"PaddingPropertyWithAVeryLongNameToGrowTheSchema06", TDH_INTYPE_UINT32, 0, 0, 1},
+         {"PaddingPropertyWithAVeryLongNameToGrowTheSchema07", TDH_INTYPE_UINT32, 0, 0, 1},
+         {"PaddingPropertyWithAVeryLongNameToGrowTheSchema08", TDH_INTYPE_UINT32, 0, 0, 1},
+         {"PaddingPropertyWithAVeryLongNameToGrowTheSchema09", TDH_INTYPE_UINT32, 0, 0, 1},
+         {"PaddingPropertyWithAVeryLongNameToGrowTheSchema10", TDH_INTYPE_UINT32, 0, 0, 1},
+         {"PaddingPropertyWithAVeryLongNameToGrowTheSchema11", TDH_INTYPE_UINT32, 0, 0, 1},
+         {"PaddingPropertyWithAVeryLongNameToGrowTheSchema12", TDH_INTYPE_UINT32, 0, 0, 1},
+         {"PaddingPropertyWithAVeryLongNameToGrowTheSchema13", TDH_INTYPE_UINT32, 0, 0, 1},
+         {"PaddingPropertyWithAVeryLongNameToGrowTheSchema14", TDH_INTYPE_UINT32, 0, 0, 1},
+         {"PaddingPropertyWithAVeryLongNameToGrowTheSchema15", TDH_INTYPE_UINT32, 0, 0, 1},
+         {"PaddingPropertyWithAVeryLongNameToGrowTheSchema16", TDH_INTYPE_UINT32, 0, 0, 1},
+         {"PaddingPropertyWithAVeryLongNameToGrowTheSchema17", TDH_INTYPE_UINT32, 0, 0, 1},
+         {"PaddingPropertyWithAVeryLongNameToGrowTheSchema18", TDH_INTYPE_UINT32, 0, 0, 1},
+         {"PaddingPropertyWithAVeryLongNameToGrowTheSchema19", TDH_INTYPE_UINT32, 0, 0, 1},
+         {"PaddingPropertyWithAVeryLongNameToGrowTheSchema20", TDH_INTYPE_UINT32, 0, 0, 1},
+         {"PaddingPropertyWithAVeryLongNameToGrowTheSchema21", TDH_INTYPE_UINT32, 0, 0, 1},
+         {"PaddingPropertyWithAVeryLongNameToGrowTheSchema22", TDH_INTYPE_UINT32, 0, 0, 1},
+         {"PaddingPropertyWithAVeryLongNameToGrowTheSchema23", TDH_INTYPE_UINT32, 0, 0, 1},
+         {"PaddingPropertyWithAVeryLongNameToGrowTheSchema24", TDH_INTYPE_UINT32, 0, 0, 1},
+         {"PaddingPropertyWithAVeryLongNameToGrowTheSchema25", TDH_INTYPE_UINT32, 0, 0, 1},
+         {"PaddingPropertyWithAVeryLongNameToGrowTheSchema26", TDH_INTYPE_UINT32, 0, 0, 1},
+         {"PaddingPropertyWithAVeryLongNameToGrowTheSchema27", TDH_INTYPE_UINT32, 0, 0, 1},
+         {"PaddingPropertyWithAVeryLongNameToGrowTheSchema28", TDH_INTYPE_UINT32, 0, 0, 1},
+         {"PaddingPropertyWithAVeryLongNameToGrowTheSchema29", TDH_INTYPE_UINT32, 0, 0, 1},
+         {"PaddingPropertyWithAVeryLongNameToGrowTheSchema30", TDH_INTYPE_UINT32, 0, 0, 1},
+         {"PaddingPropertyWithAVeryLongNameToGrowTheSchema31", TDH_INTYPE_UINT32, 0, 0, 1},
+         {"PaddingPropertyWithAVeryLongNameToGrowTheSchema32", TDH_INTYPE_UINT32, 0, 0, 1},
+         {"PaddingPropertyWithAVeryLongNameToGrowTheSchema33", TDH_INTYPE_UINT32, 0, 0, 1},
+         {"PaddingPropertyWithAVeryLongNameToGrowTheSchema34", TDH_INTYPE_UINT32, 0, 0, 1},
+         {"PaddingPropertyWithAVeryLongNameToGrowTheSchema35", TDH_INTYPE_UINT32, 0, 0, 1}}},
+};
+#define NFIXTURES (sizeof(fixtures) / sizeof(fixtures[0]))
+
+static TRACE_EVENT_INFO *teis[NFIXTURES];
+static ULONG tei_sizes[NFIXTURES];
+static long ntdhcalls;
+static long tdhcost;
+static long nfreed;
+
+static double now_usecs(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* Appends s as a nul terminated WCHAR string, returning its offset */
+static ULONG append_wstr(unsigned char *buf, ULONG *usedP, const char *s)
+{
+    ULONG offset = *usedP;
+    WCHAR *p = (WCHAR *) (buf + offset);
+
+    do {
+        *p++ = (unsigned char) *s;
+    } while (*s++);
+    *usedP = (ULONG) ((unsigned char *) p - buf);
+    return offset;
+}
+
+/* Lays out a fixture the way TDH does: header, property array, strings */
+static TRACE_EVENT_INFO *build_tei(const Fixture *fixP, ULONG *sizeP)
+{
+    unsigned char *buf;
+    TRACE_EVENT_INFO *teiP;
+    ULONG used;
+    int i;
+
+    buf = calloc(1, 8192);
+    teiP = (TRACE_EVENT_INFO *) buf;
+    teiP->ProviderGuid = fixP->provider;
+    if (fixP->source == DecodingSourceWbem)
+        teiP->EventGuid = fixP->provider;
+    teiP->EventDescriptor.Id = fixP->id;
+    teiP->EventDescriptor.Version = fixP->version;
+    teiP->EventDescriptor.Opcode = fixP->opcode;
+    teiP->DecodingSource = fixP->source;
+    teiP->PropertyCount = fixP->nprops;
+    teiP->TopLevelPropertyCount = fixP->nprops;
+    used = offsetof(TRACE_EVENT_INFO, EventPropertyInfoArray) +
+        fixP->nprops * sizeof(EVENT_PROPERTY_INFO);
+    teiP->ProviderNameOffset = append_wstr(buf, &used, fixP->provider_name);
+    teiP->TaskNameOffset = append_wstr(buf, &used, fixP->task_name);
+    for (i = 0; i < fixP->nprops; ++i) {
+        EVENT_PROPERTY_INFO *epiP = &teiP->EventPropertyInfoArray[i];
+        epiP->Flags = fixP->props[i].flags;
+        epiP->NameOffset = append_wstr(buf, &used, fixP->props[i].name);
+        epiP->nonStructType.InType = fixP->props[i].intype;
+        epiP->nonStructType.OutType = fixP->props[i].outtype;
+        epiP->count = fixP->props[i].count;
+    }
+    *sizeP = (used + 7) & ~7;
+    return teiP;
+}
+
+static ULONG __stdcall stub_TdhGetEventInformation(EVENT_RECORD *evrP, ULONG nctx, TDH_CONTEXT *ctxP, TRACE_EVENT_INFO *teiP, ULONG *sizeP)
+{
+    double start = now_usecs();
+    size_t i;
+
+    ++ntdhcalls;
+    CHECK(nctx == 1 && ctxP->ParameterType == TDH_CONTEXT_POINTERSIZE);
+    while (now_usecs() - start < tdhcost)
+        ;
+    for (i = 0; i < NFIXTURES; ++i) {
+        if (memcmp(&fixtures[i].provider, &evrP->EventHeader.ProviderId, sizeof(GUID)) == 0 &&
+            fixtures[i].id == evrP->EventHeader.EventDescriptor.Id &&
+            fixtures[i].version == evrP->EventHeader.EventDescriptor.Version &&
+            fixtures[i].opcode == evrP->EventHeader.EventDescriptor.Opcode) {
+            if (*sizeP < tei_sizes[i]) {
+                *sizeP = tei_sizes[i];
+                return ERROR_INSUFFICIENT_BUFFER;
+            }
+            memcpy(teiP, teis[i], tei_sizes[i]);
+            *sizeP = tei_sizes[i];
+            return ERROR_SUCCESS;
+        }
+    }
+    return ERROR_NOT_FOUND;
+}
+
+static void free_client(void *clientP)
+{
+    ++nfreed;
+    free(clientP);
+}
+
+static void init_event(EVENT_RECORD *evrP, const Fixture *fixP,
+                       unsigned char *data, USHORT ndata)
+{
+    memset(evrP, 0, sizeof(*evrP));
+    evrP->EventHeader.ProviderId = fixP->provider;
+    evrP->EventHeader.EventDescriptor.Id = fixP->id;
+    evrP->EventHeader.EventDescriptor.Version = fixP->version;
+    evrP->EventHeader.EventDescriptor.Opcode = fixP->opcode;
+    evrP->UserData = data;
+    evrP->UserDataLength = ndata;
+}
+
+/*
+ * Offset of a property found by walking the schema from the start as
+ * TdhGetProperty does. Returns the size or 0 if not fixed size.
+ */
+static ULONG walk_offset(const TRACE_EVENT_INFO *teiP, ULONG index,
+                         ULONG pointer_size, ULONG *offsetP)
+{
+    ULONG i, offset = 0, size = 0;
+
+    for (i = 0; i <= index; ++i) {
+        const EVENT_PROPERTY_INFO *epiP = &teiP->EventPropertyInfoArray[i];
+        if (epiP->Flags || epiP->count != 1)
+            return 0;
+        switch (epiP->nonStructType.InType) {
+        case TDH_INTYPE_UINT16: size = 2; break;
+        case TDH_INTYPE_INT32: case TDH_INTYPE_UINT32: size = 4; break;
+        case TDH_INTYPE_FILETIME: size = 8; break;
+        case TDH_INTYPE_POINTER: size = pointer_size; break;
+        default: return 0;
+        }
+        if (i < index)
+            offset += size;
+    }
+    *offsetP = offset;
+    return size;
+}
+
+static unsigned long long read_value(const unsigned char *p, ULONG size)
+{
+    unsigned long long v = 0;
+    memcpy(&v, p, size);        /* Little endian like Windows */
+    return v;
+}
+
+static void check_cache(void)
+{
+    TwapiTdhCache *cacheP;
+    TwapiTdhCacheStats stats;
+    TwapiTdhSchema *schemaP;
+    EVENT_RECORD evr;
+    EVENT_HEADER_EXTENDED_DATA_ITEM ext;
+    Fixture unknown;
+    unsigned char data[256];
+    ULONG i, j, offset, size, ptrsize;
+
+    for (i = 0; i < sizeof(data); ++i)
+        data[i] = (unsigned char) (i * 7 + 1);
+
+    /* Everything fits: one TDH lookup per schema however often asked */
+    cacheP = TwapiTdhCacheNew(64, stub_TdhGetEventInformation, free_client);
+    ntdhcalls = nfreed = 0;
+    for (i = 0; i < 10 * NFIXTURES; ++i) {
+        const Fixture *fixP = &fixtures[i % NFIXTURES];
+        init_event(&evr, fixP, data, sizeof(data));
+        schemaP = TwapiTdhCacheGet(cacheP, &evr, 8);
+        CHECK(schemaP && schemaP->status == ERROR_SUCCESS);
+        CHECK(schemaP->tei_size >= tei_sizes[i % NFIXTURES]);
+        CHECK(memcmp(schemaP->teiP, teis[i % NFIXTURES], tei_sizes[i % NFIXTURES]) == 0);
+        if (schemaP->clientP == NULL)
+            schemaP->clientP = malloc(1);
+    }
+    TwapiTdhCacheGetStats(cacheP, &stats);
+    CHECK(stats.hits == 9 * NFIXTURES && stats.misses == NFIXTURES);
+    CHECK(stats.evictions == 0 && stats.nentries == NFIXTURES);
+    /* Only the large schema needed a second call, and only once since
+       the next lookup starts with the larger size */
+    CHECK(stats.tdh_calls == NFIXTURES + 1 && ntdhcalls == NFIXTURES + 1);
+
+    /* Layouts stop at the first property that is not fixed size */
+    init_event(&evr, &fixtures[0], data, sizeof(data));
+    schemaP = TwapiTdhCacheGet(cacheP, &evr, 8);
+    CHECK(schemaP->nfixed == 5 && schemaP->fixed_size == 24);
+    CHECK(schemaP->offsetsP[1] == 4 && schemaP->sizesP[1] == 8);
+    CHECK(schemaP->offsetsP[4] == 20 && schemaP->sizesP[4] == 4);
+    init_event(&evr, &fixtures[NFIXTURES - 1], data, sizeof(data));
+    schemaP = TwapiTdhCacheGet(cacheP, &evr, 8);
+    CHECK(schemaP->nfixed == 4 && schemaP->fixed_size == 28);
+
+    /* Offsets agree with walking the schema, for both pointer sizes,
+       which are cached separately */
+    for (ptrsize = 4; ptrsize <= 8; ptrsize += 4) {
+        for (i = 0; i < NFIXTURES; ++i) {
+            init_event(&evr, &fixtures[i], data, sizeof(data));
+            schemaP = TwapiTdhCacheGet(cacheP, &evr, ptrsize);
+            for (j = 0; j < schemaP->teiP->TopLevelPropertyCount; ++j) {
+                size = walk_offset(schemaP->teiP, j, ptrsize, &offset);
+                if (j < schemaP->nfixed) {
+                    CHECK(size == schemaP->sizesP[j]);
+                    CHECK(offset == schemaP->offsetsP[j]);
+                    CHECK(read_value(data + offset, size) ==
+                          read_value(data + schemaP->offsetsP[j], schemaP->sizesP[j]));
+                } else if (j == schemaP->nfixed) {
+                    CHECK(size == 0);
+                }
+            }
+        }
+    }
+    TwapiTdhCacheGetStats(cacheP, &stats);
+    CHECK(stats.nentries == 2 * NFIXTURES);
+
+    /* Failures are cached too */
+    unknown = fixtures[0];
+    unknown.id = 999;
+    init_event(&evr, &unknown, data, sizeof(data));
+    ntdhcalls = 0;
+    schemaP = TwapiTdhCacheGet(cacheP, &evr, 8);
+    CHECK(schemaP && schemaP->status == ERROR_NOT_FOUND && schemaP->teiP == NULL);
+    schemaP = TwapiTdhCacheGet(cacheP, &evr, 8);
+    CHECK(schemaP && schemaP->status == ERROR_NOT_FOUND);
+    CHECK(ntdhcalls == 1);
+
+    /* Events differing only in level, as MOF events of a class may, are
+       cached separately since the info built from the schema names it */
+    init_event(&evr, &fixtures[0], data, sizeof(data));
+    ntdhcalls = 0;
+    for (i = 0; i < 4; ++i) {
+        evr.EventHeader.EventDescriptor.Level = (UCHAR) (4 + (i & 1));
+        schemaP = TwapiTdhCacheGet(cacheP, &evr, 8);
+        CHECK(schemaP && schemaP->status == ERROR_SUCCESS);
+    }
+    CHECK(ntdhcalls == 2);
+
+    /* TraceLogging events are not cached */
+    init_event(&evr, &fixtures[0], data, sizeof(data));
+    memset(&ext, 0, sizeof(ext));
+    ext.ExtType = EVENT_HEADER_EXT_TYPE_EVENT_SCHEMA_TL;
+    evr.ExtendedDataCount = 1;
+    evr.ExtendedData = &ext;
+    CHECK(TwapiTdhCacheGet(cacheP, &evr, 8) == NULL);
+    TwapiTdhCacheGetStats(cacheP, &stats);
+    CHECK(stats.uncached == 1);
+
+    TwapiTdhCacheClear(cacheP);
+    CHECK(nfreed == NFIXTURES);
+    TwapiTdhCacheGetStats(cacheP, &stats);
+    CHECK(stats.nentries == 0 && stats.nbytes == 0);
+    TwapiTdhCacheFree(cacheP);
+
+    /* Least recently used is evicted */
+    cacheP = TwapiTdhCacheNew(2, stub_TdhGetEventInformation, free_client);
+    nfreed = 0;
+    for (i = 0; i < 3; ++i) {
+        init_event(&evr, &fixtures[i], data, sizeof(data));
+        schemaP = TwapiTdhCacheGet(cacheP, &evr, 8);
+        schemaP->clientP = malloc(1);
+        if (i == 1) {
+            /* Touch the first so the second is evicted by the third */
+            init_event(&evr, &fixtures[0], data, sizeof(data));
+            TwapiTdhCacheGet(cacheP, &evr, 8);
+        }
+    }
+    TwapiTdhCacheGetStats(cacheP, &stats);
+    CHECK(stats.evictions == 1 && stats.nentries == 2 && nfreed == 1);
+    ntdhcalls = 0;
+    init_event(&evr, &fixtures[0], data, sizeof(data));
+    TwapiTdhCacheGet(cacheP, &evr, 8);
+    CHECK(ntdhcalls == 0);
+    init_event(&evr, &fixtures[1], data, sizeof(data));
+    TwapiTdhCacheGet(cacheP, &evr, 8);
+    CHECK(ntdhcalls == 1);
+    TwapiTdhCacheFree(cacheP);
+    CHECK(nfreed == 3);
+
+    /* Disabled */
+    cacheP = TwapiTdhCacheNew(0, stub_TdhGetEventInformation, free_client);
+    init_event(&evr, &fixtures[0], data, sizeof(data));
+    CHECK(TwapiTdhCacheGet(cacheP, &evr, 8) == NULL);
+    TwapiTdhCacheFree(cacheP);
+}
+
+/*
+ * Mirrors the ETW event callback for the fixed size properties. Without
+ * a cache, TDH is called for each event with the same 1000 byte first
+ * guess and each property located by walking the schema.
+ */
+static unsigned long long decode_events(TwapiTdhCache *cacheP, long nevents)
+{
+    EVENT_RECORD evr;
+    TwapiTdhSchema *schemaP;
+    TRACE_EVENT_INFO *teiP;
+    TDH_CONTEXT tdhctx;
+    unsigned char data[256];
+    unsigned long long sum = 0;
+    ULONG i, sz, offset, size;
+    long n;
+
+    memset(data, 0x5a, sizeof(data));
+    memset(&tdhctx, 0, sizeof(tdhctx));
+    tdhctx.ParameterType = TDH_CONTEXT_POINTERSIZE;
+    tdhctx.ParameterValue = 8;
+    for (n = 0; n < nevents; ++n) {
+        init_event(&evr, &fixtures[n % NFIXTURES], data, sizeof(data));
+        if (cacheP) {
+            schemaP = TwapiTdhCacheGet(cacheP, &evr, 8);
+            for (i = 0; i < schemaP->nfixed; ++i)
+                sum += read_value(data + schemaP->offsetsP[i], schemaP->sizesP[i]);
+        } else {
+            sz = 1000;
+            teiP = malloc(sz);
+            if (stub_TdhGetEventInformation(&evr, 1, &tdhctx, teiP, &sz) == ERROR_INSUFFICIENT_BUFFER) {
+                free(teiP);
+                teiP = malloc(sz);
+                stub_TdhGetEventInformation(&evr, 1, &tdhctx, teiP, &sz);
+            }
+            for (i = 0; i < teiP->TopLevelPropertyCount; ++i) {
+                size = walk_offset(teiP, i, 8, &offset);
+                if (size == 0)
+                    break;
+                sum += read_value(data + offset, size);
+            }
+            free(teiP);
+        }
+    }
+    return sum;
+}
+
+int main(int argc, char *argv[])
+{
+    long nevents = 1000000;
+    TwapiTdhCache *cacheP;
+    TwapiTdhCacheStats stats;
+    unsigned long long sum1, sum2;
+    double start, uncached_usecs, cached_usecs;
+    long calls;
+    size_t i;
+    int argi;
+
+    for (argi = 1; argi + 1 < argc; argi += 2) {
+        if (strcmp(argv[argi], "-events") == 0)
+            nevents = atol(argv[argi+1]);
+        else if (strcmp(argv[argi], "-tdhcost") == 0)
+            tdhcost = atol(argv[argi+1]);
+        else {
+            fprintf(stderr, "Usage: %s ?-events N? ?-tdhcost USECS?\n", argv[0]);
+            return 1;
+        }
+    }
+
+    for (i = 0; i < NFIXTURES; ++i)
+        teis[i] = build_tei(&fixtures[i], &tei_sizes[i]);
+    CHECK(tei_sizes[NFIXTURES - 1] > 1000);
+
+    check_cache();
+    printf("Checks passed\n");
+
+    ntdhcalls = 0;
+    start = now_usecs();
+    sum1 = decode_events(NULL, nevents);
+    uncached_usecs = now_usecs() - start;
+    calls = ntdhcalls;
+
+    cacheP = TwapiTdhCacheNew(256, stub_TdhGetEventInformation, NULL);
+    start = now_usecs();
+    sum2 = decode_events(cacheP, nevents);
+    cached_usecs = now_usecs() - start;
+    TwapiTdhCacheGetStats(cacheP, &stats);
+    CHECK(sum1 == sum2);
+
+    printf("%ld events, %d schemas, tdhcost %ld usecs\n",
+           nevents, (int) NFIXTURES, tdhcost);
+    printf("%-10s %14s %12s\n", "mode", "events/sec", "tdh calls");
+    printf("%-10s %14.0f %12ld\n", "uncached", nevents * 1e6 / uncached_usecs, calls);
+    printf("%-10s %14.0f %12llu\n", "cached", nevents * 1e6 / cached_usecs,
+           (unsigned long long) stats.tdh_calls);
+    printf("hits %llu misses %llu entries %zu bytes %zu\n",
+           (unsigned long long) stats.hits, (unsigned long long) stats.misses,
+           stats.nentries, stats.nbytes);
+    TwapiTdhCacheFree(cacheP);
+
+    for (i = 0; i < NFIXTURES; ++i)
+        free(teis[i]);
+    return 0;
+}
@@ -0,0 +1,452 @@
+/*
+ * Copyright (c) 2018, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file LICENSE for license
+ */
+
+/*
+ * Checks and measures the native TLS channel driver using the mock
+ * provider from sspimock.h over a socketpair, with a forked writer.
+ * Checks that data is received intact with blocking and event driven
+ * reads, that data already in the stream buffer when the driver is
+ * stacked is returned first, that a non-blocking writer loses nothing
+ * when the socket is full, and that a close_notify is seen as end of
+ * file before the socket is closed. Then times bulk transfers over the
+ * raw socket, through a reflected channel mirroring the script path in
+ * tls.tcl and through the native driver. Needs Tcl but not Windows, so
+ * POSIX only. Build and run from this directory, e.g.
+ *
+ *   cc -O2 -DCRYPTO_STANDALONE -I../../crypto -I/usr/include/tcl \
+ *       -o tlschan_bench tlschan_bench.c ../../crypto/tlschan.c \
+ *       ../../crypto/sspistream.c -ltcl
+ *   ./tlschan_bench ?-megabytes N? ?-chunk N?
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "tlschan.h"
+#include "sspimock.h"
+
+enum { RAW, REFCHAN, NATIVE };
+static const char *modenames[] = {"raw", "refchan", "native"};
+
+static double now_usecs(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static unsigned char pattern(size_t i)
+{
+    return (unsigned char) (i * 7 + (i >> 8));
+}
+
+/*
+ * Stand-ins for the sspi.c commands used by the reflected channel. One
+ * connection per process so a single buffer suffices.
+ */
+static TwapiStreamBuffer *gRefchanBuffer;
+
+static int EncryptStreamCmd(ClientData cd, Tcl_Interp *interp, int objc,
+                            Tcl_Obj *const objv[])
+{
+    CtxtHandle ctx = {0, 0};
+    Tcl_Obj *encObj;
+    unsigned char *dataP;
+    int n;
+    size_t nout;
+
+    dataP = Tcl_GetByteArrayFromObj(objv[1], &n);
+    encObj = Tcl_NewByteArrayObj(NULL, (int) TWAPI_ENCRYPT_STREAM_MAX(&gSizes, (size_t) n));
+    CHECK(TwapiEncryptStream(&gMockFns, &ctx, 0, &gSizes, dataP, n,
+                             Tcl_GetByteArrayFromObj(encObj, NULL), &nout) == SEC_E_OK);
+    Tcl_SetByteArrayLength(encObj, (int) nout);
+    Tcl_SetObjResult(interp, encObj);
+    return TCL_OK;
+}
+
+static int DecryptStreamCmd(ClientData cd, Tcl_Interp *interp, int objc,
+                            Tcl_Obj *const objv[])
+{
+    CtxtHandle ctx = {0, 0};
+    unsigned char *p;
+    int n;
+
+    p = Tcl_GetByteArrayFromObj(objv[2], &n);
+    CHECK(TwapiStreamBufferAppend(gRefchanBuffer, p, n));
+    switch (TwapiStreamBufferDecrypt(&gMockFns, &ctx, gRefchanBuffer)) {
+    case SEC_E_OK: Tcl_SetResult(interp, "ok", TCL_STATIC); break;
+    case SEC_I_CONTEXT_EXPIRED: Tcl_SetResult(interp, "expired", TCL_STATIC); break;
+    default: Tcl_SetResult(interp, "error", TCL_STATIC); return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+static int StreamBufferReadCmd(ClientData cd, Tcl_Interp *interp, int objc,
+                               Tcl_Obj *const objv[])
+{
+    size_t n = TwapiStreamBufferPlaintextSize(gRefchanBuffer);
+    int nbytes;
+
+    CHECK(Tcl_GetIntFromObj(interp, objv[2], &nbytes) == TCL_OK);
+    if ((size_t) nbytes < n)
+        n = nbytes;
+    Tcl_SetObjResult(interp, Tcl_NewByteArrayObj(TwapiStreamBufferPlaintext(gRefchanBuffer), (int) n));
+    TwapiStreamBufferConsume(gRefchanBuffer, n);
+    return TCL_OK;
+}
+
+static int StreamBufferSizeCmd(ClientData cd, Tcl_Interp *interp, int objc,
+                               Tcl_Obj *const objv[])
+{
+    Tcl_SetObjResult(interp, Tcl_NewWideIntObj(TwapiStreamBufferPlaintextSize(gRefchanBuffer)));
+    return TCL_OK;
+}
+
+/* The blocking OPEN state paths of tls::read and tls::write */
+static const char *refchan_script =
+    "namespace eval tls {\n"
+    "    namespace export *\n"
+    "    namespace ensemble create\n"
+    "    variable _channels\n"
+    "    proc initialize {chan mode} {return {initialize finalize watch read write blocking}}\n"
+    "    proc finalize {chan} {\n"
+    "        variable _channels\n"
+    "        close [dict get $_channels($chan) Socket]\n"
+    "        unset _channels($chan)\n"
+    "    }\n"
+    "    proc watch {chan events} {}\n"
+    "    proc blocking {chan mode} {\n"
+    "        variable _channels\n"
+    "        dict set _channels($chan) Blocking $mode\n"
+    "    }\n"
+    "    proc read {chan nbytes} {\n"
+    "        variable _channels\n"
+    "        dict with _channels($chan) {\n"
+    "            set status ok\n"
+    "            if {[StreamBufferSize $Buffer] < $nbytes && $State eq \"OPEN\"} {\n"
+    "                while {[StreamBufferSize $Buffer] == 0 && $status eq \"ok\"} {\n"
+    "                    set data [_blocking_read $Socket]\n"
+    "                    if {[string length $data]} {\n"
+    "                        set status [DecryptStream $Buffer $data]\n"
+    "                    } else {\n"
+    "                        set status eof\n"
+    "                    }\n"
+    "                }\n"
+    "            }\n"
+    "            return [StreamBufferRead $Buffer $nbytes]\n"
+    "        }\n"
+    "    }\n"
+    "    proc write {chan data} {\n"
+    "        variable _channels\n"
+    "        dict with _channels($chan) {\n"
+    "            chan puts -nonewline $Socket [EncryptStream $data]\n"
+    "            flush $Socket\n"
+    "        }\n"
+    "        return [string length $data]\n"
+    "    }\n"
+    "    proc _blocking_read {so} {\n"
+    "        set input [chan read $so 1]\n"
+    "        if {[string length $input]} {\n"
+    "            set more [chan pending input $so]\n"
+    "            if {$more > 0} {\n"
+    "                append input [chan read $so $more]\n"
+    "            }\n"
+    "        }\n"
+    "        return $input\n"
+    "    }\n"
+    "    proc open {so} {\n"
+    "        variable _channels\n"
+    "        chan configure $so -translation binary\n"
+    "        set chan [chan create {read write} [namespace current]]\n"
+    "        set _channels($chan) [dict create Socket $so Buffer sb State OPEN Blocking 1]\n"
+    "        return $chan\n"
+    "    }\n"
+    "}\n";
+
+/*
+ * Returns a channel of the given mode on fd. For the native driver,
+ * inP is passed as the initial stream buffer.
+ */
+static Tcl_Channel open_channel(Tcl_Interp *interp, int fd, int mode,
+                                int server, TwapiStreamBuffer *inP)
+{
+    static const SEC_WCHAR target[] = {'m', 'o', 'c', 'k', 0};
+    TwapiTlsChannelConfig config;
+    Tcl_Channel chan;
+
+    chan = Tcl_MakeFileChannel((ClientData) (intptr_t) fd,
+                               TCL_READABLE | TCL_WRITABLE);
+    CHECK(chan);
+    Tcl_RegisterChannel(interp, chan);
+
+    if (mode == REFCHAN) {
+        gRefchanBuffer = TwapiStreamBufferNew();
+        CHECK(Tcl_Eval(interp, refchan_script) == TCL_OK);
+        Tcl_CreateObjCommand(interp, "tls::EncryptStream", EncryptStreamCmd, NULL, NULL);
+        Tcl_CreateObjCommand(interp, "tls::DecryptStream", DecryptStreamCmd, NULL, NULL);
+        Tcl_CreateObjCommand(interp, "tls::StreamBufferRead", StreamBufferReadCmd, NULL, NULL);
+        Tcl_CreateObjCommand(interp, "tls::StreamBufferSize", StreamBufferSizeCmd, NULL, NULL);
+        CHECK(Tcl_VarEval(interp, "tls::open ", Tcl_GetChannelName(chan), NULL) == TCL_OK);
+        chan = Tcl_GetChannel(interp, Tcl_GetStringResult(interp), NULL);
+        CHECK(chan);
+    } else if (mode == NATIVE) {
+        memset(&config, 0, sizeof(config));
+        config.fnsP = &gMockFns;
+        config.free_credentials = 1;
+        config.server = server;
+        config.targetP = server ? NULL : target;
+        config.sizes = gSizes;
+        config.inP = inP;
+        chan = TwapiTlsChannelStack(interp, chan, &config);
+        CHECK(chan);
+    }
+    CHECK(Tcl_SetChannelOption(interp, chan, "-translation", "binary") == TCL_OK);
+    return chan;
+}
+
+static void close_channel(Tcl_Interp *interp, Tcl_Channel chan, int mode)
+{
+    CHECK(Tcl_UnregisterChannel(interp, chan) == TCL_OK);
+    if (mode == REFCHAN)
+        TwapiStreamBufferFree(gRefchanBuffer);
+}
+
+/*
+ * Writes total bytes of the pattern starting at offset in chunks of
+ * the given size, from a child process. With nonblocking, the socket
+ * send buffer is shrunk so writes regularly find it full. If ackfd is
+ * not -1, waits for a byte on it before exiting so the reader can check
+ * end of file was signalled by close_notify and not the socket closing.
+ */
+static pid_t start_writer(int fd, int mode, size_t offset, size_t total,
+                          size_t chunk, int nonblocking, int ackfd)
+{
+    Tcl_Interp *interp;
+    Tcl_Channel chan;
+    unsigned char *bufP;
+    size_t i, n;
+    pid_t pid;
+    char ack;
+    int sndbuf = 4096;
+
+    pid = fork();
+    CHECK(pid >= 0);
+    if (pid)
+        return pid;
+
+    gDeletedContexts = gFreedCredentials = 0;
+    interp = Tcl_CreateInterp();
+    if (nonblocking)
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    chan = open_channel(interp, fd, mode, 1, NULL);
+    if (nonblocking)
+        CHECK(Tcl_SetChannelOption(interp, chan, "-blocking", "0") == TCL_OK);
+    bufP = malloc(chunk);
+    while (total) {
+        n = total < chunk ? total : chunk;
+        for (i = 0; i < n; ++i)
+            bufP[i] = pattern(offset + i);
+        CHECK(Tcl_Write(chan, (char *) bufP, (int) n) == (int) n);
+        CHECK(Tcl_Flush(chan) == TCL_OK);
+        if (nonblocking)
+            while (Tcl_DoOneEvent(TCL_ALL_EVENTS | TCL_DONT_WAIT))
+                ;
+        offset += n;
+        total -= n;
+    }
+    if (nonblocking)
+        CHECK(Tcl_SetChannelOption(interp, chan, "-blocking", "1") == TCL_OK);
+    close_channel(interp, chan, mode);
+    if (mode == NATIVE)
+        CHECK(gDeletedContexts == 1 && gFreedCredentials == 1);
+    free(bufP);
+    if (ackfd != -1) {
+        CHECK(read(ackfd, &ack, 1) == 1);
+        close(ackfd);
+    }
+    _exit(0);
+}
+
+static void wait_writer(pid_t pid)
+{
+    int status;
+    CHECK(waitpid(pid, &status, 0) == pid);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+typedef struct {
+    Tcl_Channel chan;
+    unsigned char *bufP;
+    size_t readsize;
+    size_t nread;
+    int done;
+} EventReader;
+
+static void reader_handler(ClientData cd, int mask)
+{
+    EventReader *rP = cd;
+    size_t i;
+    int n;
+
+    /* Read less than available so the driver's buffering is exercised */
+    n = Tcl_Read(rP->chan, (char *) rP->bufP, (int) rP->readsize);
+    if (n < 0) {
+        CHECK(Tcl_InputBlocked(rP->chan));
+        return;
+    }
+    for (i = 0; i < (size_t) n; ++i)
+        CHECK(rP->bufP[i] == pattern(rP->nread + i));
+    rP->nread += n;
+    if (n == 0 && Tcl_Eof(rP->chan))
+        rP->done = 1;
+}
+
+/*
+ * Transfers total bytes from a child and checks them. prefix bytes are
+ * placed in the stream buffer, partly as decrypted data and partly as
+ * ciphertext, before stacking the driver.
+ */
+static void check_transfer(int mode, size_t total, size_t chunk,
+                           int evented, int nonblocking, size_t prefix)
+{
+    Tcl_Interp *interp = Tcl_CreateInterp();
+    Tcl_Channel chan;
+    TwapiStreamBuffer *inP = NULL;
+    EventReader reader;
+    CtxtHandle ctx = {0, 0};
+    unsigned char *encP, *plainP;
+    size_t i, nenc;
+    int fds[2], ackfds[2];
+    pid_t pid;
+    char ack = 'k';
+
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    CHECK(pipe(ackfds) == 0);
+    pid = start_writer(fds[1], mode, prefix, total - prefix, chunk,
+                       nonblocking, mode == NATIVE ? ackfds[0] : -1);
+    close(fds[1]);
+    close(ackfds[0]);
+
+    if (prefix) {
+        plainP = malloc(prefix);
+        for (i = 0; i < prefix; ++i)
+            plainP[i] = pattern(i);
+        encP = malloc(TWAPI_ENCRYPT_STREAM_MAX(&gSizes, prefix));
+        CHECK(TwapiEncryptStream(&gMockFns, &ctx, 0, &gSizes, plainP, prefix,
+                                 encP, &nenc) == SEC_E_OK);
+        inP = TwapiStreamBufferNew();
+        CHECK(TwapiStreamBufferAppend(inP, encP, nenc - 3));
+        CHECK(TwapiStreamBufferDecrypt(&gMockFns, &ctx, inP) == SEC_E_OK);
+        CHECK(TwapiStreamBufferAppend(inP, encP + nenc - 3, 3));
+        free(plainP);
+        free(encP);
+    }
+
+    gDeletedContexts = gFreedCredentials = 0;
+    chan = open_channel(interp, fds[0], mode, 0, inP);
+    reader.chan = chan;
+    reader.readsize = evented ? 700 : 65536;
+    reader.bufP = malloc(reader.readsize);
+    reader.nread = 0;
+    reader.done = 0;
+    if (evented) {
+        CHECK(Tcl_SetChannelOption(interp, chan, "-blocking", "0") == TCL_OK);
+        Tcl_CreateChannelHandler(chan, TCL_READABLE, reader_handler, &reader);
+        while (!reader.done)
+            Tcl_DoOneEvent(TCL_ALL_EVENTS);
+        Tcl_DeleteChannelHandler(chan, reader_handler, &reader);
+    } else {
+        while (!reader.done)
+            reader_handler(&reader, TCL_READABLE);
+    }
+    CHECK(reader.nread == total);
+
+    /* Writer is still holding the socket open, so EOF was close_notify */
+    if (mode == NATIVE)
+        CHECK(write(ackfds[1], &ack, 1) == 1);
+    close(ackfds[1]);
+    wait_writer(pid);
+
+    close_channel(interp, chan, mode);
+    if (mode == NATIVE)
+        CHECK(gDeletedContexts == 1 && gFreedCredentials == 1);
+    free(reader.bufP);
+    Tcl_DeleteInterp(interp);
+}
+
+static double time_transfer(int mode, size_t total, size_t chunk)
+{
+    Tcl_Interp *interp = Tcl_CreateInterp();
+    Tcl_Channel chan;
+    char *bufP = malloc(65536);
+    size_t nread = 0;
+    double start, usecs;
+    int fds[2], n;
+    pid_t pid;
+
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    start = now_usecs();
+    pid = start_writer(fds[1], mode, 0, total, chunk, 0, -1);
+    close(fds[1]);
+    chan = open_channel(interp, fds[0], mode, 0, NULL);
+    while ((n = Tcl_Read(chan, bufP, 65536)) > 0)
+        nread += n;
+    usecs = now_usecs() - start;
+    CHECK(nread == total);
+    wait_writer(pid);
+    close_channel(interp, chan, mode);
+    free(bufP);
+    Tcl_DeleteInterp(interp);
+    return usecs;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t megabytes = 64, chunk = 16384;
+    double usecs[3];
+    int i, mode;
+
+    for (i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "-megabytes") == 0)
+            megabytes = atol(argv[i+1]);
+        else if (strcmp(argv[i], "-chunk") == 0)
+            chunk = atol(argv[i+1]);
+    }
+
+    Tcl_FindExecutable(argv[0]);
+    gSizes.cbHeader = 5;
+    gSizes.cbTrailer = 16;
+    gSizes.cbMaximumMessage = 16384;
+    gSizes.cBuffers = 4;
+    gSizes.cbBlockSize = 16;
+    gShortHeader = 1;
+    gVariableTrailer = 1;
+
+    /* The reflected channel only mirrors the blocking paths */
+    for (mode = RAW; mode <= NATIVE; ++mode) {
+        check_transfer(mode, 3000000, 10000, 0, 0, 0);
+        if (mode != REFCHAN)
+            check_transfer(mode, 3000000, 777, 1, 0, 0);
+    }
+    check_transfer(NATIVE, 3000000, 10000, 0, 0, 40000);
+    check_transfer(NATIVE, 3000000, 10000, 1, 0, 40000);
+    check_transfer(NATIVE, 3000000, 100000, 1, 1, 0);
+
+    gShortHeader = gVariableTrailer = 0;
+    printf("%-10s %10s\n", "channel", "MB/s");
+    for (mode = RAW; mode <= NATIVE; ++mode) {
+        usecs[mode] = time_transfer(mode, megabytes << 20, chunk);
+        printf("%-10s %10.0f\n", modenames[mode], megabytes / (usecs[mode] / 1e6));
+    }
+    return 0;
+}
@@ -0,0 +1,156 @@
+#
+# Copyright (c) 2018, Ashok P. Nadkarni
+# All rights reserved.
+#
+# See the file LICENSE for license
+
+# Records/sec and framing overhead for small messages written to a TLS
+# channel with and without write coalescing.
+#
+# Unlike the other perf scripts this does not need twapi or Windows. It
+# loads tls.tcl into a plain tclsh and replaces the SSPI commands with a
+# mock provider that frames each record of at most 16K plaintext with a
+# 5 byte header and 16 byte trailer, as Schannel does for AES-GCM. The
+# "socket" is a temporary file which is read back to check the records
+# decode to exactly the data written.
+#
+#   tclsh tlscoalesce_perf.tcl ?NMESSAGES? ?MESSAGESIZE?
+
+namespace eval twapi {
+    proc debuglog args {}
+    proc StreamBufferCreate {} { return mockbuf }
+    proc StreamBufferFree {buf} {}
+    proc sspi_shutdown_context {ctx} { return [list ok ""] }
+    proc sspi_delete_context {ctx} {}
+    proc sspi_free_credentials {creds} {}
+    proc sspi_encrypt_stream {ctx data} {
+        set out ""
+        set len [string length $data]
+        for {set i 0} {$i < $len} {incr i 16384} {
+            set chunk [string range $data $i [expr {$i + 16383}]]
+            append out [binary format cSS 23 0x0303 [string length $chunk]] \
+                $chunk $::perf::tlscoalesce::trailer
+            incr ::perf::tlscoalesce::records
+        }
+        return $out
+    }
+}
+
+source [file join [file dirname [info script]] .. .. tcl tls.tcl]
+
+namespace eval perf::tlscoalesce {
+    variable trailer [string repeat \0 16]
+    variable records 0
+    variable nmsgs [lindex [concat $argv 20000] 0]
+    variable msgsize [lindex [concat $argv 20000 64] 1]
+    variable path [file join [expr {[info exists ::env(TMPDIR)] ? $::env(TMPDIR) : "/tmp"}] tlscoalesce[pid].bin]
+
+    # Returns an OPEN TLS channel whose socket writes to $path
+    proc open_chan {coalescesize coalescedelay args} {
+        variable path
+        set so [open $path wb]
+        set chan [chan create {read write} twapi::tls]
+        twapi::tls::_init $chan CLIENT $so mockcreds "" 0 {}
+        dict set twapi::tls::_channels($chan) State OPEN
+        dict set twapi::tls::_channels($chan) SspiContext mockctx
+        chan configure $chan -translation binary {*}$args \
+            -coalescesize $coalescesize -coalescedelay $coalescedelay
+        return $chan
+    }
+
+    # Returns the plaintext carried by the records in $path
+    proc decode {} {
+        variable path
+        set fd [open $path rb]
+        set bin [read $fd]
+        close $fd
+        set plain ""
+        set pos 0
+        while {$pos < [string length $bin]} {
+            binary scan $bin @${pos}cuSuSu type version len
+            append plain [string range $bin $pos+5 [expr {$pos + 4 + $len}]]
+            incr pos [expr {5 + $len + 16}]
+        }
+        return $plain
+    }
+
+    proc check {cond msg} {
+        if {![uplevel 1 [list expr $cond]]} {
+            puts stderr "FAILED: $msg"
+            exit 1
+        }
+    }
+
+    proc run {label coalescesize coalescedelay args} {
+        variable records
+        variable nmsgs
+        variable msgsize
+        variable path
+
+        # Newline terminated so -buffering line sends each message
+        set msg [string repeat x [expr {$msgsize - 1}]]\n
+        set records 0
+        set chan [open_chan $coalescesize $coalescedelay {*}$args]
+        set start [clock microseconds]
+        for {set i 0} {$i < $nmsgs} {incr i} {
+            puts -nonewline $chan $msg
+        }
+        close $chan
+        set elapsed [expr {max(1, [clock microseconds] - $start)}]
+
+        set payload [expr {$nmsgs * $msgsize}]
+        set plain [decode]
+        check {$plain eq [string repeat $msg $nmsgs]} "$label: decoded data mismatch"
+        set wire [file size $path]
+        set overhead [expr {$wire - $payload}]
+        puts [format "%-32s %12.0f %12.0f %9d %10d %8.2f%%" $label \
+                  [expr {$nmsgs * 1e6 / $elapsed}] \
+                  [expr {$records * 1e6 / $elapsed}] \
+                  $records $overhead [expr {100.0 * $overhead / $payload}]]
+    }
+
+    # Coalesced data must go out after the delay even if no more writes
+    # follow, and an explicit flush under -buffering full must go out
+    # right away without waiting for the delay.
+    proc check_latency {} {
+        variable path
+
+        set chan [open_chan 16384 5 -buffering none]
+        puts -nonewline $chan abc
+        check {[file size $path] == 0} "coalesced write sent before delay"
+        after 50 [list set [namespace current]::done 1]
+        vwait [namespace current]::done
+        check {[file size $path] == 3 + 21} "coalesced write not sent after delay"
+        close $chan
+        check {[decode] eq "abc"} "coalesced data mismatch after delay"
+
+        set chan [open_chan 16384 60000 -buffering full]
+        puts -nonewline $chan abc
+        flush $chan
+        check {[file size $path] == 3 + 21} "explicit flush not sent"
+        close $chan
+        check {[decode] eq "abc"} "flushed data mismatch"
+
+        # Coalescing can be turned on and off on an open channel
+        set chan [open_chan 0 0 -buffering none]
+        chan configure $chan -coalescesize 100 -coalescedelay 60000
+        check {[chan configure $chan -coalescesize] == 100} "-coalescesize not set"
+        puts -nonewline $chan abc
+        check {[file size $path] == 0} "write not held back after configure"
+        close $chan
+        check {[decode] eq "abc"} "held back data not sent on close"
+    }
+
+    check_latency
+
+    puts "$nmsgs messages of $msgsize bytes"
+    puts [format "%-32s %12s %12s %9s %10s %9s" \
+              "mode" "msgs/sec" "records/sec" "records" "overhead" "overhead"]
+    run "none, no coalescing" 0 0 -buffering none
+    run "line, no coalescing" 0 0 -buffering line
+    run "none, coalesce 4K" 4096 10 -buffering none
+    run "none, coalesce 16K" 16384 10 -buffering none
+    run "line, coalesce 16K" 16384 10 -buffering line
+    run "full, 16K Tcl buffer" 0 0 -buffering full -buffersize 16384
+    file delete $path
+}